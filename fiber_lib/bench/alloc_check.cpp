@@ -0,0 +1,162 @@
+// 阻塞读的堆分配检查：hook 的 read 在数据没到时挂起协程、由其他线程的写唤醒，这一路径不应有任何堆分配
+//
+//   alloc_check [--reads 5000]
+//
+// 替换全局 operator new，统计测量期间（所有线程）的分配次数。每个IO引擎（epoll、io_uring POLL_ADD、
+// io_uring 完成模式、epoll ET）各测不带超时和带 SO_RCVTIMEO 两种：读协程先预热（填满任务池、协程缓存、fd表），
+// 然后外部线程每次在读协程挂起之后写一个字节。任何一项的分配次数不为0时打印出来并以1退出。
+// 内核不支持 io_uring 时对应的引擎退回 epoll，照样检查
+//
+// 由 run.sh 编译到 build/alloc_check 并在编译后运行
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "fd_manager.h"
+#include "fiber.h"
+#include "hook.h"
+#include "ioscheduler.h"
+
+namespace {
+
+std::atomic<bool> g_counting{false};
+std::atomic<uint64_t> g_allocs{0};
+
+}
+
+// 替换函数都不内联：否则 GCC 在 -O2 下把内联进来的 free 与内建的 new 配对，报 -Wmismatched-new-delete
+__attribute__((noinline)) void* operator new(size_t size) {
+    if(g_counting.load(std::memory_order_relaxed)) {
+        g_allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    if(void* p = malloc(size ? size: 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+namespace {
+
+const int WARMUP = 200;
+
+// 返回测量期间的分配次数
+uint64_t run(sylar::IOManager::IoEngine engine, bool timeout, int reads) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) != 0) {
+        perror("socketpair");
+        exit(2);
+    }
+    sylar::FdMgr::GetInstance()->addSocket(sv[0], true);
+    std::atomic<int> done{0};
+    std::atomic<int> errors{0};
+    uint64_t allocs = 0;
+    {
+        sylar::IOManager iom(2, false, "alloc_check", sylar::Scheduler::Placement(),
+                             sylar::IOManager::REACTOR_SHARED, engine);
+        iom.scheduleLock([&]() {
+            sylar::set_hook_enable(true);
+            if(timeout) {
+                timeval tv{5, 0};
+                setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            }
+            char c;
+            for(int i = 0; i < WARMUP + reads; ++i) {
+                if(i == WARMUP) {
+                    g_allocs.store(0, std::memory_order_relaxed);
+                    g_counting.store(true, std::memory_order_release);
+                }
+                if(read(sv[0], &c, 1) != 1) {
+                    errors.fetch_add(1, std::memory_order_relaxed);
+                }
+                done.fetch_add(1, std::memory_order_release);
+            }
+            g_counting.store(false, std::memory_order_release);
+        });
+        // 等读协程读完上一个字节并再次挂起后再写
+        for(int i = 0; i < WARMUP + reads; ++i) {
+            while(done.load(std::memory_order_acquire) < i) {
+                sched_yield();
+            }
+            ::usleep(30);
+            if(::write(sv[1], "x", 1) != 1) {
+                perror("write");
+                exit(2);
+            }
+        }
+        while(done.load(std::memory_order_acquire) < WARMUP + reads) {
+            sched_yield();
+        }
+        allocs = g_allocs.load(std::memory_order_relaxed);
+        iom.stop();
+    }
+    sylar::FdMgr::GetInstance()->del(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    if(errors.load()) {
+        std::cerr << "read failed " << errors.load() << " times" << std::endl;
+        exit(2);
+    }
+    return allocs;
+}
+
+}
+
+int main(int argc, char** argv) {
+    int reads = 5000;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(std::string(argv[i]) == "--reads") {
+            reads = atoi(argv[i + 1]);
+        }
+    }
+    struct Engine {
+        sylar::IOManager::IoEngine engine;
+        const char* name;
+    } engines[] = {
+        {sylar::IOManager::ENGINE_EPOLL, "epoll"},
+        {sylar::IOManager::ENGINE_URING_POLL, "uring_poll"},
+        {sylar::IOManager::ENGINE_URING, "uring"},
+        {sylar::IOManager::ENGINE_EPOLL_ET, "epoll_et"},
+    };
+    bool failed = false;
+    for(const Engine& e: engines) {
+        for(bool timeout: {false, true}) {
+            uint64_t allocs = run(e.engine, timeout, reads);
+            std::cout << "engine=" << e.name << " timeout=" << timeout << " reads=" << reads
+                      << " allocs=" << allocs << (allocs ? "  FAIL": "") << std::endl;
+            failed = failed || allocs;
+        }
+    }
+    if(failed) {
+        std::cerr << "alloc_check: blocking hooked reads allocated on the heap" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef __SYLAR_BENCH_HTTP_H__
+#define __SYLAR_BENCH_HTTP_H__
+
+// 压测用的三个服务器（fiber_lib、原生 epoll、libevent）共用的请求处理和命令行参数，
+// 保证被比较的只有运行时本身：同样的解析、同样的响应、同样的长连接规则。
+//
+// 请求只有头部（压测客户端只发 GET），可以一次收到多个（流水线）。
+// HTTP/1.1 默认长连接，带 "Connection: close" 时回复后关闭；HTTP/1.0 相反
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+namespace bench {
+
+static const char kBody[] = "Hello, World!";
+
+// 处理 data 开头所有完整的请求，响应追加到 out，返回处理掉的字节数。
+// 有请求要求关闭时 close 置为true，之后的数据不再处理
+inline size_t handle_requests(const char* data, size_t len, std::string& out, bool& close) {
+    size_t pos = 0;
+    while(!close && pos < len) {
+        const char* begin = data + pos;
+        const char* end = (const char*)memmem(begin, len - pos, "\r\n\r\n", 4);
+        if(!end) {
+            break;
+        }
+        size_t req_len = end + 4 - begin;
+        // 请求行里的版本
+        const char* eol = (const char*)memchr(begin, '\r', req_len);
+        bool http10 = eol - begin >= 8 && memcmp(eol - 8, "HTTP/1.0", 8) == 0;
+        bool keep_alive = !http10;
+        // 只认 Connection 头部，不区分大小写
+        for(const char* p = eol + 2; p < end; ) {
+            const char* next = (const char*)memchr(p, '\r', end + 2 - p);
+            size_t n = next - p;
+            if(n > 11 && strncasecmp(p, "Connection:", 11) == 0) {
+                const char* v = p + 11;
+                while(*v == ' ') {
+                    ++v;
+                }
+                size_t vn = next - v;
+                if(vn == 5 && strncasecmp(v, "close", 5) == 0) {
+                    keep_alive = false;
+                } else if(vn == 10 && strncasecmp(v, "keep-alive", 10) == 0) {
+                    keep_alive = true;
+                }
+            }
+            p = next + 2;
+        }
+        out.append("HTTP/1.1 200 OK\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Content-Length: 13\r\n");
+        out.append(keep_alive ? "Connection: keep-alive\r\n\r\n": "Connection: close\r\n\r\n");
+        out.append(kBody, sizeof(kBody) - 1);
+        close = !keep_alive;
+        pos += req_len;
+    }
+    return pos;
+}
+
+// 服务器的命令行参数：--port P --threads N，其余参数由各服务器自己解释
+struct ServerArgs {
+    int port = 8080;
+    int threads = 4;
+
+    // 不认识的参数原样留给调用方，返回false表示参数错误
+    bool parse(int argc, char* argv[]) {
+        for(int i = 1; i < argc; ++i) {
+            if(strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+                port = atoi(argv[++i]);
+            } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                threads = atoi(argv[++i]);
+            }
+        }
+        return port > 0 && port < 65536 && threads > 0;
+    }
+};
+
+}
+
+#endif
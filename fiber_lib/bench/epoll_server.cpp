@@ -0,0 +1,188 @@
+// 压测用的原生 epoll 服务器：每个线程一个 epoll 和一个 SO_REUSEPORT 监听socket，水平触发，
+// 连接只在接受它的线程上处理。处理逻辑见 bench_http.h
+//
+//   epoll_server --port 8080 --threads 4
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "bench_http.h"
+
+#define MAX_EVENTS 256
+
+namespace {
+
+struct Conn {
+    std::string in;
+    std::string out;
+    bool close = false;
+    // 是否关注了可写事件
+    bool want_out = false;
+};
+
+int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1024) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void close_conn(int epfd, std::unordered_map<int, Conn>& conns, int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    conns.erase(fd);
+}
+
+// 尽量写出 c.out，写不完时关注可写事件。返回false表示连接应当关闭
+bool flush(int epfd, int fd, Conn& c) {
+    while(!c.out.empty()) {
+        ssize_t n = write(fd, c.out.data(), c.out.size());
+        if(n > 0) {
+            c.out.erase(0, n);
+            continue;
+        }
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN) {
+            if(!c.want_out) {
+                epoll_event ev{};
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.fd = fd;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+                c.want_out = true;
+            }
+            return true;
+        }
+        return false;
+    }
+    if(c.want_out && !c.close) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        c.want_out = false;
+    }
+    return !c.close;
+}
+
+void loop(int listen_fd) {
+    int epfd = epoll_create1(0);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    std::unordered_map<int, Conn> conns;
+    epoll_event events[MAX_EVENTS];
+    char buf[4096];
+    while(true) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for(int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if(fd == listen_fd) {
+                while(true) {
+                    int cfd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+                    if(cfd < 0) {
+                        break;
+                    }
+                    int one = 1;
+                    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    epoll_event cev{};
+                    cev.events = EPOLLIN;
+                    cev.data.fd = cfd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &cev);
+                    conns[cfd];
+                }
+                continue;
+            }
+            auto it = conns.find(fd);
+            if(it == conns.end()) {
+                continue;
+            }
+            Conn& c = it->second;
+            if(events[i].events & EPOLLOUT) {
+                if(!flush(epfd, fd, c)) {
+                    close_conn(epfd, conns, fd);
+                    continue;
+                }
+            }
+            if(!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) || !c.out.empty()) {
+                continue;
+            }
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if(r <= 0) {
+                if(r < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                close_conn(epfd, conns, fd);
+                continue;
+            }
+            c.in.append(buf, r);
+            size_t used = bench::handle_requests(c.in.data(), c.in.size(), c.out, c.close);
+            c.in.erase(0, used);
+            if(!c.out.empty() && !flush(epfd, fd, c)) {
+                close_conn(epfd, conns, fd);
+            }
+        }
+    }
+    close(epfd);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    bench::ServerArgs args;
+    if(!args.parse(argc, argv)) {
+        std::cerr << "usage: " << argv[0] << " --port P --threads N" << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < args.threads; ++i) {
+        int fd = listen_on(args.port);
+        if(fd < 0) {
+            perror("listen");
+            return 1;
+        }
+        threads.emplace_back(loop, fd);
+    }
+    std::cout << "epoll_server listening on port " << args.port << " with " << args.threads << " threads" << std::endl;
+    for(auto& t: threads) {
+        t.join();
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+// 压测用的 fiber_lib 服务器：TcpServer + 每连接一个协程，处理逻辑见 bench_http.h
+//
+//   fiber_server --port 8080 --threads 4 [--accept shared|exclusive|reuseport]
+//
+// --threads 包括主线程（IOManager 使用调用者线程）
+
+#include <iostream>
+#include <string.h>
+#include <string>
+
+#include "bench_http.h"
+#include "ioscheduler.h"
+#include "tcp_server.h"
+
+static void serve(const sylar::TcpConnection::ptr& conn) {
+    std::string in;
+    std::string out;
+    char buf[4096];
+    bool close = false;
+    while(!close) {
+        ssize_t n = conn->read(buf, sizeof(buf));
+        if(n <= 0) {
+            break;
+        }
+        in.append(buf, n);
+        size_t used = bench::handle_requests(in.data(), in.size(), out, close);
+        in.erase(0, used);
+        if(!out.empty()) {
+            if(conn->write(out) < 0) {
+                break;
+            }
+            out.clear();
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bench::ServerArgs args;
+    if(!args.parse(argc, argv)) {
+        std::cerr << "usage: " << argv[0] << " --port P --threads N [--accept shared|exclusive|reuseport]" << std::endl;
+        return 1;
+    }
+    sylar::TcpServer::Options options;
+    for(int i = 1; i + 1 < argc; ++i) {
+        if(strcmp(argv[i], "--accept") == 0) {
+            const char* mode = argv[i + 1];
+            if(strcmp(mode, "exclusive") == 0) {
+                options.accept_mode = sylar::IOManager::ACCEPT_EXCLUSIVE;
+            } else if(strcmp(mode, "reuseport") == 0) {
+                options.accept_mode = sylar::IOManager::ACCEPT_REUSEPORT;
+            }
+        }
+    }
+
+    sylar::IOManager iom(args.threads, true, "bench");
+    sylar::TcpServer server(&iom, options);
+    server.setHandler(serve);
+    if(!server.addListener("0.0.0.0", args.port) || !server.start()) {
+        perror("listen");
+        return 1;
+    }
+    std::cout << "fiber_server listening on port " << args.port << " with " << args.threads << " threads" << std::endl;
+    // 主线程加入调度，接入器一直注册着，不会返回；由压测脚本结束进程
+    iom.stop();
+    return 0;
+}
@@ -0,0 +1,113 @@
+// 压测用的 libevent 服务器：每个线程一个 event_base 和一个 SO_REUSEPORT 监听器，
+// 连接用 bufferevent 处理。处理逻辑见 bench_http.h
+//
+//   libevent_server --port 8080 --threads 4
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_http.h"
+
+namespace {
+
+struct Conn {
+    std::string out;
+    bool close = false;
+};
+
+void free_conn(bufferevent* bev, Conn* c) {
+    bufferevent_free(bev);
+    delete c;
+}
+
+// 要求关闭的连接等响应发完再释放
+void write_cb(bufferevent* bev, void* arg) {
+    Conn* c = (Conn*)arg;
+    if(c->close) {
+        free_conn(bev, c);
+    }
+}
+
+void read_cb(bufferevent* bev, void* arg) {
+    Conn* c = (Conn*)arg;
+    if(c->close) {
+        return;
+    }
+    evbuffer* input = bufferevent_get_input(bev);
+    size_t len = evbuffer_get_length(input);
+    const char* data = (const char*)evbuffer_pullup(input, len);
+    size_t used = bench::handle_requests(data, len, c->out, c->close);
+    evbuffer_drain(input, used);
+    if(!c->out.empty()) {
+        bufferevent_write(bev, c->out.data(), c->out.size());
+        c->out.clear();
+    }
+}
+
+void event_cb(bufferevent* bev, short events, void* arg) {
+    if(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        free_conn(bev, (Conn*)arg);
+    }
+}
+
+void accept_cb(evconnlistener* listener, evutil_socket_t fd, sockaddr*, int, void*) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    event_base* base = evconnlistener_get_base(listener);
+    bufferevent* bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    Conn* c = new Conn;
+    bufferevent_setcb(bev, read_cb, write_cb, event_cb, c);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+void loop(event_base* base) {
+    event_base_dispatch(base);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    bench::ServerArgs args;
+    if(!args.parse(argc, argv)) {
+        std::cerr << "usage: " << argv[0] << " --port P --threads N" << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_in sin{};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(args.port);
+
+    std::vector<event_base*> bases;
+    std::vector<std::thread> threads;
+    for(int i = 0; i < args.threads; ++i) {
+        event_base* base = event_base_new();
+        evconnlistener* listener = evconnlistener_new_bind(base, accept_cb, nullptr,
+            LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE, 1024, (sockaddr*)&sin, sizeof(sin));
+        if(!listener) {
+            perror("listen");
+            return 1;
+        }
+        bases.push_back(base);
+    }
+    for(event_base* base: bases) {
+        threads.emplace_back(loop, base);
+    }
+    std::cout << "libevent_server listening on port " << args.port << " with " << args.threads << " threads" << std::endl;
+    for(auto& t: threads) {
+        t.join();
+    }
+    return 0;
+}
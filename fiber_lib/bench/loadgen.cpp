@@ -0,0 +1,380 @@
+// HTTP 压测客户端：固定并发数，长连接（keepalive）或每个请求一个连接（close）
+//
+//   loadgen --port 8080 --connections 256 --threads 2 --duration 10 --warmup 2 \
+//           --mode keepalive --pid <server pid> --label fiber
+//
+// 每个连接同一时刻只有一个请求在路上，收到完整响应后立即发下一个（close 模式下先关闭连接再重新连接，
+// 延迟从 connect 开始计算）。预热期间的请求不计入结果。
+// 指定 --pid 时测量期间采样服务器进程的CPU时间（/proc/<pid>/stat）和 RSS（/proc/<pid>/status）。
+// 结果是一行 JSON，输出到标准输出，或者追加到 --out 指定的文件
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Args {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int connections = 64;
+    int threads = 1;
+    double duration = 10;
+    double warmup = 2;
+    bool keep_alive = true;
+    int pid = 0;
+    // 只用于记录在结果里
+    int server_threads = 0;
+    std::string label;
+    std::string out;
+};
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct Conn {
+    int fd = -1;
+    bool connecting = false;
+    uint64_t start_ns = 0;
+    std::string in;
+};
+
+struct Worker {
+    int connections = 0;
+    std::vector<uint64_t> latency_ns;
+    uint64_t errors = 0;
+    uint64_t connects = 0;
+};
+
+class Client {
+public:
+    Client(const Args& args, uint64_t measure_begin, uint64_t measure_end)
+        :m_args(args), m_begin(measure_begin), m_end(measure_end) {
+        memset(&m_addr, 0, sizeof(m_addr));
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(args.port);
+        inet_pton(AF_INET, args.host.c_str(), &m_addr.sin_addr);
+        m_request = args.keep_alive
+            ? "GET / HTTP/1.1\r\nHost: bench\r\n\r\n"
+            : "GET / HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+    }
+
+    void run(Worker& w) {
+        m_epfd = epoll_create1(0);
+        std::vector<Conn> conns(w.connections);
+        for(size_t i = 0; i < conns.size(); ++i) {
+            open(w, conns[i], i);
+        }
+        epoll_event events[256];
+        char buf[16384];
+        while(now_ns() < m_end) {
+            int n = epoll_wait(m_epfd, events, 256, 10);
+            for(int i = 0; i < n; ++i) {
+                size_t idx = events[i].data.u64;
+                Conn& c = conns[idx];
+                if(c.connecting) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if(err) {
+                        reopen(w, c, idx, true);
+                        continue;
+                    }
+                    c.connecting = false;
+                    epoll_event ev{};
+                    ev.events = EPOLLIN;
+                    ev.data.u64 = idx;
+                    epoll_ctl(m_epfd, EPOLL_CTL_MOD, c.fd, &ev);
+                    if(!send(c)) {
+                        reopen(w, c, idx, true);
+                    }
+                    continue;
+                }
+                ssize_t r = read(c.fd, buf, sizeof(buf));
+                if(r < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                if(r <= 0) {
+                    reopen(w, c, idx, true);
+                    continue;
+                }
+                c.in.append(buf, r);
+                size_t len = complete(c.in);
+                if(!len) {
+                    continue;
+                }
+                uint64_t done = now_ns();
+                if(done >= m_begin && done < m_end) {
+                    w.latency_ns.push_back(done - c.start_ns);
+                }
+                c.in.erase(0, len);
+                if(!m_args.keep_alive) {
+                    reopen(w, c, idx, false);
+                } else if(!send(c)) {
+                    reopen(w, c, idx, true);
+                }
+            }
+        }
+        for(Conn& c: conns) {
+            if(c.fd >= 0) {
+                close(c.fd);
+            }
+        }
+        close(m_epfd);
+    }
+
+private:
+    void open(Worker& w, Conn& c, size_t idx) {
+        c.in.clear();
+        c.start_ns = now_ns();
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(!m_args.keep_alive) {
+            // 客户端先关闭，不留 TIME_WAIT，否则短连接压几秒就会耗尽本地端口
+            linger lg = {1, 0};
+            setsockopt(c.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        ++w.connects;
+        int rt = connect(c.fd, (sockaddr*)&m_addr, sizeof(m_addr));
+        epoll_event ev{};
+        ev.data.u64 = idx;
+        if(rt == 0) {
+            c.connecting = false;
+            ev.events = EPOLLIN;
+            epoll_ctl(m_epfd, EPOLL_CTL_ADD, c.fd, &ev);
+            if(!send(c)) {
+                reopen(w, c, idx, true);
+            }
+            return;
+        }
+        // 立即失败（例如 ECONNREFUSED）时同样在可写事件里通过 SO_ERROR 发现
+        c.connecting = true;
+        ev.events = EPOLLOUT;
+        epoll_ctl(m_epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    void reopen(Worker& w, Conn& c, size_t idx, bool error) {
+        if(error) {
+            ++w.errors;
+        }
+        close(c.fd);
+        c.fd = -1;
+        if(now_ns() < m_end) {
+            open(w, c, idx);
+        }
+    }
+
+    bool send(Conn& c) {
+        if(m_args.keep_alive) {
+            c.start_ns = now_ns();
+        }
+        // 请求很短，发送缓冲区不会满
+        return write(c.fd, m_request.data(), m_request.size()) == (ssize_t)m_request.size();
+    }
+
+    // in 开头是一个完整的响应时返回它的长度，否则返回0
+    static size_t complete(const std::string& in) {
+        size_t hdr = in.find("\r\n\r\n");
+        if(hdr == std::string::npos) {
+            return 0;
+        }
+        size_t body = 0;
+        size_t pos = in.find("Content-Length:");
+        if(pos != std::string::npos && pos < hdr) {
+            body = strtoul(in.c_str() + pos + 15, nullptr, 10);
+        }
+        size_t total = hdr + 4 + body;
+        return in.size() >= total ? total: 0;
+    }
+
+private:
+    const Args& m_args;
+    uint64_t m_begin;
+    uint64_t m_end;
+    sockaddr_in m_addr;
+    std::string m_request;
+    int m_epfd = -1;
+};
+
+// 进程累计的CPU时间（用户态加内核态，秒）
+double proc_cpu_seconds(int pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if(!std::getline(in, line)) {
+        return 0;
+    }
+    // comm 里可能有空格，从最后一个 ')' 之后开始数字段：state 是第3个字段，utime/stime 是第14、15个
+    std::istringstream ss(line.substr(line.rfind(')') + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for(int i = 3; i <= 15 && (ss >> field); ++i) {
+        if(i == 14) {
+            utime = strtoull(field.c_str(), nullptr, 10);
+        } else if(i == 15) {
+            stime = strtoull(field.c_str(), nullptr, 10);
+        }
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+uint64_t proc_rss_kb(int pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while(std::getline(in, line)) {
+        if(line.compare(0, 6, "VmRSS:") == 0) {
+            return strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+bool parse_args(int argc, char* argv[], Args& a) {
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string k = argv[i];
+        const char* v = argv[i + 1];
+        if(k == "--host") {
+            a.host = v;
+        } else if(k == "--port") {
+            a.port = atoi(v);
+        } else if(k == "--connections") {
+            a.connections = atoi(v);
+        } else if(k == "--threads") {
+            a.threads = atoi(v);
+        } else if(k == "--duration") {
+            a.duration = atof(v);
+        } else if(k == "--warmup") {
+            a.warmup = atof(v);
+        } else if(k == "--mode") {
+            a.keep_alive = strcmp(v, "close") != 0;
+        } else if(k == "--pid") {
+            a.pid = atoi(v);
+        } else if(k == "--server-threads") {
+            a.server_threads = atoi(v);
+        } else if(k == "--label") {
+            a.label = v;
+        } else if(k == "--out") {
+            a.out = v;
+        } else {
+            return false;
+        }
+    }
+    return (argc % 2) == 1 && a.connections > 0 && a.threads > 0 && a.duration > 0;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    Args args;
+    if(!parse_args(argc, argv, args)) {
+        std::cerr << "usage: " << argv[0] << " [--host H] [--port P] [--connections C] [--threads T] [--duration S]"
+                     " [--warmup S] [--mode keepalive|close] [--pid PID] [--server-threads N] [--label L]"
+                     " [--out FILE]" << std::endl;
+        return 1;
+    }
+    args.threads = std::min(args.threads, args.connections);
+
+    uint64_t start = now_ns();
+    uint64_t begin = start + (uint64_t)(args.warmup * 1e9);
+    uint64_t end = begin + (uint64_t)(args.duration * 1e9);
+
+    std::vector<Worker> workers(args.threads);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < args.threads; ++i) {
+        workers[i].connections = args.connections / args.threads + (i < args.connections % args.threads ? 1: 0);
+        threads.emplace_back([&args, &workers, i, begin, end]() {
+            // 每个线程一个 Client（各自的 epoll）
+            Client client(args, begin, end);
+            client.run(workers[i]);
+        });
+    }
+
+    // 测量期间采样服务器的CPU和内存
+    double cpu_begin = 0, cpu_end = 0;
+    uint64_t rss_max = 0;
+    if(args.pid) {
+        while(now_ns() < begin) {
+            usleep(10000);
+        }
+        cpu_begin = proc_cpu_seconds(args.pid);
+        while(now_ns() < end) {
+            rss_max = std::max(rss_max, proc_rss_kb(args.pid));
+            usleep(100000);
+        }
+        cpu_end = proc_cpu_seconds(args.pid);
+    }
+    for(auto& t: threads) {
+        t.join();
+    }
+
+    std::vector<uint64_t> lat;
+    uint64_t errors = 0, connects = 0;
+    for(Worker& w: workers) {
+        lat.insert(lat.end(), w.latency_ns.begin(), w.latency_ns.end());
+        errors += w.errors;
+        connects += w.connects;
+    }
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&lat](double p) -> double {
+        if(lat.empty()) {
+            return 0;
+        }
+        size_t i = std::min(lat.size() - 1, (size_t)(p * lat.size()));
+        return lat[i] / 1000.0;
+    };
+    double sum = 0;
+    for(uint64_t v: lat) {
+        sum += v;
+    }
+
+    std::ostringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(1);
+    ss << "{\"label\":\"" << args.label << "\""
+       << ",\"mode\":\"" << (args.keep_alive ? "keepalive": "close") << "\""
+       << ",\"connections\":" << args.connections
+       << ",\"server_threads\":" << args.server_threads
+       << ",\"client_threads\":" << args.threads
+       << ",\"duration_s\":" << args.duration
+       << ",\"requests\":" << lat.size()
+       << ",\"errors\":" << errors
+       << ",\"connects\":" << connects
+       << ",\"rps\":" << lat.size() / args.duration
+       << ",\"latency_us\":{\"mean\":" << (lat.empty() ? 0: sum / lat.size() / 1000.0)
+       << ",\"p50\":" << pct(0.5) << ",\"p99\":" << pct(0.99) << ",\"p999\":" << pct(0.999)
+       << ",\"max\":" << (lat.empty() ? 0: lat.back() / 1000.0) << "}";
+    if(args.pid) {
+        ss << ",\"server_cpu_pct\":" << (cpu_end - cpu_begin) / args.duration * 100
+           << ",\"server_rss_kb_max\":" << rss_max;
+    }
+    ss << "}";
+
+    if(args.out.empty()) {
+        std::cout << ss.str() << std::endl;
+    } else {
+        std::ofstream out(args.out, std::ios::app);
+        out << ss.str() << std::endl;
+    }
+    return 0;
+}
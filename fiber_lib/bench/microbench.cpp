@@ -0,0 +1,416 @@
+// 核心原语的微基准
+//
+//   microbench [--filter 子串] [--repeat 5] [--scale 1.0] [--label <commit>] [--out results.jsonl]
+//
+// 每项测量重复 --repeat 次，取每次操作耗时的中位数和最小值，结果每项一行 JSON（带 --label，便于在不同提交之间对比）。
+// --scale 按比例调整迭代次数，机器慢或只想快速看一眼时用 0.1。
+// 项目（括号内为参数）：
+//   fiber_switch            resume + yield 一个来回
+//   fiber_create            创建协程（栈池）、运行到结束、析构
+//   fiber_reset             reset 一个已结束的协程并运行到结束
+//   schedule_latency(w)     外部线程 scheduleLock 到任务开始执行的时间，同一时刻只有一个任务，w 为工作线程数
+//   schedule_throughput(w)  外部线程一次提交一批空任务，到全部执行完的平均每任务时间
+//   timer_add_cancel(n)     已有 n 个活着的定时器时 addTimer + Timer::cancel
+//   timer_pooled(n)         同上，addPooledTimer + cancelTimer
+//   event_add_cancel        addEvent + cancelEvent（触发并调度回调），在 IOManager 的协程中执行
+//   event_pingpong          两个协程经 socketpair 和 hook 的 read/write 来回一次（两次 addEvent、两次就绪、两次切换）
+//   fdmanager_get(t)        t 个线程同时 FdManager::get
+//
+// 由 run.sh 编译到 build/microbench（SERVERS= ./run.sh 只编译不压测）
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fd_manager.h"
+#include "fiber.h"
+#include "hook.h"
+#include "ioscheduler.h"
+#include "scheduler.h"
+#include "timer.h"
+
+namespace {
+
+struct Options {
+    std::string filter;
+    int repeat = 5;
+    double scale = 1.0;
+    std::string label;
+    std::string out;
+};
+
+Options g_opts;
+std::ofstream g_out;
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t iterations(uint64_t n) {
+    return std::max<uint64_t>(1, (uint64_t)(n * g_opts.scale));
+}
+
+bool selected(const std::string& name) {
+    return g_opts.filter.empty() || name.find(g_opts.filter) != std::string::npos;
+}
+
+// 运行 body(iters) 共 repeat 次，body 返回本次的总耗时（纳秒），输出每次操作耗时的中位数和最小值
+void report(const std::string& name, const std::string& param, uint64_t iters,
+            const std::function<uint64_t(uint64_t)>& body) {
+    std::vector<double> per_op;
+    for(int r = 0; r < g_opts.repeat; ++r) {
+        per_op.push_back((double)body(iters) / iters);
+    }
+    std::sort(per_op.begin(), per_op.end());
+    double median = per_op[per_op.size() / 2];
+
+    std::ostringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(1);
+    ss << "{\"label\":\"" << g_opts.label << "\",\"bench\":\"" << name << "\",\"param\":\"" << param << "\""
+       << ",\"iterations\":" << iters << ",\"repeat\":" << g_opts.repeat
+       << ",\"ns_per_op\":{\"median\":" << median << ",\"min\":" << per_op.front() << ",\"max\":" << per_op.back() << "}"
+       << ",\"ops_per_sec\":" << (median > 0 ? 1e9 / median: 0) << "}";
+    if(g_out.is_open()) {
+        g_out << ss.str() << std::endl;
+    }
+    std::cout << ss.str() << std::endl;
+}
+
+// ---------------- Fiber ----------------
+
+void bench_fiber() {
+    if(selected("fiber_switch")) {
+        report("fiber_switch", "", iterations(2000000), [](uint64_t n) {
+            bool stop = false;
+            sylar::Fiber::ptr f(new sylar::Fiber([&stop]() {
+                while(!stop) {
+                    sylar::Fiber::Current()->yield();
+                }
+            }, 0, false));
+            f->resume();
+            uint64_t start = now_ns();
+            for(uint64_t i = 0; i < n; ++i) {
+                f->resume();
+            }
+            uint64_t t = now_ns() - start;
+            stop = true;
+            f->resume();
+            return t;
+        });
+    }
+    if(selected("fiber_create")) {
+        report("fiber_create", "", iterations(200000), [](uint64_t n) {
+            uint64_t start = now_ns();
+            for(uint64_t i = 0; i < n; ++i) {
+                sylar::Fiber::ptr f(new sylar::Fiber([]() {}, 0, false));
+                f->resume();
+            }
+            return now_ns() - start;
+        });
+    }
+    if(selected("fiber_reset")) {
+        report("fiber_reset", "", iterations(500000), [](uint64_t n) {
+            sylar::Fiber::ptr f(new sylar::Fiber([]() {}, 0, false));
+            f->resume();
+            uint64_t start = now_ns();
+            for(uint64_t i = 0; i < n; ++i) {
+                f->reset([]() {});
+                f->resume();
+            }
+            return now_ns() - start;
+        });
+    }
+}
+
+// ---------------- Scheduler ----------------
+
+std::vector<size_t> worker_counts() {
+    std::vector<size_t> v;
+    size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    for(size_t w = 1; w <= 8; w *= 2) {
+        if(w == 1 || w <= hw) {
+            v.push_back(w);
+        }
+    }
+    return v;
+}
+
+void bench_scheduler() {
+    for(size_t w: worker_counts()) {
+        std::string param = "workers=" + std::to_string(w);
+        if(selected("schedule_latency")) {
+            sylar::Scheduler sc(w, false, "bench");
+            sc.start();
+            report("schedule_latency", param, iterations(100000), [&sc](uint64_t n) {
+                uint64_t total = 0;
+                for(uint64_t i = 0; i < n; ++i) {
+                    uint64_t begin = now_ns();
+                    std::atomic<uint64_t> started{0};
+                    sc.scheduleLock([&started]() {
+                        started.store(now_ns(), std::memory_order_release);
+                    });
+                    // 先自旋，等久了让出CPU：CPU比工作线程少时一直自旋会把工作线程饿住
+                    uint64_t s;
+                    for(int spin = 0; !(s = started.load(std::memory_order_acquire)); ++spin) {
+                        if(spin > 1000) {
+                            sched_yield();
+                        }
+                    }
+                    total += s - begin;
+                }
+                return total;
+            });
+            sc.stop();
+        }
+        if(selected("schedule_throughput")) {
+            sylar::Scheduler sc(w, false, "bench");
+            sc.start();
+            report("schedule_throughput", param, iterations(1000000), [&sc](uint64_t n) {
+                std::atomic<uint64_t> done{0};
+                uint64_t start = now_ns();
+                for(uint64_t i = 0; i < n; ++i) {
+                    sc.scheduleLock([&done]() {
+                        done.fetch_add(1, std::memory_order_relaxed);
+                    });
+                }
+                while(done.load(std::memory_order_relaxed) < n) {
+                    sched_yield();
+                }
+                return now_ns() - start;
+            });
+            sc.stop();
+        }
+    }
+}
+
+// ---------------- Timer ----------------
+
+void bench_timer() {
+    for(size_t live: {10000ul, 100000ul, 1000000ul}) {
+        // 快速模式下跳过最大的一档，它的准备时间比测量本身长得多
+        if(g_opts.scale < 1 && live > 100000) {
+            continue;
+        }
+        std::string param = "live=" + std::to_string(live);
+        if(selected("timer_add_cancel")) {
+            sylar::TimerManager tm;
+            std::vector<std::shared_ptr<sylar::Timer>> keep;
+            keep.reserve(live);
+            for(size_t i = 0; i < live; ++i) {
+                keep.push_back(tm.addTimer(3600 * 1000 + i % 100000, []() {}));
+            }
+            report("timer_add_cancel", param, iterations(500000), [&tm](uint64_t n) {
+                uint64_t start = now_ns();
+                for(uint64_t i = 0; i < n; ++i) {
+                    tm.addTimer(1000 + i % 50000, []() {})->cancel();
+                }
+                return now_ns() - start;
+            });
+            for(auto& t: keep) {
+                t->cancel();
+            }
+        }
+        if(selected("timer_pooled")) {
+            sylar::TimerManager tm;
+            for(size_t i = 0; i < live; ++i) {
+                tm.addPooledTimer(3600 * 1000 + i % 100000, []() {});
+            }
+            report("timer_pooled", param, iterations(500000), [&tm](uint64_t n) {
+                uint64_t start = now_ns();
+                for(uint64_t i = 0; i < n; ++i) {
+                    tm.cancelTimer(tm.addPooledTimer(1000 + i % 50000, []() {}));
+                }
+                return now_ns() - start;
+            });
+        }
+    }
+}
+
+// ---------------- IOManager ----------------
+
+// 在 iom 的一个协程中运行 fn，等它结束
+void run_in(sylar::IOManager& iom, const std::function<void()>& fn) {
+    std::atomic<bool> done{false};
+    iom.scheduleLock([&]() {
+        fn();
+        done.store(true, std::memory_order_release);
+    });
+    while(!done.load(std::memory_order_acquire)) {
+        usleep(1000);
+    }
+}
+
+void bench_event() {
+    if(!selected("event_add_cancel") && !selected("event_pingpong")) {
+        return;
+    }
+    sylar::IOManager iom(2, false, "bench");
+    if(selected("event_add_cancel")) {
+        report("event_add_cancel", "", iterations(300000), [&iom](uint64_t n) {
+            uint64_t t = 0;
+            run_in(iom, [&]() {
+                int fds[2];
+                if(pipe2(fds, O_NONBLOCK) < 0) {
+                    return;
+                }
+                // 管道里没有数据，读事件不会自己就绪，只由 cancelEvent 触发
+                uint64_t start = now_ns();
+                for(uint64_t i = 0; i < n; ++i) {
+                    iom.addEvent(fds[0], sylar::IOManager::READ, []() {});
+                    iom.cancelEvent(fds[0], sylar::IOManager::READ);
+                }
+                t = now_ns() - start;
+                iom.cancelAll(fds[0]);
+                close(fds[0]);
+                close(fds[1]);
+            });
+            return t;
+        });
+    }
+    if(selected("event_pingpong")) {
+        report("event_pingpong", "", iterations(100000), [&iom](uint64_t n) {
+            int fds[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+                return (uint64_t)0;
+            }
+            sylar::FdMgr::GetInstance()->addSocket(fds[0], true);
+            sylar::FdMgr::GetInstance()->addSocket(fds[1], true);
+            std::atomic<bool> echo_done{false};
+            iom.scheduleLock([&]() {
+                sylar::set_hook_enable(true);
+                char c;
+                for(uint64_t i = 0; i < n; ++i) {
+                    if(read(fds[1], &c, 1) != 1 || write(fds[1], &c, 1) != 1) {
+                        break;
+                    }
+                }
+                echo_done.store(true, std::memory_order_release);
+            });
+            uint64_t t = 0;
+            run_in(iom, [&]() {
+                sylar::set_hook_enable(true);
+                char c = 'x';
+                uint64_t start = now_ns();
+                for(uint64_t i = 0; i < n; ++i) {
+                    if(write(fds[0], &c, 1) != 1 || read(fds[0], &c, 1) != 1) {
+                        break;
+                    }
+                }
+                t = now_ns() - start;
+            });
+            while(!echo_done.load(std::memory_order_acquire)) {
+                usleep(1000);
+            }
+            for(int fd: fds) {
+                iom.cancelAll(fd);
+                sylar::FdMgr::GetInstance()->del(fd);
+                close(fd);
+            }
+            return t;
+        });
+    }
+    iom.stop();
+}
+
+// ---------------- FdManager ----------------
+
+void bench_fdmanager() {
+    if(!selected("fdmanager_get")) {
+        return;
+    }
+    std::vector<int> fds;
+    for(int i = 0; i < 64; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        sylar::FdMgr::GetInstance()->addSocket(fd, true);
+        fds.push_back(fd);
+    }
+    for(size_t t: worker_counts()) {
+        report("fdmanager_get", "threads=" + std::to_string(t), iterations(10000000), [&fds, t](uint64_t n) {
+            std::atomic<bool> go{false};
+            std::vector<std::thread> threads;
+            std::atomic<uintptr_t> sink{0};
+            uint64_t per = n / t;
+            for(size_t k = 0; k < t; ++k) {
+                threads.emplace_back([&, k]() {
+                    while(!go.load(std::memory_order_acquire)) {
+                    }
+                    uintptr_t acc = 0;
+                    for(uint64_t i = 0; i < per; ++i) {
+                        acc += (uintptr_t)sylar::FdMgr::GetInstance()->get(fds[(i + k) & 63]);
+                    }
+                    sink.fetch_add(acc, std::memory_order_relaxed);
+                });
+            }
+            uint64_t start = now_ns();
+            go.store(true, std::memory_order_release);
+            for(auto& th: threads) {
+                th.join();
+            }
+            // 所有线程合起来每次 get 的平均时间，线程间没有争用时随线程数下降
+            return now_ns() - start;
+        });
+    }
+    for(int fd: fds) {
+        sylar::FdMgr::GetInstance()->del(fd);
+        close(fd);
+    }
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string k = argv[i];
+        const char* v = argv[i + 1];
+        if(k == "--filter") {
+            g_opts.filter = v;
+        } else if(k == "--repeat") {
+            g_opts.repeat = std::max(1, atoi(v));
+        } else if(k == "--scale") {
+            g_opts.scale = atof(v);
+        } else if(k == "--label") {
+            g_opts.label = v;
+        } else if(k == "--out") {
+            g_opts.out = v;
+        } else {
+            return false;
+        }
+    }
+    return (argc % 2) == 1 && g_opts.scale > 0;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if(!parse_args(argc, argv)) {
+        std::cerr << "usage: " << argv[0] << " [--filter NAME] [--repeat N] [--scale F] [--label L] [--out FILE]"
+                  << std::endl;
+        return 1;
+    }
+    if(!g_opts.out.empty()) {
+        g_out.open(g_opts.out, std::ios::app);
+    }
+    // 创建线程主协程，fiber_* 直接在主线程上 resume
+    sylar::Fiber::GetThis();
+    bench_fiber();
+    bench_scheduler();
+    bench_timer();
+    bench_event();
+    bench_fdmanager();
+    return 0;
+}
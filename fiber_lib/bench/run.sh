@@ -0,0 +1,110 @@
+#!/usr/bin/env bash
+# 宏观压测：fiber_lib、原生 epoll、libevent 三个服务器用同样的处理逻辑（bench_http.h）和同样的线程数，
+# 由 loadgen 在固定的几档并发下分别做长连接和短连接压测，每次一行 JSON 追加到结果文件：
+# 吞吐、p50/p99/p999 延迟、服务器CPU占用和最大RSS。
+#
+#   ./run.sh                                   # 默认参数
+#   THREADS=8 CONCURRENCY="64 1024" DURATION=20 OUT=results.jsonl ./run.sh
+#   SERVERS="fiber epoll" MODES=keepalive ./run.sh
+#   SERVERS= ./run.sh && build/microbench --label "$(git rev-parse --short HEAD)"   # 只编译，然后跑微基准
+#
+# 编译之后先运行 build/alloc_check（hook 的阻塞读不能有堆分配）和 build/stack_check（共享栈协程的等待结果），失败时不压测
+#
+# 环境变量：
+#   SERVERS       要压的服务器，默认 "fiber epoll libevent"（没有安装 libevent 时跳过它），设为空时只编译
+#   MODES         keepalive 和/或 close，默认两者
+#   CONCURRENCY   并发连接数的各档，默认 "16 64 256 1024"
+#   THREADS       服务器线程数，默认 4
+#   CLIENT_THREADS loadgen 线程数，默认与 THREADS 相同
+#   DURATION      每次测量的秒数，默认 10；WARMUP 预热秒数，默认 2
+#   PORT          监听端口，默认 18080
+#   OUT           结果文件，默认 build/results-<时间>.jsonl
+#   CPUS_SERVER / CPUS_CLIENT  用 taskset 把服务器和客户端绑到不同的CPU（例如 "0-3" 和 "4-7"），默认不绑
+#   CXXFLAGS      编译参数，默认 "-std=c++20 -O2 -g"
+set -euo pipefail
+
+cd "$(dirname "$0")"
+BENCH_DIR=$(pwd)
+LIB_DIR=$BENCH_DIR/../test
+BUILD=$BENCH_DIR/build
+
+SERVERS=${SERVERS-"fiber epoll libevent"}
+MODES=${MODES:-"keepalive close"}
+CONCURRENCY=${CONCURRENCY:-"16 64 256 1024"}
+THREADS=${THREADS:-4}
+CLIENT_THREADS=${CLIENT_THREADS:-$THREADS}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+PORT=${PORT:-18080}
+CXXFLAGS=${CXXFLAGS:-"-std=c++20 -O2 -g"}
+OUT=${OUT:-$BUILD/results-$(date +%Y%m%d-%H%M%S).jsonl}
+
+mkdir -p "$BUILD/lib"
+
+# 编译：fiber_lib（test/ 下除示例 test.cpp 之外的全部源文件）只在源文件变化时重新编译
+echo "building in $BUILD"
+objs=()
+for src in "$LIB_DIR"/*.cpp; do
+    name=$(basename "$src" .cpp)
+    [ "$name" = test ] && continue
+    obj=$BUILD/lib/$name.o
+    if [ ! -f "$obj" ] || [ "$src" -nt "$obj" ] || [ -n "$(find "$LIB_DIR" -name '*.h' -newer "$obj")" ]; then
+        g++ $CXXFLAGS -c "$src" -o "$obj"
+    fi
+    objs+=("$obj")
+done
+g++ $CXXFLAGS -I"$LIB_DIR" fiber_server.cpp "${objs[@]}" -o "$BUILD/fiber_server" -lpthread -ldl
+g++ $CXXFLAGS epoll_server.cpp -o "$BUILD/epoll_server" -lpthread
+g++ $CXXFLAGS loadgen.cpp -o "$BUILD/loadgen" -lpthread
+g++ $CXXFLAGS -I"$LIB_DIR" microbench.cpp "${objs[@]}" -o "$BUILD/microbench" -lpthread -ldl
+g++ $CXXFLAGS -I"$LIB_DIR" alloc_check.cpp "${objs[@]}" -o "$BUILD/alloc_check" -lpthread -ldl
+g++ $CXXFLAGS -I"$LIB_DIR" stack_check.cpp "${objs[@]}" -o "$BUILD/stack_check" -lpthread -ldl
+
+# 阻塞读不能有堆分配，共享栈协程的等待不能写别人的栈；检查失败时以非0退出，整个脚本随之失败
+"$BUILD/alloc_check"
+"$BUILD/stack_check"
+if [[ " $SERVERS " == *" libevent "* ]]; then
+    if g++ $CXXFLAGS libevent_server.cpp -o "$BUILD/libevent_server" -levent -lpthread 2>/dev/null; then
+        :
+    else
+        echo "libevent not available, skipping it"
+        SERVERS=${SERVERS//libevent/}
+    fi
+fi
+
+pin() {
+    if [ -n "$1" ]; then
+        echo "taskset -c $1"
+    fi
+}
+
+wait_port() {
+    for _ in $(seq 100); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.05
+    done
+    return 1
+}
+
+echo "results -> $OUT"
+for server in $SERVERS; do
+    for mode in $MODES; do
+        for conns in $CONCURRENCY; do
+            $(pin "${CPUS_SERVER:-}") "$BUILD/${server}_server" --port "$PORT" --threads "$THREADS" >/dev/null &
+            pid=$!
+            if ! wait_port; then
+                echo "$server did not start" >&2
+                kill "$pid" 2>/dev/null || true
+                exit 1
+            fi
+            $(pin "${CPUS_CLIENT:-}") "$BUILD/loadgen" --port "$PORT" --connections "$conns" \
+                --threads "$CLIENT_THREADS" --duration "$DURATION" --warmup "$WARMUP" --mode "$mode" \
+                --pid "$pid" --server-threads "$THREADS" --label "$server" --out "$OUT"
+            tail -n 1 "$OUT"
+            kill "$pid"
+            wait "$pid" 2>/dev/null || true
+        done
+    done
+done
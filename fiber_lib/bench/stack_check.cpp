@@ -0,0 +1,142 @@
+// 共享栈协程的等待检查：协程挂起期间共享栈的内容属于别的协程，别的线程在唤醒它时不能写它的栈
+//
+//   stack_check [--rounds 20]
+//
+// 只有一个共享栈，等待的协程挂起后由另一个共享栈协程把栈整块写满并挂起，检查等待的结果，
+// 以及后一个协程的栈在它挂起期间没有被唤醒前一个协程的一方改写：
+//   timeout   带 SO_RCVTIMEO 的 recv 没有数据，应当以 ETIMEDOUT 返回（结果由定时器/idle 在等待方恢复前写下）
+//   cancel    在取消上下文中 hook 的 usleep，cancel() 应当以 ECANCELED 提前唤醒（等待项登记在取消上下文的链表里）
+// 每个 epoll 引擎各测一遍（共享栈协程不走 io_uring 完成模式）。结果不对或进程崩溃都算失败，以非0退出
+//
+// 由 run.sh 编译到 build/stack_check 并在编译后运行
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+
+#include "cancel.h"
+#include "fd_manager.h"
+#include "fiber.h"
+#include "hook.h"
+#include "ioscheduler.h"
+
+namespace {
+
+// 在当前协程的栈上写满16KB（覆盖挂起的共享栈协程留下的内容），挂起 sleep_us 之后检查是否被别人改写过。
+// 唤醒方如果写了挂起协程的栈，写到的正是此时占着共享栈的这块缓冲区
+__attribute__((noinline)) bool scribble(useconds_t sleep_us) {
+    volatile char buf[16 * 1024];
+    memset((char*)buf, 0xab, sizeof(buf));
+    usleep(sleep_us);
+    for(size_t i = 0; i < sizeof(buf); ++i) {
+        if(buf[i] != (char)0xab) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 返回结果不对的轮数
+int run(sylar::IOManager::IoEngine engine, int rounds) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) != 0) {
+        perror("socketpair");
+        exit(2);
+    }
+    sylar::FdMgr::GetInstance()->addSocket(sv[0], true);
+    std::atomic<int> bad{0};
+    std::atomic<int> finished{0};
+    {
+        sylar::IOManager iom(1, false, "stack_check", sylar::Scheduler::Placement(),
+                             sylar::IOManager::REACTOR_SHARED, engine);
+        for(int r = 0; r < rounds; ++r) {
+            // timeout：recv 挂起，定时器在另一个协程占着共享栈时到期
+            iom.scheduleLock([&]() {
+                sylar::set_hook_enable(true);
+                timeval tv{0, 20000};
+                setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                char c;
+                if(recv(sv[0], &c, 1, 0) != -1 || errno != ETIMEDOUT) {
+                    bad.fetch_add(1, std::memory_order_relaxed);
+                }
+                finished.fetch_add(1, std::memory_order_release);
+            }, -1, sylar::Fiber::STACK_SHARED);
+            iom.scheduleLock([&]() {
+                sylar::set_hook_enable(true);
+                if(!scribble(40000)) {
+                    bad.fetch_add(1, std::memory_order_relaxed);
+                }
+                finished.fetch_add(1, std::memory_order_release);
+            }, -1, sylar::Fiber::STACK_SHARED);
+            while(finished.load(std::memory_order_acquire) < 2 * (2 * r + 1)) {
+                ::usleep(1000);
+            }
+
+            // cancel：usleep 挂起，另一个协程写乱共享栈之后从外部线程取消
+            auto ctx = sylar::CancelContext::Create();
+            iom.scheduleLock([&, ctx]() {
+                sylar::set_hook_enable(true);
+                sylar::CancelScope scope(ctx);
+                if(usleep(2000000) != -1 || errno != ECANCELED) {
+                    bad.fetch_add(1, std::memory_order_relaxed);
+                }
+                finished.fetch_add(1, std::memory_order_release);
+            }, -1, sylar::Fiber::STACK_SHARED);
+            ::usleep(5000);
+            iom.scheduleLock([&]() {
+                sylar::set_hook_enable(true);
+                if(!scribble(20000)) {
+                    bad.fetch_add(1, std::memory_order_relaxed);
+                }
+                finished.fetch_add(1, std::memory_order_release);
+            }, -1, sylar::Fiber::STACK_SHARED);
+            ::usleep(10000);
+            ctx->cancel();
+            while(finished.load(std::memory_order_acquire) < 2 * (2 * r + 2)) {
+                ::usleep(1000);
+            }
+        }
+        iom.stop();
+    }
+    sylar::FdMgr::GetInstance()->del(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    return bad.load();
+}
+
+}
+
+int main(int argc, char** argv) {
+    int rounds = 20;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(std::string(argv[i]) == "--rounds") {
+            rounds = atoi(argv[i + 1]);
+        }
+    }
+    // 只有一个共享栈，挂起的协程一定会被下一个共享栈协程换出
+    sylar::Fiber::SetSharedStackConfig(1, 256 * 1024);
+    struct Engine {
+        sylar::IOManager::IoEngine engine;
+        const char* name;
+    } engines[] = {
+        {sylar::IOManager::ENGINE_EPOLL, "epoll"},
+        {sylar::IOManager::ENGINE_EPOLL_ET, "epoll_et"},
+    };
+    bool failed = false;
+    for(const Engine& e: engines) {
+        int bad = run(e.engine, rounds);
+        std::cout << "engine=" << e.name << " rounds=" << rounds << " bad=" << bad << (bad ? "  FAIL": "") << std::endl;
+        failed = failed || bad;
+    }
+    if(failed) {
+        std::cerr << "stack_check: waits on shared-stack fibers returned wrong results" << std::endl;
+        return 1;
+    }
+    return 0;
+}
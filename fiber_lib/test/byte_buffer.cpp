@@ -0,0 +1,510 @@
+#include "byte_buffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace sylar {
+
+namespace detail {
+
+struct BufferChunk {
+    std::atomic<uint32_t> refs;
+    BufferChunk* nextFree;
+    char data[ByteBuffer::CHUNK_SIZE];
+};
+
+static_assert(sizeof(BufferChunk) == 4096, "BufferChunk should be exactly one page");
+
+}
+
+using detail::BufferChunk;
+
+// 空闲块：每个线程缓存最多 CHUNK_CACHE_MAX 个，多出的一半还给全局；
+// 全局最多保留 CHUNK_GLOBAL_MAX 个，再多的释放掉，突发之后不会一直占着内存
+static constexpr size_t CHUNK_CACHE_MAX = 64;
+static constexpr size_t CHUNK_GLOBAL_MAX = 1024;
+
+struct ChunkPool {
+    std::mutex mutex;
+    BufferChunk* free = nullptr;
+    size_t size = 0;
+};
+
+// 线程退出时还会用到，不析构
+static ChunkPool& GlobalChunkPool() {
+    static ChunkPool* s_pool = new ChunkPool();
+    return *s_pool;
+}
+
+static void FreeChunks(BufferChunk* list) {
+    while(list) {
+        BufferChunk* next = list->nextFree;
+        ::operator delete(list, std::align_val_t(64));
+        list = next;
+    }
+}
+
+// 把 n 个块串成的链 [first, last] 还给全局，超出上限的部分释放
+static void SpillChunks(BufferChunk* first, BufferChunk* last, size_t n) {
+    ChunkPool& pool = GlobalChunkPool();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if(pool.size + n <= CHUNK_GLOBAL_MAX) {
+            last->nextFree = pool.free;
+            pool.free = first;
+            pool.size += n;
+            return;
+        }
+    }
+    last->nextFree = nullptr;
+    FreeChunks(first);
+}
+
+struct ChunkCache {
+    BufferChunk* head = nullptr;
+    size_t size = 0;
+
+    // 取出 n 个块串成的链，返回链尾
+    BufferChunk* detach(size_t n, BufferChunk*& first) {
+        first = head;
+        BufferChunk* last = head;
+        for(size_t i = 1; i < n; ++i) {
+            last = last->nextFree;
+        }
+        head = last->nextFree;
+        last->nextFree = nullptr;
+        size -= n;
+        return last;
+    }
+
+    ~ChunkCache() {
+        if(!head) {
+            return;
+        }
+        size_t n = size;
+        BufferChunk* first = nullptr;
+        BufferChunk* last = detach(n, first);
+        SpillChunks(first, last, n);
+    }
+};
+
+static thread_local ChunkCache t_chunkCache;
+
+static BufferChunk* AcquireChunk() {
+    ChunkCache& cache = t_chunkCache;
+    if(!cache.head) {
+        ChunkPool& pool = GlobalChunkPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        while(pool.free && cache.size < CHUNK_CACHE_MAX / 2) {
+            BufferChunk* c = pool.free;
+            pool.free = c->nextFree;
+            --pool.size;
+            c->nextFree = cache.head;
+            cache.head = c;
+            ++cache.size;
+        }
+    }
+    BufferChunk* c = cache.head;
+    if(c) {
+        cache.head = c->nextFree;
+        --cache.size;
+    } else {
+        c = (BufferChunk*)::operator new(sizeof(BufferChunk), std::align_val_t(64));
+    }
+    c->refs.store(1, std::memory_order_relaxed);
+    c->nextFree = nullptr;
+    return c;
+}
+
+static void ReleaseChunk(BufferChunk* c) {
+    ChunkCache& cache = t_chunkCache;
+    c->nextFree = cache.head;
+    cache.head = c;
+    if(++cache.size > CHUNK_CACHE_MAX) {
+        // 一直在别的线程分配、在这里释放的块会越积越多，多出的一半还给全局
+        BufferChunk* first = nullptr;
+        BufferChunk* last = cache.detach(CHUNK_CACHE_MAX / 2, first);
+        SpillChunks(first, last, CHUNK_CACHE_MAX / 2);
+    }
+}
+
+static void RefChunk(BufferChunk* c) {
+    c->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void UnrefChunk(BufferChunk* c) {
+    if(c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        ReleaseChunk(c);
+    }
+}
+
+size_t ByteBuffer::GetThreadCachedChunks() {
+    return t_chunkCache.size;
+}
+
+ByteBuffer::ByteBuffer(const ByteBuffer& other)
+    :m_segments(other.m_segments)
+    ,m_size(other.m_size) {
+    for(const Segment& seg: m_segments) {
+        RefChunk(seg.chunk);
+    }
+}
+
+ByteBuffer::ByteBuffer(ByteBuffer&& other) noexcept
+    :m_segments(std::move(other.m_segments))
+    ,m_size(other.m_size) {
+    other.m_segments.clear();
+    other.m_size = 0;
+}
+
+ByteBuffer& ByteBuffer::operator=(const ByteBuffer& other) {
+    if(this != &other) {
+        ByteBuffer tmp(other);
+        *this = std::move(tmp);
+    }
+    return *this;
+}
+
+ByteBuffer& ByteBuffer::operator=(ByteBuffer&& other) noexcept {
+    if(this != &other) {
+        clear();
+        m_segments.swap(other.m_segments);
+        m_size = other.m_size;
+        other.m_size = 0;
+    }
+    return *this;
+}
+
+ByteBuffer::~ByteBuffer() {
+    clear();
+}
+
+void ByteBuffer::clear() {
+    for(const Segment& seg: m_segments) {
+        UnrefChunk(seg.chunk);
+    }
+    m_segments.clear();
+    m_size = 0;
+}
+
+bool ByteBuffer::tailWritable() const {
+    if(m_segments.empty()) {
+        return false;
+    }
+    const Segment& tail = m_segments.back();
+    // 只有自己引用的块，段后面的空间没有别人能看到
+    return tail.end < CHUNK_SIZE && tail.chunk->refs.load(std::memory_order_acquire) == 1;
+}
+
+void ByteBuffer::append(const void* data, size_t len) {
+    const char* p = (const char*)data;
+    m_size += len;
+    if(len && tailWritable()) {
+        Segment& tail = m_segments.back();
+        size_t n = std::min(len, CHUNK_SIZE - tail.end);
+        memcpy(tail.chunk->data + tail.end, p, n);
+        tail.end += n;
+        p += n;
+        len -= n;
+    }
+    while(len) {
+        BufferChunk* c = AcquireChunk();
+        size_t n = std::min(len, CHUNK_SIZE);
+        memcpy(c->data, p, n);
+        m_segments.push_back(Segment{c, 0, (uint32_t)n});
+        p += n;
+        len -= n;
+    }
+}
+
+void ByteBuffer::append(const ByteBuffer& other) {
+    if(&other == this) {
+        ByteBuffer copy(other);
+        append(std::move(copy));
+        return;
+    }
+    for(const Segment& seg: other.m_segments) {
+        RefChunk(seg.chunk);
+        m_segments.push_back(seg);
+    }
+    m_size += other.m_size;
+}
+
+void ByteBuffer::append(ByteBuffer&& other) {
+    if(&other == this) {
+        append((const ByteBuffer&)other);
+        return;
+    }
+    if(m_segments.empty()) {
+        *this = std::move(other);
+        return;
+    }
+    for(const Segment& seg: other.m_segments) {
+        m_segments.push_back(seg);
+    }
+    m_size += other.m_size;
+    other.m_segments.clear();
+    other.m_size = 0;
+}
+
+void ByteBuffer::prepend(const void* data, size_t len) {
+    // 从后往前填
+    const char* p = (const char*)data + len;
+    m_size += len;
+    while(len) {
+        if(!m_segments.empty()) {
+            Segment& head = m_segments.front();
+            if(head.begin > 0 && head.chunk->refs.load(std::memory_order_acquire) == 1) {
+                size_t n = std::min<size_t>(len, head.begin);
+                memcpy(head.chunk->data + head.begin - n, p - n, n);
+                head.begin -= n;
+                p -= n;
+                len -= n;
+                continue;
+            }
+        }
+        // 新块的数据放在末尾，前面留给之后的 prepend
+        BufferChunk* c = AcquireChunk();
+        size_t n = std::min(len, CHUNK_SIZE);
+        memcpy(c->data + CHUNK_SIZE - n, p - n, n);
+        m_segments.push_front(Segment{c, (uint32_t)(CHUNK_SIZE - n), (uint32_t)CHUNK_SIZE});
+        p -= n;
+        len -= n;
+    }
+}
+
+void ByteBuffer::consume(size_t len) {
+    while(len && !m_segments.empty()) {
+        Segment& head = m_segments.front();
+        size_t n = head.end - head.begin;
+        if(len < n) {
+            head.begin += len;
+            m_size -= len;
+            return;
+        }
+        UnrefChunk(head.chunk);
+        m_segments.pop_front();
+        m_size -= n;
+        len -= n;
+    }
+}
+
+ByteBuffer ByteBuffer::slice(size_t pos, size_t len) const {
+    ByteBuffer out;
+    if(pos >= m_size) {
+        return out;
+    }
+    len = std::min(len, m_size - pos);
+    out.m_size = len;
+    for(const Segment& seg: m_segments) {
+        if(!len) {
+            break;
+        }
+        size_t n = seg.end - seg.begin;
+        if(pos >= n) {
+            pos -= n;
+            continue;
+        }
+        size_t take = std::min(n - pos, len);
+        RefChunk(seg.chunk);
+        out.m_segments.push_back(Segment{seg.chunk, (uint32_t)(seg.begin + pos), (uint32_t)(seg.begin + pos + take)});
+        len -= take;
+        pos = 0;
+    }
+    return out;
+}
+
+size_t ByteBuffer::copyOut(void* dst, size_t len, size_t pos) const {
+    char* p = (char*)dst;
+    size_t copied = 0;
+    for(const Segment& seg: m_segments) {
+        if(copied == len) {
+            break;
+        }
+        size_t n = seg.end - seg.begin;
+        if(pos >= n) {
+            pos -= n;
+            continue;
+        }
+        size_t take = std::min(n - pos, len - copied);
+        memcpy(p + copied, seg.chunk->data + seg.begin + pos, take);
+        copied += take;
+        pos = 0;
+    }
+    return copied;
+}
+
+std::string ByteBuffer::toString(size_t pos, size_t len) const {
+    if(pos >= m_size) {
+        return std::string();
+    }
+    std::string s(std::min(len, m_size - pos), '\0');
+    copyOut(&s[0], s.size(), pos);
+    return s;
+}
+
+std::string_view ByteBuffer::front(size_t len, std::string& scratch) const {
+    len = std::min(len, m_size);
+    if(!len) {
+        return std::string_view();
+    }
+    const Segment& head = m_segments.front();
+    if(head.end - head.begin >= len) {
+        return std::string_view(head.chunk->data + head.begin, len);
+    }
+    scratch.resize(len);
+    copyOut(&scratch[0], len);
+    return std::string_view(scratch.data(), len);
+}
+
+ssize_t ByteBuffer::find(const void* pattern, size_t len, size_t from) const {
+    const char* pat = (const char*)pattern;
+    if(from > m_size || len > m_size - from) {
+        return -1;
+    }
+    if(!len) {
+        return from;
+    }
+    // 从第 i 段的 off 处开始是否和 pattern 相同（可以跨段）
+    auto match = [this, pat, len](size_t i, size_t off) {
+        for(size_t k = 0; k < len; ++i, off = 0) {
+            const Segment& seg = m_segments[i];
+            size_t n = std::min<size_t>(seg.end - seg.begin - off, len - k);
+            if(memcmp(seg.chunk->data + seg.begin + off, pat + k, n)) {
+                return false;
+            }
+            k += n;
+        }
+        return true;
+    };
+    size_t base = 0;
+    for(size_t i = 0; i < m_segments.size(); ++i) {
+        const Segment& seg = m_segments[i];
+        size_t n = seg.end - seg.begin;
+        if(base + n > from) {
+            const char* data = seg.chunk->data + seg.begin;
+            size_t off = from > base ? from - base: 0;
+            while(off < n) {
+                const char* hit = (const char*)memchr(data + off, pat[0], n - off);
+                if(!hit) {
+                    break;
+                }
+                off = hit - data;
+                if(base + off + len > m_size) {
+                    return -1;
+                }
+                if(match(i, off)) {
+                    return base + off;
+                }
+                ++off;
+            }
+        }
+        base += n;
+    }
+    return -1;
+}
+
+ssize_t ByteBuffer::readFrom(int fd, size_t max) {
+    struct iovec iov[MAX_IOV];
+    BufferChunk* fresh[MAX_IOV];
+    int n = 0;
+    int nfresh = 0;
+    size_t room = 0;
+    bool use_tail = max && tailWritable();
+    if(use_tail) {
+        Segment& tail = m_segments.back();
+        size_t free = std::min(CHUNK_SIZE - tail.end, max);
+        iov[n].iov_base = tail.chunk->data + tail.end;
+        iov[n].iov_len = free;
+        ++n;
+        room += free;
+    }
+    while(room < max && n < MAX_IOV) {
+        BufferChunk* c = AcquireChunk();
+        size_t k = std::min(CHUNK_SIZE, max - room);
+        fresh[nfresh++] = c;
+        iov[n].iov_base = c->data;
+        iov[n].iov_len = k;
+        ++n;
+        room += k;
+    }
+    if(!n) {
+        return 0;
+    }
+
+    // 开启 hook 时没有数据就挂起协程（可能在别的线程上恢复，块的归还不受影响）
+    ssize_t rt = ::readv(fd, iov, n);
+
+    size_t left = rt > 0 ? (size_t)rt: 0;
+    m_size += left;
+    int i = 0;
+    if(use_tail) {
+        size_t k = std::min(left, iov[0].iov_len);
+        m_segments.back().end += k;
+        left -= k;
+        i = 1;
+    }
+    for(int j = 0; j < nfresh; ++j, ++i) {
+        if(left) {
+            size_t k = std::min(left, iov[i].iov_len);
+            m_segments.push_back(Segment{fresh[j], 0, (uint32_t)k});
+            left -= k;
+        } else {
+            UnrefChunk(fresh[j]);
+        }
+    }
+    return rt;
+}
+
+int ByteBuffer::fillIov(struct iovec* iov, size_t max) const {
+    int n = 0;
+    size_t total = 0;
+    for(const Segment& seg: m_segments) {
+        if(n == MAX_IOV || total == max) {
+            break;
+        }
+        size_t k = std::min<size_t>(seg.end - seg.begin, max - total);
+        iov[n].iov_base = seg.chunk->data + seg.begin;
+        iov[n].iov_len = k;
+        ++n;
+        total += k;
+    }
+    return n;
+}
+
+ssize_t ByteBuffer::writeTo(int fd, size_t max) {
+    struct iovec iov[MAX_IOV];
+    int n = fillIov(iov, max);
+    if(!n) {
+        return 0;
+    }
+    ssize_t rt = ::writev(fd, iov, n);
+    if(rt > 0) {
+        consume(rt);
+    }
+    return rt;
+}
+
+ssize_t ByteBuffer::sendTo(int fd, int flags, size_t max) {
+    struct iovec iov[MAX_IOV];
+    int n = fillIov(iov, max);
+    if(!n) {
+        return 0;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t rt = ::sendmsg(fd, &msg, flags);
+    if(rt > 0) {
+        consume(rt);
+    }
+    return rt;
+}
+
+}
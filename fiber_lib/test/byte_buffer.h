@@ -0,0 +1,108 @@
+#ifndef __SYLAR_BYTE_BUFFER_H__
+#define __SYLAR_BYTE_BUFFER_H__
+
+// 由固定大小的块串成的字节缓冲
+//
+// 协议处理时用栈上的 char buffer[1024] 接收、再拷进 std::string 拼接，报文一大或者一次来好几个就要反复扩容拷贝。
+// ByteBuffer 的数据放在若干个 CHUNK_SIZE 的块里，块按引用计数共享：
+// - readFrom 用 readv 直接读进块里（开启 hook 时没有数据就挂起协程），writeTo 用 writev 直接从块里发，不拼成连续内存
+// - slice 得到一段数据的视图，只增加块的引用计数，不拷贝；append(ByteBuffer) 同样只接上块
+// - prepend 在数据前面加报文头：第一个块前面有空间（并且不与别人共享）时就地写入，否则加一个新块
+// - 块用完后回到当前线程的缓存（超过上限时一半还给全局），下一次分配不经过 malloc
+//
+// 块被多个缓冲共享（slice 或拷贝之后）时任何一方都不会再往里写，只能追加新的块，所以各个视图互不影响。
+// 一个 ByteBuffer 对象本身不是线程安全的，不同对象共享块时可以在不同线程使用
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace sylar {
+
+namespace detail {
+struct BufferChunk;
+}
+
+class ByteBuffer {
+public:
+    // 每个块的数据大小：块连同16字节的头部（引用计数、空闲链表指针）正好一页
+    static constexpr size_t CHUNK_SIZE = 4096 - 16;
+    // 一次 readv / writev 最多使用的块数
+    static constexpr int MAX_IOV = 64;
+
+    ByteBuffer() {}
+    // 拷贝共享全部的块
+    ByteBuffer(const ByteBuffer& other);
+    ByteBuffer(ByteBuffer&& other) noexcept;
+    ByteBuffer& operator=(const ByteBuffer& other);
+    ByteBuffer& operator=(ByteBuffer&& other) noexcept;
+    ~ByteBuffer();
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    void clear();
+
+    // 追加数据：写进最后一个块的剩余空间（块不共享时），不够再加新块
+    void append(const void* data, size_t len);
+    void append(const std::string& s) { append(s.data(), s.size()); }
+    // 接上另一个缓冲的块，不拷贝数据
+    void append(const ByteBuffer& other);
+    void append(ByteBuffer&& other);
+
+    // 在最前面插入数据（报文头等）
+    void prepend(const void* data, size_t len);
+
+    // 从前面丢掉 len 字节（超过 size() 时全部丢掉），用完的块归还
+    void consume(size_t len);
+
+    // 从 pos 开始最多 len 字节的视图，共享块
+    ByteBuffer slice(size_t pos, size_t len = ~(size_t)0) const;
+
+    // 从 pos 开始拷出最多 len 字节，返回拷出的字节数
+    size_t copyOut(void* dst, size_t len, size_t pos = 0) const;
+    std::string toString(size_t pos = 0, size_t len = ~(size_t)0) const;
+
+    // 前 len 字节（不超过 size()）的连续视图：都在第一个块里时直接指向块中的数据，
+    // 否则拷贝到 scratch 中。视图在 consume 掉这些数据、或 scratch 改变之前有效
+    std::string_view front(size_t len, std::string& scratch) const;
+
+    // 从 from 开始查找第一次出现的 pattern（可以跨块），没有返回-1
+    ssize_t find(const void* pattern, size_t len, size_t from = 0) const;
+    ssize_t find(const std::string& pattern, size_t from = 0) const { return find(pattern.data(), pattern.size(), from); }
+
+    // 用 readv 读一次，最多 max 字节，直接读进块里。返回值同 readv；读到的数据追加在后面
+    ssize_t readFrom(int fd, size_t max = 64 * 1024);
+    // 用 writev 写一次，最多 max 字节。返回值同 writev；写出的数据从前面丢掉
+    ssize_t writeTo(int fd, size_t max = ~(size_t)0);
+    // 同 writeTo，但用 sendmsg 发送，可以带 MSG_MORE、MSG_NOSIGNAL 等 flags（只能用于socket）
+    ssize_t sendTo(int fd, int flags, size_t max = ~(size_t)0);
+
+    // 当前线程缓存的空闲块数
+    static size_t GetThreadCachedChunks();
+
+private:
+    // 一个块中 [begin, end) 这一段
+    struct Segment {
+        detail::BufferChunk* chunk;
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    // 最后一个块是否可以继续往后写（不共享、后面还有空间）
+    bool tailWritable() const;
+
+    // 用前面最多 max 字节填 iov（最多 MAX_IOV 项），返回项数
+    int fillIov(struct iovec* iov, size_t max) const;
+
+private:
+    std::deque<Segment> m_segments;
+    size_t m_size = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef __SYLAR_CALLBACK_H__
+#define __SYLAR_CALLBACK_H__
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace sylar {
+
+// 只能移动、不能拷贝的 void() 可调用对象，用来代替 std::function<void()> 作为任务类型
+// std::function 的小对象缓冲区只有16字节左右，捕获稍多的lambda就会在堆上分配，并且任务在队列中还会被拷贝。
+// Callback 自带56字节的内联缓冲区（整个对象64字节，正好一个cache line），
+// 像 [fd, iom]{...}、[fiber, iom]{...} 这样的捕获都直接放在对象内部，不会触及堆；
+// 只有放不下（或移动构造可能抛异常）的可调用对象才退化为堆分配。
+class Callback {
+public:
+    static const size_t INLINE_SIZE = 56;
+
+    Callback() noexcept {}
+
+    Callback(std::nullptr_t) noexcept {}
+
+    template<class F, class D = typename std::decay<F>::type,
+             class = typename std::enable_if<!std::is_same<D, Callback>::value
+                                             && std::is_invocable<D&>::value>::type>
+    Callback(F&& f) {
+        if(IsNull(f)) {
+            return;
+        }
+        if(FitsInline<D>()) {
+            new (m_buf) D(std::forward<F>(f));
+            m_ops = &InlineOps<D>::ops;
+        } else {
+            *reinterpret_cast<D**>(m_buf) = new D(std::forward<F>(f));
+            m_ops = &HeapOps<D>::ops;
+        }
+    }
+
+    Callback(Callback&& other) noexcept {
+        moveFrom(other);
+    }
+
+    Callback& operator=(Callback&& other) noexcept {
+        if(this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    Callback& operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    template<class F, class D = typename std::decay<F>::type,
+             class = typename std::enable_if<!std::is_same<D, Callback>::value
+                                             && std::is_invocable<D&>::value>::type>
+    Callback& operator=(F&& f) {
+        Callback tmp(std::forward<F>(f));
+        return *this = std::move(tmp);
+    }
+
+    Callback(const Callback&) = delete;
+    Callback& operator=(const Callback&) = delete;
+
+    ~Callback() {
+        reset();
+    }
+
+    void swap(Callback& other) noexcept {
+        Callback tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    explicit operator bool() const noexcept {
+        return m_ops != nullptr;
+    }
+
+    void operator()() {
+        assert(m_ops);
+        m_ops->invoke(m_buf);
+    }
+
+    // 可调用对象是否存放在内联缓冲区中（未在堆上分配）
+    bool isInline() const noexcept {
+        return m_ops && m_ops->is_inline;
+    }
+
+    friend bool operator==(const Callback& cb, std::nullptr_t) noexcept { return !cb; }
+    friend bool operator!=(const Callback& cb, std::nullptr_t) noexcept { return !!cb; }
+
+private:
+    struct Ops {
+        void (*invoke)(void* buf);
+        // 把src中的对象移动到dst，并析构src中的对象
+        void (*relocate)(void* dst, void* src) noexcept;
+        void (*destroy)(void* buf) noexcept;
+        bool is_inline;
+    };
+
+    template<class D>
+    static constexpr bool FitsInline() {
+        return sizeof(D) <= INLINE_SIZE && alignof(D) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<D>::value;
+    }
+
+    template<class D>
+    struct InlineOps {
+        static void invoke(void* buf) {
+            (*static_cast<D*>(buf))();
+        }
+        static void relocate(void* dst, void* src) noexcept {
+            new (dst) D(std::move(*static_cast<D*>(src)));
+            static_cast<D*>(src)->~D();
+        }
+        static void destroy(void* buf) noexcept {
+            static_cast<D*>(buf)->~D();
+        }
+        static constexpr Ops ops = {&invoke, &relocate, &destroy, true};
+    };
+
+    template<class D>
+    struct HeapOps {
+        static void invoke(void* buf) {
+            (**static_cast<D**>(buf))();
+        }
+        static void relocate(void* dst, void* src) noexcept {
+            *static_cast<D**>(dst) = *static_cast<D**>(src);
+        }
+        static void destroy(void* buf) noexcept {
+            delete *static_cast<D**>(buf);
+        }
+        static constexpr Ops ops = {&invoke, &relocate, &destroy, false};
+    };
+
+    // 空的函数指针、std::function 构造出空的 Callback
+    template<class F>
+    static bool IsNull(const F& f) {
+        if constexpr(std::is_function<F>::value) {
+            return false;
+        } else if constexpr(std::is_pointer<F>::value || std::is_member_pointer<F>::value
+                     || std::is_constructible<bool, const F&>::value) {
+            return !f;
+        } else {
+            return false;
+        }
+    }
+
+    void moveFrom(Callback& other) noexcept {
+        if(other.m_ops) {
+            other.m_ops->relocate(m_buf, other.m_buf);
+            m_ops = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+
+    void reset() noexcept {
+        if(m_ops) {
+            const Ops* ops = m_ops;
+            m_ops = nullptr;
+            ops->destroy(m_buf);
+        }
+    }
+
+private:
+    alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+    const Ops* m_ops = nullptr;
+};
+
+}
+
+#endif
@@ -0,0 +1,128 @@
+#include "cancel.h"
+#include "fiber.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+
+namespace sylar {
+
+CancelContext::CancelContext(const ptr& parent, uint64_t deadline)
+    :m_parent(parent)
+    ,m_deadline(deadline) {
+}
+
+CancelContext::ptr CancelContext::Create(const ptr& parent, uint64_t timeout_ms) {
+    uint64_t deadline = ~0ull;
+    if(timeout_ms != ~0ull) {
+        deadline = MonotonicNs() + timeout_ms * 1000000;
+    }
+    if(parent) {
+        deadline = std::min(deadline, parent->m_deadline);
+    }
+    ptr ctx(new CancelContext(parent, deadline));
+    if(parent) {
+        // 在父上下文的锁下检查：要么 cancel() 已经设置了标志，要么它会在子上下文列表里看到这个新的
+        std::lock_guard<std::mutex> lock(parent->m_mutex);
+        if(parent->isCancelled()) {
+            ctx->m_cancelled.store(true, std::memory_order_release);
+        } else {
+            parent->m_children.push_back(ctx.get());
+        }
+    }
+    return ctx;
+}
+
+CancelContext::~CancelContext() {
+    // 父上下文的 cancel() 可能正拿着它的锁遍历到这里，摘除之前成员都还有效
+    if(m_parent) {
+        std::lock_guard<std::mutex> lock(m_parent->m_mutex);
+        auto it = std::find(m_parent->m_children.begin(), m_parent->m_children.end(), this);
+        if(it != m_parent->m_children.end()) {
+            *it = m_parent->m_children.back();
+            m_parent->m_children.pop_back();
+        }
+    }
+    assert(!m_waiters);
+}
+
+void CancelContext::cancel() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_cancelled.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+    for(Waiter* w = m_waiters; w; w = w->next) {
+        w->wake(w);
+    }
+    for(CancelContext* child: m_children) {
+        child->cancel();
+    }
+}
+
+uint64_t CancelContext::remainingMs() const {
+    if(m_deadline == ~0ull) {
+        return ~0ull;
+    }
+    uint64_t now = MonotonicNs();
+    return now >= m_deadline ? 0: (m_deadline - now + 999999) / 1000000;
+}
+
+int CancelContext::check() const {
+    if(isCancelled()) {
+        return ECANCELED;
+    }
+    if(m_deadline != ~0ull && MonotonicNs() >= m_deadline) {
+        return ETIMEDOUT;
+    }
+    return 0;
+}
+
+void CancelContext::addWaiter(Waiter* w) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    w->prev = nullptr;
+    w->next = m_waiters;
+    if(m_waiters) {
+        m_waiters->prev = w;
+    }
+    m_waiters = w;
+}
+
+void CancelContext::removeWaiter(Waiter* w) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(w->prev) {
+        w->prev->next = w->next;
+    } else {
+        m_waiters = w->next;
+    }
+    if(w->next) {
+        w->next->prev = w->prev;
+    }
+    w->prev = w->next = nullptr;
+}
+
+CancelContext* CancelContext::Current() {
+    return Fiber::CurrentCancelContext();
+}
+
+CancelContext::ptr CancelContext::GetCurrent() {
+    CancelContext* ctx = Current();
+    return ctx ? ctx->shared_from_this(): nullptr;
+}
+
+int CancelContext::CheckCurrent() {
+    CancelContext* ctx = Current();
+    return ctx ? ctx->check(): 0;
+}
+
+CancelScope::CancelScope(CancelContext::ptr ctx) {
+    Fiber* f = Fiber::Current();
+    m_saved = f->getCancelContext();
+    f->setCancelContext(std::move(ctx));
+}
+
+CancelScope::~CancelScope() {
+    Fiber::Current()->setCancelContext(std::move(m_saved));
+}
+
+}
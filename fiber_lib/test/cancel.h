@@ -0,0 +1,110 @@
+#ifndef __SYLAR_CANCEL_H__
+#define __SYLAR_CANCEL_H__
+
+// 取消和截止时间：一个请求派生出的所有协程共用一个取消上下文
+//
+// FdCtx::setTimeout 只能限制单个fd上的一次读写，没法表达"这个请求总共还剩50ms"，也没法在客户端断开后
+// 让请求的所有协程停下来。CancelContext 表示一个请求的截止时间和是否已经放弃：
+// - 当前协程的上下文（CancelScope 设置）对它所有的挂起等待生效：IOManager::waitEvent（hook 的 read/write/recv/send/accept、
+//   connect、poll/select/epoll_wait，TcpConnection 的读写，连接池，DNS）的超时取原来的超时和剩余时间中较小的一个，
+//   sleep/usleep/nanosleep 最多睡到截止时间。已经取消或到期时 hook 的IO直接失败，不再发起调用
+// - cancel() 唤醒正挂起在这些等待上的协程（与 cancelEvent 相同的途径），hook 的调用返回-1，errno 为 ECANCELED；
+//   因截止时间返回时 errno 为 ETIMEDOUT
+// - 在带上下文的协程中提交的回调任务（scheduleLock、scheduleBatch 等）继承这个上下文，cancel 一次就能停下
+//   整个请求派生出来的协程。内联回调（STACK_INLINE）不会挂起，不继承
+// - 子上下文继承父上下文的截止时间，父上下文取消时一起取消，取消子上下文不影响父上下文
+// 没有上下文的协程行为不变，每次等待只多一次线程局部的读。io_uring 完成模式的操作不能中途取消，
+// 有上下文时 hook 退回就绪模式
+//
+//   auto ctx = sylar::CancelContext::Create(nullptr, 50);    // 整个请求最多50ms
+//   sylar::CancelScope scope(ctx);
+//   ssize_t n = recv(fd, buf, sizeof(buf), 0);               // 超过50ms返回-1，errno 为 ETIMEDOUT
+//   ...
+//   ctx->cancel();                                           // 例如客户端断开时，可以在任何线程调用
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace sylar {
+
+class CancelContext: public std::enable_shared_from_this<CancelContext> {
+public:
+    typedef std::shared_ptr<CancelContext> ptr;
+
+    // 挂起中的一次等待：等待的一方在挂起前 addWaiter，恢复后 removeWaiter，期间 cancel() 调用 wake 唤醒它。
+    // wake 在持有上下文的锁时调用，不能再调用本上下文的方法。
+    // 其他线程会通过链表读写等待项，等待项不能放在协程栈上（共享栈协程挂起期间栈内容属于别的协程）
+    struct Waiter {
+        void (*wake)(Waiter* w) = nullptr;
+        Waiter* prev = nullptr;
+        Waiter* next = nullptr;
+    };
+
+    // timeout_ms 为从现在起的时限，~0ull 表示不限；有父上下文时截止时间取两者中较早的，父上下文已经取消时一创建就是取消的
+    static ptr Create(const ptr& parent = nullptr, uint64_t timeout_ms = ~0ull);
+    ~CancelContext();
+
+    CancelContext(const CancelContext&) = delete;
+    CancelContext& operator=(const CancelContext&) = delete;
+
+    // 取消自己和所有子上下文，唤醒挂起在等待上的协程。可以在任何线程调用，重复调用什么也不做
+    void cancel();
+
+    bool isCancelled() const {
+        return m_cancelled.load(std::memory_order_acquire);
+    }
+
+    // 截止时间（MonotonicNs），~0ull 表示不限
+    uint64_t getDeadline() const {
+        return m_deadline;
+    }
+
+    // 到截止时间还有多少毫秒（向上取整，按它等待不会提前醒来），不限时返回 ~0ull，已经到期返回0
+    uint64_t remainingMs() const;
+
+    // 已取消返回 ECANCELED，已到截止时间返回 ETIMEDOUT，否则返回0
+    int check() const;
+
+    void addWaiter(Waiter* w);
+    void removeWaiter(Waiter* w);
+
+    // 当前协程的上下文，不持有引用；没有时为空
+    static CancelContext* Current();
+    static ptr GetCurrent();
+
+    // 当前协程上下文的 check()，没有上下文时为0。CPU 密集的循环可以定期调用，请求放弃后提前结束
+    static int CheckCurrent();
+
+private:
+    CancelContext(const ptr& parent, uint64_t deadline);
+
+private:
+    ptr m_parent;
+    uint64_t m_deadline;
+    std::atomic<bool> m_cancelled{false};
+    // 保护等待链表和子上下文列表；加锁顺序为父 -> 子
+    std::mutex m_mutex;
+    Waiter* m_waiters = nullptr;
+    // 子上下文在析构时从这里摘除
+    std::vector<CancelContext*> m_children;
+};
+
+// 在作用域内把当前协程的上下文换成 ctx（可以为空，表示不受任何上下文约束），离开时恢复原来的
+class CancelScope {
+public:
+    explicit CancelScope(CancelContext::ptr ctx);
+    ~CancelScope();
+
+    CancelScope(const CancelScope&) = delete;
+    CancelScope& operator=(const CancelScope&) = delete;
+
+private:
+    CancelContext::ptr m_saved;
+};
+
+}
+
+#endif
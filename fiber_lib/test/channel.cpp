@@ -0,0 +1,194 @@
+#include "channel.h"
+
+namespace sylar {
+
+namespace detail {
+
+void ChannelWaiter::arm() {
+    if(Fiber::CanSuspend() && Scheduler::GetThis()) {
+        m_target.scheduler = Scheduler::GetThis();
+        m_target.fiber = Fiber::ptr(Fiber::Current());
+        m_target.sem = nullptr;
+    } else {
+        // 不在调度器的协程中，只能阻塞当前线程
+        m_target.scheduler = nullptr;
+        m_target.fiber = nullptr;
+        m_target.sem = &m_sem;
+    }
+    m_fired.store(ARMED, std::memory_order_seq_cst);
+}
+
+void ChannelWaiter::park() {
+    if(m_target.sem) {
+        m_sem.wait();
+    } else {
+        // wake() 可能已经把协程放回了调度器，resume() 会等这里切换完成
+        Fiber::SetWaitReason(Fiber::WAIT_CHANNEL);
+        Fiber::Current()->yield();
+    }
+}
+
+}
+
+void ChannelBase::addWaiter(int dir, const detail::ChannelWaiter::ptr& waiter, int index) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_waiters[dir].push_back(Entry{waiter, index});
+    m_waiting[dir].fetch_add(1, std::memory_order_seq_cst);
+}
+
+void ChannelBase::removeWaiter(int dir, detail::ChannelWaiter* waiter) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::deque<Entry>& q = m_waiters[dir];
+    for(auto it = q.begin(); it != q.end(); ++it) {
+        if(it->waiter.get() == waiter) {
+            q.erase(it);
+            m_waiting[dir].fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    // 已经被 notify 取走
+}
+
+void ChannelBase::notify(int dir) {
+    detail::ChannelWaiter::ptr target;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::deque<Entry>& q = m_waiters[dir];
+        while(!q.empty()) {
+            Entry e = std::move(q.front());
+            q.pop_front();
+            m_waiting[dir].fetch_sub(1, std::memory_order_relaxed);
+            // 同时等待多个通道的 Select 可能已经被别的通道或超时唤醒，跳过它，否则这次唤醒就丢了
+            if(e.waiter->fire(e.index)) {
+                target = std::move(e.waiter);
+                break;
+            }
+        }
+    }
+    if(target) {
+        target->wake();
+    }
+}
+
+void ChannelBase::close() {
+    if(m_closed.exchange(true, std::memory_order_seq_cst)) {
+        return;
+    }
+    std::vector<detail::ChannelWaiter::ptr> targets;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(int dir = 0; dir < 2; ++dir) {
+            for(auto& e: m_waiters[dir]) {
+                if(e.waiter->fire(e.index)) {
+                    targets.push_back(std::move(e.waiter));
+                }
+            }
+            m_waiters[dir].clear();
+            m_waiting[dir].store(0, std::memory_order_relaxed);
+        }
+    }
+    for(auto& w: targets) {
+        w->wake();
+    }
+}
+
+// 多个分支同时就绪时的轮换起点
+static thread_local uint32_t t_select_seq = 0;
+
+int Select::tryOnce() {
+    size_t n = m_cases.size();
+    if(n == 0) {
+        return -1;
+    }
+    size_t start = t_select_seq++ % n;
+    for(size_t i = 0; i < n; ++i) {
+        size_t k = (start + i) % n;
+        if(attemptCase(k)) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+int Select::wait() {
+    int idx = tryOnce();
+    if(idx >= 0 || m_cases.empty()) {
+        return idx;
+    }
+
+    detail::ChannelWaiter::ptr waiter(new detail::ChannelWaiter);
+    std::shared_ptr<Timer> timer;
+
+    while(true) {
+        waiter->arm();
+        // 定时器可能在两轮等待之间（waiter 未处于等待状态时）到期，那次 fire 会失败
+        if(waiter->isTimedOut()) {
+            waiter->cancel();
+            idx = m_timeoutIndex;
+            break;
+        }
+        for(size_t i = 0; i < m_cases.size(); ++i) {
+            if(m_cases[i].channel) {
+                m_cases[i].channel->addWaiter(m_cases[i].dir, waiter, i);
+            }
+        }
+        if(m_timeoutIndex >= 0 && !timer) {
+            int index = m_timeoutIndex;
+            timer = m_timerManager->addTimer(m_timeoutMs, [waiter, index]() {
+                waiter->setTimedOut();
+                if(waiter->fire(index)) {
+                    waiter->wake();
+                }
+            });
+        }
+
+        // 登记之后再检查一次：与 afterPush/afterPop 的屏障配对，登记之前放入/取出的元素在这里一定能看到
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        idx = tryOnce();
+        int fired;
+        if(idx >= 0) {
+            fired = waiter->cancel();
+            if(fired != detail::ChannelWaiter::ARMED) {
+                // 取消之前已经被唤醒，等那次唤醒到达
+                waiter->park();
+            }
+        } else {
+            waiter->park();
+            fired = waiter->getFired();
+        }
+
+        for(size_t i = 0; i < m_cases.size(); ++i) {
+            if(m_cases[i].channel) {
+                m_cases[i].channel->removeWaiter(m_cases[i].dir, waiter.get());
+            }
+        }
+
+        if(idx >= 0) {
+            // 被另一个通道唤醒却没有用上，把唤醒转交给该通道上的下一个等待者
+            if(fired >= 0 && fired != idx && fired != m_timeoutIndex) {
+                m_cases[fired].channel->notify(m_cases[fired].dir);
+            }
+            break;
+        }
+        if(fired == m_timeoutIndex) {
+            idx = fired;
+            break;
+        }
+        // 优先完成唤醒我们的分支；失败说明元素（或空位）被快路径上的其他协程抢走了，不需要转交
+        if(attemptCase(fired)) {
+            idx = fired;
+            break;
+        }
+        idx = tryOnce();
+        if(idx >= 0) {
+            break;
+        }
+    }
+
+    if(timer) {
+        timer->cancel();
+    }
+    return idx;
+}
+
+}
@@ -0,0 +1,425 @@
+#ifndef __SYLAR_CHANNEL_H__
+#define __SYLAR_CHANNEL_H__
+
+// 有界多生产者多消费者通道 Channel<T>，用于协程之间的流水线
+//
+// 数据放在无锁环形缓冲区中（每个槽位带序号的有界MPMC队列），通道不满/不空时 send/recv 只有几次原子操作，
+// 不加锁、不经过调度器；满（或空）时当前协程登记在通道的等待队列上并让出，
+// 对端取走（或放入）一个元素后把它放回调度器，工作线程不会被阻塞。
+// 容量即背压：生产者比消费者快时会在 send 上挂起，例如 accept 协程与处理协程之间用一个通道连接。
+//
+// Select 可以同时等待多个通道的收/发以及一个超时（TimerManager），返回就绪的那一项。
+//
+// 与 fiber_sync.h 中的原语一样，在调度器之外的普通线程中调用时退化为阻塞该线程。
+//
+// 用法：
+//   Channel<int> ch(128);
+//   iom.scheduleLock([&]{ for(int i = 0; i < n; ++i) ch.send(i); ch.close(); });
+//   iom.scheduleLock([&]{ int v; while(ch.recv(v)) { ... } });
+//
+//   int v; std::string s;
+//   Select sel;
+//   sel.recv(ints, v).recv(strs, s).timeout(&iom, 100);
+//   switch(sel.wait()) { case 0: ...; case 1: ...; case 2: /* 超时 */ }
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "fiber_sync.h"
+#include "timer.h"
+
+namespace sylar {
+
+class Select;
+
+namespace detail {
+
+// 一次 Select（或阻塞的 send/recv）的等待者，同时登记在多个通道上，只会被其中一个唤醒
+// 放在堆上：等待者所在的协程可能使用共享栈，挂起期间它的栈内容会被换出
+class ChannelWaiter: public RefCounted {
+public:
+    typedef RefPtr<ChannelWaiter> ptr;
+
+    enum {
+        // 尚未准备好等待 / 已取消
+        IDLE = -2,
+        // 等待中，可以被触发
+        ARMED = -1
+        // 非负值：触发它的 Select 分支下标
+    };
+
+    // 准备等待当前协程（或线程）
+    void arm();
+
+    // 由通道（持有通道的锁）或超时定时器调用，成功后调用方必须在锁外调用 wake()
+    bool fire(int index) {
+        int expected = ARMED;
+        return m_fired.compare_exchange_strong(expected, index, std::memory_order_acq_rel);
+    }
+
+    // 放弃等待，返回 ARMED 表示取消成功（不会再被唤醒），否则返回已经触发它的分支下标
+    int cancel() {
+        int expected = ARMED;
+        if(m_fired.compare_exchange_strong(expected, IDLE, std::memory_order_acq_rel)) {
+            return ARMED;
+        }
+        return expected;
+    }
+
+    int getFired() const {
+        return m_fired.load(std::memory_order_acquire);
+    }
+
+    void wake() {
+        m_target.wake();
+    }
+
+    // 超时定时器到期时先设置，再 fire
+    void setTimedOut() {
+        m_timedOut.store(true, std::memory_order_seq_cst);
+    }
+
+    // 在 arm() 之后检查
+    bool isTimedOut() const {
+        return m_timedOut.load(std::memory_order_seq_cst);
+    }
+
+    // 挂起直到 wake()
+    void park();
+
+private:
+    std::atomic<int> m_fired{IDLE};
+    std::atomic<bool> m_timedOut{false};
+    SyncWaiter m_target;
+    Semaphore m_sem;
+};
+
+}
+
+// Channel<T> 中与元素类型无关的部分：等待队列与关闭状态
+class ChannelBase {
+    friend class Select;
+public:
+    enum Direction {
+        SEND = 0,
+        RECV = 1
+    };
+
+    ChannelBase() {}
+    ChannelBase(const ChannelBase&) = delete;
+    ChannelBase& operator=(const ChannelBase&) = delete;
+
+    // 关闭通道：之后 send 失败，recv 取完剩余元素后失败；唤醒所有等待者
+    void close();
+
+    bool isClosed() const {
+        return m_closed.load(std::memory_order_acquire);
+    }
+
+protected:
+    // 放入一个元素之后调用：有接收者在等时唤醒一个
+    void afterPush() {
+        // 与等待者“登记后再检查一次”配对，保证不会两边都看不到对方
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_waiting[RECV].load(std::memory_order_relaxed)) {
+            notify(RECV);
+        }
+    }
+
+    // 取出一个元素之后调用：有发送者在等时唤醒一个
+    void afterPop() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_waiting[SEND].load(std::memory_order_relaxed)) {
+            notify(SEND);
+        }
+    }
+
+private:
+    struct Entry {
+        detail::ChannelWaiter::ptr waiter;
+        int index;
+    };
+
+    void addWaiter(int dir, const detail::ChannelWaiter::ptr& waiter, int index);
+    void removeWaiter(int dir, detail::ChannelWaiter* waiter);
+
+    // 唤醒dir方向上一个仍在等待的等待者（跳过已被其他通道或超时触发的）
+    void notify(int dir);
+
+private:
+    std::atomic<bool> m_closed{false};
+    // 各方向等待队列的长度，放入/取出元素时不加锁就能判断是否需要唤醒
+    std::atomic<size_t> m_waiting[2] = {{0}, {0}};
+    std::mutex m_mutex;
+    std::deque<Entry> m_waiters[2];
+};
+
+template<class T>
+class Channel: public ChannelBase {
+public:
+    // capacity 至少为1
+    explicit Channel(size_t capacity)
+        :m_capacity(capacity)
+        ,m_cells(new Cell[capacity]) {
+        assert(capacity > 0);
+        for(size_t i = 0; i < capacity; ++i) {
+            m_cells[i].seq.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // 析构时不能再有协程在使用通道，剩余的元素直接销毁
+    ~Channel() {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        for(size_t pos = m_tail.load(std::memory_order_relaxed); pos < head; ++pos) {
+            m_cells[pos % m_capacity].value()->~T();
+        }
+    }
+
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+    // 当前元素数（近似值）
+    size_t size() const {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_relaxed);
+        return head >= tail ? head - tail: 0;
+    }
+
+    // 通道满时挂起当前协程，直到有空位；通道已关闭返回false
+    bool send(const T& value) {
+        T v(value);
+        return send(std::move(v));
+    }
+
+    bool send(T&& value);
+
+    // 通道为空时挂起当前协程，直到有元素；通道已关闭且没有剩余元素时返回false
+    bool recv(T& out);
+
+    // 不挂起：满（或已关闭）时返回false，value 保持不变
+    bool try_send(T& value) {
+        if(isClosed() || !push(value)) {
+            return false;
+        }
+        afterPush();
+        return true;
+    }
+
+    bool try_send(T&& value) {
+        return try_send(value);
+    }
+
+    // 不挂起：空时返回false
+    bool try_recv(T& out) {
+        if(!pop(out)) {
+            return false;
+        }
+        afterPop();
+        return true;
+    }
+
+private:
+    // 槽位的序号记录它走到了第几圈：第lap圈的 push 等待 seq == 2*lap，pop 等待 seq == 2*lap+1，
+    // 这样容量为1时“已放入”和“已取走”也不会混淆
+    struct alignas(64) Cell {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* value() {
+            return reinterpret_cast<T*>(storage);
+        }
+    };
+
+    // 成功时从 value 移出
+    bool push(T& value) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        while(true) {
+            Cell& cell = m_cells[pos % m_capacity];
+            size_t turn = pos / m_capacity * 2;
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            if(seq == turn) {
+                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    new (cell.storage) T(std::move(value));
+                    cell.seq.store(turn + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(seq < turn) {
+                // 上一圈放在这里的元素还没被取走：已满
+                return false;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T& out) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        while(true) {
+            Cell& cell = m_cells[pos % m_capacity];
+            size_t turn = pos / m_capacity * 2 + 1;
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            if(seq == turn) {
+                if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    T* v = cell.value();
+                    out = std::move(*v);
+                    v->~T();
+                    cell.seq.store(turn + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(seq < turn) {
+                // 这一圈的元素还没放入：空
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    const size_t m_capacity;
+    std::unique_ptr<Cell[]> m_cells;
+    // 生产者与消费者的位置分开放在不同的cache line
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+};
+
+// 同时等待多个通道操作和一个可选的超时
+// 每个分支按添加顺序编号（超时也占一个编号），wait() 返回完成的那个分支；
+// 多个分支同时就绪时从轮换的起点开始尝试，避免总是偏向第一个。
+// Select 对象只在一次 wait() 中使用，分支引用的通道和变量必须在 wait() 返回前保持有效
+class Select {
+public:
+    Select() {}
+    Select(const Select&) = delete;
+    Select& operator=(const Select&) = delete;
+
+    // 从ch接收到out；ok不为空时，接收成功写入true，通道已关闭（分支同样算作完成）写入false
+    template<class T>
+    Select& recv(Channel<T>& ch, T& out, bool* ok = nullptr) {
+        m_cases.push_back(Case{&ch, ChannelBase::RECV, &out, ok, &Select::attemptRecv<T>});
+        return *this;
+    }
+
+    // 把value发送到ch（value 在发送成功时被移走）；ok 的含义同 recv
+    template<class T>
+    Select& send(Channel<T>& ch, T& value, bool* ok = nullptr) {
+        m_cases.push_back(Case{&ch, ChannelBase::SEND, &value, ok, &Select::attemptSend<T>});
+        return *this;
+    }
+
+    // ms 毫秒后仍没有分支就绪则以本分支完成，最多只能有一个
+    Select& timeout(TimerManager* tm, uint64_t ms) {
+        assert(m_timeoutIndex < 0);
+        m_timeoutIndex = m_cases.size();
+        m_timerManager = tm;
+        m_timeoutMs = ms;
+        m_cases.push_back(Case{nullptr, -1, nullptr, nullptr, nullptr});
+        return *this;
+    }
+
+    // 挂起当前协程直到有分支完成，返回它的下标；没有任何分支时返回-1
+    int wait();
+
+    // 不挂起：有分支可以立即完成时返回它的下标，否则返回-1
+    int tryOnce();
+
+private:
+    struct Case {
+        ChannelBase* channel;
+        int dir;
+        void* target;
+        bool* ok;
+        // 尝试完成该分支，返回false表示还不能完成
+        bool (*attempt)(ChannelBase* ch, void* target, bool* ok);
+    };
+
+    template<class T>
+    static bool attemptRecv(ChannelBase* ch, void* target, bool* ok) {
+        Channel<T>* c = static_cast<Channel<T>*>(ch);
+        T& out = *static_cast<T*>(target);
+        bool done = c->try_recv(out);
+        // 已关闭时再取一次，关闭前刚放入的元素不会被漏掉；这次取到了按正常收到处理
+        if(!done && c->isClosed()) {
+            done = c->try_recv(out);
+            if(!done) {
+                if(ok) {
+                    *ok = false;
+                }
+                return true;
+            }
+        }
+        if(done && ok) {
+            *ok = true;
+        }
+        return done;
+    }
+
+    template<class T>
+    static bool attemptSend(ChannelBase* ch, void* target, bool* ok) {
+        Channel<T>* c = static_cast<Channel<T>*>(ch);
+        if(c->isClosed()) {
+            if(ok) {
+                *ok = false;
+            }
+            return true;
+        }
+        if(c->try_send(*static_cast<T*>(target))) {
+            if(ok) {
+                *ok = true;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool attemptCase(int index) {
+        Case& c = m_cases[index];
+        return c.attempt && c.attempt(c.channel, c.target, c.ok);
+    }
+
+private:
+    std::vector<Case> m_cases;
+    int m_timeoutIndex = -1;
+    TimerManager* m_timerManager = nullptr;
+    uint64_t m_timeoutMs = 0;
+};
+
+template<class T>
+bool Channel<T>::send(T&& value) {
+    if(try_send(value)) {
+        return true;
+    }
+    if(isClosed()) {
+        return false;
+    }
+    bool ok = false;
+    Select sel;
+    sel.send(*this, value, &ok);
+    sel.wait();
+    return ok;
+}
+
+template<class T>
+bool Channel<T>::recv(T& out) {
+    if(try_recv(out)) {
+        return true;
+    }
+    bool ok = false;
+    Select sel;
+    sel.recv(*this, out, &ok);
+    sel.wait();
+    return ok;
+}
+
+}
+
+#endif
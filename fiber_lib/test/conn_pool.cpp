@@ -0,0 +1,409 @@
+#include "conn_pool.h"
+#include "fd_manager.h"
+#include "hook.h"
+#include "ioscheduler.h"
+#include "resolver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <vector>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <poll.h>
+#include <string.h>
+
+namespace sylar {
+
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 协程恢复后可能换了线程，系统调用、读写 errno 放在单独的（不内联的）函数里
+
+__attribute__((noinline)) static void set_errno(int err) {
+    errno = err;
+}
+
+// 发起连接，返回0或错误码（EINPROGRESS 表示在进行中）
+__attribute__((noinline)) static int connect_start(int fd, const sockaddr* addr, socklen_t addrlen) {
+    int rt;
+    do {
+        rt = connect_f(fd, addr, addrlen);
+    } while(rt == -1 && errno == EINTR);
+    return rt == 0 ? 0: errno;
+}
+
+__attribute__((noinline)) static int socket_error(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt_f(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+        return errno;
+    }
+    return err;
+}
+
+// 空闲连接还能不能用：对端关闭（读到0）、出错、或者有没读的数据（上一次的响应没读完）都不能用
+__attribute__((noinline)) static bool conn_alive(int fd) {
+    char c;
+    ssize_t n = recv_f(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// 同一个端点的不同写法（sin_zero 的内容、多余的长度）得到同一个键
+static std::string endpoint_key(const sockaddr* addr, socklen_t addrlen) {
+    if(addr->sa_family == AF_INET && addrlen >= sizeof(sockaddr_in)) {
+        const sockaddr_in* sin = (const sockaddr_in*)addr;
+        std::string key("4");
+        key.append((const char*)&sin->sin_port, sizeof(sin->sin_port));
+        key.append((const char*)&sin->sin_addr, sizeof(sin->sin_addr));
+        return key;
+    }
+    if(addr->sa_family == AF_INET6 && addrlen >= sizeof(sockaddr_in6)) {
+        const sockaddr_in6* sin6 = (const sockaddr_in6*)addr;
+        std::string key("6");
+        key.append((const char*)&sin6->sin6_port, sizeof(sin6->sin6_port));
+        key.append((const char*)&sin6->sin6_addr, sizeof(sin6->sin6_addr));
+        key.append((const char*)&sin6->sin6_scope_id, sizeof(sin6->sin6_scope_id));
+        return key;
+    }
+    return std::string((const char*)addr, addrlen);
+}
+
+ConnectionPool::ConnectionPool(const Options& options, IOManager* iom)
+    :m_options(options)
+    ,m_iom(iom ? iom: IOManager::GetThis()) {
+    assert(m_iom);
+    if(!m_options.max_active) {
+        m_options.max_active = 1;
+    }
+}
+
+ConnectionPool::ConnectionPool()
+    :ConnectionPool(Options()) {
+}
+
+ConnectionPool::~ConnectionPool() {
+    if(m_evictTimer) {
+        m_evictTimer->cancel();
+    }
+    // 借出的连接持有池，析构时只剩空闲连接，也没有排队的等待者
+    for(auto& it: m_endpoints) {
+        for(const Idle& idle: it.second->idle) {
+            closeConn(idle.fd);
+        }
+    }
+}
+
+PooledConnection ConnectionPool::acquire(const std::string& host, uint16_t port) {
+    std::vector<IpAddr> addrs(1);
+    IpAddr& ip = addrs[0];
+    if(inet_pton(AF_INET, host.c_str(), &ip.v4) == 1) {
+        ip.family = AF_INET;
+    } else if(inet_pton(AF_INET6, host.c_str(), &ip.v6) == 1) {
+        ip.family = AF_INET6;
+    } else if(Resolver::GetDefault()->resolve(host, AF_UNSPEC, addrs) != Resolver::OK || addrs.empty()) {
+        set_errno(EHOSTUNREACH);
+        return PooledConnection();
+    }
+    sockaddr_storage addr;
+    socklen_t addrlen = addrs[0].toSockaddr(port, addr);
+    return acquire((const sockaddr*)&addr, addrlen);
+}
+
+PooledConnection ConnectionPool::acquire(const sockaddr* addr, socklen_t addrlen) {
+    PooledConnection conn;
+    if(addrlen > sizeof(sockaddr_storage)) {
+        set_errno(EINVAL);
+        return conn;
+    }
+    std::string key = endpoint_key(addr, addrlen);
+
+    Endpoint* ep = nullptr;
+    int fd = -1;
+    std::shared_ptr<Waiter> waiter;
+    Semaphore sem;
+    bool in_fiber = Fiber::CanSuspend() && Scheduler::GetThis();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::unique_ptr<Endpoint>& slot = m_endpoints[key];
+        if(!slot) {
+            slot.reset(new Endpoint());
+            memcpy(&slot->addr, addr, addrlen);
+            slot->addrlen = addrlen;
+        }
+        ep = slot.get();
+        if(!ep->idle.empty()) {
+            fd = ep->idle.back().fd;
+            ep->idle.pop_back();
+            --m_stats.idle;
+            ++ep->active;
+            ++m_stats.active;
+        } else if(ep->active < m_options.max_active) {
+            ++ep->active;
+            ++m_stats.active;
+        } else if(m_options.acquire_timeout_ms == 0) {
+            lock.unlock();
+            set_errno(EAGAIN);
+            return conn;
+        } else {
+            // 排队：归还者把连接（或新建的名额）交给队首，借出数不变
+            waiter = std::make_shared<Waiter>();
+            if(in_fiber) {
+                waiter->who.scheduler = Scheduler::GetThis();
+                waiter->who.fiber = Fiber::ptr(Fiber::Current());
+            } else {
+                // 不在调度器的协程中，只能阻塞当前线程
+                waiter->who.sem = &sem;
+            }
+            ep->waiters.push_back(waiter);
+            ++m_stats.waited;
+        }
+    }
+
+    if(waiter) {
+        // 定时器和归还者都在池的锁下检查对方是否已经处理过，只有一方会唤醒等待者
+        if(m_options.acquire_timeout_ms != ~0ull) {
+            std::weak_ptr<ConnectionPool> weak = weak_from_this();
+            waiter->timer = m_iom->addPooledTimer(m_options.acquire_timeout_ms, [weak, waiter, ep]() {
+                ConnectionPool::ptr self = weak.lock();
+                if(!self) {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(self->m_mutex);
+                    if(waiter->granted) {
+                        return;
+                    }
+                    waiter->timed_out = true;
+                    auto it = std::find(ep->waiters.begin(), ep->waiters.end(), waiter);
+                    if(it != ep->waiters.end()) {
+                        ep->waiters.erase(it);
+                    }
+                    ++self->m_stats.wait_timeouts;
+                }
+                waiter->who.wake();
+            });
+        }
+        if(in_fiber) {
+            // 挂起之前就被唤醒也没关系：resume() 会等协程切换出去
+            Fiber::SetWaitReason(Fiber::WAIT_SYNC);
+            Fiber::Current()->yield();
+        } else {
+            sem.wait();
+        }
+        if(waiter->timer) {
+            m_iom->cancelTimer(waiter->timer);
+        }
+        if(waiter->timed_out) {
+            set_errno(EAGAIN);
+            return conn;
+        }
+        fd = waiter->fd;
+    }
+
+    // 从空闲列表（或归还者）得到的连接先检查一次，不能用就换一个空闲的，都不行再新建
+    bool reused = false;
+    while(fd >= 0) {
+        if(conn_alive(fd)) {
+            reused = true;
+            break;
+        }
+        closeConn(fd);
+        fd = -1;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_stats.dropped;
+        if(!ep->idle.empty()) {
+            fd = ep->idle.back().fd;
+            ep->idle.pop_back();
+            --m_stats.idle;
+        }
+    }
+    if(fd < 0) {
+        int err = 0;
+        fd = connect(ep, err);
+        if(fd < 0) {
+            // 名额交给下一个排队的，或者还回去
+            giveBack(ep, -1, false);
+            set_errno(err);
+            return conn;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++(reused ? m_stats.reused: m_stats.created);
+    }
+    conn.m_pool = shared_from_this();
+    conn.m_endpoint = ep;
+    conn.m_fd = fd;
+    conn.m_reused = reused;
+    return conn;
+}
+
+void ConnectionPool::giveBack(Endpoint* ep, int fd, bool reusable) {
+    std::shared_ptr<Waiter> waiter;
+    bool close_fd = fd >= 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(!ep->waiters.empty()) {
+            // 直接交给队首：能复用的连接连同名额一起给它，否则只给名额
+            waiter = ep->waiters.front();
+            ep->waiters.pop_front();
+            waiter->granted = true;
+            if(reusable && fd >= 0) {
+                waiter->fd = fd;
+                close_fd = false;
+            }
+        } else {
+            --ep->active;
+            --m_stats.active;
+            if(reusable && fd >= 0 && ep->idle.size() < m_options.max_idle) {
+                ep->idle.push_back(Idle{fd, now_ms()});
+                ++m_stats.idle;
+                close_fd = false;
+                startEvictTimer();
+            }
+        }
+    }
+    if(close_fd) {
+        closeConn(fd);
+    }
+    if(waiter) {
+        waiter->who.wake();
+    }
+}
+
+int ConnectionPool::connect(const Endpoint* ep, int& err) {
+    int fd = socket_f(ep->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        err = errno;
+        return -1;
+    }
+    // 登记为阻塞语义的socket：用户的 hook 读写照常挂起协程
+    FdMgr::GetInstance()->addSocket(fd, true);
+    err = connect_start(fd, (const sockaddr*)&ep->addr, ep->addrlen);
+    if(err == EINPROGRESS) {
+        uint64_t timeout = m_options.connect_timeout_ms;
+        IOManager* iom = IOManager::GetThis();
+        if(iom) {
+            // 超时返回 ETIMEDOUT，注册失败返回-1
+            int rt = iom->waitEvent(fd, IOManager::WRITE, timeout);
+            err = rt > 0 ? rt: (rt < 0 ? EINVAL: socket_error(fd));
+        } else {
+            pollfd pfd = {fd, POLLOUT, 0};
+            int rt = poll_f(&pfd, 1, timeout == ~0ull ? -1: (int)std::min<uint64_t>(timeout, INT_MAX));
+            err = rt == 0 ? ETIMEDOUT: (rt < 0 ? EINTR: socket_error(fd));
+        }
+    }
+    if(err) {
+        closeConn(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 同 hook 的 close：从 IOManager 注销（ENGINE_EPOLL_ET 下fd会一直注册着），删除fd上下文
+void ConnectionPool::closeConn(int fd) {
+    IOManager* iom = IOManager::GetThis();
+    if(iom) {
+        iom->cancelAll(fd);
+    }
+    FdMgr::GetInstance()->del(fd);
+    close_f(fd);
+}
+
+void ConnectionPool::startEvictTimer() {
+    if(m_evictTimer || !m_options.idle_timeout_ms) {
+        return;
+    }
+    // 空闲连接最多多留半个 idle_timeout_ms
+    uint64_t interval = std::max<uint64_t>(m_options.idle_timeout_ms / 2, 1);
+    m_evictTimer = m_iom->addConditionTimer(interval, [this]() {
+        evictIdle();
+    }, weak_from_this(), true);
+}
+
+void ConnectionPool::evictIdle() {
+    std::vector<int> fds;
+    uint64_t now = now_ms();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(auto it = m_endpoints.begin(); it != m_endpoints.end();) {
+            Endpoint* ep = it->second.get();
+            while(!ep->idle.empty() && ep->idle.front().since_ms + m_options.idle_timeout_ms <= now) {
+                fds.push_back(ep->idle.front().fd);
+                ep->idle.pop_front();
+            }
+            // 没有借出、空闲和排队的端点不再保留
+            if(!ep->active && ep->idle.empty() && ep->waiters.empty()) {
+                it = m_endpoints.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        m_stats.evicted += fds.size();
+        m_stats.idle -= fds.size();
+    }
+    for(int fd: fds) {
+        closeConn(fd);
+    }
+}
+
+void ConnectionPool::clearIdle() {
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(auto& it: m_endpoints) {
+            for(const Idle& idle: it.second->idle) {
+                fds.push_back(idle.fd);
+            }
+            it.second->idle.clear();
+        }
+        m_stats.idle = 0;
+    }
+    for(int fd: fds) {
+        closeConn(fd);
+    }
+}
+
+ConnectionPool::Stats ConnectionPool::getStats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+PooledConnection::PooledConnection(PooledConnection&& other) noexcept
+    :m_pool(std::move(other.m_pool))
+    ,m_endpoint(other.m_endpoint)
+    ,m_fd(other.m_fd)
+    ,m_reused(other.m_reused)
+    ,m_broken(other.m_broken) {
+    other.m_endpoint = nullptr;
+    other.m_fd = -1;
+}
+
+PooledConnection& PooledConnection::operator=(PooledConnection&& other) noexcept {
+    if(this != &other) {
+        release();
+        m_pool = std::move(other.m_pool);
+        m_endpoint = other.m_endpoint;
+        m_fd = other.m_fd;
+        m_reused = other.m_reused;
+        m_broken = other.m_broken;
+        other.m_endpoint = nullptr;
+        other.m_fd = -1;
+    }
+    return *this;
+}
+
+void PooledConnection::release() {
+    if(m_fd < 0) {
+        return;
+    }
+    m_pool->giveBack(m_endpoint, m_fd, !m_broken);
+    m_pool.reset();
+    m_endpoint = nullptr;
+    m_fd = -1;
+    m_broken = false;
+}
+
+}
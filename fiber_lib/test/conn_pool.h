@@ -0,0 +1,166 @@
+#ifndef __SYLAR_CONN_POOL_H__
+#define __SYLAR_CONN_POOL_H__
+
+// 按端点（地址 + 端口）复用的 TCP 连接池
+//
+// 每次请求都经由 hook 的 connect 新建连接要付一次握手，全局的 connect 超时（s_connect_timeout）也不能按目标分别设置。
+// ConnectionPool 为每个端点保存空闲连接，取用时优先复用最近归还的：
+// - 连接超时、每个端点借出的上限（max_active）、保留的空闲连接数（max_idle）都按池设置
+// - 借出数达到上限时挂起当前协程排队，有连接归还（或借出的被关闭）时按先来先得交给队首；可以设置最长等待时间
+// - 空闲超过 idle_timeout_ms 的连接由 IOManager 的定时器定期关闭
+// - 取出空闲连接时先检查一次：对端已经关闭、出错或者还留着未读的数据的连接丢弃，换一个或新建
+//
+// 新连接是非阻塞socket，登记在 FdManager 中，之后 hook 的 read/write 照常挂起协程。
+// 池必须由 shared_ptr 持有（借出的连接持有它）：
+//   auto pool = std::make_shared<sylar::ConnectionPool>(opts);
+//   sylar::PooledConnection conn = pool->acquire("backend.local", 8080);
+//   if(!conn) { ... errno ... }
+//   write(conn.fd(), ...); read(conn.fd(), ...);
+//   // 出错或协议状态不确定时 conn.markBroken()；析构时归还
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "fiber_sync.h"
+#include "timer.h"
+
+namespace sylar {
+
+class IOManager;
+class PooledConnection;
+
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool> {
+public:
+    typedef std::shared_ptr<ConnectionPool> ptr;
+
+    struct Options {
+        // 新建连接的超时
+        uint64_t connect_timeout_ms = 3000;
+        // 每个端点同时借出（包括正在建立）的连接数上限
+        size_t max_active = 32;
+        // 每个端点最多保留的空闲连接数，多出的归还时直接关闭
+        size_t max_idle = 8;
+        // 空闲连接的最长保留时间，0 表示不按时间清理
+        uint64_t idle_timeout_ms = 30000;
+        // 借出数达到上限时最多等多久，~0ull 一直等，0 不等
+        uint64_t acquire_timeout_ms = ~0ull;
+    };
+
+    struct Stats {
+        // 新建的连接数、复用空闲连接的次数
+        uint64_t created = 0;
+        uint64_t reused = 0;
+        // 取出时检查不通过而丢弃的、空闲超时被关闭的空闲连接数
+        uint64_t dropped = 0;
+        uint64_t evicted = 0;
+        // 达到上限排队的次数、排队超时的次数
+        uint64_t waited = 0;
+        uint64_t wait_timeouts = 0;
+        // 当前借出、空闲的连接数（所有端点之和）
+        uint64_t active = 0;
+        uint64_t idle = 0;
+    };
+
+    // iom 为空时使用当前线程的 IOManager，空闲清理的定时器加在它上面
+    explicit ConnectionPool(const Options& options, IOManager* iom = nullptr);
+    ConnectionPool();
+    ~ConnectionPool();
+
+    // 借一个到 addr 的连接。失败时返回空连接并设置 errno：
+    // 连接失败为 connect 的错误（超时为 ETIMEDOUT），排队超时为 EAGAIN
+    PooledConnection acquire(const sockaddr* addr, socklen_t addrlen);
+    // host 为数字地址或域名（经 Resolver 解析，取第一个地址；解析失败时 errno 为 EHOSTUNREACH）
+    PooledConnection acquire(const std::string& host, uint16_t port);
+
+    // 关闭所有空闲连接，借出的不受影响
+    void clearIdle();
+
+    Stats getStats();
+    const Options& getOptions() const { return m_options; }
+
+private:
+    friend class PooledConnection;
+
+    struct Idle {
+        int fd;
+        uint64_t since_ms;
+    };
+
+    // 排队等待的协程（或线程）：被交给已有的连接（fd >= 0）或一个新建连接的名额（fd 为-1）
+    struct Waiter {
+        detail::SyncWaiter who;
+        TimerHandle timer;
+        int fd = -1;
+        bool granted = false;
+        bool timed_out = false;
+    };
+
+    struct Endpoint {
+        sockaddr_storage addr;
+        socklen_t addrlen = 0;
+        // 借出 + 正在建立的连接数
+        size_t active = 0;
+        // 按归还时间排列，取用时取最后一个（最近归还的最可能还活着）
+        std::deque<Idle> idle;
+        std::deque<std::shared_ptr<Waiter>> waiters;
+    };
+
+    // 归还借出的连接
+    void giveBack(Endpoint* ep, int fd, bool reusable);
+    // 新建连接，失败返回-1，错误码放在 err
+    int connect(const Endpoint* ep, int& err);
+    void closeConn(int fd);
+    // 定时器回调：关闭空闲超时的连接
+    void evictIdle();
+    // 在锁内调用：第一次有空闲连接时启动空闲清理的定时器
+    void startEvictTimer();
+
+private:
+    Options m_options;
+    IOManager* m_iom;
+
+    std::mutex m_mutex;
+    // 键为规范化的地址（地址族 + 地址 + 端口）
+    std::unordered_map<std::string, std::unique_ptr<Endpoint>> m_endpoints;
+    std::shared_ptr<Timer> m_evictTimer;
+    Stats m_stats;
+};
+
+// 从池中借出的一个连接，只能移动；析构（或 release）时归还给池
+class PooledConnection {
+public:
+    PooledConnection() {}
+    PooledConnection(PooledConnection&& other) noexcept;
+    PooledConnection& operator=(PooledConnection&& other) noexcept;
+    PooledConnection(const PooledConnection&) = delete;
+    PooledConnection& operator=(const PooledConnection&) = delete;
+    ~PooledConnection() { release(); }
+
+    int fd() const { return m_fd; }
+    explicit operator bool() const { return m_fd >= 0; }
+    // 是否复用了池中的空闲连接（否则是新建的）
+    bool isReused() const { return m_reused; }
+
+    // 连接不能再用（读写出错、响应没有读完）：归还时关闭，不放回空闲列表
+    void markBroken() { m_broken = true; }
+
+    // 提前归还，之后 fd() 为-1
+    void release();
+
+private:
+    friend class ConnectionPool;
+    std::shared_ptr<ConnectionPool> m_pool;
+    ConnectionPool::Endpoint* m_endpoint = nullptr;
+    int m_fd = -1;
+    bool m_reused = false;
+    bool m_broken = false;
+};
+
+}
+
+#endif
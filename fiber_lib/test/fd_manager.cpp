@@ -1,9 +1,14 @@
 #include "fd_manager.h"
 #include "hook.h"
+#include "ioscheduler.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <string.h>
+#include <thread>
 
 namespace sylar {
 // instantiate
@@ -61,8 +66,35 @@ FdCtx::FdCtx(int fd):m_fd(fd) {
     init();
 }
 
+void FdCtx::reset(int fd) {
+    clear(fd);
+    init();
+}
+
+void FdCtx::resetSocket(int fd, bool stream) {
+    clear(fd);
+    m_isInit = true;
+    m_isSocket = true;
+    m_isStream = stream;
+    m_sysNonblock = true;
+}
+
+void FdCtx::clear(int fd) {
+    closeErrqueueFd();
+    m_zerocopy = 0;
+    m_isInit = false;
+    m_isSocket = false;
+    m_isStream = false;
+    m_sysNonblock = false;
+    m_userNonblock = false;
+    m_isClosed = false;
+    m_fd = fd;
+    m_recvTimeout = (uint64_t)-1;
+    m_sendTimeout = (uint64_t)-1;
+}
+
 FdCtx::~FdCtx() {
-    // Destructor implementation needed
+    closeErrqueueFd();
 }
 
 bool FdCtx::init() {
@@ -121,6 +153,10 @@ O_NONBLOCK标志表示非阻塞模式。
         }
         // hook 非阻塞设置成功
         m_sysNonblock = true;
+
+        int type = 0;
+        socklen_t type_len = sizeof(type);
+        m_isStream = getsockopt(m_fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_STREAM;
     } else {
         // 如果不是一个 socket 那就没必要设置非阻塞了。
         m_sysNonblock = false;
@@ -153,60 +189,140 @@ uint64_t FdCtx::getTimeout(int type) {
     }
 }
 
-FdManager::FdManager() {
-    m_datas.resize(64);
+bool FdCtx::enableZerocopy() {
+    if(!m_zerocopy) {
+        int one = 1;
+        m_zerocopy = setsockopt_f(m_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1: -1;
+    }
+    return m_zerocopy > 0;
+}
+
+int FdCtx::getErrqueueFd() {
+    int cur = m_errqueueFd.load(std::memory_order_acquire);
+    if(cur >= 0) {
+        return cur;
+    }
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if(efd < 0) {
+        return -1;
+    }
+    // 不关注读写，EPOLLERR 总会报告；边沿触发，已经取过的错误或挂断不会一直让它可读
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLET;
+    if(epoll_ctl(efd, EPOLL_CTL_ADD, m_fd, &ev)) {
+        close_f(efd);
+        return -1;
+    }
+    // 同时第一次用到的几方各自创建，只有CAS成功的一个发布出去；其余的关掉自己的，
+    // 它们还没有交给任何人，也没有注册到 IOManager
+    if(!m_errqueueFd.compare_exchange_strong(cur, efd, std::memory_order_acq_rel)) {
+        close_f(efd);
+        return cur;
+    }
+    return efd;
+}
+
+void FdCtx::closeErrqueueFd() {
+    int efd = m_errqueueFd.exchange(-1, std::memory_order_acq_rel);
+    if(efd < 0) {
+        return;
+    }
+    // 在 IOManager 里注册过：先让它忘掉这个fd，fd号复用时不会沿用旧的状态
+    IOManager* iom = IOManager::GetThis();
+    if(iom) {
+        iom->cancelAll(efd);
+    }
+    close_f(efd);
+}
+
+FdManager::FdManager(): m_chunks(new std::atomic<FdCtx*>[FD_MAX_CHUNKS]) {
+    for(size_t i = 0; i < FD_MAX_CHUNKS; ++i) {
+        m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+FdManager::~FdManager() {
+    for(size_t i = 0; i < FD_MAX_CHUNKS; ++i) {
+        delete[] m_chunks[i].load(std::memory_order_relaxed);
+    }
+}
+
+FdCtx* FdManager::get(int fd, bool auto_create) {
+    return lookup(fd, auto_create, -1);
+}
+
+FdCtx* FdManager::addSocket(int fd, bool stream) {
+    return lookup(fd, true, stream);
 }
 
-std::shared_ptr<FdCtx> FdManager::get(int fd, bool auto_create) {
-    if(fd == -1) {
+FdCtx* FdManager::lookup(int fd, bool auto_create, int stream) {
+    if(fd < 0 || (size_t)fd >= FD_CHUNK_SIZE * FD_MAX_CHUNKS) {
         //文件描述符无效则直接返回。
         return nullptr;
     }
 
-    // std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-    std::lock_guard<std::recursive_mutex> lock(m_mutex);
-
-    //如果 fd 超出了 m_datas 的范围，并且 auto_create 为 false，则返回 nullptr，表示没有创建新对象的需求。
-    /*
+    size_t idx = (size_t)fd >> FD_CHUNK_SHIFT;
+    // acquire 与发布新块时的 release 配对
+    FdCtx* chunk = m_chunks[idx].load(std::memory_order_acquire);
+    if(!chunk) {
+        /*
         bool auto_create：
         是否在找不到对应的 FdCtx 对象时自动创建。
         为 true 时找不到就创建。
         为 false 时找不到就返回空指针。
         */
-    if ((int)m_datas.size() > fd) {
-        if (m_datas[fd] || !auto_create) {
-            return m_datas[fd];
+        if(!auto_create) {
+            return nullptr;
+        }
+        // 多个线程同时分配同一块时只有一个能发布成功，其余的丢弃自己的，用已发布的那块
+        FdCtx* fresh = new FdCtx[FD_CHUNK_SIZE];
+        if(m_chunks[idx].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            chunk = fresh;
+        } else {
+            delete[] fresh;
         }
     }
 
-    if (!auto_create) {
+    FdCtx* ctx = &chunk[fd & (FD_CHUNK_SIZE - 1)];
+    // acquire 与初始化完成时的 release 配对，看到 READY 时各字段已经写好
+    uint8_t state = ctx->m_state.load(std::memory_order_acquire);
+    if(state == FdCtx::READY && stream < 0) {
+        return ctx;
+    }
+    // 正在初始化时不等待：init() 里的 fcntl 会经过 hook 再来查同一个fd
+    if(!auto_create) {
         return nullptr;
     }
-
-    //当fd的大小超出m_data.size的值也就是m_datas[fd]数组中没找到对应的fd并且auto_create为true时候会走到这里。
-    // 由于接下来要修改数据，因此必须释放读锁，避免死锁。
-    // read_lock.unlock();
-
-    // 加写锁，修改数据：
-    // std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-
-    // 扩容并创建新的FdCtx
-    m_datas.resize(fd * 1.5);
-    if (!m_datas[fd]) {
-        m_datas[fd] = std::make_shared<FdCtx>(fd);
+    for(;;) {
+        // addSocket 时fd刚由内核分配，残留的 READY 也要重新初始化
+        bool claimable = state == FdCtx::EMPTY || (state == FdCtx::READY && stream >= 0);
+        if(claimable && ctx->m_state.compare_exchange_weak(state, FdCtx::INITIALIZING, std::memory_order_acquire)) {
+            if(stream < 0) {
+                ctx->reset(fd);
+            } else {
+                ctx->resetSocket(fd, stream);
+            }
+            ctx->m_state.store(FdCtx::READY, std::memory_order_release);
+            return ctx;
+        }
+        if(state == FdCtx::READY && stream < 0) {
+            return ctx;
+        }
+        // 另一个线程正在创建同一个fd的上下文，很快就会完成
+        if(state == FdCtx::INITIALIZING) {
+            std::this_thread::yield();
+        }
+        state = ctx->m_state.load(std::memory_order_acquire);
     }
-    return m_datas[fd];
 }
 
 void FdManager::del(int fd) {
-    // std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-    // if(m_datas.size() <= fd) {
-    //     return;
-    // }
-    // m_datas[fd].reset();
-    std::lock_guard<std::recursive_mutex> lock(m_mutex);
-    if ((int)m_datas.size() > fd) {
-        m_datas[fd].reset();
+    FdCtx* ctx = get(fd, false);
+    if(ctx) {
+        ctx->closeErrqueueFd();
+        uint8_t state = FdCtx::READY;
+        ctx->m_state.compare_exchange_strong(state, FdCtx::EMPTY, std::memory_order_release, std::memory_order_relaxed);
     }
 }
 
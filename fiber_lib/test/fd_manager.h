@@ -2,43 +2,57 @@
 #define _FD_MANAGER_H_
 
 #include <memory>
+#include <atomic>
+#include <cstdint>
 #include <shared_mutex>
 #include "thread.h"
 
 namespace sylar {
 // fd info
-class FdCtx: public std::enable_shared_from_this<FdCtx> {
+// 放在 FdManager 按块分配的表里、原地复用：fd 关闭后再打开时重新初始化同一个对象，不会被释放
+class FdCtx {
+friend class FdManager;
 private:
+    // 表中槽位的状态：空、正在初始化、可用。只由 FdManager 读写
+    enum State {
+        EMPTY = 0,
+        INITIALIZING = 1,
+        READY = 2,
+    };
+    // 字段按大小排列，整个对象32字节，一个缓存行放两个
+    std::atomic<uint8_t> m_state{EMPTY};
     //标记文件描述符是否已初始化。
     bool m_isInit = false;
-
     //标记文件描述符是否是一个套接字。
     bool m_isSocket = false;
-
+    //标记是否是流式socket（SOCK_STREAM），读写不足说明缓冲区已经读空/写满
+    bool m_isStream = false;
     //标记文件描述符是否设置为系统非阻塞模式
     bool m_sysNonblock = false;
-
     //标记文件描述符是否设置为用户非阻塞模式
     bool m_userNonblock = false;
-
     //标记文件描述符是否已关闭。
     bool m_isClosed = false; 
-
+    // SO_ZEROCOPY：0 还没试过，1 已开启，-1 不支持（如 AF_UNIX）
+    int8_t m_zerocopy = 0;
     //文件描述符的整数值
-    int m_fd;
-
+    int m_fd = -1;
+    // 等待 MSG_ZEROCOPY 完成通知用的 epoll fd（只关注这个socket的 EPOLLERR），第一次用到时创建并用CAS发布
+    std::atomic<int> m_errqueueFd{-1};
     // read event timeout
     //读事件的超时时间，默认为 -1 表示没有超时限制。
     uint64_t m_recvTimeout = (uint64_t)-1;
-
     // write event timeout
     //写事件的超时时间，默认为 -1 表示没有超时限制。
     uint64_t m_sendTimeout = (uint64_t)-1;
-
 public:
+    FdCtx() = default;
     FdCtx(int fd);
     ~FdCtx();
 
+    // 在原处重新初始化为 fd 的上下文（fd 被关闭后号码又被复用）
+    void reset(int fd);
+
     //初始化 FdCtx 对象。
     bool init();
     bool isInit() const {
@@ -49,6 +63,10 @@ public:
         return m_isSocket;
     }
 
+    bool isStream() const {
+        return m_isStream;
+    }
+
     bool isClosed() const {
         return m_isClosed;
     }
@@ -74,27 +92,53 @@ public:
     //设置和获取超时时间，type 用于区分读事件和写事件的超时设置，v表示时间毫秒。
 	void setTimeout(int type, uint64_t v);
 	uint64_t getTimeout(int type);
+
+    // 开启 SO_ZEROCOPY（只试一次），返回是否可以用 MSG_ZEROCOPY 发送
+    bool enableZerocopy();
+
+    // socket 的错误队列有新消息（完成通知）时变为可读的 epoll fd，失败返回-1。
+    // 多个线程同时第一次调用时都返回同一个fd
+    int getErrqueueFd();
+
+private:
+    // 关闭 getErrqueueFd() 创建的fd
+    void closeErrqueueFd();
+
+    // 重新初始化为已知已经是非阻塞的socket，不调用 fstat/fcntl/getsockopt
+    void resetSocket(int fd, bool stream);
+
+    // 恢复为 fd 的初始状态（未初始化）
+    void clear(int fd);
 };
+static_assert(sizeof(FdCtx) == 32, "FdCtx should stay at two per cache line");
 
 // 文件描述符管理器，维护多个FdCtx对象，并提供对fd上下文的查询、创建、删除功能。
+// 与 IOManager 的 FdContext 表相同的两级结构：查找是一次原子读加下标运算，不加锁，也不增减引用计数
 class FdManager {
 public:
     //构造函数
     //获取指定文件描述符的 FdCtx 对象。如果 auto_create 为 true，在不存在时自动创建新的 FdCtx 对象。
+    // 返回的指针一直有效（对象不会被释放），但 del() 之后同一个fd再创建时会被重新初始化
     FdManager();
-    std::shared_ptr<FdCtx> get(int fd, bool auto_create = false);
+    ~FdManager();
+    FdCtx* get(int fd, bool auto_create = false);
+
+    // 登记一个刚创建、已经是非阻塞的socket（socket/accept4 带 SOCK_NONBLOCK），不再探测fd的类型和状态。
+    // fd号上残留的旧上下文（之前的fd没有经过 hook 的 close 就被关闭了）会被覆盖
+    FdCtx* addSocket(int fd, bool stream);
 
     //删除指定文件描述符的 FdCtx 对象  
     void del(int fd);
 
 private:
-    //用于保护对 m_datas 的访问，支持共享读锁和独占写锁。
-    // std::shared_mutex m_mutex;
-    // std::recursive_mutex允许同一线程多次获得锁，而不会造成死锁
-    std::recursive_mutex m_mutex;
-
-    //存储所有 FdCtx 对象的共享指针。
-    std::vector<std::shared_ptr<FdCtx>> m_datas;
+    // get/addSocket 的实现：stream < 0 时按 get 处理，否则按 addSocket
+    FdCtx* lookup(int fd, bool create, int stream);
+
+    // 顶层是固定长度的原子指针数组，每一项指向连续分配的 FD_CHUNK_SIZE 个 FdCtx，用CAS发布，已有的块不动
+    static const size_t FD_CHUNK_SHIFT = 9;
+    static const size_t FD_CHUNK_SIZE = (size_t)1 << FD_CHUNK_SHIFT;
+    static const size_t FD_MAX_CHUNKS = 8192;   // 最多 4M 个fd
+    std::unique_ptr<std::atomic<FdCtx*>[]> m_chunks;
 };
 
 template<typename T>
@@ -1,6 +1,18 @@
 #include "fiber.h"
-
-static bool debug = false;
+#include "fiber_local.h"
+#include "fiber_stack.h"
+#include "log.h"
+#include "metrics.h"
+#include "probe.h"
+#include "thread.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <sys/mman.h>
+#include <vector>
 
 namespace sylar {
 // 当前线程上的协程控制信息
@@ -8,7 +20,7 @@ namespace sylar {
 // 正在运行的协程
 static thread_local Fiber* t_fiber = nullptr;
 // 主协程
-static thread_local std::shared_ptr<Fiber> t_thread_fiber = nullptr;
+static thread_local Fiber::ptr t_thread_fiber = nullptr;
 // 调度协程
 static thread_local Fiber* t_scheduler_fiber = nullptr;
 
@@ -18,35 +30,377 @@ static std::atomic<uint64_t> s_fiber_id{0};
 // 协程计数器
 static std::atomic<uint64_t> s_fiber_count{0};
 
+// 全局登记表：所有还没有析构的协程，按id分片，每片一个侵入式双向链表。
+// 只在创建、析构（以及 reset 换栈）时加锁一次；调度器缓存复用协程，不会每个任务都加锁
+struct RegistryShard {
+    std::mutex mutex;
+    Fiber* head = nullptr;
+};
+
+static const size_t REGISTRY_SHARDS = 16;
+
+static RegistryShard& registry_shard(uint64_t id) {
+    // 不析构：线程退出时析构的协程还要从登记表移除
+    static RegistryShard* shards = new RegistryShard[REGISTRY_SHARDS];
+    return shards[id % REGISTRY_SHARDS];
+}
+
+// 栈染色
+static const uint64_t STACK_PAINT = 0xA5A5A5A5A5A5A5A5ull;
+static std::atomic<bool> s_stack_painting{false};
+static std::atomic<size_t> s_stack_hw_max{0};
+
+static void record_high_water(size_t hw) {
+    size_t cur = s_stack_hw_max.load(std::memory_order_relaxed);
+    while(hw > cur && !s_stack_hw_max.compare_exchange_weak(cur, hw, std::memory_order_relaxed)) {
+    }
+}
+
+// 共享栈
+// 同一时刻只有一个协程（owner）的栈内容驻留在共享栈上，其余协程的栈内容保存在各自的私有缓冲区中；
+// 只有当另一个协程要切入时才把 owner 换出，连续切回同一个协程不需要拷贝。
+struct SharedStack {
+    void* stack = nullptr;
+    size_t size = 0;
+    int kind = 0;
+    // 当前驻留在栈上的协程
+    Fiber* owner = nullptr;
+    // 协程可能在其他线程析构，析构时需要清除owner
+    std::mutex mutex;
+
+    ~SharedStack() {
+        StackPool::Free(stack, size, kind);
+    }
+};
+
+static std::atomic<size_t> s_shared_stack_count{4};
+static std::atomic<size_t> s_shared_stack_size{1024 * 1024};
+
+// 本线程的共享栈，轮流分配给新运行的共享栈协程
+static thread_local std::vector<std::shared_ptr<SharedStack>> t_shared_stacks;
+static thread_local size_t t_shared_stack_next = 0;
+
+static std::shared_ptr<SharedStack> pick_shared_stack() {
+    if(t_shared_stacks.empty()) {
+        size_t count = std::max<size_t>(s_shared_stack_count, 1);
+        for(size_t i = 0; i < count; ++i) {
+            std::shared_ptr<SharedStack> ss = std::make_shared<SharedStack>();
+            ss->size = s_shared_stack_size;
+            ss->stack = StackPool::Alloc(ss->size, ss->kind);
+            if(!ss->stack) {
+                SYLAR_LOG_ERROR() << "pick_shared_stack(): alloc stack failed, size = " << ss->size;
+                pthread_exit(NULL);
+            }
+            t_shared_stacks.push_back(ss);
+        }
+    }
+    return t_shared_stacks[t_shared_stack_next++ % t_shared_stacks.size()];
+}
+
+void Fiber::SetSharedStackConfig(size_t count, size_t size) {
+    s_shared_stack_count = count;
+    s_shared_stack_size = size;
+}
+
+// 正在调度协程的栈上内联执行回调任务
+static thread_local bool t_inline_task = false;
+
+void Fiber::SetInlineTask(bool flag) {
+    t_inline_task = flag;
+}
+
+bool Fiber::InInlineTask() {
+    return t_inline_task;
+}
+
+bool Fiber::CanSuspend() {
+    return !t_inline_task && t_fiber && t_fiber != t_thread_fiber.get() && t_fiber != t_scheduler_fiber && t_fiber->m_runInScheduler;
+}
+
+size_t Fiber::BoundFiberCount() {
+    // 除了本线程的列表，每个引用都来自一个第一次运行时绑定到该共享栈的协程
+    size_t n = 0;
+    for(auto& ss: t_shared_stacks) {
+        n += ss.use_count() - 1;
+    }
+    return n;
+}
+
+void Fiber::SetWaitReason(WaitReason reason, uint64_t arg) {
+    Fiber* f = t_fiber;
+    if(!f) {
+        return;
+    }
+    f->m_waitArg.store(arg, std::memory_order_relaxed);
+    f->m_waitSince.store(MonotonicNs(), std::memory_order_relaxed);
+    f->m_waitReason.store(reason, std::memory_order_relaxed);
+}
+
+const char* Fiber::WaitReasonName(WaitReason reason) {
+    switch(reason) {
+        case WAIT_NONE: return "none";
+        case WAIT_IO: return "io";
+        case WAIT_TIMER: return "timer";
+        case WAIT_CHANNEL: return "channel";
+        case WAIT_SYNC: return "sync";
+        case WAIT_OFFLOAD: return "offload";
+        default: return "unknown";
+    }
+}
+
+void Fiber::registerSelf() {
+    RegistryShard& shard = registry_shard(m_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    m_regPrev = nullptr;
+    m_regNext = shard.head;
+    if(shard.head) {
+        shard.head->m_regPrev = this;
+    }
+    shard.head = this;
+}
+
+void Fiber::unregisterSelf() {
+    RegistryShard& shard = registry_shard(m_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if(m_regPrev) {
+        m_regPrev->m_regNext = m_regNext;
+    } else {
+        shard.head = m_regNext;
+    }
+    if(m_regNext) {
+        m_regNext->m_regPrev = m_regPrev;
+    }
+    m_regPrev = m_regNext = nullptr;
+}
+
+void Fiber::paintStack() {
+    memset(m_stack, 0xA5, m_stacksize);
+    m_painted = true;
+}
+
+size_t Fiber::paintedHighWater() const {
+    if(!m_painted || !m_stack) {
+        return 0;
+    }
+    // 栈从高地址向低地址增长：从栈底往上第一个被改写的字就是用到的最深处
+    const uint64_t* p = (const uint64_t*)m_stack;
+    const uint64_t* end = (const uint64_t*)((char*)m_stack + m_stacksize);
+    while(p < end && *(const volatile uint64_t*)p == STACK_PAINT) {
+        ++p;
+    }
+    return (char*)end - (char*)p;
+}
+
+void Fiber::fillInfo(Info& info, uint64_t now) const {
+    info.id = m_id;
+    info.state = m_state;
+    info.wait = (WaitReason)m_waitReason.load(std::memory_order_relaxed);
+    if(info.wait != WAIT_NONE) {
+        info.wait_arg = m_waitArg.load(std::memory_order_relaxed);
+        uint64_t since = m_waitSince.load(std::memory_order_relaxed);
+        info.wait_ns = now > since ? now - since: 0;
+    }
+    info.shared = m_shared;
+    info.bound_thread = m_boundThread;
+    info.owner = m_owner.load(std::memory_order_relaxed);
+    if(m_shared) {
+        info.save_bytes = m_saveCap;
+        info.stack_high_water = m_saveLen;
+        return;
+    }
+    if(!m_stack) {
+        return;
+    }
+    info.stack_size = m_stacksize;
+    // 驻留的页：mincore 要求起始地址按页对齐，堆上的栈首尾两页可能和相邻的内存共用
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = (uintptr_t)m_stack & ~(page - 1);
+    uintptr_t hi = (uintptr_t)m_stack + m_stacksize;
+    size_t pages = (hi - lo + page - 1) / page;
+    std::vector<unsigned char> vec(pages);
+    if(mincore((void*)lo, hi - lo, vec.data()) == 0) {
+        size_t lowest = pages;
+        for(size_t i = 0; i < pages; ++i) {
+            if(vec[i] & 1) {
+                info.stack_resident += page;
+                if(lowest == pages) {
+                    lowest = i;
+                }
+            }
+        }
+        info.stack_resident = std::min<size_t>(info.stack_resident, m_stacksize);
+        if(lowest != pages) {
+            info.stack_high_water = hi - std::max<uintptr_t>(lo + lowest * page, (uintptr_t)m_stack);
+        }
+    }
+    if(m_painted) {
+        info.stack_high_water = paintedHighWater();
+    }
+}
+
+void Fiber::Snapshot(std::vector<Info>& out, const void* owner) {
+    uint64_t now = MonotonicNs();
+    for(size_t i = 0; i < REGISTRY_SHARDS; ++i) {
+        RegistryShard& shard = registry_shard(i);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for(Fiber* f = shard.head; f; f = f->m_regNext) {
+            if(owner && f->m_owner.load(std::memory_order_relaxed) != owner) {
+                continue;
+            }
+            out.emplace_back();
+            f->fillInfo(out.back(), now);
+        }
+    }
+}
+
+void Fiber::ClearOwner(const void* owner) {
+    for(size_t i = 0; i < REGISTRY_SHARDS; ++i) {
+        RegistryShard& shard = registry_shard(i);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for(Fiber* f = shard.head; f; f = f->m_regNext) {
+            const void* expected = owner;
+            f->m_owner.compare_exchange_strong(expected, nullptr, std::memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t Fiber::TotalFibers() {
+    return s_fiber_count.load(std::memory_order_relaxed);
+}
+
+void Fiber::SetStackPainting(bool on) {
+    s_stack_painting.store(on, std::memory_order_relaxed);
+}
+
+bool Fiber::IsStackPainting() {
+    return s_stack_painting.load(std::memory_order_relaxed);
+}
+
+size_t Fiber::StackHighWaterMax() {
+    return s_stack_hw_max.load(std::memory_order_relaxed);
+}
+
 void Fiber::SetThis(Fiber* f) {
     t_fiber = f;
 }
 
 // 首先运行该函数创建主协程
-// 获取当前线程正在运行的协程（Fiber）实例的 shared_ptr
-std::shared_ptr<Fiber> Fiber::GetThis() {
+// 获取当前线程正在运行的协程（Fiber）实例，返回的 Fiber::ptr 持有一个引用
+Fiber::ptr Fiber::GetThis() {
+    // 引用计数在对象内部，直接从裸指针构造即可，计数+1
+    return Fiber::ptr(Current());
+}
+
+Fiber* Fiber::Current() {
     if(t_fiber) {
-        // std::cout << "ss"<< std::endl;
-        // std::shared_from_this() 是 std::enable_shared_from_this 类模板的一部分。它使得一个类的成员函数能够安全地生成一个指向当前对象的 std::shared_ptr，并且增加该对象的引用计数。shared_from_this() 的核心作用是生成一个 shared_ptr，并通过该 shared_ptr 增加对象的引用计数，从而管理对象的生命周期。
-        return t_fiber->shared_from_this();
+        return t_fiber;
     }
-    // std::cout << "kk" << std::endl;
     // new Fiber() 会调用私有构造函数（只允许在此内部创建），表示主协程专属构造路径。
-    std::shared_ptr<Fiber> main_fiber(new Fiber());
-    t_thread_fiber = main_fiber;
+    // 主协程由 t_thread_fiber 持有
+    t_thread_fiber.reset(new Fiber());
 
     // 除非主动设置 主协程默认为调度协程
-    // get() 函数是C++标准库中智能指针（如 std::shared_ptr 或 std::unique_ptr）的成员函数，用于获取指向对象的原始指针
-    t_scheduler_fiber = main_fiber.get();
+    t_scheduler_fiber = t_thread_fiber.get();
 
-    assert(t_fiber == main_fiber.get());
-    return t_fiber->shared_from_this();
+    assert(t_fiber == t_thread_fiber.get());
+    return t_fiber;
 }
 
 void Fiber::SetSchedulerFiber(Fiber* f) {
     t_scheduler_fiber = f;
 }
 
+CancelContext* Fiber::CurrentCancelContext() {
+    return t_fiber ? t_fiber->m_cancel.get(): nullptr;
+}
+
+const char* Fiber::CurrentLabel() {
+    return t_fiber ? t_fiber->getLabel(): nullptr;
+}
+
+bool Fiber::SampleCurrent(Sample& out) {
+    Fiber* f = t_fiber;
+    if(!f) {
+        return false;
+    }
+    out.label = f->getLabel();
+    out.task = !t_inline_task && f != t_thread_fiber.get() && f != t_scheduler_fiber;
+    if(f->m_stack) {
+        out.stack_lo = (const char*)f->m_stack;
+        out.stack_hi = out.stack_lo + f->m_stacksize;
+    } else if(f->m_shared && f->m_sharedStack) {
+        out.stack_lo = (const char*)f->m_sharedStack->stack;
+        out.stack_hi = out.stack_lo + f->m_sharedStack->size;
+    } else {
+        out.stack_lo = out.stack_hi = nullptr;
+    }
+    return true;
+}
+
+void* Fiber::GetLocal(uint32_t index) {
+    Fiber* f = t_fiber;
+    if(!f) {
+        return nullptr;
+    }
+    if(index < INLINE_LOCALS) {
+        return f->m_locals[index];
+    }
+    index -= INLINE_LOCALS;
+    return index < f->m_localsExtCap ? f->m_localsExt[index]: nullptr;
+}
+
+void* Fiber::SetLocal(uint32_t index, void* value) {
+    Fiber* f = Current();
+    void** slot;
+    if(index < INLINE_LOCALS) {
+        slot = &f->m_locals[index];
+    } else {
+        index -= INLINE_LOCALS;
+        if(index >= f->m_localsExtCap) {
+            if(!value) {
+                return nullptr;
+            }
+            // 一次扩到当前所有的键，之后这个协程不会再扩
+            uint32_t cap = std::max(FiberLocalKey::KeyCount() - INLINE_LOCALS, index + 1);
+            void** ext = (void**)realloc(f->m_localsExt, cap * sizeof(void*));
+            if(!ext) {
+                abort();
+            }
+            std::fill(ext + f->m_localsExtCap, ext + cap, nullptr);
+            f->m_localsExt = ext;
+            f->m_localsExtCap = cap;
+        }
+        slot = &f->m_localsExt[index];
+    }
+    void* old = *slot;
+    *slot = value;
+    return old;
+}
+
+void Fiber::clearLocals() {
+    // 析构函数可能又设置了别的值，与 pthread 的 TSD 一样最多重复几轮
+    for(int round = 0; round < 4; ++round) {
+        bool any = false;
+        uint32_t total = INLINE_LOCALS + m_localsExtCap;
+        for(uint32_t i = 0; i < total; ++i) {
+            void*& slot = i < INLINE_LOCALS ? m_locals[i]: m_localsExt[i - INLINE_LOCALS];
+            if(!slot) {
+                continue;
+            }
+            void* value = slot;
+            slot = nullptr;
+            any = true;
+            if(FiberLocalKey::Destructor dtor = FiberLocalKey::GetDestructor(i)) {
+                dtor(value);
+            }
+        }
+        if(!any) {
+            break;
+        }
+    }
+    // 溢出区留给复用的协程
+}
+
 uint64_t Fiber::GetFiberId() {
     // 正常情况：返回当前协程的 ID；
     if(t_fiber) {
@@ -61,8 +415,8 @@ Fiber::Fiber() {
     m_state = RUNNING;
 
     // 成功时，m_ctx 就保存了当前线程主函数的执行状态；
-    if(getcontext(&m_ctx)) {
-        std::cerr<< "Fiber() failed\n";
+    if(!context_init_main(&m_ctx)) {
+        SYLAR_LOG_ERROR() << "Fiber() failed";
         pthread_exit(NULL);
     }
 
@@ -73,76 +427,147 @@ Fiber::Fiber() {
     // s_fiber_count 是静态变量，表示当前存活的 Fiber 总数量；
     // 便于监控或调试内存泄漏（是否有 Fiber 没有释放）；
     ++s_fiber_count;
-    if(debug) {
-        std::cout << "Fiber(): main id = " << m_id << std::endl;
-    }
+    registerSelf();
+    SYLAR_LOG_DEBUG() << "Fiber(): main id = " << m_id;
 }
 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
-    : m_cb(cb), m_runInScheduler(run_in_scheduler) {
+Fiber::Fiber(Callback cb, size_t stacksize, bool run_in_scheduler, int stack_flags)
+    : m_cb(std::move(cb)), m_runInScheduler(run_in_scheduler) {
         m_state = READY;
+        m_label.store(CurrentLabel(), std::memory_order_relaxed);
+
+#if SYLAR_FIBER_ASM_CONTEXT
+        if(stack_flags & STACK_SHARED) {
+            // 共享栈协程不分配私有栈，上下文推迟到第一次运行时在共享栈上构造
+            m_shared = true;
+            m_id = s_fiber_id++;
+            ++s_fiber_count;
+            registerSelf();
+            SYLAR_TRACE(TRACE_FIBER_CREATE, m_id, stack_flags);
+            SYLAR_LOG_DEBUG() << "Fiber(): shared child id = " << m_id;
+            return;
+        }
+#endif
 
         // 分配协程栈空间
-        // 协程栈的大小，单位为字节。如果用户没有指定（传入0），则使用默认大小128000字节（约128KB）
-        m_stacksize = stacksize ? stacksize: 128000;
-        m_stack = malloc(m_stacksize);
+        // 协程栈的大小，单位为字节。如果用户没有指定（传入0），则使用栈池的默认大小
+        // （堆栈为128000字节约128KB，mmap栈为1MB虚拟空间）
+        // 栈从StackPool中取，大小会被向上取整到栈池的尺寸等级
+        size_t size = stacksize ? stacksize: StackPool::DefaultStackSize();
+        m_stack = StackPool::Alloc(size, m_stackKind, stack_flags & STACK_HUGE_PAGES);
+        if(!m_stack) {
+            SYLAR_LOG_ERROR() << "Fiber(): alloc stack failed, size = " << size;
+            pthread_exit(NULL);
+        }
+        m_stacksize = size;
+        if(s_stack_painting.load(std::memory_order_relaxed)) {
+            paintStack();
+        }
 
-        // 调用getcontext(&m_ctx)，保存当前执行上下文到m_ctx结构体中。
-        if(getcontext(&m_ctx)) {
-            std::cerr << "Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler) failed\n";
+        // 在协程栈上构造上下文，入口为Fiber::MainFunc，此时上下文创建完成，当协程首次切换执行时，就会调用Fiber::MainFunc
+        if(!context_make(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc)) {
+            SYLAR_LOG_ERROR() << "Fiber(Callback cb, size_t stacksize, bool run_in_scheduler) failed";
 		    pthread_exit(NULL);
         }
 
-        m_ctx.uc_link = nullptr;
-        // 指定协程上下文的栈空间起始地址。
-        m_ctx.uc_stack.ss_sp = m_stack;
-        m_ctx.uc_stack.ss_size = m_stacksize;
-        // 使用makecontext函数，将m_ctx上下文设置为执行函数Fiber::MainFunc，此时上下文创建完成，当协程首次切换执行时，就会调用Fiber::MainFunc
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
-
         m_id = s_fiber_id++;
         ++s_fiber_count;
-        if(debug) {
-            std::cout << "Fiber(): child id = " << m_id << std::endl;
-        }
+        registerSelf();
+        SYLAR_TRACE(TRACE_FIBER_CREATE, m_id, stack_flags);
+        SYLAR_LOG_DEBUG() << "Fiber(): child id = " << m_id;
     }
 
 Fiber::~Fiber() {
     --s_fiber_count;
+    // 先移出登记表，Snapshot 不会再读到即将释放的栈
+    unregisterSelf();
+    if(m_painted) {
+        record_high_water(paintedHighWater());
+    }
+    if(m_sharedStack) {
+        std::lock_guard<std::mutex> lock(m_sharedStack->mutex);
+        if(m_sharedStack->owner == this) {
+            m_sharedStack->owner = nullptr;
+        }
+    }
+    // 没有正常结束的协程（线程主协程、挂起时被丢弃的协程）在这里析构它的局部值
+    clearLocals();
+    free(m_localsExt);
+    free(m_saveBuf);
     if(m_stack) {
-        free(m_stack);
+        // 归还给栈池，供后续的Fiber复用
+        StackPool::Free(m_stack, m_stacksize, m_stackKind);
     }
 
-    if(debug) {
-        std::cout << "~Fiber(): id = " << m_id << std::endl;	
-    }
+    SYLAR_LOG_DEBUG() << "~Fiber(): id = " << m_id;
 }
 
 //作用：重置协程的回调函数，并重新设置上下文，使用与将协程从`TERM`状态重置READY
 // 用于重置（复用）一个已结束（TERMINATED状态）的协程对象，让它可以再次运行新的任务
 // 以避免频繁创建和销毁协程对象带来的性能损失。
-void Fiber::reset(std::function<void()> cb) {
+void Fiber::reset(Callback cb, size_t stacksize) {
     // 确保协程对象已处于终止状态（TERM），且栈空间已分配。
-    assert(m_stack != nullptr && m_state == TERM);
+    assert((m_stack != nullptr || m_shared) && m_state == TERM);
     m_state = READY;
-    m_cb = cb;
+    m_cb = std::move(cb);
 
-    if(getcontext(&m_ctx)) {
-        std::cerr<< "reset() failed\n";
-		pthread_exit(NULL);
+    if(m_shared) {
+        // 下次运行时重新在共享栈上构造上下文
+        m_ctxMade = false;
+        m_saveLen = 0;
+        return;
     }
 
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    if(m_painted) {
+        record_high_water(paintedHighWater());
+    }
+    // 需要不同大小的栈时，通过栈池换一块，而不是重新创建Fiber
+    if(stacksize && m_stackKind != StackPool::MMAP_HUGE && StackPool::RoundUp(stacksize) != m_stacksize) {
+        // 换栈期间持有登记表的锁，Snapshot 不会读到已经释放的栈
+        std::lock_guard<std::mutex> lock(registry_shard(m_id).mutex);
+        StackPool::Free(m_stack, m_stacksize, m_stackKind);
+        size_t size = stacksize;
+        m_stack = StackPool::Alloc(size, m_stackKind);
+        if(!m_stack) {
+            SYLAR_LOG_ERROR() << "reset(): alloc stack failed, size = " << size;
+            pthread_exit(NULL);
+        }
+        m_stacksize = size;
+    }
+    m_painted = false;
+    if(s_stack_painting.load(std::memory_order_relaxed)) {
+        paintStack();
+    }
+
+    if(!context_make(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc)) {
+        SYLAR_LOG_ERROR() << "reset() failed";
+		pthread_exit(NULL);
+    }
 }
 
 // 将一个处于准备就绪（READY）状态的协程切换到运行状态（RUNNING）
 void Fiber::resume() {
+    // 等上一个 resume() 的调用方切换完成，此时上下文已保存好
+    while(m_switching.load(std::memory_order_acquire)) {
+        cpu_relax();
+    }
+    if(m_state == TERM) {
+        // 避免resume已终止协程
+        return;
+    }
     assert(m_state == READY);
+    m_switching.store(true, std::memory_order_relaxed);
+
+    if(m_shared) {
+        switchInSharedStack();
+    }
 
     m_state = RUNNING;
+    if(m_waitReason.load(std::memory_order_relaxed) != WAIT_NONE) {
+        m_waitReason.store(WAIT_NONE, std::memory_order_relaxed);
+    }
+    SYLAR_TRACE(TRACE_FIBER_RESUME, m_id, 0);
+    SYLAR_PROBE1(fiber_resume, m_id);
 
     //这里的切换就相当于非对称协程函数那个当a执行完成后会将执行权交给b
     if(m_runInScheduler) {
@@ -150,8 +575,8 @@ void Fiber::resume() {
         SetThis(this);
         // 表示当前协程运行在调度器管理之下。
         // 当前的上下文状态会被保存到scheduler协程的上下文中，然后启动或继续目标协程（即本协程，this）的执行。
-        if(swapcontext(&(t_scheduler_fiber->m_ctx), &m_ctx)) {
-            std::cerr << "resume() to t_scheduler_fiber failed\n";
+        if(!context_swap(&(t_scheduler_fiber->m_ctx), &m_ctx, true)) {
+            SYLAR_LOG_ERROR() << "resume() to t_scheduler_fiber failed";
 			pthread_exit(NULL);
         }
         // std::cout << "hi" << std::endl;
@@ -159,19 +584,82 @@ void Fiber::resume() {
         // 表示协程直接运行于某个线程上下文，而非调度器。
         // 通常用于简单场景或线程主协程切换。
         SetThis(this);
-        if(swapcontext(&(t_thread_fiber->m_ctx), &m_ctx)) {
-            std::cerr << "resume() to t_thread_fiber failed\n";
+        if(!context_swap(&(t_thread_fiber->m_ctx), &m_ctx, true)) {
+            SYLAR_LOG_ERROR() << "resume() to t_thread_fiber failed";
 			pthread_exit(NULL);
         }
         // std::cout << "hh"<< std::endl;
     }
+    // 协程已经切出，上下文保存完毕，之后其他线程可以再次resume它。
+    // 在 m_switching 清零之前读状态：之后协程可能已经在别的线程上运行
+    SYLAR_TRACE(m_state == TERM ? TRACE_FIBER_TERM: TRACE_FIBER_YIELD, m_id, 0);
+    if(m_state == TERM) {
+        SYLAR_PROBE1(fiber_term, m_id);
+    } else {
+        SYLAR_PROBE1(fiber_yield, m_id);
+    }
+    m_switching.store(false, std::memory_order_release);
     // std::cout << "resume" << std::endl;
 }
 
+void Fiber::switchInSharedStack() {
+#if SYLAR_FIBER_ASM_CONTEXT
+    // resume() 总是在调度协程/线程主协程上调用，它们都有私有栈，因此这里可以安全地改写共享栈
+    if(!m_sharedStack) {
+        m_sharedStack = pick_shared_stack();
+        m_boundThread = Thread::GetThreadId();
+    }
+    assert(m_boundThread == Thread::GetThreadId());
+
+    std::lock_guard<std::mutex> lock(m_sharedStack->mutex);
+    Fiber* owner = m_sharedStack->owner;
+    if(owner == this) {
+        return;
+    }
+    if(owner) {
+        owner->saveSharedStack();
+    }
+    m_sharedStack->owner = this;
+
+    if(!m_ctxMade) {
+        if(!context_make(&m_ctx, m_sharedStack->stack, m_sharedStack->size, &Fiber::MainFunc)) {
+            SYLAR_LOG_ERROR() << "switchInSharedStack() failed";
+            pthread_exit(NULL);
+        }
+        m_ctxMade = true;
+    } else if(m_saveLen) {
+        char* top = (char*)m_sharedStack->stack + m_sharedStack->size;
+        memcpy(top - m_saveLen, m_saveBuf, m_saveLen);
+    }
+#endif
+}
+
+void Fiber::saveSharedStack() {
+#if SYLAR_FIBER_ASM_CONTEXT
+    // 已结束或尚未开始的协程没有需要保存的栈内容
+    if(m_state == TERM || !m_ctxMade) {
+        m_saveLen = 0;
+        return;
+    }
+    // 切走时sp保存在上下文中，[sp, 栈顶) 就是正在使用的部分
+    char* top = (char*)m_sharedStack->stack + m_sharedStack->size;
+    size_t used = top - (char*)m_ctx.sp;
+    if(used > m_saveCap) {
+        free(m_saveBuf);
+        m_saveBuf = (char*)malloc(used);
+        m_saveCap = used;
+    }
+    memcpy(m_saveBuf, m_ctx.sp, used);
+    m_saveLen = used;
+#endif
+}
+
 // 协程主动让出执行权，切换回到调度器协程或线程主协程
-// yield() 会通过 swapcontext() 切换上下文，把当前协程的上下文保存并切换到调度器协程的上下文
+// yield() 会通过 context_swap() 切换上下文，把当前协程的上下文保存并切换到调度器协程的上下文
 void Fiber::yield() {
     assert(m_state == RUNNING || m_state == TERM);
+    // 内联回调运行在调度协程上，没有自己的上下文可以让出
+    assert(!t_inline_task && "yield() in a STACK_INLINE callback");
     // std::cout << "alive" << std::endl;
     if(m_state != TERM) {
         m_state = READY;
@@ -183,14 +671,14 @@ void Fiber::yield() {
 
         // std::cout<< "syl"<< std::endl;
 
-        if(swapcontext(&m_ctx, &(t_scheduler_fiber->m_ctx))) {
-            std::cerr << "yield() to to t_scheduler_fiber failed\n";
+        if(!context_swap(&m_ctx, &(t_scheduler_fiber->m_ctx))) {
+            SYLAR_LOG_ERROR() << "yield() to to t_scheduler_fiber failed";
 			pthread_exit(NULL);
         }
     } else {
         SetThis(t_thread_fiber.get());
-        if(swapcontext(&m_ctx, &(t_thread_fiber->m_ctx))) {
-            std::cerr << "yield() to t_thread_fiber failed\n";
+        if(!context_swap(&m_ctx, &(t_thread_fiber->m_ctx))) {
+            SYLAR_LOG_ERROR() << "yield() to t_thread_fiber failed";
 			pthread_exit(NULL);
         }
     }
@@ -198,28 +686,28 @@ void Fiber::yield() {
 }
 
 // 通过封装协程入口函数，可以实现协程在结束自动执行yield的操作。
-void Fiber::MainFunc() {
+void Fiber::MainFunc() noexcept {
     // std::cout << "main" <<std::endl;
 
-    // 获取当前协程对象，确保引用计数正常。
-    std::shared_ptr<Fiber> curr = GetThis();
+    // 获取当前协程对象
+    // 使用裸指针：resume() 的调用方在协程运行期间一直持有引用，这里不需要再增加引用计数，
+    // 同时协程栈上也不会残留一个永远不会析构的引用
+    Fiber* curr = Current();
     assert(curr != nullptr);
 
     //真正执行任务的地方
     curr->m_cb();
     //防止悬空引用
     curr->m_cb = nullptr;
+    // 上下文和协程局部值随请求结束，复用的协程不能带着它们。析构函数还在协程自己的栈上运行
+    curr->clearLocals();
+    curr->m_cancel.reset();
+    curr->setLabel(nullptr);
     curr->m_state = TERM;
 
     // 运行完毕 -> 让出执行权
-    //获取原始指针，不增加引用计数
-    auto raw_ptr = curr.get();
-    //引用计数-1，如果此时为0，协程对象销毁
-    // reset() 的作用是将 shared_ptr 绑定的对象指针置为 nullptr，并减少该对象的引用计数。如果没有其他 shared_ptr 对象共享该资源，那么对象会被销毁。
-    curr.reset();
-
     // std::cout << "same" << std::endl;
 
-    raw_ptr->yield();
+    curr->yield();
 }
 }
\ No newline at end of file
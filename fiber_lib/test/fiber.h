@@ -6,34 +6,106 @@
 #include <atomic>       
 #include <functional>   
 #include <cassert>      
-#include <ucontext.h>   
 #include <unistd.h>
 #include <mutex>
+#include <vector>
+
+#include "callback.h"
+#include "fiber_context.h"
+#include "ref_ptr.h"
 
 namespace sylar {
-// 用于帮助一个对象在自己内部创建指向自己的 shared_ptr。这样做可以避免对象的生命周期管理问题，确保它在有多个共享指针引用时正确地被销毁。
-// 在对象的成员函数中获取指向该对象的 shared_ptr，而不必显式地创建一个新的 shared_ptr。
-// 防止对象被提前销毁，确保在使用它的其他地方仍然能维持有效的引用。
-class Fiber: public std::enable_shared_from_this<Fiber> {
+// 线程私有的共享栈（见 Fiber::STACK_SHARED）
+struct SharedStack;
+// 取消上下文，见 cancel.h
+class CancelContext;
+
+// 协程使用侵入式引用计数（RefCounted），通过 Fiber::ptr 持有。
+// 引用计数就在 Fiber 对象内部，从 this 得到一个新的引用只需一次原子加；
+// 只是临时使用当前协程（yield、读取状态）时应当用 Current() 拿裸指针，完全不碰引用计数。
+class Fiber: public RefCounted {
 public:
+    typedef RefPtr<Fiber> ptr;
+
+    // 协程局部存储（见 fiber_local.h）在 Fiber 内的槽位数，更多的键放在按需分配的溢出区
+    static constexpr uint32_t INLINE_LOCALS = 4;
+
     // 协程状态
     enum State {
         READY,
         RUNNING,
         TERM
     };
+
+    // 协程栈选项，可按位组合
+    enum StackFlag {
+        STACK_DEFAULT = 0x0,
+        // 使用大页栈，适合热点、长生命周期的协程（见 StackPool）
+        STACK_HUGE_PAGES = 0x1,
+        // 共享栈（copy-stack）：运行在所在线程的少数几个共享栈之一上，不独占栈内存。
+        // 被切走时把用到的那一段栈拷贝到按需大小的私有缓冲区，再次运行时拷回原地址。
+        // 适合大量长期挂起在 addEvent 上的连接协程，用每次切换的一次memcpy换取每连接内存的大幅下降。
+        // 由于栈内容必须恢复到同一地址，协程第一次运行后就绑定在该线程上（见 getBoundThread）。
+        // 仅汇编上下文后端支持，ucontext 后端下退化为普通私有栈。
+        STACK_SHARED = 0x2,
+        // 内联执行：只对调度器的回调任务有效，不创建协程，直接在调度协程的栈上运行回调，
+        // 省去协程的创建/复用和两次上下文切换。适合从不让出的短回调（只修改标志的定时器回调、cancelEvent 的完成回调等）。
+        // 回调中不能 yield（会触发断言），fiber_sync/Channel 中的等待退化为阻塞线程
+        STACK_INLINE = 0x4
+    };
+
+    // 挂起的原因，由等待的一方在 yield 之前设置（SetWaitReason），下一次 resume 时清除
+    enum WaitReason {
+        WAIT_NONE = 0,
+        // 等fd就绪（waitEvent、io_uring 操作），参数为 fd | (事件 << 32)
+        WAIT_IO,
+        // sleep/usleep/nanosleep，参数为睡眠的微秒数
+        WAIT_TIMER,
+        // Channel 收发
+        WAIT_CHANNEL,
+        // FiberMutex / FiberCondition / FiberSemaphore 等同步原语、连接池
+        WAIT_SYNC,
+        // OffloadPool 上的阻塞调用
+        WAIT_OFFLOAD
+    };
+
+    // 协程的快照（Snapshot），用于排查挂起不动的协程和调整栈大小
+    struct Info {
+        uint64_t id = 0;
+        State state = READY;
+        WaitReason wait = WAIT_NONE;
+        uint64_t wait_arg = 0;
+        // 已经挂起了多久（纳秒），没有等待原因时为0
+        uint64_t wait_ns = 0;
+        bool shared = false;
+        int bound_thread = -1;
+        // 最后一次运行它的调度器（Scheduler*），从未被调度器运行过为空
+        const void* owner = nullptr;
+        // 独占的栈大小（虚拟内存），共享栈协程为0
+        size_t stack_size = 0;
+        // 栈上已经驻留物理内存的字节数（mincore）。栈池里复用的栈包括之前使用者摸过的页
+        size_t stack_resident = 0;
+        // 栈的最大使用深度：打开栈染色（SetStackPainting）时是本次运行以来的精确值，
+        // 否则按驻留页估计（最低的驻留页到栈顶）；共享栈协程为切走时保存的字节数
+        size_t stack_high_water = 0;
+        // 共享栈协程保存栈内容的私有缓冲区大小
+        size_t save_bytes = 0;
+    };
 private:
     // 仅由GetThis()调用 -> 私有 -> 创建主协程  
     Fiber();
 
 public:
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true);
+    // stacksize为0时使用 StackPool::DefaultStackSize()，stack_flags 为 StackFlag 的组合
+    Fiber(Callback cb, size_t stacksize = 0, bool run_in_scheduler = true, int stack_flags = STACK_DEFAULT);
     ~Fiber();
 
     // 重用一个协程
-    void reset(std::function<void()> cb);
+    // stacksize为0表示沿用原来的栈，否则从栈池换一块对应大小的栈
+    void reset(Callback cb, size_t stacksize = 0);
 
     // 任务线程恢复执行
+    // 若协程刚在其他线程上让出、还没切换完，会先等它切换完成；已结束（TERM）的协程直接返回
     void resume();
 
     // 任务线程让出执行权
@@ -47,12 +119,84 @@ public:
         return m_state;
     }
 
+    // 共享栈协程绑定的线程id，其他协程（或尚未运行过）返回-1
+    int getBoundThread() const {
+        return m_boundThread;
+    }
+
+    bool isSharedStack() const {
+        return m_shared;
+    }
+
+    // 调度器在 resume 之前设置，用于按调度器汇总（见 Scheduler::getFiberMemory）
+    void setOwner(const void* owner) {
+        m_owner.store(owner, std::memory_order_relaxed);
+    }
+
+    // 协程的取消上下文（见 cancel.h）。只由协程自己（CancelScope）或恢复它之前的调度器设置，协程结束时清除
+    const std::shared_ptr<CancelContext>& getCancelContext() const {
+        return m_cancel;
+    }
+
+    void setCancelContext(std::shared_ptr<CancelContext> ctx) {
+        m_cancel = std::move(ctx);
+    }
+
+    // 任务标签（见 profiler.h），采样分析器按它归类CPU时间。只保存指针，字符串必须一直有效（字面量或 Profiler::InternLabel）。
+    // 新协程继承创建它的协程的标签，回调任务继承提交它的协程的标签；协程结束时清除
+    void setLabel(const char* label) {
+        m_label.store(label, std::memory_order_relaxed);
+    }
+
+    const char* getLabel() const {
+        return m_label.load(std::memory_order_relaxed);
+    }
+
+    // 挂起的等待以什么结果结束：0 为正常就绪，否则为 errno 值（超时 ETIMEDOUT、取消 ECANCELED）。
+    // 由结束等待的一方在把协程放回调度器之前设置，协程恢复后读取（见 IOManager::waitEvent）。
+    // 结果放在协程对象上而不是等待方的栈上：共享栈协程挂起期间栈内容可能已经被换出
+    void setWakeResult(int result) {
+        m_wakeResult = result;
+    }
+
+    int getWakeResult() const {
+        return m_wakeResult;
+    }
+
 public:
     // 设置当前运行的协程
     static void SetThis(Fiber *f);
 
-    // 得到当前运行的协程 
-    static std::shared_ptr<Fiber> GetThis();
+    // 得到当前运行的协程（持有一个引用）
+    static Fiber::ptr GetThis();
+
+    // 得到当前运行的协程的裸指针，不改变引用计数，只在当前协程内部使用
+    // 当前线程还没有协程时与 GetThis() 一样先创建主协程
+    static Fiber* Current();
+
+    // 当前协程的取消上下文，不持有引用；没有上下文（或当前线程还没有协程）时为空，不创建主协程
+    static CancelContext* CurrentCancelContext();
+
+    // 当前协程在协程局部存储槽位 index 上的值（见 fiber_local.h），当前线程还没有协程时为空
+    static void* GetLocal(uint32_t index);
+
+    // 设置当前协程的值，返回原来的值；当前线程还没有协程时先创建主协程
+    static void* SetLocal(uint32_t index, void* value);
+
+    // 当前协程的标签，当前线程还没有协程时为空，不创建主协程
+    static const char* CurrentLabel();
+
+    // 采样时的当前协程：标签、是否为调度器管理的子协程（任务），以及协程运行所在的栈 [stack_lo, stack_hi)。
+    // 线程主协程和调度协程（没有私有栈时）运行在线程自己的栈上，stack_lo/stack_hi 为空
+    struct Sample {
+        const char* label = nullptr;
+        bool task = false;
+        const char* stack_lo = nullptr;
+        const char* stack_hi = nullptr;
+    };
+
+    // 只读线程局部变量和当前协程的成员，不加锁、不分配内存，可以在信号处理函数中调用。当前线程还没有协程时返回false
+    static bool SampleCurrent(Sample& out);
 
     // 设置调度协程（默认为主协程）
     static void SetSchedulerFiber(Fiber* f);
@@ -60,8 +204,65 @@ public:
     // 得到当前运行的协程id
     static uint64_t GetFiberId();
 
-    // 协程函数
-    static void MainFunc();
+    // 协程函数。noexcept：协程栈的回溯会接到 resume 的调用方，逃出回调的异常不能沿着它继续传播，在这里终止进程
+    static void MainFunc() noexcept;
+
+    // 设置之后新创建的共享栈的数量和大小（每个线程第一次运行共享栈协程时创建）
+    static void SetSharedStackConfig(size_t count, size_t size);
+
+    // 绑定在当前线程共享栈上、还没有析构的协程数。这些协程只能在本线程恢复，线程退出前应当为0
+    static size_t BoundFiberCount();
+
+    // 当前是否运行在调度器管理的子协程中，即可以 yield 回调度协程、之后再被放回调度器恢复
+    // 线程的主协程和调度协程（包括其中内联执行的回调）返回false
+    static bool CanSuspend();
+
+    // 调度器内联执行回调（STACK_INLINE）前后设置，期间 yield 会触发断言
+    static void SetInlineTask(bool flag);
+    static bool InInlineTask();
+
+    // 当前协程即将挂起的原因，在 yield 之前调用（当前线程没有子协程时忽略）
+    static void SetWaitReason(WaitReason reason, uint64_t arg = 0);
+    static const char* WaitReasonName(WaitReason reason);
+
+    // 所有还没有析构的协程（包括线程主协程）。owner 不为空时只列出最后由该调度器运行的协程。
+    // 逐个协程调用一次 mincore，只应在排查问题时按需调用
+    static void Snapshot(std::vector<Info>& out, const void* owner = nullptr);
+
+    // 把 owner 为该值的协程的 owner 清空（调度器析构时调用）
+    static void ClearOwner(const void* owner);
+
+    // 还没有析构的协程数
+    static uint64_t TotalFibers();
+
+    // 栈染色：之后创建或 reset 的私有栈先整块填充固定字节，Snapshot 从栈底找第一个被改写的字节得到精确的使用深度。
+    // 代价是每次创建/复用协程多一次整栈 memset，mmap 栈的所有页也因此驻留物理内存，只应在调整栈大小时打开
+    static void SetStackPainting(bool on);
+    static bool IsStackPainting();
+
+    // 栈染色打开以来，已结束（析构或 reset）的协程用到的最大栈深度
+    static size_t StackHighWaterMax();
+
+private:
+    // 共享栈协程切入前：把共享栈当前的占用者换出，并恢复自己的栈内容
+    void switchInSharedStack();
+
+    // 把自己在共享栈上用到的部分拷贝到私有缓冲区
+    void saveSharedStack();
+
+    // 加入/移出全局登记表
+    void registerSelf();
+    void unregisterSelf();
+
+    // 栈染色下的使用深度，没有染色的栈返回0
+    size_t paintedHighWater() const;
+    // 染色整个私有栈（调用方已确认打开了栈染色）
+    void paintStack();
+
+    void fillInfo(Info& info, uint64_t now) const;
+
+    // 对所有非空的协程局部值调用析构函数并清空
+    void clearLocals();
 
 private:
     // id
@@ -70,17 +271,55 @@ private:
     uint32_t m_stacksize = 0;
     // 协程状态
     State m_state = READY;
-    // 协程上下文
-    ucontext_t m_ctx;
+    // 协程上下文（汇编切换或ucontext，见 fiber_context.h）
+    FiberContext m_ctx;
     // 协程栈指针
     void* m_stack = nullptr;
+    // 协程栈的来源（StackPool::Kind）
+    int m_stackKind = 0;
     // 协程函数
-    std::function<void()> m_cb;
+    Callback m_cb;
     // 是否让出执行权交给调度协程
     bool m_runInScheduler;
 
-public:
-    std::mutex m_mutex;
+    // 是否为共享栈协程
+    bool m_shared = false;
+    // 上下文是否已在共享栈上构造（共享栈协程首次运行时才构造）
+    bool m_ctxMade = false;
+    // 绑定的线程id
+    int m_boundThread = -1;
+    // 所用的共享栈
+    std::shared_ptr<SharedStack> m_sharedStack;
+    // 切走时保存栈内容的私有缓冲区
+    char* m_saveBuf = nullptr;
+    size_t m_saveCap = 0;
+    size_t m_saveLen = 0;
+
+    // resume() 已把它切入、但还没有切换回 resume() 的调用方。
+    // 协程在A线程 yield 之前可能已经把自己交给了事件/定时器，B线程拿到后必须等A线程切换完成（上下文保存好）才能切入；
+    // 只有resume()的调用方写入，无竞争时只是普通的load/store，不像互斥锁每次都要两次原子读改写
+    std::atomic<bool> m_switching{false};
+
+    // 等待原因（WaitReason）、参数和开始挂起的时间，Snapshot 会在其他线程读取
+    std::atomic<uint8_t> m_waitReason{WAIT_NONE};
+    std::atomic<uint64_t> m_waitArg{0};
+    std::atomic<uint64_t> m_waitSince{0};
+    std::atomic<const void*> m_owner{nullptr};
+    // 私有栈是否已染色
+    bool m_painted = false;
+    // 最近一次等待的结果
+    int m_wakeResult = 0;
+    // 取消上下文
+    std::shared_ptr<CancelContext> m_cancel;
+    // 任务标签，SIGPROF 处理函数会在本线程上读取
+    std::atomic<const char*> m_label{nullptr};
+    // 协程局部存储：前 INLINE_LOCALS 个槽位，以及下标从 INLINE_LOCALS 开始的溢出区
+    void* m_locals[INLINE_LOCALS] = {};
+    void** m_localsExt = nullptr;
+    uint32_t m_localsExtCap = 0;
+    // 全局登记表中的链表指针，由所在分片的锁保护
+    Fiber* m_regPrev = nullptr;
+    Fiber* m_regNext = nullptr;
 };
 }
 #endif
\ No newline at end of file
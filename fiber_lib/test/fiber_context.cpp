@@ -0,0 +1,249 @@
+#include "fiber_context.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if SYLAR_FIBER_ASM_CONTEXT
+// 汇编实现，见文件末尾
+extern "C" void sylar_context_swap(void** from_sp, void* to_sp, void** link);
+extern "C" void sylar_context_trampoline();
+#endif
+
+namespace sylar {
+
+#if SYLAR_FIBER_ASM_CONTEXT
+
+const char* context_backend_name() {
+    return "asm";
+}
+
+bool context_init_main(FiberContext* ctx) {
+    // 主协程第一次切出时 sylar_context_swap 会把当前sp写入这里
+    ctx->sp = nullptr;
+    ctx->link = nullptr;
+    return true;
+}
+
+bool context_make(FiberContext* ctx, void* stack, size_t size, void (*entry)()) {
+    // 栈从高地址向低地址增长，栈顶按16字节对齐
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    // 栈顶32字节是链接帧，第一次 resume 之前全为0，回溯到这里结束
+    uint64_t* link = (uint64_t*)(top - 32);
+    memset(link, 0, 32);
+
+#if defined(__x86_64__)
+    // 初始帧布局（由低到高），与 sylar_context_swap 的恢复顺序一致：
+    // [0] mxcsr | x87 控制字  [8] r12=entry  [16] r13  [24] r14  [32] r15  [40] rbx  [48] rbp=0
+    // [56] 返回地址=trampoline，ret 之后 rsp 指向链接帧（16字节对齐），保证 call entry 时满足 ABI 对齐
+    uint64_t* sp = link - 8;
+    memset(sp, 0, 64);
+    uint32_t* fpu = (uint32_t*)sp;
+    fpu[0] = 0x1F80;        // mxcsr 默认值
+    fpu[1] = 0x037F;        // x87 控制字默认值
+    sp[1] = (uint64_t)entry;
+    sp[7] = (uint64_t)&sylar_context_trampoline;
+#elif defined(__aarch64__)
+    // 初始帧布局：x19..x28, x29(fp), x30(lr), d8..d15 共160字节，恢复后 sp 指向链接帧
+    // x19=entry，x30=trampoline
+    uint64_t* sp = link - 20;
+    memset(sp, 0, 160);
+    sp[0] = (uint64_t)entry;
+    sp[11] = (uint64_t)&sylar_context_trampoline;
+#endif
+
+    ctx->sp = sp;
+    ctx->link = (void**)link;
+    return true;
+}
+
+bool context_swap(FiberContext* from, FiberContext* to, bool link) {
+    sylar_context_swap(&from->sp, to->sp, link ? to->link: nullptr);
+    return true;
+}
+
+#else
+
+const char* context_backend_name() {
+    return "ucontext";
+}
+
+bool context_init_main(FiberContext* ctx) {
+    return getcontext(&ctx->uc) == 0;
+}
+
+bool context_make(FiberContext* ctx, void* stack, size_t size, void (*entry)()) {
+    if(getcontext(&ctx->uc)) {
+        return false;
+    }
+    ctx->uc.uc_link = nullptr;
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    makecontext(&ctx->uc, entry, 0);
+    return true;
+}
+
+bool context_swap(FiberContext* from, FiberContext* to, bool) {
+    return swapcontext(&from->uc, &to->uc) == 0;
+}
+
+#endif
+
+}
+
+#if SYLAR_FIBER_ASM_CONTEXT
+#if defined(__x86_64__)
+// void sylar_context_swap(void** from_sp /* rdi */, void* to_sp /* rsi */, void** link /* rdx */)
+// 只保存 System V ABI 规定的被调用者保存寄存器以及 mxcsr/x87 控制字。
+// link 不为空时先把调用方的 rbp、返回地址和返回后的 rsp 写进目标栈的链接帧
+asm(R"(
+    .text
+    .globl sylar_context_swap
+    .type sylar_context_swap, @function
+    .align 16
+sylar_context_swap:
+    .cfi_startproc
+    testq %rdx, %rdx
+    jz 1f
+    movq %rbp, (%rdx)
+    movq (%rsp), %rax
+    movq %rax, 8(%rdx)
+    leaq 8(%rsp), %rax
+    movq %rax, 16(%rdx)
+1:
+    pushq %rbp
+    .cfi_adjust_cfa_offset 8
+    pushq %rbx
+    .cfi_adjust_cfa_offset 8
+    pushq %r15
+    .cfi_adjust_cfa_offset 8
+    pushq %r14
+    .cfi_adjust_cfa_offset 8
+    pushq %r13
+    .cfi_adjust_cfa_offset 8
+    pushq %r12
+    .cfi_adjust_cfa_offset 8
+    subq $8, %rsp
+    .cfi_adjust_cfa_offset 8
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    .cfi_adjust_cfa_offset -8
+    popq %r12
+    .cfi_adjust_cfa_offset -8
+    popq %r13
+    .cfi_adjust_cfa_offset -8
+    popq %r14
+    .cfi_adjust_cfa_offset -8
+    popq %r15
+    .cfi_adjust_cfa_offset -8
+    popq %rbx
+    .cfi_adjust_cfa_offset -8
+    popq %rbp
+    .cfi_adjust_cfa_offset -8
+    ret
+    .cfi_endproc
+    .size sylar_context_swap, .-sylar_context_swap
+
+    .globl sylar_context_trampoline
+    .type sylar_context_trampoline, @function
+    .align 16
+// 入口跳板：rsp 指向链接帧，把它设为 rbp，帧指针链经过链接帧接到调用方。
+// CFI：CFA = *(rbp + 16)，即调用方在 sylar_context_swap 返回后的 rsp；返回地址和调用方的
+// 被调用者保存寄存器按 sylar_context_swap 压栈的位置从调用方的栈上恢复（调用方在协程运行期间一直挂起，栈不变）
+sylar_context_trampoline:
+    .cfi_startproc
+    .cfi_undefined rip
+    movq %rsp, %rbp
+    .cfi_escape 0x0f, 0x03, 0x76, 0x10, 0x06
+    .cfi_offset rip, -8
+    .cfi_offset rbp, -16
+    .cfi_offset rbx, -24
+    .cfi_offset r15, -32
+    .cfi_offset r14, -40
+    .cfi_offset r13, -48
+    .cfi_offset r12, -56
+    callq *%r12
+    ud2
+    .cfi_endproc
+    .size sylar_context_trampoline, .-sylar_context_trampoline
+)");
+#elif defined(__aarch64__)
+// void sylar_context_swap(void** from_sp /* x0 */, void* to_sp /* x1 */, void** link /* x2 */)
+// 保存 AAPCS64 规定的 x19-x29、lr 和 d8-d15。
+// link 不为空时先把调用方的 x29、x30 和 sp 写进目标栈的链接帧
+asm(R"(
+    .text
+    .globl sylar_context_swap
+    .type sylar_context_swap, %function
+    .align 4
+sylar_context_swap:
+    .cfi_startproc
+    cbz x2, 1f
+    stp x29, x30, [x2]
+    mov x9, sp
+    str x9, [x2, #16]
+1:
+    sub sp, sp, #160
+    .cfi_adjust_cfa_offset 160
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8,  d9,  [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0]
+    ldp x21, x22, [sp, #16]
+    ldp x23, x24, [sp, #32]
+    ldp x25, x26, [sp, #48]
+    ldp x27, x28, [sp, #64]
+    ldp x29, x30, [sp, #80]
+    ldp d8,  d9,  [sp, #96]
+    ldp d10, d11, [sp, #112]
+    ldp d12, d13, [sp, #128]
+    ldp d14, d15, [sp, #144]
+    add sp, sp, #160
+    .cfi_adjust_cfa_offset -160
+    ret
+    .cfi_endproc
+    .size sylar_context_swap, .-sylar_context_swap
+
+    .globl sylar_context_trampoline
+    .type sylar_context_trampoline, %function
+    .align 4
+// 入口跳板：sp 指向链接帧，把它设为 x29，帧记录链经过链接帧接到调用方。
+// CFI：CFA = *(x29 + 16)，即调用方的 sp；x19-x30 按 sylar_context_swap 保存的位置从调用方的栈上恢复
+sylar_context_trampoline:
+    .cfi_startproc
+    .cfi_undefined x30
+    mov x29, sp
+    .cfi_escape 0x0f, 0x03, 0x8d, 0x10, 0x06
+    .cfi_offset x19, -160
+    .cfi_offset x20, -152
+    .cfi_offset x21, -144
+    .cfi_offset x22, -136
+    .cfi_offset x23, -128
+    .cfi_offset x24, -120
+    .cfi_offset x25, -112
+    .cfi_offset x26, -104
+    .cfi_offset x27, -96
+    .cfi_offset x28, -88
+    .cfi_offset x29, -80
+    .cfi_offset x30, -72
+    blr x19
+    brk #0
+    .cfi_endproc
+    .size sylar_context_trampoline, .-sylar_context_trampoline
+)");
+#endif
+#endif
@@ -0,0 +1,51 @@
+#ifndef __SYLAR_FIBER_CONTEXT_H__
+#define __SYLAR_FIBER_CONTEXT_H__
+
+#include <cstddef>
+
+// 协程上下文切换后端
+// 默认在 x86-64 / aarch64 上使用手写汇编切换：只保存被调用者保存寄存器（callee-saved），不涉及信号掩码，
+// 因此不会像 glibc 的 swapcontext 那样每次切换都触发一次 rt_sigprocmask 系统调用。
+// 其他平台，或编译时定义了 SYLAR_FIBER_UCONTEXT，则回退到 ucontext（getcontext/makecontext/swapcontext）。
+//
+// 汇编后端的协程栈可以被 perf/gdb/libgcc 回溯：栈顶留一个"链接帧"，resume 时记下调用方的帧指针、返回地址和栈指针，
+// 入口跳板的 CFI 从链接帧恢复调用方的寄存器，帧指针链也经过它，所以协程里的回溯会接着走到 resume 的调用方
+// （Scheduler::run -> Fiber::resume -> 协程里的函数），DWARF 回溯（perf --call-graph dwarf、gdb）和
+// 帧指针回溯（perf --call-graph fp，需要 -fno-omit-frame-pointer）都适用。
+#if !defined(SYLAR_FIBER_UCONTEXT) && (defined(__x86_64__) || defined(__aarch64__))
+#define SYLAR_FIBER_ASM_CONTEXT 1
+#else
+#define SYLAR_FIBER_ASM_CONTEXT 0
+#include <ucontext.h>
+#endif
+
+namespace sylar {
+
+struct FiberContext {
+#if SYLAR_FIBER_ASM_CONTEXT
+    // 切出时保存的栈顶指针，寄存器都压在该栈上
+    void* sp = nullptr;
+    // 栈顶的链接帧：[0] 调用方的帧指针 [1] 返回地址 [2] 调用方的栈指针（CFA）。主协程没有
+    void** link = nullptr;
+#else
+    ucontext_t uc;
+#endif
+};
+
+// 后端名称，便于调试输出（"asm" 或 "ucontext"）
+const char* context_backend_name();
+
+// 初始化线程主协程的上下文（主协程使用线程原本的栈，不需要makecontext）
+bool context_init_main(FiberContext* ctx);
+
+// 在 [stack, stack + size) 上构造一个新上下文，首次切换到它时执行 entry
+// entry 不允许返回
+bool context_make(FiberContext* ctx, void* stack, size_t size, void (*entry)());
+
+// 保存当前上下文到 from，并切换到 to
+// link 为 true 时把调用方记到 to 的链接帧里，to 上的栈回溯从此接到调用方（resume 时使用；切回调度协程时不用）
+bool context_swap(FiberContext* from, FiberContext* to, bool link = false);
+
+}
+
+#endif
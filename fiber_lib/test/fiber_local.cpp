@@ -0,0 +1,44 @@
+#include "fiber_local.h"
+#include "fiber.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+
+namespace sylar {
+
+namespace {
+
+// 常量初始化，其他编译单元的静态初始化里创建键也是安全的
+std::atomic<uint32_t> s_key_count{0};
+std::atomic<FiberLocalKey::Destructor> s_destructors[FiberLocalKey::MAX_KEYS];
+
+}
+
+FiberLocalKey::FiberLocalKey(Destructor dtor) {
+    m_index = s_key_count.fetch_add(1, std::memory_order_relaxed);
+    if(m_index >= MAX_KEYS) {
+        // 键是静态对象，超出上限是程序本身的问题
+        abort();
+    }
+    s_destructors[m_index].store(dtor, std::memory_order_release);
+}
+
+void* FiberLocalKey::get() const {
+    return Fiber::GetLocal(m_index);
+}
+
+void* FiberLocalKey::set(void* value) {
+    return Fiber::SetLocal(m_index, value);
+}
+
+uint32_t FiberLocalKey::KeyCount() {
+    return s_key_count.load(std::memory_order_relaxed);
+}
+
+FiberLocalKey::Destructor FiberLocalKey::GetDestructor(uint32_t index) {
+    assert(index < MAX_KEYS);
+    return s_destructors[index].load(std::memory_order_acquire);
+}
+
+}
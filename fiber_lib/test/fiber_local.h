@@ -0,0 +1,105 @@
+#ifndef __SYLAR_FIBER_LOCAL_H__
+#define __SYLAR_FIBER_LOCAL_H__
+
+// 协程局部存储（FLS）
+//
+// 协程会在不同的工作线程上恢复，thread_local 变量对协程来说是"当前碰巧在哪个线程"的状态，
+// 放不了随请求走的数据。用 unordered_map<fiber_id, ...> 加锁查找又太慢。这里每个键在静态初始化时
+// 分到一个固定的槽位下标，值就存在 Fiber 对象里：前 Fiber::INLINE_LOCALS 个槽位是 Fiber 内的定长数组，
+// 之后的放在第一次用到时才分配的溢出区。读写都是按下标直接访问，不加锁，也没有哈希
+// - 键必须是静态存储期的对象（全局变量、静态成员或函数内的 static），槽位不回收，键的总数不超过 FiberLocalKey::MAX_KEYS
+// - 值只由协程自己读写。没有运行在协程中的线程（还没有主协程）上 get() 返回空，set() 会先创建主协程
+// - 协程结束（TERM）时，在它自己的栈上对非空的值调用键的析构函数，复用的协程从全空开始；
+//   没有结束就析构的协程（线程的主协程、挂起时被丢弃的协程）在析构时调用
+// - 内联回调（STACK_INLINE）运行在调度协程上，读写的是调度协程的值
+//
+//   static sylar::FiberLocal<RequestInfo> t_request;
+//   t_request.reset(new RequestInfo(...));     // 协程结束时自动 delete
+//   if(RequestInfo* info = t_request.get()) { ... }
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sylar {
+
+class FiberLocalKey {
+public:
+    typedef void (*Destructor)(void* value);
+
+    // 键的总数上限
+    static constexpr uint32_t MAX_KEYS = 256;
+
+    // 分配一个槽位。dtor 为空时协程结束只是丢弃值
+    explicit FiberLocalKey(Destructor dtor = nullptr);
+
+    FiberLocalKey(const FiberLocalKey&) = delete;
+    FiberLocalKey& operator=(const FiberLocalKey&) = delete;
+
+    uint32_t index() const {
+        return m_index;
+    }
+
+    // 当前协程在这个键上的值，没有设置过时为空
+    void* get() const;
+
+    // 设置当前协程的值，返回原来的值（不会对它调用析构函数）
+    void* set(void* value);
+
+    // 已经分配的键数
+    static uint32_t KeyCount();
+
+    static Destructor GetDestructor(uint32_t index);
+
+private:
+    uint32_t m_index;
+};
+
+// 类型化的协程局部变量，值由 new 创建，协程结束时 delete
+template<class T>
+class FiberLocal {
+public:
+    FiberLocal()
+        :m_key(&FiberLocal::Destroy) {
+    }
+
+    // 当前协程的值，没有时为空
+    T* get() const {
+        return static_cast<T*>(m_key.get());
+    }
+
+    // 当前协程的值，没有时先默认构造一个
+    T& operator*() {
+        T* value = get();
+        if(!value) {
+            value = new T();
+            m_key.set(value);
+        }
+        return *value;
+    }
+
+    T* operator->() {
+        return &**this;
+    }
+
+    // 换成 value（接管所有权），原来的值立即 delete
+    void reset(T* value = nullptr) {
+        delete static_cast<T*>(m_key.set(value));
+    }
+
+    // 取出当前协程的值并交给调用方，槽位置空
+    T* release() {
+        return static_cast<T*>(m_key.set(nullptr));
+    }
+
+private:
+    static void Destroy(void* value) {
+        delete static_cast<T*>(value);
+    }
+
+private:
+    FiberLocalKey m_key;
+};
+
+}
+
+#endif
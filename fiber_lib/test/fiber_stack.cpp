@@ -0,0 +1,375 @@
+#include "fiber_stack.h"
+#include "numa.h"
+
+#include <assert.h>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+namespace sylar {
+
+// 每个尺寸等级默认的缓存上限
+static std::atomic<size_t> s_thread_capacity{16};
+static std::atomic<size_t> s_global_capacity{64};
+// 新栈的来源
+static std::atomic<int> s_mode{StackPool::HEAP};
+
+// 进入栈池的两种来源各自一组链表，互不混用
+static const size_t POOL_KINDS = 2;
+// 大页大小（x86-64 / aarch64 常见的2MB）
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// 全局溢出链表按NUMA节点分开，节点id超出时取模
+static const size_t NODE_SLOTS = 8;
+
+// 只由所属线程写入的计数器，用普通的load/store代替原子加，避免lock前缀
+static inline void bump(std::atomic<uint64_t>& v, int64_t d = 1) {
+    v.store(v.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+}
+
+// 线程级缓存
+struct StackThreadCache {
+    std::vector<void*> free_list[POOL_KINDS][StackPool::CLASS_COUNT];
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> global_hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> releases{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> cached{0};
+};
+
+// 全局溢出链表以及所有线程缓存的登记表
+// 有意不析构：进程退出时其他线程的缓存可能仍在归还栈
+// 栈的物理页在首次访问时分配在访问它的线程所在的节点上，因此溢出链表按节点分开，
+// 绑定到某个节点的工作线程只会取回本节点线程用过的栈；未绑定的线程都使用0号链表
+struct StackGlobal {
+    std::mutex mutex;
+    std::vector<void*> free_list[NODE_SLOTS][POOL_KINDS][StackPool::CLASS_COUNT];
+    std::unordered_set<StackThreadCache*> caches;
+    // 已退出线程的计数器累加到这里
+    StackPool::Stats retired;
+};
+
+static StackGlobal& global() {
+    static StackGlobal* g = new StackGlobal();
+    return *g;
+}
+
+// 线程退出时把缓存的栈转入全局链表
+struct StackThreadCacheHolder {
+    StackThreadCache* cache = nullptr;
+    ~StackThreadCacheHolder();
+};
+
+static thread_local StackThreadCacheHolder t_holder;
+// thread_local 对象析构之后仍可能有 Fiber 在本线程被销毁，此时直接走全局链表
+static thread_local bool t_cache_dead = false;
+
+static StackThreadCache* thread_cache() {
+    if(t_holder.cache) {
+        return t_holder.cache;
+    }
+    if(t_cache_dead) {
+        return nullptr;
+    }
+    StackThreadCache* cache = new StackThreadCache();
+    {
+        std::lock_guard<std::mutex> lock(global().mutex);
+        global().caches.insert(cache);
+    }
+    t_holder.cache = cache;
+    return cache;
+}
+
+static int size_class(size_t size) {
+    size_t cls_size = StackPool::MIN_CLASS_SIZE;
+    for(size_t i = 0; i < StackPool::CLASS_COUNT; ++i) {
+        if(size <= cls_size) {
+            return (int)i;
+        }
+        cls_size <<= 1;
+    }
+    return -1;
+}
+
+static size_t class_size(int cls) {
+    return StackPool::MIN_CLASS_SIZE << cls;
+}
+
+static size_t node_slot() {
+    int node = Numa::GetThreadNode();
+    return node < 0 ? 0: (size_t)node % NODE_SLOTS;
+}
+
+static size_t page_size() {
+    static size_t page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+// 向系统申请一块栈内存，返回可用区域的最低地址
+static void* system_alloc(size_t size, int kind) {
+    if(kind == StackPool::HEAP) {
+        return malloc(size);
+    }
+
+    size_t page = page_size();
+    if(kind == StackPool::MMAP) {
+        // [保护页][size字节的栈]，MAP_NORESERVE 使得只有被访问过的页才会真正占用内存
+        char* base = (char*)mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if(base == MAP_FAILED) {
+            return nullptr;
+        }
+        if(mprotect(base, page, PROT_NONE)) {
+            munmap(base, size + page);
+            return nullptr;
+        }
+        return base + page;
+    }
+
+    // MMAP_HUGE: 先保留一段足够大的 PROT_NONE 区域，在其中找一个按大页对齐且下方至少留一页作保护页的位置
+    size_t len = size + HUGE_PAGE_SIZE + page;
+    char* base = (char*)mmap(nullptr, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED) {
+        return nullptr;
+    }
+    char* stack = (char*)(((uintptr_t)base + page + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+    // 优先使用预留的大页；没有预留大页时退化为透明大页
+    void* rt = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    rt = mmap(stack, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB | MAP_STACK, -1, 0);
+#endif
+    if(rt == MAP_FAILED) {
+        // MAP_FIXED 失败时原来的保留区可能已被拆掉，这里重新映射而不是 mprotect
+        rt = mmap(stack, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if(rt == MAP_FAILED) {
+            munmap(base, len);
+            return nullptr;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(stack, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    // 裁掉首尾多余的部分，只留下 [保护页][栈]，与 MMAP 的布局一致
+    char* guard = stack - page;
+    if(guard > base) {
+        munmap(base, guard - base);
+    }
+    if(stack + size < base + len) {
+        munmap(stack + size, base + len - (stack + size));
+    }
+    return stack;
+}
+
+static void system_free(void* stack, size_t size, int kind) {
+    if(kind == StackPool::HEAP) {
+        free(stack);
+        return;
+    }
+    size_t page = page_size();
+    munmap((char*)stack - page, size + page);
+}
+
+// 放入全局链表，调用方需持有全局锁；返回false表示全局已满
+static bool push_global_locked(int kind, int cls, void* stack) {
+    StackGlobal& g = global();
+    std::vector<void*>& list = g.free_list[node_slot()][kind][cls];
+    if(list.size() >= s_global_capacity.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    list.push_back(stack);
+    return true;
+}
+
+StackThreadCacheHolder::~StackThreadCacheHolder() {
+    t_cache_dead = true;
+    if(!cache) {
+        return;
+    }
+    StackGlobal& g = global();
+    std::lock_guard<std::mutex> lock(g.mutex);
+    for(size_t k = 0; k < POOL_KINDS; ++k) {
+        for(size_t i = 0; i < StackPool::CLASS_COUNT; ++i) {
+            for(void* stack: cache->free_list[k][i]) {
+                if(!push_global_locked((int)k, (int)i, stack)) {
+                    system_free(stack, class_size((int)i), (int)k);
+                    bump(cache->frees);
+                }
+            }
+        }
+    }
+    g.retired.hits += cache->hits;
+    g.retired.global_hits += cache->global_hits;
+    g.retired.misses += cache->misses;
+    g.retired.releases += cache->releases;
+    g.retired.frees += cache->frees;
+    g.caches.erase(cache);
+    delete cache;
+    cache = nullptr;
+}
+
+void* StackPool::Alloc(size_t& size, int& kind, bool huge_pages) {
+    StackThreadCache* cache = thread_cache();
+    if(huge_pages) {
+        // 大页栈按大页大小取整，不做缓存
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        kind = MMAP_HUGE;
+        if(cache) {
+            bump(cache->misses);
+        }
+        return system_alloc(size, kind);
+    }
+
+    kind = s_mode.load(std::memory_order_relaxed);
+    int cls = size_class(size);
+    if(cls < 0) {
+        // 超大栈不做缓存
+        if(cache) {
+            bump(cache->misses);
+        }
+        return system_alloc(size, kind);
+    }
+    size = class_size(cls);
+
+    // 1 本线程缓存
+    std::vector<void*>* local = cache ? &cache->free_list[kind][cls]: nullptr;
+    if(local && !local->empty()) {
+        void* stack = local->back();
+        local->pop_back();
+        bump(cache->hits);
+        bump(cache->cached, -1);
+        return stack;
+    }
+
+    // 2 全局溢出链表
+    {
+        StackGlobal& g = global();
+        std::lock_guard<std::mutex> lock(g.mutex);
+        std::vector<void*>& list = g.free_list[node_slot()][kind][cls];
+        if(!list.empty()) {
+            void* stack = list.back();
+            list.pop_back();
+            if(cache) {
+                bump(cache->global_hits);
+            } else {
+                ++g.retired.global_hits;
+            }
+            return stack;
+        }
+        if(!cache) {
+            ++g.retired.misses;
+        }
+    }
+
+    // 3 向系统申请
+    if(cache) {
+        bump(cache->misses);
+    }
+    return system_alloc(size, kind);
+}
+
+void StackPool::Free(void* stack, size_t size, int kind) {
+    if(!stack) {
+        return;
+    }
+    int cls = size_class(size);
+    StackThreadCache* cache = thread_cache();
+    if(cls < 0 || kind == MMAP_HUGE) {
+        if(cache) {
+            bump(cache->frees);
+        }
+        system_free(stack, size, kind);
+        return;
+    }
+
+    if(cache && cache->free_list[kind][cls].size() < s_thread_capacity.load(std::memory_order_relaxed)) {
+        cache->free_list[kind][cls].push_back(stack);
+        bump(cache->releases);
+        bump(cache->cached);
+        return;
+    }
+
+    bool pushed;
+    {
+        StackGlobal& g = global();
+        std::lock_guard<std::mutex> lock(g.mutex);
+        pushed = push_global_locked(kind, cls, stack);
+        if(!cache) {
+            ++(pushed ? g.retired.releases : g.retired.frees);
+        }
+    }
+    if(cache) {
+        bump(pushed ? cache->releases : cache->frees);
+    }
+    if(!pushed) {
+        system_free(stack, size, kind);
+    }
+}
+
+size_t StackPool::RoundUp(size_t size) {
+    int cls = size_class(size);
+    return cls < 0 ? size: class_size(cls);
+}
+
+void StackPool::SetThreadCapacity(size_t n) {
+    s_thread_capacity = n;
+}
+
+void StackPool::SetGlobalCapacity(size_t n) {
+    s_global_capacity = n;
+}
+
+size_t StackPool::GetThreadCapacity() {
+    return s_thread_capacity;
+}
+
+size_t StackPool::GetGlobalCapacity() {
+    return s_global_capacity;
+}
+
+void StackPool::SetMode(Kind kind) {
+    assert(kind == HEAP || kind == MMAP);
+    s_mode = kind;
+}
+
+StackPool::Kind StackPool::GetMode() {
+    return (Kind)s_mode.load(std::memory_order_relaxed);
+}
+
+size_t StackPool::DefaultStackSize() {
+    // mmap的栈按需提交物理页，可以给到1MB虚拟空间
+    return GetMode() == MMAP ? 1024 * 1024: 128000;
+}
+
+StackPool::Stats StackPool::GetStats() {
+    StackGlobal& g = global();
+    std::lock_guard<std::mutex> lock(g.mutex);
+    Stats st = g.retired;
+    st.cached = 0;
+    for(auto cache: g.caches) {
+        st.hits += cache->hits.load(std::memory_order_relaxed);
+        st.global_hits += cache->global_hits.load(std::memory_order_relaxed);
+        st.misses += cache->misses.load(std::memory_order_relaxed);
+        st.releases += cache->releases.load(std::memory_order_relaxed);
+        st.frees += cache->frees.load(std::memory_order_relaxed);
+        st.cached += cache->cached.load(std::memory_order_relaxed);
+    }
+    for(size_t n = 0; n < NODE_SLOTS; ++n) {
+        for(size_t k = 0; k < POOL_KINDS; ++k) {
+            for(size_t i = 0; i < CLASS_COUNT; ++i) {
+                st.cached += g.free_list[n][k][i].size();
+            }
+        }
+    }
+    return st;
+}
+
+}
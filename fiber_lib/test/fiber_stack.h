@@ -0,0 +1,85 @@
+#ifndef __SYLAR_FIBER_STACK_H__
+#define __SYLAR_FIBER_STACK_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sylar {
+
+// 协程栈池
+// 每个线程按尺寸等级（64KB、128KB ... 8MB，2的幂）缓存已释放的栈，分配时优先从本线程缓存取，
+// 本线程缓存不足时再去全局溢出链表取，最后才真正向系统申请内存。
+// 释放时先放回本线程缓存，超过上限则放入全局溢出链表，全局也满了才把内存还给系统。
+// 这样 Scheduler::run() 中为每个回调任务创建/销毁 Fiber 时不再每次都 malloc/free 一块大内存。
+//
+// 栈内存有两种来源（SetMode）：
+// HEAP: malloc，默认栈大小128000字节（向上取整为128KB）
+// MMAP: 每个栈单独mmap一段区域，最低处放一个PROT_NONE的保护页，栈溢出会直接SIGSEGV而不是悄悄写坏相邻内存；
+//       物理页由内核在首次访问时才提交，因此默认栈可以提高到1MB虚拟内存，只为真正用到的页付出RSS。
+//       注意每个栈占两个内存映射，大量协程时需要调大 vm.max_map_count。
+// 另外可以为热点、长生命周期的协程申请大页栈（huge_pages），优先MAP_HUGETLB，
+// 系统未预留大页时退化为透明大页（madvise MADV_HUGEPAGE）。大页栈不进入栈池。
+class StackPool {
+public:
+    // 栈内存的来源
+    enum Kind {
+        HEAP = 0,
+        MMAP = 1,
+        // 大页栈，仅由 Alloc(..., huge_pages = true) 产生
+        MMAP_HUGE = 2
+    };
+
+    // 最小/最大的尺寸等级，超过最大等级的栈不做缓存
+    static const size_t MIN_CLASS_SIZE = 64 * 1024;
+    static const size_t MAX_CLASS_SIZE = 8 * 1024 * 1024;
+    static const size_t CLASS_COUNT = 8;
+
+    struct Stats {
+        // 本线程缓存命中次数
+        uint64_t hits = 0;
+        // 全局溢出链表命中次数
+        uint64_t global_hits = 0;
+        // 未命中，向系统申请内存的次数
+        uint64_t misses = 0;
+        // 归还到栈池的次数（包括进入全局链表）
+        uint64_t releases = 0;
+        // 因超过上限而真正释放给系统的次数
+        uint64_t frees = 0;
+        // 当前缓存在栈池里（本线程 + 全局）的栈数量
+        uint64_t cached = 0;
+    };
+
+public:
+    // 分配一个至少 size 字节的栈，size 会被向上取整到尺寸等级并回写，kind 回写栈内存的来源
+    // 返回可用栈空间的最低地址，失败返回nullptr
+    static void* Alloc(size_t& size, int& kind, bool huge_pages = false);
+
+    // 归还一个由 Alloc 分配的栈，size / kind 为 Alloc 回写的值
+    static void Free(void* stack, size_t size, int kind);
+
+    // 返回 size 对应尺寸等级的实际栈大小（与 Alloc 回写的值一致）
+    static size_t RoundUp(size_t size);
+
+    // 设置每个尺寸等级在单个线程中最多缓存多少个栈，0表示不缓存
+    static void SetThreadCapacity(size_t n);
+
+    // 设置每个尺寸等级在全局溢出链表中最多缓存多少个栈（每个NUMA节点的链表分别计算），0表示不缓存
+    static void SetGlobalCapacity(size_t n);
+
+    static size_t GetThreadCapacity();
+    static size_t GetGlobalCapacity();
+
+    // 设置之后新分配的栈的来源（HEAP 或 MMAP），已分配的栈不受影响
+    static void SetMode(Kind kind);
+    static Kind GetMode();
+
+    // 当前模式下 Fiber 未指定栈大小时使用的默认值
+    static size_t DefaultStackSize();
+
+    // 汇总所有线程的计数器
+    static Stats GetStats();
+};
+
+}
+
+#endif
@@ -0,0 +1,275 @@
+#include "fiber_sync.h"
+
+namespace sylar {
+
+namespace detail {
+
+void SyncWaiter::wake() {
+    if(fiber) {
+        // 协程可能还没在原来的线程上切换出去，resume() 会等它切换完成
+        scheduler->scheduleLock(std::move(fiber));
+    } else {
+        sem->signal();
+    }
+}
+
+void SyncWaitQueue::wait(std::unique_lock<std::mutex>& lock, FiberMutex* release) {
+    if(Fiber::CanSuspend() && Scheduler::GetThis()) {
+        Fiber* self = Fiber::Current();
+        SyncWaiter waiter;
+        waiter.scheduler = Scheduler::GetThis();
+        waiter.fiber = Fiber::ptr(self);
+        m_waiters.push_back(std::move(waiter));
+        lock.unlock();
+        if(release) {
+            release->unlock();
+        }
+        Fiber::SetWaitReason(Fiber::WAIT_SYNC);
+        self->yield();
+    } else {
+        // 不在调度器的协程中，只能阻塞当前线程
+        Semaphore sem;
+        SyncWaiter waiter;
+        waiter.sem = &sem;
+        m_waiters.push_back(std::move(waiter));
+        lock.unlock();
+        if(release) {
+            release->unlock();
+        }
+        sem.wait();
+    }
+}
+
+bool SyncWaitQueue::pop(SyncWaiter& waiter) {
+    if(m_waiters.empty()) {
+        return false;
+    }
+    waiter = std::move(m_waiters.front());
+    m_waiters.pop_front();
+    return true;
+}
+
+}
+
+void FiberMutex::lockSlow() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    int s = m_state.load(std::memory_order_relaxed);
+    while(true) {
+        if(s == UNLOCKED) {
+            if(m_state.compare_exchange_weak(s, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return;
+            }
+            continue;
+        }
+        // 标记有等待者，持有者解锁时就会走慢路径来唤醒我们
+        if(s == LOCKED && !m_state.compare_exchange_weak(s, CONTENDED, std::memory_order_relaxed)) {
+            continue;
+        }
+        // 被唤醒时锁已经转交给本协程
+        m_queue.wait(lock);
+        return;
+    }
+}
+
+void FiberMutex::unlockSlow() {
+    detail::SyncWaiter waiter;
+    bool handoff;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        handoff = m_queue.pop(waiter);
+        if(!handoff) {
+            m_state.store(UNLOCKED, std::memory_order_release);
+        } else if(m_queue.empty()) {
+            // 锁仍然被持有（归被唤醒者），只是没有其他等待者了
+            m_state.store(LOCKED, std::memory_order_relaxed);
+        }
+    }
+    if(handoff) {
+        waiter.wake();
+    }
+}
+
+void FiberCondVar::wait(std::unique_lock<FiberMutex>& lock) {
+    FiberMutex* mutex = lock.mutex();
+    assert(mutex && lock.owns_lock());
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        // 在释放 mutex 之前登记，修改条件后再 notify 的一方一定能看到
+        m_waiters.fetch_add(1, std::memory_order_relaxed);
+        m_queue.wait(guard, mutex);
+    }
+    mutex->lock();
+}
+
+void FiberCondVar::notify_one() {
+    if(m_waiters.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    detail::SyncWaiter waiter;
+    bool found;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        found = m_queue.pop(waiter);
+        if(found) {
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    if(found) {
+        waiter.wake();
+    }
+}
+
+void FiberCondVar::notify_all() {
+    if(m_waiters.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    std::deque<detail::SyncWaiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.popAll(waiters);
+        m_waiters.fetch_sub(waiters.size(), std::memory_order_relaxed);
+    }
+    for(auto& w: waiters) {
+        w.wake();
+    }
+}
+
+bool FiberSemaphore::tryWait() {
+    int64_t c = m_count.load(std::memory_order_relaxed);
+    while(c > 0) {
+        if(m_count.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FiberSemaphore::waitSlow() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // 在入队之前就有 post 把计数给了我们
+    if(m_pendingWakes > 0) {
+        --m_pendingWakes;
+        return;
+    }
+    m_queue.wait(lock);
+}
+
+void FiberSemaphore::postSlow() {
+    detail::SyncWaiter waiter;
+    bool found;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        found = m_queue.pop(waiter);
+        if(!found) {
+            // 等待者已经减了计数但还没入队
+            ++m_pendingWakes;
+        }
+    }
+    if(found) {
+        waiter.wake();
+    }
+}
+
+void FiberRWMutex::lockSlow() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint32_t s = m_state.load(std::memory_order_relaxed);
+    while(true) {
+        if(s == 0) {
+            if(m_state.compare_exchange_weak(s, WRITER, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return;
+            }
+            continue;
+        }
+        if(!(s & WAITERS) && !m_state.compare_exchange_weak(s, s | WAITERS, std::memory_order_relaxed)) {
+            continue;
+        }
+        // 被唤醒时写锁已经转交给本协程
+        m_writers.wait(lock);
+        return;
+    }
+}
+
+void FiberRWMutex::lockSharedSlow() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint32_t s = m_state.load(std::memory_order_relaxed);
+    while(true) {
+        if(!(s & (WRITER | WAITERS))) {
+            if(m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return;
+            }
+            continue;
+        }
+        if(!(s & WAITERS) && !m_state.compare_exchange_weak(s, s | WAITERS, std::memory_order_relaxed)) {
+            continue;
+        }
+        // 被唤醒时读者计数已经替本协程加上
+        m_readers.wait(lock);
+        return;
+    }
+}
+
+void FiberRWMutex::unlockSlow() {
+    std::deque<detail::SyncWaiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // 有等待者时快路径都会失败，状态只会在这里改变
+        handOff(waiters, true);
+    }
+    for(auto& w: waiters) {
+        w.wake();
+    }
+}
+
+void FiberRWMutex::unlockSharedSlow() {
+    std::deque<detail::SyncWaiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint32_t s = m_state.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        // 最后一个读者离开，优先交给等待的写者
+        if((s & READER_MASK) == 0) {
+            handOff(waiters, false);
+        }
+    }
+    for(auto& w: waiters) {
+        w.wake();
+    }
+}
+
+void FiberRWMutex::handOff(std::deque<detail::SyncWaiter>& waiters, bool prefer_readers) {
+    if(!m_readers.empty() && (prefer_readers || m_writers.empty())) {
+        uint32_t n = m_readers.size();
+        m_readers.popAll(waiters);
+        m_state.store(n | (m_writers.empty() ? 0: WAITERS), std::memory_order_release);
+        return;
+    }
+    detail::SyncWaiter writer;
+    if(m_writers.pop(writer)) {
+        waiters.push_back(std::move(writer));
+        bool more = !m_writers.empty() || !m_readers.empty();
+        m_state.store(WRITER | (more ? WAITERS: 0), std::memory_order_release);
+        return;
+    }
+    m_state.store(0, std::memory_order_release);
+}
+
+void WaitGroup::waitSlow() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // 计数归零的一方在减完之后才加锁唤醒，这里在锁内看到非0就一定能被它唤醒
+    if(m_count.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+    m_queue.wait(lock);
+}
+
+void WaitGroup::wakeAll() {
+    std::deque<detail::SyncWaiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.popAll(waiters);
+    }
+    for(auto& w: waiters) {
+        w.wake();
+    }
+}
+
+}
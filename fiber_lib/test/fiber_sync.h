@@ -0,0 +1,305 @@
+#ifndef __SYLAR_FIBER_SYNC_H__
+#define __SYLAR_FIBER_SYNC_H__
+
+// 协程同步原语：FiberMutex / FiberCondVar / FiberSemaphore / FiberRWMutex / WaitGroup
+//
+// 与 Semaphore（thread.h）不同，等待时挂起的是当前协程而不是工作线程：
+// 协程把自己放进原语的等待队列后 yield，被唤醒时通过 Scheduler::scheduleLock 放回调度器
+// （共享栈协程自动放回它绑定的线程），工作线程在此期间继续执行其他任务。
+// 无竞争时只有一次原子操作，不经过调度器和内部的锁。
+//
+// 必须在调度器管理的协程中等待；在调度器之外的普通线程（例如 main 中）调用时退化为阻塞该线程。
+// 接口与标准库一致，可以直接配合 std::lock_guard / std::unique_lock / std::shared_lock 使用。
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+#include "scheduler.h"
+
+namespace sylar {
+
+class FiberMutex;
+
+namespace detail {
+
+// 一个挂起的等待者：调度器中的协程，或调度器之外阻塞在信号量上的线程
+struct SyncWaiter {
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    Semaphore* sem = nullptr;
+
+    // 把等待者放回调度器（或唤醒线程）
+    void wake();
+};
+
+// 等待队列，由各原语内部的 std::mutex 保护
+class SyncWaitQueue {
+public:
+    bool empty() const {
+        return m_waiters.empty();
+    }
+
+    size_t size() const {
+        return m_waiters.size();
+    }
+
+    // 把当前协程（或线程）加入队列，释放lock（以及release，供条件变量使用）后挂起，直到被取出并唤醒。
+    // 返回时lock处于未加锁状态
+    void wait(std::unique_lock<std::mutex>& lock, FiberMutex* release = nullptr);
+
+    // 取出队首的等待者，队列为空返回false；在锁外调用 SyncWaiter::wake
+    bool pop(SyncWaiter& waiter);
+
+    // 取出所有等待者
+    void popAll(std::deque<SyncWaiter>& waiters) {
+        waiters.swap(m_waiters);
+    }
+
+private:
+    std::deque<SyncWaiter> m_waiters;
+};
+
+}
+
+// 协程互斥锁
+// 解锁时若有等待者，锁直接转交给队首的协程（FIFO），被唤醒的协程不需要再竞争
+class FiberMutex {
+public:
+    FiberMutex() {}
+    FiberMutex(const FiberMutex&) = delete;
+    FiberMutex& operator=(const FiberMutex&) = delete;
+
+    void lock() {
+        int expected = UNLOCKED;
+        if(!m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+            lockSlow();
+        }
+    }
+
+    bool try_lock() {
+        int expected = UNLOCKED;
+        return m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        int expected = LOCKED;
+        if(!m_state.compare_exchange_strong(expected, UNLOCKED, std::memory_order_release, std::memory_order_relaxed)) {
+            unlockSlow();
+        }
+    }
+
+private:
+    void lockSlow();
+    void unlockSlow();
+
+private:
+    // 未加锁 / 已加锁且没有等待者 / 已加锁且可能有等待者（解锁时必须走慢路径）
+    enum State {
+        UNLOCKED = 0,
+        LOCKED = 1,
+        CONTENDED = 2
+    };
+
+    std::atomic<int> m_state{UNLOCKED};
+    std::mutex m_mutex;
+    detail::SyncWaitQueue m_queue;
+};
+
+// 协程条件变量，配合 FiberMutex 使用
+// 与 std::condition_variable 一样，修改条件时应持有同一把 FiberMutex，等待一方应在循环中检查条件
+class FiberCondVar {
+public:
+    FiberCondVar() {}
+    FiberCondVar(const FiberCondVar&) = delete;
+    FiberCondVar& operator=(const FiberCondVar&) = delete;
+
+    // lock 必须已经加锁；挂起期间释放，返回前重新加锁
+    void wait(std::unique_lock<FiberMutex>& lock);
+
+    template<class Predicate>
+    void wait(std::unique_lock<FiberMutex>& lock, Predicate pred) {
+        while(!pred()) {
+            wait(lock);
+        }
+    }
+
+    // 没有等待者时只有一次原子读
+    void notify_one();
+    void notify_all();
+
+private:
+    std::atomic<size_t> m_waiters{0};
+    std::mutex m_mutex;
+    detail::SyncWaitQueue m_queue;
+};
+
+// 协程信号量
+// 计数为正时 wait 只是一次原子减；计数可以为负，绝对值为正在等待（或即将入队）的协程数
+class FiberSemaphore {
+public:
+    explicit FiberSemaphore(int64_t count = 0): m_count(count) {}
+    FiberSemaphore(const FiberSemaphore&) = delete;
+    FiberSemaphore& operator=(const FiberSemaphore&) = delete;
+
+    // P 操作
+    void wait() {
+        if(m_count.fetch_sub(1, std::memory_order_acquire) <= 0) {
+            waitSlow();
+        }
+    }
+
+    // 计数为正时减一并返回true，否则不等待直接返回false
+    bool tryWait();
+
+    // V 操作
+    void post() {
+        if(m_count.fetch_add(1, std::memory_order_release) < 0) {
+            postSlow();
+        }
+    }
+
+    // 当前计数，为负表示有等待者
+    int64_t getCount() const {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    void waitSlow();
+    void postSlow();
+
+private:
+    std::atomic<int64_t> m_count;
+    std::mutex m_mutex;
+    // post 已经把计数给了某个等待者、但它还没来得及入队，入队前先检查这里
+    int64_t m_pendingWakes = 0;
+    detail::SyncWaitQueue m_queue;
+};
+
+// 协程读写锁
+// 有写者等待时新的读者排队，避免写者饿死；写锁释放时优先唤醒所有排队的读者，读写交替进行
+class FiberRWMutex {
+public:
+    FiberRWMutex() {}
+    FiberRWMutex(const FiberRWMutex&) = delete;
+    FiberRWMutex& operator=(const FiberRWMutex&) = delete;
+
+    // 写锁
+    void lock() {
+        uint32_t expected = 0;
+        if(!m_state.compare_exchange_strong(expected, WRITER, std::memory_order_acquire, std::memory_order_relaxed)) {
+            lockSlow();
+        }
+    }
+
+    bool try_lock() {
+        uint32_t expected = 0;
+        return m_state.compare_exchange_strong(expected, WRITER, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        uint32_t expected = WRITER;
+        if(!m_state.compare_exchange_strong(expected, 0, std::memory_order_release, std::memory_order_relaxed)) {
+            unlockSlow();
+        }
+    }
+
+    // 读锁
+    void lock_shared() {
+        if(!try_lock_shared()) {
+            lockSharedSlow();
+        }
+    }
+
+    bool try_lock_shared() {
+        uint32_t s = m_state.load(std::memory_order_relaxed);
+        while(!(s & (WRITER | WAITERS))) {
+            if(m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void unlock_shared() {
+        uint32_t s = m_state.load(std::memory_order_relaxed);
+        while(!(s & WAITERS)) {
+            if(m_state.compare_exchange_weak(s, s - 1, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+        unlockSharedSlow();
+    }
+
+private:
+    void lockSlow();
+    void unlockSlow();
+    void lockSharedSlow();
+    void unlockSharedSlow();
+
+    // 锁已空闲（没有读者也没有写者）时把它转交给等待者：一批读者或一个写者，prefer_readers决定两者都在等时交给谁。
+    // 调用时持有 m_mutex，被转交的等待者放入 waiters，由调用方在锁外唤醒
+    void handOff(std::deque<detail::SyncWaiter>& waiters, bool prefer_readers);
+
+private:
+    // 写者持有
+    static constexpr uint32_t WRITER = 1u << 31;
+    // 有等待者，释放时必须走慢路径（只在 m_mutex 下修改）
+    static constexpr uint32_t WAITERS = 1u << 30;
+    // 低位为持有读锁的读者数
+    static constexpr uint32_t READER_MASK = WAITERS - 1;
+
+    std::atomic<uint32_t> m_state{0};
+    std::mutex m_mutex;
+    detail::SyncWaitQueue m_readers;
+    detail::SyncWaitQueue m_writers;
+};
+
+// 等待一组任务全部完成（类似 Go 的 sync.WaitGroup）
+// 派发任务前 add(n)，每个任务结束时 done()，wait() 挂起当前协程直到计数归零。
+// 最后一个 done() 在计数归零之后还要唤醒等待者，WaitGroup 不能在它返回之前销毁
+// （等待者看到计数归零就把它析构掉的场景，应当像 TaskGroup 那样把它放在任务共享的引用计数对象里）
+class WaitGroup {
+public:
+    explicit WaitGroup(int64_t count = 0): m_count(count) {}
+    WaitGroup(const WaitGroup&) = delete;
+    WaitGroup& operator=(const WaitGroup&) = delete;
+
+    void add(int64_t n = 1) {
+        m_count.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // 计数归零时唤醒所有等待者
+    void done() {
+        int64_t prev = m_count.fetch_sub(1, std::memory_order_acq_rel);
+        assert(prev > 0);
+        if(prev == 1) {
+            wakeAll();
+        }
+    }
+
+    // 计数已经为0时只有一次原子读
+    void wait() {
+        if(m_count.load(std::memory_order_acquire) != 0) {
+            waitSlow();
+        }
+    }
+
+    int64_t getCount() const {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    void waitSlow();
+    void wakeAll();
+
+private:
+    std::atomic<int64_t> m_count;
+    std::mutex m_mutex;
+    detail::SyncWaitQueue m_queue;
+};
+
+}
+
+#endif
@@ -0,0 +1,42 @@
+#include "future.h"
+
+namespace sylar {
+
+namespace detail {
+
+void TaskGroupState::fail(std::exception_ptr e) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!error) {
+            error = e;
+        }
+    }
+    cancelled.store(true, std::memory_order_release);
+}
+
+}
+
+TaskGroup::TaskGroup(Scheduler* sc)
+    :m_scheduler(sc ? sc: Scheduler::GetThis())
+    ,m_state(new detail::TaskGroupState()) {
+    assert(m_scheduler);
+}
+
+TaskGroup::~TaskGroup() {
+    // 任务通常引用着调用方的局部变量，不能先于它们返回
+    m_state->pending.wait();
+}
+
+void TaskGroup::wait() {
+    m_state->pending.wait();
+    std::exception_ptr e;
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        e = m_state->error;
+    }
+    if(e) {
+        std::rethrow_exception(e);
+    }
+}
+
+}
@@ -0,0 +1,235 @@
+#ifndef __SYLAR_FUTURE_H__
+#define __SYLAR_FUTURE_H__
+
+// 扇出/扇入：spawn() 返回的 Future<T>，以及出错即取消的 TaskGroup
+//
+// scheduleLock 提交的任务没有返回值，也无法等待。spawn() 把可调用对象交给调度器执行，
+// 返回一个 Future，可以在协程中 get() 等待结果（挂起当前协程，工作线程继续执行其他任务），
+// 任务抛出的异常在 get() 中重新抛出。Future<void> 即 join handle。
+//
+// 用法：
+//   auto a = spawn(&iom, [&]{ return callBackend(1); });
+//   auto b = spawn(&iom, [&]{ return callBackend(2); });
+//   int sum = a.get() + b.get();
+//
+//   TaskGroup group(&iom);
+//   for(auto& req: reqs) group.spawn([&]{ if(!group.isCancelled()) call(req); });
+//   group.wait();   // 第一个异常在这里重新抛出，其余尚未开始的任务不会再执行
+
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "fiber_sync.h"
+
+namespace sylar {
+
+// 在开始执行之前被 cancel() 的任务，get() 抛出该异常
+class FutureCancelled: public std::runtime_error {
+public:
+    FutureCancelled(): std::runtime_error("future cancelled") {}
+};
+
+namespace detail {
+
+template<class T>
+struct FutureValue {
+    std::optional<T> value;
+
+    template<class F>
+    void run(F& f) {
+        value.emplace(f());
+    }
+
+    T& get() {
+        return *value;
+    }
+};
+
+template<>
+struct FutureValue<void> {
+    template<class F>
+    void run(F& f) {
+        f();
+    }
+
+    void get() {}
+};
+
+// Future 与执行它的任务共享的状态，侵入式引用计数
+template<class T>
+struct FutureState: public RefCounted {
+    typedef RefPtr<FutureState> ptr;
+
+    enum Status {
+        PENDING,
+        RUNNING,
+        DONE,
+        CANCELLED
+    };
+
+    std::atomic<int> status{PENDING};
+    // 完成（或取消）时归零
+    WaitGroup finished{1};
+    FutureValue<T> result;
+    std::exception_ptr exception;
+
+    template<class F>
+    void run(F& f) {
+        int expected = PENDING;
+        if(!status.compare_exchange_strong(expected, RUNNING, std::memory_order_acq_rel)) {
+            // 已被取消
+            return;
+        }
+        try {
+            result.run(f);
+        } catch(...) {
+            exception = std::current_exception();
+        }
+        status.store(DONE, std::memory_order_release);
+        finished.done();
+    }
+
+    bool cancel() {
+        int expected = PENDING;
+        if(!status.compare_exchange_strong(expected, CANCELLED, std::memory_order_acq_rel)) {
+            return false;
+        }
+        finished.done();
+        return true;
+    }
+};
+
+// TaskGroup 与其中的任务共享的状态：最后一个任务 done() 时还会访问 WaitGroup，
+// 不能是 TaskGroup 对象本身，否则等待者看到计数归零就析构 TaskGroup，与之竞争
+struct TaskGroupState: public RefCounted {
+    typedef RefPtr<TaskGroupState> ptr;
+
+    WaitGroup pending;
+    std::atomic<bool> cancelled{false};
+    std::mutex mutex;
+    std::exception_ptr error;
+
+    // 记录第一个异常并取消整组
+    void fail(std::exception_ptr e);
+};
+
+}
+
+// 任务结果，可以拷贝，所有副本共享同一个结果
+template<class T>
+class Future {
+public:
+    Future() {}
+
+    explicit Future(typename detail::FutureState<T>::ptr state): m_state(std::move(state)) {}
+
+    bool valid() const {
+        return (bool)m_state;
+    }
+
+    // 任务已经完成（或已取消），get() 不会挂起
+    bool isReady() const {
+        return m_state->finished.getCount() == 0;
+    }
+
+    // 挂起当前协程直到任务完成
+    void wait() const {
+        m_state->finished.wait();
+    }
+
+    // 等待并取得结果：任务抛出的异常在这里重新抛出，已取消时抛出 FutureCancelled。
+    // 返回的引用在最后一个 Future 副本销毁之前有效
+    typename std::add_lvalue_reference<T>::type get() const {
+        wait();
+        if(m_state->status.load(std::memory_order_acquire) == detail::FutureState<T>::CANCELLED) {
+            throw FutureCancelled();
+        }
+        if(m_state->exception) {
+            std::rethrow_exception(m_state->exception);
+        }
+        return m_state->result.get();
+    }
+
+    // 任务还没开始执行时取消它，返回false表示已经开始（或已经结束），此时只能等它完成
+    bool cancel() {
+        return m_state->cancel();
+    }
+
+private:
+    typename detail::FutureState<T>::ptr m_state;
+};
+
+template<>
+inline std::add_lvalue_reference<void>::type Future<void>::get() const {
+    wait();
+    if(m_state->status.load(std::memory_order_acquire) == detail::FutureState<void>::CANCELLED) {
+        throw FutureCancelled();
+    }
+    if(m_state->exception) {
+        std::rethrow_exception(m_state->exception);
+    }
+}
+
+// 把f交给调度器执行并返回它的 Future，参数与 scheduleLock 相同
+template<class F, class R = typename std::invoke_result<F&>::type>
+Future<R> spawn(Scheduler* sc, F f, int thread = -1, int stack_flags = Fiber::STACK_DEFAULT,
+                int priority = Scheduler::PRIORITY_NORMAL) {
+    typename detail::FutureState<R>::ptr state(new detail::FutureState<R>());
+    sc->scheduleLock([state, f = std::move(f)]() mutable {
+        state->run(f);
+    }, thread, stack_flags, priority);
+    return Future<R>(state);
+}
+
+// 一组并发任务，任意一个抛出异常即取消整组（类似 Go 的 errgroup）
+// 取消后尚未开始的任务直接跳过；已经在运行的任务应当在合适的位置检查 isCancelled() 提前返回。
+// 任务通常引用调用方栈上的变量，析构时会等待所有任务结束
+class TaskGroup {
+public:
+    // sc为空时使用当前线程的调度器
+    explicit TaskGroup(Scheduler* sc = nullptr);
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    template<class F>
+    void spawn(F f, int thread = -1, int stack_flags = Fiber::STACK_DEFAULT,
+               int priority = Scheduler::PRIORITY_NORMAL) {
+        m_state->pending.add(1);
+        m_scheduler->scheduleLock([state = m_state, f = std::move(f)]() mutable {
+            if(!state->cancelled.load(std::memory_order_acquire)) {
+                try {
+                    f();
+                } catch(...) {
+                    state->fail(std::current_exception());
+                }
+            }
+            state->pending.done();
+        }, thread, stack_flags, priority);
+    }
+
+    // 挂起当前协程直到所有任务结束，有任务抛出异常时重新抛出第一个
+    void wait();
+
+    // 主动取消整组
+    void cancel() {
+        m_state->cancelled.store(true, std::memory_order_release);
+    }
+
+    bool isCancelled() const {
+        return m_state->cancelled.load(std::memory_order_acquire);
+    }
+
+private:
+    Scheduler* m_scheduler;
+    detail::TaskGroupState::ptr m_state;
+};
+
+}
+
+#endif
@@ -1,10 +1,22 @@
 #include "hook.h"
+#include "cancel.h"
 #include "ioscheduler.h"
 #include <dlfcn.h>
-#include <iostream>
 #include <cstdarg>
 #include "fd_manager.h"
+#include "fiber_local.h"
+#include "log.h"
+#include "offload.h"
+#include "resolver.h"
 #include <string.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <vector>
 
 // apply XX to all functions
 // 此宏定义了一个函数列表，列表中包括了所有希望实现Hook的系统调用
@@ -16,36 +28,64 @@
     XX(socket) \
     XX(connect) \
     XX(accept) \
+    XX(accept4) \
     XX(read) \
     XX(readv) \
     XX(recv) \
     XX(recvfrom) \
     XX(recvmsg) \
+    XX(recvmmsg) \
     XX(write) \
     XX(writev) \
     XX(send) \
     XX(sendto) \
     XX(sendmsg) \
+    XX(sendmmsg) \
     XX(close) \
     XX(fcntl) \
     XX(ioctl) \
     XX(getsockopt) \
-    XX(setsockopt) 
+    XX(setsockopt) \
+    XX(fsync) \
+    XX(sendfile) \
+    XX(splice) \
+    XX(tee) \
+    XX(poll) \
+    XX(ppoll) \
+    XX(select) \
+    XX(epoll_wait) \
+    XX(getaddrinfo)
 
 namespace sylar {
 // if this thread is using hooked function 
 //使用线程局部变量，每个线程都会判断一下是否启用了钩子
 //表示当前线程是否启用了钩子功能。初始值为 false，即钩子功能默认关闭。
+// 这是线程的默认值：协程自己设置过（见 s_hook_fiber）时以协程的为准
 static thread_local bool t_hook_enable = false;
 
-//返回当前线程的钩子功能是否启用。
+// 协程自己的设置，随协程迁移到其他线程：空表示沿用所在线程的默认值
+static FiberLocalKey s_hook_fiber;
+static void* const HOOK_FIBER_OFF = (void*)1;
+static void* const HOOK_FIBER_ON = (void*)2;
+
+static inline bool hook_enabled() {
+    void* v = s_hook_fiber.get();
+    return v ? v == HOOK_FIBER_ON: t_hook_enable;
+}
+
+//返回当前协程（或线程）的钩子功能是否启用。
 bool is_hook_enable() {
-    return t_hook_enable;
+    return hook_enabled();
 }
 
-//设置当前线程的钩子功能是否启用
+// 在调度器管理的子协程里只对这个协程生效，协程换到别的线程恢复后仍然有效，也不影响同一线程上的其他协程；
+// 在线程的主协程、调度协程（包括内联回调）里设置线程的默认值
 void set_hook_enable(bool flag) {
-    t_hook_enable = flag;
+    if(Fiber::CanSuspend()) {
+        s_hook_fiber.set(flag ? HOOK_FIBER_ON: HOOK_FIBER_OFF);
+    } else {
+        t_hook_enable = flag;
+    }
 }
 
 // 初始化Hook机制，主要用来获取系统原始函数的地址并保存到对应的函数指针中。
@@ -87,10 +127,6 @@ struct HookIniter {
 static HookIniter s_hook_initer;
 } // end namespace sylar
 
-struct timer_info {
-    int cancelled = 0;
-};
-
 // universal template for read and write function
 // OriginFun：原始系统调用函数指针类型（如read_fun, write_fun）。
 // Args&&... args：变参模板参数，原样转发给系统调用
@@ -106,10 +142,46 @@ args: 其他所有的参数，转发给fun函数
 
 Args&&... args 表示函数可以接受任意个数的参数，并且能以完美转发（perfect forwarding） 的方式传递给其他函数，既保持参数的原始类型与引用特性（左值/右值不变）。
 */
+// 在卸载线程池中执行可能阻塞的调用。用户设置了 O_NONBLOCK 的fd不会阻塞，直接调用
+template<typename OriginFun, typename... Args>
+static ssize_t offload_io(int fd, OriginFun fun, Args&&... args) {
+    int flags = fcntl_f(fd, F_GETFL, 0);
+    if(flags == -1 || (flags & O_NONBLOCK)) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+    return sylar::offload([&]() {
+        return fun(fd, args...);
+    });
+}
+
+// IOManager 使用 ENGINE_URING 时，socket 上阻塞的 recv/send/accept 直接提交给 io_uring，
+// 不再先调用一次、返回 EAGAIN 后等就绪再调用。返回false表示不适用，调用方走 do_io
+template<typename Submit>
+static bool uring_io(int fd, int timeout_so, ssize_t& n, Submit submit) {
+    if(!sylar::hook_enabled()) {
+        return false;
+    }
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!iom || !iom->canSubmitIo()) {
+        return false;
+    }
+    // 提交给内核的操作不能被取消上下文中途唤醒，有上下文时走就绪模式
+    if(sylar::CancelContext::Current()) {
+        return false;
+    }
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClosed() || !ctx->isSocket() || ctx->getUserNonblock()) {
+        return false;
+    }
+    n = submit(iom, ctx->getTimeout(timeout_so));
+    // 内核没有替我们等待（非阻塞fd在旧内核上直接返回 EAGAIN）时退回就绪模式
+    return !(n == -1 && errno == EAGAIN);
+}
+
 template<typename OriginFun, typename... Args>
 // 表示函数为内部链接，仅在定义它的编译单元（cpp文件）中有效。
-static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t event, int timeout_so, Args&&... args) {
-    if(!sylar::t_hook_enable) {
+static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t event, int timeout_so, size_t len, Args&&... args) {
+    if(!sylar::hook_enabled()) {
         // 如果没有开启hook，则直接调用原始函数，结束。
         // 这里所有参数的类型、引用性质、左值右值，都原封不动地传递给系统调用函数
         return fun(fd, std::forward<Args>(args)...);
@@ -117,10 +189,10 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
 
     // 获取文件描述符上下文 (FdCtx)
     // typedef Singleton<FdManager> FdMgr;
-    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
     if(!ctx) {
-        // 如果找不到ctx，则不执行hook，直接调用原始函数
-        return fun(fd, std::forward<Args>(args)...);
+        // 没有经过 socket()/accept() 的fd（普通文件、管道等），交给卸载线程池执行
+        return offload_io(fd, fun, std::forward<Args>(args)...);
     }
 
     // 如果fd已经被关闭
@@ -132,117 +204,356 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
 
     // 如果当前fd不是socket类型，或用户自己将fd设置成了非阻塞模式，就不会进行hook处理，直接调用原始的系统调用返回。
     // 目的是只对socket类型的阻塞调用进行封装，避免干扰其他IO操作
-    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+    if(ctx->getUserNonblock()) {
         return fun(fd, std::forward<Args>(args)...);
     }
+    // 不是socket的fd没有可以等待的就绪事件，交给卸载线程池执行，当前协程挂起
+    if(!ctx->isSocket()) {
+        return offload_io(fd, fun, std::forward<Args>(args)...);
+    }
 
     // get the timeout
     // 根据当前fd的上下文(FdCtx)获取超时时间（发送或接收超时）。
     uint64_t timeout = ctx->getTimeout(timeout_so);
+
+    // 当前协程的取消上下文已经取消或到期：请求已经放弃，不再发起IO
+    if(int err = sylar::CancelContext::CheckCurrent()) {
+        errno = err;
+        return -1;
+    }
     
-    // timer condition
-    // timer_info结构用于后续记录超时事件状态（是否超时）。
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    sylar::IOManager::Event ev = (sylar::IOManager::Event)(event);
+    // 只有流式socket读写不足时可以断定缓冲区已经读空/写满（数据报一次只读一个）
+    bool short_means_drained = len && ctx->isStream();
+
 /*
-调用原始IO函数
+调用原始IO函数（已知未就绪时跳过）
    │
    ├─成功 → 返回
-   └─失败（EAGAIN）→ 注册事件 & 定时器，挂起协程
+   └─失败（EAGAIN）→ 注册事件（带超时），挂起协程
          │
          ├─IO事件发生 → 唤醒 → 重新尝试
          └─超时事件发生 → 唤醒 → 返回超时错误
 */
 // 标签 retry 和 IO 调用逻辑
 retry:
-    // run the function
-    // 实际调用系统的IO函数。
-    ssize_t n = fun(fd, std::forward<Args>(args)...);
-    
-    // EINTR ->Operation interrupted by system ->retry
-    // 如果调用过程中因为信号中断(EINTR)而失败，则自动重试，确保调用得到明确结果（成功或其他错误）。
-    while(n == -1 && errno == EINTR) {
+    // ENGINE_EPOLL_ET 下上次 EAGAIN 之后还没有来过边沿：调用也只会得到 EAGAIN，直接去等待
+    uint32_t readiness = iom ? iom->getReadiness(fd): 0;
+    bool not_ready = sylar::IOManager::IsNotReady(readiness, ev);
+    ssize_t n = -1;
+    if(!not_ready) {
+        // run the function
+        // 实际调用系统的IO函数。
         n = fun(fd, std::forward<Args>(args)...);
+
+        // EINTR ->Operation interrupted by system ->retry
+        // 如果调用过程中因为信号中断(EINTR)而失败，则自动重试，确保调用得到明确结果（成功或其他错误）。
+        while(n == -1 && errno == EINTR) {
+            n = fun(fd, std::forward<Args>(args)...);
+        }
+        not_ready = n == -1 && errno == EAGAIN;
+        if(iom && (not_ready || (short_means_drained && n > 0 && (size_t)n < len))) {
+            iom->markNotReady(fd, ev, readiness);
+        }
     }
 
     // 0 resource was temporarily unavailable -> retry until ready 
     // 非阻塞IO重试处理逻辑(EAGAIN)
     // 在非阻塞模式下，资源暂时不可用时，IO调用返回EAGAIN。
     // 这里处理这种情况，通过异步事件机制等待资源可用
-    if(n == -1 && errno == EAGAIN) {
-        sylar::IOManager* iom = sylar::IOManager::GetThis();
-        // timer
-        std::shared_ptr<sylar::Timer> timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-
-        // 1 timeout has been set -> add a conditional timer for canceling this operation
-        // 如果设置了超时时间，注册一个定时器
-        if(timeout != (uint64_t)-1) {
-/*
-参数1 (timeout)：定时器的超时时间（毫秒）。
-参数2（lambda）：定时器触发后执行的回调函数。
-参数3 (winfo)：条件对象的弱引用（weak_ptr），用于在定时器执行时判断目标对象是否有效，避免对象已经销毁后访问。
-*/
-            timer = iom->addConditionTimer(timeout, [winfo, fd, iom, event]() {
-                // 将弱引用（weak_ptr）提升为强引用（shared_ptr）
-                auto t = winfo.lock();
+    if(not_ready) {
+        // 注册当前协程到IOManager并挂起，等待事件发生或超时。
+        // 超时由IOManager在注册它的工作线程上检查，不需要额外的定时器，恢复后也不需要取消什么
+        int rt = iom->waitEvent(fd, ev, timeout);
+        if(rt == 0) {
+            // 事件就绪（或被 cancelEvent 唤醒，或 ENGINE_EPOLL_ET 下已经就绪过而没有挂起），重新尝试IO操作
+            goto retry;
+        }
+        // 超时或取消：waitEvent 已经在恢复后的线程上设置了 errno 为 ETIMEDOUT / ECANCELED
+        if(rt > 0) {
+            return -1;
+        }
+        // 注册事件失败的处理
+        SYLAR_LOG_ERROR() << hook_fun_name << " addEvent("<< fd << ", " << event << ") failed";
+        errno = EINVAL;  // 设置明确的错误码
+        return -1;
+    }
+    return n;
+}
 
-                // 若提升失败（!t），说明原对象(timer_info)已被销毁，直接返回，不执行后续逻辑。
-                if(!t || t->cancelled) {
-                    return;
-                }
+// poll/select/epoll_wait 挂起等待用：要等的 (fd, epoll事件)
+typedef std::vector<std::pair<int, uint32_t>> WaitList;
 
-                // 置位标志cancelled，表明此次操作已超时。
-                // 这里使用标准错误码ETIMEDOUT（连接或操作超时）
-                t->cancelled = ETIMEDOUT;
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 到 deadline 的剩余毫秒数，不限时（~0ull）仍为 ~0ull
+static uint64_t remaining_ms(uint64_t deadline) {
+    if(deadline == ~0ull) {
+        return ~0ull;
+    }
+    uint64_t now = now_ms();
+    return now >= deadline ? 0: deadline - now;
+}
 
-                // cancel this event and trigger once to return to this fiber
-                // 调用IOManager的cancelEvent方法，取消之前注册的fd上对应事件。
-                iom->cancelEvent(fd, (sylar::IOManager::Event)(event));
-            }, winfo);
+// 有取消上下文时的 sleep：定时器到期和 cancel() 哪个先到由哪个恢复协程。
+// 登记到取消上下文的等待项也放在这里（堆上）：cancel() 会在其他线程遍历、改写等待链表，
+// 共享栈协程挂起期间栈的内容属于别的协程，等待项不能在协程栈上
+struct SleepState: public sylar::CancelContext::Waiter {
+    std::atomic<bool> done{false};
+    sylar::Fiber::ptr fiber;
+    sylar::IOManager* iom = nullptr;
+    int result = 0;
+
+    void resume(int res) {
+        if(!done.exchange(true, std::memory_order_acq_rel)) {
+            result = res;
+            iom->scheduleLock(std::move(fiber));
         }
+    }
 
-        // 2 add event -> callback is this fiber
-        // 注册当前协程到IOManager，表示当前协程需要等待
-        int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
-        if(rt) {
-            // 注册事件失败的处理
-            std::cout << hook_fun_name << " addEvent("<< fd << ", " << event << ")";
+    static void Wake(sylar::CancelContext::Waiter* w) {
+        static_cast<SleepState*>(w)->resume(ECANCELED);
+    }
+};
+
+// 挂起当前协程 us 微秒，最多睡到 cancel 的截止时间，期间 cancel() 会提前唤醒。
+// 睡满返回0，被取消返回 ECANCELED，因截止时间提前结束返回 ETIMEDOUT；slept_us 回写实际睡了多久
+static int cancellable_sleep(sylar::CancelContext* cancel, sylar::IOManager* iom, uint64_t us, uint64_t& slept_us) {
+    uint64_t start = sylar::MonotonicNs();
+    slept_us = 0;
+    if(int err = cancel->check()) {
+        return err;
+    }
+    uint64_t deadline = cancel->getDeadline();
+    bool cut = false;
+    if(deadline != ~0ull && (deadline - start + 999) / 1000 < us) {
+        us = (deadline - start + 999) / 1000;
+        cut = true;
+    }
+    auto state = std::make_shared<SleepState>();
+    state->fiber = sylar::Fiber::GetThis();
+    state->iom = iom;
+    state->wake = &SleepState::Wake;
+    cancel->addWaiter(state.get());
+    std::shared_ptr<sylar::Timer> timer = iom->addTimerUs(us, [state, cut]() {
+        state->resume(cut ? ETIMEDOUT: 0);
+    });
+    // 登记之前已经取消的，cancel() 看不到这次等待
+    if(cancel->isCancelled()) {
+        state->resume(ECANCELED);
+    }
+    sylar::Fiber::SetWaitReason(sylar::Fiber::WAIT_TIMER, us);
+    sylar::Fiber::Current()->yield();
+    cancel->removeWaiter(state.get());
+    if(state->result == ECANCELED) {
+        timer->cancel();
+    }
+    slept_us = (sylar::MonotonicNs() - start) / 1000;
+    return state->result;
+}
+
+// 把 waits 加入一个临时的 epoll fd（同一fd的事件合并），当前协程等它可读，最多 timeout_ms。
+// 就绪或超时返回0；建不了 epoll fd 或注册失败返回-1，调用方改为在卸载线程池中阻塞调用；
+// 当前协程的取消上下文取消或到期时返回 ECANCELED / ETIMEDOUT，调用方以-1返回。
+// 普通文件加不进 epoll（EPERM），它们总是就绪，前面不带超时的检查已经报告过
+static int wait_any(sylar::IOManager* iom, WaitList& waits, uint64_t timeout_ms) {
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if(efd < 0) {
+        return -1;
+    }
+    std::sort(waits.begin(), waits.end());
+    for(size_t i = 0; i < waits.size();) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.data.fd = waits[i].first;
+        for(; i < waits.size() && waits[i].first == ev.data.fd; ++i) {
+            ev.events |= waits[i].second;
+        }
+        epoll_ctl(efd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    }
+    int rt = iom->waitEvent(efd, sylar::IOManager::READ, timeout_ms);
+    // 关闭前从 IOManager 注销，fd号被复用时不会留下旧的注册
+    iom->cancelAll(efd);
+    close_f(efd);
+    if(rt < 0) {
+        return -1;
+    }
+    // 调用方自己的超时到期不算错误
+    return rt > 0 ? sylar::CancelContext::CheckCurrent(): 0;
+}
 
-            // 若定时器已注册，则主动调用timer->cancel()取消定时器，避免不必要的超时回调。
-            if(timer) {
-                timer->cancel();
+// poll/ppoll：检查一次，没有就绪时挂起等待再检查，直到有就绪或超时
+static int poll_fiber(sylar::IOManager* iom, struct pollfd* fds, nfds_t nfds, uint64_t timeout_ms, const sigset_t* sigmask) {
+    uint64_t deadline = timeout_ms == ~0ull ? ~0ull: now_ms() + timeout_ms;
+    for(;;) {
+        struct timespec zero = {0, 0};
+        int rt = ppoll_f(fds, nfds, &zero, sigmask);
+        uint64_t left = remaining_ms(deadline);
+        if(rt != 0 || left == 0) {
+            return rt;
+        }
+        WaitList waits;
+        for(nfds_t i = 0; i < nfds; ++i) {
+            if(fds[i].fd >= 0) {
+                // Linux 上 POLL* 和 EPOLL* 的取值相同；EPOLLERR/EPOLLHUP 总会报告
+                waits.emplace_back(fds[i].fd, (unsigned short)fds[i].events);
             }
-            errno = EINVAL;  // 设置明确的错误码
+        }
+        int wrt = wait_any(iom, waits, left);
+        if(wrt > 0) {
+            errno = wrt;
             return -1;
-        } else {
-            // 协程挂起等待事件发生或超时
-            sylar::Fiber::GetThis()->yield();
-
-            // 3 resume either by addEvent or cancelEvent
-            // 协程恢复后，无论是否超时，都应主动取消定时器。
-            // 防止定时器未触发，但后续已经无需超时控制的情况，避免无效定时器回调
-            // 假设你在煮饭，设置了个闹钟（定时器）提醒你30分钟后必须关火（超时）。
-            // 如果饭熟了（IO事件发生），你主动关了火。
-            // 此时闹钟已经没用了，必须要手动关掉闹钟，不然过了一会闹钟响了，又提醒你去关火一次，是不是很奇怪？
-            // 同理，协程恢复后也要“关掉闹钟”，防止后续无用的提醒。
-            if(timer) {
-                timer->cancel();
+        }
+        if(wrt < 0) {
+            return sylar::offload([&]() {
+                struct timespec ts = {(time_t)(left / 1000), (long)(left % 1000) * 1000000L};
+                return ppoll_f(fds, nfds, left == ~0ull ? nullptr: &ts, sigmask);
+            });
+        }
+    }
+}
+
+// select：fd_set 是输入输出参数，每次在副本上检查，有结果（或超时）时才写回
+static int select_fiber(sylar::IOManager* iom, int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout) {
+    uint64_t timeout_ms = timeout ? timeout->tv_sec * 1000ull + (timeout->tv_usec + 999) / 1000: ~0ull;
+    uint64_t deadline = timeout_ms == ~0ull ? ~0ull: now_ms() + timeout_ms;
+    fd_set* sets[3] = {readfds, writefds, exceptfds};
+    const uint32_t events[3] = {EPOLLIN, EPOLLOUT, EPOLLPRI};
+    fd_set in[3];
+    for(int k = 0; k < 3; ++k) {
+        if(sets[k]) {
+            in[k] = *sets[k];
+        }
+    }
+    for(;;) {
+        fd_set out[3];
+        for(int k = 0; k < 3; ++k) {
+            if(sets[k]) {
+                out[k] = in[k];
+            }
+        }
+        struct timeval zero = {0, 0};
+        int rt = select_f(nfds, readfds ? &out[0]: nullptr, writefds ? &out[1]: nullptr, exceptfds ? &out[2]: nullptr, &zero);
+        uint64_t left = remaining_ms(deadline);
+        if(rt != 0 || left == 0) {
+            if(rt >= 0) {
+                for(int k = 0; k < 3; ++k) {
+                    if(sets[k]) {
+                        *sets[k] = out[k];
+                    }
+                }
+                if(timeout) {
+                    timeout->tv_sec = left / 1000;
+                    timeout->tv_usec = (left % 1000) * 1000;
+                }
+            }
+            return rt;
+        }
+        WaitList waits;
+        for(int fd = 0; fd < nfds; ++fd) {
+            uint32_t ev = 0;
+            for(int k = 0; k < 3; ++k) {
+                if(sets[k] && FD_ISSET(fd, &in[k])) {
+                    ev |= events[k];
+                }
+            }
+            if(ev) {
+                waits.emplace_back(fd, ev);
+            }
+        }
+        int wrt = wait_any(iom, waits, left);
+        if(wrt > 0) {
+            errno = wrt;
+            return -1;
+        }
+        if(wrt < 0) {
+            // 集合还没有写过，原样交给阻塞的 select
+            if(timeout) {
+                timeout->tv_sec = left / 1000;
+                timeout->tv_usec = (left % 1000) * 1000;
             }
+            return sylar::offload([&]() {
+                return select_f(nfds, readfds, writefds, exceptfds, timeout);
+            });
+        }
+    }
+}
+
+// getaddrinfo：service 转成端口（主机字节序），失败返回 EAI_* 错误码
+static int service_port(const char* service, const struct addrinfo* hints, int& port) {
+    port = 0;
+    if(!service) {
+        return 0;
+    }
+    char* end = nullptr;
+    long v = strtol(service, &end, 10);
+    if(*service && !*end) {
+        if(v < 0 || v > 65535) {
+            return EAI_SERVICE;
+        }
+        port = (int)v;
+        return 0;
+    }
+    if(hints && (hints->ai_flags & AI_NUMERICSERV)) {
+        return EAI_NONAME;
+    }
+    // /etc/services 很小，直接读
+    struct servent se;
+    struct servent* found = nullptr;
+    char buf[1024];
+    int socktype = hints ? hints->ai_socktype: 0;
+    getservbyname_r(service, socktype == SOCK_DGRAM ? "udp": "tcp", &se, buf, sizeof(buf), &found);
+    if(!found && socktype == 0) {
+        getservbyname_r(service, "udp", &se, buf, sizeof(buf), &found);
+    }
+    if(!found) {
+        return EAI_SERVICE;
+    }
+    port = ntohs(found->s_port);
+    return 0;
+}
 
-            // by cancelEvent
-            // 判断是否超时
-            // 若为ETIMEDOUT，代表协程被超时机制唤醒。
-            // 设置系统错误码errno为ETIMEDOUT。
-            // 返回-1表明操作超时。
-            if(tinfo->cancelled == ETIMEDOUT) {
-                errno = tinfo->cancelled;
-                return -1;
+// 按 glibc 的 freeaddrinfo 的释放方式构造结果：每个节点和它的地址在同一块内存中，ai_canonname 单独分配
+static int build_addrinfo(const std::vector<sylar::IpAddr>& addrs, const char* node, int port, const struct addrinfo* hints, struct addrinfo** res) {
+    // 没有指定 socktype 时与 glibc 一样每个地址给出 TCP、UDP（没有 service 时再加 RAW）三种
+    const int kinds[3][2] = {{SOCK_STREAM, IPPROTO_TCP}, {SOCK_DGRAM, IPPROTO_UDP}, {SOCK_RAW, 0}};
+    int socktype = hints ? hints->ai_socktype: 0;
+    int protocol = hints ? hints->ai_protocol: 0;
+    struct addrinfo* head = nullptr;
+    struct addrinfo** tail = &head;
+    for(const sylar::IpAddr& ip: addrs) {
+        for(const auto& kind: kinds) {
+            if(socktype ? socktype != kind[0]: (kind[0] == SOCK_RAW && port)) {
+                continue;
             }
-            // 重新尝试IO操作 (goto retry)
-            goto retry;
+            if(protocol && kind[0] != SOCK_RAW && protocol != kind[1]) {
+                continue;
+            }
+            struct addrinfo* ai = (struct addrinfo*)calloc(1, sizeof(struct addrinfo) + sizeof(sockaddr_storage));
+            if(!ai) {
+                freeaddrinfo(head);
+                return EAI_MEMORY;
+            }
+            ai->ai_family = ip.family;
+            ai->ai_socktype = kind[0];
+            ai->ai_protocol = kind[0] == SOCK_RAW ? protocol: kind[1];
+            ai->ai_addr = (struct sockaddr*)(ai + 1);
+            ai->ai_addrlen = ip.toSockaddr(port, *(sockaddr_storage*)ai->ai_addr);
+            *tail = ai;
+            tail = &ai->ai_next;
         }
     }
-    return n;
+    if(!head) {
+        return EAI_NONAME;
+    }
+    if(hints && (hints->ai_flags & AI_CANONNAME)) {
+        head->ai_canonname = strdup(node);
+    }
+    *res = head;
+    return 0;
 }
 
 extern "C" {
@@ -260,48 +571,73 @@ HOOK_FUN(XX)
 unsigned int sleep(unsigned int seconds) {
     // 如果全局hook功能未开启，则调用原生系统函数sleep_f（阻塞式）。
     // 此时表现与原生sleep一致。
-    if(!sylar::t_hook_enable) {
+    if(!sylar::hook_enabled()) {
         return sleep_f(seconds);
     }
 
-    // 获取当前执行的协程对象
-    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
+    // 获取当前执行的协程对象（裸指针，不改变引用计数）
+    sylar::Fiber* fiber = sylar::Fiber::Current();
 
     // 获取当前协程调度器(IOManager)
     sylar::IOManager* iom = sylar::IOManager::GetThis();
 
+    if(sylar::CancelContext* cancel = sylar::CancelContext::Current()) {
+        uint64_t us = seconds * 1000000ull;
+        uint64_t slept = 0;
+        if(int err = cancellable_sleep(cancel, iom, us, slept)) {
+            // 与被信号打断一样返回没睡完的秒数
+            errno = err;
+            return (us - std::min(slept, us) + 999999) / 1000000;
+        }
+        return 0;
+    }
+
     // add a timer to reschedule this fiber
     // seconds * 1000：睡眠时间，单位是毫秒
     // lambda的作用是唤醒协程：
     // scheduleLock用于把之前挂起（睡眠）的协程重新放入执行队列中，准备恢复执行。
-    iom->addTimer(seconds * 1000, [fiber, iom]() {
-        iom->scheduleLock(fiber, -1);
+    // 定时器持有协程的唯一一个额外引用，到期时直接移交给任务队列，不再复制。
+    // 不会被取消、毫秒精度足够，用池化定时器
+    iom->addPooledTimer(seconds * 1000, [fiber = sylar::Fiber::ptr(fiber), iom]() mutable {
+        iom->scheduleLock(std::move(fiber), -1);
     });
 
     // wait for the next resume
     // 协程主动挂起，进入等待状态。
     // 此时线程不会阻塞，线程可以继续执行其他任务或协程。
     // 协程直到定时器到期，才会恢复执行
+    sylar::Fiber::SetWaitReason(sylar::Fiber::WAIT_TIMER, (uint64_t)seconds * 1000000);
     fiber->yield();
     return 0;
 }
 
 // useconds_t usec表示睡眠的微秒数 (us表示 microseconds)
 int usleep(useconds_t usec) {
-    if(!sylar::t_hook_enable) {
+    if(!sylar::hook_enabled()) {
         return usleep_f(usec);
     }
 
     //这里的步骤和sleep函数类似。
-    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
+    sylar::Fiber* fiber = sylar::Fiber::Current();
     sylar::IOManager* iom = sylar::IOManager::GetThis();
 
+    if(sylar::CancelContext* cancel = sylar::CancelContext::Current()) {
+        uint64_t slept = 0;
+        if(int err = cancellable_sleep(cancel, iom, usec, slept)) {
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+
     // add a timer to reschedule this fiber
-    iom->addTimer(usec / 1000, [fiber, iom]() {
-        iom->scheduleLock(fiber);
+    // 微秒定时器：亚毫秒的睡眠不会被截成0
+    iom->addTimerUs(usec, [fiber = sylar::Fiber::ptr(fiber), iom]() mutable {
+        iom->scheduleLock(std::move(fiber));
     });
 
     // wait for the next resume
+    sylar::Fiber::SetWaitReason(sylar::Fiber::WAIT_TIMER, usec);
 	fiber->yield();
 	return 0;
 }
@@ -309,25 +645,39 @@ int usleep(useconds_t usec) {
 // req: 请求的睡眠时长 (timespec结构包含秒tv_sec和纳秒tv_nsec)。
 // rem: 当sleep被信号中断时，剩余的未睡眠时长会被写入rem（本实现简化，未考虑中断情况）。
 int nanosleep(const struct timespec* req, struct timespec* rem) {
-    if(!sylar::t_hook_enable) {
+    if(!sylar::hook_enabled()) {
         return nanosleep_f(req, rem);
     }
     
-    //timeout_ms 将 tv_sec 转换为毫秒，并将 tv_nsec 转换为毫秒，然后两者相加得到总的超时毫秒数。所以从这里看出实现的也是一个毫秒级的操作。
-    // 将用户输入的睡眠时长转换为毫秒（ms）：
-    // 秒(tv_sec)转为毫秒: tv_sec * 1000
-    // 纳秒(tv_nsec)转为毫秒: tv_nsec / 1000000
+    // 将用户输入的睡眠时长转换为微秒（us），纳秒部分向上取整，保证不会睡得比要求的短：
+    // 秒(tv_sec)转为微秒: tv_sec * 1000000
+    // 纳秒(tv_nsec)转为微秒: (tv_nsec + 999) / 1000
     // req = { tv_sec = 1, tv_nsec = 500000000 } 
-    // 计算结果 timeout_ms = 1000 + 500 = 1500ms
-    int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 / 1000;
+    // 计算结果 timeout_us = 1000000 + 500000 = 1500000us
+    uint64_t timeout_us = (uint64_t)req->tv_sec * 1000000 + (req->tv_nsec + 999) / 1000;
 
     // 获取当前协程和调度器
-    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
+    sylar::Fiber* fiber = sylar::Fiber::Current();
     sylar::IOManager* iom = sylar::IOManager::GetThis();
 
+    if(sylar::CancelContext* cancel = sylar::CancelContext::Current()) {
+        uint64_t slept = 0;
+        if(int err = cancellable_sleep(cancel, iom, timeout_us, slept)) {
+            if(rem) {
+                uint64_t left = timeout_us - std::min(slept, timeout_us);
+                rem->tv_sec = left / 1000000;
+                rem->tv_nsec = (left % 1000000) * 1000;
+            }
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+
     // add a timer to reschedule this fiber
-	iom->addTimer(timeout_ms, [fiber, iom](){iom->scheduleLock(fiber, -1);});
+	iom->addTimerUs(timeout_us, [fiber = sylar::Fiber::ptr(fiber), iom]() mutable {iom->scheduleLock(std::move(fiber), -1);});
 	// wait for the next resume
+	sylar::Fiber::SetWaitReason(sylar::Fiber::WAIT_TIMER, timeout_us);
 	fiber->yield();	
 	return 0;
 }
@@ -339,21 +689,31 @@ type：套接字类型（如SOCK_STREAM表示TCP，SOCK_DGRAM表示UDP）。
 protocol：指定具体协议（通常填0自动推断）。
 */
 int socket(int domain, int type, int protocol) {
-    if(!sylar::t_hook_enable) {
+    if(!sylar::hook_enabled()) {
         return socket_f(domain, type, protocol);
     }
 
     //如果钩子启用了，则通过调用原始的 socket 函数创建套接字，并将返回的文件描述符存储在 fd 变量中。
-    int fd = socket_f(domain, type, protocol);
+    // 直接以非阻塞方式创建，FdCtx 不需要再 fcntl 设置、也不需要探测类型
+    int fd = socket_f(domain, type | SOCK_NONBLOCK, protocol);
 
     //fd是无效的情况
     if(fd == -1) {
-        std::cerr << "socket() failed:" << strerror(errno) << std::endl;
+        SYLAR_LOG_ERROR() << "socket() failed:" << strerror(errno);
 		return fd;
     }
 
-    //如果socket创建成功会利用Fdmanager的文件描述符管理类来进行管理，判断是否在其管理的文件描述符中，如果不在扩展存储文件描述数组大小，并且利用FDctx进行初始化判断是是不是套接字，是不是系统非阻塞模式。
-    sylar::FdMgr::GetInstance()->get(fd, true);
+    //如果socket创建成功会利用Fdmanager的文件描述符管理类来进行管理，记下它是系统非阻塞的socket；
+    // 用户自己要求的 SOCK_NONBLOCK 记为用户非阻塞，之后的调用不再hook
+    int sock_type = type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->addSocket(fd, sock_type == SOCK_STREAM);
+    ctx->setUserNonblock(type & SOCK_NONBLOCK);
+
+    // IOManager 打开了低延迟模式时设置 SO_BUSY_POLL 等选项
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(iom) {
+        iom->prepareSocket(fd);
+    }
     return fd;
 }
 
@@ -369,13 +729,13 @@ timeout_ms: 超时时间（单位为毫秒，ms）。
 */
 int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms) {
     // 检查是否启用了hook功能
-    if(!sylar::t_hook_enable) {
+    if(!sylar::hook_enabled()) {
         return connect_f(fd, addr, addrlen);
     }
 
     //获取文件描述符 fd 的上下文信息 FdCtx
     // 通过FdMgr单例获取对应fd的上下文信息（FdCtx）
-    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
 
     //检查文件描述符上下文是否存在或是否已关闭。
     // 若fd未注册或已关闭，则返回错误，设置errno为EBADF（坏的文件描述符）
@@ -395,6 +755,12 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
+    // 当前协程的取消上下文已经取消或到期时不再发起连接
+    if(int err = sylar::CancelContext::CheckCurrent()) {
+        errno = err;
+        return -1;
+    }
+
     // attempt to connect
     //尝试进行 connect 操作，返回值存储在 n 中。
     int n = connect_f(fd, addr, addrlen);
@@ -411,69 +777,15 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     //获取当前线程的 IOManager 实例。
     sylar::IOManager* iom = sylar::IOManager::GetThis();
 
-    //声明一个定时器对象。
-    std::shared_ptr<sylar::Timer> timer;
-
-    //创建追踪定时器是否取消的对象
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-
-    //判断追踪定时器对象是否存在
-    std::weak_ptr<timer_info> winfo(tinfo);
-
-    //检查是否设置了超时时间。如果 timeout_ms 不等于 -1，则创建一个定时器
-    if(timeout_ms != (uint64_t)-1) {
-        //添加一个定时器，当超时时间到达时，取消事件监听并设置 cancelled 状态。
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
-            auto t = winfo.lock();
-
-            //判断追踪定时器对象是否存在或者追踪定时器的成员变量是否大于0.大于0就意味着取消了
-            if(!t || t->cancelled) {
-                return;
-            }
-
-            //如果超时了但时间仍然未处理
-            // 定时器回调触发 → 设置cancelled=ETIMEDOUT
-            t->cancelled = ETIMEDOUT;
-
-            //将指定的fd的事件触发将事件处理。
-            // 取消监听事件并强制触发事件
-            // 我们在等待fd变为可写（连接成功时fd自动变可写）
-            iom->cancelEvent(fd, sylar::IOManager::WRITE);
-        }, winfo);
-    }
-
-    //为文件描述符 fd 添加一个写事件监听器。这样的目的是为了上面的回调函数处理指定文件描述符
-    // 协程想要等待连接完成，所以必须监听fd变为可写状态
-    // 这一步是开启事件监听，告诉IOManager：
-    // “我要等待这个fd的WRITE事件（连接成功时fd变可写），事件发生时请唤醒我。”
-    int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
-
-    //返回0表示注册监听成功
-    if(rt == 0) {
-        // 如果addEvent注册成功（返回0），协程立即调用yield()主动挂起：
-        // 协程进入休眠状态，线程释放出来去执行其他协程。
-        // 此时协程不会占用CPU和线程，达到高效并发的目的。
-        sylar::Fiber::GetThis()->yield();
-
-        // resume either by addEvent or cancelEvent
-        //如果有定时器，取消定时器。
-        if(timer) {
-            timer->cancel();
-        } 
-        
-        //发生超时错误或者用户取消
-        if(tinfo->cancelled) {
-            //赋值给errno通过其查看具体错误原因。
-            errno = tinfo->cancelled;
-            return -1;
-        }
-    } else {
-        // 若最初的addEvent本身失败（返回非零），事件监听根本未注册成功
-        //添加事件失败
-        if(timer) {
-            timer->cancel();
-        }
-        std::cerr << "connect addEvent(" << fd << ", WRITE) error";
+    // 协程想要等待连接完成，所以必须监听fd变为可写状态（连接成功时fd自动变可写），
+    // 注册并挂起当前协程，timeout_ms 到期时IOManager取消等待并以 ETIMEDOUT 恢复
+    int rt = iom->waitEvent(fd, sylar::IOManager::WRITE, timeout_ms);
+    if(rt > 0) {
+        //发生超时错误，errno 为 ETIMEDOUT
+        return -1;
+    } else if(rt) {
+        // 若最初的注册本身失败，事件监听根本未注册成功
+        SYLAR_LOG_ERROR() << "connect addEvent(" << fd << ", WRITE) error";
     }
 
     // check out if the connection socket established 
@@ -525,73 +837,143 @@ int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
     return connect_with_timeout(sockfd, addr, addrlen, s_connect_timeout);
 }
 
-int accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen) {
-    int fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+// accept 和 accept4 的实现
+static int accept_fd(int sockfd, struct sockaddr* addr, socklen_t* addrlen, int flags) {
+    if(!sylar::hook_enabled()) {
+        int fd = accept4_f(sockfd, addr, addrlen, flags);
+        if(fd >= 0) {
+            sylar::FdMgr::GetInstance()->get(fd, true);
+        }
+        return fd;
+    }
+
+    // 新连接直接以非阻塞方式接入，FdCtx 不需要再 fcntl 设置
+    ssize_t n;
+    int fd;
+    if(uring_io(sockfd, SO_RCVTIMEO, n, [&](sylar::IOManager* iom, uint64_t timeout) {
+        return iom->uringAccept(sockfd, addr, addrlen, flags | SOCK_NONBLOCK, timeout);
+    })) {
+        fd = n;
+    } else {
+        fd = do_io(sockfd, accept4_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, 0, addr, addrlen, flags | SOCK_NONBLOCK);
+    }
 
     if(fd >= 0) {
-        //添加到文件描述符管理器FdManager中
-        sylar::FdMgr::GetInstance()->get(fd, true);
+        //添加到文件描述符管理器FdManager中。接入的socket与监听socket类型相同，不知道监听socket时才探测
+        sylar::FdCtx* listen_ctx = sylar::FdMgr::GetInstance()->get(sockfd);
+        if(listen_ctx && listen_ctx->isSocket()) {
+            sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->addSocket(fd, listen_ctx->isStream());
+            ctx->setUserNonblock(flags & SOCK_NONBLOCK);
+        } else {
+            // init 看到已经是非阻塞的，记为系统非阻塞，与普通的 accept 之后再设置相同
+            sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd, true);
+            if(ctx && (flags & SOCK_NONBLOCK)) {
+                ctx->setUserNonblock(true);
+            }
+        }
     }
 
     return fd;
 }
 
+int accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen) {
+    return accept_fd(sockfd, addr, addrlen, 0);
+}
+
+int accept4(int sockfd, struct sockaddr* addr, socklen_t* addrlen, int flags) {
+    return accept_fd(sockfd, addr, addrlen, flags);
+}
+
 ssize_t read(int fd, void* buf, size_t count) {
-    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+    ssize_t n;
+    if(uring_io(fd, SO_RCVTIMEO, n, [&](sylar::IOManager* iom, uint64_t timeout) {
+        return iom->uringRecv(fd, buf, count, 0, timeout);
+    })) {
+        return n;
+    }
+    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, count, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
 {
-	return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);	
+	return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, 0, iov, iovcnt);	
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags)
 {
-	return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);	
+    ssize_t n;
+    if(uring_io(sockfd, SO_RCVTIMEO, n, [&](sylar::IOManager* iom, uint64_t timeout) {
+        return iom->uringRecv(sockfd, buf, len, flags, timeout);
+    })) {
+        return n;
+    }
+	return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, (flags & MSG_PEEK) ? 0: len, buf, len, flags);	
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
 {
-	return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);	
+	return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, (flags & MSG_PEEK) ? 0: len, buf, len, flags, src_addr, addrlen);	
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
-	return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);	
+	return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, 0, msg, flags);	
+}
+
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+	return do_io(sockfd, recvmmsg_f, "recvmmsg", sylar::IOManager::READ, SO_RCVTIMEO, 0, msgvec, vlen, flags, timeout);
 }
 
 ssize_t write(int fd, const void *buf, size_t count)
 {
-	return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);	
+    ssize_t n;
+    if(uring_io(fd, SO_SNDTIMEO, n, [&](sylar::IOManager* iom, uint64_t timeout) {
+        return iom->uringSend(fd, buf, count, 0, timeout);
+    })) {
+        return n;
+    }
+	return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, count, buf, count);	
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
 {
-	return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);	
+	return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, 0, iov, iovcnt);	
 }
 
 ssize_t send(int sockfd, const void *buf, size_t len, int flags)
 {
-	return do_io(sockfd, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags);	
+    ssize_t n;
+    if(uring_io(sockfd, SO_SNDTIMEO, n, [&](sylar::IOManager* iom, uint64_t timeout) {
+        return iom->uringSend(sockfd, buf, len, flags, timeout);
+    })) {
+        return n;
+    }
+	return do_io(sockfd, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, len, buf, len, flags);	
 }
 
 ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen)
 {
-	return do_io(sockfd, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags, dest_addr, addrlen);	
+	return do_io(sockfd, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, len, buf, len, flags, dest_addr, addrlen);	
 }
 
 ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
 {
-	return do_io(sockfd, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);	
+	return do_io(sockfd, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, 0, msg, flags);	
+}
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	return do_io(sockfd, sendmmsg_f, "sendmmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, 0, msgvec, vlen, flags);
 }
 
 int close(int fd) {
-    if(!sylar::t_hook_enable) {
+    if(!sylar::hook_enabled()) {
         return close_f(fd);
     }
 
     // 获取文件描述符上下文（FdCtx）
-    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
 
     // 检查并取消所有事件
     if(ctx) {
@@ -628,7 +1010,7 @@ int fcntl(int fd, int cmd, ...) {
                 va_end(va);
 
                 // 使用FdMgr获取对应fd的上下文对象FdCtx
-                std::shared_ptr<sylar::FdCtx> ctx;
+                sylar::FdCtx* ctx = nullptr;
                 {
                     // 限定在一个局部范围内释放锁
                     ctx = sylar::FdMgr::GetInstance()->get(fd); 
@@ -665,7 +1047,7 @@ int fcntl(int fd, int cmd, ...) {
                 //调用原始的 fcntl 函数获取文件描述符的当前状态标志。
                 int arg = fcntl_f(fd, cmd);
 
-                std::shared_ptr<sylar::FdCtx> ctx;
+                sylar::FdCtx* ctx = nullptr;
                 {
                     // 尽量避免全局锁持有
                     ctx = sylar::FdMgr::GetInstance()->get(fd);
@@ -807,7 +1189,7 @@ int ioctl(int fd, unsigned long request, ...) {
         bool user_nonblock = !!*(int*)arg;
 
         // 通过sylar::FdMgr（文件描述符管理器）获取对应于文件描述符fd的上下文对象（FdCtx）
-        std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+        sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
 
         //检查获取的上下文对象是否有效（即 ctx 是否为空）。如果上下文对象无效、文件描述符已关闭或不是一个套接字，则直接调用原始的 ioctl 函数，返回处理结果。
         if(!ctx || ctx->isClosed() || !ctx->isSocket()) {
@@ -826,7 +1208,7 @@ int getsockopt(int sockfd, int level, int optname, void* optval, socklen_t* optl
 }
 
 int setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t optlen) {
-    if(!sylar::t_hook_enable) {
+    if(!sylar::hook_enabled()) {
         return setsockopt_f(sockfd, level, optname, optval, optlen);
     }
 
@@ -835,7 +1217,7 @@ int setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t
     if(level == SOL_SOCKET) {
         if(optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
             // 获取文件描述符的上下文对象（FdCtx）
-            std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(sockfd);
+            sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(sockfd);
 
             //那么代码会读取传入的 timeval 结构体，将其转化为毫秒数，并调用 ctx->setTimeout 方法，记录超时设置：
             // 如果上下文对象有效，则记录超时时间到上下文
@@ -856,4 +1238,272 @@ int setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t
     return setsockopt_f(sockfd, level, optname, optval, optlen);	
 }
 
-}
\ No newline at end of file
+// 刷盘可能阻塞几十毫秒，交给卸载线程池执行
+int fsync(int fd) {
+    if(!sylar::hook_enabled()) {
+        return fsync_f(fd);
+    }
+    return sylar::offload([fd]() {
+        return fsync_f(fd);
+    });
+}
+
+// 文件 -> socket：等待 out_fd 可写。发送不足可能是读到了文件末尾，不能据此断定socket写满，len 传0
+ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count) {
+    return do_io(out_fd, sendfile_f, "sendfile", sylar::IOManager::WRITE, SO_SNDTIMEO, 0, in_fd, offset, count);
+}
+
+// 一侧必须是管道。socket 在输入侧时等它可读，在输出侧时等它可写；管道一侧按用户设置的阻塞方式，
+// 阻塞的管道写满时仍会阻塞线程（通常每次搬运不超过管道容量、随即取走，不会发生）
+ssize_t splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out, size_t len, unsigned int flags) {
+    if(sylar::hook_enabled()) {
+        sylar::FdCtx* in_ctx = sylar::FdMgr::GetInstance()->get(fd_in);
+        if(!(in_ctx && in_ctx->isSocket())) {
+            sylar::FdCtx* out_ctx = sylar::FdMgr::GetInstance()->get(fd_out);
+            if(out_ctx && out_ctx->isSocket()) {
+                // do_io 按第一个参数查fd上下文，输出侧的fd放到第一个参数
+                auto fun = [fd_in, off_in, off_out, len, flags](int fd) {
+                    return splice_f(fd_in, off_in, fd, off_out, len, flags);
+                };
+                return do_io(fd_out, fun, "splice", sylar::IOManager::WRITE, SO_SNDTIMEO, 0);
+            }
+        }
+    }
+    return do_io(fd_in, splice_f, "splice", sylar::IOManager::READ, SO_RCVTIMEO, 0, off_in, fd_out, off_out, len, flags);
+}
+
+// 两侧都是管道：不经过 socket 的就绪事件，阻塞的管道在卸载线程池中执行
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    return do_io(fd_in, tee_f, "tee", sylar::IOManager::READ, SO_RCVTIMEO, 0, fd_out, len, flags);
+}
+
+// 不在 IOManager 的协程中（或没有开启hook）时调用原函数；超时为负数时不限时
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    sylar::IOManager* iom = sylar::hook_enabled() ? sylar::IOManager::GetThis(): nullptr;
+    if(!iom || timeout == 0) {
+        return poll_f(fds, nfds, timeout);
+    }
+    return poll_fiber(iom, fds, nfds, timeout < 0 ? ~0ull: (uint64_t)timeout, nullptr);
+}
+
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask) {
+    sylar::IOManager* iom = sylar::hook_enabled() ? sylar::IOManager::GetThis(): nullptr;
+    if(!iom || (tmo_p && tmo_p->tv_sec == 0 && tmo_p->tv_nsec == 0)) {
+        return ppoll_f(fds, nfds, tmo_p, sigmask);
+    }
+    // 不足1毫秒的部分向上取整
+    uint64_t timeout_ms = tmo_p ? tmo_p->tv_sec * 1000ull + (tmo_p->tv_nsec + 999999) / 1000000: ~0ull;
+    return poll_fiber(iom, fds, nfds, timeout_ms, sigmask);
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    sylar::IOManager* iom = sylar::hook_enabled() ? sylar::IOManager::GetThis(): nullptr;
+    if(!iom || (timeout && timeout->tv_sec == 0 && timeout->tv_usec == 0)) {
+        return select_f(nfds, readfds, writefds, exceptfds, timeout);
+    }
+    return select_fiber(iom, nfds, readfds, writefds, exceptfds, timeout);
+}
+
+// 嵌套的 epoll fd：把它加入临时的 epoll fd 等待，不直接在 IOManager 上注册（用户关闭它时不经过 FdManager，注册会留下来）
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    sylar::IOManager* iom = sylar::hook_enabled() ? sylar::IOManager::GetThis(): nullptr;
+    if(!iom || timeout == 0) {
+        return epoll_wait_f(epfd, events, maxevents, timeout);
+    }
+    uint64_t deadline = timeout < 0 ? ~0ull: now_ms() + timeout;
+    for(;;) {
+        int rt = epoll_wait_f(epfd, events, maxevents, 0);
+        uint64_t left = remaining_ms(deadline);
+        if(rt != 0 || left == 0) {
+            return rt;
+        }
+        WaitList waits(1, std::make_pair(epfd, (uint32_t)EPOLLIN));
+        int wrt = wait_any(iom, waits, left);
+        if(wrt > 0) {
+            errno = wrt;
+            return -1;
+        }
+        if(wrt < 0) {
+            return sylar::offload([&]() {
+                return epoll_wait_f(epfd, events, maxevents, left == ~0ull ? -1: (int)std::min<uint64_t>(left, INT_MAX));
+            });
+        }
+    }
+}
+
+int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+    sylar::IOManager* iom = sylar::hook_enabled() ? sylar::IOManager::GetThis(): nullptr;
+    int family = hints ? hints->ai_family: AF_UNSPEC;
+    sylar::IpAddr numeric;
+    if(!iom || !node || (hints && (hints->ai_flags & AI_NUMERICHOST)) || (family != AF_UNSPEC && family != AF_INET && family != AF_INET6)
+       || inet_pton(AF_INET, node, &numeric.v4) == 1 || strchr(node, ':')) {
+        return getaddrinfo_f(node, service, hints, res);
+    }
+    int port = 0;
+    int rt = service_port(service, hints, port);
+    if(rt) {
+        return rt;
+    }
+    std::vector<sylar::IpAddr> addrs;
+    sylar::Resolver::Status st = sylar::Resolver::GetDefault()->resolve(node, family, addrs);
+    if(st != sylar::Resolver::OK) {
+        return st == sylar::Resolver::NOT_FOUND ? EAI_NONAME: EAI_AGAIN;
+    }
+    return build_addrinfo(addrs, node, port, hints, res);
+}
+
+}
+
+namespace sylar {
+
+// MSG_ZEROCOPY 发送要在等待前后多次调用系统调用并检查 errno。协程恢复后可能换了线程，
+// 系统调用和读 errno 放在单独的（不内联的）函数里，errno 的地址总是当前线程的
+
+// 发送一次，出错时 err 为 errno
+__attribute__((noinline)) static ssize_t zerocopy_send(int sockfd, const void* buf, size_t len, int flags, int& err) {
+    ssize_t n;
+    do {
+        n = send_f(sockfd, buf, len, flags);
+    } while(n == -1 && errno == EINTR);
+    err = n == -1 ? errno: 0;
+    return n;
+}
+
+// 取走错误队列里的 MSG_ZEROCOPY 完成通知，返回完成的发送次数（每条通知覆盖一段连续的发送序号），出错返回-1
+__attribute__((noinline)) static ssize_t zerocopy_drain(int sockfd, int efd, int& err) {
+    // 清掉上次留下的边沿：之后来的通知会重新让它可读
+    epoll_event ev;
+    epoll_wait_f(efd, &ev, 1, 0);
+
+    ssize_t done = 0;
+    for(;;) {
+        char control[128];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg_f(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN) {
+                break;
+            }
+            err = errno;
+            return -1;
+        }
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                 || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            sock_extended_err* serr = (sock_extended_err*)CMSG_DATA(cm);
+            if(serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY && serr->ee_errno == 0) {
+                // [ee_info, ee_data]，序号是32位的，回绕时减法照样成立
+                done += (uint32_t)(serr->ee_data - serr->ee_info) + 1;
+            }
+        }
+    }
+    if(!done) {
+        // 没有通知：socket 本身出错时不会再来了
+        int soerr = 0;
+        socklen_t soerr_len = sizeof(soerr);
+        if(getsockopt_f(sockfd, SOL_SOCKET, SO_ERROR, &soerr, &soerr_len) == 0 && soerr) {
+            err = soerr;
+            return -1;
+        }
+    }
+    return done;
+}
+
+// 至少等到一条完成通知，返回完成的发送次数，超时或出错返回-1
+static ssize_t zerocopy_reap(int sockfd, FdCtx* ctx, IOManager* iom, uint64_t timeout, int& err) {
+    int efd = ctx->getErrqueueFd();
+    if(efd < 0) {
+        err = EMFILE;
+        return -1;
+    }
+    for(;;) {
+        ssize_t done = zerocopy_drain(sockfd, efd, err);
+        if(done) {
+            return done;
+        }
+        int rt = iom->waitEvent(efd, IOManager::READ, timeout);
+        if(rt) {
+            err = rt > 0 ? rt: EINVAL;
+            return -1;
+        }
+    }
+}
+
+ssize_t send_zerocopy(int sockfd, const void* buf, size_t len, int flags) {
+    FdCtx* ctx = hook_enabled() ? FdMgr::GetInstance()->get(sockfd): nullptr;
+    IOManager* iom = IOManager::GetThis();
+    if(!ctx || !iom || ctx->isClosed() || !ctx->isSocket() || ctx->getUserNonblock() || !ctx->enableZerocopy()) {
+        return ::send(sockfd, buf, len, flags);
+    }
+    uint64_t timeout = ctx->getTimeout(SO_SNDTIMEO);
+
+    const char* data = (const char*)buf;
+    size_t sent = 0;
+    // 已经发出、还没收到完成通知的发送次数
+    size_t pending = 0;
+    int err = 0;
+    bool copy = false;
+    while(sent < len) {
+        ssize_t n = zerocopy_send(sockfd, data + sent, len - sent, copy ? flags: flags | MSG_ZEROCOPY, err);
+        if(n > 0) {
+            sent += n;
+            pending += !copy;
+            copy = false;
+            continue;
+        }
+        if(n == 0) {
+            break;
+        }
+        if(err == EAGAIN) {
+            // 发送缓冲区满：与 do_io 相同，挂起等待可写
+            int rt = iom->waitEvent(sockfd, IOManager::WRITE, timeout);
+            if(rt) {
+                err = rt > 0 ? rt: EINVAL;
+                break;
+            }
+            continue;
+        }
+        if(err == ENOBUFS && !copy) {
+            // 固定的内存页数超过了 optmem 限制：有未完成的先等它们完成，否则这一段退回复制发送
+            if(!pending) {
+                copy = true;
+                continue;
+            }
+            ssize_t done = zerocopy_reap(sockfd, ctx, iom, timeout, err);
+            if(done < 0) {
+                break;
+            }
+            pending -= std::min<size_t>(done, pending);
+            continue;
+        }
+        break;
+    }
+
+    // 内核还引用着缓冲区：等全部完成通知再返回
+    while(pending) {
+        int reap_err = 0;
+        ssize_t done = zerocopy_reap(sockfd, ctx, iom, timeout, reap_err);
+        if(done < 0) {
+            // 超时或socket出错：内核可能还引用着缓冲区，只能报告错误
+            err = reap_err;
+            sent = 0;
+            break;
+        }
+        pending -= std::min<size_t>(done, pending);
+    }
+
+    if(sent == 0 && err) {
+        errno = err;
+        return -1;
+    }
+    return sent;
+}
+
+}
@@ -7,14 +7,28 @@
 #include <sys/types.h>          
 #include <sys/uio.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <netdb.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 namespace sylar {
 //用于判断钩子功能是否启用。
 bool is_hook_enable();
 
 //用于设置钩子功能的启用或禁用状态
+// 在调度器管理的子协程中设置的是这个协程自己的状态：协程在其他工作线程上恢复后依然生效，同一线程上的其他协程不受影响，
+// 协程结束时清除；没有设置过的协程沿用所在线程的状态。在线程的主协程、调度协程中设置的是线程的状态
 void set_hook_enable(bool flag);
+
+// 用 MSG_ZEROCOPY 发送整个缓冲区：内核直接引用用户内存而不复制，协程挂起直到全部发出、
+// 并且收到所有完成通知（之后缓冲区才可以修改或释放）才返回。返回发出的字节数，出错返回-1（errno 同 send）。
+// 等待完成通知时超时或socket出错也返回-1，此时数据可能已经发出、缓冲区仍可能被内核引用。超时按 SO_SNDTIMEO。不支持 SO_ZEROCOPY 的socket（如 AF_UNIX）、没有开启 hook 或用户设置了非阻塞时退回普通的 send。
+// 每次发送和完成通知都有固定开销，适合大块数据（一般要几十KB以上才划算）；同一个socket上同时只能有一个协程调用
+ssize_t send_zerocopy(int sockfd, const void* buf, size_t len, int flags = 0);
 }
 
 // 保证在C++编译器编译时，这个代码块中的函数使用C语言风格的函数名修饰方式，便于动态链接与系统调用兼容。
@@ -48,6 +62,9 @@ extern "C" {
 	typedef int (*accept_fun) (int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 	extern accept_fun accept_f;
 
+	typedef int (*accept4_fun) (int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+	extern accept4_fun accept4_f;
+
 	typedef ssize_t (*read_fun) (int fd, void *buf, size_t count);
 	extern read_fun read_f;
 
@@ -63,6 +80,9 @@ extern "C" {
 	typedef ssize_t (*recvmsg_fun) (int sockfd, struct msghdr *msg, int flags);
 	extern recvmsg_fun recvmsg_f;
 
+	typedef int (*recvmmsg_fun) (int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+	extern recvmmsg_fun recvmmsg_f;
+
 	typedef ssize_t (*write_fun) (int fd, const void *buf, size_t count);
 	extern write_fun write_f;
 
@@ -78,6 +98,9 @@ extern "C" {
 	typedef ssize_t (*sendmsg_fun) (int sockfd, const struct msghdr *msg, int flags);
 	extern sendmsg_fun sendmsg_f;
 
+	typedef int (*sendmmsg_fun) (int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+	extern sendmmsg_fun sendmmsg_f;
+
 	typedef int (*close_fun) (int fd);
 	extern close_fun close_f;
 
@@ -93,6 +116,33 @@ extern "C" {
     typedef int (*setsockopt_fun) (int sockfd, int level, int optname, const void *optval, socklen_t optlen);
     extern setsockopt_fun setsockopt_f;
 
+    typedef int (*fsync_fun) (int fd);
+    extern fsync_fun fsync_f;
+
+    typedef ssize_t (*sendfile_fun) (int out_fd, int in_fd, off_t* offset, size_t count);
+    extern sendfile_fun sendfile_f;
+
+    typedef ssize_t (*splice_fun) (int fd_in, loff_t* off_in, int fd_out, loff_t* off_out, size_t len, unsigned int flags);
+    extern splice_fun splice_f;
+
+    typedef ssize_t (*tee_fun) (int fd_in, int fd_out, size_t len, unsigned int flags);
+    extern tee_fun tee_f;
+
+    typedef int (*poll_fun) (struct pollfd *fds, nfds_t nfds, int timeout);
+    extern poll_fun poll_f;
+
+    typedef int (*ppoll_fun) (struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask);
+    extern ppoll_fun ppoll_f;
+
+    typedef int (*select_fun) (int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+    extern select_fun select_f;
+
+    typedef int (*epoll_wait_fun) (int epfd, struct epoll_event *events, int maxevents, int timeout);
+    extern epoll_wait_fun epoll_wait_f;
+
+    typedef int (*getaddrinfo_fun) (const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
+    extern getaddrinfo_fun getaddrinfo_f;
+
     // function prototype -> 对应.h中已经存在 可以省略
     // sleep function
  	//函数重定义 
@@ -105,6 +155,8 @@ extern "C" {
 	int socket(int domain, int type, int protocol);
 	int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 	int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+	// flags 里的 SOCK_NONBLOCK 记为用户设置的非阻塞（与之后 fcntl 设置 O_NONBLOCK 相同）
+	int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 
 	// read 
 	ssize_t read(int fd, void *buf, size_t count);
@@ -113,6 +165,9 @@ extern "C" {
     ssize_t recv(int sockfd, void *buf, size_t len, int flags);
     ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
     ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags);
+    // 一次系统调用收多个数据报：一个都没有时挂起等待（超时按 SO_RCVTIMEO），有了就返回当时已经到达的（最多 vlen 个）。
+    // timeout 原样交给内核，和内核一样只在收到数据报之后检查
+    int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
 
     // write
     ssize_t write(int fd, const void *buf, size_t count);
@@ -121,6 +176,8 @@ extern "C" {
     ssize_t send(int sockfd, const void *buf, size_t len, int flags);
     ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
     ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
+    // 一次系统调用发多个数据报：发送缓冲区满、一个都发不出去时挂起等待（超时按 SO_SNDTIMEO），返回发出的个数
+    int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
 
     // fd
     int close(int fd);
@@ -131,6 +188,29 @@ extern "C" {
 
     int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen);
     int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+
+    // 普通文件上的阻塞调用，在卸载线程池（offload.h）中执行
+    int fsync(int fd);
+
+    // 零拷贝传输：socket 一侧未就绪时挂起协程等待，与 read/write 相同；两侧都不是socket时在卸载线程池中执行
+    ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count);
+    ssize_t splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out, size_t len, unsigned int flags);
+    ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+
+    // 多路等待：先不带超时检查一次，没有就绪时把这些fd加入一个临时的 epoll fd，挂起协程等它可读或超时，醒来再检查。
+    // 不在 IOManager 上登记这些fd本身，不影响其他协程在同一fd上的 read/write 等待。timeout 为0时直接调用原函数
+    int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+    // sigmask 只在每次检查（不阻塞）时生效，挂起期间信号的处理同其他协程
+    int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask);
+    // 和 Linux 一样把剩余时间写回 timeout
+    int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+    // 用户自己的 epoll fd：等它可读（有就绪事件）后再取事件。epoll_pwait 不 hook（IOManager 的 idle 用它阻塞）
+    int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+    // 域名交给协程版的 Resolver（resolver.h）：先查 /etc/hosts，再向 resolv.conf 的服务器查询，结果有缓存，
+    // 等回答时挂起协程。数字地址、node 为空、不在 IOManager 中时调用原函数。
+    // 返回的链表用 freeaddrinfo 释放；不处理 AI_ADDRCONFIG / AI_V4MAPPED，AI_CANONNAME 时规范名就是 node
+    int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,568 @@
+#include "http.h"
+#include "profiler.h"
+
+#include <string.h>
+#include <strings.h>
+
+namespace sylar {
+
+// 协程恢复后可能换了线程，读 errno 放在单独的（不内联的）函数里
+__attribute__((noinline)) static int get_errno() {
+    return errno;
+}
+
+static bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+static std::string_view trim(std::string_view s) {
+    while(!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while(!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// 逗号分隔的列表中是否有 token（不区分大小写）
+static bool has_token(std::string_view list, std::string_view token) {
+    while(!list.empty()) {
+        size_t comma = list.find(',');
+        if(iequals(trim(list.substr(0, comma)), token)) {
+            return true;
+        }
+        if(comma == std::string_view::npos) {
+            break;
+        }
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// 头部名字中允许的字符（RFC 9110 的 tchar）
+static bool is_tchar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("!#$%&'*+-.^_`|~", c);
+}
+
+const char* HttpReasonPhrase(int status) {
+    switch(status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 413: return "Content Too Large";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Unknown";
+    }
+}
+
+std::string_view HttpRequest::getHeader(std::string_view name) const {
+    for(const auto& h: m_headers) {
+        if(iequals(h.first, name)) {
+            return h.second;
+        }
+    }
+    return std::string_view();
+}
+
+void HttpRequest::reset() {
+    m_method = m_target = m_path = m_query = std::string_view();
+    m_versionMinor = 1;
+    m_headers.clear();
+    m_body.clear();
+    m_keepAlive = true;
+}
+
+HttpRequestParser::HttpRequestParser(size_t max_header_size, size_t max_body_size)
+    :m_maxHeader(max_header_size)
+    ,m_maxBody(max_body_size) {
+}
+
+void HttpRequestParser::reset() {
+    m_state = STATE_HEADER;
+    m_scanned = 0;
+    m_headerLen = 0;
+    m_bodyLen = 0;
+    m_pos = 0;
+    m_chunkLen = 0;
+    m_consumed = 0;
+    m_errorStatus = 0;
+}
+
+HttpRequestParser::Result HttpRequestParser::parse(const ByteBuffer& in, HttpRequest& req) {
+    if(m_state == STATE_HEADER) {
+        // 只扫描新到的数据（往回退3字节，结尾可能正好被上次截断）
+        ssize_t end = in.find("\r\n\r\n", 4, m_scanned > 3 ? m_scanned - 3: 0);
+        if(end < 0) {
+            m_scanned = in.size();
+            return in.size() > m_maxHeader ? fail(431): NEED_MORE;
+        }
+        m_headerLen = end + 4;
+        if(m_headerLen > m_maxHeader) {
+            return fail(431);
+        }
+        Result rt = parseHeader(in, req);
+        if(rt != NEED_MORE) {
+            return rt;
+        }
+    }
+    if(m_state == STATE_BODY) {
+        if(in.size() < m_headerLen + m_bodyLen) {
+            return NEED_MORE;
+        }
+        req.m_body = in.slice(m_headerLen, m_bodyLen);
+        m_consumed = m_headerLen + m_bodyLen;
+        return DONE;
+    }
+    return parseChunked(in, req);
+}
+
+HttpRequestParser::Result HttpRequestParser::parseHeader(const ByteBuffer& in, HttpRequest& req) {
+    // 不含最后的空行
+    std::string_view head = in.front(m_headerLen, req.m_scratch).substr(0, m_headerLen - 2);
+
+    size_t eol = head.find("\r\n");
+    std::string_view line = head.substr(0, eol);
+    head.remove_prefix(eol == std::string_view::npos ? head.size(): eol + 2);
+
+    // 请求行：method SP target SP HTTP/1.x
+    size_t sp1 = line.find(' ');
+    size_t sp2 = sp1 == std::string_view::npos ? sp1: line.find(' ', sp1 + 1);
+    if(sp2 == std::string_view::npos || sp1 == 0 || sp2 == sp1 + 1) {
+        return fail(400);
+    }
+    req.m_method = line.substr(0, sp1);
+    req.m_target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string_view version = line.substr(sp2 + 1);
+    if(version.size() != 8 || version.substr(0, 7) != "HTTP/1.") {
+        return fail(version.substr(0, 5) == "HTTP/" ? 505: 400);
+    }
+    if(version[7] != '0' && version[7] != '1') {
+        return fail(505);
+    }
+    req.m_versionMinor = version[7] - '0';
+    size_t q = req.m_target.find('?');
+    req.m_path = req.m_target.substr(0, q);
+    req.m_query = q == std::string_view::npos ? std::string_view(): req.m_target.substr(q + 1);
+
+    // 头部
+    bool has_length = false;
+    bool chunked = false;
+    std::string_view connection;
+    while(!head.empty()) {
+        eol = head.find("\r\n");
+        line = head.substr(0, eol);
+        head.remove_prefix(eol == std::string_view::npos ? head.size(): eol + 2);
+        size_t colon = line.find(':');
+        // 不接受续行（obs-fold）和名字中的空白
+        if(colon == 0 || colon == std::string_view::npos) {
+            return fail(400);
+        }
+        std::string_view name = line.substr(0, colon);
+        for(char c: name) {
+            if(!is_tchar(c)) {
+                return fail(400);
+            }
+        }
+        std::string_view value = trim(line.substr(colon + 1));
+        req.m_headers.emplace_back(name, value);
+
+        if(iequals(name, "Content-Length")) {
+            size_t len = 0;
+            if(value.empty()) {
+                return fail(400);
+            }
+            for(char c: value) {
+                if(c < '0' || c > '9' || len > (m_maxBody + 9) / 10) {
+                    return fail(c < '0' || c > '9' ? 400: 413);
+                }
+                len = len * 10 + (c - '0');
+            }
+            // 重复的 Content-Length 必须相同
+            if(has_length && len != m_bodyLen) {
+                return fail(400);
+            }
+            has_length = true;
+            m_bodyLen = len;
+        } else if(iequals(name, "Transfer-Encoding")) {
+            // 只支持 chunked，并且它必须是最后一个编码
+            size_t comma = value.rfind(',');
+            std::string_view last = trim(comma == std::string_view::npos ? value: value.substr(comma + 1));
+            if(!iequals(last, "chunked") || comma != std::string_view::npos) {
+                return fail(501);
+            }
+            chunked = true;
+        } else if(iequals(name, "Connection")) {
+            connection = value;
+        }
+    }
+
+    if(req.m_versionMinor == 0) {
+        req.m_keepAlive = has_token(connection, "keep-alive");
+    } else {
+        req.m_keepAlive = !has_token(connection, "close");
+    }
+
+    if(chunked) {
+        // 同时带 Content-Length 的请求可能是请求走私，处理完就关闭连接
+        if(has_length) {
+            req.m_keepAlive = false;
+        }
+        m_state = STATE_CHUNK_SIZE;
+        m_pos = m_headerLen;
+        return NEED_MORE;
+    }
+    if(m_bodyLen > m_maxBody) {
+        return fail(413);
+    }
+    m_state = STATE_BODY;
+    return NEED_MORE;
+}
+
+HttpRequestParser::Result HttpRequestParser::parseChunked(const ByteBuffer& in, HttpRequest& req) {
+    while(true) {
+        if(m_state == STATE_CHUNK_SIZE) {
+            ssize_t eol = in.find("\r\n", 2, m_pos);
+            if(eol < 0) {
+                // 长度行（包括扩展）不应该很长
+                return in.size() - m_pos > 1024 ? fail(400): NEED_MORE;
+            }
+            std::string line = in.toString(m_pos, eol - m_pos);
+            size_t len = 0;
+            size_t i = 0;
+            for(; i < line.size() && isxdigit((unsigned char)line[i]); ++i) {
+                if(len > m_maxBody) {
+                    return fail(413);
+                }
+                len = len * 16 + (isdigit((unsigned char)line[i]) ? line[i] - '0': (tolower(line[i]) - 'a' + 10));
+            }
+            // 块扩展（;name=value）忽略
+            if(i == 0 || (i < line.size() && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) {
+                return fail(400);
+            }
+            m_pos = eol + 2;
+            if(len == 0) {
+                m_state = STATE_TRAILER;
+                continue;
+            }
+            if(req.m_body.size() + len > m_maxBody) {
+                return fail(413);
+            }
+            m_chunkLen = len;
+            m_state = STATE_CHUNK_DATA;
+        } else if(m_state == STATE_CHUNK_DATA) {
+            if(in.size() < m_pos + m_chunkLen + 2) {
+                return NEED_MORE;
+            }
+            char crlf[2];
+            in.copyOut(crlf, 2, m_pos + m_chunkLen);
+            if(crlf[0] != '\r' || crlf[1] != '\n') {
+                return fail(400);
+            }
+            // 数据不拷贝，只接上接收缓冲区的切片
+            req.m_body.append(in.slice(m_pos, m_chunkLen));
+            m_pos += m_chunkLen + 2;
+            m_state = STATE_CHUNK_SIZE;
+        } else {
+            // 尾部字段：跳过，直到空行
+            ssize_t eol = in.find("\r\n", 2, m_pos);
+            if(eol < 0) {
+                return in.size() - m_pos > m_maxHeader ? fail(431): NEED_MORE;
+            }
+            if((size_t)eol == m_pos) {
+                m_consumed = m_pos + 2;
+                return DONE;
+            }
+            m_pos = eol + 2;
+        }
+    }
+}
+
+namespace detail {
+
+// 一个连接上的响应输出：同一批请求的响应攒在 out 里，一次 writev 发出
+struct HttpSession {
+    TcpConnection* conn = nullptr;
+    ByteBuffer out;
+    bool broken = false;
+
+    // 当前请求的属性
+    bool keep_alive = true;
+    bool head = false;
+    int version_minor = 1;
+
+    bool flush() {
+        if(!broken && !out.empty() && conn->write(out) < 0) {
+            broken = true;
+        }
+        return !broken;
+    }
+
+    // 处理函数返回后补全响应
+    void finish(HttpResponse& rsp);
+
+    // 立即回复一个错误并在之后关闭连接
+    void sendError(int status);
+};
+
+}
+
+using detail::HttpSession;
+
+// 1xx、204、304 没有响应体
+static bool status_has_body(int status) {
+    return status >= 200 && status != 204 && status != 304;
+}
+
+static void append_chunk(ByteBuffer& out, ByteBuffer& data) {
+    char line[24];
+    int n = snprintf(line, sizeof(line), "%zx\r\n", data.size());
+    out.append(line, n);
+    out.append(std::move(data));
+    out.append("\r\n", 2);
+}
+
+void HttpResponse::setStatus(int status, std::string reason) {
+    m_status = status;
+    m_reason = std::move(reason);
+}
+
+void HttpResponse::setHeader(std::string name, std::string value) {
+    m_headers.emplace_back(std::move(name), std::move(value));
+}
+
+void HttpResponse::appendHeader(ByteBuffer& out, bool chunked, bool keep_alive) const {
+    std::string head;
+    head.reserve(128);
+    head.append("HTTP/1.1 ");
+    head.append(std::to_string(m_status));
+    head.push_back(' ');
+    head.append(m_reason.empty() ? HttpReasonPhrase(m_status): m_reason);
+    head.append("\r\n");
+    for(const auto& h: m_headers) {
+        head.append(h.first);
+        head.append(": ");
+        head.append(h.second);
+        head.append("\r\n");
+    }
+    if(chunked) {
+        head.append("Transfer-Encoding: chunked\r\n");
+    } else if(status_has_body(m_status)) {
+        head.append("Content-Length: ");
+        head.append(std::to_string(m_body.size()));
+        head.append("\r\n");
+    }
+    if(!keep_alive) {
+        head.append("Connection: close\r\n");
+    } else if(m_session->version_minor == 0) {
+        head.append("Connection: keep-alive\r\n");
+    }
+    head.append("\r\n");
+    out.append(head);
+}
+
+bool HttpResponse::writeChunk(const void* data, size_t len) {
+    ByteBuffer buf;
+    buf.append(data, len);
+    return writeChunk(buf);
+}
+
+bool HttpResponse::writeChunk(ByteBuffer& data) {
+    HttpSession* s = m_session;
+    if(!m_chunked) {
+        m_chunked = true;
+        // HTTP/1.0 不认识 chunked：发完之后关闭连接来表示结束
+        if(s->version_minor == 0) {
+            s->keep_alive = false;
+        }
+        appendHeader(s->out, s->version_minor != 0, s->keep_alive && !m_close);
+        if(!m_body.empty() && !s->head) {
+            if(s->version_minor == 0) {
+                s->out.append(std::move(m_body));
+            } else {
+                append_chunk(s->out, m_body);
+            }
+        }
+        m_body.clear();
+    }
+    if(!data.empty() && !s->head) {
+        if(s->version_minor == 0) {
+            s->out.append(std::move(data));
+        } else {
+            append_chunk(s->out, data);
+        }
+    }
+    data.clear();
+    return s->flush();
+}
+
+void HttpSession::finish(HttpResponse& rsp) {
+    if(rsp.m_close) {
+        keep_alive = false;
+    }
+    if(rsp.m_chunked) {
+        if(version_minor != 0 && !head) {
+            out.append("0\r\n\r\n", 5);
+        }
+        return;
+    }
+    rsp.appendHeader(out, false, keep_alive);
+    if(!head && status_has_body(rsp.m_status)) {
+        out.append(std::move(rsp.m_body));
+    }
+}
+
+void HttpSession::sendError(int status) {
+    keep_alive = false;
+    head = false;
+    HttpResponse rsp(this);
+    rsp.setStatus(status);
+    rsp.setHeader("Content-Type", "text/plain");
+    rsp.body().append(std::string(HttpReasonPhrase(status)));
+    finish(rsp);
+    flush();
+}
+
+HttpServer::HttpServer(IOManager* iom, const Options& options)
+    :m_options(options)
+    ,m_server(iom, options.tcp) {
+    m_server.setHandler([this](const TcpConnection::ptr& conn) {
+        serve(conn);
+    });
+}
+
+HttpServer::HttpServer(IOManager* iom)
+    :HttpServer(iom, Options()) {
+}
+
+HttpServer::~HttpServer() {
+    // 先等连接结束，再析构路由表
+    m_server.stop();
+}
+
+void HttpServer::setHandler(Handler handler) {
+    m_default = std::move(handler);
+}
+
+void HttpServer::addRoute(const std::string& path, Handler handler) {
+    Route& route = m_routes[path];
+    route.handler = std::move(handler);
+    route.label = Profiler::InternLabel("http:" + path);
+}
+
+bool HttpServer::start() {
+    return m_server.start();
+}
+
+void HttpServer::dispatch(HttpRequest& req, HttpResponse& rsp) {
+    auto it = m_routes.find(req.path());
+    if(it != m_routes.end()) {
+        TaskLabelScope label(it->second.label);
+        it->second.handler(req, rsp);
+    } else if(m_default) {
+        m_default(req, rsp);
+    } else {
+        rsp.setStatus(404);
+        rsp.setHeader("Content-Type", "text/plain");
+        rsp.body().append(std::string("Not Found"));
+    }
+}
+
+void HttpServer::serve(const TcpConnection::ptr& conn) {
+    HttpSession session;
+    session.conn = conn.get();
+    HttpRequestParser parser(m_options.max_header_size, m_options.max_body_size);
+    HttpRequest req;
+    // 连接自带的接收缓冲区
+    ByteBuffer& in = conn->input();
+    size_t served = 0;
+    bool continued = false;
+    uint64_t timeout = ~0ull;
+
+    while(!session.broken) {
+        HttpRequestParser::Result rt = parser.parse(in, req);
+        if(rt == HttpRequestParser::DONE) {
+            ++served;
+            session.keep_alive = req.keepAlive() && !conn->isDraining()
+                                 && (!m_options.max_requests || served < m_options.max_requests);
+            session.head = req.method() == "HEAD";
+            session.version_minor = req.versionMinor();
+            {
+                HttpResponse rsp(&session);
+                dispatch(req, rsp);
+                session.finish(rsp);
+            }
+            // 请求中的视图和请求体在这之后失效
+            req.reset();
+            in.consume(parser.consumed());
+            parser.reset();
+            continued = false;
+            if(!session.keep_alive) {
+                session.flush();
+                break;
+            }
+            // 流水线：缓冲区里可能还有下一个请求，先处理完再一起发出，攒多了先发一部分
+            if(session.out.size() >= m_options.flush_threshold) {
+                session.flush();
+            }
+            continue;
+        }
+        if(rt == HttpRequestParser::ERROR) {
+            session.flush();
+            session.sendError(parser.errorStatus());
+            break;
+        }
+
+        // 需要更多数据：先把攒着的响应发出去
+        if(!session.flush()) {
+            break;
+        }
+        if(parser.inBody() && !continued && iequals(req.getHeader("Expect"), "100-continue")) {
+            continued = true;
+            session.out.append(std::string("HTTP/1.1 100 Continue\r\n\r\n"));
+            if(!session.flush()) {
+                break;
+            }
+        }
+        bool idle = in.empty();
+        uint64_t want = idle ? m_options.keepalive_timeout_ms: m_options.request_timeout_ms;
+        if(want != timeout) {
+            timeout = want;
+            conn->setReadTimeout(timeout);
+        }
+        conn->setIdle(idle);
+        // 标记之后再检查一次：stop() 可能在标记之前检查过这个连接
+        if(idle && conn->isDraining()) {
+            break;
+        }
+        ssize_t n = conn->readInto(in);
+        conn->setIdle(false);
+        if(n <= 0) {
+            // 请求读了一半超时时回复 408，其余情况（对端关闭、空闲超时、出错）直接关闭
+            if(n < 0 && !idle && get_errno() == ETIMEDOUT) {
+                session.sendError(408);
+            }
+            break;
+        }
+    }
+}
+
+}
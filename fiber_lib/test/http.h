@@ -0,0 +1,243 @@
+#ifndef __SYLAR_HTTP_H__
+#define __SYLAR_HTTP_H__
+
+// HTTP/1.1 服务器，建在 TcpServer 和 ByteBuffer 之上
+//
+// 示例里的处理函数每个请求都回 Connection: close，测的是建连接的开销而不是请求的吞吐。HttpServer：
+// - 请求解析是增量的：数据不够时记住扫描到的位置，下次读到更多数据后从那里继续。
+//   请求行和头部是指向接收缓冲区的 string_view（头部跨块时才拷贝一次），请求体是缓冲区的切片，都不拷贝
+// - 长连接和流水线：一次读到的多个请求依次处理，它们的响应攒在一起用一次 writev 发出
+// - 请求体支持 Content-Length 和 chunked；响应默认带 Content-Length，也可以用 writeChunk 分块发送
+// - 空闲计时按连接：等下一个请求时读超时为 keepalive_timeout_ms，请求读了一半时为 request_timeout_ms，
+//   超时由 IOManager 的 waitEvent 在 reactor 中检查，不创建 Timer
+//
+//   sylar::HttpServer server(&iom);
+//   server.addRoute("/hello", [](sylar::HttpRequest& req, sylar::HttpResponse& rsp) {
+//       rsp.setHeader("Content-Type", "text/plain");
+//       rsp.body().append("Hello, World!");
+//   });
+//   server.addListener("0.0.0.0", 8080);
+//   server.start();
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "byte_buffer.h"
+#include "tcp_server.h"
+
+namespace sylar {
+
+// 一个请求。string_view 指向连接的接收缓冲区，只在处理函数执行期间有效
+class HttpRequest {
+public:
+    std::string_view method() const { return m_method; }
+    // 请求目标的原文、其中 '?' 之前和之后的部分
+    std::string_view target() const { return m_target; }
+    std::string_view path() const { return m_path; }
+    std::string_view query() const { return m_query; }
+    // HTTP/1.x 的 x
+    int versionMinor() const { return m_versionMinor; }
+
+    // 按名字查找头部（不区分大小写），没有返回空视图
+    std::string_view getHeader(std::string_view name) const;
+    const std::vector<std::pair<std::string_view, std::string_view>>& headers() const { return m_headers; }
+
+    // 请求体（chunked 时已经解码），共享接收缓冲区的块
+    const ByteBuffer& body() const { return m_body; }
+
+    // 处理完这个请求后是否保持连接（按版本和 Connection 头部）
+    bool keepAlive() const { return m_keepAlive; }
+
+    void reset();
+
+private:
+    friend class HttpRequestParser;
+
+    std::string_view m_method;
+    std::string_view m_target;
+    std::string_view m_path;
+    std::string_view m_query;
+    int m_versionMinor = 1;
+    std::vector<std::pair<std::string_view, std::string_view>> m_headers;
+    ByteBuffer m_body;
+    bool m_keepAlive = true;
+    // 头部跨块时拷贝到这里
+    std::string m_scratch;
+};
+
+// 增量的请求解析器，每个连接一个。输入总是从一个请求的开头开始（处理完的请求由调用方 consume 掉）
+class HttpRequestParser {
+public:
+    enum Result {
+        NEED_MORE = 0,
+        DONE,
+        ERROR
+    };
+
+    HttpRequestParser(size_t max_header_size, size_t max_body_size);
+
+    // 解析 in 开头的请求。NEED_MORE 时 req 保存了已经解析的部分，读到更多数据后用同一个 req 再调用；
+    // DONE 时请求占 in 的前 consumed() 字节；ERROR 时 errorStatus() 为应当回复的状态码
+    Result parse(const ByteBuffer& in, HttpRequest& req);
+
+    size_t consumed() const { return m_consumed; }
+    int errorStatus() const { return m_errorStatus; }
+    // 头部已经解析完、还在等请求体
+    bool inBody() const { return m_state != STATE_HEADER; }
+
+    // 准备解析下一个请求
+    void reset();
+
+private:
+    enum State {
+        STATE_HEADER = 0,
+        STATE_BODY,
+        STATE_CHUNK_SIZE,
+        STATE_CHUNK_DATA,
+        STATE_TRAILER
+    };
+
+    Result fail(int status) {
+        m_errorStatus = status;
+        return ERROR;
+    }
+
+    // 解析 [0, m_headerLen) 中的请求行和头部
+    Result parseHeader(const ByteBuffer& in, HttpRequest& req);
+    Result parseChunked(const ByteBuffer& in, HttpRequest& req);
+
+private:
+    size_t m_maxHeader;
+    size_t m_maxBody;
+    State m_state = STATE_HEADER;
+    // 查找头部结尾时已经扫描过的位置
+    size_t m_scanned = 0;
+    size_t m_headerLen = 0;
+    // STATE_BODY：请求体长度；chunked：下一个要解析的位置、当前块的长度
+    size_t m_bodyLen = 0;
+    size_t m_pos = 0;
+    size_t m_chunkLen = 0;
+    size_t m_consumed = 0;
+    int m_errorStatus = 0;
+};
+
+namespace detail {
+struct HttpSession;
+}
+
+// 一个响应。处理函数返回后发出（分块发送时发出结束块）
+class HttpResponse {
+public:
+    explicit HttpResponse(detail::HttpSession* session): m_session(session) {}
+
+    // reason 为空时按状态码取默认的
+    void setStatus(int status, std::string reason = std::string());
+    int getStatus() const { return m_status; }
+
+    // 增加一个头部。Content-Length、Transfer-Encoding、Connection 由服务器生成，不要设置
+    void setHeader(std::string name, std::string value);
+
+    ByteBuffer& body() { return m_body; }
+
+    // 处理完这个请求后关闭连接
+    void setClose() { m_close = true; }
+    bool isClose() const { return m_close; }
+
+    // 分块发送：第一次调用时发出状态行和头部（Transfer-Encoding: chunked），之后每次立即发出一块。
+    // 之前放进 body() 的数据作为第一块一起发出。连接出错返回false
+    bool writeChunk(const void* data, size_t len);
+    bool writeChunk(ByteBuffer& data);
+
+private:
+    friend struct detail::HttpSession;
+
+    // 状态行和头部
+    void appendHeader(ByteBuffer& out, bool chunked, bool keep_alive) const;
+
+private:
+    detail::HttpSession* m_session;
+    int m_status = 200;
+    std::string m_reason;
+    std::vector<std::pair<std::string, std::string>> m_headers;
+    ByteBuffer m_body;
+    bool m_close = false;
+    // 已经开始分块发送
+    bool m_chunked = false;
+};
+
+class HttpServer {
+public:
+    typedef std::function<void(HttpRequest&, HttpResponse&)> Handler;
+
+    struct Options {
+        TcpServer::Options tcp;
+        // 等下一个请求的最长时间（长连接的空闲超时）
+        uint64_t keepalive_timeout_ms = 60000;
+        // 请求开始之后，每次读剩余部分的最长等待时间
+        uint64_t request_timeout_ms = 30000;
+        // 请求行加头部的上限，超过回复 431
+        size_t max_header_size = 8192;
+        // 请求体的上限，超过回复 413
+        size_t max_body_size = 8 * 1024 * 1024;
+        // 一个连接上最多处理的请求数，0 不限制
+        size_t max_requests = 0;
+        // 流水线的响应攒到这么多字节就先发出去
+        size_t flush_threshold = 64 * 1024;
+    };
+
+    HttpServer(IOManager* iom, const Options& options);
+    explicit HttpServer(IOManager* iom = nullptr);
+    // 调用 stop()
+    ~HttpServer();
+    HttpServer(const HttpServer&) = delete;
+    HttpServer& operator=(const HttpServer&) = delete;
+
+    // 没有匹配路由时的处理函数，默认回复 404
+    void setHandler(Handler handler);
+    // 按路径（不含查询串）精确匹配。处理函数运行时协程带着任务标签 "http:路径"（见 profiler.h）
+    void addRoute(const std::string& path, Handler handler);
+
+    bool addListener(const std::string& ip, uint16_t port) { return m_server.addListener(ip, port); }
+    bool addListener(const sockaddr* addr, socklen_t addrlen) { return m_server.addListener(addr, addrlen); }
+
+    bool start();
+    // 同 TcpServer::stop：等下一个请求的连接直接关闭，正在处理的连接处理完当前请求后关闭
+    void stop() { m_server.stop(); }
+
+    TcpServer& getTcpServer() { return m_server; }
+    const Options& getOptions() const { return m_options; }
+
+private:
+    // 路由表可以直接用 string_view 查找
+    struct PathHash {
+        typedef void is_transparent;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+    };
+
+    struct Route {
+        Handler handler;
+        // 任务标签，由 Profiler::InternLabel 保存
+        const char* label = nullptr;
+    };
+
+    // 一个连接上的请求循环
+    void serve(const TcpConnection::ptr& conn);
+    void dispatch(HttpRequest& req, HttpResponse& rsp);
+
+private:
+    Options m_options;
+    TcpServer m_server;
+    Handler m_default;
+    std::unordered_map<std::string, Route, PathHash, std::equal_to<>> m_routes;
+};
+
+// 状态码的默认原因短语，不认识的返回 "Unknown"
+const char* HttpReasonPhrase(int status);
+
+}
+
+#endif
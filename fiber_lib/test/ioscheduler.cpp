@@ -2,10 +2,19 @@
 #include <sys/epoll.h> 
 #include <fcntl.h>     
 #include <cstring>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "ioscheduler.h"
-
-static bool debug = true;
+#include "uring.h"
+#include "fd_manager.h"
+#include "hook.h"
+#include "log.h"
+#include "probe.h"
+#include "trace.h"
 
 namespace sylar {
 
@@ -15,32 +24,164 @@ IOManager* IOManager::GetThis() {
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
 }
 
-// 用于获取指定事件类型（如读事件或写事件）对应的事件上下文（EventContext）。FdContext 类中维护了 read 和 write 两个 EventContext，该方法根据传入的 event 类型返回相应的事件上下文
-IOManager::FdContext::EventContext& IOManager::FdContext::getEventContext(Event event) {
-    assert(event == READ || event == WRITE);
-    switch(event) {
-        // READ 和 WRITE 事件类型会分别返回 read 或 write 对应的 EventContext。
-        case READ:
-            return read;
-        case WRITE:
-            return write;
+void IOManager::FdLock::lockSlow() {
+    // 持有者通常只改几个字段，先自旋一会儿
+    for(int i = 0; i < 64; ++i) {
+        uint32_t expected = 0;
+        if(m_state.load(std::memory_order_relaxed) == 0
+            && m_state.compare_exchange_weak(expected, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return;
+        }
+        cpu_relax();
+    }
+    // 标记为有人等待，解锁方据此决定是否 FUTEX_WAKE
+    while(m_state.exchange(2, std::memory_order_acquire) != 0) {
+        syscall(SYS_futex, &m_state, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+    }
+}
+
+void IOManager::FdLock::unlockSlow() {
+    syscall(SYS_futex, &m_state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+// 带回调或要放回其他调度器的等待者
+struct IOManager::EventHandler {
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    Callback cb;
+    // waitEvent 的协程
+    bool wait = false;
+};
+
+// 去掉等待者指针的标记
+template<class T>
+static inline T* untag(uintptr_t waiter) {
+    return (T*)(waiter & ~(uintptr_t)3);
+}
+
+// waitEvent 的超时堆：按到期时间排列的小顶堆，元素在堆中的位置记录在 EventContext::heap_index，
+// 等待触发、取消时可以直接删除，堆里只有还在等待的超时。所属线程插入和检查到期，其他线程触发事件时删除
+struct alignas(64) IOManager::DeadlineHeap {
+    struct Entry {
+        uint64_t deadline;
+        FdContext* fd_ctx;
+        Event event;
+        uint32_t id;
+    };
+
+    std::mutex mutex;
+    std::vector<Entry> entries;
+    // 最早的到期时间（MonotonicNs），空时为 ~0ull；所属线程不加锁读它来决定最多等待多久
+    std::atomic<uint64_t> earliest = {~0ull};
+
+    // 以下调用方持有 mutex
+    void push(const Entry& e) {
+        entries.push_back(e);
+        up(entries.size() - 1);
+        update();
+    }
+
+    // 堆顶出堆
+    Entry pop() {
+        Entry top = entries[0];
+        remove(0);
+        return top;
+    }
+
+    void remove(size_t i) {
+        entries[i].fd_ctx->getEventContext(entries[i].event).heap_index = -1;
+        Entry last = entries.back();
+        entries.pop_back();
+        if(i < entries.size()) {
+            place(i, last);
+            up(i);
+            down(i);
+        }
+        update();
+    }
+
+private:
+    void place(size_t i, const Entry& e) {
+        entries[i] = e;
+        e.fd_ctx->getEventContext(e.event).heap_index = i;
+    }
+
+    void up(size_t i) {
+        Entry e = entries[i];
+        while(i > 0 && entries[(i - 1) / 2].deadline > e.deadline) {
+            place(i, entries[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        place(i, e);
+    }
+
+    void down(size_t i) {
+        Entry e = entries[i];
+        size_t n = entries.size();
+        while(2 * i + 1 < n) {
+            size_t c = 2 * i + 1;
+            if(c + 1 < n && entries[c + 1].deadline < entries[c].deadline) {
+                ++c;
+            }
+            if(entries[c].deadline >= e.deadline) {
+                break;
+            }
+            place(i, entries[c]);
+            i = c;
+        }
+        place(i, e);
+    }
+
+    void update() {
+        earliest.store(entries.empty() ? ~0ull: entries[0].deadline, std::memory_order_relaxed);
+    }
+};
+
+Scheduler* IOManager::waiterScheduler(uintptr_t waiter) {
+    if(!waiter) {
+        return nullptr;
+    }
+    return (waiter & WAITER_TAG_MASK) == WAITER_HANDLER ? untag<EventHandler>(waiter)->scheduler: this;
+}
+
+void IOManager::endWait(FdContext::EventContext& ctx) {
+    // 等待在超时之前结束：从超时堆中删除
+    if(ctx.flags & FdContext::EVENT_IN_HEAP) {
+        DeadlineHeap& heap = m_deadlines[ctx.heap];
+        std::lock_guard<std::mutex> lock(heap.mutex);
+        if(ctx.heap_index >= 0) {
+            heap.remove(ctx.heap_index);
+        }
     }
-    // 如果传入的 event 既不是 READ 也不是 WRITE，则抛出 std::invalid_argument 异常，表示传入的事件类型无效。
-    // 这行代码可以防止传入无效事件类型时造成未定义行为，确保代码的健壮性。
-    throw std::invalid_argument("Unsupported event type");
+    ctx.flags = 0;
 }
 
-void IOManager::FdContext::resetEventContext(EventContext& ctx) {
-    ctx.scheduler = nullptr;
-    ctx.fiber.reset();
-    ctx.cb = nullptr;
+void IOManager::resetEvent(FdContext* fd_ctx, Event event) {
+    uintptr_t& waiter = fd_ctx->getWaiter(event);
+    if((waiter & WAITER_TAG_MASK) == WAITER_HANDLER) {
+        delete untag<EventHandler>(waiter);
+    } else if(waiter) {
+        // 交还槽位持有的引用
+        Fiber::ptr fiber(untag<Fiber>(waiter));
+        fiber->releaseRef();
+    }
+    waiter = 0;
+    endWait(fd_ctx->getEventContext(event));
 }
 
 // no lock
 // 用于触发并处理特定文件描述符（fd）上已经发生的事件。
-void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+void IOManager::FdContext::bumpReadiness(uint32_t clear, uint32_t set) {
+    uint32_t old = readiness.load(std::memory_order_relaxed);
+    uint32_t val;
+    do {
+        val = ((old & ~(READINESS_SEQ - 1)) + READINESS_SEQ) | (old & (READINESS_SEQ - 1) & ~clear) | set;
+    } while(!readiness.compare_exchange_weak(old, val, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void IOManager::triggerEvent(FdContext* fd_ctx, Event event, Scheduler::Batch* batch, int thread) {
     //确保event是中有指定的事件，否则程序中断。
-    assert(events & event);
+    assert(fd_ctx->events & event);
 
     // delete event
     // 清理该事件，表示不再关注，也就是说，注册IO事件是一次性的，
@@ -52,33 +193,91 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
     // 假设event为：0010（事件2发生）
     // 取反后：~0010 → 1101
     // 进行与运算后：0110 & 1101 → 0100，成功移除了事件2，仅剩事件3
-    events = (Event)(events & ~event);
+    fd_ctx->events = (Event)(fd_ctx->events & ~event);
+    SYLAR_TRACE(TRACE_EVENT_TRIGGER, fd_ctx->fd, event);
 
     // trigger
-    // 获取当前触发事件(event)所对应的上下文对象(EventContext)
-    EventContext& ctx = getEventContext(event);
+    // 取出当前触发事件(event)所对应的等待者，一旦触发，这个方向恢复到初始状态
+    uintptr_t& slot = fd_ctx->getWaiter(event);
+    uintptr_t waiter = slot;
+    slot = 0;
+    FdContext::EventContext& ctx = fd_ctx->getEventContext(event);
+    int priority = ctx.flags & FdContext::EVENT_PRIORITY_MASK;
+    endWait(ctx);
+    assert(waiter);
 
     //这个过程就相当于scheduler文件中的main.cpp测试一样，把真正要执行的函数放入到任务队列中等线程取出后任务后，协程执行，执行完成后返回主协程继续，执行run方法取任务执行任务(不过可能是不同的线程的协程执行了)。
-    // 判断上下文对象存放的是一个回调函数还是一个协程
-    if(ctx.cb) {
-        // std::cout << "111"<< std::endl;
-        // call ScheduleTask(std::function<void()>* f, int thr)
-        // 如果是回调函数 (std::function<void()> ctx.cb)，则将该回调封装为调度任务，放入调度器的任务队列。
-        ctx.scheduler->scheduleLock(&ctx.cb);
-    } else {
-        // call ScheduleTask(std::shared_ptr<Fiber>* f, int thr)
-        // 如果是协程任务 (std::shared_ptr<Fiber> ctx.fiber)，则直接将协程对象作为任务加入调度队列。
-        ctx.scheduler->scheduleLock(&ctx.fiber);
-    }   // scheduleLock 是调度器的方法，作用是将任务安全地加入到调度器维护的任务队列中，并唤醒等待取任务的线程进行调度执行
+    // 判断等待者是一个回调函数还是一个协程
+    if((waiter & WAITER_TAG_MASK) == WAITER_HANDLER) {
+        EventHandler* h = untag<EventHandler>(waiter);
+        if(batch && batch->getScheduler() != h->scheduler) {
+            batch = nullptr;
+        }
+        // 如果是回调函数，则将该回调封装为调度任务，放入调度器的任务队列；否则直接将协程对象作为任务加入调度队列
+        // scheduleLock 是调度器的方法，作用是将任务安全地加入到调度器维护的任务队列中，并唤醒等待取任务的线程进行调度执行
+        if(h->cb) {
+            if(batch) {
+                batch->add(&h->cb, thread, Fiber::STACK_DEFAULT, priority);
+            } else {
+                h->scheduler->scheduleLock(&h->cb, thread, Fiber::STACK_DEFAULT, priority);
+            }
+        } else {
+            if(batch) {
+                batch->add(&h->fiber, thread, Fiber::STACK_DEFAULT, priority);
+            } else {
+                h->scheduler->scheduleLock(&h->fiber, thread, Fiber::STACK_DEFAULT, priority);
+            }
+        }
+        delete h;
+        return;
+    }
 
-    // reset event context
-    // 一旦触发执行完毕，当前事件上下文（ctx）需恢复到初始状态
-    resetEventContext(ctx);
-    return;
+    // 协程放回本IOManager，槽位持有的引用转给调度任务
+    Fiber::ptr fiber(untag<Fiber>(waiter));
+    fiber->releaseRef();
+    if(batch && batch->getScheduler() != this) {
+        batch = nullptr;
+    }
+    if(batch) {
+        batch->add(&fiber, thread, Fiber::STACK_DEFAULT, priority);
+    } else {
+        scheduleLock(&fiber, thread, Fiber::STACK_DEFAULT, priority);
+    }
 }
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string &name):
-    Scheduler(threads, use_caller, name), TimerManager() {
+// ACCEPT_EXCLUSIVE 注册到epoll时 data.ptr 是带这个标记的 Acceptor*，与 FdContext* 区分
+static const uintptr_t ACCEPTOR_TAG = 1;
+// 工作线程epoll上的唤醒eventfd注册时的 data.ptr
+static void* const WAKEUP_TAG = (void*)(uintptr_t)2;
+
+struct IOManager::Acceptor {
+    int id = -1;
+    AcceptMode mode = ACCEPT_SHARED;
+    sockaddr_storage addr;
+    socklen_t addrlen = 0;
+    int backlog = 0;
+    size_t batch = 0;
+    std::function<void(int)> cb;
+    std::atomic<bool> closed = {false};
+    // ACCEPT_REUSEPORT 每个工作线程一个监听socket（下标为工作线程下标），其余模式只用 fds[0]
+    int fds[MAX_WORKERS];
+    // ACCEPT_EXCLUSIVE：是否已经注册到第i个工作线程的epoll
+    bool registered[MAX_WORKERS] = {};
+
+    Acceptor() {
+        for(int& fd: fds) {
+            fd = -1;
+        }
+    }
+};
+
+IOManager::IOManager(size_t threads, bool use_caller, const std::string &name, const Placement& placement,
+                     ReactorMode reactor, IoEngine engine, const BusyPoll& busy_poll, Backend timers, bool timer_shards):
+    // 分片数为新建的工作线程数；使用调用者线程时它排在最后（下标等于线程数），取模后落在第0个分片
+    Scheduler(threads, use_caller, name, placement),
+    TimerManager(timers, timer_shards ? std::max<size_t>(use_caller ? threads - 1: threads, 1): 1),
+    m_reactorMode(reactor), m_engine(engine),
+    m_busyPoll(busy_poll) {
         // create epoll fd
         // 5000，epoll_create 的参数实际上在现代 Linux 内核中已经被忽略，最早版本的 Linux 中，这个参数用于指定 epoll 内部使用的事件表的大小。
         m_epfd = epoll_create(5000);
@@ -87,91 +286,31 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name):
         // 成功返回新创建的epoll实例的文件描述符（正整数）,失败返回-1
         assert(m_epfd > 0);
 
-        // create pipe
-        //创建管道的函数规定了m_tickleFds[0]是读端，[1]是写端 
-        // 创建一个管道用于唤醒阻塞在epoll_wait的线程
-        // m_tickleFds[0]：读端，用于epoll监控。
-        // m_tickleFds[1]：写端，当有新任务到来时写入该端，唤醒阻塞的线程
-        // pipe() 是 Linux/UNIX 系统提供的一个 系统调用，用于创建一个匿名管道（anonymous pipe），用于进程或线程间通信（IPC）
-        // int pipe(int pipefd[2]);
-        // 创建一个“单向通信通道”，返回一对文件描述符：
-        // 一个用于“读”，一个用于“写”。
-        // m_tickleFds[0]：管道的读端（read end）
-        // m_tickleFds[1]：管道的写端（write end）
-        // 系统会自动创建一个缓冲区，并返回这两个描述符。
-        /* 
-        在 IOManager 中，pipe() 创建的是一个唤醒 epoll_wait 的手段：
-        epoll 会阻塞在 epoll_wait() 等待事件；
-        如果这时你想添加任务，需要有方法唤醒 epoll_wait；
-        所以：
-        把 m_tickleFds[0]（读端）加入 epoll 监听；
-        在有任务时向 m_tickleFds[1]（写端）写一个字节；
-        读端就会变为“可读”，epoll_wait() 就会被唤醒；
-        被唤醒后就可以处理新任务。*/
-
-        /*
-        线程 A (epoll_wait)
-            |
-            |---监听---> m_tickleFds[0] (读端)
-
-        线程 B（或当前线程）
-            |
-            |---向 m_tickleFds[1] 写数据（写端） → 唤醒 A
-        */
-        int rt = pipe(m_tickleFds);
-
-        // 成功返回0失败返回-1
-        assert(!rt);
-
-        // add read event to epoll
-        //将管道的监听注册到epoll上
-    //     struct epoll_event {
-    //     uint32_t events; /* Epoll events (事件类型) */
-    //     epoll_data_t data; /* User data variable (用户数据，一般为文件描述符) */
-    // };
-        epoll_event event;
+        // 各工作线程自己的epoll在它第一次进入 idle 时才创建
+        for(size_t i = 0; i < MAX_WORKERS; ++i) {
+            m_reactorFds[i].store(-1, std::memory_order_relaxed);
+            m_wakeFds[i].store(-1, std::memory_order_relaxed);
+            m_reactorLoad[i].store(0, std::memory_order_relaxed);
+            m_rings[i].store(nullptr, std::memory_order_relaxed);
+            m_ringOps[i].store(0, std::memory_order_relaxed);
+        }
+        if(usesUring() && !Uring::Supported()) {
+            SYLAR_LOG_WARN() << "IOManager: io_uring is not available, fall back to epoll";
+            m_engine = ENGINE_EPOLL;
+        }
 
-        // Edge Triggered，设置标志位，并且采用边缘触发和读事件。
-        // EPOLLIN：监听读事件。
-        // EPOLLET (Edge Triggered)：边沿触发模式。
-        // 边沿触发意味着：仅当pipe从不可读变为可读时触发一次，若不一次性处理完毕，将不会再通知。
-        // 仅当文件描述符状态发生变化时触发通知。
-        // 状态变化的含义：
-        // 从不可读变为可读，或从不可写变为可写的瞬间。
-        // 边缘触发模式下，只有在状态变化瞬间（从不可读 → 可读，或从不可写 → 可写）时才通知一次。
-        // 如果事件发生后你没有一次性读取完缓冲区中的所有数据，那么即使缓冲区中还有剩余数据，epoll也不会再通知你。
-        // 边沿触发就像“门铃”，只在有人按门铃瞬间响一下。如果你开门时没把人接进来，后面再去看门铃，它不会再响。
-        // 与水平触发（LT）对比：
-        // 水平触发模式（默认模式），只要缓冲区中还有数据可读，就一直通知你（不断响铃），直到读完为止。
-        // EPOLLIN：监听读事件（可读即通知）。
-        // EPOLLET：事件边沿触发模式（变化瞬间通知一次，不会持续通知）。
-        event.events = EPOLLIN | EPOLLET;
-
-        // 指定event.data.fd为pipe的读端，确保epoll监控pipe读端的可读事件。
-        // epoll可以监听多个文件描述符（如socket、pipe），这里明确指定了要监听的是哪个文件描述符。
-        // epoll监听的是管道的读端，因为只有读端有数据可读时，才需要通知程序处理数据
-        event.data.fd = m_tickleFds[0];
-
-        // non-blocked
-        //修改管道文件描述符以非阻塞的方式，配合边缘触发。
-        // 设置pipe读端为非阻塞模式
-        // 防止在读取pipe内容时线程阻塞。
-        // 若无数据则直接返回-1，而非等待数据。
-        rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-
-        //每次需要判断rt是否成功
-        // 成功返回0失败返回-1
-        assert(!rt);
-
-        //将 m_tickleFds[0];作为读事件放入到event监听集合中
-        // 调用epoll_ctl函数，将上面定义好的事件（event）添加到epoll实例（m_epfd）中，开始监控m_tickleFds[0]
-        // 成功返回0失败返回-1
-        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-        assert(!rt);
+        // 阻塞在 epoll_pwait 上的线程由 Scheduler::tickle() 逐个定向唤醒，不使用所有线程共同监听的唤醒管道，
+        // 一次唤醒只叫醒一个确定的线程：每个工作线程有自己的epoll时向它上面的eventfd写入（见 reactorFd()），
+        // 共用 m_epfd 时（eventfd 会叫醒任意一个等待者）向该线程发唤醒信号（见 Scheduler::prepareWait()）
 
         //初始化了一个包含 32 个文件描述符上下文的数组
         // 事件上下文数组大小初始化
         // 预先分配大小为32个FD的事件上下文对象，减少运行时频繁内存分配的开销。
+        m_deadlines.reset(new DeadlineHeap[MAX_WORKERS]);
+        m_fdChunks.reset(new std::atomic<FdContext*>[FD_MAX_CHUNKS]);
+        for(size_t i = 0; i < FD_MAX_CHUNKS; ++i) {
+            m_fdChunks[i].store(nullptr, std::memory_order_relaxed);
+        }
         contextResize(32);
 
         //启动 Scheduler，开启线程池，准备处理任务
@@ -208,71 +347,172 @@ IOManager::~IOManager() {
     // 关闭epoll的句柄
     // 关闭epoll句柄后，操作系统会自动清理epoll实例相关资源，停止监听事件
     close(m_epfd);
-
-    //关闭管道读端写端
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
-
-    //将fdcontext文件描述符一个个关闭
-    for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if(m_fdContexts[i]) {
-            delete m_fdContexts[i];
+    for(auto& acc: m_acceptors) {
+        for(int fd: acc->fds) {
+            if(fd >= 0) {
+                close(fd);
+            }
         }
     }
-}
-
-// no lock
-// 函数的用途是调整类内维护的FdContext数组（或容器）大小到指定的size。
-void IOManager::contextResize(size_t size) {
-    if (size < m_fdContexts.size()) {
-        // std::cout <<"1"<< std::endl;
-        for (size_t i = size; i < m_fdContexts.size(); ++i) {
-            delete m_fdContexts[i]; // 释放多余的FdContext
-            m_fdContexts[i] = nullptr;
+    m_acceptors.clear();
+    for(size_t i = 0; i < MAX_WORKERS; ++i) {
+        int fd = m_reactorFds[i].load(std::memory_order_relaxed);
+        if(fd >= 0) {
+            close(fd);
+        }
+        fd = m_wakeFds[i].load(std::memory_order_relaxed);
+        if(fd >= 0) {
+            close(fd);
         }
+        delete m_rings[i].load(std::memory_order_relaxed);
     }
 
-    //调整m_fdContexts的大小
-    // 遍历 m_fdContexts 向量，初始化尚未初始化的 FdContext 对象
-    m_fdContexts.resize(size);
+    //将fdcontext文件描述符一块块释放
+    for(size_t i = 0; i < FD_MAX_CHUNKS; ++i) {
+        delete[] m_fdChunks[i].load(std::memory_order_relaxed);
+    }
+}
 
-    for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if(m_fdContexts[i] == nullptr) {
-            m_fdContexts[i] = new FdContext();
+// 预先分配覆盖 [0, size) 的上下文块，之后这些fd的查找不会再触发分配
+void IOManager::contextResize(size_t size) {
+    for(size_t fd = 0; fd < size && fd < FD_CHUNK_SIZE * FD_MAX_CHUNKS; fd += FD_CHUNK_SIZE) {
+        getContext(fd, true);
+    }
+}
 
-            // 将文件描述符的编号赋值给 fd
-            // 设置FdContext的成员fd为当前的索引i
-            m_fdContexts[i]->fd = i;
-            // std::cout <<i << std::endl;
+IOManager::FdContext* IOManager::getContext(int fd, bool create) {
+    if(fd < 0 || (size_t)fd >= FD_CHUNK_SIZE * FD_MAX_CHUNKS) {
+        return nullptr;
+    }
+    size_t idx = (size_t)fd >> FD_CHUNK_SHIFT;
+    // acquire 与发布新块时的 release 配对，保证看到的块里 fd 等字段已经初始化
+    FdContext* chunk = m_fdChunks[idx].load(std::memory_order_acquire);
+    if(!chunk) {
+        if(!create) {
+            return nullptr;
+        }
+        // 整块连续分配，相邻fd的上下文在相邻的内存里
+        FdContext* fresh = new FdContext[FD_CHUNK_SIZE];
+        for(size_t i = 0; i < FD_CHUNK_SIZE; ++i) {
+            fresh[i].fd = idx * FD_CHUNK_SIZE + i;
+        }
+        // 多个线程同时分配同一块时只有一个能发布成功，其余的丢弃自己的，用已发布的那块
+        if(m_fdChunks[idx].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            chunk = fresh;
+        } else {
+            delete[] fresh;
         }
     }
+    return &chunk[fd & (FD_CHUNK_SIZE - 1)];
 }
 
 // addEvent方法用于向IO管理器中注册一个事件（如读或写事件）
 // fd：文件描述符（通常是socket）。
 // event：事件类型（如读事件或写事件）。
 // cb：当事件触发时执行的回调函数。
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+int IOManager::addEvent(int fd, Event event, Callback cb, int priority) {
+    return registerEvent(fd, event, std::move(cb), priority, ~0ull, false);
+}
+
+struct IOManager::CancelWaiter: public CancelContext::Waiter {
+    IOManager* iom;
+    FdContext* fd_ctx;
+    Event event;
+    uint32_t id;
+
+    static void Wake(CancelContext::Waiter* w) {
+        CancelWaiter* self = static_cast<CancelWaiter*>(w);
+        self->iom->expireWait(self->fd_ctx, self->event, self->id, nullptr, ECANCELED);
+    }
+};
+
+int IOManager::waitEvent(int fd, Event event, uint64_t timeout_ms) {
+    CancelContext* cancel = CancelContext::Current();
+    if(cancel) {
+        if(int err = cancel->check()) {
+            errno = err;
+            return err;
+        }
+        timeout_ms = std::min(timeout_ms, cancel->remainingMs());
+    }
+    Fiber* self = Fiber::Current();
+    self->setWakeResult(0);
+    uint32_t id = 0;
+    int rt = registerEvent(fd, event, nullptr, PRIORITY_NORMAL, timeout_ms, true, &id);
+    if(rt) {
+        // rt > 0：ENGINE_EPOLL_ET 下已经就绪过，没有注册，不用挂起
+        return rt < 0 ? -1: 0;
+    }
+    // 放在堆上：共享栈协程挂起期间栈内容可能已经被换出，cancel() 不能去读写它
+    CancelWaiter* waiter = nullptr;
+    if(cancel) {
+        waiter = new CancelWaiter;
+        waiter->wake = &CancelWaiter::Wake;
+        waiter->iom = this;
+        waiter->fd_ctx = getContext(fd, false);
+        waiter->event = event;
+        waiter->id = id;
+        cancel->addWaiter(waiter);
+        // 在登记之前已经取消的，cancel() 看不到这次等待，由自己结束（协程还没切出去，触发后 resume 会等它切换完成）
+        if(cancel->isCancelled()) {
+            CancelWaiter::Wake(waiter);
+        }
+    }
+    Fiber::SetWaitReason(Fiber::WAIT_IO, (uint32_t)fd | ((uint64_t)event << 32));
+    self->yield();
+    if(waiter) {
+        cancel->removeWaiter(waiter);
+        delete waiter;
+    }
+    int result = self->getWakeResult();
+    if(result) {
+        errno = result;
+    }
+    return result;
+}
+
+uint32_t IOManager::getReadiness(int fd) {
+    if(m_engine != ENGINE_EPOLL_ET) {
+        return 0;
+    }
+    FdContext* fd_ctx = getContext(fd, false);
+    return fd_ctx ? fd_ctx->readiness.load(std::memory_order_acquire): 0;
+}
+
+void IOManager::markNotReady(int fd, Event event, uint32_t readiness) {
+    if(m_engine != ENGINE_EPOLL_ET) {
+        return;
+    }
+    FdContext* fd_ctx = getContext(fd, true);
+    if(!fd_ctx) {
+        return;
+    }
+    // 只有取值之后没有来过边沿时才标记；fd还没注册时也可以标记，注册时epoll会报告当时已有的就绪。
+    // 对端关闭后读到结尾不会再有边沿，出过挂断就不再标记
+    uint32_t old = readiness;
+    while(!(old & ((uint32_t)event | FdContext::READINESS_HUP)) && (old & ~(FdContext::READINESS_SEQ - 1)) == (readiness & ~(FdContext::READINESS_SEQ - 1))) {
+        if(fd_ctx->readiness.compare_exchange_weak(old, old | event, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+int IOManager::registerEvent(int fd, Event event, Callback cb, int priority, uint64_t timeout_ms, bool wait,
+                             uint32_t* wait_id) {
     // attemp to find FdContext 
     FdContext* fd_ctx = nullptr;
 
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-
-    // 如果容器m_fdContexts足够大，快速获取对应fd的上下文对象
-    if((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        read_lock.unlock();
-    } else {
-        // 如果大小不足，释放读锁，申请独占写锁，调用contextResize(fd * 1.5)扩展容器，保证容器能够容纳新的fd。
-        read_lock.unlock();
-        std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+    // 无锁查找fd对应的上下文对象，所在的块还不存在时分配它，已有的块不受影响
+    fd_ctx = getContext(fd, true);
+    if(!fd_ctx) {
+        SYLAR_LOG_ERROR() << "addEvent fd out of range: " << fd;
+        return -1;
     }
+    SYLAR_TRACE(TRACE_EVENT_ADD, fd, event);
 
     // 锁定fd_ctx并检查是否已有事件
     // fd_ctx->mutex是保护FdContext自身状态的互斥锁，确保多个线程不会同时修改。
-    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    std::lock_guard<FdLock> lock(fd_ctx->mutex);
 
     // the event has already been added
     // 检查fd_ctx->events是否已经包含当前的事件：
@@ -282,21 +522,30 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         return -1;
     }
 
+    // ENGINE_EPOLL_ET：waitEvent 等待的方向在上次调用返回 EAGAIN 之后已经就绪过，不注册，调用方直接重试
+    if(wait && (fd_ctx->ready & event)) {
+        fd_ctx->ready &= ~event;
+        return 1;
+    }
+
+    // 多reactor模式下第一次注册事件时决定fd归哪个工作线程
+    if(perWorker() && fd_ctx->owner == OWNER_NONE) {
+        assignOwner(fd_ctx);
+    }
+
     // add new event
     // 构建epoll事件并调用epoll_ctl
     // 确定调用epoll_ctl的操作类型：
     // 若fd_ctx已有事件，则使用EPOLL_CTL_MOD（修改）。
     // 若还没有注册任何事件，则使用EPOLL_CTL_ADD（新增）。
-    int op = fd_ctx->events ? EPOLL_CTL_MOD: EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
-
-    // 成功返回0失败返回-1
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    // 成功返回0失败返回-1（见 updateEvents）
+    int rt = updateEvents(fd_ctx, fd_ctx->events, (Event)(fd_ctx->events | event));
 
     if(rt) {
-        std::cerr << "addEvent::epoll_ctl failed: " << strerror(errno) << std::endl; 
+        SYLAR_LOG_ERROR() << "addEvent::epoll_ctl failed: " << strerror(errno);
+        if(!fd_ctx->events) {
+            releaseOwner(fd_ctx);
+        }
         return -1;
     }
 
@@ -310,47 +559,134 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     // getEventContext(event) 会返回对应事件的引用：
     // 比如事件为READ或WRITE，分别返回对应的EventContext结构
     FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
+    uintptr_t& waiter = fd_ctx->getWaiter(event);
 
     // 确保事件上下文未被占用（防御性编程）
-    assert(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
+    assert(!waiter);
 
-    // 当前的事件被注册到特定的调度器（当前线程绑定的调度器）
-    event_ctx.scheduler = Scheduler::GetThis();
+    // 当前的事件被注册到特定的调度器（当前线程绑定的调度器），不在调度器线程上时放回本IOManager
+    Scheduler* scheduler = Scheduler::GetThis();
+    if(!scheduler) {
+        scheduler = this;
+    }
+    event_ctx.flags = priority & FdContext::EVENT_PRIORITY_MASK;
 
     // 绑定回调函数（回调模式）或绑定协程（协程模式）
-    if(cb) {
-        // 如果传入的参数 cb 不为空，说明采用回调模式
-        // 此时回调函数func2()就已经被存入了event_ctx.cb，等待事件触发时调用
-        event_ctx.cb.swap(cb);
+    if(cb || scheduler != this) {
+        // 回调、或者要放回其他调度器：放在堆上的 EventHandler 里
+        EventHandler* h = new EventHandler;
+        h->scheduler = scheduler;
+        if(cb) {
+            // 此时回调函数func2()就已经被存入了h->cb，等待事件触发时调用
+            h->cb.swap(cb);
+        } else {
+            h->fiber = Fiber::GetThis();
+            assert(h->fiber->getState() == Fiber::RUNNING);
+            h->wait = wait;
+        }
+        waiter = (uintptr_t)h | WAITER_HANDLER;
     } else {
-        // 如果未提供回调函数，默认使用协程模式：
-        event_ctx.fiber = Fiber::GetThis();
+        // 常见情况：协程等在本IOManager上，指针本身就是等待者，不需要分配
+        Fiber* fiber = Fiber::Current();
         // 断言协程状态为 Fiber::RUNNING，说明当前一定处于协程运行状态下调用此函数。
-        assert(event_ctx.fiber->getState() == Fiber::RUNNING);
+        assert(fiber->getState() == Fiber::RUNNING);
+        fiber->addRef();
+        waiter = (uintptr_t)fiber | (wait ? WAITER_WAIT: WAITER_FIBER);
+    }
+
+    // waitEvent 的超时：登记到本线程的超时堆，由本线程的 idle 检查；
+    // 不在本IOManager运行中的工作线程上时退回用定时器
+    uint32_t id = ++event_ctx.wait_id;
+    if(wait_id) {
+        *wait_id = id;
+    }
+    bool timer_fallback = false;
+    if(wait && timeout_ms != ~0ull) {
+        int index = getCurrentWorkerIndex();
+        if(index >= 0 && isWorkerRunning(index)) {
+            DeadlineHeap& heap = m_deadlines[index];
+            event_ctx.heap = index;
+            event_ctx.flags |= FdContext::EVENT_IN_HEAP;
+            std::lock_guard<std::mutex> heap_lock(heap.mutex);
+            heap.push({MonotonicNs() + timeout_ms * 1000000, fd_ctx, event, id});
+        } else {
+            timer_fallback = true;
+        }
+    }
+
+    // ENGINE_EPOLL_ET：上次调用返回 EAGAIN 之后已经就绪过，边沿不会再来，立即触发
+    if(fd_ctx->ready & event) {
+        fd_ctx->ready &= ~event;
+        triggerEvent(fd_ctx, event, nullptr, ownerThread(fd_ctx, event));
+        --m_pendingEventCount;
+    } else if(timer_fallback) {
+        // 到期时按 id 判断等待是否还在，不需要在就绪时取消。一次性的，用池化定时器，不分配 Timer
+        addPooledTimer(timeout_ms, [this, fd_ctx, event, id]() {
+            expireWait(fd_ctx, event, id, nullptr, ETIMEDOUT);
+        });
     }
     return 0;
 }
 
+void IOManager::expireWait(FdContext* fd_ctx, Event event, uint32_t id, Scheduler::Batch* batch, int result) {
+    std::lock_guard<FdLock> lock(fd_ctx->mutex);
+    FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
+    uintptr_t waiter = fd_ctx->getWaiter(event);
+    // 只结束 waitEvent 的等待
+    Fiber* fiber = nullptr;
+    if((waiter & WAITER_TAG_MASK) == WAITER_WAIT) {
+        fiber = untag<Fiber>(waiter);
+    } else if((waiter & WAITER_TAG_MASK) == WAITER_HANDLER && untag<EventHandler>(waiter)->wait) {
+        fiber = untag<EventHandler>(waiter)->fiber.get();
+    }
+    if(!(fd_ctx->events & event) || event_ctx.wait_id != id || !fiber) {
+        return;
+    }
+    if(updateEvents(fd_ctx, fd_ctx->events, (Event)(fd_ctx->events & ~event))) {
+        SYLAR_LOG_ERROR() << "expireWait::epoll_ctl failed: " << strerror(errno);
+        return;
+    }
+    --m_pendingEventCount;
+    fiber->setWakeResult(result);
+    triggerEvent(fd_ctx, event, batch, ownerThread(fd_ctx, event));
+}
+
+void IOManager::expireWaits(size_t index, Scheduler::Batch& batch) {
+    DeadlineHeap& heap = m_deadlines[index];
+    // idle 本轮刚更新过缓存的时间（与 MonotonicNs 同一个时钟）
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(CachedNow().time_since_epoch()).count();
+    if(heap.earliest.load(std::memory_order_relaxed) > now) {
+        return;
+    }
+    // 先在堆的锁下取出到期的，再逐个加 fd 的锁处理（加锁顺序与注册、触发时的 fd -> 堆 一致）
+    std::vector<DeadlineHeap::Entry> expired;
+    {
+        std::lock_guard<std::mutex> lock(heap.mutex);
+        while(!heap.entries.empty() && heap.entries[0].deadline <= now) {
+            expired.push_back(heap.pop());
+        }
+    }
+    for(const DeadlineHeap::Entry& e: expired) {
+        expireWait(e.fd_ctx, e.event, e.id, &batch, ETIMEDOUT);
+    }
+}
+
 // delEvent 函数的作用是从事件管理器中移除一个指定文件描述符（fd）的特定事件（Event）。通常用于取消对某个文件描述符的读写或异常事件监听。
 bool IOManager::delEvent(int fd, Event event) {
     // attemp to find FdContext 
     //这里的步骤和上面的addevent添加事件类似
     FdContext* fd_ctx = nullptr;
 
-    // 这里使用读锁（共享锁）安全访问m_fdContexts容器（通常是数组或vector），检查指定的fd是否存在对应的上下文FdContext。
+    // 检查指定的fd是否存在对应的上下文FdContext。
     // 若找到，则保存到fd_ctx指针中；否则直接返回false（表示无法删除）
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-    if((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        read_lock.unlock();
-    } else {
-        read_lock.unlock();
+    fd_ctx = getContext(fd, false);
+    if(!fd_ctx) {
         //如果没查找到代表数组中没这个文件描述符直接，返回false；
         return false;
     }
 
     //找到后添加互斥锁
-    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    std::lock_guard<FdLock> lock(fd_ctx->mutex);
 
     // the event doesn't exist
     // 检查待删除事件是否存在
@@ -365,20 +701,11 @@ bool IOManager::delEvent(int fd, Event event) {
 
     // 如果删除后事件还存在其他监听事件，则修改（EPOLL_CTL_MOD）监听的事件集；
     // 否则，没有任何事件监听了，则从epoll监听集中删除（EPOLL_CTL_DEL）此fd。
-    int op = new_events ? EPOLL_CTL_MOD: EPOLL_CTL_DEL;
-
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-
-    //这一步是为了在 epoll 事件触发时能够快速找到与该事件相关联的 FdContext 对象。
-    // 并将fd_ctx保存至data.ptr，便于epoll_wait时获取上下文
-    epevent.data.ptr = fd_ctx;
-
-    // 调用epoll_ctl更新epoll事件监听状态
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    // 调用epoll_ctl更新epoll事件监听状态（见 updateEvents）
+    int rt = updateEvents(fd_ctx, fd_ctx->events, new_events);
 
     if(rt) {
-        std::cerr << "delEvent::epoll_ctl failed: " << strerror(errno) << std::endl; 
+        SYLAR_LOG_ERROR() << "delEvent::epoll_ctl failed: " << strerror(errno);
         return -1;
     }
 
@@ -391,10 +718,8 @@ bool IOManager::delEvent(int fd, Event event) {
 
     // update event context
     // 重置事件上下文EventContext
-    FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
-
-    // 将原本存储在FdContext内的事件上下文（通常包含回调、协程信息等）清理重置，防止内存泄漏或误操作。
-    fd_ctx->resetEventContext(event_ctx);
+    // 将原本存储在FdContext内的等待者（回调或协程）清理重置，防止内存泄漏或误操作。
+    resetEvent(fd_ctx, event);
     return true;
 }
 
@@ -403,16 +728,12 @@ bool IOManager::cancelEvent(int fd, Event event) {
     // attemp to find FdContext 
     FdContext* fd_ctx = nullptr;
 
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-    if((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        read_lock.unlock();
-    } else {
-        read_lock.unlock();
+    fd_ctx = getContext(fd, false);
+    if(!fd_ctx) {
         return false;
     }
 
-    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    std::lock_guard<FdLock> lock(fd_ctx->mutex);
 
     // the event doesn't exist
     if(!(fd_ctx->events & event)) {
@@ -421,15 +742,10 @@ bool IOManager::cancelEvent(int fd, Event event) {
 
     // delete the event
     Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD: EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = updateEvents(fd_ctx, fd_ctx->events, new_events);
 
     if(rt) {
-        std::cerr << "cancelEvent::epoll_ctl failed: " << strerror(errno) << std::endl; 
+        SYLAR_LOG_ERROR() << "cancelEvent::epoll_ctl failed: " << strerror(errno);
         return false;
     }
     
@@ -438,7 +754,7 @@ bool IOManager::cancelEvent(int fd, Event event) {
     // update fdcontext, event context and trigger
     //这个代码和上面那个delEvent一致好像就是最后的处理不同一个是重置，一个是调用事件的回调函数
     // 立即触发事件回调
-    fd_ctx->triggerEvent(event);
+    triggerEvent(fd_ctx, event, nullptr, ownerThread(fd_ctx, event));
     return true;
 }
 
@@ -447,46 +763,61 @@ bool IOManager::cancelAll(int fd) {
     // attemp to find FdContext 
     FdContext* fd_ctx = nullptr;
 
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-    if((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        read_lock.unlock();
-    } else {
-        read_lock.unlock();
+    fd_ctx = getContext(fd, false);
+    if(!fd_ctx) {
         return false;
     }
 
-    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    std::lock_guard<FdLock> lock(fd_ctx->mutex);
+
+    // 完成模式下还在进行的操作：在各个 ring 上按fd取消，发起的协程得到 EBADF
+    if(fd_ctx->uring_ops > 0) {
+        for(size_t i = 0; i < MAX_WORKERS; ++i) {
+            Uring* ring = m_rings[i].load(std::memory_order_acquire);
+            if(!ring || m_ringOps[i].load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            ring->submit(1, [fd](io_uring_sqe** sqes) {
+                sqes[0]->opcode = IORING_OP_ASYNC_CANCEL;
+                sqes[0]->fd = fd;
+                sqes[0]->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            }, true);
+        }
+    }
 
     // none of events exist
+    // 事件已经全部触发过的fd同样要交还所属线程：cancelAll 之后fd通常会被关闭，fd号复用时重新分配
     if(!fd_ctx->events) {
+        unregisterFd(fd_ctx);
+        releaseOwner(fd_ctx);
         return false;
     }
 
-    // delete all events
-    int op = EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = 0;
-    epevent.data.ptr = fd_ctx;
+    int read_thread = ownerThread(fd_ctx, READ);
+    int write_thread = ownerThread(fd_ctx, WRITE);
 
+    // delete all events
     // 所有事件清空
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = updateEvents(fd_ctx, fd_ctx->events, NONE);
     if(rt) {
-        std::cerr << "IOManager::epoll_ctl failed: " << strerror(errno) << std::endl; 
+        SYLAR_LOG_ERROR() << "IOManager::epoll_ctl failed: " << strerror(errno);
         return false;
     }
 
+    unregisterFd(fd_ctx);
+    releaseOwner(fd_ctx);
+
     // update fdcontext, event context and trigger
     // 逐个检查并触发已注册事件的回调
     // 检测并主动触发所有已注册事件（如读事件、写事件）的回调函数或协程任务。
     // 每触发一个事件的回调，都需要减少全局待处理事件计数器（m_pendingEventCount）。
     if(fd_ctx->events & READ) {
-        fd_ctx->triggerEvent(READ);
+        triggerEvent(fd_ctx, READ, nullptr, read_thread);
         --m_pendingEventCount;
     }
 
     if(fd_ctx->events & WRITE) {
-        fd_ctx->triggerEvent(WRITE);
+        triggerEvent(fd_ctx, WRITE, nullptr, write_thread);
         --m_pendingEventCount;
     }
 
@@ -495,33 +826,39 @@ bool IOManager::cancelAll(int fd) {
     return true;
 }
 
-// 用于唤醒当前IO管理器中处于空闲等待（idle）状态的线程。
-void IOManager::tickle() {
-    // no idle threads
-    //这个函数在scheduler检查当前是否有线程处于空闲状态。如果没有空闲线程，函数直接返回，不执行后续操作。
-    // 若当前没有任何线程处于空闲（等待事件）的状态，则无需唤醒。
-    // 提前返回，避免无意义的唤醒调用。
-    if(!hasIdleThreads()) {
-        return;
-    }
-
-    //如果有空闲线程，函数会向管道 m_tickleFds[1] 写入一个字符 "T"。这个写操作的目的是向等待在 m_tickleFds[0]（管道的另一端）的线程发送一个信号，通知它有新任务可以处理了。
-    // 用于唤醒处于阻塞等待状态（例如调用epoll_wait()）的线程
-    // ssize_t write(int fd, const void *buf, size_t count);
-    // 将缓冲区buf中最多count字节的数据写入到文件描述符fd中。
-    // 成功时返回实际写入的字节数（应与count相同），失败则返回-1。
-    int rt = write(m_tickleFds[1], "T", 1);
-    assert(rt == 1);
+Scheduler::Metrics IOManager::getMetrics() const {
+    Metrics m = Scheduler::getMetrics();
+    m.pending_events = m_pendingEventCount.load(std::memory_order_relaxed);
+    m.timers_fired = getTimersFired();
+    m.timer_lag_us = getTimerLag();
+    return m;
 }
 
 bool IOManager::stopping() {
-    uint64_t timeout = getNextTimer();
-    // std::cout << std::boolalpha << (timeout == ~0ull) << std::endl;
-    // std::cout << std::boolalpha << (m_pendingEventCount == 0)<< std::endl;
-    // std::cout << std::boolalpha<< (Scheduler::stopping() == true) << std::endl;
-
+    // 空闲循环每一轮都会调用：先看不加锁的 Scheduler::stopping()（平时 m_stopping 为false直接返回），
+    // 定时器也只读计数，不拿定时器的读写锁
     // no timers left and no pending events left with the Scheduler::stopping()
-    return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
+    return Scheduler::stopping() && m_pendingEventCount == 0 && !hasTimer();
+}
+
+// 最多等待 timeout_us 微秒（负数一直等）的 epoll_pwait。优先用 epoll_pwait2（内核5.11+）的纳秒超时，
+// 让亚毫秒定时器按时醒来；内核不支持时退回 epoll_pwait，超时向上取整到毫秒
+static int epoll_pwait_us(int epfd, epoll_event* events, int maxevents, int64_t timeout_us, const sigset_t* mask) {
+#ifdef __NR_epoll_pwait2
+    static std::atomic<bool> s_noPwait2{false};
+    if(!s_noPwait2.load(std::memory_order_relaxed)) {
+        timespec ts;
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        int rt = syscall(__NR_epoll_pwait2, epfd, events, maxevents, timeout_us < 0 ? nullptr: &ts, mask, _NSIG / 8);
+        if(rt >= 0 || errno != ENOSYS) {
+            return rt;
+        }
+        s_noPwait2.store(true, std::memory_order_relaxed);
+    }
+#endif
+    int timeout_ms = timeout_us < 0 ? -1: (int)std::min<int64_t>((timeout_us + 999) / 1000, INT32_MAX);
+    return epoll_pwait(epfd, events, maxevents, timeout_ms, mask);
 }
 
 // 本质是一个运行于Fiber（协程）或独立线程上的事件循环函数，负责监视并处理IO事件与定时任务。
@@ -534,19 +871,48 @@ void IOManager::idle() {
     // 表示管理的是一个动态数组，而不是单个对象。
     // 因此，unique_ptr会调用delete[]释放数组内存
     // 使用 std::unique_ptr 动态分配了一个大小为 MAX_EVENTS 的 epoll_event 数组，用于存储从 epoll_wait 获取的事件
-    std::unique_ptr<epoll_event[]> events(new epoll_event[MAX_EVENTS]);
+    // BusyPoll::max_events 更大时数组大小随 epoll_wait 的返回情况在 [MAX_EVENTS, max_events] 之间伸缩
+    size_t cap = MAX_EVENTS;
+    size_t max_cap = std::max<size_t>(MAX_EVENTS, m_busyPoll.max_events);
+    std::unique_ptr<epoll_event[]> events(new epoll_event[cap]);
+    uint32_t full_streak = 0;
+    uint32_t sparse_streak = 0;
+
+    // 多reactor模式和 io_uring 引擎下只等待本线程拥有的fd
+    int index = perWorker() ? getCurrentWorkerIndex(): -1;
+    Uring* ring = usesUring() && index >= 0 ? ringOf(index): nullptr;
+    int epfd = index >= 0 && !ring ? reactorFd(index): m_epfd;
+    // 本线程独占epoll时用上面的eventfd定向唤醒，否则用信号（eventfd 创建失败时同样退回信号）
+    int wake_fd = epfd != m_epfd ? m_wakeFds[index].load(std::memory_order_relaxed): -1;
+    // 本线程的 waitEvent 超时堆
+    int slot = getCurrentWorkerIndex();
+    DeadlineHeap* deadlines = slot >= 0 ? &m_deadlines[slot]: nullptr;
 
     while(true) {
-        if(debug) {
-            std::cout << "IOManager::idle(),run in thread: " << Thread::GetThreadId() << std::endl; 
+        SYLAR_LOG_DEBUG() << "IOManager::idle(),run in thread: " << Thread::GetThreadId();
+
+        if(index >= 0) {
+            // 被要求退出时先把fd交给其他线程，否则它们的事件再也没有人等待
+            if(!isWorkerRunning(index) && m_reactorLoad[index].load(std::memory_order_relaxed) > 0) {
+                handOffAll(index);
+            }
+            if(m_unowned.load(std::memory_order_relaxed) > 0) {
+                handOffAll(OWNER_PENDING);
+            }
+            if(m_acceptorSeen[index] != m_acceptorGen.load(std::memory_order_acquire) && isWorkerRunning(index)) {
+                syncAcceptors(index);
+            }
         }
 
         // 如果IOManager准备停止（stopping()返回true），则退出循环并结束idle()运行
         // 返回false
-        if(stopping()) {
-            if(debug) {
-                std::cout << "name = " << getName() << " idle exists in thread: " << Thread::GetThreadId() << std::endl;
-            }
+        // 本线程被要求退出（retireWorkers）并且剩余任务都已处理完时同样结束
+        // 本线程 ring 上还有没完成的操作时不能退出，否则它们的完成事件没有人收割
+        // 超时堆里还有等待时同样不能退出，否则它们不会再到期
+        bool ops_pending = (index >= 0 && m_ringOps[index].load(std::memory_order_relaxed) > 0)
+            || (deadlines && deadlines->earliest.load(std::memory_order_relaxed) != ~0ull);
+        if(stopping() || (!ops_pending && tryRetire())) {
+            SYLAR_LOG_DEBUG() << "name = " << getName() << " idle exists in thread: " << Thread::GetThreadId();
             break;
         }
 
@@ -579,27 +945,85 @@ void IOManager::idle() {
         // 存放epoll_wait调用的返回值（触发事件的数量或错误码）
         int rt = 0;
 
-        // 无限循环直至epoll_wait成功返回或发生非信号中断错误
-        while(true) {
-            // 将next_timeout限制在最大5000ms（5秒）内
-            static const uint64_t MAX_TIMEOUT = 5000;
+        // 空闲策略：先自旋等任务，再用 epoll_wait(0) 轮询几次，都没有才阻塞在 epoll_pwait 上。
+        // 任务密集时省掉唤醒信号和线程睡眠/唤醒的开销
+        uint64_t poll_start = MonotonicNs();
+        IdlePolicy policy = getIdlePolicy();
+        bool ready = spinForWork();
+        for(uint32_t i = 0; !ready && i < policy.poll_count; ++i) {
+            rt = ring ? ring->wait(0, nullptr): epoll_wait_f(epfd, events.get(), (int)cap, 0);
+            recordEpollWait(rt);
+            ready = rt != 0 || hasWork();
+        }
+        // 低延迟模式：按时间继续轮询，不超过最近一个定时器的到期时间
+        if(!ready && m_busyPoll.window_us) {
+            uint64_t window_ns = m_busyPoll.window_us * 1000ull;
+            uint64_t next_timer = timerWaitUs(slot);
+            if(next_timer != ~0ull) {
+                window_ns = std::min<uint64_t>(window_ns, next_timer * 1000);
+            }
+            uint64_t deadline = MonotonicNs() + window_ns;
+            do {
+                rt = ring ? ring->wait(0, nullptr): epoll_wait_f(epfd, events.get(), (int)cap, 0);
+                recordEpollWait(rt);
+                ready = rt != 0 || hasWork();
+            } while(!ready && MonotonicNs() < deadline);
+        }
+        if(rt < 0) {
+            rt = 0;
+        }
+        uint64_t park_start = MonotonicNs();
+        bool parked = !ready;
 
-            //获取下一个超时的定时器
-            uint64_t next_timeout = getNextTimer();
+        // 无限循环直至epoll_wait成功返回或发生非信号中断错误
+        while(!ready) {
+            //获取下一个超时的定时器（微秒），只看本线程负责的分片
+            uint64_t next_timeout = timerWaitUs(slot);
             // std::cout << std::boolalpha<< (~0ull == next_timeout)<< std::endl;   true
 
-            //获取下一个定时器的超时时间，并将其与 MAX_TIMEOUT 取较小值，避免等待时间过长。
-            next_timeout = std::min(next_timeout, MAX_TIMEOUT);
+            //获取下一个定时器的超时时间，并将其与空闲策略的最长阻塞时间取较小值，避免等待时间过长。
+            next_timeout = std::min(next_timeout, (uint64_t)policy.park_timeout_ms * 1000);
+            // 还要在本线程最早的 waitEvent 超时到期时醒来
+            uint64_t earliest = deadlines ? deadlines->earliest.load(std::memory_order_relaxed): ~0ull;
+            if(earliest != ~0ull) {
+                uint64_t now = MonotonicNs();
+                next_timeout = std::min<uint64_t>(next_timeout, earliest > now ? (earliest - now + 999) / 1000: 0);
+            }
 
             // std::unique_ptr通过get()方法返回其管理的原始指针（裸指针）
             // 注意：此处必须提供C风格裸指针。
             // C++智能指针无法直接隐式转换为原始指针，因此必须显式调用get()
             //epoll_wait陷入阻塞，等待tickle信号的唤醒，
             //并且使用了定时器堆中最早超时的定时器作为epoll_wait超时时间。
-            // 最多等待5000毫秒(5秒)。
-            // 如果5秒内某文件描述符（例如套接字）变得可读、可写，epoll_wait立即返回。
-            // 如果5秒内没有事件发生，epoll_wait 超时返回0。
-            rt = epoll_wait(m_epfd, events.get(), MAX_EVENTS, (int)next_timeout);
+            // 最多等待 park_timeout_ms（默认5秒）。
+            // 期间某文件描述符（例如套接字）变得可读、可写，epoll_wait立即返回。
+            // 超时没有事件发生，epoll_wait 返回0。
+            // 信箱里已有指定给本线程的任务时不阻塞；否则用 epoll_pwait 在等待期间放开定向唤醒信号
+            const sigset_t* wait_mask = prepareWait(wake_fd);
+            // 算出等待时间之后又插入了更早的定时器：插入方可能没看到本线程在等待，重新计算
+            if(wait_mask && timersTickled(slot)) {
+                finishWait();
+                continue;
+            }
+            if(wait_mask) {
+                rt = ring ? ring->wait((int64_t)next_timeout, wait_mask)
+                          : epoll_pwait_us(epfd, events.get(), (int)cap, (int64_t)next_timeout, wait_mask);
+            } else {
+                rt = ring ? ring->wait(0, nullptr): epoll_wait_f(epfd, events.get(), (int)cap, 0);
+            }
+            int err = errno;
+            finishWait();
+            recordEpollWait(rt);
+            if(wait_mask) {
+                recordWakeup(rt == 0);
+            }
+            errno = err;
+
+            // 被定向唤醒（或一开始就有指定给本线程的任务）-> 返回调度循环去执行
+            if(rt < 0 && errno == EINTR && hasInboxTask()) {
+                rt = 0;
+                break;
+            }
 
             // EINTR -> retry
             // EINTR全称为 "Interrupted system call"（被中断的系统调用），是在Linux/Unix环境中非常常见的一种错误返回值。
@@ -613,20 +1037,40 @@ void IOManager::idle() {
                 break;
             }
         }
+        // 本轮的时间只取一次：缓存给到期检查和本轮派发的回调（TimerManager::CachedNow）
+        uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            UpdateCachedNow().time_since_epoch()).count();
+        recordIdleTime(park_start - poll_start, parked ? now_ns - park_start: 0);
+        SYLAR_PROBE3(idle_wake, rt, parked, parked ? now_ns - park_start: 0);
 
         // collect all timers overdue
         // 处理到期的定时任务
         //用于存储超时的回调函数。
-        std::vector<std::function<void()>> cbs;
+        std::vector<Callback> cbs;
+        std::vector<int> priorities;
 
         //用来获取所有超时的定时器回调，并将它们添加到 cbs 向量中
-        listExpiredCb(cbs);
-        if(!cbs.empty()) {
-            for(const auto& cb: cbs) {
-                // 将定时器回调调度到协程/任务队列中异步执行。
-                scheduleLock(cb);
-            }
-            cbs.clear();
+        collectTimers(slot, cbs, priorities);
+
+        // 到期的定时器回调和本轮就绪的I/O事件先收集到一起，最后一次性提交：
+        // 全局队列只加一次锁，空闲线程也只按任务数唤醒，而不是每个任务唤醒一次
+        Scheduler::Batch batch(this);
+        for(size_t i = 0; i < cbs.size(); ++i) {
+            // 将定时器回调调度到协程/任务队列中异步执行。
+            batch.add(std::move(cbs[i]), -1, Fiber::STACK_DEFAULT,
+                      priorities[i] < 0 ? PRIORITY_NORMAL: priorities[i]);
+        }
+        cbs.clear();
+
+        // 到期的 waitEvent：取消等待，协程带着 ETIMEDOUT 恢复
+        if(deadlines) {
+            expireWaits(slot, batch);
+        }
+
+        // io_uring 引擎：收割完成事件，不经过下面的 epoll 事件处理
+        if(ring) {
+            reapRing(ring, batch);
+            rt = 0;
         }
 
         // collect all events ready
@@ -636,45 +1080,44 @@ void IOManager::idle() {
             // 获取第 i 个 epoll_event，用于处理该事件。
             epoll_event& event = events[i];
             // std::cout <<std::endl<< i <<std::endl;
-            // std::cout << "i: "<< i<< std::boolalpha<< (event.data.fd == m_tickleFds[0])<< std::endl;
-            // 0
-            // i: 0false
-
-            // 1
-            // i: 1true
-
-            // tickle event
-            //检查当前事件是否是 tickle 事件（即用于唤醒空闲线程的事件）。
-            // 当其他线程添加了新任务或新监听事件时，需要立刻通知（唤醒）阻塞线程重新处理
-            // tickle事件（通常是一个管道或eventfd）用于唤醒阻塞在epoll_wait的线程。
-            // 采用边缘触发模式（EPOLLET），必须将管道内数据全部读出，否则下次不会再通知。
-            if(event.data.fd == m_tickleFds[0]) {
-                uint8_t dummy[256];
-
-                // edge triggered -> exhaust
-                // epoll_wait侦测到可读事件后返回，如果不及时将管道内的数据读走，下次调用epoll_wait还会持续返回（因为管道内还有数据），造成无效唤醒（busy loop）。
-                // 因此必须在接收到事件通知后一次性将管道内数据全部读取完毕。
-                // 对于一个管道，如果管道里有多个字节数据（可能是多次写入），epoll_wait只会在管道中有数据可读时触发一次事件。
-                // 为了确保每次事件触发都能“消费掉”管道中的所有数据，必须将管道中积累的数据一次性读完。否则，下次epoll_wait被调用时，可能无法再次触发tickle事件。
-
-                // ssize_t read(int fd, void *buf, size_t count);
-                // fd：文件描述符（file descriptor），表示要读取的文件、管道、socket 等的标识符。
-                // buf：指向缓冲区的指针，存储读取的数据。
-                // count：期望读取的字节数（buffer大小）。
-                // 返回值（ssize_t，有符号整型）：
-                // > 0：成功读取的字节数。
-                // = 0：已到达文件末尾（EOF）。
-                // < 0：读取失败，出错信息存储在errno中
-                while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
+
+            // 被定向唤醒：清零eventfd，信箱里的任务回到调度循环后执行
+            if(event.data.ptr == WAKEUP_TAG) {
+                eventfd_t value;
+                eventfd_read(wake_fd, &value);
                 continue;
             }
 
+            // ACCEPT_EXCLUSIVE 的监听socket：直接在这里accept，连接的回调固定在本线程
+            if((uintptr_t)event.data.ptr & ACCEPTOR_TAG) {
+                Acceptor* acc = (Acceptor*)((uintptr_t)event.data.ptr & ~ACCEPTOR_TAG);
+                acceptBatch(acc, acc->fds[0], batch);
+                continue;
+            }
             // other events
             //通过 event.data.ptr 获取与当前事件关联的 FdContext 指针 fd_ctx，该指针包含了与文件描述符相关的上下文信息。
             // 普通事件处理逻辑：
             // 获取 fd 的上下文，并加锁：
             FdContext* fd_ctx = (FdContext*)event.data.ptr;
-            std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+            std::lock_guard<FdLock> lock(fd_ctx->mutex);
+
+            // ENGINE_EPOLL_ET：注册保持不变，有等待者就触发，没有就记下来留给下一次 addEvent
+            if(m_engine == ENGINE_EPOLL_ET) {
+                for(Event e: {READ, WRITE}) {
+                    uint32_t mask = (e == READ ? EPOLLIN | EPOLLRDHUP: EPOLLOUT) | EPOLLERR | EPOLLHUP;
+                    if(!(event.events & mask)) {
+                        continue;
+                    }
+                    fd_ctx->bumpReadiness(e, (event.events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ? FdContext::READINESS_HUP: 0);
+                    if(fd_ctx->events & e) {
+                        triggerEvent(fd_ctx, e, &batch, ownerThread(fd_ctx, e));
+                        --m_pendingEventCount;
+                    } else {
+                        fd_ctx->ready |= e;
+                    }
+                }
+                continue;
+            }
 
             // convert EPOLLERR or EPOLLHUP to -> read or write event
             //如果当前事件是错误或挂起（EPOLLERR 或 EPOLLHUP），则将其转换为可读或可写事件（EPOLLIN 或 EPOLLOUT），以便后续处理。
@@ -731,35 +1174,816 @@ void IOManager::idle() {
 
             // 构造新的事件设置，并提交更新
             //根据之前计算的操作（op），调用 epoll_ctl 更新或删除 epoll 监听，如果失败，打印错误并继续处理下一个事件。
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+            // fd可能刚被 moveFd 移到了别的线程，按它现在所在的epoll修改
+            int rt2 = epoll_ctl(epfdOf(fd_ctx), op, fd_ctx->fd, &event);
             if(rt2) {
-                std::cerr << "idle::epoll_ctl failed: " << strerror(errno) << std::endl; 
+                SYLAR_LOG_ERROR() << "idle::epoll_ctl failed: " << strerror(errno);
                 continue;
             }
 
             // schedule callback and update fdcontext and event context
             //触发事件，事件的执行
             if(real_events & READ) {
-                fd_ctx->triggerEvent(READ);
+                triggerEvent(fd_ctx, READ, &batch, ownerThread(fd_ctx, READ));
                 --m_pendingEventCount;
             }
 
             if(real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
+                triggerEvent(fd_ctx, WRITE, &batch, ownerThread(fd_ctx, WRITE));
                 --m_pendingEventCount;
             }
         }
+        batch.submit();
+
+        // 缓冲连续两次被填满说明一次取不完就绪的事件，加倍；连续很多次用不到四分之一时减半
+        if(max_cap > MAX_EVENTS) {
+            if((size_t)rt == cap) {
+                sparse_streak = 0;
+                if(++full_streak >= 2 && cap < max_cap) {
+                    cap = std::min(cap * 2, max_cap);
+                    events.reset(new epoll_event[cap]);
+                    full_streak = 0;
+                }
+            } else {
+                full_streak = 0;
+                if(cap > MAX_EVENTS && rt < (int)(cap / 4) && ++sparse_streak >= 1024) {
+                    cap /= 2;
+                    events.reset(new epoll_event[cap]);
+                    sparse_streak = 0;
+                }
+            }
+        }
 
         //当前线程的协程主动让出控制权，调度器可以选择执行其他任务或再次进入 idle 状态。
-        Fiber::GetThis()->yield();
+        Fiber::Current()->yield();
+    }
+}
+
+int IOManager::getFdOwner(int fd) {
+    FdContext* fd_ctx = getContext(fd, false);
+    if(!fd_ctx) {
+        return -1;
+    }
+    std::lock_guard<FdLock> lock(fd_ctx->mutex);
+    return fd_ctx->owner >= 0 ? fd_ctx->owner: -1;
+}
+
+bool IOManager::moveFd(int fd, int index) {
+    if(!perWorker() || index < 0 || !isWorkerRunning(index)) {
+        return false;
+    }
+    FdContext* fd_ctx = getContext(fd, false);
+    if(!fd_ctx) {
+        return false;
+    }
+    std::lock_guard<FdLock> lock(fd_ctx->mutex);
+    return moveLocked(fd_ctx, index);
+}
+
+int IOManager::epfdOf(FdContext* fd_ctx) {
+    if(m_reactorMode == REACTOR_SHARED || fd_ctx->owner < 0) {
+        return m_epfd;
+    }
+    return reactorFd(fd_ctx->owner);
+}
+
+int IOManager::reactorFd(size_t index) {
+    int fd = m_reactorFds[index].load(std::memory_order_acquire);
+    if(fd >= 0) {
+        return fd;
+    }
+    std::lock_guard<std::mutex> lock(m_reactorMutex);
+    fd = m_reactorFds[index].load(std::memory_order_relaxed);
+    if(fd < 0) {
+        fd = epoll_create(5000);
+        assert(fd > 0);
+        // 唤醒eventfd只注册在这一个epoll上，写入它只会叫醒第index个线程
+        int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(wake >= 0) {
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.ptr = WAKEUP_TAG;
+            if(epoll_ctl(fd, EPOLL_CTL_ADD, wake, &event) == 0) {
+                m_wakeFds[index].store(wake, std::memory_order_relaxed);
+            } else {
+                close(wake);
+            }
+        }
+        m_reactorFds[index].store(fd, std::memory_order_release);
+    }
+    return fd;
+}
+
+void IOManager::assignOwner(FdContext* fd_ctx) {
+    size_t slots = getWorkerSlots();
+    int owner = -1;
+    if(m_reactorMode == REACTOR_SHARED) {
+        // io_uring 引擎的共享模式：留在注册它的线程上，省得跨线程提交
+        int cur = getCurrentWorkerIndex();
+        if(cur >= 0 && isWorkerRunning(cur)) {
+            owner = cur;
+        }
+    } else if(m_reactorMode == REACTOR_HASH && slots > 0) {
+        // 乘法散列，避免连续的fd号总落在相邻的线程上
+        size_t i = ((uint32_t)fd_ctx->fd * 2654435761u) % slots;
+        if(isWorkerRunning(i)) {
+            owner = i;
+        }
+    } else if(m_reactorMode == REACTOR_LEAST_LOADED) {
+        size_t best = (size_t)-1;
+        for(size_t i = 0; i < slots; ++i) {
+            size_t load = m_reactorLoad[i].load(std::memory_order_relaxed);
+            if(isWorkerRunning(i) && load < best) {
+                best = load;
+                owner = i;
+            }
+        }
+    }
+    // 轮流分配，散列到的线程没有在运行时也走这里
+    for(size_t n = 0; owner < 0 && n < slots; ++n) {
+        size_t i = m_reactorSeq.fetch_add(1, std::memory_order_relaxed) % slots;
+        if(isWorkerRunning(i)) {
+            owner = i;
+        }
+    }
+
+    if(owner >= 0) {
+        fd_ctx->owner = owner;
+        m_reactorLoad[owner].fetch_add(1, std::memory_order_relaxed);
+    } else {
+        // 工作线程都还没开始运行：先放在 m_epfd 上，叫醒一个线程来领走
+        fd_ctx->owner = OWNER_PENDING;
+        m_unowned.fetch_add(1, std::memory_order_relaxed);
+        tickle();
+    }
+}
+
+void IOManager::releaseOwner(FdContext* fd_ctx) {
+    if(!perWorker()) {
+        return;
+    }
+    if(fd_ctx->owner >= 0) {
+        m_reactorLoad[fd_ctx->owner].fetch_sub(1, std::memory_order_relaxed);
+    } else if(fd_ctx->owner == OWNER_PENDING) {
+        m_unowned.fetch_sub(1, std::memory_order_relaxed);
+    }
+    fd_ctx->owner = OWNER_NONE;
+}
+
+int IOManager::ownerThread(FdContext* fd_ctx, Event event) {
+    if(m_reactorMode == REACTOR_SHARED || fd_ctx->owner < 0
+        || waiterScheduler(fd_ctx->getWaiter(event)) != this) {
+        return -1;
+    }
+    return getWorkerThreadId(fd_ctx->owner);
+}
+
+bool IOManager::moveLocked(FdContext* fd_ctx, int index) {
+    if(fd_ctx->owner == index) {
+        return true;
+    }
+    if(fd_ctx->events && usesUring()) {
+        // 在原来的 ring 上取消，换了所属线程后再在新的 ring 上提交；旧提交的完成事件按 seq 丢弃
+        Event events = fd_ctx->events;
+        updateEvents(fd_ctx, events, NONE);
+        releaseOwner(fd_ctx);
+        fd_ctx->owner = index;
+        if(index >= 0) {
+            m_reactorLoad[index].fetch_add(1, std::memory_order_relaxed);
+        } else if(index == OWNER_PENDING) {
+            m_unowned.fetch_add(1, std::memory_order_relaxed);
+        }
+        updateEvents(fd_ctx, NONE, events);
+        return true;
+    }
+    bool persistent = m_engine == ENGINE_EPOLL_ET;
+    if(persistent ? fd_ctx->registered: fd_ctx->events != NONE) {
+        int from = epfdOf(fd_ctx);
+        int to = index >= 0 ? reactorFd(index): m_epfd;
+        epoll_event epevent;
+        epevent.events = persistent ? EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET: EPOLLET | (uint32_t)fd_ctx->events;
+        epevent.data.ptr = fd_ctx;
+        // 先加到新的epoll再从旧的删除，中间就绪的事件两边都可能收到，idle 中按 fd_ctx->events 过滤掉重复的
+        if(epoll_ctl(to, EPOLL_CTL_ADD, fd_ctx->fd, &epevent)) {
+            SYLAR_LOG_ERROR() << "moveFd::epoll_ctl failed: " << strerror(errno);
+            return false;
+        }
+        epoll_ctl(from, EPOLL_CTL_DEL, fd_ctx->fd, &epevent);
+    }
+    releaseOwner(fd_ctx);
+    fd_ctx->owner = index;
+    if(index >= 0) {
+        m_reactorLoad[index].fetch_add(1, std::memory_order_relaxed);
+    } else if(index == OWNER_PENDING) {
+        m_unowned.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void IOManager::handOffAll(int from) {
+    size_t slots = getWorkerSlots();
+    std::vector<int> targets;
+    for(size_t i = 0; i < slots; ++i) {
+        if((int)i != from && isWorkerRunning(i)) {
+            targets.push_back(i);
+        }
+    }
+    if(targets.empty()) {
+        // 没有其他线程可以接手：要退出的线程把fd放回 m_epfd，等有线程运行时再领走
+        if(from == OWNER_PENDING) {
+            return;
+        }
+        targets.push_back(OWNER_PENDING);
+    }
+
+    size_t next = 0;
+    // 只遍历已经分配的块；遍历期间才分配的块留给下一轮 idle
+    for(size_t c = 0; c < FD_MAX_CHUNKS; ++c) {
+        FdContext* chunk = m_fdChunks[c].load(std::memory_order_acquire);
+        if(!chunk) {
+            continue;
+        }
+        for(size_t i = 0; i < FD_CHUNK_SIZE; ++i) {
+            FdContext* fd_ctx = &chunk[i];
+            std::lock_guard<FdLock> lock(fd_ctx->mutex);
+            // 没有注册事件的fd也一起转移，之后的 addEvent 不会再落到要退出的线程上
+            if(fd_ctx->owner != from) {
+                continue;
+            }
+            int to = targets[next++ % targets.size()];
+            if(m_reactorMode == REACTOR_LEAST_LOADED && to >= 0) {
+                for(int t: targets) {
+                    if(m_reactorLoad[t].load(std::memory_order_relaxed) < m_reactorLoad[to].load(std::memory_order_relaxed)) {
+                        to = t;
+                    }
+                }
+            }
+            moveLocked(fd_ctx, to);
+        }
+    }
+}
+
+// io_uring 提交项的 user_data：低3位是用途，高16位是 POLL_ADD 时的 EventContext::seq，中间是对象地址
+static const uint64_t UD_READ = 1;
+static const uint64_t UD_WRITE = 2;
+static const uint64_t UD_OP = 3;
+static const uint64_t UD_TIMEOUT = 4;
+static const uint64_t UD_TAG_MASK = 0x7;
+static const uint64_t UD_PTR_MASK = ((1ull << 48) - 1) & ~UD_TAG_MASK;
+
+static uint64_t make_udata(void* ptr, uint64_t tag, uint16_t seq = 0) {
+    assert(((uint64_t)ptr & ~UD_PTR_MASK) == 0);
+    return (uint64_t)ptr | tag | ((uint64_t)seq << 48);
+}
+
+struct IOManager::UringOp {
+    uint8_t opcode = 0;
+    int fd = -1;
+    uint64_t addr = 0;
+    uint64_t addr2 = 0;
+    uint32_t len = 0;
+    uint32_t flags = 0;
+
+    // 完成后恢复的协程和线程
+    Fiber::ptr fiber;
+    int thread = -1;
+    int index = -1;
+    int64_t res = 0;
+    // 还要收到的完成事件数：带超时时操作本身和 LINK_TIMEOUT 各一个，都收到之后才能恢复协程
+    int remaining = 1;
+    bool timed_out = false;
+    __kernel_timespec ts;
+};
+
+int IOManager::updateEvents(FdContext* fd_ctx, Event old_events, Event new_events) {
+    if(m_engine == ENGINE_EPOLL_ET) {
+        // 只在第一次注册事件时加入epoll，之后增删事件只改用户态的状态
+        if(fd_ctx->registered || !(new_events & ~old_events)) {
+            return 0;
+        }
+        epoll_event epevent;
+        epevent.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        epevent.data.ptr = fd_ctx;
+        int rt = epoll_ctl(epfdOf(fd_ctx), EPOLL_CTL_ADD, fd_ctx->fd, &epevent);
+        // 没有经过 cancelAll 就关闭、复用的fd号可能还留着注册
+        if(rt && errno == EEXIST) {
+            rt = epoll_ctl(epfdOf(fd_ctx), EPOLL_CTL_MOD, fd_ctx->fd, &epevent);
+        }
+        if(!rt) {
+            fd_ctx->registered = true;
+        }
+        return rt;
+    }
+    if(!usesUring()) {
+        // 还没有事件 -> ADD，事件全部删除 -> DEL，其余 MOD
+        int op = !old_events ? EPOLL_CTL_ADD: (new_events ? EPOLL_CTL_MOD: EPOLL_CTL_DEL);
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+        return epoll_ctl(epfdOf(fd_ctx), op, fd_ctx->fd, &epevent);
+    }
+
+    // 还没有线程在运行：先不提交，分给线程时再提交
+    if(fd_ctx->owner < 0) {
+        return 0;
+    }
+    int add = new_events & ~old_events;
+    int del = old_events & ~new_events;
+    unsigned n = !!(add & READ) + !!(add & WRITE) + !!(del & READ) + !!(del & WRITE);
+    if(!n) {
+        return 0;
+    }
+    // 所属线程自己注册的留到它下一次等待时一起提交；别的线程注册的立即提交，它正在等待时会被完成事件叫醒
+    bool now = fd_ctx->owner != getCurrentWorkerIndex();
+    ringOf(fd_ctx->owner)->submit(n, [&](io_uring_sqe** sqes) {
+        unsigned i = 0;
+        for(Event e: {READ, WRITE}) {
+            FdContext::EventContext& ctx = fd_ctx->getEventContext(e);
+            uint64_t tag = e == READ ? UD_READ: UD_WRITE;
+            if(del & e) {
+                sqes[i]->opcode = IORING_OP_POLL_REMOVE;
+                sqes[i]->fd = -1;
+                sqes[i]->addr = make_udata(fd_ctx, tag, ctx.seq);
+                ++i;
+            }
+            if(add & e) {
+                // POLL_ADD 是一次性的，与 epoll 下事件触发后即删除的语义一致
+                sqes[i]->opcode = IORING_OP_POLL_ADD;
+                sqes[i]->fd = fd_ctx->fd;
+                sqes[i]->poll32_events = e == READ ? POLLIN: POLLOUT;
+                sqes[i]->user_data = make_udata(fd_ctx, tag, ++ctx.seq);
+                ++i;
+            }
+        }
+    }, now);
+    return 0;
+}
+
+void IOManager::unregisterFd(FdContext* fd_ctx) {
+    if(fd_ctx->registered) {
+        epoll_event epevent;
+        epevent.events = 0;
+        epevent.data.ptr = fd_ctx;
+        // fd可能已经被关闭（关闭时内核已经自动移除），失败不影响
+        epoll_ctl(epfdOf(fd_ctx), EPOLL_CTL_DEL, fd_ctx->fd, &epevent);
+        fd_ctx->registered = false;
+    }
+    fd_ctx->ready = NONE;
+    // 清掉所有标记；计数照常加一，之前取到的值不能再用来标记
+    fd_ctx->bumpReadiness(FdContext::READINESS_SEQ - 1);
+}
+
+Uring* IOManager::ringOf(size_t index) {
+    Uring* ring = m_rings[index].load(std::memory_order_acquire);
+    if(ring) {
+        return ring;
+    }
+    std::lock_guard<std::mutex> lock(m_reactorMutex);
+    ring = m_rings[index].load(std::memory_order_relaxed);
+    if(!ring) {
+        ring = new Uring();
+        assert(ring->valid());
+        m_rings[index].store(ring, std::memory_order_release);
+    }
+    return ring;
+}
+
+void IOManager::reapRing(Uring* ring, Scheduler::Batch& batch) {
+    ring->reap([&](const io_uring_cqe& cqe) {
+        uint64_t tag = cqe.user_data & UD_TAG_MASK;
+        void* ptr = (void*)(cqe.user_data & UD_PTR_MASK);
+        // POLL_REMOVE、ASYNC_CANCEL 自己的完成事件
+        if(!ptr) {
+            return;
+        }
+
+        if(tag == UD_OP || tag == UD_TIMEOUT) {
+            UringOp* op = (UringOp*)ptr;
+            if(tag == UD_OP) {
+                op->res = cqe.res;
+            } else if(cqe.res == -ETIME) {
+                op->timed_out = true;
+            }
+            if(--op->remaining == 0) {
+                // 协程恢复后 op 随它的栈一起失效，之后不能再访问
+                int index = op->index;
+                batch.add(&op->fiber, op->thread);
+                m_ringOps[index].fetch_sub(1, std::memory_order_relaxed);
+                --m_pendingEventCount;
+            }
+            return;
+        }
+
+        FdContext* fd_ctx = (FdContext*)ptr;
+        Event event = tag == UD_READ ? READ: WRITE;
+        std::lock_guard<FdLock> lock(fd_ctx->mutex);
+        // 已经删除、取消或者转移到别的 ring 的旧提交
+        if(!(fd_ctx->events & event) || fd_ctx->getEventContext(event).seq != (uint16_t)(cqe.user_data >> 48)) {
+            return;
+        }
+        // 就绪、出错、挂断以及提交本身失败都当作事件发生，由等待方重新调用得到结果
+        triggerEvent(fd_ctx, event, &batch, ownerThread(fd_ctx, event));
+        --m_pendingEventCount;
+    });
+}
+
+bool IOManager::canSubmitIo() {
+    if(m_engine != ENGINE_URING || Scheduler::GetThis() != this || !Fiber::CanSuspend()) {
+        return false;
+    }
+    if(Fiber::Current()->isSharedStack()) {
+        return false;
+    }
+    int index = getCurrentWorkerIndex();
+    return index >= 0 && isWorkerRunning(index);
+}
+
+int64_t IOManager::submitOp(UringOp& op, uint64_t timeout_ms) {
+    FdContext* fd_ctx = getContext(op.fd, true);
+    if(!fd_ctx) {
+        return -EBADF;
+    }
+    {
+        std::lock_guard<FdLock> lock(fd_ctx->mutex);
+        ++fd_ctx->uring_ops;
+    }
+
+    bool timed = timeout_ms != ~0ull;
+    op.fiber = Fiber::GetThis();
+    op.thread = Thread::GetThreadId();
+    op.index = getCurrentWorkerIndex();
+    op.remaining = timed ? 2: 1;
+    if(timed) {
+        op.ts.tv_sec = timeout_ms / 1000;
+        op.ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    }
+    ++m_pendingEventCount;
+    m_ringOps[op.index].fetch_add(1, std::memory_order_relaxed);
+
+    // 留到本线程下一次等待时和其他提交一起交给内核
+    ringOf(op.index)->submit(timed ? 2: 1, [&](io_uring_sqe** sqes) {
+        sqes[0]->opcode = op.opcode;
+        sqes[0]->fd = op.fd;
+        sqes[0]->addr = op.addr;
+        sqes[0]->addr2 = op.addr2;
+        sqes[0]->len = op.len;
+        sqes[0]->msg_flags = op.flags;
+        sqes[0]->user_data = make_udata(&op, UD_OP);
+        if(timed) {
+            // 超时由内核处理：到期时取消前一个操作
+            sqes[0]->flags |= IOSQE_IO_LINK;
+            sqes[1]->opcode = IORING_OP_LINK_TIMEOUT;
+            sqes[1]->fd = -1;
+            sqes[1]->addr = (uint64_t)&op.ts;
+            sqes[1]->len = 1;
+            sqes[1]->user_data = make_udata(&op, UD_TIMEOUT);
+        }
+    }, false);
+    Fiber::SetWaitReason(Fiber::WAIT_IO, (uint32_t)op.fd);
+    Fiber::Current()->yield();
+
+    {
+        std::lock_guard<FdLock> lock(fd_ctx->mutex);
+        --fd_ctx->uring_ops;
+    }
+    if(op.res == -ECANCELED) {
+        return op.timed_out ? -ETIMEDOUT: -EBADF;
+    }
+    return op.res;
+}
+
+static ssize_t uring_result(int64_t res) {
+    if(res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+ssize_t IOManager::uringRecv(int fd, void* buf, size_t len, int flags, uint64_t timeout_ms) {
+    UringOp op;
+    op.opcode = IORING_OP_RECV;
+    op.fd = fd;
+    op.addr = (uint64_t)buf;
+    op.len = len;
+    op.flags = flags;
+    return uring_result(submitOp(op, timeout_ms));
+}
+
+ssize_t IOManager::uringSend(int fd, const void* buf, size_t len, int flags, uint64_t timeout_ms) {
+    UringOp op;
+    op.opcode = IORING_OP_SEND;
+    op.fd = fd;
+    op.addr = (uint64_t)buf;
+    op.len = len;
+    op.flags = flags;
+    return uring_result(submitOp(op, timeout_ms));
+}
+
+int IOManager::uringAccept(int fd, sockaddr* addr, socklen_t* addrlen, int flags, uint64_t timeout_ms) {
+    UringOp op;
+    op.opcode = IORING_OP_ACCEPT;
+    op.fd = fd;
+    op.addr = (uint64_t)addr;
+    op.addr2 = (uint64_t)addrlen;
+    // accept_flags 与 msg_flags 在同一个位置
+    op.flags = flags;
+    return uring_result(submitOp(op, timeout_ms));
+}
+
+void IOManager::prepareSocket(int fd) {
+    if(!m_busyPoll.socket_busy_poll_us) {
+        return;
+    }
+    int us = m_busyPoll.socket_busy_poll_us;
+    int rt = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+    if(!rt && m_busyPoll.prefer_busy_poll) {
+        int yes = 1;
+        rt = setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &yes, sizeof(yes));
+    }
+    if(rt && !m_busyPollWarned.exchange(true, std::memory_order_relaxed)) {
+        SYLAR_LOG_ERROR() << "IOManager::prepareSocket setsockopt failed: " << strerror(errno);
+    }
+}
+
+int IOManager::addAcceptor(const sockaddr* addr, socklen_t addrlen, std::function<void(int)> cb,
+                           AcceptMode mode, size_t batch, int backlog) {
+    if(!addr || addrlen > sizeof(sockaddr_storage) || !cb) {
+        return -1;
+    }
+    if(mode == ACCEPT_EXCLUSIVE && (m_reactorMode == REACTOR_SHARED || usesUring())) {
+        mode = ACCEPT_SHARED;
+    } else if(mode == ACCEPT_REUSEPORT && !perWorker()) {
+        mode = ACCEPT_SHARED;
+    }
+
+    std::unique_ptr<Acceptor> acc(new Acceptor);
+    acc->mode = mode;
+    memcpy(&acc->addr, addr, addrlen);
+    acc->addrlen = addrlen;
+    acc->backlog = backlog;
+    acc->batch = batch ? batch: 1;
+    acc->cb = std::move(cb);
+
+    std::lock_guard<std::mutex> lock(m_acceptorMutex);
+    Acceptor* a = acc.get();
+    if(mode != ACCEPT_REUSEPORT) {
+        a->fds[0] = openListener(a);
+        if(a->fds[0] < 0) {
+            return -1;
+        }
+    }
+    if(mode == ACCEPT_SHARED) {
+        int fd = a->fds[0];
+        addEvent(fd, READ, [this, a, fd]() {
+            onAcceptable(a, fd);
+        });
+    } else {
+        if(mode == ACCEPT_EXCLUSIVE) {
+            // 注册不经过 addEvent，单独计数，让 stop() 等到 delAcceptor
+            ++m_pendingEventCount;
+        }
+        for(size_t i = 0; i < getWorkerSlots(); ++i) {
+            if(isWorkerRunning(i)) {
+                armAcceptor(a, i);
+            }
+        }
+        if(mode == ACCEPT_REUSEPORT && a->fds[0] < 0) {
+            // 还没有工作线程在运行：先开一个监听socket，按 ReactorMode 分配，之后进入 idle 的线程再各自补上
+            armAcceptor(a, 0);
+        }
+    }
+    a->id = m_acceptors.size();
+    m_acceptors.push_back(std::move(acc));
+    // 之后开始运行的工作线程在 idle 中补上
+    m_acceptorGen.fetch_add(1, std::memory_order_release);
+    return a->id;
+}
+
+bool IOManager::delAcceptor(int id) {
+    std::lock_guard<std::mutex> lock(m_acceptorMutex);
+    if(id < 0 || (size_t)id >= m_acceptors.size() || m_acceptors[id]->closed) {
+        return false;
+    }
+    Acceptor* acc = m_acceptors[id].get();
+    acc->closed = true;
+    for(size_t i = 0; i < MAX_WORKERS; ++i) {
+        if(acc->registered[i]) {
+            epoll_ctl(reactorFd(i), EPOLL_CTL_DEL, acc->fds[0], nullptr);
+            acc->registered[i] = false;
+        }
+    }
+    if(acc->mode == ACCEPT_EXCLUSIVE) {
+        --m_pendingEventCount;
+    }
+    for(int fd: acc->fds) {
+        if(fd < 0) {
+            continue;
+        }
+        // 正在执行的 onAcceptable 看到 closed 后不会再注册；
+        // 监听socket留到析构时才关闭，免得fd号被复用后还有线程拿着旧的fd号accept
+        delEvent(fd, READ);
+        shutdown(fd, SHUT_RDWR);
+    }
+    return true;
+}
+
+bool IOManager::getAcceptorAddress(int id, sockaddr_storage& addr, socklen_t& addrlen) {
+    std::lock_guard<std::mutex> lock(m_acceptorMutex);
+    if(id < 0 || (size_t)id >= m_acceptors.size() || m_acceptors[id]->closed) {
+        return false;
+    }
+    for(int fd: m_acceptors[id]->fds) {
+        if(fd >= 0) {
+            addrlen = sizeof(addr);
+            return getsockname(fd, (sockaddr*)&addr, &addrlen) == 0;
+        }
+    }
+    return false;
+}
+
+int IOManager::openListener(Acceptor* acc) {
+    int fd = socket(acc->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        SYLAR_LOG_ERROR() << "addAcceptor::socket failed: " << strerror(errno);
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    // accept 得到的连接继承监听socket的忙等设置
+    prepareSocket(fd);
+    if(acc->mode == ACCEPT_REUSEPORT) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+    }
+    if(bind(fd, (sockaddr*)&acc->addr, acc->addrlen) || listen(fd, acc->backlog)) {
+        SYLAR_LOG_ERROR() << "addAcceptor::bind/listen failed: " << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    if(acc->mode == ACCEPT_REUSEPORT) {
+        // 端口为0时第一个socket由内核分配端口，其余的绑定到同一个端口上
+        socklen_t len = acc->addrlen;
+        getsockname(fd, (sockaddr*)&acc->addr, &len);
+    }
+    return fd;
+}
+
+void IOManager::armAcceptor(Acceptor* acc, size_t index) {
+    if(acc->mode == ACCEPT_EXCLUSIVE) {
+        if(acc->registered[index]) {
+            return;
+        }
+        // 水平触发：一批没有accept完时下一次 epoll_wait 还会报告
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = (void*)((uintptr_t)acc | ACCEPTOR_TAG);
+        if(epoll_ctl(reactorFd(index), EPOLL_CTL_ADD, acc->fds[0], &event)) {
+            SYLAR_LOG_ERROR() << "addAcceptor::epoll_ctl failed: " << strerror(errno);
+            return;
+        }
+        acc->registered[index] = true;
+    } else if(acc->mode == ACCEPT_REUSEPORT) {
+        int fd = acc->fds[index];
+        if(fd < 0) {
+            fd = openListener(acc);
+            if(fd < 0) {
+                return;
+            }
+            acc->fds[index] = fd;
+            addEvent(fd, READ, [this, acc, fd]() {
+                onAcceptable(acc, fd);
+            });
+        }
+        // 之前绑定这个下标的线程退出时监听socket被交给了别的线程，现在收回来
+        if(isWorkerRunning(index)) {
+            moveFd(fd, index);
+        }
+    }
+}
+
+void IOManager::syncAcceptors(size_t index) {
+    std::lock_guard<std::mutex> lock(m_acceptorMutex);
+    m_acceptorSeen[index] = m_acceptorGen.load(std::memory_order_relaxed);
+    for(auto& acc: m_acceptors) {
+        if(!acc->closed) {
+            armAcceptor(acc.get(), index);
+        }
+    }
+}
+
+bool IOManager::acceptBatch(Acceptor* acc, int fd, Scheduler::Batch& batch) {
+    int index = getCurrentWorkerIndex();
+    // 共享模式下连接按 ReactorMode 分配，回调不固定线程
+    bool local = acc->mode != ACCEPT_SHARED && index >= 0;
+    size_t n = 0;
+    bool drained = false;
+    for(; n < acc->batch && !acc->closed.load(std::memory_order_relaxed); ) {
+        // 原始的 accept4：hook 版会把 SOCK_NONBLOCK 记成用户设置的非阻塞
+        int conn = accept4_f(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(conn < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // delAcceptor 之后监听socket已经 shutdown，accept4 返回 EINVAL
+            if(errno != EAGAIN && errno != EWOULDBLOCK && !acc->closed.load(std::memory_order_relaxed)) {
+                SYLAR_LOG_ERROR() << "acceptBatch::accept4 failed: " << strerror(errno);
+            }
+            drained = true;
+            break;
+        }
+        // 和 hook 的 accept 一样登记到 FdManager：已经是非阻塞的流式socket，不需要再探测
+        FdMgr::GetInstance()->addSocket(conn, true);
+        if(local && perWorker()) {
+            moveFd(conn, index);
+        }
+        batch.add([acc, conn]() {
+            acc->cb(conn);
+        }, local ? Thread::GetThreadId(): -1);
+        ++n;
+    }
+    if(index >= 0 && n) {
+        m_acceptCount[index].add(n);
+    }
+    return drained || acc->closed.load(std::memory_order_relaxed);
+}
+
+void IOManager::onAcceptable(Acceptor* acc, int fd) {
+    {
+        Scheduler::Batch batch(this);
+        if(!acceptBatch(acc, fd, batch)) {
+            // 一批用完了还有连接：排到队尾接着accept，先让其他任务执行。
+            // 不重新注册读事件，ENGINE_EPOLL_ET 下没有新连接就不会再有通知
+            batch.add([this, acc, fd]() {
+                onAcceptable(acc, fd);
+            }, acc->mode == ACCEPT_REUSEPORT ? Thread::GetThreadId(): -1);
+            return;
+        }
+    }
+    if(acc->closed) {
+        return;
+    }
+    addEvent(fd, READ, [this, acc, fd]() {
+        onAcceptable(acc, fd);
+    });
+    // 与 delAcceptor 并发：它可能在上面的检查之后、注册之前删除了事件
+    if(acc->closed) {
+        delEvent(fd, READ);
     }
 }
 
 // 当一个定时器被插入到定时器队列的最前面时，通知（唤醒）IOManager 的 epoll 线程，重新评估等待时间。
 // onTimerInsertedAtFront() 是一个钩子，用于在插入最早定时器时立即唤醒 epoll，使得定时器精确触发。
-void IOManager::onTimerInsertedAtFront() {
+void IOManager::onTimerInsertedAtFront(size_t shard) {
     // 唤醒可能被阻塞的 epoll_wait 调用
-    tickle();
+    size_t n = getTimerShards();
+    if(n == 1) {
+        tickle();
+        return;
+    }
+    // 插入自己负责的分片时不需要唤醒：本线程正在运行，回到 idle 时会重新计算等待时间
+    int self = getCurrentWorkerIndex();
+    if(self >= 0 && (size_t)self % n == shard && isWorkerRunning(self)) {
+        return;
+    }
+    // 分片的所属线程已经退出时由所有线程代管，唤醒任意一个
+    if(isWorkerRunning(shard)) {
+        tickleWorker(shard);
+    } else {
+        tickle();
+    }
+}
+
+bool IOManager::servesTimerShard(int slot, size_t shard) const {
+    size_t n = getTimerShards();
+    return n == 1 || slot < 0 || (size_t)slot % n == shard || !isWorkerRunning(shard);
+}
+
+uint64_t IOManager::timerWaitUs(int slot) {
+    uint64_t next = ~0ull;
+    for(size_t i = 0, n = getTimerShards(); i < n; ++i) {
+        if(servesTimerShard(slot, i)) {
+            next = std::min(next, getNextTimerUs(i));
+        }
+    }
+    return next;
+}
+
+void IOManager::collectTimers(int slot, std::vector<Callback>& cbs, std::vector<int>& priorities) {
+    for(size_t i = 0, n = getTimerShards(); i < n; ++i) {
+        if(servesTimerShard(slot, i)) {
+            listExpiredCb(cbs, &priorities, i);
+        }
+    }
+}
+
+bool IOManager::timersTickled(int slot) const {
+    for(size_t i = 0, n = getTimerShards(); i < n; ++i) {
+        if(servesTimerShard(slot, i) && isTimerTickled(i)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 }
\ No newline at end of file
@@ -4,7 +4,12 @@
 #include "scheduler.h"
 #include "timer.h"
 
+#include <sys/socket.h>
+
 namespace sylar {
+
+class Uring;
+
 // work flow
 // 1 register one event -> 2 wait for it to ready -> 3 schedule the callback -> 4 unregister the event -> 5 run the callback
 // 1 注册事件 -> 2 等待事件 -> 3 事件触发调度回调 -> 4 注销事件回调后从epoll注销 -> 5 执行回调进入调度器中执行调度。
@@ -28,63 +33,241 @@ public:
         WRITE = 0x4
     };
 
+    // 多reactor模式：REACTOR_SHARED 时所有工作线程共用一个epoll；其余模式每个工作线程一个epoll，
+    // fd第一次 addEvent 时按策略分给一个工作线程（此后一直归它，直到 cancelAll，即hook的close），
+    // 它的就绪事件只由该线程等待，触发的回调/协程也固定在该线程上执行，不同线程之间不再争用同一个fd的锁
+    enum ReactorMode {
+        REACTOR_SHARED = 0,
+        // 轮流分配
+        REACTOR_ROUND_ROBIN,
+        // 分给当前拥有fd最少的线程
+        REACTOR_LEAST_LOADED,
+        // 按fd号散列，同一个fd号总是落在同一个线程上（该线程不在运行时退回轮流分配）
+        REACTOR_HASH
+    };
+
+    // IO引擎，只能在构造时指定：
+    // ENGINE_URING_POLL 用 io_uring 的 POLL_ADD 代替 epoll 等待就绪，注册、取消和等待都在所属线程下一次进入 idle 时
+    // 合并成一次 io_uring_enter；ENGINE_URING 在此基础上把 hook 的 socket recv/send/accept 直接提交给内核，
+    // 完成后恢复协程，省掉"先调用返回EAGAIN、等就绪、再调用"的两次系统调用。
+    // io_uring 引擎总是每个工作线程一个 ring，fd按 ReactorMode 分配（REACTOR_SHARED 时分给第一次注册它的线程，
+    // 回调不固定线程）。内核不支持时退回 ENGINE_EPOLL。
+    // ENGINE_EPOLL_ET 仍然使用 epoll，但fd第一次 addEvent 时以 EPOLLIN|EPOLLOUT|EPOLLET 注册一次，直到 cancelAll
+    // （hook的close）才注销：事件触发、delEvent 都不再调用 epoll_ctl，没有等待者时的就绪记在 FdContext::ready 里，
+    // 下一次 addEvent 发现已经就绪时立即触发。长连接上每个请求省掉一次 MOD/DEL 和一次 ADD；
+    // 代价是发送缓冲区每次腾出空间都会产生一次 EPOLLOUT 通知，并且fd必须经由 hook 的 close 或 cancelAll 关闭
+    enum IoEngine {
+        ENGINE_EPOLL = 0,
+        ENGINE_URING_POLL,
+        ENGINE_URING,
+        ENGINE_EPOLL_ET
+    };
+
+    // 低延迟模式，构造时指定，默认全部关闭
+    struct BusyPoll {
+        // 空闲时在 IdlePolicy 的 poll_count 次轮询之后，继续用 timeout 为0的 epoll_wait 轮询这么久（微秒）才阻塞，
+        // 不超过最近一个定时器的到期时间。窗口内到达的事件不经过线程睡眠/唤醒，代价是空闲时占满CPU
+        uint32_t window_us;
+        // 大于0时给 hook 创建的 socket 和接入器的监听socket 设置 SO_BUSY_POLL（微秒，accept 得到的连接继承监听socket的设置），
+        // 阻塞的读在套接字层忙等网卡队列。超过 net.core.busy_read 需要 CAP_NET_ADMIN，失败时只提示一次
+        uint32_t socket_busy_poll_us;
+        // 同时设置 SO_PREFER_BUSY_POLL：忙等期间优先由用户态轮询网卡队列，而不是软中断
+        bool prefer_busy_poll;
+        // epoll 事件缓冲的上限：连续两次 epoll_wait 返回满时缓冲加倍直到该值，长时间用不到四分之一时减半。
+        // 不大于256时固定为256个
+        uint32_t max_events;
+
+        BusyPoll(): window_us(0), socket_busy_poll_us(0), prefer_busy_poll(false), max_events(256) {}
+    };
+
+    // 接入器（addAcceptor）把新连接分给工作线程的方式
+    enum AcceptMode {
+        // 一个监听socket，读事件只注册一次，哪个线程等到就由哪个线程accept
+        ACCEPT_SHARED = 0,
+        // 一个监听socket以 EPOLLEXCLUSIVE 注册到每个工作线程自己的epoll，一次就绪只叫醒其中一个正在等待的线程。
+        // 需要多reactor模式和 epoll 引擎，否则退回 ACCEPT_SHARED（所有线程等同一个epoll时内核本来就只叫醒一个）
+        ACCEPT_EXCLUSIVE,
+        // 每个工作线程一个 SO_REUSEPORT 监听socket，内核按连接散列分给各个socket。
+        // 需要fd按工作线程分配（多reactor模式或 io_uring 引擎），否则退回 ACCEPT_SHARED
+        ACCEPT_REUSEPORT
+    };
+
+    // FdContext::owner 的特殊值
+    enum {
+        OWNER_NONE = -1,
+        OWNER_PENDING = -2
+    };
+
 private:
+    // 每个工作线程一个的 waitEvent 超时堆
+    struct DeadlineHeap;
+
+    // fd 上下文的锁：一个32位的状态字（0 空闲，1 被持有，2 被持有并且可能有线程在等），抢不到时短暂自旋再在 futex 上等待。
+    // 临界区只是改几个字段、最多一次 epoll_ctl，用不着 std::mutex 的40字节
+    class FdLock {
+    public:
+        void lock() {
+            uint32_t expected = 0;
+            if(!m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+                lockSlow();
+            }
+        }
+
+        void unlock() {
+            if(m_state.exchange(0, std::memory_order_release) == 2) {
+                unlockSlow();
+            }
+        }
+
+    private:
+        void lockSlow();
+        void unlockSlow();
+
+    private:
+        std::atomic<uint32_t> m_state{0};
+    };
+
+    // 等待者：带标记的指针，低2位是标记（Fiber 和 EventHandler 至少8字节对齐），0 表示没有等待者
+    enum WaiterTag {
+        // addEvent 不带回调：挂起的协程（持有一个引用），触发后放回本IOManager
+        WAITER_FIBER = 0,
+        // waitEvent：同上，超时、取消时结果通过 Fiber::setWakeResult 交给它
+        WAITER_WAIT = 1,
+        // 带回调，或者要放回其他调度器的协程：堆上的 EventHandler
+        WAITER_HANDLER = 2,
+        WAITER_TAG_MASK = 3
+    };
+    struct EventHandler;
+
     // 用于描述一个文件描述的事件上下文
     // FdContext 结构体用于存储每个文件描述符的事件上下文。每个文件描述符可以有两个事件上下文：read 和 write，分别对应读事件和写事件
-    struct FdContext {
+    // 每个fd一个，在表中按块连续分配，正好一个缓存行：等待者是带标记的指针，常见的协程等待不需要额外分配，
+    // 回调和调度器等不常用的部分放在 EventHandler 里
+    struct alignas(64) FdContext {
         // 描述一个具体事件的上下文，如读事件或写事件 
         struct EventContext {
-            // scheduler
-            // 关联的调度器 用于安排回调的执行 
-            Scheduler* scheduler = nullptr;
-
-            // callback fiber
-            // 协程对象，表示回调函数运行时的上下文。
-            std::shared_ptr<Fiber> fiber;
-
-            // callback function
-            // 关联的回调函数 事件触发时会执行该函数。
-            std::function<void()> cb;
+            // waitEvent 每次注册加一（不随 reset 清零），已经出堆的旧超时、取消据此判断等待是否还是同一次
+            uint32_t wait_id = 0;
+            // 在超时堆中的位置（由堆的锁保护），不在堆中为-1
+            int32_t heap_index = -1;
+            // io_uring 引擎下每次提交 POLL_ADD 加一，用来丢弃已经取消或转移的旧提交的完成事件（不随 reset 清零）
+            uint16_t seq = 0;
+            // 带超时的 waitEvent 登记在哪个工作线程的超时堆里，flags 中有 EVENT_IN_HEAP 时有效
+            uint8_t heap = 0;
+            // 低2位是事件触发后放入调度器时使用的优先级（Scheduler::Priority），以及 EVENT_IN_HEAP
+            uint8_t flags = 0;
+        };
+        enum {
+            EVENT_PRIORITY_MASK = 0x3,
+            EVENT_IN_HEAP = 0x4
         };
 
-        // read event context
+        // 读、写两个方向的等待者（见 WaiterTag）
+        uintptr_t waiters[2] = {0, 0};
+
         // read 和write表示读和写的上下文
-        EventContext read;
+        EventContext contexts[2];
+
+        // 用于保护 FdContext 数据的锁。由于 IOManager 可能在多线程环境中运行，mutex 保证了在并发环境中对文件描述符上下文的安全访问，避免竞态条件
+        FdLock mutex;
 
-        // write event context
-        EventContext write;
         int fd = 0;
 
+        // ENGINE_EPOLL_ET 的就绪缓存（不加锁读写）：低位是调用返回 EAGAIN（或流式socket读写不足）之后还没有来过边沿的方向
+        // 和出过错/挂断的标记（之后不再缓存），其余位是边沿计数，见 getReadiness / markNotReady
+        std::atomic<uint32_t> readiness{0};
+        enum {
+            READINESS_HUP = 0x2,
+            READINESS_SEQ = 0x8
+        };
+        // 来了一个边沿：计数加一，清掉 clear 中的低位，再加上 set
+        void bumpReadiness(uint32_t clear, uint32_t set = 0);
+
+        // io_uring 完成模式下正在进行的操作数，cancelAll 时据此取消
+        int16_t uring_ops = 0;
+
+        // 多reactor模式下所属的工作线程下标，未分配为 OWNER_NONE，
+        // 分配时还没有工作线程在运行为 OWNER_PENDING（暂时注册在 m_epfd 上；io_uring 引擎下暂不提交）
+        int16_t owner = OWNER_NONE;
+
         // events registered
         // 当前注册的事件，表示当前文件描述符上注册的事件类型。它的值可以是 NONE、READ、WRITE 或者 READ | WRITE（组合事件）。这个变量用于标识哪些事件正在被监视和处理。
         Event events = NONE;
 
-        // 用于保护 FdContext 数据的互斥锁。由于 IOManager 可能在多线程环境中运行，mutex 保证了在并发环境中对文件描述符上下文的安全访问，避免竞态条件
-        std::mutex mutex;
+        // ENGINE_EPOLL_ET：没有等待者时发生的就绪，以及是否已经注册到epoll
+        uint8_t ready = 0;
+        bool registered = false;
 
-        // 根据事件类型获取相应的事件上下文（如读事件上下文或写事件上下文）
-        // 根据事件类型获取相应的事件上下文（read 或 write）。这个方法根据传入的 event（如 READ 或 WRITE）返回对应的 EventContext
-        EventContext& getEventContext(Event event);
+        static int Index(Event event) {
+            assert(event == READ || event == WRITE);
+            return event == READ ? 0: 1;
+        }
 
-        // 重置事件上下文
-        // 重置事件上下文的状态。这个方法会将事件上下文中的成员变量（如 scheduler、fiber 和 cb）重置为初始状态，通常在事件完成处理后调用，以准备好下一次事件的注册。
-        void resetEventContext(EventContext& ctx);
+        // 根据事件类型获取相应的事件上下文（read 或 write）
+        EventContext& getEventContext(Event event) {
+            return contexts[Index(event)];
+        }
 
-        // 触发事件
-        // 触发事件，执行与事件相关的回调。调用此方法会根据事件类型（如 READ 或 WRITE）执行相应的回调函数。
-        void triggerEvent(Event event);
+        uintptr_t& getWaiter(Event event) {
+            return waiters[Index(event)];
+        }
     };
+    static_assert(sizeof(FdContext) == 64, "FdContext should fill exactly one cache line");
+
+    // 等待者要放回的调度器，没有等待者时为空
+    Scheduler* waiterScheduler(uintptr_t waiter);
+
+    // 触发事件：从 events 中删除该事件，把等待者（协程或回调）放入它的调度器。调用方持有 fd_ctx->mutex
+    // batch 不为空且事件属于同一个调度器时，任务先加入 batch，由调用方统一提交
+    // thread 不为-1时回调/协程固定到该线程执行（只对属于本IOManager的事件有效）
+    void triggerEvent(FdContext* fd_ctx, Event event, Scheduler::Batch* batch = nullptr, int thread = -1);
+
+    // 丢弃一个方向上的等待者（delEvent），不调度它
+    void resetEvent(FdContext* fd_ctx, Event event);
+
+    // 等待在超时之前结束：从超时堆中删除，清掉优先级等状态
+    void endWait(FdContext::EventContext& ctx);
+
 public:
     // 允许设置线程数量、是否使用调用者线程以及名称。
     // threads线程数量，use_caller是否将主线程或调度线程包含进去，name调度器的名字
     // 定是否使用调用者线程来执行事件处理。默认值为 true，表示在 IOManager 中，调用者线程也会被用于执行 I/O 操作
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "IOManager");
+    // placement为工作线程的CPU亲和性 / NUMA放置（见 Scheduler::Placement）
+    // reactor为多reactor模式（ReactorMode），只能在构造时指定
+    // engine为IO引擎（IoEngine）
+    // busy_poll为低延迟模式（BusyPoll）
+    // timers为定时器的存储方式（TimerManager::Backend）
+    // timer_shards为true时每个工作线程一个定时器分片：工作线程添加的定时器放进自己的分片，由自己到期派发，
+    // idle 只按自己的分片（以及所属线程已退出的分片）计算等待时间，不再和其他线程争用同一把锁；
+    // 其他线程添加的定时器轮流放进各个分片并定向唤醒所属线程。只能在构造时指定
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "IOManager",
+              const Placement& placement = Placement(), ReactorMode reactor = REACTOR_SHARED,
+              IoEngine engine = ENGINE_EPOLL, const BusyPoll& busy_poll = BusyPoll(), Backend timers = TIMER_SET,
+              bool timer_shards = false);
     ~IOManager();
 
     // add one event at a time
     // 事件管理方法
     // 添加一个事件到文件描述符 fd 上，并关联一个回调函数 cb。
-    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    // priority 为事件触发后回调/协程进入调度器时的优先级（Scheduler::Priority）
+    int addEvent(int fd, Event event, Callback cb = nullptr, int priority = PRIORITY_NORMAL);
+
+    // 注册当前协程等待fd上的event并挂起：就绪（或被 cancelEvent/cancelAll 取消）后返回0；
+    // timeout_ms 到期返回 ETIMEDOUT 并设置errno；注册失败返回-1（不挂起）。
+    // 当前协程有取消上下文（见 cancel.h）时超时不超过它的截止时间，到期同样返回 ETIMEDOUT；
+    // 上下文被取消时返回 ECANCELED（已经取消或到期时不挂起）。
+    // 协程恢复时可能已经换了线程，调用方应按返回值区分，不要在挂起前后的同一个函数里读写 errno（编译器可能沿用旧线程的 errno 地址）。
+    // 超时登记在当前工作线程自己的超时堆里，由它在 idle 中检查，不创建 Timer，就绪时也不需要取消定时器
+    int waitEvent(int fd, Event event, uint64_t timeout_ms = ~0ull);
+
+    // ENGINE_EPOLL_ET 的就绪缓存，其他引擎下总是返回0（未知）。
+    // hook 在调用系统调用之前取一次，IsNotReady 为真时说明上次 EAGAIN 之后没有来过边沿，可以不调用直接等待；
+    // 调用返回 EAGAIN（或读写不足）时把取到的值交给 markNotReady，期间来过边沿时不会标记
+    uint32_t getReadiness(int fd);
+    static bool IsNotReady(uint32_t readiness, Event event) {
+        return readiness & event;
+    }
+    void markNotReady(int fd, Event event, uint32_t readiness);
 
     // delete event
     // 删除文件描述符fd上的某个事件
@@ -102,11 +285,65 @@ public:
     // 获取当前的 IOManager 实例
     static IOManager* GetThis();
 
-protected:
-    //通知调度器有任务调度
-    //写pipe让idle协程从epoll_wait退出，待idle协程yield之后Scheduler::run就可以调度其他任务.
-    void tickle() override;
+    ReactorMode getReactorMode() const {
+        return m_reactorMode;
+    }
+
+    // fd所属的工作线程下标，共享模式或尚未分配时返回-1
+    int getFdOwner(int fd);
+
+    // 把fd交给第index个工作线程的reactor：已经注册的事件从原来的epoll移到新的epoll，之后的事件在新线程上处理。
+    // 已经触发、正在排队的回调仍在原来的线程上执行。共享模式、index不是正在运行的工作线程时返回false
+    bool moveFd(int fd, int index);
+
+    IoEngine getEngine() const {
+        return m_engine;
+    }
+
+    const BusyPoll& getBusyPoll() const {
+        return m_busyPoll;
+    }
+
+    // 按 BusyPoll 设置 socket 的忙等选项，没有打开时什么也不做。hook 的 socket() 会调用
+    void prepareSocket(int fd);
+
+    // 当前协程能否使用下面的完成模式接口：ENGINE_URING、在本IOManager正在运行的工作线程的协程中，
+    // 并且不在共享栈上（共享栈的内容挂起后会被换出，内核不能往栈上的缓冲区里写）
+    bool canSubmitIo();
+
+    // 完成模式：把一次 recv/send/accept 提交给 io_uring，当前协程挂起直到完成。返回值与系统调用相同，
+    // 失败返回-1并设置errno；timeout_ms 到期时内核取消该操作，返回 ETIMEDOUT；期间 cancelAll（hook的close）返回 EBADF
+    ssize_t uringRecv(int fd, void* buf, size_t len, int flags, uint64_t timeout_ms = ~0ull);
+    ssize_t uringSend(int fd, const void* buf, size_t len, int flags, uint64_t timeout_ms = ~0ull);
+    int uringAccept(int fd, sockaddr* addr, socklen_t* addrlen, int flags, uint64_t timeout_ms = ~0ull);
 
+    // 第index个工作线程的reactor上的fd数
+    size_t getReactorLoad(size_t index) const {
+        return index < MAX_WORKERS ? m_reactorLoad[index].load(std::memory_order_relaxed): 0;
+    }
+
+    // 在调度器统计之外加上IO事件和定时器的统计
+    Metrics getMetrics() const override;
+
+    // 在addr上监听，接受的连接（非阻塞，已登记到 FdManager，hook 的读写照常可用）交给 cb(fd)，由cb负责关闭。
+    // batch 为每次就绪最多accept的连接数，用完就让出线程，剩下的连接排到后面再处理。
+    // ACCEPT_EXCLUSIVE 和 ACCEPT_REUSEPORT 下连接归accept它的工作线程所有，cb也在该线程上执行。
+    // 返回接入器id，失败返回-1。接入器和注册着的事件一样会让 stop() 一直等待，停止前先 delAcceptor
+    int addAcceptor(const sockaddr* addr, socklen_t addrlen, std::function<void(int)> cb,
+                    AcceptMode mode = ACCEPT_SHARED, size_t batch = 16, int backlog = 1024);
+
+    // 停止监听（监听socket在析构时关闭），已经接受的连接不受影响
+    bool delAcceptor(int id);
+
+    // 接入器实际监听的地址（绑定端口为0时是内核分配的端口），接入器不存在、已经停止或还没有监听socket时返回false
+    bool getAcceptorAddress(int id, sockaddr_storage& addr, socklen_t& addrlen);
+
+    // 第index个工作线程accept的连接数（所有接入器之和），用来检查连接分布是否均衡
+    uint64_t getAcceptCount(size_t index) const {
+        return index < MAX_WORKERS ? m_acceptCount[index].get(): 0;
+    }
+
+protected:
     //判断调度器是否可以停止
     //判断条件是Scheduler::stopping()外加IOManager的m_pendingEventCount为0，表示没有IO事件可调度
     bool stopping() override;
@@ -117,29 +354,162 @@ protected:
     void idle() override;
 
     //因为Timer类的成员函数重写当有新的定时器插入到前面时的处理逻辑
-    void onTimerInsertedAtFront() override;
+    void onTimerInsertedAtFront(size_t shard) override;
+
+    // 工作线程的定时器分片为自己的下标（对分片数取模）
+    int localTimerShard() const override {
+        return getCurrentWorkerIndex();
+    }
 
-    // 调整 IOManager 内部上下文（例如，文件描述符上下文）的大小。这可能用于动态增加或减少事件处理的容量
+    // 预先分配能容纳 [0, size) 这些fd的上下文块。块一旦分配就不再释放或移动（直到析构），所以不会缩小
     void contextResize(size_t size);
 
+    // 取fd对应的上下文：一次原子读定位所在的块，不加锁。块还没分配时 create 为true则分配，否则返回nullptr；
+    // fd 超出表的容量时返回nullptr
+    FdContext* getContext(int fd, bool create);
+
 private:
+    // 一次完成模式的操作，在发起它的协程栈上
+    struct UringOp;
+
+    // addEvent 和 waitEvent 的实现：wait 为true时为 waitEvent 注册（cb 为空），timeout_ms 为它的超时，
+    // wait_id 不为空时回写这次等待的序号。
+    // 成功返回0，失败返回-1；waitEvent 的方向在 ENGINE_EPOLL_ET 下已经就绪过时不注册，返回1
+    int registerEvent(int fd, Event event, Callback cb, int priority, uint64_t timeout_ms, bool wait,
+                      uint32_t* wait_id = nullptr);
+
+    // 以错误码 result 结束第 id 次等待（超时为 ETIMEDOUT，取消上下文为 ECANCELED；已经触发或重新注册过时什么也不做），
+    // 触发的协程加入 batch（为空时直接调度）
+    void expireWait(FdContext* fd_ctx, Event event, uint32_t id, Scheduler::Batch* batch, int result);
+
+    // waitEvent 挂在当前协程取消上下文上的等待，cancel() 时以 ECANCELED 结束它
+    struct CancelWaiter;
+
+    // 处理第index个工作线程超时堆里到期的等待
+    void expireWaits(size_t index, Scheduler::Batch& batch);
+
+    // addAcceptor 创建的接入器，析构时才释放
+    struct Acceptor;
+
+    bool usesUring() const {
+        return m_engine == ENGINE_URING_POLL || m_engine == ENGINE_URING;
+    }
+
+    // fd按工作线程分配（多reactor模式或 io_uring 引擎）
+    bool perWorker() const {
+        return m_reactorMode != REACTOR_SHARED || usesUring();
+    }
+
+    // ENGINE_EPOLL_ET：从epoll注销fd并清除记下的就绪，调用方持有 fd_ctx->mutex
+    void unregisterFd(FdContext* fd_ctx);
+
+    // 把fd上注册的事件从 old_events 改为 new_events：epoll 引擎调用 epoll_ctl，
+    // io_uring 引擎在所属线程的 ring 上提交 POLL_ADD / POLL_REMOVE。调用方持有 fd_ctx->mutex
+    int updateEvents(FdContext* fd_ctx, Event old_events, Event new_events);
+
+    // 第index个工作线程的 ring，第一次使用时创建
+    Uring* ringOf(size_t index);
+
+    // 处理 ring 上的完成事件，触发的回调/协程加入 batch
+    void reapRing(Uring* ring, Scheduler::Batch& batch);
+
+    // 提交一次完成模式的操作并挂起当前协程，返回内核的结果（失败为 -errno）
+    int64_t submitOp(UringOp& op, uint64_t timeout_ms);
+
+    // fd_ctx 当前注册在哪个epoll上，调用方持有 fd_ctx->mutex
+    int epfdOf(FdContext* fd_ctx);
+
+    // 第index个工作线程的epoll，第一次使用时创建（同时创建注册在上面的唤醒eventfd）
+    int reactorFd(size_t index);
+
+    // 按策略给 fd_ctx 分配所属线程，调用方持有 fd_ctx->mutex
+    void assignOwner(FdContext* fd_ctx);
+
+    // 交还 assignOwner 分配的所属线程，调用方持有 fd_ctx->mutex
+    void releaseOwner(FdContext* fd_ctx);
+
+    // fd_ctx 上的 event 触发后回调要固定到的线程id；共享模式或事件不属于本IOManager时为-1
+    int ownerThread(FdContext* fd_ctx, Event event);
+
+    // 要退出的工作线程把它拥有的fd交给其他线程，from为 OWNER_PENDING 时分配暂时没有所属线程的fd
+    void handOffAll(int from);
+
+    // 第slot个工作线程的 idle 负责的定时器分片：自己的分片，以及所属线程不在运行的分片（退出后由其他线程代管）。
+    // 只有一个分片或 slot 为-1时负责全部
+    bool servesTimerShard(int slot, size_t shard) const;
+
+    // 负责的分片中最近一个定时器的间隔（微秒），没有为 ~0ull
+    uint64_t timerWaitUs(int slot);
+
+    // 取出负责的分片中到期的定时器回调
+    void collectTimers(int slot, std::vector<Callback>& cbs, std::vector<int>& priorities);
+
+    // 上次 timerWaitUs 之后负责的分片里是否插入过更早的定时器（阻塞前检查，与插入方的唤醒配对）
+    bool timersTickled(int slot) const;
+
+    // 把 fd_ctx 从原来的epoll移到第index个线程的epoll（index为 OWNER_PENDING 时移到 m_epfd），调用方持有 fd_ctx->mutex
+    bool moveLocked(FdContext* fd_ctx, int index);
+
+    // 按 acc 的地址创建并开始监听一个非阻塞socket，失败返回-1
+    int openListener(Acceptor* acc);
+
+    // 让第index个工作线程开始为 acc 接受连接：ACCEPT_EXCLUSIVE 注册到它的epoll，
+    // ACCEPT_REUSEPORT 给它一个自己的监听socket。调用方持有 m_acceptorMutex
+    void armAcceptor(Acceptor* acc, size_t index);
+
+    // 第index个工作线程补上它还没有参与的接入器（新加入或复用了已退出线程下标的线程）
+    void syncAcceptors(size_t index);
+
+    // 从监听socket上最多accept acc->batch 个连接，cb 加入 batch；返回false表示还有没接受完的连接
+    bool acceptBatch(Acceptor* acc, int fd, Scheduler::Batch& batch);
+
+    // ACCEPT_SHARED / ACCEPT_REUSEPORT 监听socket读事件的回调：accept 一批，然后重新等待
+    void onAcceptable(Acceptor* acc, int fd);
+
+private:
+    ReactorMode m_reactorMode;
+    // 各工作线程的epoll（-1表示还没有创建）和拥有的fd数
+    std::atomic<int> m_reactorFds[MAX_WORKERS];
+    // 各工作线程epoll上的唤醒eventfd，阻塞等待时由 Scheduler::tickle() 写入唤醒该线程，与epoll一起创建、一起关闭
+    std::atomic<int> m_wakeFds[MAX_WORKERS];
+    std::atomic<size_t> m_reactorLoad[MAX_WORKERS];
+    std::atomic<size_t> m_reactorSeq = {0};
+    // 还没有工作线程在运行时注册的fd暂时放在 m_epfd 上，由第一个进入 idle 的工作线程领走
+    std::atomic<size_t> m_unowned = {0};
+    std::mutex m_reactorMutex;
+
+    IoEngine m_engine;
+    BusyPoll m_busyPoll;
+    std::atomic<bool> m_busyPollWarned = {false};
+    std::atomic<Uring*> m_rings[MAX_WORKERS];
+    // 各 ring 上还没有完成的操作数，不为0时所属线程不能退出
+    std::atomic<size_t> m_ringOps[MAX_WORKERS];
+
+    std::mutex m_acceptorMutex;
+    std::vector<std::unique_ptr<Acceptor>> m_acceptors;
+    // 接入器每次增加时加一；m_acceptorSeen[i] 是第i个工作线程同步到的值，只由该线程访问
+    std::atomic<uint32_t> m_acceptorGen = {0};
+    uint32_t m_acceptorSeen[MAX_WORKERS] = {};
+    Counter m_acceptCount[MAX_WORKERS];
+
+    // 各工作线程的 waitEvent 超时堆，下标同工作线程
+    std::unique_ptr<DeadlineHeap[]> m_deadlines;
+
     //用于epoll的文件描述符。
     // fd[0] read，fd[1] write
     int m_epfd = 0;
 
-    //用于线程间通信的管道文件描述符，fd[0] 是读端，fd[1] 是写端。
-    int m_tickleFds[2];
-
     //原子计数器，用于记录待处理的事件数量。使用atomic的好处是这个变量再进行加或-都是不会被多线程影响
     // 原子变量，表示当前挂起的事件数量。使用 atomic 类型确保在多线程环境下的并发访问不会出现问题。
     std::atomic<size_t> m_pendingEventCount = {0};
 
-    // 读写锁
-    std::shared_mutex m_mutex;
-
     // store fdcontexts for each fd
-    //文件描述符上下文数组，用于存储每个文件描述符的 FdContext。
-    std::vector<FdContext*> m_fdContexts;
+    // 文件描述符上下文表，两级：顶层是固定长度的原子指针数组，每一项指向连续分配的 FD_CHUNK_SIZE 个 FdContext。
+    // 查找是一次原子读加下标运算；扩容只是用CAS发布一个新块，已有的块不动，查找方不需要任何锁
+    static const size_t FD_CHUNK_SHIFT = 9;
+    static const size_t FD_CHUNK_SIZE = (size_t)1 << FD_CHUNK_SHIFT;
+    static const size_t FD_MAX_CHUNKS = 8192;   // 最多 4M 个fd
+    std::unique_ptr<std::atomic<FdContext*>[]> m_fdChunks;
 };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,318 @@
+#include "log.h"
+#include "fiber.h"
+#include "thread.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace sylar {
+
+namespace detail {
+std::atomic<int> g_log_level{LOG_INFO};
+}
+
+namespace {
+
+// 一个线程的日志缓冲区：所属线程写，后台线程（或 Flush() 的调用者，持有 LogState::mutex）读
+struct LogRing {
+    char* data;
+    uint64_t mask;
+    // 写入位置和读取位置都只增不减，写完一整行后 release 发布
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    // 所属线程已经退出，读空后释放
+    std::atomic<bool> dead{false};
+};
+
+struct LogState {
+    // 保护 rings，同时保证同一时刻只有一个读者
+    std::mutex mutex;
+    std::vector<LogRing*> rings;
+    std::atomic<int> fd{STDERR_FILENO};
+    std::atomic<size_t> ring_size{64 * 1024};
+    std::atomic<uint64_t> sync_writes{0};
+
+    // 后台线程
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool wake_pending = false;
+    std::once_flag start_once;
+    std::thread flusher;
+    std::atomic<bool> running{false};
+    // 进程退出时置位，之后的日志直接写出
+    std::atomic<bool> shutdown{false};
+};
+
+LogState& State() {
+    // 不析构：其他全局对象析构时可能还要写日志
+    static LogState* s = new LogState;
+    return *s;
+}
+
+const char* level_name(LogLevel level) {
+    switch(level) {
+        case LOG_DEBUG: return "DEBUG";
+        case LOG_INFO: return "INFO";
+        case LOG_WARN: return "WARN";
+        case LOG_ERROR: return "ERROR";
+        default: return "OFF";
+    }
+}
+
+// 不经过 hook（工作线程上 write 被 hook 接管），也不拿任何锁
+void write_all(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t n = syscall(SYS_write, fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// 线程退出时把缓冲区交给后台线程回收
+struct RingHolder {
+    LogRing* ring = nullptr;
+    ~RingHolder();
+};
+
+thread_local RingHolder t_holder;
+// 线程已经开始析构 thread_local 对象，之后的日志直接写出
+thread_local bool t_exiting = false;
+thread_local pid_t t_tid = 0;
+
+RingHolder::~RingHolder() {
+    t_exiting = true;
+    if(ring) {
+        ring->dead.store(true, std::memory_order_release);
+        ring = nullptr;
+    }
+}
+
+// 取出一个缓冲区里的全部日志写到 fd，调用者持有 LogState::mutex
+void drain(LogRing* ring, int fd) {
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    if(head == tail) {
+        return;
+    }
+    uint64_t cap = ring->mask + 1;
+    uint64_t off = tail & ring->mask;
+    uint64_t len = head - tail;
+    uint64_t first = std::min(len, cap - off);
+    write_all(fd, ring->data + off, first);
+    if(first < len) {
+        write_all(fd, ring->data, len - first);
+    }
+    ring->tail.store(head, std::memory_order_release);
+}
+
+// 取出所有缓冲区，回收已退出线程的缓冲区
+void drain_all() {
+    LogState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    int fd = st.fd.load(std::memory_order_relaxed);
+    for(auto it = st.rings.begin(); it != st.rings.end();) {
+        LogRing* ring = *it;
+        // 先读 dead 再取：dead 之后所属线程不会再写，取完就可以释放
+        bool dead = ring->dead.load(std::memory_order_acquire);
+        drain(ring, fd);
+        if(dead) {
+            delete[] ring->data;
+            delete ring;
+            it = st.rings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void flusher_main() {
+    LogState& st = State();
+    pthread_setname_np(pthread_self(), "log_flush");
+    while(!st.shutdown.load(std::memory_order_acquire)) {
+        {
+            std::unique_lock<std::mutex> lock(st.wake_mutex);
+            st.wake.wait_for(lock, std::chrono::milliseconds(50), [&] { return st.wake_pending; });
+            st.wake_pending = false;
+        }
+        drain_all();
+    }
+}
+
+void stop_flusher() {
+    LogState& st = State();
+    st.shutdown.store(true, std::memory_order_release);
+    if(st.flusher.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(st.wake_mutex);
+            st.wake_pending = true;
+        }
+        st.wake.notify_one();
+        st.flusher.join();
+    }
+    drain_all();
+}
+
+void start_flusher() {
+    LogState& st = State();
+    try {
+        st.flusher = std::thread(flusher_main);
+        st.running.store(true, std::memory_order_release);
+        atexit(stop_flusher);
+    } catch(...) {
+        // 起不了后台线程就一直直接写出
+    }
+}
+
+void wake_flusher() {
+    LogState& st = State();
+    {
+        std::lock_guard<std::mutex> lock(st.wake_mutex);
+        st.wake_pending = true;
+    }
+    st.wake.notify_one();
+}
+
+LogRing* create_ring() {
+    LogState& st = State();
+    size_t cap = 1024;
+    while(cap < st.ring_size.load(std::memory_order_relaxed)) {
+        cap <<= 1;
+    }
+    LogRing* ring = new LogRing;
+    ring->data = new char[cap];
+    ring->mask = cap - 1;
+    std::lock_guard<std::mutex> lock(st.mutex);
+    st.rings.push_back(ring);
+    return ring;
+}
+
+// 把一整行放进本线程的缓冲区，放不下返回false
+bool append(const char* line, size_t len) {
+    LogState& st = State();
+    if(t_exiting || st.shutdown.load(std::memory_order_acquire)) {
+        return false;
+    }
+    std::call_once(st.start_once, start_flusher);
+    if(!st.running.load(std::memory_order_acquire)) {
+        return false;
+    }
+    LogRing* ring = t_holder.ring;
+    if(!ring) {
+        ring = t_holder.ring = create_ring();
+    }
+    uint64_t cap = ring->mask + 1;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if(cap - (head - tail) < len) {
+        return false;
+    }
+    uint64_t off = head & ring->mask;
+    uint64_t first = std::min<uint64_t>(len, cap - off);
+    memcpy(ring->data + off, line, first);
+    memcpy(ring->data, line + first, len - first);
+    ring->head.store(head + len, std::memory_order_release);
+    return true;
+}
+
+LogLevel parse_level(const char* s) {
+    if(!strcasecmp(s, "debug")) return LOG_DEBUG;
+    if(!strcasecmp(s, "info")) return LOG_INFO;
+    if(!strcasecmp(s, "warn")) return LOG_WARN;
+    if(!strcasecmp(s, "error")) return LOG_ERROR;
+    if(!strcasecmp(s, "off")) return LOG_OFF;
+    return LOG_INFO;
+}
+
+// 启动时读环境变量 SYLAR_LOG_LEVEL
+struct LevelFromEnv {
+    LevelFromEnv() {
+        if(const char* s = getenv("SYLAR_LOG_LEVEL")) {
+            detail::g_log_level.store(parse_level(s), std::memory_order_relaxed);
+        }
+    }
+} s_level_from_env;
+
+}
+
+void Logger::SetLevel(LogLevel level) {
+    detail::g_log_level.store(level, std::memory_order_relaxed);
+}
+
+void Logger::SetOutputFd(int fd) {
+    Flush();
+    State().fd.store(fd, std::memory_order_relaxed);
+}
+
+void Logger::SetBufferSize(size_t size) {
+    State().ring_size.store(size, std::memory_order_relaxed);
+}
+
+void Logger::Flush() {
+    drain_all();
+}
+
+uint64_t Logger::GetSyncWrites() {
+    return State().sync_writes.load(std::memory_order_relaxed);
+}
+
+LogLine::LogLine(LogLevel level, const char* file, int line)
+    :m_level(level)
+    ,m_sbuf(m_buf, sizeof(m_buf))
+    ,m_stream(&m_sbuf) {
+    if(!t_tid) {
+        t_tid = Thread::GetThreadId();
+    }
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    char ts[32];
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+    const char* base = strrchr(file, '/');
+    // 还没有协程的线程记为 fiber=0，不为打日志去创建主协程
+    uint64_t fiber_id = Fiber::GetFiberId();
+    char prefix[128];
+    int n = snprintf(prefix, sizeof(prefix), "%s.%06ld %s [tid=%d thread=", ts, (long)tv.tv_usec,
+                     level_name(level), (int)t_tid);
+    m_sbuf.sputn(prefix, std::min<int>(n, sizeof(prefix) - 1));
+    m_stream << Thread::GetName() << " fiber=" << (fiber_id == (uint64_t)-1 ? 0: fiber_id) << "] "
+             << (base ? base + 1: file) << ":" << line << " ";
+}
+
+LogLine::~LogLine() {
+    size_t len = m_sbuf.size();
+    // 构造时为换行预留了一个字节
+    m_buf[len++] = '\n';
+    LogState& st = State();
+    if(!append(m_buf, len)) {
+        if(!t_exiting && st.running.load(std::memory_order_acquire) && !st.shutdown.load(std::memory_order_acquire)) {
+            // 缓冲区满：先把已缓冲的写出，保证本线程的日志不乱序
+            st.sync_writes.fetch_add(1, std::memory_order_relaxed);
+            drain_all();
+        }
+        write_all(st.fd.load(std::memory_order_relaxed), m_buf, len);
+    } else if(m_level >= LOG_ERROR) {
+        wake_flusher();
+    }
+}
+
+}
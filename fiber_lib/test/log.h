@@ -0,0 +1,124 @@
+#ifndef __SYLAR_LOG_H__
+#define __SYLAR_LOG_H__
+
+// 异步日志：取代库里散落的 std::cout/std::cerr
+//
+// std::cout/std::cerr 每次输出都要拿流的全局锁，在 idle()、do_io 这样的热路径上会把工作线程串行化。
+// 这里每条日志在调用线程里格式化成一整行，追加到该线程自己的环形缓冲区（单写者单读者，不加锁），
+// 由后台线程定期（或遇到 ERROR 时立即）取出写到输出fd（默认 stderr），一次 write 写出多行。
+// 每行带时间、级别、线程id、线程名、协程id和源码位置：
+//
+//   2026-10-15 12:00:00.123456 ERROR [tid=4242 thread=Scheduler_0 fiber=17] hook.cpp:250 addEvent failed, fd=9
+//
+// 级别过滤分两层：
+// - 编译期：SYLAR_LOG_MIN_LEVEL（默认 SYLAR_LOG_LEVEL_DEBUG）以下的记录点在编译期就是一个恒假的分支，
+//   连 << 右边的表达式都不会求值，发布版可以定义 -DSYLAR_LOG_MIN_LEVEL=SYLAR_LOG_LEVEL_INFO 把调试日志彻底去掉
+// - 运行期：Logger::SetLevel()，默认 INFO，可以用环境变量 SYLAR_LOG_LEVEL=debug|info|warn|error 设置。
+//   低于运行期级别的记录点只是一次原子读和一个分支
+//
+// 线程缓冲区满了或者一行比缓冲区还长时，调用线程先把已缓冲的日志写出，再直接写这一行，不丢也不乱序；
+// 后台线程启动失败、线程或进程退出以后的日志也是直接写出。不同线程的日志按线程分批写出，行之间的先后以时间戳为准
+//
+//   SYLAR_LOG_INFO() << "listening on port " << port;
+//   SYLAR_LOG_ERROR() << "addEvent failed, fd=" << fd;
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <streambuf>
+
+#define SYLAR_LOG_LEVEL_DEBUG 0
+#define SYLAR_LOG_LEVEL_INFO  1
+#define SYLAR_LOG_LEVEL_WARN  2
+#define SYLAR_LOG_LEVEL_ERROR 3
+#define SYLAR_LOG_LEVEL_OFF   4
+
+#ifndef SYLAR_LOG_MIN_LEVEL
+#define SYLAR_LOG_MIN_LEVEL SYLAR_LOG_LEVEL_DEBUG
+#endif
+
+namespace sylar {
+
+enum LogLevel {
+    LOG_DEBUG = SYLAR_LOG_LEVEL_DEBUG,
+    LOG_INFO = SYLAR_LOG_LEVEL_INFO,
+    LOG_WARN = SYLAR_LOG_LEVEL_WARN,
+    LOG_ERROR = SYLAR_LOG_LEVEL_ERROR,
+    LOG_OFF = SYLAR_LOG_LEVEL_OFF
+};
+
+namespace detail {
+// 运行期级别，记录点只读它
+extern std::atomic<int> g_log_level;
+}
+
+class Logger {
+public:
+    static void SetLevel(LogLevel level);
+    static LogLevel GetLevel() {
+        return (LogLevel)detail::g_log_level.load(std::memory_order_relaxed);
+    }
+
+    static bool IsEnabled(LogLevel level) {
+        return level >= detail::g_log_level.load(std::memory_order_relaxed);
+    }
+
+    // 输出fd，默认 STDERR_FILENO。调用方负责fd的生命周期；切换前已缓冲的日志先写到旧fd
+    static void SetOutputFd(int fd);
+
+    // 线程缓冲区的字节数（向上取整到2的幂），只对之后第一次写日志的线程生效，默认64KB
+    static void SetBufferSize(size_t size);
+
+    // 把所有线程已缓冲的日志同步写出，返回前写完
+    static void Flush();
+
+    // 因为线程缓冲区满而在调用线程里直接写出的行数
+    static uint64_t GetSyncWrites();
+};
+
+// 一条日志：构造时写前缀，析构时补换行并交给本线程的缓冲区。应当通过 SYLAR_LOG_* 宏使用
+class LogLine {
+public:
+    LogLine(LogLevel level, const char* file, int line);
+    ~LogLine();
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    std::ostream& stream() {
+        return m_stream;
+    }
+
+private:
+    // 写到栈上定长缓冲区，写满后截断
+    class LineBuf: public std::streambuf {
+    public:
+        LineBuf(char* buf, size_t size) {
+            // 留一个字节给换行
+            setp(buf, buf + size - 1);
+        }
+        size_t size() const {
+            return pptr() - pbase();
+        }
+    };
+
+    LogLevel m_level;
+    char m_buf[512];
+    LineBuf m_sbuf;
+    std::ostream m_stream;
+};
+
+}
+
+// 记录点：level 低于编译期最低级别时条件在编译期为假，整条语句被消除
+#define SYLAR_LOG(level) \
+    if((level) < SYLAR_LOG_MIN_LEVEL || !__builtin_expect(::sylar::Logger::IsEnabled(level), 0)) {} \
+    else ::sylar::LogLine((level), __FILE__, __LINE__).stream()
+
+#define SYLAR_LOG_DEBUG() SYLAR_LOG(::sylar::LOG_DEBUG)
+#define SYLAR_LOG_INFO() SYLAR_LOG(::sylar::LOG_INFO)
+#define SYLAR_LOG_WARN() SYLAR_LOG(::sylar::LOG_WARN)
+#define SYLAR_LOG_ERROR() SYLAR_LOG(::sylar::LOG_ERROR)
+
+#endif
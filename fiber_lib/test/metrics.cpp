@@ -0,0 +1,53 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <time.h>
+
+namespace sylar {
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other) {
+    for(int i = 0; i < BUCKETS; ++i) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const {
+    if(count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * count);
+    if(rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if(seen > rank) {
+            uint64_t upper = i == 0 ? 0: (i >= 64 ? ~0ull: (1ull << i) - 1);
+            return std::min(upper, max);
+        }
+    }
+    return max;
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot s;
+    for(int i = 0; i < HistogramSnapshot::BUCKETS; ++i) {
+        s.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    }
+    s.count = m_count.load(std::memory_order_relaxed);
+    s.sum = m_sum.load(std::memory_order_relaxed);
+    s.max = m_max.load(std::memory_order_relaxed);
+    return s;
+}
+
+uint64_t MonotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+}
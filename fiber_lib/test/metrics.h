@@ -0,0 +1,80 @@
+#ifndef __SYLAR_METRICS_H__
+#define __SYLAR_METRICS_H__
+
+#include <atomic>
+#include <cstdint>
+
+namespace sylar {
+
+// 单写者计数器：只由一个线程（或在同一把锁下）增加，其他线程随时可以读取近似值。
+// 增加是普通的读-加-写，没有原子读改写（lock前缀）的开销
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_value{0};
+};
+
+// 直方图的快照，可以合并多个线程的数据
+struct HistogramSnapshot {
+    static const int BUCKETS = 48;
+
+    // buckets[0] 统计值0，buckets[i] 统计 [2^(i-1), 2^i)，最后一个桶包含更大的值
+    uint64_t buckets[BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    void merge(const HistogramSnapshot& other);
+
+    double mean() const {
+        return count ? (double)sum / count: 0;
+    }
+
+    // 近似分位数（p取0~1）：返回所在桶的上界，不超过记录到的最大值
+    uint64_t percentile(double p) const;
+};
+
+// 按2的幂分桶的单写者直方图，记录一次只有几次普通的读写
+class Histogram {
+public:
+    void record(uint64_t v) {
+        int b = v ? 64 - __builtin_clzll(v): 0;
+        if(b >= HistogramSnapshot::BUCKETS) {
+            b = HistogramSnapshot::BUCKETS - 1;
+        }
+        bump(m_buckets[b], 1);
+        bump(m_count, 1);
+        bump(m_sum, v);
+        if(v > m_max.load(std::memory_order_relaxed)) {
+            m_max.store(v, std::memory_order_relaxed);
+        }
+    }
+
+    HistogramSnapshot snapshot() const;
+
+private:
+    static void bump(std::atomic<uint64_t>& a, uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_buckets[HistogramSnapshot::BUCKETS] = {};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_sum{0};
+    std::atomic<uint64_t> m_max{0};
+};
+
+// 单调时钟，纳秒
+uint64_t MonotonicNs();
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+#include "numa.h"
+
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sched.h>
+#include <set>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace sylar {
+
+// <numaif.h> 属于 libnuma 的开发包，这里只需要一个常量
+static const int NUMA_MPOL_PREFERRED = 1;
+
+static thread_local int t_numa_node = -1;
+
+struct NumaTopology {
+    std::vector<int> nodes;
+    std::map<int, std::vector<int>> node_cpus;
+    std::map<int, int> cpu_node;
+    std::vector<int> allowed;
+
+    NumaTopology();
+};
+
+// 解析 "0-3,8,10-11" 形式的CPU列表
+static std::vector<int> parse_cpulist(const std::string& str) {
+    std::vector<int> cpus;
+    std::stringstream ss(str);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        if(item.empty() || item == "\n") {
+            continue;
+        }
+        int lo = 0;
+        int hi = 0;
+        if(sscanf(item.c_str(), "%d-%d", &lo, &hi) == 2) {
+            for(int c = lo; c <= hi; ++c) {
+                cpus.push_back(c);
+            }
+        } else if(sscanf(item.c_str(), "%d", &lo) == 1) {
+            cpus.push_back(lo);
+        }
+    }
+    return cpus;
+}
+
+NumaTopology::NumaTopology() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int c = 0; c < CPU_SETSIZE; ++c) {
+            if(CPU_ISSET(c, &set)) {
+                allowed.push_back(c);
+            }
+        }
+    }
+    if(allowed.empty()) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for(long c = 0; c < n; ++c) {
+            allowed.push_back((int)c);
+        }
+    }
+
+    std::set<int> allowed_set(allowed.begin(), allowed.end());
+    DIR* dir = opendir("/sys/devices/system/node");
+    if(dir) {
+        while(dirent* ent = readdir(dir)) {
+            int node = -1;
+            if(sscanf(ent->d_name, "node%d", &node) != 1) {
+                continue;
+            }
+            std::ifstream in("/sys/devices/system/node/" + std::string(ent->d_name) + "/cpulist");
+            std::string line;
+            std::getline(in, line);
+            for(int c: parse_cpulist(line)) {
+                if(allowed_set.count(c)) {
+                    node_cpus[node].push_back(c);
+                    cpu_node[c] = node;
+                }
+            }
+        }
+        closedir(dir);
+    }
+
+    if(node_cpus.empty()) {
+        node_cpus[0] = allowed;
+        for(int c: allowed) {
+            cpu_node[c] = 0;
+        }
+    }
+    for(auto& kv: node_cpus) {
+        nodes.push_back(kv.first);
+    }
+}
+
+static NumaTopology& topology() {
+    static NumaTopology topo;
+    return topo;
+}
+
+const std::vector<int>& Numa::Nodes() {
+    return topology().nodes;
+}
+
+const std::vector<int>& Numa::CpusOfNode(int node) {
+    static const std::vector<int> empty;
+    auto& m = topology().node_cpus;
+    auto it = m.find(node);
+    return it == m.end() ? empty: it->second;
+}
+
+int Numa::NodeOfCpu(int cpu) {
+    auto& m = topology().cpu_node;
+    auto it = m.find(cpu);
+    return it == m.end() ? -1: it->second;
+}
+
+const std::vector<int>& Numa::AllowedCpus() {
+    return topology().allowed;
+}
+
+void Numa::SetThreadNode(int node) {
+    t_numa_node = node;
+}
+
+int Numa::GetThreadNode() {
+    return t_numa_node;
+}
+
+void* Numa::AllocOnNode(size_t size, int node) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) & ~(page - 1);
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        return nullptr;
+    }
+#ifdef SYS_mbind
+    // 首次访问之前设置策略，物理页从该节点分配；节点内存不足时退回其他节点
+    if(node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, p, size, NUMA_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+#endif
+    return p;
+}
+
+void Numa::FreeOnNode(void* p, size_t size) {
+    if(!p) {
+        return;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) & ~(page - 1);
+    munmap(p, size);
+}
+
+std::string Numa::FormatCpus(const std::vector<int>& cpus) {
+    std::stringstream ss;
+    for(size_t i = 0; i < cpus.size(); ) {
+        size_t j = i;
+        while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            ++j;
+        }
+        if(i) {
+            ss << ",";
+        }
+        ss << cpus[i];
+        if(j > i) {
+            ss << "-" << cpus[j];
+        }
+        i = j + 1;
+    }
+    return ss.str();
+}
+
+}
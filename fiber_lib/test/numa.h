@@ -0,0 +1,45 @@
+#ifndef __SYLAR_NUMA_H__
+#define __SYLAR_NUMA_H__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace sylar {
+
+// CPU / NUMA 拓扑以及按节点分配内存
+// 拓扑在第一次使用时从 /sys/devices/system/node 读取，只保留进程亲和性掩码允许的CPU；
+// 读不到（非NUMA机器、容器中没有挂载sysfs）时视为只有一个节点0，包含所有允许的CPU。
+// 不依赖 libnuma：按节点分配直接使用 mmap + mbind 系统调用，mbind 失败时内存仍然可用，只是不保证在本地节点上。
+class Numa {
+public:
+    // 可用的节点id（至少一个），升序
+    static const std::vector<int>& Nodes();
+
+    // 节点上允许使用的CPU，未知节点返回空
+    static const std::vector<int>& CpusOfNode(int node);
+
+    // CPU所在的节点，未知返回-1
+    static int NodeOfCpu(int cpu);
+
+    // 进程允许使用的全部CPU
+    static const std::vector<int>& AllowedCpus();
+
+    // 设置/获取当前线程所在的节点，调度器在绑定工作线程之后设置，-1表示未绑定
+    // 协程栈池等线程级缓存据此把全局溢出链表按节点分开
+    static void SetThreadNode(int node);
+    static int GetThreadNode();
+
+    // 在指定节点上分配内存（按页取整，清零），node为-1时不指定节点；失败返回nullptr
+    static void* AllocOnNode(size_t size, int node);
+
+    // 释放 AllocOnNode 分配的内存，size 与分配时一致
+    static void FreeOnNode(void* p, size_t size);
+
+    // 把CPU列表格式化为 "0-3,8,10-11" 的形式
+    static std::string FormatCpus(const std::vector<int>& cpus);
+};
+
+}
+
+#endif
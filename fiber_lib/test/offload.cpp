@@ -0,0 +1,208 @@
+#include "offload.h"
+
+#include <sstream>
+
+namespace sylar {
+
+OffloadPool::OffloadPool(const Options& options)
+    :m_options(options)
+    ,m_slots(std::max<size_t>(options.queue_depth, 1)) {
+    setThreads(options.threads);
+}
+
+OffloadPool::~OffloadPool() {
+    std::vector<std::shared_ptr<Thread>> thrs;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        for(auto& w: m_workers) {
+            thrs.push_back(w->thread);
+        }
+        thrs.insert(thrs.end(), m_exited.begin(), m_exited.end());
+        m_exited.clear();
+    }
+    m_cond.notify_all();
+    // 线程把队列执行空才退出
+    for(auto& t: thrs) {
+        t->join();
+    }
+}
+
+void OffloadPool::setThreads(size_t n) {
+    std::vector<std::shared_ptr<Thread>> exited;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_stopping) {
+            return;
+        }
+        exited.swap(m_exited);
+        // 先收回正在退出的线程
+        size_t alive = 0;
+        for(auto& w: m_workers) {
+            alive += !w->exit;
+        }
+        for(auto it = m_workers.rbegin(); it != m_workers.rend() && alive > n; ++it) {
+            if(!(*it)->exit) {
+                (*it)->exit = true;
+                --alive;
+            }
+        }
+        for(; alive < n; ++alive) {
+            std::shared_ptr<Worker> w(new Worker);
+            m_workers.push_back(w);
+            w->thread.reset(new Thread(std::bind(&OffloadPool::workerMain, this, w),
+                                       m_options.name + "_" + std::to_string(m_threadSeq++)));
+        }
+        m_threadCount.store(n, std::memory_order_relaxed);
+    }
+    m_cond.notify_all();
+    for(auto& t: exited) {
+        t->join();
+    }
+}
+
+size_t OffloadPool::getThreads() const {
+    return m_threadCount.load(std::memory_order_relaxed);
+}
+
+bool OffloadPool::shouldOffload() const {
+    return m_threadCount.load(std::memory_order_relaxed) > 0 && Fiber::CanSuspend() && Scheduler::GetThis();
+}
+
+void OffloadPool::submit(detail::OffloadJob* job) {
+    if(!m_slots.tryWait()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_queueFull;
+        }
+        m_slots.wait();
+    }
+    Fiber* self = Fiber::Current();
+    job->scheduler = Scheduler::GetThis();
+    job->fiber = Fiber::ptr(self);
+    job->thread = Thread::GetThreadId();
+    job->enqueue_ns = MonotonicNs();
+    // 调度器要等协程回来才能停止
+    job->scheduler->beginExternalWait();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(job);
+        ++m_submitted;
+    }
+    m_cond.notify_one();
+    // 调用可能在切换出去之前就完成了，resume() 会等这里切换完成
+    Fiber::SetWaitReason(Fiber::WAIT_OFFLOAD);
+    self->yield();
+}
+
+void OffloadPool::workerMain(std::shared_ptr<Worker> self) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true) {
+        m_cond.wait(lock, [&]() {
+            return !m_queue.empty() || self->exit || m_stopping;
+        });
+        // 停止时执行完队列才退出；被 setThreads 减掉的线程把剩下的调用留给其他线程，没有其他线程时由它执行完
+        if(m_queue.empty() || (self->exit && m_threadCount.load(std::memory_order_relaxed) > 0)) {
+            break;
+        }
+        detail::OffloadJob* job = m_queue.front();
+        m_queue.pop_front();
+        ++m_running;
+        uint64_t start = MonotonicNs();
+        m_queueWait.record(start - job->enqueue_ns);
+        lock.unlock();
+        m_slots.post();
+
+        job->invoke();
+        job->error = errno;
+        self->run_ns.record(MonotonicNs() - start);
+        self->completed.add();
+        // 回到提交它的工作线程，之后不能再访问 job：协程恢复后会立即释放它
+        Scheduler* sc = job->scheduler;
+        int thread = job->thread;
+        Fiber::ptr fiber = std::move(job->fiber);
+        sc->scheduleLock(std::move(fiber), thread);
+        sc->endExternalWait();
+
+        lock.lock();
+        --m_running;
+    }
+
+    // 统计并入池子，从列表中移除；线程对象留给下一次 setThreads 或析构时 join
+    m_exitedCompleted += self->completed.get();
+    m_exitedRunNs.merge(self->run_ns.snapshot());
+    if(!m_stopping) {
+        m_exited.push_back(self->thread);
+    }
+    for(auto it = m_workers.begin(); it != m_workers.end(); ++it) {
+        if(*it == self) {
+            m_workers.erase(it);
+            break;
+        }
+    }
+}
+
+OffloadPool::Stats OffloadPool::getStats() const {
+    Stats s;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    s.threads = m_threadCount.load(std::memory_order_relaxed);
+    s.queue_depth = m_options.queue_depth;
+    s.queued = m_queue.size();
+    s.running = m_running;
+    s.submitted = m_submitted;
+    s.queue_full = m_queueFull;
+    s.queue_wait_ns = m_queueWait.snapshot();
+    s.completed = m_exitedCompleted;
+    s.run_ns = m_exitedRunNs;
+    for(auto& w: m_workers) {
+        s.completed += w->completed.get();
+        s.run_ns.merge(w->run_ns.snapshot());
+    }
+    return s;
+}
+
+static void format_histogram(std::stringstream& ss, const char* name, const HistogramSnapshot& h) {
+    ss << name << ": count=" << h.count << " mean=" << (uint64_t)h.mean()
+       << " p50=" << h.percentile(0.5) << " p99=" << h.percentile(0.99)
+       << " max=" << h.max << "\n";
+}
+
+std::string OffloadPool::Stats::toString() const {
+    std::stringstream ss;
+    ss << "threads=" << threads << " queue_depth=" << queue_depth << " queued=" << queued
+       << " running=" << running << "\n";
+    ss << "submitted=" << submitted << " completed=" << completed << " queue_full=" << queue_full << "\n";
+    format_histogram(ss, "queue_wait_ns", queue_wait_ns);
+    format_histogram(ss, "run_ns", run_ns);
+    return ss.str();
+}
+
+static std::mutex s_default_mutex;
+static OffloadPool::Options s_default_options;
+static std::atomic<OffloadPool*> s_default_pool{nullptr};
+
+OffloadPool* OffloadPool::GetDefault() {
+    OffloadPool* pool = s_default_pool.load(std::memory_order_acquire);
+    if(pool) {
+        return pool;
+    }
+    std::lock_guard<std::mutex> lock(s_default_mutex);
+    pool = s_default_pool.load(std::memory_order_relaxed);
+    if(!pool) {
+        // 与 FdManager 一样不释放：hook 在进程退出前的任何时刻都可能用到它
+        pool = new OffloadPool(s_default_options);
+        s_default_pool.store(pool, std::memory_order_release);
+    }
+    return pool;
+}
+
+bool OffloadPool::SetDefaultOptions(const Options& options) {
+    std::lock_guard<std::mutex> lock(s_default_mutex);
+    if(s_default_pool.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    s_default_options = options;
+    return true;
+}
+
+}
@@ -0,0 +1,188 @@
+#ifndef __SYLAR_OFFLOAD_H__
+#define __SYLAR_OFFLOAD_H__
+
+// 阻塞调用卸载线程池
+//
+// hook 只能把 socket 的读写变成协程挂起：普通文件、NFS、慢速管道上的 read() 以及 fsync() 没有
+// 可以等待的就绪事件，直接调用会把整个工作线程阻塞住。OffloadPool 用一组独立的线程执行这些调用，
+// 提交的协程挂起，调用完成后回到原来的工作线程上继续执行，errno 和异常都会带回来。
+//
+// 开启 hook 后，非 socket fd 上的 read/readv/write/writev 以及 fsync 自动走默认线程池；
+// 其他阻塞函数（第三方库、getaddrinfo 等）可以手动提交：
+//   int rt = sylar::offload([&]{ return ::stat(path, &st); });
+//
+// 不在调度器的协程中调用时没有可以让出的东西，直接在当前线程执行
+
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <errno.h>
+
+#include "fiber_sync.h"
+#include "future.h"
+#include "metrics.h"
+
+namespace sylar {
+
+namespace detail {
+
+// 一次卸载的调用。协程可能运行在共享栈上，挂起后栈上的内容会被换出，所以任务总是分配在堆上
+struct OffloadJob {
+    virtual ~OffloadJob() {}
+    // 在卸载线程中执行
+    virtual void invoke() = 0;
+
+    // 完成后在哪里恢复提交的协程
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    int thread = -1;
+    // 调用结束时的 errno，恢复后还给调用方
+    int error = 0;
+    // 放入队列的时间，用于统计排队时间
+    uint64_t enqueue_ns = 0;
+};
+
+template<class F, class R>
+struct OffloadCall: public OffloadJob {
+    explicit OffloadCall(F&& f): func(std::move(f)) {}
+
+    void invoke() override {
+        try {
+            result.run(func);
+        } catch(...) {
+            exception = std::current_exception();
+        }
+    }
+
+    F func;
+    FutureValue<R> result;
+    std::exception_ptr exception;
+};
+
+}
+
+class OffloadPool {
+public:
+    struct Options {
+        // 线程数，0表示不卸载（所有调用都直接在调用方线程执行）
+        size_t threads;
+        // 正在排队的调用上限，队列满时提交方（协程）挂起等待空位
+        size_t queue_depth;
+        // 线程名前缀
+        std::string name;
+
+        Options(): threads(4), queue_depth(1024), name("offload") {}
+    };
+
+    struct Stats {
+        size_t threads;
+        size_t queue_depth;
+        // 当前排队 / 正在执行的调用数
+        size_t queued;
+        size_t running;
+        uint64_t submitted;
+        uint64_t completed;
+        // 提交时队列已满、需要等待空位的次数
+        uint64_t queue_full;
+        // 排队时间、执行时间（纳秒）
+        HistogramSnapshot queue_wait_ns;
+        HistogramSnapshot run_ns;
+
+        std::string toString() const;
+    };
+
+    explicit OffloadPool(const Options& options = Options());
+    // 等待已经提交的调用全部完成
+    ~OffloadPool();
+
+    OffloadPool(const OffloadPool&) = delete;
+    OffloadPool& operator=(const OffloadPool&) = delete;
+
+    // 在卸载线程中执行f并返回它的结果，当前协程挂起直到完成。f抛出的异常在这里重新抛出，
+    // 执行结束时的 errno 也会设置到调用方线程上
+    template<class F, class R = typename std::invoke_result<F&>::type>
+    R run(F f) {
+        if(!shouldOffload()) {
+            return f();
+        }
+        std::unique_ptr<detail::OffloadCall<F, R>> call(new detail::OffloadCall<F, R>(std::move(f)));
+        submit(call.get());
+        errno = call->error;
+        if(call->exception) {
+            std::rethrow_exception(call->exception);
+        }
+        if constexpr(!std::is_void<R>::value) {
+            return std::move(call->result.get());
+        }
+    }
+
+    // 调整线程数：增加时立即创建，减少时多余的线程执行完手上的调用后退出
+    void setThreads(size_t n);
+
+    size_t getThreads() const;
+
+    Stats getStats() const;
+
+    // hook 使用的默认线程池，第一次使用时按 SetDefaultOptions 设置的参数创建
+    static OffloadPool* GetDefault();
+
+    // 设置默认线程池的参数，必须在第一次使用默认线程池之前调用才有效，返回是否生效
+    static bool SetDefaultOptions(const Options& options);
+
+private:
+    // 卸载线程
+    struct Worker {
+        std::shared_ptr<Thread> thread;
+        // 被 setThreads 要求退出
+        bool exit = false;
+        // 由该线程写入
+        Counter completed;
+        Histogram run_ns;
+    };
+
+    // 当前在调度器的协程中并且有卸载线程
+    bool shouldOffload() const;
+
+    // 放入队列并挂起当前协程，返回时 job 已经执行完
+    void submit(detail::OffloadJob* job);
+
+    void workerMain(std::shared_ptr<Worker> self);
+
+private:
+    Options m_options;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<detail::OffloadJob*> m_queue;
+    // 空位，先取得空位再入队
+    FiberSemaphore m_slots;
+    std::vector<std::shared_ptr<Worker>> m_workers;
+    // 已经退出、等待 join 的线程
+    std::vector<std::shared_ptr<Thread>> m_exited;
+    size_t m_threadSeq = 0;
+    size_t m_running = 0;
+    bool m_stopping = false;
+    std::atomic<size_t> m_threadCount{0};
+
+    // 以下在 m_mutex 下修改
+    uint64_t m_submitted = 0;
+    uint64_t m_queueFull = 0;
+    Histogram m_queueWait;
+    // 已退出线程的统计
+    uint64_t m_exitedCompleted = 0;
+    HistogramSnapshot m_exitedRunNs;
+};
+
+// 在默认卸载线程池中执行阻塞调用
+template<class F>
+auto offload(F f) -> typename std::invoke_result<F&>::type {
+    return OffloadPool::GetDefault()->run(std::move(f));
+}
+
+}
+
+#endif
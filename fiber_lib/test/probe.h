@@ -0,0 +1,73 @@
+#ifndef __SYLAR_PROBE_H__
+#define __SYLAR_PROBE_H__
+
+// USDT（用户态静态探针）：perf / bpftrace / SystemTap 可以直接挂在发布版二进制上，不需要专门的构建
+//
+// 每个探针在代码里只是一条 nop，另外在 .note.stapsdt 段里记下它的地址、名字和参数所在的寄存器
+// （格式与 <sys/sdt.h> 相同，这里自己生成是为了不依赖 systemtap-sdt-dev）。没有工具挂上去时的开销是
+// 一条 nop 和把参数放进寄存器。探针（provider 都是 sylar，参数都是64位整数）：
+//   fiber_resume(fiber_id)                 协程即将被切入，在 resume 的调用线程上
+//   fiber_yield(fiber_id) / fiber_term(fiber_id)   协程切出或结束后回到 resume 的调用方
+//   task_enqueue(fiber_id, priority)       任务入队，回调任务的 fiber_id 为0
+//   task_dequeue(fiber_id, priority)       工作线程取出任务
+//   idle_wake(events, parked, park_ns)     IOManager::idle() 从 epoll/io_uring 等待中返回：
+//                                          就绪事件数、是否真的阻塞过、阻塞的纳秒数
+//   timer_fire(lag_us)                     定时器到期，lag_us 为相对到期时间的延迟
+//
+//   perf probe -x ./server 'sdt_sylar:fiber_resume'    # 或 perf record -e sdt_sylar:fiber_resume
+//   bpftrace -e 'usdt:./server:sylar:idle_wake { @[arg1] = hist(arg2); }'
+//   readelf -n ./server                                  # 列出所有探针
+//
+// 只支持 x86-64 和 aarch64 的 ELF，其他平台或定义了 SYLAR_PROBE_DISABLED 时探针为空
+
+#include <cstdint>
+
+#if !defined(SYLAR_PROBE_DISABLED) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// 探针地址以 _.stapsdt.base 为基准，工具据此修正 prelink/PIE 的加载偏移
+#define SYLAR_PROBE_ASM(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"sylar\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define SYLAR_PROBE0(name) \
+    __asm__ __volatile__(SYLAR_PROBE_ASM(name, ""))
+#define SYLAR_PROBE1(name, a1) \
+    __asm__ __volatile__(SYLAR_PROBE_ASM(name, "8@%[sylar_a1]") \
+        :: [sylar_a1] "r"((uint64_t)(a1)))
+#define SYLAR_PROBE2(name, a1, a2) \
+    __asm__ __volatile__(SYLAR_PROBE_ASM(name, "8@%[sylar_a1] 8@%[sylar_a2]") \
+        :: [sylar_a1] "r"((uint64_t)(a1)), [sylar_a2] "r"((uint64_t)(a2)))
+#define SYLAR_PROBE3(name, a1, a2, a3) \
+    __asm__ __volatile__(SYLAR_PROBE_ASM(name, "8@%[sylar_a1] 8@%[sylar_a2] 8@%[sylar_a3]") \
+        :: [sylar_a1] "r"((uint64_t)(a1)), [sylar_a2] "r"((uint64_t)(a2)), [sylar_a3] "r"((uint64_t)(a3)))
+
+#else
+
+#define SYLAR_PROBE0(name) do {} while(0)
+#define SYLAR_PROBE1(name, a1) do {} while(0)
+#define SYLAR_PROBE2(name, a1, a2) do {} while(0)
+#define SYLAR_PROBE3(name, a1, a2, a3) do {} while(0)
+
+#endif
+
+#endif
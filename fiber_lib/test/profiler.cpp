@@ -0,0 +1,551 @@
+#include "profiler.h"
+#include "fiber.h"
+#include "log.h"
+#include "thread.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sstream>
+#include <time.h>
+#include <ucontext.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// 旧版 glibc 没有定义这个字段名
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace sylar {
+
+namespace {
+
+// 样本的归类：有标签时按标签，否则按运行在哪种协程上
+enum SampleKind : uint32_t {
+    KIND_TASK = 0,
+    KIND_SCHEDULER = 1
+};
+
+// 聚合表的一项。hash 为0表示空项；所属线程先填好其余字段和栈帧，再 release 发布 hash，之后只增加 count
+struct SampleSlot {
+    std::atomic<uint64_t> hash{0};
+    std::atomic<uint64_t> count{0};
+    const char* label = nullptr;
+    uint32_t kind = 0;
+    uint32_t depth = 0;
+};
+
+// 一个登记过的线程。线程退出后保留到下一次 Start()，导出时仍然包含它的样本
+struct ProfThread {
+    pid_t tid = 0;
+    pthread_t handle;
+    std::string name;
+    // 线程自己的栈，线程主协程和调度协程在上面运行
+    const char* stack_lo = nullptr;
+    const char* stack_hi = nullptr;
+    timer_t timer;
+    bool armed = false;
+    bool alive = true;
+    // 信号处理函数正在执行，Stop()/Clear() 等它结束才动表
+    std::atomic<bool> busy{false};
+    // 聚合表：slots[mask + 1]，每项的栈帧在 frames[i * max_depth] 起
+    SampleSlot* slots = nullptr;
+    uintptr_t* frames = nullptr;
+    size_t mask = 0;
+    uint32_t max_depth = 0;
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+struct ProfState {
+    std::mutex mutex;
+    std::vector<ProfThread*> threads;
+    Profiler::Options options;
+    bool running = false;
+    bool handler_installed = false;
+    std::mutex label_mutex;
+    std::unordered_set<std::string> labels;
+};
+
+// 线程退出时还会用到，不析构
+ProfState& State() {
+    static ProfState* s = new ProfState;
+    return *s;
+}
+
+std::atomic<bool> g_prof_enabled{false};
+
+thread_local ProfThread* t_prof = nullptr;
+
+// 插入时最多探测的项数，超过算表满
+static constexpr size_t MAX_PROBE = 16;
+// 栈帧数上限：信号处理函数在被中断的协程栈上先把栈帧收集到局部数组里
+static constexpr uint32_t MAX_DEPTH = 128;
+
+void free_table(ProfThread* t) {
+    delete[] t->slots;
+    delete[] t->frames;
+    t->slots = nullptr;
+    t->frames = nullptr;
+}
+
+// 按当前参数准备空表，调用方持有 State().mutex，且该线程的信号处理函数不会访问表
+void reset_table(ProfThread* t, const Profiler::Options& options) {
+    size_t size = 1;
+    while(size < options.table_size) {
+        size <<= 1;
+    }
+    if(!t->slots || t->mask + 1 != size || t->max_depth != options.max_depth) {
+        free_table(t);
+        t->slots = new SampleSlot[size];
+        t->frames = new uintptr_t[size * options.max_depth];
+        t->mask = size - 1;
+        t->max_depth = options.max_depth;
+    } else {
+        for(size_t i = 0; i <= t->mask; ++i) {
+            t->slots[i].hash.store(0, std::memory_order_relaxed);
+            t->slots[i].count.store(0, std::memory_order_relaxed);
+        }
+    }
+    t->samples.store(0, std::memory_order_relaxed);
+    t->dropped.store(0, std::memory_order_relaxed);
+}
+
+// 等线程正在执行的信号处理函数结束。调用前已经清除了 g_prof_enabled 或删除了定时器
+void wait_idle(ProfThread* t) {
+    while(t->busy.load(std::memory_order_seq_cst)) {
+        cpu_relax();
+    }
+}
+
+bool arm(ProfThread* t, uint32_t frequency) {
+    clockid_t clock;
+    if(pthread_getcpuclockid(t->handle, &clock) != 0) {
+        return false;
+    }
+    sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = t->tid;
+    if(timer_create(clock, &sev, &t->timer) != 0) {
+        return false;
+    }
+    uint64_t period_ns = 1000000000ull / frequency;
+    itimerspec its;
+    its.it_interval.tv_sec = period_ns / 1000000000ull;
+    its.it_interval.tv_nsec = period_ns % 1000000000ull;
+    its.it_value = its.it_interval;
+    if(timer_settime(t->timer, 0, &its, nullptr) != 0) {
+        timer_delete(t->timer);
+        return false;
+    }
+    t->armed = true;
+    return true;
+}
+
+void disarm(ProfThread* t) {
+    if(t->armed) {
+        timer_delete(t->timer);
+        t->armed = false;
+    }
+}
+
+// 取被中断处的 pc/fp/sp，不支持的平台返回false
+bool context_regs(void* ucv, uintptr_t& pc, uintptr_t& fp, uintptr_t& sp) {
+    ucontext_t* uc = (ucontext_t*)ucv;
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+    return true;
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+    sp = uc->uc_mcontext.sp;
+    return true;
+#else
+    (void)uc;
+    pc = fp = sp = 0;
+    return false;
+#endif
+}
+
+// 沿帧指针回溯：每一帧 [fp] 为上一帧的 fp，[fp + 8] 为返回地址。
+// fp 必须落在 [sp, hi) 内且严格递增，栈上这一段一定是映射了的，读不到非法地址
+uint32_t walk_frames(uintptr_t pc, uintptr_t fp, uintptr_t sp, const char* lo, const char* hi,
+                     uintptr_t* out, uint32_t max_depth) {
+    uint32_t depth = 0;
+    out[depth++] = pc;
+    if(!lo || sp < (uintptr_t)lo || sp >= (uintptr_t)hi) {
+        // 正在切换协程（sp 与登记的协程不符）或者不知道栈的范围：只记最内层一帧
+        return depth;
+    }
+    uintptr_t top = (uintptr_t)hi;
+    while(depth < max_depth && fp >= sp && fp + 2 * sizeof(uintptr_t) <= top && (fp & (sizeof(uintptr_t) - 1)) == 0) {
+        uintptr_t* frame = (uintptr_t*)fp;
+        uintptr_t ret = frame[1];
+        if(!ret) {
+            break;
+        }
+        out[depth++] = ret;
+        uintptr_t next = frame[0];
+        if(next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+uint64_t hash_sample(const char* label, uint32_t kind, const uintptr_t* frames, uint32_t depth) {
+    uint64_t h = 0xcbf29ce484222325ull ^ (uintptr_t)label ^ ((uint64_t)kind << 56);
+    for(uint32_t i = 0; i < depth; ++i) {
+        h ^= frames[i];
+        h *= 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    return h ? h: 1;
+}
+
+// 在本线程的信号处理函数中执行：只读写本线程的表
+void record(ProfThread* t, void* uc) {
+    uintptr_t pc, fp, sp;
+    if(!context_regs(uc, pc, fp, sp)) {
+        return;
+    }
+    Fiber::Sample fs;
+    const char* label = nullptr;
+    uint32_t kind = KIND_SCHEDULER;
+    const char* lo = t->stack_lo;
+    const char* hi = t->stack_hi;
+    if(Fiber::SampleCurrent(fs)) {
+        label = fs.label;
+        kind = fs.task ? KIND_TASK: KIND_SCHEDULER;
+        if(fs.stack_hi) {
+            lo = fs.stack_lo;
+            hi = fs.stack_hi;
+        }
+    }
+    uintptr_t frames[MAX_DEPTH];
+    uint32_t depth = walk_frames(pc, fp, sp, lo, hi, frames, std::min(t->max_depth, MAX_DEPTH));
+    uint64_t h = hash_sample(label, kind, frames, depth);
+    t->samples.fetch_add(1, std::memory_order_relaxed);
+    for(size_t i = 0; i < MAX_PROBE; ++i) {
+        size_t idx = (h + i) & t->mask;
+        SampleSlot& slot = t->slots[idx];
+        uintptr_t* slot_frames = t->frames + idx * t->max_depth;
+        uint64_t cur = slot.hash.load(std::memory_order_relaxed);
+        if(cur == 0) {
+            slot.label = label;
+            slot.kind = kind;
+            slot.depth = depth;
+            memcpy(slot_frames, frames, depth * sizeof(uintptr_t));
+            slot.count.store(1, std::memory_order_relaxed);
+            slot.hash.store(h, std::memory_order_release);
+            return;
+        }
+        if(cur == h && slot.label == label && slot.kind == kind && slot.depth == depth
+            && memcmp(slot_frames, frames, depth * sizeof(uintptr_t)) == 0) {
+            // 只有本线程写，不需要读改写
+            slot.count.store(slot.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    t->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void on_sigprof(int, siginfo_t*, void* uc) {
+    ProfThread* t = t_prof;
+    if(!t) {
+        return;
+    }
+    int saved_errno = errno;
+    // 先置 busy 再检查开关，与 Stop() 的先关开关再等 busy 配对
+    t->busy.store(true, std::memory_order_seq_cst);
+    if(g_prof_enabled.load(std::memory_order_seq_cst) && t->slots) {
+        record(t, uc);
+    }
+    t->busy.store(false, std::memory_order_release);
+    errno = saved_errno;
+}
+
+bool install_handler(ProfState& st) {
+    if(st.handler_installed) {
+        return true;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = &on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGPROF, &sa, nullptr) != 0) {
+        return false;
+    }
+    st.handler_installed = true;
+    return true;
+}
+
+std::string symbolize(uintptr_t pc) {
+    Dl_info info;
+    if(dladdr((void*)pc, &info)) {
+        if(info.dli_sname) {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            std::string name = status == 0 && demangled ? demangled: info.dli_sname;
+            free(demangled);
+            return name;
+        }
+        if(info.dli_fname) {
+            const char* base = strrchr(info.dli_fname, '/');
+            std::stringstream ss;
+            ss << (base ? base + 1: info.dli_fname) << "+0x" << std::hex << (pc - (uintptr_t)info.dli_fbase);
+            return ss.str();
+        }
+    }
+    std::stringstream ss;
+    ss << "0x" << std::hex << pc;
+    return ss.str();
+}
+
+}
+
+std::string Profiler::Stats::toString() const {
+    std::stringstream ss;
+    ss << "samples=" << samples << " dropped=" << dropped << " threads=" << threads << " stacks=" << stacks;
+    return ss.str();
+}
+
+bool Profiler::Start() {
+    return Start(Options());
+}
+
+bool Profiler::Start(const Options& options) {
+    if(options.frequency == 0 || options.frequency > 10000 || options.max_depth == 0 || options.max_depth > MAX_DEPTH
+        || options.table_size == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    ProfState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    if(st.running) {
+        errno = EBUSY;
+        return false;
+    }
+    if(!install_handler(st)) {
+        return false;
+    }
+    st.options = options;
+    // 已经退出的线程的样本属于上一次采样
+    std::vector<ProfThread*> live;
+    for(ProfThread* t: st.threads) {
+        if(t->alive) {
+            reset_table(t, options);
+            live.push_back(t);
+        } else {
+            free_table(t);
+            delete t;
+        }
+    }
+    st.threads.swap(live);
+    g_prof_enabled.store(true, std::memory_order_seq_cst);
+    for(ProfThread* t: st.threads) {
+        if(!arm(t, options.frequency)) {
+            SYLAR_LOG_WARN() << "Profiler::Start() arm timer failed, tid=" << t->tid << " errno=" << errno;
+        }
+    }
+    st.running = true;
+    return true;
+}
+
+void Profiler::Stop() {
+    ProfState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    if(!st.running) {
+        return;
+    }
+    g_prof_enabled.store(false, std::memory_order_seq_cst);
+    for(ProfThread* t: st.threads) {
+        disarm(t);
+    }
+    for(ProfThread* t: st.threads) {
+        wait_idle(t);
+    }
+    st.running = false;
+}
+
+bool Profiler::IsRunning() {
+    ProfState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    return st.running;
+}
+
+void Profiler::Clear() {
+    ProfState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    // 暂时关掉开关，等各线程的信号处理函数都退出再清表
+    bool was = g_prof_enabled.exchange(false, std::memory_order_seq_cst);
+    for(ProfThread* t: st.threads) {
+        wait_idle(t);
+    }
+    for(ProfThread* t: st.threads) {
+        if(t->slots) {
+            reset_table(t, st.options);
+        }
+    }
+    g_prof_enabled.store(was, std::memory_order_seq_cst);
+}
+
+void Profiler::RegisterThread() {
+    if(t_prof) {
+        return;
+    }
+    ProfThread* t = new ProfThread;
+    t->tid = Thread::GetThreadId();
+    t->handle = pthread_self();
+    t->name = Thread::GetName();
+    pthread_attr_t attr;
+    if(pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void* addr = nullptr;
+        size_t size = 0;
+        if(pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            t->stack_lo = (const char*)addr;
+            t->stack_hi = t->stack_lo + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    ProfState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    if(st.running) {
+        reset_table(t, st.options);
+    }
+    // 先让信号处理函数能找到它，再开定时器
+    t_prof = t;
+    st.threads.push_back(t);
+    if(st.running && !arm(t, st.options.frequency)) {
+        SYLAR_LOG_WARN() << "Profiler::RegisterThread() arm timer failed, tid=" << t->tid << " errno=" << errno;
+    }
+}
+
+void Profiler::UnregisterThread() {
+    ProfThread* t = t_prof;
+    if(!t) {
+        return;
+    }
+    ProfState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    disarm(t);
+    // 信号处理函数只在本线程上执行，此时不会在运行
+    t_prof = nullptr;
+    t->alive = false;
+    if(!t->slots) {
+        for(size_t i = 0; i < st.threads.size(); ++i) {
+            if(st.threads[i] == t) {
+                st.threads.erase(st.threads.begin() + i);
+                break;
+            }
+        }
+        delete t;
+    }
+}
+
+std::string Profiler::FoldedStacks(bool by_thread) {
+    ProfState& st = State();
+    std::map<std::string, uint64_t> folded;
+    std::unordered_map<uintptr_t, std::string> names;
+    std::lock_guard<std::mutex> lock(st.mutex);
+    for(ProfThread* t: st.threads) {
+        if(!t->slots) {
+            continue;
+        }
+        for(size_t i = 0; i <= t->mask; ++i) {
+            SampleSlot& slot = t->slots[i];
+            if(!slot.hash.load(std::memory_order_acquire)) {
+                continue;
+            }
+            uint64_t count = slot.count.load(std::memory_order_relaxed);
+            if(!count) {
+                continue;
+            }
+            std::string key;
+            if(by_thread) {
+                key = (t->name.empty() ? "thread-" + std::to_string(t->tid): t->name) + ";";
+            }
+            key += slot.label ? slot.label: (slot.kind == KIND_TASK ? "[task]": "[scheduler]");
+            const uintptr_t* frames = t->frames + i * t->max_depth;
+            // 最外层在前；除最内层外都是返回地址，减1落在调用指令内，解析出的才是调用方所在的函数
+            for(uint32_t d = slot.depth; d-- > 0;) {
+                uintptr_t pc = d ? frames[d] - 1: frames[d];
+                auto it = names.find(pc);
+                if(it == names.end()) {
+                    it = names.emplace(pc, symbolize(pc)).first;
+                }
+                key += ";";
+                key += it->second;
+            }
+            folded[key] += count;
+        }
+    }
+    std::stringstream ss;
+    for(auto& i: folded) {
+        ss << i.first << " " << i.second << "\n";
+    }
+    return ss.str();
+}
+
+bool Profiler::WriteFolded(const std::string& path, bool by_thread) {
+    std::ofstream out(path, std::ios::trunc);
+    if(!out) {
+        return false;
+    }
+    out << FoldedStacks(by_thread);
+    return (bool)out;
+}
+
+Profiler::Stats Profiler::GetStats() {
+    ProfState& st = State();
+    Stats stats;
+    std::lock_guard<std::mutex> lock(st.mutex);
+    stats.threads = st.threads.size();
+    for(ProfThread* t: st.threads) {
+        stats.samples += t->samples.load(std::memory_order_relaxed);
+        stats.dropped += t->dropped.load(std::memory_order_relaxed);
+        if(!t->slots) {
+            continue;
+        }
+        for(size_t i = 0; i <= t->mask; ++i) {
+            if(t->slots[i].hash.load(std::memory_order_acquire)) {
+                ++stats.stacks;
+            }
+        }
+    }
+    return stats;
+}
+
+const char* Profiler::InternLabel(const std::string& label) {
+    ProfState& st = State();
+    std::lock_guard<std::mutex> lock(st.label_mutex);
+    // 节点不会移动也不会释放，c_str() 一直有效
+    return st.labels.insert(label).first->c_str();
+}
+
+TaskLabelScope::TaskLabelScope(const char* label) {
+    Fiber* f = Fiber::Current();
+    m_saved = f->getLabel();
+    f->setLabel(label);
+}
+
+TaskLabelScope::~TaskLabelScope() {
+    Fiber::Current()->setLabel(m_saved);
+}
+
+}
@@ -0,0 +1,101 @@
+#ifndef __SYLAR_PROFILER_H__
+#define __SYLAR_PROFILER_H__
+
+// 采样分析器：按任务标签和调用栈统计CPU时间，导出为折叠栈（flamegraph.pl、speedscope、inferno 都能直接读）
+//
+// perf 之类的分析器看到的调用栈底都是 Scheduler::run / Fiber::MainFunc，分不出是哪一类请求在耗CPU。
+// 这里每个调度线程（Scheduler::run 自动登记，其他线程可以调用 RegisterThread）各有一个按本线程CPU时间计时的
+// timer_create 定时器，到期时给本线程发 SIGPROF。信号处理函数记下当时的协程标签和调用栈，
+// 累加到本线程自己的开放寻址表里：只有本线程写，不加锁、不分配内存；导出时其他线程只读
+// - 任务标签是协程上的一个字符串指针（Fiber::setLabel）：新协程继承创建它的协程的标签，
+//   回调任务继承提交它的协程的标签，所以在 TaskLabelScope 里 scheduleLock 或创建协程就给任务打上了标签，
+//   任务运行中也可以随时改（例如解析出请求路径之后）。HttpServer 自动用路由路径作为处理函数的标签
+// - 没有标签的样本按 [task]（调度器管理的子协程）和 [scheduler]（调度协程、idle、线程主协程）归类
+// - 调用栈沿帧指针回溯，只在当前协程的栈（或线程栈）范围内走，不会读到未映射的内存。
+//   需要用 -fno-omit-frame-pointer 编译才有完整的栈，否则大多只有最内层的一帧；
+//   函数名用 dladdr 解析，静态函数和没有导出的符号需要 -rdynamic，解析不出时输出 模块+偏移，可以再用 addr2line 转换
+// - 同一个标签和栈只占表中的一项，表满之后新的栈计入 dropped
+// - SIGPROF 处理函数安装后不再卸载（之后迟到的信号直接忽略）。不要与其他使用 SIGPROF 的分析器同时使用
+// - glibc 2.34 之前 timer_create 在 librt 中，需要链接 -lrt
+//
+//   sylar::Profiler::Start();
+//   {
+//       sylar::TaskLabelScope label("rpc:GetUser");
+//       iom.scheduleLock([] { ... });                 // 这个任务及它派生的任务都带着 rpc:GetUser
+//   }
+//   ...
+//   sylar::Profiler::Stop();
+//   sylar::Profiler::WriteFolded("cpu.folded");      // flamegraph.pl cpu.folded > cpu.svg
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sylar {
+
+class Profiler {
+public:
+    struct Options {
+        // 每个线程每秒CPU时间的采样次数
+        uint32_t frequency = 99;
+        // 每个样本最多记录的栈帧数，不超过128
+        uint32_t max_depth = 48;
+        // 每个线程聚合表的项数（向上取整到2的幂）
+        size_t table_size = 4096;
+    };
+
+    struct Stats {
+        // 已记录的样本数
+        uint64_t samples = 0;
+        // 表满没有记下的样本数
+        uint64_t dropped = 0;
+        // 登记过的线程数（包括已经退出、样本还保留着的）
+        size_t threads = 0;
+        // 不同的（线程、标签、栈）组合数
+        size_t stacks = 0;
+
+        std::string toString() const;
+    };
+
+    // 开始采样，清除之前的样本。已经在采样或参数无效时返回false并设置errno
+    static bool Start(const Options& options);
+    static bool Start();
+    // 停止采样，样本保留到 Clear() 或下一次 Start()
+    static void Stop();
+    static bool IsRunning();
+
+    // 丢弃已有的样本，采样中也可以调用
+    static void Clear();
+
+    // 折叠栈：每行为 "标签;外层函数;...;内层函数 样本数"。by_thread 为true时最外层再加一级线程名
+    static std::string FoldedStacks(bool by_thread = false);
+    // 失败返回false
+    static bool WriteFolded(const std::string& path, bool by_thread = false);
+
+    static Stats GetStats();
+
+    // 登记/注销当前线程。Scheduler::run 已经在进出时调用；采样中登记的线程立即开始采样。
+    // 线程退出前必须注销（定时器按线程id发信号）。注销后样本保留
+    static void RegisterThread();
+    static void UnregisterThread();
+
+    // 返回一个与 label 内容相同、一直有效的字符串，相同内容返回同一个指针。用于运行时拼出来的标签
+    static const char* InternLabel(const std::string& label);
+};
+
+// 在作用域内把当前协程的标签换成 label，离开时恢复。label 必须一直有效
+class TaskLabelScope {
+public:
+    explicit TaskLabelScope(const char* label);
+    ~TaskLabelScope();
+
+    TaskLabelScope(const TaskLabelScope&) = delete;
+    TaskLabelScope& operator=(const TaskLabelScope&) = delete;
+
+private:
+    const char* m_saved;
+};
+
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef __SYLAR_REF_PTR_H__
+#define __SYLAR_REF_PTR_H__
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace sylar {
+
+// 侵入式引用计数基类
+// 计数直接放在对象内部：没有单独的控制块，也没有 enable_shared_from_this 的弱引用，
+// 从裸指针重新得到一个引用（RefPtr<T>(raw)）只是一次原子加，不需要 weak_ptr::lock 的CAS循环。
+// 派生类通过 RefPtr<T> 管理生命周期，计数归零时用 delete 销毁派生类对象。
+class RefCounted {
+public:
+    RefCounted() = default;
+    RefCounted(const RefCounted&) = delete;
+    RefCounted& operator=(const RefCounted&) = delete;
+
+    void addRef() const {
+        m_refCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 返回true表示这是最后一个引用，调用方负责销毁对象
+    bool releaseRef() const {
+        return m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    // 当前的引用数量，只适合用于判断“是否只有我持有”
+    long getRefCount() const {
+        return m_refCount.load(std::memory_order_acquire);
+    }
+
+protected:
+    ~RefCounted() = default;
+
+private:
+    mutable std::atomic<long> m_refCount{0};
+};
+
+// 侵入式智能指针，接口与 std::shared_ptr 的常用部分保持一致
+template<class T>
+class RefPtr {
+public:
+    RefPtr() noexcept {}
+
+    RefPtr(std::nullptr_t) noexcept {}
+
+    // 可以从裸指针构造任意多次，引用都记在对象本身上
+    explicit RefPtr(T* p): m_ptr(p) {
+        if(m_ptr) {
+            m_ptr->addRef();
+        }
+    }
+
+    RefPtr(const RefPtr& other): RefPtr(other.m_ptr) {}
+
+    RefPtr(RefPtr&& other) noexcept: m_ptr(other.m_ptr) {
+        other.m_ptr = nullptr;
+    }
+
+    ~RefPtr() {
+        release();
+    }
+
+    RefPtr& operator=(const RefPtr& other) {
+        RefPtr(other).swap(*this);
+        return *this;
+    }
+
+    RefPtr& operator=(RefPtr&& other) noexcept {
+        RefPtr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    RefPtr& operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    void reset() noexcept {
+        release();
+        m_ptr = nullptr;
+    }
+
+    void reset(T* p) {
+        RefPtr(p).swap(*this);
+    }
+
+    void swap(RefPtr& other) noexcept {
+        std::swap(m_ptr, other.m_ptr);
+    }
+
+    T* get() const noexcept {
+        return m_ptr;
+    }
+
+    T& operator*() const noexcept {
+        return *m_ptr;
+    }
+
+    T* operator->() const noexcept {
+        return m_ptr;
+    }
+
+    explicit operator bool() const noexcept {
+        return m_ptr != nullptr;
+    }
+
+    long use_count() const {
+        return m_ptr ? m_ptr->getRefCount(): 0;
+    }
+
+    friend bool operator==(const RefPtr& a, const RefPtr& b) noexcept { return a.m_ptr == b.m_ptr; }
+    friend bool operator!=(const RefPtr& a, const RefPtr& b) noexcept { return a.m_ptr != b.m_ptr; }
+    friend bool operator==(const RefPtr& a, std::nullptr_t) noexcept { return !a.m_ptr; }
+    friend bool operator!=(const RefPtr& a, std::nullptr_t) noexcept { return a.m_ptr != nullptr; }
+
+private:
+    void release() noexcept {
+        if(m_ptr && m_ptr->releaseRef()) {
+            delete m_ptr;
+        }
+    }
+
+private:
+    T* m_ptr = nullptr;
+};
+
+}
+
+#endif
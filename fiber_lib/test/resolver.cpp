@@ -0,0 +1,542 @@
+#include "resolver.h"
+#include "hook.h"
+#include "ioscheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <ctype.h>
+#include <poll.h>
+#include <string.h>
+
+namespace sylar {
+
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t remaining_ms(uint64_t deadline) {
+    uint64_t now = now_ms();
+    return now >= deadline ? 0: deadline - now;
+}
+
+static std::string lower(const std::string& s) {
+    std::string r(s);
+    for(char& c: r) {
+        if(c >= 'A' && c <= 'Z') {
+            c = c - 'A' + 'a';
+        }
+    }
+    return r;
+}
+
+socklen_t IpAddr::toSockaddr(uint16_t port, sockaddr_storage& out) const {
+    memset(&out, 0, sizeof(out));
+    if(family == AF_INET) {
+        sockaddr_in* sin = (sockaddr_in*)&out;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr = v4;
+        return sizeof(sockaddr_in);
+    }
+    sockaddr_in6* sin6 = (sockaddr_in6*)&out;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    sin6->sin6_addr = v6;
+    return sizeof(sockaddr_in6);
+}
+
+// 数字地址转成 IpAddr，不是数字地址返回false
+static bool parse_ip(const std::string& s, IpAddr& out) {
+    if(inet_pton(AF_INET, s.c_str(), &out.v4) == 1) {
+        out.family = AF_INET;
+        return true;
+    }
+    if(inet_pton(AF_INET6, s.c_str(), &out.v6) == 1) {
+        out.family = AF_INET6;
+        return true;
+    }
+    return false;
+}
+
+static bool same_addr(const IpAddr& a, const IpAddr& b) {
+    if(a.family != b.family) {
+        return false;
+    }
+    return a.family == AF_INET ? a.v4.s_addr == b.v4.s_addr: memcmp(&a.v6, &b.v6, sizeof(a.v6)) == 0;
+}
+
+Resolver* Resolver::GetDefault() {
+    // 与 FdManager 一样不释放：hook 的 getaddrinfo 在进程退出前的任何时刻都可能用到它
+    static Resolver* s_resolver = new Resolver();
+    return s_resolver;
+}
+
+Resolver::Resolver(const std::string& resolv_conf, const std::string& hosts) {
+    // 配置文件很小，直接读。开着 hook 时普通文件的 read 会卸载到线程池、挂起协程，
+    // 而 GetDefault 的静态初始化期间挂起会让同一线程上的其他调用者卡在初始化锁上
+    bool hook = is_hook_enable();
+    set_hook_enable(false);
+    loadResolvConf(resolv_conf);
+    loadHosts(hosts);
+    set_hook_enable(hook);
+}
+
+void Resolver::loadResolvConf(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    while(std::getline(in, line)) {
+        std::istringstream ss(line);
+        std::string key;
+        if(!(ss >> key) || key[0] == '#' || key[0] == ';') {
+            continue;
+        }
+        if(key == "nameserver") {
+            std::string addr;
+            // 与 glibc 一样最多使用3个（MAXNS）
+            if(!(ss >> addr) || m_servers.size() >= 3) {
+                continue;
+            }
+            unsigned scope = 0;
+            size_t pct = addr.find('%');
+            if(pct != std::string::npos) {
+                scope = if_nametoindex(addr.substr(pct + 1).c_str());
+                addr.resize(pct);
+            }
+            IpAddr ip;
+            if(parse_ip(addr, ip)) {
+                sockaddr_storage ss_addr;
+                ip.toSockaddr(53, ss_addr);
+                if(ip.family == AF_INET6) {
+                    ((sockaddr_in6*)&ss_addr)->sin6_scope_id = scope;
+                }
+                m_servers.push_back(ss_addr);
+            }
+        } else if(key == "search" || key == "domain") {
+            // 后出现的 search / domain 覆盖前面的
+            m_search.clear();
+            std::string domain;
+            while(ss >> domain) {
+                m_search.push_back(lower(domain));
+            }
+        } else if(key == "options") {
+            std::string opt;
+            while(ss >> opt) {
+                size_t colon = opt.find(':');
+                if(colon == std::string::npos) {
+                    continue;
+                }
+                int v = atoi(opt.c_str() + colon + 1);
+                std::string name = opt.substr(0, colon);
+                // 上限同 glibc
+                if(name == "timeout") {
+                    m_timeoutS = std::max(1, std::min(v, 30));
+                } else if(name == "attempts") {
+                    m_attempts = std::max(1, std::min(v, 5));
+                } else if(name == "ndots") {
+                    m_ndots = std::max(0, std::min(v, 15));
+                }
+            }
+        }
+    }
+    // 没有配置时与 glibc 一样使用本机
+    if(m_servers.empty()) {
+        IpAddr ip;
+        parse_ip("127.0.0.1", ip);
+        sockaddr_storage ss_addr;
+        ip.toSockaddr(53, ss_addr);
+        m_servers.push_back(ss_addr);
+    }
+}
+
+void Resolver::loadHosts(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    while(std::getline(in, line)) {
+        size_t hash = line.find('#');
+        if(hash != std::string::npos) {
+            line.resize(hash);
+        }
+        std::istringstream ss(line);
+        std::string addr, name;
+        IpAddr ip;
+        if(!(ss >> addr) || !parse_ip(addr, ip)) {
+            continue;
+        }
+        while(ss >> name) {
+            std::vector<IpAddr>& addrs = m_hosts[lower(name)];
+            if(std::none_of(addrs.begin(), addrs.end(), [&ip](const IpAddr& a) { return same_addr(a, ip); })) {
+                addrs.push_back(ip);
+            }
+        }
+    }
+}
+
+// 构造查询报文（要求递归），名字不合法（空标签、标签超过63字节、总长超过255）时返回false
+static bool build_query(const std::string& name, uint16_t id, uint16_t qtype, std::vector<uint8_t>& out) {
+    uint8_t header[12] = {(uint8_t)(id >> 8), (uint8_t)id, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+    out.assign(header, header + sizeof(header));
+    size_t start = 0;
+    while(start < name.size()) {
+        size_t dot = name.find('.', start);
+        if(dot == std::string::npos) {
+            dot = name.size();
+        }
+        size_t n = dot - start;
+        if(n == 0 || n > 63) {
+            return false;
+        }
+        out.push_back((uint8_t)n);
+        out.insert(out.end(), name.begin() + start, name.begin() + dot);
+        start = dot + 1;
+    }
+    out.push_back(0);
+    if(out.size() - sizeof(header) > 255) {
+        return false;
+    }
+    uint8_t tail[4] = {(uint8_t)(qtype >> 8), (uint8_t)qtype, 0, 1};
+    out.insert(out.end(), tail, tail + sizeof(tail));
+    return true;
+}
+
+// 跳过 pos 处的名字（可能以压缩指针结尾），越界返回false
+static bool skip_name(const uint8_t* p, size_t len, size_t& pos) {
+    while(pos < len) {
+        uint8_t c = p[pos];
+        if(c == 0) {
+            ++pos;
+            return true;
+        }
+        if((c & 0xC0) == 0xC0) {
+            pos += 2;
+            return pos <= len;
+        }
+        if(c & 0xC0) {
+            return false;
+        }
+        pos += 1 + c;
+    }
+    return false;
+}
+
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// 解析 query 的回答。返回-1：不是对它的回答（id 或问题不一致），丢弃继续等；
+// 0：服务器出错（SERVFAIL、REFUSED 等），换下一个服务器；1：得到结果（包括名字不存在）
+static int parse_answer(const uint8_t* p, size_t len, const std::vector<uint8_t>& query, uint16_t qtype,
+                        Resolver::Status& status, std::vector<IpAddr>& addrs, uint32_t& ttl) {
+    size_t qlen = query.size() - 12;
+    if(len < query.size() || p[0] != query[0] || p[1] != query[1] || !(p[2] & 0x80) || get16(p + 4) != 1) {
+        return -1;
+    }
+    // 服务器可能改变问题中名字的大小写
+    for(size_t i = 12; i < query.size(); ++i) {
+        if(tolower(p[i]) != tolower(query[i])) {
+            return -1;
+        }
+    }
+    int rcode = p[3] & 0x0F;
+    if(rcode == 3) {
+        status = Resolver::NOT_FOUND;
+        ttl = Resolver::NEGATIVE_TTL_S;
+        return 1;
+    }
+    if(rcode != 0) {
+        return 0;
+    }
+    addrs.clear();
+    ttl = Resolver::MAX_TTL_S;
+    size_t pos = 12 + qlen;
+    // 回答里可能先是 CNAME 链，再是别名的地址记录：只取请求类型的记录，TTL 取链上的最小值
+    for(uint16_t an = get16(p + 6); an > 0; --an) {
+        if(!skip_name(p, len, pos) || pos + 10 > len) {
+            break;
+        }
+        uint16_t type = get16(p + pos);
+        uint16_t cls = get16(p + pos + 2);
+        uint32_t rttl = get32(p + pos + 4);
+        uint16_t rdlen = get16(p + pos + 8);
+        pos += 10;
+        if(pos + rdlen > len) {
+            // 截断的回答：用已经完整的部分
+            break;
+        }
+        if(cls == 1 && (type == qtype || type == 5)) {
+            ttl = std::min(ttl, rttl);
+        }
+        if(cls == 1 && type == qtype) {
+            IpAddr ip;
+            if(qtype == 1 && rdlen == 4) {
+                ip.family = AF_INET;
+                memcpy(&ip.v4, p + pos, 4);
+                addrs.push_back(ip);
+            } else if(qtype == 28 && rdlen == 16) {
+                ip.family = AF_INET6;
+                memcpy(&ip.v6, p + pos, 16);
+                addrs.push_back(ip);
+            }
+        }
+        pos += rdlen;
+    }
+    if(addrs.empty()) {
+        // 名字存在但没有这种记录
+        status = Resolver::NOT_FOUND;
+        ttl = Resolver::NEGATIVE_TTL_S;
+    } else {
+        status = Resolver::OK;
+    }
+    return 1;
+}
+
+// 协程恢复后可能换了线程，系统调用和读 errno 放在单独的（不内联的）函数里
+__attribute__((noinline)) static ssize_t dns_recv(int fd, void* buf, size_t len, int& err) {
+    ssize_t n = recv_f(fd, buf, len, 0);
+    err = n < 0 ? errno: 0;
+    return n;
+}
+
+void Resolver::exchange(const sockaddr_storage& server, const std::string& name, const QType* qtypes, Answer* answers, int n, uint64_t deadline) {
+    static thread_local std::mt19937 t_rng(std::random_device{}());
+    std::vector<uint8_t> queries[2];
+    int pending = 0;
+    for(int i = 0; i < n; ++i) {
+        if(answers[i].done) {
+            continue;
+        }
+        if(!build_query(name, (uint16_t)t_rng(), qtypes[i], queries[i])) {
+            answers[i].done = true;
+            answers[i].status = NOT_FOUND;
+            answers[i].ttl = 0;
+            queries[i].clear();
+            continue;
+        }
+        ++pending;
+    }
+    if(!pending) {
+        return;
+    }
+
+    // 不经过 hook：不依赖当前线程是否开启了 hook，直接用 waitEvent 挂起。
+    // connect 之后内核只把这个服务器发来的报文交给socket
+    int fd = socket_f(server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return;
+    }
+    socklen_t slen = server.ss_family == AF_INET ? sizeof(sockaddr_in): sizeof(sockaddr_in6);
+    IOManager* iom = IOManager::GetThis();
+    if(connect_f(fd, (const sockaddr*)&server, slen) == 0) {
+        for(int i = 0; i < n; ++i) {
+            if(!queries[i].empty()) {
+                send_f(fd, queries[i].data(), queries[i].size(), 0);
+            }
+        }
+        // 不带 EDNS 的 UDP 回答不超过512字节
+        uint8_t buf[1024];
+        while(pending > 0) {
+            int err = 0;
+            ssize_t r = dns_recv(fd, buf, sizeof(buf), err);
+            if(r >= 0) {
+                for(int i = 0; i < n; ++i) {
+                    if(queries[i].empty()) {
+                        continue;
+                    }
+                    Answer& ans = answers[i];
+                    int rt = parse_answer(buf, r, queries[i], qtypes[i], ans.status, ans.addrs, ans.ttl);
+                    if(rt >= 0) {
+                        ans.done = rt > 0;
+                        queries[i].clear();
+                        --pending;
+                        break;
+                    }
+                }
+                continue;
+            }
+            if(err == EINTR) {
+                continue;
+            }
+            // ECONNREFUSED：服务器地址上没有DNS服务
+            if(err != EAGAIN) {
+                break;
+            }
+            uint64_t left = remaining_ms(deadline);
+            if(!left) {
+                break;
+            }
+            if(iom) {
+                // ETIMEDOUT 或注册失败
+                if(iom->waitEvent(fd, IOManager::READ, left) != 0) {
+                    break;
+                }
+            } else {
+                pollfd pfd = {fd, POLLIN, 0};
+                if(poll_f(&pfd, 1, (int)std::min<uint64_t>(left, INT_MAX)) == 0) {
+                    break;
+                }
+            }
+        }
+        if(iom) {
+            iom->cancelAll(fd);
+        }
+    }
+    close_f(fd);
+}
+
+Resolver::Status Resolver::query(const std::string& name, int family, std::vector<IpAddr>& out, uint64_t deadline) {
+    QType qtypes[2];
+    int n = 0;
+    if(family != AF_INET6) {
+        qtypes[n++] = QTYPE_A;
+    }
+    if(family != AF_INET) {
+        qtypes[n++] = QTYPE_AAAA;
+    }
+    Answer answers[2];
+    bool cached[2] = {false, false};
+    uint64_t now = now_ms();
+    for(int i = 0; i < n; ++i) {
+        CacheEntry entry;
+        if(cacheGet(std::to_string(qtypes[i]) + " " + name, now, entry)) {
+            answers[i].done = cached[i] = true;
+            answers[i].status = entry.status;
+            answers[i].addrs.swap(entry.addrs);
+        }
+    }
+
+    auto all_done = [&]() {
+        return std::all_of(answers, answers + n, [](const Answer& a) { return a.done; });
+    };
+    // 与 glibc 相同的重试顺序：每一轮依次问每个服务器
+    for(int attempt = 0; attempt < m_attempts && !all_done(); ++attempt) {
+        for(size_t s = 0; s < m_servers.size() && !all_done(); ++s) {
+            if(!remaining_ms(deadline)) {
+                break;
+            }
+            exchange(m_servers[s], name, qtypes, answers, n, std::min(deadline, now_ms() + (uint64_t)m_timeoutS * 1000));
+        }
+    }
+
+    now = now_ms();
+    bool found = false;
+    bool done = true;
+    for(int i = 0; i < n; ++i) {
+        const Answer& ans = answers[i];
+        if(!ans.done) {
+            done = false;
+            continue;
+        }
+        if(!cached[i] && ans.ttl > 0) {
+            cachePut(std::to_string(qtypes[i]) + " " + name, CacheEntry{ans.status, ans.addrs, now + ans.ttl * 1000ull}, now);
+        }
+        if(ans.status == OK) {
+            found = true;
+            out.insert(out.end(), ans.addrs.begin(), ans.addrs.end());
+        }
+    }
+    // 一种记录有结果就算成功；都没有时只有全部得到回答才能断定名字不存在
+    return found ? OK: (done ? NOT_FOUND: FAILED);
+}
+
+Resolver::Status Resolver::resolve(const std::string& host, int family, std::vector<IpAddr>& out, uint64_t timeout_ms) {
+    out.clear();
+    std::string name = lower(host);
+    bool absolute = !name.empty() && name.back() == '.';
+    if(absolute) {
+        name.pop_back();
+    }
+    if(name.empty()) {
+        return NOT_FOUND;
+    }
+
+    auto it = m_hosts.find(name);
+    if(it != m_hosts.end()) {
+        for(int f: {AF_INET, AF_INET6}) {
+            for(const IpAddr& ip: it->second) {
+                if(ip.family == f && (family == AF_UNSPEC || family == f)) {
+                    out.push_back(ip);
+                }
+            }
+        }
+        if(!out.empty()) {
+            return OK;
+        }
+    }
+
+    if(timeout_ms == ~0ull) {
+        timeout_ms = (uint64_t)m_timeoutS * 1000 * m_attempts * m_servers.size();
+    }
+    uint64_t deadline = now_ms() + timeout_ms;
+
+    // search 域：名字中的点少于 ndots 时先试 search 域，否则先试名字本身
+    std::vector<std::string> candidates;
+    if(!absolute) {
+        bool first = std::count(name.begin(), name.end(), '.') >= m_ndots;
+        if(first) {
+            candidates.push_back(name);
+        }
+        for(const std::string& domain: m_search) {
+            candidates.push_back(name + "." + domain);
+        }
+        if(!first) {
+            candidates.push_back(name);
+        }
+    } else {
+        candidates.push_back(name);
+    }
+    for(const std::string& candidate: candidates) {
+        Status st = query(candidate, family, out, deadline);
+        // 服务器不回应时后面的名字也问不到，不再耗时间
+        if(st != NOT_FOUND) {
+            return st;
+        }
+    }
+    return NOT_FOUND;
+}
+
+void Resolver::flush() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cache.clear();
+}
+
+bool Resolver::cacheGet(const std::string& key, uint64_t now, CacheEntry& out) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_cache.find(key);
+    if(it == m_cache.end()) {
+        return false;
+    }
+    if(it->second.expire_ms <= now) {
+        m_cache.erase(it);
+        return false;
+    }
+    out = it->second;
+    return true;
+}
+
+void Resolver::cachePut(const std::string& key, const CacheEntry& entry, uint64_t now) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_cache.size() >= CACHE_MAX && !m_cache.count(key)) {
+        for(auto it = m_cache.begin(); it != m_cache.end();) {
+            if(it->second.expire_ms <= now) {
+                it = m_cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if(m_cache.size() >= CACHE_MAX) {
+            m_cache.clear();
+        }
+    }
+    m_cache[key] = entry;
+}
+
+}
@@ -0,0 +1,122 @@
+#ifndef __SYLAR_RESOLVER_H__
+#define __SYLAR_RESOLVER_H__
+
+// 协程版 DNS 解析
+//
+// glibc 的 getaddrinfo 在线程里同步收发 DNS 报文，域名服务器不回应时要等 resolv.conf 的 timeout × attempts
+// （默认10秒），整个工作线程都被阻塞。Resolver 自己构造查询，用非阻塞的 UDP socket 发出，
+// 等回答时通过 IOManager::waitEvent 挂起当前协程；不在 IOManager 中时阻塞在 poll 上。
+//
+// - 先查 /etc/hosts，再按 /etc/resolv.conf 的 nameserver / search / options（timeout、attempts、ndots）查询
+// - AF_UNSPEC 时 A 和 AAAA 两个查询从同一个socket并行发出
+// - 回答按记录的 TTL 缓存（所有线程共享，TTL 不超过 MAX_TTL_S），不存在的名字也缓存 NEGATIVE_TTL_S 秒
+// - 只走 UDP：回答被截断（TC）时使用已经收到的部分，不再用 TCP 重查
+//
+// 开启 hook 后 getaddrinfo 在 IOManager 的协程中自动使用它（见 hook.h），也可以直接调用：
+//   std::vector<sylar::IpAddr> addrs;
+//   if(sylar::Resolver::GetDefault()->resolve("example.com", AF_UNSPEC, addrs) == sylar::Resolver::OK) { ... }
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace sylar {
+
+// 解析得到的一个地址
+struct IpAddr {
+    // AF_INET 或 AF_INET6
+    int family;
+    union {
+        in_addr v4;
+        in6_addr v6;
+    };
+
+    // 转成带端口的 sockaddr（port 为主机字节序），返回地址长度
+    socklen_t toSockaddr(uint16_t port, sockaddr_storage& out) const;
+};
+
+class Resolver {
+public:
+    enum Status {
+        OK = 0,
+        // 名字不存在，或者没有所请求地址族的地址
+        NOT_FOUND,
+        // 域名服务器都没有回应（超时）或回答出错
+        FAILED,
+    };
+
+    // 缓存的 TTL 上限和不存在的名字的缓存时间（秒）
+    static constexpr uint32_t MAX_TTL_S = 300;
+    static constexpr uint32_t NEGATIVE_TTL_S = 10;
+    // 缓存的条目数上限，满时先清掉过期的，仍然满时清空
+    static constexpr size_t CACHE_MAX = 4096;
+
+    // 进程内共享的解析器，第一次调用时读取 /etc/resolv.conf 和 /etc/hosts
+    static Resolver* GetDefault();
+
+    // 按系统配置文件构造；路径可以换成测试用的文件
+    Resolver(const std::string& resolv_conf = "/etc/resolv.conf", const std::string& hosts = "/etc/hosts");
+
+    // 解析 host（不接受数字地址），family 为 AF_UNSPEC / AF_INET / AF_INET6。
+    // 结果中 IPv4 地址在前。timeout_ms 为整个解析的时限，默认按 resolv.conf 的 timeout × attempts
+    Status resolve(const std::string& host, int family, std::vector<IpAddr>& out, uint64_t timeout_ms = ~0ull);
+
+    // 清空缓存
+    void flush();
+
+    const std::vector<sockaddr_storage>& getServers() const { return m_servers; }
+
+private:
+    enum QType {
+        QTYPE_A = 1,
+        QTYPE_AAAA = 28,
+    };
+
+    // 一个名字一种记录的查询结果
+    struct Answer {
+        bool done = false;
+        Status status = FAILED;
+        std::vector<IpAddr> addrs;
+        uint32_t ttl = 0;
+    };
+
+    struct CacheEntry {
+        Status status;
+        std::vector<IpAddr> addrs;
+        uint64_t expire_ms;
+    };
+
+    void loadResolvConf(const std::string& path);
+    void loadHosts(const std::string& path);
+
+    // 查询一个完整的名字：先查缓存，缺的记录类型向域名服务器查询后放入缓存
+    Status query(const std::string& name, int family, std::vector<IpAddr>& out, uint64_t deadline);
+    // 在 server 上并行查询 n 种记录，回答到了的填入 answers 并置 done
+    void exchange(const sockaddr_storage& server, const std::string& name, const QType* qtypes, Answer* answers, int n, uint64_t deadline);
+
+    bool cacheGet(const std::string& key, uint64_t now, CacheEntry& out);
+    void cachePut(const std::string& key, const CacheEntry& entry, uint64_t now);
+
+private:
+    std::vector<sockaddr_storage> m_servers;
+    std::vector<std::string> m_search;
+    // resolv.conf options：单次查询的超时（秒）、每个服务器的尝试次数、名字中少于几个点时先试 search 域
+    int m_timeoutS = 5;
+    int m_attempts = 2;
+    int m_ndots = 1;
+
+    // /etc/hosts（名字为小写），构造时读一次
+    std::unordered_map<std::string, std::vector<IpAddr>> m_hosts;
+
+    std::mutex m_mutex;
+    // 键为记录类型 + 小写的完整名字
+    std::unordered_map<std::string, CacheEntry> m_cache;
+};
+
+}
+
+#endif
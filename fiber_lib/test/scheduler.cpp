@@ -1,10 +1,466 @@
 #include "scheduler.h"
+#include "log.h"
+#include "numa.h"
+#include "probe.h"
+#include "profiler.h"
+#include "trace.h"
 
-static bool debug = false;
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <execinfo.h>
+#include <functional>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sstream>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 namespace sylar {
 static thread_local Scheduler* t_scheduler = nullptr;
 
+// Chase-Lev 工作窃取双端队列（Lê et al. 2013 的 C11 内存序版本）
+// 只有所属线程在底部 push/pop（LIFO，刚提交的任务缓存还是热的），其他线程从顶部 steal（FIFO，偷最老的任务）。
+// 所属线程的 push 无原子读改写，pop 只有在与窃取者争最后一个元素时才需要CAS。
+// 数组在第一次push时才分配：工作线程绑定CPU后由它自己分配，内存落在本地节点上。
+class TaskDeque {
+public:
+    TaskDeque() {}
+
+    ~TaskDeque() {
+        delete m_array.load(std::memory_order_relaxed);
+        for(Array* a: m_retired) {
+            delete a;
+        }
+    }
+
+    // 仅所属线程调用
+    void push(void* x) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array* a = m_array.load(std::memory_order_relaxed);
+        if(!a) {
+            a = new Array(64);
+            m_array.store(a, std::memory_order_release);
+        } else if(b - t > (int64_t)a->mask) {
+            a = grow(a, t, b);
+        }
+        a->put(b, x);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // 仅所属线程调用，空时返回nullptr
+    void* pop() {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if(t > b) {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        void* x = a->get(b);
+        if(t == b) {
+            // 最后一个元素，和窃取者竞争
+            if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                x = nullptr;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    // 任意线程调用，空或竞争失败时返回nullptr
+    void* steal() {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if(t >= b) {
+            return nullptr;
+        }
+        Array* a = m_array.load(std::memory_order_acquire);
+        void* x = a->get(t);
+        if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return x;
+    }
+
+    // 近似长度，只用于判断是否需要唤醒其他线程、是否可以停止
+    size_t size() const {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? (size_t)(b - t): 0;
+    }
+
+private:
+    struct Array {
+        size_t mask;
+        std::atomic<void*>* slots;
+
+        explicit Array(size_t n): mask(n - 1), slots(new std::atomic<void*>[n]) {}
+        ~Array() {
+            delete[] slots;
+        }
+
+        void put(int64_t i, void* x) {
+            slots[i & mask].store(x, std::memory_order_relaxed);
+        }
+
+        void* get(int64_t i) {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+    };
+
+    Array* grow(Array* a, int64_t t, int64_t b) {
+        Array* na = new Array((a->mask + 1) * 2);
+        for(int64_t i = t; i < b; ++i) {
+            na->put(i, a->get(i));
+        }
+        // 窃取者可能还在读旧数组，旧数组推迟到队列析构时释放
+        m_retired.push_back(a);
+        m_array.store(na, std::memory_order_release);
+        return na;
+    }
+
+private:
+    // top 和 bottom 分别由窃取者和所属线程频繁写入，放在不同的cache line上
+    alignas(64) std::atomic<int64_t> m_top{0};
+    alignas(64) std::atomic<int64_t> m_bottom{0};
+    std::atomic<Array*> m_array{nullptr};
+    std::vector<Array*> m_retired;
+};
+
+// 工作线程的状态
+enum WorkerState {
+    // 下标空闲：线程已退出（或正在退出），不会再处理信箱
+    WORKER_FREE = 0,
+    WORKER_ACTIVE = 1,
+    // 被要求退出（retireWorkers），只处理绑定在它上面的剩余任务
+    WORKER_RETIRING = 2
+};
+
+struct WorkerQueue {
+    // 所属调度器，同一个线程先后属于不同调度器时用于区分
+    Scheduler* scheduler = nullptr;
+    // 线程状态（WorkerState）
+    std::atomic<int> state{WORKER_FREE};
+    // 线程已经从 run() 返回，下标可以交给新线程
+    std::atomic<bool> exited{false};
+    // 退出前是否已经迁移过任务，只由所属线程访问
+    bool migrated = false;
+    // 所在的NUMA节点，-1表示未指定；队列本身的内存分配在该节点上
+    int node = -1;
+    // 在调度器中的下标
+    int index = -1;
+    // 所属线程的id，线程开始运行前为-1
+    std::atomic<int> thread_id{-1};
+    // 所属线程正在 run() 中调度（主线程 use_caller 时只有 stop() 期间才进入）
+    std::atomic<bool> in_run{false};
+    // 未指定线程的任务，每个优先级一个
+    TaskDeque deque[Scheduler::PRIORITY_COUNT];
+    // 指定在本线程运行的任务（MPSC信箱）
+    // 生产者用CAS压入 inbox_head（后进先出的链表），消费者一次取走整条链表，反转后按优先级分到私有的FIFO链表中，
+    // 两边都是O(1)（摊还），生产者之间只在同一个cache line上竞争一次CAS，没有锁。
+    std::atomic<Scheduler::ScheduleTask*> inbox_head{nullptr};
+    Scheduler::ScheduleTask* inbox_local[Scheduler::PRIORITY_COUNT] = {};
+    Scheduler::ScheduleTask* inbox_tail[Scheduler::PRIORITY_COUNT] = {};
+    // 信箱中各优先级的任务数，只用于 getQueueDepth()
+    std::atomic<size_t> inbox_count[Scheduler::PRIORITY_COUNT] = {};
+    // run() 每取一次任务加1，定期优先检查全局队列和信箱，避免本地任务不断产生时饿死它们
+    uint32_t tick = 0;
+    // 加权轮转中各优先级本轮剩余的配额
+    uint32_t credits[Scheduler::PRIORITY_COUNT] = {};
+
+    // 线程正阻塞在等待中时记录等待方式（SleepMode），只有这时才需要定向唤醒
+    std::atomic<int> sleeping{0};
+    // park() 等待的futex，唤醒方先加1再 FUTEX_WAKE
+    std::atomic<uint32_t> park_seq{0};
+    // prepareWait() 传入的唤醒eventfd（SLEEP_EVENTFD 时使用），先于 sleeping 写入
+    std::atomic<int> wake_fd{-1};
+    // 所属线程，用于定向唤醒
+    pthread_t pthread;
+    // 阻塞等待期间使用的信号掩码：线程原本的掩码去掉唤醒信号
+    sigset_t wait_mask;
+    // 进入 run() 之前线程的信号掩码，退出时恢复
+    sigset_t saved_mask;
+
+    // 长时间运行检测（setWatchdog）：当前任务的开始时间（MonotonicNs，没有任务时为0）、协程id和任务序号，
+    // 由所属线程写入，后台线程读取
+    std::atomic<uint64_t> run_start_ns{0};
+    std::atomic<uint64_t> run_fiber_id{0};
+    std::atomic<uint64_t> run_seq{0};
+    // 当前任务的时间片已用完，由后台线程设置，maybe_yield() 检查
+    std::atomic<bool> yield_requested{false};
+    // 调用栈采样：后台线程置位 bt_requested 后发 SAMPLE_SIGNAL，信号处理函数在本线程上记录调用栈并置位 bt_ready
+    static const int MAX_BACKTRACE = 32;
+    void* bt_frames[MAX_BACKTRACE];
+    int bt_depth = 0;
+    std::atomic<bool> bt_requested{false};
+    std::atomic<bool> bt_ready{false};
+
+    // 本线程的统计数据（按线程分片），除 tickles_received 外只由所属线程写入
+    struct Stats {
+        Counter tasks_executed;
+        // 其中内联执行（STACK_INLINE，没有协程）的回调任务数
+        Counter inline_executed;
+        Counter steals;
+        Counter handoffs_out;
+        Counter handoffs_in;
+        Counter tickles_issued;
+        Counter epoll_waits;
+        Counter epoll_events;
+        Counter poll_ns;
+        Counter park_ns;
+        Counter wakeups;
+        Counter timer_wakeups;
+        Histogram queue_wait_ns;
+        Histogram run_ns;
+        Histogram events_per_wakeup;
+        // 由唤醒方写入，单独放在一个cache line上
+        alignas(64) std::atomic<uint64_t> tickles_received{0};
+    } stats;
+
+    // 任意线程调用
+    void pushInbox(Scheduler::ScheduleTask* t) {
+        inbox_count[t->priority].fetch_add(1, std::memory_order_relaxed);
+        Scheduler::ScheduleTask* head = inbox_head.load(std::memory_order_relaxed);
+        do {
+            t->next = head;
+        } while(!inbox_head.compare_exchange_weak(head, t, std::memory_order_seq_cst, std::memory_order_relaxed));
+    }
+
+    // 仅所属线程调用。spill 为true时把外部注入的任务（ScheduleTask::injected）转入本地双端队列
+    Scheduler::ScheduleTask* popInbox(int priority, bool spill = false) {
+        if(!inbox_local[priority]) {
+            if(!inbox_head.load(std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            // 取走整条链表，反转为先进先出后按优先级追加到各自的链表尾部
+            Scheduler::ScheduleTask* list = inbox_head.exchange(nullptr, std::memory_order_acquire);
+            Scheduler::ScheduleTask* fifo = nullptr;
+            while(list) {
+                Scheduler::ScheduleTask* next = list->next;
+                list->next = fifo;
+                fifo = list;
+                list = next;
+            }
+            while(fifo) {
+                Scheduler::ScheduleTask* next = fifo->next;
+                int p = fifo->priority;
+                fifo->next = nullptr;
+                if(spill && fifo->injected) {
+                    fifo->injected = false;
+                    deque[p].push(fifo);
+                    inbox_count[p].fetch_sub(1, std::memory_order_relaxed);
+                    fifo = next;
+                    continue;
+                }
+                if(inbox_tail[p]) {
+                    inbox_tail[p]->next = fifo;
+                } else {
+                    inbox_local[p] = fifo;
+                }
+                inbox_tail[p] = fifo;
+                fifo = next;
+            }
+        }
+        Scheduler::ScheduleTask* t = inbox_local[priority];
+        if(t) {
+            inbox_local[priority] = t->next;
+            if(!t->next) {
+                inbox_tail[priority] = nullptr;
+            }
+            t->next = nullptr;
+            inbox_count[priority].fetch_sub(1, std::memory_order_relaxed);
+        }
+        return t;
+    }
+
+    bool inboxEmpty() const {
+        for(auto t: inbox_local) {
+            if(t) {
+                return false;
+            }
+        }
+        return !inbox_head.load(std::memory_order_seq_cst);
+    }
+
+    // 队列按页单独分配，指定节点时物理页来自该节点
+    static void* operator new(size_t size, int node) {
+        void* p = Numa::AllocOnNode(size, node);
+        if(!p) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    static void operator delete(void* p, size_t size) {
+        Numa::FreeOnNode(p, size);
+    }
+
+    // 构造抛出异常时使用
+    static void operator delete(void* p, int) {
+        Numa::FreeOnNode(p, sizeof(WorkerQueue));
+    }
+
+    ~WorkerQueue() {
+        for(int p = 0; p < Scheduler::PRIORITY_COUNT; ++p) {
+            while(void* t = deque[p].pop()) {
+                delete (Scheduler::ScheduleTask*)t;
+            }
+            while(Scheduler::ScheduleTask* t = popInbox(p)) {
+                delete t;
+            }
+        }
+    }
+};
+
+// 长时间运行检测采样调用栈使用的信号，处理函数设置了 SA_RESTART，不会打断任务中的系统调用
+static int sample_signal() {
+    return SIGRTMIN + 4;
+}
+
+// 定向唤醒空闲线程使用的信号，默认 SIGRTMIN+3（实时信号没有系统或库约定的用途，不会和应用已有的处理函数冲突），
+// 可以在第一个调度线程启动前用 Scheduler::SetWakeupSignal() 换掉。
+// 工作线程平时屏蔽该信号，只有阻塞在 epoll_pwait 期间才放开：
+// 在检查信箱之后、进入 epoll_pwait 之前到达的信号会保持挂起，epoll_pwait 一开始就会被它打断，不会丢失唤醒。
+static std::mutex s_wakeup_mutex;
+static std::atomic<int> s_wakeup_signal{0};
+static bool s_wakeup_installed = false;
+
+static int wakeup_signal() {
+    int sig = s_wakeup_signal.load(std::memory_order_relaxed);
+    return sig ? sig: SIGRTMIN + 3;
+}
+
+static void wakeup_signal_handler(int) {
+}
+
+// 信号处理函数是进程级的，安装前检查该信号是否已被程序的其他部分占用
+static void install_wakeup_handler() {
+    std::lock_guard<std::mutex> lock(s_wakeup_mutex);
+    if(s_wakeup_installed) {
+        return;
+    }
+    int sig = wakeup_signal();
+    struct sigaction old;
+    if(sigaction(sig, nullptr, &old) == 0) {
+        bool custom = (old.sa_flags & SA_SIGINFO) ? old.sa_sigaction != nullptr
+                                                  : (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN);
+        if(custom) {
+            SYLAR_LOG_ERROR() << "Scheduler wakeup signal " << sig
+                              << " already has a handler installed, replacing it;"
+                              << " use Scheduler::SetWakeupSignal() to pick an unused signal";
+        }
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &wakeup_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    // 不设置 SA_RESTART：信号需要打断 epoll_pwait
+    sa.sa_flags = 0;
+    sigaction(sig, &sa, nullptr);
+    s_wakeup_installed = true;
+}
+
+bool Scheduler::SetWakeupSignal(int sig) {
+    if(sig <= 0 || sig >= NSIG || sig == SIGKILL || sig == SIGSTOP || sig == sample_signal()) {
+        errno = EINVAL;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(s_wakeup_mutex);
+    if(s_wakeup_installed) {
+        errno = EBUSY;
+        return false;
+    }
+    s_wakeup_signal.store(sig, std::memory_order_relaxed);
+    return true;
+}
+
+int Scheduler::GetWakeupSignal() {
+    return wakeup_signal();
+}
+
+// 当前线程所属的工作队列
+static thread_local WorkerQueue* t_worker = nullptr;
+
+static void sample_signal_handler(int) {
+    WorkerQueue* w = t_worker;
+    if(!w || !w->bt_requested.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+    // backtrace() 在 install_sample_handler 中预先调用过一次，libgcc 已经加载，这里不会再分配内存
+    w->bt_depth = backtrace(w->bt_frames, WorkerQueue::MAX_BACKTRACE);
+    w->bt_ready.store(true, std::memory_order_release);
+}
+
+static void install_sample_handler() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        void* frames[2];
+        backtrace(frames, 2);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &sample_signal_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(sample_signal(), &sa, nullptr);
+    });
+}
+
+// 工作线程的等待方式
+enum SleepMode {
+    SLEEP_NONE = 0,
+    // epoll_pwait 等待，用 wakeup_signal() 唤醒
+    SLEEP_SIGNAL = 1,
+    // park() 在futex上等待
+    SLEEP_FUTEX = 2,
+    // epoll_pwait 等待本线程自己的epoll，向其中的eventfd写入唤醒
+    SLEEP_EVENTFD = 3
+};
+
+// 选择窃取对象的随机数状态（xorshift）
+static thread_local uint32_t t_steal_seed = 0;
+
+// 定向唤醒一个正在等待的线程，线程没有在等待时返回false。
+// 唤醒方先用CAS把 sleeping 清零抢到唤醒权（相当于“已通知”标记），同一次等待只会被唤醒一次：
+// 连续的 tickle() 会落到不同的线程上，连续推给同一线程的任务也只发一次信号
+static bool wake_worker(WorkerQueue* w) {
+    int mode = w->sleeping.load(std::memory_order_seq_cst);
+    if(mode == SLEEP_NONE
+       || !w->sleeping.compare_exchange_strong(mode, SLEEP_NONE, std::memory_order_seq_cst)) {
+        return false;
+    }
+    if(mode == SLEEP_SIGNAL) {
+        pthread_kill(w->pthread, wakeup_signal());
+    } else if(mode == SLEEP_EVENTFD) {
+        eventfd_write(w->wake_fd.load(std::memory_order_relaxed), 1);
+    } else {
+        w->park_seq.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, &w->park_seq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+    w->stats.tickles_received.fetch_add(1, std::memory_order_relaxed);
+    if(t_worker && t_worker->scheduler == w->scheduler) {
+        t_worker->stats.tickles_issued.add();
+    }
+    return true;
+}
+
+// 要退出的线程手上的任务是否都已处理完，只在该线程调用
+static bool retire_ready(WorkerQueue* self) {
+    for(int p = 0; p < Scheduler::PRIORITY_COUNT; ++p) {
+        if(self->deque[p].size() > 0) {
+            return false;
+        }
+    }
+    return self->inboxEmpty() && Fiber::BoundFiberCount() == 0;
+}
+
 Scheduler* Scheduler::GetThis() {
     return t_scheduler;
 }
@@ -13,24 +469,26 @@ void Scheduler::SetThis() {
     t_scheduler = this;
 }
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name, const Placement& placement)
     : m_useCaller(use_caller), m_name(name) {
         //首先判断线程的数量是否大于0，并且调度器的对象是否是空指针，是就调用setThis()进行设置.
-        assert(threads > 0 && Scheduler::GetThis() == nullptr);
-        
-        //设置当前调度器对象
-        // public 成员：可以被任何位置的代码访问。
-        // protected 成员：只能被本类成员函数、友元函数、或派生类成员函数访问。
-        // private 成员：只能被本类的成员函数或友元函数访问。
-        // 由于public成员函数是类的成员函数，因此可以自由调用类的protected成员函数。
-        // 这里的 this 就是当前正在构造的 Scheduler 对象
-        SetThis();
-
-        //设置当前线程的名称为调度器的名称 t_thread_name = name;
-        Thread::SetName(m_name);
+        // 不使用调用者线程的调度器不绑定当前线程，同一个线程可以再创建别的调度器
+        // （例如一个 IOManager 加一个做CPU密集处理的 Scheduler，见 switchTo）
+        assert(threads > 0 && (!use_caller || Scheduler::GetThis() == nullptr));
 
         // 使用主线程当作工作线程，创建协程的主要原因是为了实现更高效的任务调度和管理
         if(use_caller) {
+            //设置当前调度器对象
+            // public 成员：可以被任何位置的代码访问。
+            // protected 成员：只能被本类成员函数、友元函数、或派生类成员函数访问。
+            // private 成员：只能被本类的成员函数或友元函数访问。
+            // 由于public成员函数是类的成员函数，因此可以自由调用类的protected成员函数。
+            // 这里的 this 就是当前正在构造的 Scheduler 对象
+            SetThis();
+
+            //设置当前线程的名称为调度器的名称 t_thread_name = name;
+            Thread::SetName(m_name);
+
             //如果user_caller为true，表示当前线程也要作为一个工作线程使用。
             //因为此时作为了工作线程所以线程数量--
             --threads;
@@ -42,6 +500,7 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
             // reset() 是智能指针的方法，用来释放当前管理的对象，并将新的对象赋给智能指针管理。也就是说，m_schedulerFiber.reset(...) 会释放当前 m_schedulerFiber 管理的 Fiber 对象，并赋给它一个新的 Fiber 对象
             // 实际上是为调度器创建了一个专门的协程来运行调度逻辑。即主线程通过 m_schedulerFiber 执行 Scheduler::run()，开始管理和调度任务。
             m_schedulerFiber.reset(new Fiber(std::bind(&Scheduler::run, this), 0, false));
+            m_schedulerFiber->setOwner(this);
 
             //设置协程的调度器对象
             // 将新创建的协程设置为调度器协程。
@@ -52,28 +511,74 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
             m_rootThread = Thread::GetThreadId();
             m_threadIds.push_back(m_rootThread);
 
-            std::cout << "m_rootThread: " << m_rootThread<< std::endl;
+            SYLAR_LOG_DEBUG() << "m_rootThread: " << m_rootThread;
         }
 
         //将剩余的线程数量（即总线程数量减去是否使用调用者线程）赋值给 m_threadCount
         m_threadCount = threads;    // 2
-        if(debug) {
-            std::cout << "Scheduler::Scheduler() success\n";
+
+        // 确定每个工作线程绑定的CPU和所在节点，运行期间增加的线程（addWorkers）按同样的规则放置
+        size_t workers = m_threadCount + (use_caller ? 1: 0);
+        assert(workers <= MAX_WORKERS);
+        const std::vector<int>& nodes = Numa::Nodes();
+        m_workerCpus.resize(MAX_WORKERS);
+        m_workerNodes.assign(MAX_WORKERS, -1);
+        m_numaSpread = placement.numa_spread;
+        for(size_t i = 0; i < MAX_WORKERS; ++i) {
+            if(i < placement.cpus.size()) {
+                m_workerCpus[i] = placement.cpus[i];
+            }
+            if(m_workerCpus[i].empty() && placement.numa_spread) {
+                m_workerCpus[i] = Numa::CpusOfNode(nodes[i % nodes.size()]);
+            }
+            if(!m_workerCpus[i].empty()) {
+                m_placed = m_placed || i < workers;
+                m_workerNodes[i] = Numa::NodeOfCpu(m_workerCpus[i][0]);
+            }
+        }
+
+        // 每个工作线程一个任务队列，主线程（use_caller）的排在最后；绑定了节点的队列分配在该节点上
+        for(size_t i = 0; i < workers; ++i) {
+            WorkerQueue* w = new (m_workerNodes[i]) WorkerQueue();
+            w->scheduler = this;
+            w->index = i;
+            w->node = m_workerNodes[i];
+            w->state.store(WORKER_ACTIVE, std::memory_order_relaxed);
+            m_workers[i].store(w, std::memory_order_relaxed);
+        }
+        m_workerSlots.store(workers, std::memory_order_release);
+        m_activeWorkers = m_threadCount;
+        if(use_caller) {
+            m_rootSlot = m_threadCount;
+            worker(m_rootSlot)->thread_id = m_rootThread;
         }
+        SYLAR_LOG_DEBUG() << "Scheduler::Scheduler() success";
     }
 
 Scheduler::~Scheduler() {
     //判断调度器是否终止
     assert(stopping() == true);
+    // stop() 之后才调用 setWatchdog 的情况
+    stopWatchdog();
 
     //获取调度器的对象
     if(GetThis() == this) {
         //将其设置为nullptr防止悬空指针
         t_scheduler = nullptr;
     }
-    if(debug) {
-        std::cout << "Scheduler::~Scheduler() success\n";
+
+    // 正常停止后队列都已为空，这里只是释放未执行的任务
+    for(auto& tasks: m_tasks) {
+        for(ScheduleTask* t: tasks) {
+            delete t;
+        }
+    }
+    for(size_t i = 0; i < m_workerSlots.load(std::memory_order_relaxed); ++i) {
+        delete worker(i);
     }
+    // 还没析构的协程不再归到这个地址上（之后可能被新的调度器复用）
+    Fiber::ClearOwner(this);
+    SYLAR_LOG_DEBUG() << "Scheduler::~Scheduler() success";
 }
 
 void Scheduler::start() {
@@ -82,8 +587,8 @@ void Scheduler::start() {
 
     // 标志表示调度器是否已经处于停止状态。
     //如果调度器退出直接报错打印cerr后面的话
-    if(m_stopping) {
-        std::cerr << "Scheduler is stopped" << std::endl;
+    if(m_stopping.load(std::memory_order_acquire)) {
+        SYLAR_LOG_WARN() << "Scheduler is stopped";
 		return;
     }
 
@@ -91,6 +596,8 @@ void Scheduler::start() {
     // 确保线程池尚未启动（空线程池检查）
     assert(m_threads.empty());
 
+    m_started = true;
+
     // 根据线程数量m_threadCount调整线程容器大小
     m_threads.resize(m_threadCount);
 
@@ -100,35 +607,233 @@ void Scheduler::start() {
     // 在 32 位系统中，size_t 是 32 位；
     // 在 64 位系统中，size_t 是 64 位；
     for(size_t i = 0; i < m_threadCount; ++i) {
-        // this 会自动作为 Scheduler::run 的隐式参数传递进去。
-        // Scheduler::run() 会在新的线程中运行，且 this 始终指向调用 run 方法的那个 Scheduler 实例。
-        // m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this), m_name + "_" + std::to_string(i)));
-        // m_threadIds.push_back(m_threads[i]->getId());
+        startWorker(i);
+    }
+
+    if(m_placed) {
+        for(size_t i = 0; i < m_workerSlots.load(std::memory_order_relaxed); ++i) {
+            pid_t tid = i < m_threadCount ? m_threads[i]->getId(): m_rootThread;
+            SYLAR_LOG_INFO() << "Scheduler " << m_name << " worker " << i << " tid=" << tid
+                             << " node=" << m_workerNodes[i]
+                             << " cpus=" << (m_workerCpus[i].empty() ? "any": Numa::FormatCpus(m_workerCpus[i]));
+        }
+    }
+    SYLAR_LOG_DEBUG() << "Scheduler::start() success";
+}
+
+void Scheduler::startWorker(size_t i) {
+    if(m_threads.size() <= i) {
+        m_threads.resize(i + 1);
+    }
+    WorkerQueue* w = worker(i);
+    // this 会自动作为 Scheduler::run 的隐式参数传递进去。
+    // Scheduler::run() 会在新的线程中运行，且 this 始终指向调用 run 方法的那个 Scheduler 实例。
+    m_threads[i].reset(new Thread([this, i, w](){
+        pid_t tid = Thread::GetThreadId();          // 获取系统线程 ID
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_threadIdMap[i] = tid;  // 保存索引与线程id映射关系
+            m_threadIds.push_back(tid);
+            // 线程id可能被系统复用
+            m_retiredThreadIds.erase(tid);
+        }
+        // 绑定本线程的任务队列，之后指定到该线程的任务会进入它的信箱
+        w->thread_id = tid;
+        t_worker = w;
+        Numa::SetThreadNode(m_workerNodes[i]);
+        this->run();        // 每个线程执行调度器主循环
+        w->exited.store(true, std::memory_order_release);
+    }, m_name + "_" + std::to_string(i), m_workerCpus[i]));
+    m_threadIds.push_back(m_threads[i]->getId());
+}
+
+size_t Scheduler::addWorkers(size_t n) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!m_started || m_stopping.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    size_t added = 0;
+    size_t slots = m_workerSlots.load(std::memory_order_relaxed);
+    // 先复用已经退出的线程留下的下标和队列
+    for(size_t i = 0; i < slots && added < n; ++i) {
+        WorkerQueue* w = worker(i);
+        if((m_useCaller && i == m_rootSlot)
+            || w->state.load(std::memory_order_acquire) != WORKER_FREE
+            || !w->exited.load(std::memory_order_acquire)) {
+            continue;
+        }
+        m_threads[i]->join();
+        w->exited.store(false, std::memory_order_relaxed);
+        w->migrated = false;
+        w->state.store(WORKER_ACTIVE, std::memory_order_seq_cst);
+        startWorker(i);
+        ++added;
+    }
+    for(; added < n && slots < MAX_WORKERS; ++slots, ++added) {
+        WorkerQueue* w = new (m_workerNodes[slots]) WorkerQueue();
+        w->scheduler = this;
+        w->index = slots;
+        w->node = m_workerNodes[slots];
+        w->state.store(WORKER_ACTIVE, std::memory_order_relaxed);
+        m_workers[slots].store(w, std::memory_order_release);
+        m_workerSlots.store(slots + 1, std::memory_order_release);
+        startWorker(slots);
+    }
+    m_activeWorkers.fetch_add(added, std::memory_order_relaxed);
+    SYLAR_LOG_DEBUG() << "Scheduler::addWorkers() added " << added << " workers";
+    return added;
+}
+
+size_t Scheduler::retireWorkers(size_t n) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!m_started || m_stopping.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    size_t retired = 0;
+    for(size_t i = m_workerSlots.load(std::memory_order_relaxed); i-- > 0 && retired < n; ) {
+        if(m_activeWorkers.load(std::memory_order_relaxed) <= 1) {
+            break;
+        }
+        WorkerQueue* w = worker(i);
+        if((m_useCaller && i == m_rootSlot) || w->state.load(std::memory_order_relaxed) != WORKER_ACTIVE) {
+            continue;
+        }
+        w->state.store(WORKER_RETIRING, std::memory_order_seq_cst);
+        m_activeWorkers.fetch_sub(1, std::memory_order_relaxed);
+        // 在等待中的话叫醒它，让它尽快迁移任务并退出
+        wake_worker(w);
+        ++retired;
+    }
+    return retired;
+}
+
+void Scheduler::migrateTasks(WorkerQueue* self) {
+    self->migrated = true;
+    int tid = self->thread_id.load(std::memory_order_relaxed);
+    std::vector<ScheduleTask*> tasks;
+    std::vector<ScheduleTask*> keep;
+    for(int p = 0; p < PRIORITY_COUNT; ++p) {
+        while(void* t = self->deque[p].pop()) {
+            tasks.push_back((ScheduleTask*)t);
+        }
+        while(ScheduleTask* t = self->popInbox(p)) {
+            // 绑定在本线程共享栈上的协程不能换线程
+            if(t->fiber && t->fiber->getBoundThread() == tid) {
+                keep.push_back(t);
+            } else {
+                tasks.push_back(t);
+            }
+        }
+    }
+    for(ScheduleTask* t: keep) {
+        self->pushInbox(t);
+    }
+    if(!tasks.empty()) {
+        pushGlobal(tasks, true);
+    }
+}
+
+void Scheduler::rescueInbox(WorkerQueue* w) {
+    ScheduleTask* list = w->inbox_head.exchange(nullptr, std::memory_order_acquire);
+    if(!list) {
+        return;
+    }
+    std::vector<ScheduleTask*> tasks;
+    for(; list; list = tasks.back()->next) {
+        tasks.push_back(list);
+        w->inbox_count[list->priority].fetch_sub(1, std::memory_order_relaxed);
+    }
+    // 信箱是后进先出的链表
+    std::reverse(tasks.begin(), tasks.end());
+    if(w->state.load(std::memory_order_seq_cst) != WORKER_FREE) {
+        // 下标已经被新线程复用，任务仍然归它
+        for(ScheduleTask* t: tasks) {
+            t->next = nullptr;
+            pushWorker(w, t);
+        }
+        return;
+    }
+    pushGlobal(tasks, true);
+}
 
-        m_threads[i].reset(new Thread([this, i](){
-            pid_t tid = Thread::GetThreadId();          // 获取系统线程 ID
-            {
-                std::lock_guard<std::mutex> lock(m_mutex);
-                m_threadIdMap[i] = tid;  // 保存索引与线程id映射关系
-                m_threadIds.push_back(tid);
+void Scheduler::pushGlobal(std::vector<ScheduleTask*>& tasks, bool unpin) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(ScheduleTask* t: tasks) {
+            t->next = nullptr;
+            if(unpin) {
+                // 共享栈协程仍然只能回到它绑定的线程
+                t->thread = t->fiber ? t->fiber->getBoundThread(): -1;
             }
-            // m_threadIdMap[i] = Thread::GetThreadId(); // 保存索引与线程id映射关系
-            this->run();        // 每个线程执行调度器主循环
-        }, m_name + "_" + std::to_string(i)));
-        m_threadIds.push_back(m_threads[i]->getId());
+            m_tasks[t->priority].push_back(t);
+            m_globalTaskCount[t->priority].fetch_add(1, std::memory_order_release);
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    size_t wake = std::min(tasks.size(), m_parkedThreadCount.load(std::memory_order_relaxed));
+    for(size_t i = 0; i < wake; ++i) {
+        tickle();
+    }
+}
+
+bool Scheduler::tryRetire() {
+    WorkerQueue* self = t_worker;
+    if(!self || self->scheduler != this || self->state.load(std::memory_order_acquire) != WORKER_RETIRING) {
+        return false;
     }
-    if(debug) {
-        std::cout << "Scheduler::start() success\n";
+    if(!self->migrated) {
+        migrateTasks(self);
+    }
+    if(!retire_ready(self)) {
+        return false;
+    }
+
+    int tid = self->thread_id.load(std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_retiredThreadIds.insert(tid);
+        for(auto it = m_threadIdMap.begin(); it != m_threadIdMap.end(); ) {
+            if(it->second == tid) {
+                it = m_threadIdMap.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // 指定到本线程、还在全局队列里的任务
+        for(auto& tasks: m_tasks) {
+            for(ScheduleTask* t: tasks) {
+                if(t->thread == tid) {
+                    t->thread = -1;
+                }
+            }
+        }
+        self->thread_id.store(-1, std::memory_order_relaxed);
+        self->state.store(WORKER_FREE, std::memory_order_seq_cst);
     }
+    // 与 pushWorker() 中先放入信箱再检查状态相对应：
+    // 这之后放入信箱的任务由放入的一方取走，之前放入的在这里取走
+    rescueInbox(self);
+    SYLAR_LOG_DEBUG() << "Scheduler::tryRetire() worker " << tid << " retired";
+    return true;
+}
+
+// 任务开始/结束时由所属线程调用（仅开启 setWatchdog 时）
+static void watch_begin(WorkerQueue* w, uint64_t fiber_id) {
+    w->yield_requested.store(false, std::memory_order_relaxed);
+    w->run_fiber_id.store(fiber_id, std::memory_order_relaxed);
+    w->run_seq.store(w->run_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    w->run_start_ns.store(MonotonicNs(), std::memory_order_release);
+}
+
+static void watch_end(WorkerQueue* w) {
+    w->run_start_ns.store(0, std::memory_order_release);
 }
 
 //作用：调度器的核心，负责从任务队列中取出任务并通过协程执行
 void Scheduler::run() {
     //获取当前线程的ID
     int thread_id = Thread::GetThreadId();
-    if(debug) {
-        std::cout << "Schedule::run() starts in thread: " << thread_id << std::endl;
-    }
+    SYLAR_LOG_DEBUG() << "Schedule::run() starts in thread: " << thread_id;
 
     //set_hook_enable(true);
     //设置调度器对象即t_scheduler = this;
@@ -146,12 +851,45 @@ void Scheduler::run() {
         Fiber::GetThis();
     }
 
+    // 调度线程都登记到采样分析器，开始采样时才会真正打开定时器
+    Profiler::RegisterThread();
+
     // 创建空闲协程（idle_fiber）
-    //创建空闲协程，std::make_shared 是 C++11 引入的一个函数，用于创建 std::shared_ptr 对象。相比于直接使用 std::shared_ptr 构造函数，std::make_shared 更高效且更安全，因为它在单个内存分配中同时分配了控制块和对象，避免了额外的内存分配和指针操作。
-    //子协程
-    std::shared_ptr<Fiber> idle_fiber = std::make_shared<Fiber>(std::bind(&Scheduler::idle, this));
+    //子协程，引用计数在 Fiber 内部，不需要额外的控制块
+    Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+    idle_fiber->setOwner(this);
     ScheduleTask task;
 
+    // 本线程的任务队列，主线程（use_caller）在这里绑定
+    WorkerQueue* self = t_worker;
+    if((!self || self->scheduler != this) && m_useCaller && thread_id == m_rootThread) {
+        self = worker(m_rootSlot);
+        t_worker = self;
+        // 主线程的绑定推迟到它真正进入调度时
+        if(!m_workerCpus[m_rootSlot].empty()) {
+            int rt = Thread::SetAffinity(m_workerCpus[m_rootSlot]);
+            if(rt) {
+                SYLAR_LOG_WARN() << "Scheduler::run() SetAffinity failed, rt=" << rt;
+            }
+        }
+        Numa::SetThreadNode(m_workerNodes[m_rootSlot]);
+    }
+    if(self) {
+        // 平时屏蔽唤醒信号，避免打断任务中的系统调用；只在空闲等待时放开
+        install_wakeup_handler();
+        self->pthread = pthread_self();
+        sigset_t block;
+        sigemptyset(&block);
+        sigaddset(&block, wakeup_signal());
+        pthread_sigmask(SIG_BLOCK, &block, &self->saved_mask);
+        self->wait_mask = self->saved_mask;
+        sigdelset(&self->wait_mask, wakeup_signal());
+        self->in_run.store(true, std::memory_order_release);
+    }
+
+    // 本线程已结束的回调协程缓存，用于复用
+    std::vector<Fiber::ptr> fiber_cache;
+
     while(true) {
         // std::cout<< "run" <<std::endl;
 
@@ -161,34 +899,21 @@ void Scheduler::run() {
 
         //是否唤醒了其他线程进行任务调度
         bool tickle_me = false;
-        {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            auto it = m_tasks.begin();
-
-            // 1 遍历任务队列
-            // 当 std::vector 为空时，begin() 和 end() 都会返回指向容器尾部的迭代器，这两个迭代器是相同的。
-            while(it != m_tasks.end()) {
-                // std::cout << "xx" << std::endl;
-
-                //不能等于当前thread_id,其目的是让任何的线程都可以执行。
-                // 这段代码的作用是过滤任务队列中的任务，确保任务只在指定的线程上执行，或者允许任务在任何线程上执行。如果任务被锁定在特定线程上，并且当前线程不是该线程，就跳过该任务。
-                if(it->thread != -1 && it->thread != thread_id) {
-                    // std::cout <<"thread"<< std::endl;
-                    ++it;
-                    tickle_me = true;
-                    continue;
-                }
 
-                // 2 取出任务
-                //这里取到任务的线程就直接break所以并没有遍历到队尾
-                assert(it->fiber || it->cb);
-                task = *it;
-                m_tasks.erase(it);
-                ++m_activeThreadCount;
-                break;
-            }
-            //确保仍然存在未处理的任务
-            tickle_me = tickle_me || (it != m_tasks.end());
+        // 被要求退出 -> 先把手上的任务交出去
+        if(self && !self->migrated && self->state.load(std::memory_order_acquire) == WORKER_RETIRING) {
+            migrateTasks(self);
+        }
+
+        // 1 依次从本地队列、信箱、全局队列取任务，都没有则随机窃取其他线程的任务
+        ScheduleTask* next = nextTask(self, thread_id, tickle_me);
+        if(next) {
+            // 2 取出任务
+            assert(next->fiber || next->cb);
+            SYLAR_TRACE(TRACE_TASK_DEQUEUE, next->fiber ? next->fiber->getId(): 0, next->priority);
+            SYLAR_PROBE2(task_dequeue, next->fiber ? next->fiber->getId(): 0, next->priority);
+            task = std::move(*next);
+            delete next;
         }
         if(tickle_me) {
             //这里虽然写了唤醒但并没有具体的逻辑代码，具体的在io+scheduler
@@ -196,38 +921,95 @@ void Scheduler::run() {
         }
 
         // 3 执行任务
+        // 排队时间：从放入队列到开始执行
+        uint64_t start_ns = 0;
+        if(task.enqueue_ns && self) {
+            start_ns = MonotonicNs();
+            self->stats.queue_wait_ns.record(start_ns - task.enqueue_ns);
+            if(m_admissionOn.load(std::memory_order_relaxed)) {
+                admissionSample(task.priority, start_ns, start_ns - task.enqueue_ns);
+            }
+        }
         // 若任务为已有Fiber：
+        // 长时间运行检测：记录任务的开始时间，后台线程据此判断它运行了多久
+        bool watched = self && m_watchdogOn.load(std::memory_order_relaxed);
         if(task.fiber) {
             //resume协程，resume返回时此时任务要么执行完了，要么半路yield了，总之任务完成了，活跃线程-1；
-            {
-                std::lock_guard<std::mutex> lock(task.fiber->m_mutex);
-                if(task.fiber->getState() != Fiber::TERM) {
-                    --m_activeThreadCount;
-                    task.reset();
-                    continue;  // 避免resume已终止协程
-                }
+            // 协程在别的线程上可能还没来得及切换出去，resume() 内部会等它切换完成；已终止的协程不会再执行
+            if(watched) {
+                watch_begin(self, task.fiber->getId());
             }
-            //线程完成任务后就不再处于活跃状态，而是进入空闲状态，因此需要将活跃线程计数减一。
+            task.fiber->setOwner(this);
             task.fiber->resume();
-            --m_activeThreadCount;
+            if(watched) {
+                watch_end(self);
+            }
+            //任务执行完（或半路yield出去）后就不再计入待完成的任务
+            taskDone(self, start_ns);
+            task.reset();
+        } else if(task.cb && (task.stack_flags & Fiber::STACK_INLINE)) {
+            // 内联任务直接在调度协程的栈上执行，不需要协程
+            if(watched) {
+                watch_begin(self, 0);
+            }
+            // 内联任务借用调度协程，执行期间调度协程带着任务的标签
+            Fiber* sched_fiber = task.label ? Fiber::Current(): nullptr;
+            if(sched_fiber) {
+                sched_fiber->setLabel(task.label);
+            }
+            Fiber::SetInlineTask(true);
+            task.cb();
+            Fiber::SetInlineTask(false);
+            if(sched_fiber) {
+                sched_fiber->setLabel(nullptr);
+            }
+            if(watched) {
+                watch_end(self);
+            }
+            if(self) {
+                self->stats.inline_executed.add();
+            }
+            taskDone(self, start_ns);
             task.reset();
         } else if(task.cb) {
-            // 将回调函数包装成新的Fiber执行（这样可统一协程和回调任务的管理方式）
-            std::shared_ptr<Fiber> cb_fiber = std::make_shared<Fiber>(task.cb);
-            {
-                std::lock_guard<std::mutex> lock(cb_fiber->m_mutex);
-                cb_fiber->resume();
+            // 将回调函数包装成Fiber执行（这样可统一协程和回调任务的管理方式）
+            // 优先复用本线程缓存的已结束协程，只需reset上下文，省去创建Fiber和分配栈的开销
+            Fiber::ptr cb_fiber;
+            if(task.stack_flags == Fiber::STACK_DEFAULT && !fiber_cache.empty()) {
+                cb_fiber.swap(fiber_cache.back());
+                fiber_cache.pop_back();
+                cb_fiber->reset(std::move(task.cb));
+                m_fiberReused.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                cb_fiber.reset(new Fiber(std::move(task.cb), 0, true, task.stack_flags));
+                m_fiberCreated.fetch_add(1, std::memory_order_relaxed);
+            }
+            if(task.cancel) {
+                cb_fiber->setCancelContext(std::move(task.cancel));
+            }
+            cb_fiber->setLabel(task.label);
+            if(watched) {
+                watch_begin(self, cb_fiber->getId());
+            }
+            cb_fiber->setOwner(this);
+            cb_fiber->resume();
+            if(watched) {
+                watch_end(self);
+            }
+            // 执行完且没有其他地方引用 -> 放回缓存；半路yield的协程由等待它的一方持有
+            if(cb_fiber->getState() == Fiber::TERM && cb_fiber.use_count() == 1
+                && task.stack_flags == Fiber::STACK_DEFAULT
+                && fiber_cache.size() < m_fiberCacheSize.load(std::memory_order_relaxed)) {
+                fiber_cache.push_back(std::move(cb_fiber));
             }
-            --m_activeThreadCount;
+            taskDone(self, start_ns);
             task.reset();
         } else {
             // 4 无任务 -> 执行空闲协程
             // 系统关闭 -> idle协程将从死循环跳出并结束 -> 此时的idle协程状态为TERM -> 再次进入将跳出循环并退出run()
             if(idle_fiber->getState() == Fiber::TERM) {
                 //如果调度器没有调度任务，那么idle协程回不断的resume/yield,不会结束进入一个忙等待，如果idele协程结束了，一定是调度器停止了，直到有任务才执行上面的if/else，在这里idle_fiber就是不断的和主协程进行交互的子协程
-                if(debug) {
-                    std::cout << "Schedule::run() ends in thread: " << thread_id << std::endl;
-                }
+                SYLAR_LOG_DEBUG() << "Schedule::run() ends in thread: " << thread_id;
                 break;
             }
             ++m_idleThreadCount;
@@ -241,44 +1023,803 @@ void Scheduler::run() {
             // std::cout << "m_idleThreadCount"<< std::endl;
         }
     }
+
+    Profiler::UnregisterThread();
+    if(self) {
+        self->in_run.store(false, std::memory_order_release);
+        pthread_sigmask(SIG_SETMASK, &self->saved_mask, nullptr);
+        // 队列随调度器一起释放，主线程之后可能再创建新的调度器，不能留下悬空指针
+        t_worker = nullptr;
+        Numa::SetThreadNode(-1);
+    }
 }
 
-// 用于安全地停止调度器(Scheduler)，它会通知所有线程和协程终止运行，等待它们完成后才退出。
-void Scheduler::stop() {
-    if(debug) {
-        std::cout << "Schedule::stop() starts in thread: " << Thread::GetThreadId() << std::endl;
+// ScheduleTask 的空闲链表：同 timer.cpp 的 TimerNode 池。按块分配，块不释放；
+// 每个线程缓存一部分，超过上限时一半还给全局，空了从全局取一批
+static constexpr size_t TASK_CHUNK = 64;
+static constexpr size_t TASK_CACHE_MAX = 4 * TASK_CHUNK;
+
+struct FreeTask {
+    FreeTask* next;
+};
+
+struct TaskPool {
+    std::mutex mutex;
+    FreeTask* free = nullptr;
+};
+
+// 线程退出时还会用到，不析构
+static TaskPool& GlobalTaskPool() {
+    static TaskPool* s_pool = new TaskPool();
+    return *s_pool;
+}
+
+struct TaskCache {
+    FreeTask* head = nullptr;
+    size_t size = 0;
+
+    // 取出 n 个串成的链，返回链尾
+    FreeTask* detach(size_t n, FreeTask*& first) {
+        first = head;
+        FreeTask* last = head;
+        for(size_t i = 1; i < n; ++i) {
+            last = last->next;
+        }
+        head = last->next;
+        last->next = nullptr;
+        size -= n;
+        return last;
     }
 
-    if(stopping()) {
-        // std::cout << "stopping!!!"<< std::endl;
+    ~TaskCache() {
+        if(!head) {
+            return;
+        }
+        FreeTask* first = nullptr;
+        FreeTask* last = detach(size, first);
+        TaskPool& pool = GlobalTaskPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        last->next = pool.free;
+        pool.free = first;
+    }
+};
+
+static thread_local TaskCache t_taskCache;
+
+void* Scheduler::ScheduleTask::operator new(size_t size) {
+    assert(size == sizeof(ScheduleTask));
+    TaskCache& cache = t_taskCache;
+    if(!cache.head) {
+        TaskPool& pool = GlobalTaskPool();
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            while(pool.free && cache.size < TASK_CHUNK) {
+                FreeTask* t = pool.free;
+                pool.free = t->next;
+                t->next = cache.head;
+                cache.head = t;
+                ++cache.size;
+            }
+        }
+        if(!cache.head) {
+            char* chunk = (char*)::operator new(TASK_CHUNK * sizeof(ScheduleTask));
+            for(size_t i = 0; i < TASK_CHUNK; ++i) {
+                FreeTask* t = (FreeTask*)(chunk + i * sizeof(ScheduleTask));
+                t->next = cache.head;
+                cache.head = t;
+            }
+            cache.size = TASK_CHUNK;
+        }
+    }
+    FreeTask* t = cache.head;
+    cache.head = t->next;
+    --cache.size;
+    return t;
+}
+
+void Scheduler::ScheduleTask::operator delete(void* p) {
+    if(!p) {
         return;
     }
+    TaskCache& cache = t_taskCache;
+    FreeTask* t = (FreeTask*)p;
+    t->next = cache.head;
+    cache.head = t;
+    if(++cache.size > TASK_CACHE_MAX) {
+        // 一直在别的线程分配、在这里释放的会越积越多，多出的一半还给全局
+        FreeTask* first = nullptr;
+        FreeTask* last = cache.detach(TASK_CACHE_MAX / 2, first);
+        TaskPool& pool = GlobalTaskPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        last->next = pool.free;
+        pool.free = first;
+    }
+}
 
-    m_stopping = true;
+void Scheduler::pushTask(ScheduleTask&& task) {
+    assert(task.priority >= 0 && task.priority < PRIORITY_COUNT);
+    ScheduleTask* t = new ScheduleTask(std::move(task));
+    m_pendingTaskCount.fetch_add(1, std::memory_order_relaxed);
+    if(stampEnqueue()) {
+        t->enqueue_ns = MonotonicNs();
+    }
+    SYLAR_TRACE(TRACE_TASK_ENQUEUE, t->fiber ? t->fiber->getId(): 0, t->priority);
+    SYLAR_PROBE2(task_enqueue, t->fiber ? t->fiber->getId(): 0, t->priority);
+    int prio = t->priority;
 
-    if(m_useCaller) {
-        assert(GetThis() == this);
+    // 队列由空变为非空时才需要唤醒空闲线程
+    bool need_tickle;
+    WorkerQueue* self = t_worker;
+    WorkerQueue* target = nullptr;
+    if(t->thread == -1 && self && self->scheduler == this
+        && self->state.load(std::memory_order_relaxed) == WORKER_ACTIVE) {
+        // 工作线程自己提交的任务 -> 本地双端队列，不加锁
+        need_tickle = self->deque[prio].size() == 0;
+        self->deque[prio].push(t);
+    } else if(t->thread != -1 && (target = findWorker(t->thread))) {
+        // 指定线程的任务 -> 目标线程的信箱（不会被窃取），只唤醒目标线程
+        pushWorker(target, t);
+        return;
+    } else if(t->thread == -1 && m_injectExternal.load(std::memory_order_relaxed) && (target = injectTarget())) {
+        // 外部线程（IO完成、卸载线程池等）提交的任务 -> 某个工作线程的信箱，不加锁
+        t->injected = true;
+        pushWorker(target, t);
+        return;
     } else {
-        assert(GetThis() != this);
+        // 目标线程还没开始运行，或者还没有可用的工作线程 -> 全局注入队列
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(t->thread != -1 && m_retiredThreadIds.count(t->thread)) {
+            // 指定的线程已经退出
+            t->thread = -1;
+        }
+        need_tickle = m_tasks[prio].empty();
+        m_tasks[prio].push_back(t);
+        m_globalTaskCount[prio].fetch_add(1, std::memory_order_release);
     }
 
-    // 唤醒所有线程（tickle机制）
-    for(size_t i = 0; i < m_threadCount; ++i) {
-        // std::cout << "m_threadCount: "<< m_threadCount<< std::endl;
+    if(need_tickle) {
         tickle();
     }
+}
 
-    // 唤醒调度协程（schedulerFiber）
-    if(m_schedulerFiber) {
-        tickle();
+void Scheduler::scheduleBatch(Batch& batch) {
+    ScheduleTask* t = batch.m_head;
+    size_t n = batch.m_count;
+    batch.m_head = batch.m_tail = nullptr;
+    batch.m_count = 0;
+    if(!t) {
+        return;
     }
+    m_pendingTaskCount.fetch_add(n, std::memory_order_relaxed);
+    uint64_t enqueue_ns = stampEnqueue() ? MonotonicNs(): 0;
 
-    // 恢复执行调度协程（schedulerFiber）
-    if(m_schedulerFiber) {
-        m_schedulerFiber->resume();
-        if(debug) {
-            std::cout << "m_schedulerFiber ends in thread:" << Thread::GetThreadId() << std::endl;
+    WorkerQueue* self = t_worker;
+    bool local = self && self->scheduler == this && self->state.load(std::memory_order_relaxed) == WORKER_ACTIVE;
+    // 本地双端队列和全局队列中新增的任务数，用来决定唤醒几个空闲线程
+    size_t to_local = 0;
+    ScheduleTask* global_head = nullptr;
+    ScheduleTask** global_tail = &global_head;
+    size_t to_global = 0;
+    while(t) {
+        assert(t->priority >= 0 && t->priority < PRIORITY_COUNT);
+        ScheduleTask* next = t->next;
+        t->next = nullptr;
+        t->enqueue_ns = enqueue_ns;
+        SYLAR_TRACE(TRACE_TASK_ENQUEUE, t->fiber ? t->fiber->getId(): 0, t->priority);
+        SYLAR_PROBE2(task_enqueue, t->fiber ? t->fiber->getId(): 0, t->priority);
+        WorkerQueue* target = nullptr;
+        if(t->thread == -1 && local) {
+            self->deque[t->priority].push(t);
+            ++to_local;
+        } else if(t->thread != -1 && (target = findWorker(t->thread))) {
+            pushWorker(target, t);
+        } else {
+            *global_tail = t;
+            global_tail = &t->next;
+            ++to_global;
         }
+        t = next;
+    }
+
+    if(global_head) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(t = global_head; t; t = global_head) {
+            global_head = t->next;
+            t->next = nullptr;
+            if(t->thread != -1 && m_retiredThreadIds.count(t->thread)) {
+                t->thread = -1;
+            }
+            m_tasks[t->priority].push_back(t);
+            m_globalTaskCount[t->priority].fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    // 提交者自己是工作线程时，回到调度循环后会先执行其中一个任务
+    size_t wake = to_local + to_global;
+    if(local && wake > 0) {
+        --wake;
+    }
+    if(to_global > 0 && wake == 0) {
+        wake = 1;
+    }
+    // 只有阻塞中的线程需要唤醒，自旋中的线程自己会看到新任务
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    wake = std::min(wake, m_parkedThreadCount.load(std::memory_order_relaxed));
+    for(size_t i = 0; i < wake; ++i) {
+        tickle();
+    }
+}
+
+void Scheduler::pushWorker(WorkerQueue* target, ScheduleTask* t) {
+    target->pushInbox(t);
+    // 与 prepareWait()/park() 中先置 sleeping 再检查信箱相对应（均为seq_cst）：
+    // 要么目标线程看到了新任务而不阻塞，要么这里看到它已经（或即将）阻塞而唤醒它
+    if(target != t_worker) {
+        wake_worker(target);
+    }
+    // 目标线程已经退出，不会再看信箱 -> 由这里取走（见 tryRetire()）
+    if(target->state.load(std::memory_order_seq_cst) == WORKER_FREE) {
+        rescueInbox(target);
+    }
+}
+
+void Scheduler::pushTaskOnIndex(ScheduleTask&& task, int index) {
+    assert(index >= 0 && index < (int)m_workerSlots.load(std::memory_order_acquire));
+    assert(task.priority >= 0 && task.priority < PRIORITY_COUNT);
+    ScheduleTask* t = new ScheduleTask(std::move(task));
+    m_pendingTaskCount.fetch_add(1, std::memory_order_relaxed);
+    if(stampEnqueue()) {
+        t->enqueue_ns = MonotonicNs();
+    }
+    SYLAR_TRACE(TRACE_TASK_ENQUEUE, t->fiber ? t->fiber->getId(): 0, t->priority);
+    SYLAR_PROBE2(task_enqueue, t->fiber ? t->fiber->getId(): 0, t->priority);
+    pushWorker(worker(index), t);
+}
+
+const sigset_t* Scheduler::prepareWait(int wake_fd) {
+    WorkerQueue* self = t_worker;
+    if(!self || self->scheduler != this) {
+        return nullptr;
+    }
+    if(wake_fd >= 0) {
+        self->wake_fd.store(wake_fd, std::memory_order_relaxed);
+        self->sleeping.store(SLEEP_EVENTFD, std::memory_order_seq_cst);
+    } else {
+        self->sleeping.store(SLEEP_SIGNAL, std::memory_order_seq_cst);
+    }
+    m_parkedThreadCount.fetch_add(1, std::memory_order_seq_cst);
+    if(hasWork() || stopping()) {
+        // 已经有任务（或者调度器要停止了），不要阻塞
+        return nullptr;
+    }
+    return &self->wait_mask;
+}
+
+void Scheduler::finishWait() {
+    WorkerQueue* self = t_worker;
+    if(self && self->scheduler == this) {
+        self->sleeping.store(SLEEP_NONE, std::memory_order_relaxed);
+        m_parkedThreadCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void Scheduler::park(uint32_t timeout_ms) {
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    WorkerQueue* self = t_worker;
+    if(!self || self->scheduler != this) {
+        // 没有自己的工作队列，不能被定向唤醒：等在共用的futex上，同样先读序号再登记、检查任务
+        uint32_t seq = m_strayParkSeq.load(std::memory_order_acquire);
+        m_strayParked.fetch_add(1, std::memory_order_seq_cst);
+        m_parkedThreadCount.fetch_add(1, std::memory_order_seq_cst);
+        if(!hasWork() && !stopping()) {
+            syscall(SYS_futex, &m_strayParkSeq, FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+        }
+        m_parkedThreadCount.fetch_sub(1, std::memory_order_relaxed);
+        m_strayParked.fetch_sub(1, std::memory_order_relaxed);
+        return;
+    }
+    // 先读序号再声明自己在等待、检查任务：之后的唤醒都会改变序号，FUTEX_WAIT 会立即返回
+    uint32_t seq = self->park_seq.load(std::memory_order_acquire);
+    self->sleeping.store(SLEEP_FUTEX, std::memory_order_seq_cst);
+    m_parkedThreadCount.fetch_add(1, std::memory_order_seq_cst);
+    if(!hasWork() && !stopping()) {
+        syscall(SYS_futex, &self->park_seq, FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+    }
+    self->sleeping.store(SLEEP_NONE, std::memory_order_relaxed);
+    m_parkedThreadCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool Scheduler::hasParkedThreads() {
+    // 与等待方先登记再检查任务相对应
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return m_parkedThreadCount.load(std::memory_order_relaxed) > 0;
+}
+
+bool Scheduler::hasWork() {
+    WorkerQueue* self = t_worker;
+    if(self && self->scheduler == this && !self->inboxEmpty()) {
+        return true;
+    }
+    if(self && self->scheduler == this && self->state.load(std::memory_order_relaxed) != WORKER_ACTIVE) {
+        // 要退出的线程不再取其他任务，但可以退出了也算作有事可做，不要阻塞
+        return !self->migrated || retire_ready(self);
+    }
+    for(int p = 0; p < PRIORITY_COUNT; ++p) {
+        if(m_globalTaskCount[p].load(std::memory_order_acquire) > 0) {
+            return true;
+        }
+    }
+    for(size_t i = 0, n = m_workerSlots.load(std::memory_order_acquire); i < n; ++i) {
+        WorkerQueue* w = worker(i);
+        for(int p = 0; p < PRIORITY_COUNT; ++p) {
+            if(w->deque[p].size() > 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool Scheduler::spinForWork() {
+    uint32_t n = m_idleSpinCount.load(std::memory_order_relaxed);
+    for(uint32_t i = 0; i < n; ++i) {
+        if(hasWork()) {
+            return true;
+        }
+        cpu_relax();
+    }
+    return false;
+}
+
+void Scheduler::setIdlePolicy(const IdlePolicy& policy) {
+    m_idleSpinCount = policy.spin_count;
+    m_idlePollCount = policy.poll_count;
+    m_idleParkTimeout = policy.park_timeout_ms;
+}
+
+Scheduler::IdlePolicy Scheduler::getIdlePolicy() const {
+    IdlePolicy policy;
+    policy.spin_count = m_idleSpinCount.load(std::memory_order_relaxed);
+    policy.poll_count = m_idlePollCount.load(std::memory_order_relaxed);
+    policy.park_timeout_ms = m_idleParkTimeout.load(std::memory_order_relaxed);
+    return policy;
+}
+
+bool Scheduler::hasInboxTask() {
+    WorkerQueue* self = t_worker;
+    return self && self->scheduler == this && !self->inboxEmpty();
+}
+
+int Scheduler::getCurrentWorkerIndex() const {
+    WorkerQueue* self = t_worker;
+    return self && self->scheduler == this ? self->index: -1;
+}
+
+bool Scheduler::isWorkerRunning(size_t index) const {
+    if(index >= m_workerSlots.load(std::memory_order_acquire)) {
+        return false;
+    }
+    WorkerQueue* w = worker(index);
+    return w->state.load(std::memory_order_acquire) == WORKER_ACTIVE && w->in_run.load(std::memory_order_acquire);
+}
+
+int Scheduler::getWorkerThreadId(size_t index) const {
+    if(index >= m_workerSlots.load(std::memory_order_acquire)) {
+        return -1;
+    }
+    return worker(index)->thread_id.load(std::memory_order_relaxed);
+}
+
+WorkerQueue* Scheduler::injectTarget() {
+    size_t n = m_workerSlots.load(std::memory_order_acquire);
+    if(n == 0) {
+        return nullptr;
+    }
+    // 只看少数几个位置，代价不随线程数增长
+    static const size_t MAX_PROBES = 4;
+    for(size_t i = 0; i < MAX_PROBES; ++i) {
+        // 跳过的位置也要推进轮转，否则它的份额全部落到下一个线程上
+        WorkerQueue* w = worker(m_injectSeq.fetch_add(1, std::memory_order_relaxed) % n);
+        if(w->state.load(std::memory_order_acquire) == WORKER_ACTIVE
+            && w->in_run.load(std::memory_order_acquire)) {
+            return w;
+        }
+    }
+    return nullptr;
+}
+
+WorkerQueue* Scheduler::findWorker(int thread_id) {
+    for(size_t i = 0, n = m_workerSlots.load(std::memory_order_acquire); i < n; ++i) {
+        WorkerQueue* w = worker(i);
+        if(w->thread_id.load(std::memory_order_relaxed) == thread_id) {
+            return w;
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::ScheduleTask* Scheduler::popGlobal(int priority, int thread_id, bool& tickle_me) {
+    if(m_globalTaskCount[priority].load(std::memory_order_acquire) == 0) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::deque<ScheduleTask*>& tasks = m_tasks[priority];
+    for(auto it = tasks.begin(); it != tasks.end(); ++it) {
+        // 只有指定的线程尚未开始运行时，指定线程的任务才会留在全局队列里
+        if((*it)->thread != -1 && (*it)->thread != thread_id) {
+            tickle_me = true;
+            continue;
+        }
+        ScheduleTask* t = *it;
+        tasks.erase(it);
+        m_globalTaskCount[priority].fetch_sub(1, std::memory_order_relaxed);
+        return t;
+    }
+    return nullptr;
+}
+
+Scheduler::ScheduleTask* Scheduler::popPriority(WorkerQueue* self, int priority, int thread_id,
+                                                bool remote_first, bool& tickle_me) {
+    ScheduleTask* t = nullptr;
+    if(self) {
+        if(remote_first) {
+            t = self->popInbox(priority, true);
+            if(!t) {
+                t = popGlobal(priority, thread_id, tickle_me);
+            }
+        }
+        if(!t) {
+            t = (ScheduleTask*)self->deque[priority].pop();
+        }
+        if(!t) {
+            t = self->popInbox(priority, true);
+            if(!t) {
+                // 注入的任务刚刚转入了本地队列
+                t = (ScheduleTask*)self->deque[priority].pop();
+            }
+        }
+    }
+    if(!t) {
+        t = popGlobal(priority, thread_id, tickle_me);
+    }
+    return t;
+}
+
+Scheduler::ScheduleTask* Scheduler::nextTask(WorkerQueue* self, int thread_id, bool& tickle_me) {
+    ScheduleTask* t = nullptr;
+    if(self && self->state.load(std::memory_order_relaxed) != WORKER_ACTIVE) {
+        // 要退出的线程只处理自己信箱里剩下的任务（绑定在它共享栈上的协程）
+        for(int p = 0; p < PRIORITY_COUNT && !t; ++p) {
+            t = self->popInbox(p);
+        }
+        return t;
+    }
+    if(self) {
+        // 每61次优先看一次信箱和全局队列，保证本地任务源源不断时它们也能被执行
+        bool remote_first = ++self->tick % 61 == 0;
+        // 加权轮转：从高到低找还有配额的优先级；该优先级没有任务时放弃本轮剩余配额，
+        // 所有优先级的配额都用完（或放弃）后重新发放，再按从高到低找一遍
+        for(int round = 0; round < 2 && !t; ++round) {
+            for(int p = 0; p < PRIORITY_COUNT && !t; ++p) {
+                if(self->credits[p] == 0) {
+                    continue;
+                }
+                t = popPriority(self, p, thread_id, remote_first, tickle_me);
+                if(t) {
+                    --self->credits[p];
+                } else {
+                    self->credits[p] = 0;
+                }
+            }
+            if(!t) {
+                for(int p = 0; p < PRIORITY_COUNT; ++p) {
+                    self->credits[p] = m_priorityWeights[p].load(std::memory_order_relaxed);
+                }
+            }
+        }
+    } else {
+        for(int p = 0; p < PRIORITY_COUNT && !t; ++p) {
+            t = popGlobal(p, thread_id, tickle_me);
+        }
+    }
+
+    size_t slots = m_workerSlots.load(std::memory_order_acquire);
+    if(!t && self && slots > 1) {
+        // 从随机位置开始依次尝试窃取其他线程的任务，同一个线程先偷高优先级的
+        if(t_steal_seed == 0) {
+            t_steal_seed = (uint32_t)thread_id * 2654435761u + 1;
+        }
+        t_steal_seed ^= t_steal_seed << 13;
+        t_steal_seed ^= t_steal_seed >> 17;
+        t_steal_seed ^= t_steal_seed << 5;
+        size_t start = t_steal_seed % slots;
+        for(size_t i = 0; i < slots && !t; ++i) {
+            WorkerQueue* victim = worker((start + i) % slots);
+            if(victim == self) {
+                continue;
+            }
+            for(int p = 0; p < PRIORITY_COUNT && !t; ++p) {
+                t = (ScheduleTask*)victim->deque[p].steal();
+            }
+        }
+        if(t) {
+            self->stats.steals.add();
+        }
+    }
+
+    // 还有剩余任务时唤醒其他空闲线程来分担；信箱中的任务已经定向唤醒过目标线程，这里不再管
+    if(t && !tickle_me) {
+        for(int p = 0; p < PRIORITY_COUNT; ++p) {
+            if((self && self->deque[p].size() > 0)
+                || m_globalTaskCount[p].load(std::memory_order_relaxed) > 0) {
+                tickle_me = true;
+                break;
+            }
+        }
+    }
+    return t;
+}
+
+void Scheduler::setPriorityWeight(int priority, uint32_t weight) {
+    assert(priority >= 0 && priority < PRIORITY_COUNT);
+    m_priorityWeights[priority] = std::max<uint32_t>(weight, 1);
+}
+
+uint32_t Scheduler::getPriorityWeight(int priority) const {
+    assert(priority >= 0 && priority < PRIORITY_COUNT);
+    return m_priorityWeights[priority].load(std::memory_order_relaxed);
+}
+
+size_t Scheduler::getQueueDepth(int priority) const {
+    assert(priority >= 0 && priority < PRIORITY_COUNT);
+    size_t n = m_globalTaskCount[priority].load(std::memory_order_relaxed);
+    for(size_t i = 0, slots = m_workerSlots.load(std::memory_order_acquire); i < slots; ++i) {
+        WorkerQueue* w = worker(i);
+        n += w->deque[priority].size() + w->inbox_count[priority].load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+void Scheduler::WorkerMetrics::merge(const WorkerMetrics& other) {
+    tasks_executed += other.tasks_executed;
+    inline_executed += other.inline_executed;
+    steals += other.steals;
+    handoffs_out += other.handoffs_out;
+    handoffs_in += other.handoffs_in;
+    tickles_issued += other.tickles_issued;
+    tickles_received += other.tickles_received;
+    epoll_waits += other.epoll_waits;
+    epoll_events += other.epoll_events;
+    poll_ns += other.poll_ns;
+    park_ns += other.park_ns;
+    wakeups += other.wakeups;
+    timer_wakeups += other.timer_wakeups;
+    queue_wait_ns.merge(other.queue_wait_ns);
+    run_ns.merge(other.run_ns);
+    events_per_wakeup.merge(other.events_per_wakeup);
+}
+
+Scheduler::Metrics Scheduler::getMetrics() const {
+    Metrics m;
+    for(size_t i = 0, n = m_workerSlots.load(std::memory_order_acquire); i < n; ++i) {
+        WorkerQueue* w = worker(i);
+        const WorkerQueue::Stats& s = w->stats;
+        WorkerMetrics wm;
+        wm.index = (int)i;
+        wm.thread_id = w->thread_id.load(std::memory_order_relaxed);
+        wm.tasks_executed = s.tasks_executed.get();
+        wm.inline_executed = s.inline_executed.get();
+        wm.steals = s.steals.get();
+        wm.handoffs_out = s.handoffs_out.get();
+        wm.handoffs_in = s.handoffs_in.get();
+        wm.tickles_issued = s.tickles_issued.get();
+        wm.tickles_received = s.tickles_received.load(std::memory_order_relaxed);
+        wm.epoll_waits = s.epoll_waits.get();
+        wm.epoll_events = s.epoll_events.get();
+        wm.poll_ns = s.poll_ns.get();
+        wm.park_ns = s.park_ns.get();
+        wm.wakeups = s.wakeups.get();
+        wm.timer_wakeups = s.timer_wakeups.get();
+        wm.queue_wait_ns = s.queue_wait_ns.snapshot();
+        wm.run_ns = s.run_ns.snapshot();
+        wm.events_per_wakeup = s.events_per_wakeup.snapshot();
+        m.total.merge(wm);
+        m.workers.push_back(wm);
+    }
+    m.external_tickles = m.total.tickles_received > m.total.tickles_issued
+        ? m.total.tickles_received - m.total.tickles_issued: 0;
+    for(int p = 0; p < PRIORITY_COUNT; ++p) {
+        m.queued += getQueueDepth(p);
+    }
+    m.pending = m_pendingTaskCount.load(std::memory_order_relaxed);
+    m.active_workers = getWorkerCount();
+    m.idle_threads = m_idleThreadCount.load(std::memory_order_relaxed);
+    for(int p = 0; p < PRIORITY_COUNT; ++p) {
+        const AdmissionLane& lane = m_admission[p];
+        m.rejected_overload[p] = lane.rejected_overload.load(std::memory_order_relaxed);
+        m.rejected_queue_full[p] = lane.rejected_queue_full.load(std::memory_order_relaxed);
+        m.overloaded[p] = isOverloaded(p);
+    }
+    m.overload_episodes = m_overloadEpisodes.load(std::memory_order_relaxed);
+    m.time_ns = MonotonicNs();
+    return m;
+}
+
+double Scheduler::Metrics::wakeupsPerSecond(const Metrics& prev) const {
+    if(time_ns <= prev.time_ns || total.wakeups < prev.total.wakeups) {
+        return 0;
+    }
+    return (total.wakeups - prev.total.wakeups) * 1e9 / (time_ns - prev.time_ns);
+}
+
+static void format_histogram(std::stringstream& ss, const char* name, const HistogramSnapshot& h) {
+    ss << name << ": count=" << h.count << " mean=" << (uint64_t)h.mean()
+       << " p50=" << h.percentile(0.5) << " p99=" << h.percentile(0.99)
+       << " p999=" << h.percentile(0.999) << " max=" << h.max << "\n";
+}
+
+std::string Scheduler::Metrics::toString() const {
+    std::stringstream ss;
+    ss << "workers=" << active_workers << " idle=" << idle_threads << " queued=" << queued
+       << " pending=" << pending << " pending_events=" << pending_events << "\n";
+    ss << "tasks=" << total.tasks_executed << " inline=" << total.inline_executed << " steals=" << total.steals
+       << " tickles_issued=" << total.tickles_issued << " tickles_received=" << total.tickles_received
+       << " external_tickles=" << external_tickles << " handoffs_out=" << total.handoffs_out
+       << " handoffs_in=" << total.handoffs_in << "\n";
+    ss << "epoll_waits=" << total.epoll_waits << " epoll_events=" << total.epoll_events
+       << " timers_fired=" << timers_fired << " poll_ms=" << total.poll_ns / 1000000
+       << " park_ms=" << total.park_ns / 1000000 << " wakeups=" << total.wakeups
+       << " timer_wakeups=" << total.timer_wakeups << "\n";
+    ss << "overload_episodes=" << overload_episodes;
+    for(int p = 0; p < PRIORITY_COUNT; ++p) {
+        ss << " p" << p << ":overloaded=" << overloaded[p] << ",rejected=" << rejected_overload[p]
+           << "/" << rejected_queue_full[p];
+    }
+    ss << "\n";
+    format_histogram(ss, "queue_wait_ns", total.queue_wait_ns);
+    format_histogram(ss, "run_ns", total.run_ns);
+    format_histogram(ss, "events_per_wakeup", total.events_per_wakeup);
+    format_histogram(ss, "timer_lag_us", timer_lag_us);
+    for(const WorkerMetrics& w: workers) {
+        ss << "worker " << w.index << " tid=" << w.thread_id << " tasks=" << w.tasks_executed
+           << " steals=" << w.steals << " tickles=" << w.tickles_issued << "/" << w.tickles_received
+           << " epoll=" << w.epoll_waits << "/" << w.epoll_events
+           << " poll/park_ms=" << w.poll_ns / 1000000 << "/" << w.park_ns / 1000000
+           << " wakeups=" << w.wakeups << "/" << w.timer_wakeups << "\n";
+    }
+    return ss.str();
+}
+
+Scheduler::FiberMemory Scheduler::getFiberMemory() const {
+    std::vector<Fiber::Info> infos;
+    Fiber::Snapshot(infos, this);
+    FiberMemory mem;
+    for(const Fiber::Info& info: infos) {
+        ++mem.fibers;
+        if(info.wait != Fiber::WAIT_NONE) {
+            ++mem.waiting;
+            mem.longest_wait_ns = std::max(mem.longest_wait_ns, info.wait_ns);
+        }
+        if(info.shared) {
+            ++mem.shared;
+        }
+        mem.stack_bytes += info.stack_size;
+        mem.resident_bytes += info.stack_resident;
+        mem.save_bytes += info.save_bytes;
+        mem.high_water_max = std::max(mem.high_water_max, info.stack_high_water);
+    }
+    return mem;
+}
+
+std::string Scheduler::FiberMemory::toString() const {
+    std::stringstream ss;
+    ss << "fibers=" << fibers << " waiting=" << waiting << " shared=" << shared
+       << " stack_kb=" << stack_bytes / 1024 << " resident_kb=" << resident_bytes / 1024
+       << " save_kb=" << save_bytes / 1024 << " high_water_max=" << high_water_max
+       << " longest_wait_ms=" << longest_wait_ns / 1000000;
+    return ss.str();
+}
+
+std::string Scheduler::dumpFibers(uint64_t min_wait_ms) const {
+    std::vector<Fiber::Info> infos;
+    Fiber::Snapshot(infos, this);
+    std::sort(infos.begin(), infos.end(), [](const Fiber::Info& a, const Fiber::Info& b) {
+        return a.wait_ns > b.wait_ns;
+    });
+    static const char* const states[] = {"READY", "RUNNING", "TERM"};
+    std::stringstream ss;
+    for(const Fiber::Info& info: infos) {
+        if(info.wait_ns < min_wait_ms * 1000000) {
+            continue;
+        }
+        ss << "fiber " << info.id << " " << states[info.state] << " wait=" << Fiber::WaitReasonName(info.wait);
+        if(info.wait == Fiber::WAIT_IO) {
+            ss << " fd=" << (uint32_t)info.wait_arg << " event=" << (info.wait_arg >> 32);
+        } else if(info.wait == Fiber::WAIT_TIMER) {
+            ss << " sleep_us=" << info.wait_arg;
+        }
+        if(info.wait != Fiber::WAIT_NONE) {
+            ss << " waited_ms=" << info.wait_ns / 1000000;
+        }
+        if(info.shared) {
+            ss << " shared bound=" << info.bound_thread << " save=" << info.save_bytes;
+        } else {
+            ss << " stack=" << info.stack_size << " resident=" << info.stack_resident;
+        }
+        ss << " high_water=" << info.stack_high_water << "\n";
+    }
+    return ss.str();
+}
+
+void Scheduler::recordEpollWait(int events) {
+    WorkerQueue* self = t_worker;
+    if(!self || self->scheduler != this || events < 0) {
+        return;
+    }
+    self->stats.epoll_waits.add();
+    self->stats.epoll_events.add(events);
+    self->stats.events_per_wakeup.record(events);
+}
+
+void Scheduler::recordWakeup(bool timeout) {
+    WorkerQueue* self = t_worker;
+    if(!self || self->scheduler != this) {
+        return;
+    }
+    self->stats.wakeups.add();
+    if(timeout) {
+        self->stats.timer_wakeups.add();
+    }
+}
+
+void Scheduler::recordIdleTime(uint64_t poll_ns, uint64_t park_ns) {
+    WorkerQueue* self = t_worker;
+    if(!self || self->scheduler != this) {
+        return;
+    }
+    self->stats.poll_ns.add(poll_ns);
+    self->stats.park_ns.add(park_ns);
+}
+
+// 用于安全地停止调度器(Scheduler)，它会通知所有线程和协程终止运行，等待它们完成后才退出。
+void Scheduler::stop() {
+    SYLAR_LOG_DEBUG() << "Schedule::stop() starts in thread: " << Thread::GetThreadId();
+
+    // 停止过程中不再增减线程
+    stopAutoScale();
+
+    if(stopping()) {
+        // std::cout << "stopping!!!"<< std::endl;
+        return;
+    }
+
+    // 与等待方先登记 sleeping 再检查 stopping() 相对应（均为seq_cst）：
+    // 要么它看到正在关闭而不阻塞，要么下面的 tickle 看到它在等待而唤醒它
+    m_stopping.store(true, std::memory_order_seq_cst);
+
+    if(m_useCaller) {
+        assert(GetThis() == this);
+    } else {
+        assert(GetThis() != this);
+    }
+
+    // 唤醒所有线程（tickle机制）
+    for(size_t i = 0; i < m_workerSlots.load(std::memory_order_acquire); ++i) {
+        // std::cout << "m_threadCount: "<< m_threadCount<< std::endl;
+        tickle();
+    }
+
+    // 唤醒调度协程（schedulerFiber）
+    if(m_schedulerFiber) {
+        tickle();
+    }
+
+    // 恢复执行调度协程（schedulerFiber）
+    if(m_schedulerFiber) {
+        m_schedulerFiber->resume();
+        SYLAR_LOG_DEBUG() << "m_schedulerFiber ends in thread:" << Thread::GetThreadId();
     }
 
     // 将线程列表转移到临时向量
@@ -295,38 +1836,418 @@ void Scheduler::stop() {
     }
 
     for(auto& i: thrs) {
-        i->join();
+        // 主线程的位置为空
+        if(i) {
+            i->join();
+        }
     }
-    if(debug) {
-        std::cout << "Schedule::stop() ends in thread:" << Thread::GetThreadId() << std::endl;
+    // 剩余任务在上面执行完，这期间仍然需要检测
+    stopWatchdog();
+    SYLAR_LOG_DEBUG() << "Schedule::stop() ends in thread:" << Thread::GetThreadId();
+}
+
+void Scheduler::taskDone(WorkerQueue* self, uint64_t start_ns) {
+    if(self) {
+        self->stats.tasks_executed.add();
+        if(start_ns) {
+            self->stats.run_ns.record(MonotonicNs() - start_ns);
+        }
+    }
+    if(m_pendingTaskCount.fetch_sub(1, std::memory_order_acq_rel) == 1 && m_stopping.load(std::memory_order_seq_cst)) {
+        for(size_t i = 0, n = m_workerSlots.load(std::memory_order_acquire); i < n; ++i) {
+            WorkerQueue* w = worker(i);
+            if(w != t_worker) {
+                wake_worker(w);
+            }
+        }
     }
 }
 
+// 唤醒一个正在等待的线程（park() 中或 IOManager 的 epoll_pwait 中），每个线程都有自己的唤醒通道，不会惊群
 void Scheduler::tickle() {
-    // std::cout << "xd" << std::endl;
+    if(!hasParkedThreads()) {
+        return;
+    }
+    for(size_t i = 0, n = m_workerSlots.load(std::memory_order_acquire); i < n; ++i) {
+        WorkerQueue* w = worker(i);
+        if(w != t_worker && w->state.load(std::memory_order_relaxed) == WORKER_ACTIVE && wake_worker(w)) {
+            return;
+        }
+    }
+    // 没有可叫醒的工作线程：叫醒一个在 park() 中等待的其他线程
+    if(m_strayParked.load(std::memory_order_seq_cst) > 0) {
+        m_strayParkSeq.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, &m_strayParkSeq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+}
+
+void Scheduler::tickleWorker(size_t index) {
+    if(index >= m_workerSlots.load(std::memory_order_acquire)) {
+        return;
+    }
+    WorkerQueue* w = worker(index);
+    if(w != t_worker) {
+        wake_worker(w);
+    }
 }
 
 void Scheduler::idle() {
-    // std::cout << "xd" << std::endl;
+    // 依靠stopping()函数进行检测是否有任务处理；被要求退出的线程处理完剩余任务后也结束
+    while(!stopping() && !tryRetire()) {
+        SYLAR_LOG_DEBUG() << "Scheduler::idle(), sleeping in thread: " << Thread::GetThreadId();
+        // 先自旋、再让出CPU，都没有等到任务才在futex上阻塞，由 tickle() 或定向唤醒叫醒
+        if(!spinForWork()) {
+            uint32_t polls = m_idlePollCount.load(std::memory_order_relaxed);
+            bool found = false;
+            for(uint32_t i = 0; i < polls && !found; ++i) {
+                sched_yield();
+                found = hasWork();
+            }
+            if(!found) {
+                park(m_idleParkTimeout.load(std::memory_order_relaxed));
+            }
+        }
+        Fiber::Current()->yield();
+    }
+}
+
+void Scheduler::setAutoScale(const AutoScalePolicy& policy) {
+    std::lock_guard<std::mutex> lock(m_autoScaleMutex);
+    m_autoScale = policy;
+    m_autoScaleStop = false;
+    if(!m_autoScaleThread) {
+        m_autoScaleThread.reset(new Thread(std::bind(&Scheduler::autoScale, this), m_name + "_autoscale"));
+    }
+}
+
+void Scheduler::stopAutoScale() {
+    std::shared_ptr<Thread> thr;
+    {
+        std::lock_guard<std::mutex> lock(m_autoScaleMutex);
+        m_autoScaleStop = true;
+        thr.swap(m_autoScaleThread);
+    }
+    m_autoScaleCv.notify_all();
+    if(thr) {
+        thr->join();
+    }
+}
+
+void Scheduler::autoScale() {
+    // 连续满足缩容条件的采样次数
+    uint32_t idle_rounds = 0;
+    std::unique_lock<std::mutex> lock(m_autoScaleMutex);
+    while(!m_autoScaleStop) {
+        m_autoScaleCv.wait_for(lock, std::chrono::milliseconds(m_autoScale.interval_ms));
+        if(m_autoScaleStop) {
+            break;
+        }
+        AutoScalePolicy policy = m_autoScale;
+        lock.unlock();
+
+        size_t workers = getWorkerCount();
+        size_t queued = 0;
+        for(int p = 0; p < PRIORITY_COUNT; ++p) {
+            queued += getQueueDepth(p);
+        }
+        size_t idle = m_idleThreadCount.load(std::memory_order_relaxed);
+        if(workers < policy.min_threads) {
+            addWorkers(policy.min_threads - workers);
+            idle_rounds = 0;
+        } else if(workers < policy.max_threads && idle == 0
+                  && queued > policy.grow_queue_depth * std::max<size_t>(workers, 1)) {
+            addWorkers(1);
+            idle_rounds = 0;
+        } else if(workers > policy.min_threads && idle >= policy.shrink_idle_ratio * workers) {
+            if(++idle_rounds >= policy.shrink_after) {
+                retireWorkers(1);
+                idle_rounds = 0;
+            }
+        } else {
+            idle_rounds = 0;
+        }
+
+        lock.lock();
+    }
+}
 
-    // 依靠stopping()函数进行检测是否有任务处理
-    while(!stopping()) {
-        if(debug) {
-            std::cout << "Scheduler::idle(), sleeping in thread: " << Thread::GetThreadId() << std::endl;	
+void Scheduler::setWatchdog(const WatchdogPolicy& policy) {
+    install_sample_handler();
+    std::lock_guard<std::mutex> lock(m_watchdogMutex);
+    m_watchdog = policy;
+    m_watchdogStop = false;
+    m_watchdogOn = true;
+    if(!m_watchdogThread) {
+        m_watchdogThread.reset(new Thread(std::bind(&Scheduler::watchdog, this), m_name + "_watchdog"));
+    }
+}
+
+void Scheduler::stopWatchdog() {
+    std::shared_ptr<Thread> thr;
+    {
+        std::lock_guard<std::mutex> lock(m_watchdogMutex);
+        m_watchdogStop = true;
+        m_watchdogOn = false;
+        thr.swap(m_watchdogThread);
+    }
+    m_watchdogCv.notify_all();
+    if(thr) {
+        thr->join();
+    }
+}
+
+void Scheduler::setAdmission(const AdmissionPolicy& policy) {
+    std::shared_ptr<const std::function<void(int, RejectReason)>> cb;
+    if(policy.on_reject) {
+        cb = std::make_shared<const std::function<void(int, RejectReason)>>(policy.on_reject);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_admissionMutex);
+        m_onReject.swap(cb);
+    }
+    m_admissionTargetNs.store((uint64_t)policy.target_us * 1000, std::memory_order_relaxed);
+    m_admissionIntervalNs.store((uint64_t)std::max<uint32_t>(policy.interval_ms, 1) * 1000000, std::memory_order_relaxed);
+    for(int p = 0; p < PRIORITY_COUNT; ++p) {
+        m_admission[p].max_depth.store(policy.max_queue_depth[p], std::memory_order_relaxed);
+        m_admission[p].shed.store(policy.shed[p], std::memory_order_relaxed);
+    }
+    m_admissionOn.store(true, std::memory_order_release);
+}
+
+void Scheduler::clearAdmission() {
+    m_admissionOn.store(false, std::memory_order_release);
+    for(AdmissionLane& lane: m_admission) {
+        lane.above_until_ns.store(0, std::memory_order_relaxed);
+        lane.overloaded.store(false, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(m_admissionMutex);
+    m_onReject.reset();
+}
+
+bool Scheduler::isOverloaded(int priority) const {
+    assert(priority >= 0 && priority < PRIORITY_COUNT);
+    return m_admissionOn.load(std::memory_order_relaxed)
+        && m_admission[priority].overloaded.load(std::memory_order_relaxed);
+}
+
+void Scheduler::admissionSample(int priority, uint64_t now_ns, uint64_t sojourn_ns) {
+    AdmissionLane& lane = m_admission[priority];
+    // 只在状态变化时写，大多数任务只是几次读
+    if(sojourn_ns < m_admissionTargetNs.load(std::memory_order_relaxed)) {
+        if(lane.above_until_ns.load(std::memory_order_relaxed)) {
+            lane.above_until_ns.store(0, std::memory_order_relaxed);
+        }
+        if(lane.overloaded.load(std::memory_order_relaxed)) {
+            lane.overloaded.store(false, std::memory_order_relaxed);
+        }
+        return;
+    }
+    uint64_t interval = m_admissionIntervalNs.load(std::memory_order_relaxed);
+    uint64_t until = lane.above_until_ns.load(std::memory_order_relaxed);
+    if(!until) {
+        lane.above_until_ns.compare_exchange_strong(until, now_ns + interval, std::memory_order_relaxed);
+    } else if(now_ns >= until && !lane.overloaded.load(std::memory_order_relaxed)) {
+        bool expected = false;
+        if(lane.overloaded.compare_exchange_strong(expected, true, std::memory_order_relaxed)) {
+            lane.recheck_ns.store(now_ns + interval, std::memory_order_relaxed);
+            m_overloadEpisodes.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool Scheduler::admit(int priority) {
+    if(!m_admissionOn.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    assert(priority >= 0 && priority < PRIORITY_COUNT);
+    AdmissionLane& lane = m_admission[priority];
+    RejectReason reason;
+    size_t max_depth = lane.max_depth.load(std::memory_order_relaxed);
+    if(lane.overloaded.load(std::memory_order_relaxed) && lane.shed.load(std::memory_order_relaxed)) {
+        // 拒绝掉所有新工作以后可能不再有任务被取出来更新状态：每隔一个间隔看一次队列，排空了就退出过载
+        uint64_t now = MonotonicNs();
+        uint64_t recheck = lane.recheck_ns.load(std::memory_order_relaxed);
+        if(now >= recheck && lane.recheck_ns.compare_exchange_strong(recheck,
+                now + m_admissionIntervalNs.load(std::memory_order_relaxed), std::memory_order_relaxed)
+            && getQueueDepth(priority) == 0) {
+            lane.above_until_ns.store(0, std::memory_order_relaxed);
+            lane.overloaded.store(false, std::memory_order_relaxed);
+            return true;
+        }
+        reason = REJECT_OVERLOAD;
+        lane.rejected_overload.fetch_add(1, std::memory_order_relaxed);
+    } else if(max_depth && getQueueDepth(priority) >= max_depth) {
+        reason = REJECT_QUEUE_FULL;
+        lane.rejected_queue_full.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        return true;
+    }
+    std::shared_ptr<const std::function<void(int, RejectReason)>> cb;
+    {
+        std::lock_guard<std::mutex> lock(m_admissionMutex);
+        cb = m_onReject;
+    }
+    if(cb) {
+        (*cb)(priority, reason);
+    }
+    return false;
+}
+
+// 向工作线程发信号采样它当前的调用栈，最多等待10ms
+static void sample_backtrace(WorkerQueue* w, std::vector<std::string>& out) {
+    w->bt_ready.store(false, std::memory_order_relaxed);
+    w->bt_requested.store(true, std::memory_order_release);
+    if(pthread_kill(w->pthread, sample_signal()) != 0) {
+        w->bt_requested.store(false, std::memory_order_relaxed);
+        return;
+    }
+    for(int i = 0; i < 100 && !w->bt_ready.load(std::memory_order_acquire); ++i) {
+        usleep(100);
+    }
+    if(!w->bt_ready.load(std::memory_order_acquire)) {
+        w->bt_requested.store(false, std::memory_order_relaxed);
+        return;
+    }
+    char** symbols = backtrace_symbols(w->bt_frames, w->bt_depth);
+    if(!symbols) {
+        return;
+    }
+    // 第一帧是信号处理函数本身
+    for(int i = 1; i < w->bt_depth; ++i) {
+        out.push_back(symbols[i]);
+    }
+    free(symbols);
+}
+
+void Scheduler::watchdog() {
+    // 每个工作线程上次报告的任务序号，同一个任务只报告一次
+    std::vector<uint64_t> reported(MAX_WORKERS, 0);
+    std::unique_lock<std::mutex> lock(m_watchdogMutex);
+    while(!m_watchdogStop) {
+        m_watchdogCv.wait_for(lock, std::chrono::milliseconds(std::max<uint32_t>(m_watchdog.check_interval_ms, 1)));
+        if(m_watchdogStop) {
+            break;
+        }
+        uint64_t slice_ns = (uint64_t)m_watchdog.slice_ms * 1000000;
+        uint64_t warn_ns = (uint64_t)m_watchdog.warn_ms * 1000000;
+        bool want_backtrace = m_watchdog.backtrace;
+        std::function<void(const LongRunningReport&)> on_report = m_watchdog.on_report;
+        lock.unlock();
+
+        uint64_t now = MonotonicNs();
+        for(size_t i = 0, n = m_workerSlots.load(std::memory_order_acquire); i < n; ++i) {
+            WorkerQueue* w = worker(i);
+            uint64_t start = w->run_start_ns.load(std::memory_order_acquire);
+            if(!start || now <= start) {
+                continue;
+            }
+            uint64_t elapsed = now - start;
+            if(slice_ns && elapsed >= slice_ns) {
+                w->yield_requested.store(true, std::memory_order_relaxed);
+            }
+            if(!warn_ns || elapsed < warn_ns) {
+                continue;
+            }
+            uint64_t seq = w->run_seq.load(std::memory_order_relaxed);
+            if(reported[i] == seq) {
+                continue;
+            }
+            reported[i] = seq;
+
+            LongRunningReport report;
+            report.worker_index = (int)i;
+            report.thread_id = w->thread_id.load(std::memory_order_relaxed);
+            report.fiber_id = w->run_fiber_id.load(std::memory_order_relaxed);
+            report.elapsed_ms = elapsed / 1000000;
+            if(want_backtrace) {
+                sample_backtrace(w, report.backtrace);
+            }
+            if(on_report) {
+                on_report(report);
+            } else {
+                SYLAR_LOG_WARN() << "Scheduler::watchdog() " << m_name << ": worker " << report.worker_index
+                                 << " tid=" << report.thread_id << " fiber=" << report.fiber_id
+                                 << " running for " << report.elapsed_ms << "ms";
+                for(const std::string& frame: report.backtrace) {
+                    SYLAR_LOG_WARN() << "    " << frame;
+                }
+            }
         }
-        //降低空闲协程在无任务时对cpu占用率，避免空转浪费资源
-        sleep(1);
-        Fiber::GetThis()->yield();
 
-        // std::cout << "idle" <<std::endl;
+        lock.lock();
+    }
+}
+
+void Scheduler::MaybeYield() {
+    WorkerQueue* self = t_worker;
+    if(!self || !self->yield_requested.load(std::memory_order_relaxed)) {
+        return;
+    }
+    self->yield_requested.store(false, std::memory_order_relaxed);
+    Scheduler* sc = self->scheduler;
+    // 没有别的任务在等就继续运行，后台线程下次检查时会再次置位
+    if(!Fiber::CanSuspend() || !sc->hasWork()) {
+        return;
+    }
+    // 放到全局队列末尾而不是本地队列：本地队列是后进先出的，马上又会取到自己
+    Fiber* fiber = Fiber::Current();
+    std::vector<ScheduleTask*> tasks(1, new ScheduleTask(Fiber::ptr(fiber), -1));
+    sc->m_pendingTaskCount.fetch_add(1, std::memory_order_relaxed);
+    sc->pushGlobal(tasks, true);
+    fiber->yield();
+}
+
+bool Scheduler::switchTo(int thread) {
+    Scheduler* from = GetThis();
+    if(from == this && (thread == -1 || thread == Thread::GetThreadId())) {
+        return true;
+    }
+    if(!Fiber::CanSuspend()) {
+        return false;
+    }
+    Fiber* fiber = Fiber::Current();
+    // 共享栈协程的栈内容只能恢复到这个线程的共享栈上
+    if(fiber->getBoundThread() != -1) {
+        return false;
+    }
+    WorkerQueue* self = t_worker;
+    if(self && self->scheduler == from) {
+        self->stats.handoffs_out.add();
+    }
+    // 目标线程可能在这里让出之前就取到它，resume() 会等切换完成
+    scheduleLock(Fiber::ptr(fiber), thread);
+    fiber->yield();
+    self = t_worker;
+    if(self && self->scheduler == this) {
+        self->stats.handoffs_in.add();
+    }
+    return true;
+}
+
+SchedulerSwitcher::SchedulerSwitcher(Scheduler* target, int thread)
+    :m_caller(Scheduler::GetThis()) {
+    if(!target || !m_caller || target == m_caller) {
+        return;
+    }
+    // 协程离开期间原调度器不能停止，否则回不去
+    m_caller->beginExternalWait();
+    m_switched = target->switchTo(thread);
+    if(!m_switched) {
+        m_caller->endExternalWait();
+    }
+}
+
+SchedulerSwitcher::~SchedulerSwitcher() {
+    if(m_switched) {
+        m_caller->switchTo();
+        m_caller->endExternalWait();
     }
 }
 
 bool Scheduler::stopping() {
-    std::lock_guard<std::mutex> lock(m_mutex);
     // std::cout << "m_stopping: "<< std::boolalpha<< m_stopping<< std::endl;
-    // std::cout << "m_activeThreadCount: "<< m_activeThreadCount<< std::endl;
-    return m_stopping && m_tasks.empty() && m_activeThreadCount == 0;
+    // 待完成任务数同时涵盖了所有队列中排队的任务和正在执行的任务
+    return m_stopping.load(std::memory_order_seq_cst) && m_pendingTaskCount.load(std::memory_order_acquire) == 0;
 }
 
 }
@@ -2,17 +2,146 @@
 #define _SCHEDULER_H_
 
 //#include "hook.h"
+#include "cancel.h"
 #include "fiber.h"
+#include "metrics.h"
 #include "thread.h"
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
 #include <mutex>
+#include <signal.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace sylar {
+// 每个工作线程的任务队列（Chase-Lev 双端队列 + 指定线程任务的信箱），定义见 scheduler.cpp
+struct WorkerQueue;
 
 class Scheduler {
+    friend struct WorkerQueue;
 public:
-    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name="Scheduler");
+    // 任务优先级，数值越小越优先
+    // 每个优先级有独立的本地队列、信箱链表和全局队列，工作线程按加权轮转在各优先级之间取任务：
+    // 高优先级的任务不会排在大批低优先级任务后面，低优先级也总能分到一定比例，不会被饿死
+    enum Priority {
+        // 延迟敏感的任务：健康检查、心跳、控制面请求
+        PRIORITY_HIGH = 0,
+        // 默认
+        PRIORITY_NORMAL = 1,
+        // 批量/后台任务
+        PRIORITY_LOW = 2,
+        PRIORITY_COUNT = 3
+    };
+
+    // 工作线程的放置（CPU亲和性 / NUMA），下标同 scheduleOnIndex：使用调用者线程时最后一个对应主线程，
+    // 主线程在进入调度时才绑定，调度结束后不会恢复
+    struct Placement {
+        // cpus[i] 为第i个工作线程绑定的CPU集合，为空（或不足i+1项）表示不绑定
+        std::vector<std::vector<int>> cpus;
+        // 没有单独指定CPU的线程按下标轮流分配到各个NUMA节点，绑定到所在节点允许使用的全部CPU
+        bool numa_spread;
+
+        Placement(): numa_spread(false) {}
+    };
+
+    // 空闲策略：线程没有任务时先在用户态自旋检查任务队列，然后非阻塞地轮询，最后才阻塞（park）
+    // 自旋和轮询越多，新任务到来时的唤醒延迟越低，代价是空闲时占用更多CPU
+    struct IdlePolicy {
+        // 自旋阶段检查任务队列的次数，两次检查之间执行一次 pause，0表示不自旋
+        uint32_t spin_count;
+        // 阻塞前非阻塞轮询的次数：IOManager 为 timeout 为0的 epoll_wait，Scheduler 为 sched_yield
+        uint32_t poll_count;
+        // 一次阻塞的最长时间（毫秒），超时后重新检查；IOManager 还会受最近一个定时器的限制
+        // 阻塞时 Scheduler 等待在工作线程自己的futex上，IOManager 等待在 epoll_pwait 中，有新任务时被定向唤醒
+        uint32_t park_timeout_ms;
+
+        IdlePolicy(): spin_count(100), poll_count(1), park_timeout_ms(5000) {}
+    };
+
+    // 工作线程（包括主线程）的上限，运行期间增加线程不能超过它
+    static const size_t MAX_WORKERS = 256;
+
+    // 自动伸缩策略：后台线程每隔 interval_ms 采样一次排队任务数和空闲线程数，
+    // 排队的任务多并且没有空闲线程时增加一个线程，连续 shrink_after 次空闲比例都不低于 shrink_idle_ratio 时退出一个线程。
+    // 线程数只计算额外创建的线程，不包括主线程（use_caller）
+    struct AutoScalePolicy {
+        size_t min_threads;
+        size_t max_threads;
+        uint32_t interval_ms;
+        // 平均每个线程排队的任务超过它时扩容
+        size_t grow_queue_depth;
+        // 空闲线程数 / 线程数
+        double shrink_idle_ratio;
+        uint32_t shrink_after;
+
+        AutoScalePolicy(): min_threads(1), max_threads(MAX_WORKERS - 1), interval_ms(100),
+                           grow_queue_depth(64), shrink_idle_ratio(0.5), shrink_after(50) {}
+    };
+
+    // 一次长时间运行的报告
+    struct LongRunningReport {
+        // 工作线程下标和线程id
+        int worker_index;
+        int thread_id;
+        // 正在运行的协程id，内联执行的回调为0
+        uint64_t fiber_id;
+        // 已经运行的时间
+        uint64_t elapsed_ms;
+        // 采样到的调用栈（backtrace_symbols 的输出），未开启或采样失败时为空
+        std::vector<std::string> backtrace;
+    };
+
+    // 长时间运行检测：后台线程每隔 check_interval_ms 检查各工作线程上当前任务已经运行了多久。
+    // 超过 slice_ms 时请求它在下一个 maybe_yield() 处让出；超过 warn_ms 时报告一次（每个任务最多一次）。
+    // 没有抢占，一直不调用 maybe_yield() 的任务只会被报告，不会被打断
+    struct WatchdogPolicy {
+        uint32_t slice_ms;
+        uint32_t warn_ms;
+        uint32_t check_interval_ms;
+        // 报告时是否用信号采样该线程的调用栈
+        bool backtrace;
+        // 报告回调，在后台线程中调用；为空时写 WARN 日志
+        std::function<void(const LongRunningReport&)> on_report;
+
+        WatchdogPolicy(): slice_ms(10), warn_ms(100), check_interval_ms(5), backtrace(true) {}
+    };
+
+    // 接纳控制拒绝新工作的原因
+    enum RejectReason {
+        // 该优先级处于过载状态（排队时间持续超过目标）
+        REJECT_OVERLOAD = 0,
+        // 该优先级排队的任务数达到上限
+        REJECT_QUEUE_FULL
+    };
+
+    // 接纳控制：过载时让一部分新工作立即失败，而不是让所有请求一起排队到超时、内存一直涨到被杀掉。
+    // 每个优先级按 CoDel 的方式判断过载：工作线程取出任务时计算它的排队时间，排队时间连续 interval_ms 都不低于 target_us
+    // （一个间隔内队列从没排空过，是持续积压而不是突发）时进入过载，取出一个排队时间低于 target_us 的任务、
+    // 或者队列已经排空时退出。
+    // 只有经过 admit()/trySchedule() 的新工作会被拒绝；scheduleLock() 等原有接口、挂起后重新调度的协程总是入队——
+    // 它们是已经接纳的工作，丢掉只会让协程永远挂着
+    struct AdmissionPolicy {
+        uint32_t target_us;
+        uint32_t interval_ms;
+        // 各优先级排队任务数的上限，0表示不限制
+        size_t max_queue_depth[PRIORITY_COUNT];
+        // 过载时是否拒绝该优先级的新工作。默认高优先级不拒绝：过载时健康检查、心跳也要能进来
+        bool shed[PRIORITY_COUNT];
+        // 拒绝时在调用 admit() 的线程上调用，参数为优先级和原因，用于打日志、降级等；为空时只计数
+        std::function<void(int priority, RejectReason reason)> on_reject;
+
+        AdmissionPolicy(): target_us(5000), interval_ms(100), max_queue_depth{0, 0, 0}, shed{false, true, true} {}
+    };
+
+    // placement 指定了绑定时，每个工作线程的任务队列分配在它所在节点的内存上，
+    // 线程从创建起就运行在绑定的CPU上，它自己分配的协程栈、epoll_event 数组等也都落在本地节点
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name="Scheduler",
+              const Placement& placement = Placement());
     virtual ~Scheduler();
 
     const std::string& getName() const {
@@ -23,6 +152,13 @@ public:
     // 获取正在运行的调度器
     static Scheduler* GetThis();
 
+    // 定向唤醒阻塞在 epoll_pwait 上的空闲线程所用的信号，默认 SIGRTMIN+3。
+    // 第一个工作线程启动时为它安装进程级的处理函数，之后不再卸载：程序的其他部分不能再使用这个信号。
+    // 安装时发现该信号已经有别的处理函数会记一条错误日志并替换它，冲突时应在创建任何调度器之前换一个空闲的信号。
+    // 已经安装之后再调用返回false（errno 为 EBUSY）；信号无效或与调用栈采样信号（SIGRTMIN+4）相同返回false（EINVAL）
+    static bool SetWakeupSignal(int sig);
+    static int GetWakeupSignal();
+
     pid_t getThreadIdByIndex(int idx) const {
         auto it = m_threadIdMap.find(idx);
         if(it != m_threadIdMap.end()) return it->second;
@@ -36,38 +172,160 @@ protected:
 
 public:
     // 添加任务到任务队列
+    // 在本调度器的工作线程中提交、且未指定线程的任务放入该线程自己的双端队列（无锁），空闲的线程会来窃取；
+    // 指定了线程的任务放入目标线程的信箱，只会在该线程上执行；其他线程提交的任务放入全局注入队列。
+    // stack_flags 仅对回调任务有效，决定执行该回调的协程使用哪种栈（Fiber::StackFlag），
+    // 例如长连接处理函数可以用 Fiber::STACK_SHARED 运行在共享栈上
+    // priority 为任务优先级（Priority）
 template<class FiberOrCb>
-void scheduleLock(FiberOrCb fc, int thread = -1) {
-    bool need_tickle;
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        // empty ->  all thread is idle -> need to be waken up
-        need_tickle = m_tasks.empty();
-
-        ScheduleTask task(fc, thread);
-        if(task.fiber || task.cb) {
-            m_tasks.push_back(task);
-        }
+void scheduleLock(FiberOrCb fc, int thread = -1, int stack_flags = Fiber::STACK_DEFAULT, int priority = PRIORITY_NORMAL) {
+    ScheduleTask task(std::move(fc), thread);
+    task.stack_flags = stack_flags;
+    task.priority = priority;
+    if(task.fiber || task.cb) {
+        pushTask(std::move(task));
     }
+}
 
-    // 暂时无用
-    if(need_tickle) {
-        tickle();
+    // 先经过接纳控制（admit）再调度：被拒绝时不入队，fc 被丢弃，返回false。未开启接纳控制时同 scheduleLock
+template<class FiberOrCb>
+bool trySchedule(FiberOrCb fc, int thread = -1, int stack_flags = Fiber::STACK_DEFAULT, int priority = PRIORITY_NORMAL) {
+    if(!admit(priority)) {
+        return false;
     }
+    scheduleLock(std::move(fc), thread, stack_flags, priority);
+    return true;
+}
+
+    // 提交一个内联执行的回调（Fiber::STACK_INLINE）：不分配协程，直接在工作线程的调度协程上运行。
+    // 回调必须不会让出（不能 yield、不能调用会挂起的hook函数），否则触发断言
+template<class F>
+void scheduleInline(F cb, int thread = -1, int priority = PRIORITY_NORMAL) {
+    scheduleLock(Callback(std::move(cb)), thread, Fiber::STACK_INLINE, priority);
 }
 
+    // 把任务放入第index个工作线程的信箱（与 getThreadIdByIndex 的下标一致，使用调用者线程时主线程为最后一个），
+    // 不需要按线程id查找，代价与不指定线程的调度相同；只会唤醒目标线程
+template<class FiberOrCb>
+void scheduleOnIndex(FiberOrCb fc, int index, int stack_flags = Fiber::STACK_DEFAULT, int priority = PRIORITY_NORMAL) {
+    ScheduleTask task(std::move(fc), -1);
+    task.stack_flags = stack_flags;
+    task.priority = priority;
+    if(task.fiber || task.cb) {
+        pushTaskOnIndex(std::move(task), index);
+    }
+}
+
+    // 批量添加任务：[first, last) 中的协程/回调被移动进调度器，全局队列只加一次锁，
+    // 并且只唤醒与任务数相当的空闲线程，而不是每个任务各唤醒一次
+template<class Iterator>
+void scheduleBatch(Iterator first, Iterator last, int thread = -1, int stack_flags = Fiber::STACK_DEFAULT,
+                   int priority = PRIORITY_NORMAL) {
+    Batch batch(this);
+    for(; first != last; ++first) {
+        batch.add(std::move(*first), thread, stack_flags, priority);
+    }
+    batch.submit();
+}
+
+    // 第index个工作线程所在的NUMA节点，未绑定时返回-1
+    int getWorkerNode(size_t index) const {
+        return index < MAX_WORKERS ? m_workerNodes[index]: -1;
+    }
+
+    // 第index个工作线程绑定的CPU集合，为空表示未绑定
+    const std::vector<int>& getWorkerCpus(size_t index) const {
+        return m_workerCpus[index];
+    }
+
     // 启动线程池
     // 启动调度器（线程池开始工作）
+    // 有线程需要绑定时，以 INFO 级别把各线程的放置情况写入日志（SYLAR_LOG_INFO）
     virtual void start();
 
     // 关闭线程池
     // 停止调度器，结束线程池
     virtual void stop();
 
+    // 运行期间增加n个工作线程，优先复用已退出线程的下标，返回实际增加的数量（受 MAX_WORKERS 限制，未启动或正在停止时为0）
+    // placement 指定了 numa_spread 时新线程同样按下标轮流分配到各个节点
+    size_t addWorkers(size_t n);
+
+    // 让最多n个额外创建的工作线程退出（下标大的先退出，至少保留一个），返回实际通知的数量，不等待线程结束。
+    // 退出的线程把本地队列和信箱里的任务移到全局队列，指定到它的任务改为不指定线程；
+    // 绑定在它共享栈上的协程只能在它上面恢复，线程会一直等到这些协程都析构之后才真正退出
+    size_t retireWorkers(size_t n);
+
+    // 正在运行（没有被要求退出）的额外创建的工作线程数，不包括主线程
+    size_t getWorkerCount() const {
+        return m_activeWorkers.load(std::memory_order_relaxed);
+    }
+
+    // 开启（或更新）自动伸缩，调度器停止时自动关闭
+    void setAutoScale(const AutoScalePolicy& policy);
+
+    // 关闭自动伸缩，等待后台线程结束
+    void stopAutoScale();
+
+    // 开启（或更新）长时间运行检测，调度器停止时自动关闭。
+    // 开启后每个任务开始时多一次取时间
+    void setWatchdog(const WatchdogPolicy& policy);
+
+    // 关闭长时间运行检测，等待后台线程结束
+    void stopWatchdog();
+
+    // 开启（或更新）接纳控制。开启后每个任务入队时都记录时间，排队和执行时间同时计入统计（同 setLatencyTracking）
+    void setAdmission(const AdmissionPolicy& policy);
+
+    // 关闭接纳控制，清除过载状态
+    void clearAdmission();
+
+    // 该优先级现在是否接纳一个新工作：不接纳时计数、调用 on_reject 并返回false，未开启接纳控制时总是返回true。
+    // 用在接受连接、解析出请求之类的入口上提前拒绝，由调用方决定怎么失败（关闭连接、返回503等）
+    bool admit(int priority = PRIORITY_NORMAL);
+
+    // 某个优先级当前是否处于过载状态
+    bool isOverloaded(int priority = PRIORITY_NORMAL) const;
+
+    // 当前任务的时间片已经用完（由 setWatchdog 的后台线程判断）并且还有其他任务等着执行时，
+    // 把当前协程放到全局队列末尾并让出；否则只是一次线程局部的读，适合放在CPU密集的循环里。
+    // 不在调度器的协程中（或未开启 setWatchdog）时什么也不做
+    static void MaybeYield();
+
+    // 把当前协程换到本调度器上继续执行：放入本调度器的队列（thread 为线程id，-1 不指定）后让出，
+    // 返回时已经运行在本调度器的工作线程上，原来的工作线程可以立即去执行别的任务。
+    // 适合 IOManager 的连接协程把CPU密集的处理换到一个普通 Scheduler 线程池上做，epoll 循环不会被拖住。
+    // 已经在本调度器（和指定的线程）上时直接返回true；不在可挂起的协程中（线程主协程、调度协程、内联回调），
+    // 或者是已经绑定线程的共享栈协程时不切换，返回false。
+    // 切换之后 GetThis() 是本调度器，hook 的IO等待、addEvent 等都作用在它上面；原调度器在协程离开期间
+    // 不再把它算作待完成的任务，需要回去的用 SchedulerSwitcher
+    bool switchTo(int thread = -1);
+
+    // 外部线程（不是本调度器的工作线程）提交未指定线程的任务时，不再加锁放入全局队列，
+    // 而是轮流压入各工作线程的无锁信箱，该线程取出时转入本地双端队列，其他线程仍然可以窃取。
+    // 适合多核上大量外部线程（卸载线程池、其他调度器等）同时提交、全局锁竞争激烈的场景；
+    // 外部提交不多时全局队列更省：任务不需要再被窃取一次，默认关闭
+    void setExternalInjection(bool on) {
+        m_injectExternal.store(on, std::memory_order_relaxed);
+    }
+
+    // 协程挂起在调度器之外（例如卸载线程池），之后由其他线程重新调度回来时，挂起前调用 beginExternalWait()，
+    // 重新调度之后调用 endExternalWait()：期间它算作一个待完成的任务，stop() 会等它回来
+    void beginExternalWait() {
+        m_pendingTaskCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void endExternalWait() {
+        taskDone(nullptr, 0);
+    }
+
 protected:
     // 通知空闲线程有新任务进入（通常用条件变量或其他唤醒机制实现）。
     virtual void tickle();
 
+    // 定向唤醒第index个工作线程（它正在等待时），不唤醒当前线程自己
+    void tickleWorker(size_t index);
+
     // 线程函数
     // 线程池中线程运行的核心逻辑（执行任务调度和任务执行）。
     virtual void run();
@@ -80,17 +338,229 @@ protected:
     // 判断调度器是否处于关闭状态
     virtual bool stopping();
 
+    // 当前线程在本调度器中的工作线程下标，不是本调度器的工作线程时返回-1
+    int getCurrentWorkerIndex() const;
+
+    // 第index个工作线程正在 run() 中调度并且没有被要求退出（使用调用者线程时主线程只在 stop() 期间算作运行）
+    bool isWorkerRunning(size_t index) const;
+
+    // 第index个工作线程的线程id，尚未开始运行为-1
+    int getWorkerThreadId(size_t index) const;
+
+    // 工作线程下标的上界（包括已经退出、下标等待复用的线程）
+    size_t getWorkerSlots() const {
+        return m_workerSlots.load(std::memory_order_acquire);
+    }
+
     bool hasIdleThreads() {
         return m_idleThreadCount > 0;
     }
 
+    // 是否有线程阻塞在（或即将进入）等待中；还在自旋、轮询的空闲线程会自己发现新任务，不需要唤醒
+    // 调用前已经放入的任务，一定会被返回false时仍在检查的线程看到
+    bool hasParkedThreads();
+
+    // 当前线程可以取到的任务：本线程信箱、全局队列、任意线程的本地队列（可窃取）是否非空
+    bool hasWork();
+
+    // 按空闲策略自旋检查任务队列，期间出现任务返回true
+    bool spinForWork();
+
+    // 空闲线程阻塞等待之前调用：标记本线程正在等待，返回阻塞期间应使用的信号掩码（放开定向唤醒信号，用于epoll_pwait）
+    // 已经有可取的任务时返回nullptr，此时不应阻塞；无论返回什么都要调用 finishWait()。
+    // wake_fd 为本线程独占的epoll上注册的eventfd时，定向唤醒改为向它写入而不发信号（fd 在调度器的生命期内必须一直有效）
+    const sigset_t* prepareWait(int wake_fd = -1);
+
+    // 阻塞等待返回后调用
+    void finishWait();
+
+    // 本线程的信箱里是否有任务（被定向唤醒后用来判断是否需要退出等待）
+    bool hasInboxTask();
+
+    // 在本线程的futex上阻塞，直到被 tickle()/定向唤醒或超时。
+    // 不是本调度器的工作线程时在调度器共用的futex上阻塞，tickle() 没有叫醒任何工作线程时唤醒它
+    void park(uint32_t timeout_ms);
+
+    // 本线程被要求退出（retireWorkers）并且手上的任务都已处理完时完成退出，返回true，此时 idle() 应当结束
+    bool tryRetire();
+
+    // 记录本线程一次 epoll_wait 返回的事件数（IOManager 使用）
+    void recordEpollWait(int events);
+
+    // 记录本线程一次阻塞等待返回，timeout 为没有事件、超时返回（IOManager 使用）
+    void recordWakeup(bool timeout);
+
+    // 记录本线程一轮空闲中轮询和阻塞的时间（纳秒，IOManager 使用）
+    void recordIdleTime(uint64_t poll_ns, uint64_t park_ns);
+
+private:
+    // 一个任务执行完（或半路yield）；停止阶段最后一个任务完成时唤醒所有阻塞的线程，让它们看到 stopping()
+    // start_ns 不为0时记录本次执行的时间
+    void taskDone(WorkerQueue* self, uint64_t start_ns);
+
+public:
+    void setIdlePolicy(const IdlePolicy& policy);
+    IdlePolicy getIdlePolicy() const;
+
+    // 每个工作线程最多缓存多少个已结束的回调协程用于复用，0表示不复用
+    void setFiberCacheSize(size_t n) {
+        m_fiberCacheSize = n;
+    }
+
+    size_t getFiberCacheSize() const {
+        return m_fiberCacheSize;
+    }
+
+    // 为回调任务新创建的协程数
+    uint64_t getFiberCreatedCount() const {
+        return m_fiberCreated.load(std::memory_order_relaxed);
+    }
+
+    // 通过reset复用缓存协程执行的回调任务数
+    uint64_t getFiberReusedCount() const {
+        return m_fiberReused.load(std::memory_order_relaxed);
+    }
+
+    // 设置某个优先级在加权轮转中的权重：各优先级都有任务时，每一轮该优先级最多执行weight个任务
+    // 默认 高:普通:低 = 8:4:1，权重最小为1
+    void setPriorityWeight(int priority, uint32_t weight);
+
+    uint32_t getPriorityWeight(int priority) const;
+
+    // 某个优先级正在排队（尚未开始执行）的任务数，包括各线程的本地队列、信箱和全局队列；并发修改时为近似值
+    size_t getQueueDepth(int priority) const;
+
+    // 一个工作线程的统计数据
+    struct WorkerMetrics {
+        // 工作线程下标，汇总时为-1
+        int index;
+        // 线程id，已退出（或尚未开始运行）为-1
+        int thread_id;
+        uint64_t tasks_executed;
+        // 其中内联执行（Fiber::STACK_INLINE）的回调任务数
+        uint64_t inline_executed;
+        // 从其他线程窃取到的任务数
+        uint64_t steals;
+        // switchTo：从本线程换到其他调度器上的协程数、从其他调度器换到本线程上的协程数
+        uint64_t handoffs_out;
+        uint64_t handoffs_in;
+        // 本线程发出的 / 收到的定向唤醒
+        uint64_t tickles_issued;
+        uint64_t tickles_received;
+        // IOManager：epoll_wait 返回次数、返回的事件总数
+        uint64_t epoll_waits;
+        uint64_t epoll_events;
+        // IOManager：空闲时自旋和非阻塞轮询花的时间、阻塞等待的时间（纳秒）
+        uint64_t poll_ns;
+        uint64_t park_ns;
+        // IOManager：从阻塞等待中返回的次数，其中没有事件、因超时（定时器、超时等待到期或等待上限）返回的次数
+        uint64_t wakeups;
+        uint64_t timer_wakeups;
+        // 任务从放入队列到开始执行的时间、每次执行的时间（纳秒），只统计打开 setLatencyTracking() 之后提交的任务
+        HistogramSnapshot queue_wait_ns;
+        HistogramSnapshot run_ns;
+        // 每次 epoll_wait 返回的事件数
+        HistogramSnapshot events_per_wakeup;
+
+        WorkerMetrics(): index(-1), thread_id(-1), tasks_executed(0), inline_executed(0), steals(0), handoffs_out(0),
+                         handoffs_in(0), tickles_issued(0), tickles_received(0), epoll_waits(0), epoll_events(0),
+                         poll_ns(0), park_ns(0), wakeups(0), timer_wakeups(0) {}
+
+        void merge(const WorkerMetrics& other);
+    };
+
+    // 调度器统计快照。数据按工作线程分片，由各线程自己写入、不加锁，快照是各分片的近似值之和
+    struct Metrics {
+        std::vector<WorkerMetrics> workers;
+        // 所有工作线程之和
+        WorkerMetrics total;
+        // 非工作线程（或其他调度器的线程）发出的唤醒
+        uint64_t external_tickles;
+        // 排队中的任务数（各优先级之和）、已提交尚未执行完的任务数
+        size_t queued;
+        size_t pending;
+        size_t active_workers;
+        size_t idle_threads;
+        // IOManager：正在等待的IO事件数、到期派发的定时器数和相对到期时间的延迟（微秒）
+        size_t pending_events;
+        uint64_t timers_fired;
+        HistogramSnapshot timer_lag_us;
+        // 接纳控制：各优先级因过载、因排队任务数达到上限而被拒绝的新工作数，当前是否过载，进入过载的次数
+        uint64_t rejected_overload[PRIORITY_COUNT] = {};
+        uint64_t rejected_queue_full[PRIORITY_COUNT] = {};
+        bool overloaded[PRIORITY_COUNT] = {};
+        uint64_t overload_episodes = 0;
+        // 快照的时间（MonotonicNs），用于计算两次快照之间的速率
+        uint64_t time_ns;
+
+        Metrics(): external_tickles(0), queued(0), pending(0), active_workers(0), idle_threads(0),
+                   pending_events(0), timers_fired(0), time_ns(0) {}
+
+        // 从 prev 到本次快照之间平均每秒从阻塞等待中醒来的次数（所有工作线程之和）
+        double wakeupsPerSecond(const Metrics& prev) const;
+
+        // 多行文本，便于打印或导出到日志
+        std::string toString() const;
+    };
+
+    virtual Metrics getMetrics() const;
+
+    // 本调度器的协程内存汇总：最后由本调度器运行、还没有析构的协程（见 Fiber::Snapshot）
+    struct FiberMemory {
+        size_t fibers = 0;
+        // 有等待原因（挂起在IO、定时器、Channel、同步原语上）的协程
+        size_t waiting = 0;
+        size_t shared = 0;
+        // 私有栈的虚拟内存、其中已驻留的物理内存、共享栈协程的保存缓冲区
+        size_t stack_bytes = 0;
+        size_t resident_bytes = 0;
+        size_t save_bytes = 0;
+        // 单个协程的最大栈使用深度（见 Fiber::Info::stack_high_water）
+        size_t high_water_max = 0;
+        // 挂起最久的协程挂起了多久（纳秒）
+        uint64_t longest_wait_ns = 0;
+
+        std::string toString() const;
+    };
+
+    // 逐个协程调用 mincore，只应在排查问题时按需调用
+    FiberMemory getFiberMemory() const;
+
+    // 本调度器的协程列表，每行一个：id、状态、等待原因和参数、挂起时长、栈占用，按挂起时长从长到短排列。
+    // min_wait_ms 大于0时只列出挂起超过该时长的协程，用于找长期挂起、占着栈内存不放的协程
+    std::string dumpFibers(uint64_t min_wait_ms = 0) const;
+
+    // 是否记录任务的排队时间和执行时间，每个任务多两三次读时钟，默认关闭
+    void setLatencyTracking(bool on) {
+        m_trackLatency = on;
+    }
+
+    bool getLatencyTracking() const {
+        return m_trackLatency;
+    }
+
 private:
-    // 任务
+    // 任务（只能移动，回调放在 Callback 的内联缓冲区中）
     struct ScheduleTask {
-        std::shared_ptr<Fiber> fiber;
-        std::function<void()> cb;
+        Fiber::ptr fiber;
+        Callback cb;
         // 指定任务需要运行的线程id
         int thread;
+        // 回调任务所用协程的栈选项
+        int stack_flags = Fiber::STACK_DEFAULT;
+        // 优先级（Priority）
+        int priority = PRIORITY_NORMAL;
+        // 放入队列的时间（MonotonicNs），没有记录时为0
+        uint64_t enqueue_ns = 0;
+        // 在工作线程信箱中时的链表指针
+        ScheduleTask* next = nullptr;
+        // 外部线程提交、未指定线程的任务：放进某个工作线程的信箱只是为了不加锁，
+        // 该线程取出信箱时把它转入本地双端队列，其他线程仍然可以窃取
+        bool injected = false;
+        // 回调任务继承提交它的协程的取消上下文，执行它的协程带着这个上下文运行
+        std::shared_ptr<CancelContext> cancel;
+        // 回调任务继承提交它的协程的任务标签（见 profiler.h）
+        const char* label = nullptr;
 
         ScheduleTask() {
             fiber = nullptr;
@@ -98,41 +568,199 @@ private:
             thread = -1;
         }
 
-        ScheduleTask(std::shared_ptr<Fiber> f, int thr) {
-            fiber = f;
-            thread = thr;
+        // 共享栈协程只能在绑定的线程上恢复，总是固定到该线程（即使指定了别的线程，如多reactor模式下fd所属的线程）
+        ScheduleTask(Fiber::ptr f, int thr) {
+            fiber = std::move(f);
+            thread = boundOr(thr);
         }
 
-        ScheduleTask(std::shared_ptr<Fiber>* f, int thr) {
+        ScheduleTask(Fiber::ptr* f, int thr) {
             fiber.swap(*f);
-            thread = thr;
+            thread = boundOr(thr);
+        }
+
+        int boundOr(int thr) const {
+            int bound = fiber ? fiber->getBoundThread(): -1;
+            return bound != -1 ? bound: thr;
         }
 
-        ScheduleTask(std::function<void()> f, int thr) {
-            cb = f;
+        ScheduleTask(Callback f, int thr) {
+            cb = std::move(f);
             thread = thr;
+            inheritContext();
         }
 
-        ScheduleTask(std::function<void()>* f, int thr) {
+        ScheduleTask(Callback* f, int thr) {
             cb.swap(*f);
             thread = thr;
+            inheritContext();
+        }
+
+        void inheritContext() {
+            if(CancelContext* ctx = CancelContext::Current()) {
+                cancel = ctx->shared_from_this();
+            }
+            label = Fiber::CurrentLabel();
         }
 
         void reset() {
             fiber = nullptr;
             cb = nullptr;
             thread = -1;
+            stack_flags = Fiber::STACK_DEFAULT;
+            priority = PRIORITY_NORMAL;
+            enqueue_ns = 0;
+            injected = false;
+            cancel.reset();
+            label = nullptr;
+        }
+
+        // 每次调度都要分配一个，常常在一个线程上分配、在另一个线程上释放：
+        // 从按线程缓存的空闲链表中取（不够时从全局链表取一批），不经过 malloc
+        static void* operator new(size_t size);
+        static void operator delete(void* p);
+    };
+
+public:
+    // 批量提交任务的构造器：add() 只把任务串到本地链表上，submit() 时一次性放入调度器
+    // 析构时会提交尚未提交的任务。只能在一个线程中使用
+    class Batch {
+    public:
+        explicit Batch(Scheduler* scheduler): m_scheduler(scheduler) {}
+
+        ~Batch() {
+            submit();
+        }
+
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+
+        template<class FiberOrCb>
+        void add(FiberOrCb fc, int thread = -1, int stack_flags = Fiber::STACK_DEFAULT, int priority = PRIORITY_NORMAL) {
+            ScheduleTask task(std::move(fc), thread);
+            task.stack_flags = stack_flags;
+            task.priority = priority;
+            if(!task.fiber && !task.cb) {
+                return;
+            }
+            ScheduleTask* t = new ScheduleTask(std::move(task));
+            if(m_tail) {
+                m_tail->next = t;
+            } else {
+                m_head = t;
+            }
+            m_tail = t;
+            ++m_count;
+        }
+
+        void submit() {
+            if(m_head) {
+                m_scheduler->scheduleBatch(*this);
+            }
+        }
+
+        Scheduler* getScheduler() const {
+            return m_scheduler;
         }
+
+        size_t size() const {
+            return m_count;
+        }
+
+        bool empty() const {
+            return m_count == 0;
+        }
+
+    private:
+        friend class Scheduler;
+        Scheduler* m_scheduler;
+        ScheduleTask* m_head = nullptr;
+        ScheduleTask* m_tail = nullptr;
+        size_t m_count = 0;
     };
 
+    // 提交并清空 batch 中的所有任务
+    void scheduleBatch(Batch& batch);
+
+private:
+    // 按提交者和指定线程把任务放入对应的队列
+    void pushTask(ScheduleTask&& task);
+
+    // 取出本线程的下一个任务：按加权轮转选择优先级，同一优先级内 本地队列 -> 信箱 -> 全局队列，
+    // 都没有则窃取其他线程的任务；没有任务返回nullptr
+    // tickle_me 回写是否还有本线程处理不了、需要唤醒其他线程的任务
+    ScheduleTask* nextTask(WorkerQueue* self, int thread_id, bool& tickle_me);
+
+    // 从某个优先级的各个队列中取一个任务，remote_first 表示先看信箱和全局队列
+    ScheduleTask* popPriority(WorkerQueue* self, int priority, int thread_id, bool remote_first, bool& tickle_me);
+
+    // 从某个优先级的全局注入队列取一个可以在本线程运行的任务
+    ScheduleTask* popGlobal(int priority, int thread_id, bool& tickle_me);
+
+    // 指定线程id对应的工作线程队列，该线程还未开始运行时返回nullptr
+    WorkerQueue* findWorker(int thread_id);
+
+    // 外部线程提交的未指定线程的任务放进哪个工作线程的信箱：轮转，
+    // 没有可用的线程（都还没开始运行或要退出）时返回nullptr，改为放入全局队列
+    WorkerQueue* injectTarget();
+
+    // 放入目标线程的信箱，目标线程正在等待时定向唤醒它
+    void pushWorker(WorkerQueue* target, ScheduleTask* t);
+
+    void pushTaskOnIndex(ScheduleTask&& task, int index);
+
+    // 第i个工作线程的队列，下标不超过 m_workerSlots
+    WorkerQueue* worker(size_t i) const {
+        return m_workers[i].load(std::memory_order_acquire);
+    }
+
+    // 创建第slot个工作线程，调用者持有 m_mutex
+    void startWorker(size_t slot);
+
+    // 要退出的线程把本地队列和信箱中的任务移到全局队列（只在该线程调用）
+    void migrateTasks(WorkerQueue* self);
+
+    // 取走一个已退出线程信箱里的任务：下标已被新线程复用则还给它，否则放入全局队列
+    void rescueInbox(WorkerQueue* w);
+
+    // 把一组任务放入全局队列并唤醒相应数量的线程，unpin 为true时去掉任务指定的线程
+    void pushGlobal(std::vector<ScheduleTask*>& tasks, bool unpin);
+
+    // 入队时是否需要记录时间
+    bool stampEnqueue() const {
+        return m_trackLatency.load(std::memory_order_relaxed) || m_admissionOn.load(std::memory_order_relaxed);
+    }
+
+    // 接纳控制：工作线程取出一个任务时用它的排队时间更新该优先级的过载状态
+    void admissionSample(int priority, uint64_t now_ns, uint64_t sojourn_ns);
+
+    // 自动伸缩的后台线程
+    void autoScale();
+
+    // 长时间运行检测的后台线程
+    void watchdog();
+
 private:
     std::string m_name;
-    // 互斥锁 -> 保护任务队列
+    // 互斥锁 -> 保护全局注入队列、线程池
     std::mutex m_mutex;
-    // 线程池
+    // 线程池，下标同 m_workers（主线程的位置为空）
     std::vector<std::shared_ptr<Thread>> m_threads;
-    // 任务队列
-    std::vector<ScheduleTask> m_tasks;
+    // 全局注入队列（每个优先级一个）：非工作线程提交的任务，以及指定了尚未运行的线程的任务
+    std::deque<ScheduleTask*> m_tasks[PRIORITY_COUNT];
+    // 全局队列长度，工作线程先检查它再决定是否加锁
+    std::atomic<size_t> m_globalTaskCount[PRIORITY_COUNT] = {};
+    // 加权轮转中各优先级的权重
+    std::atomic<uint32_t> m_priorityWeights[PRIORITY_COUNT] = {{8}, {4}, {1}};
+    // 每个工作线程一个队列，m_workers[i] 对应第i个线程，使用调用者线程时主线程的是第 m_rootSlot 个。
+    // 数组大小固定，其他线程可以无锁地遍历 [0, m_workerSlots)；队列在调度器析构前不会释放，线程退出后下标可以被新线程复用
+    std::atomic<WorkerQueue*> m_workers[MAX_WORKERS] = {};
+    std::atomic<size_t> m_workerSlots = {0};
+    size_t m_rootSlot = 0;
+    // 正在运行的额外创建的工作线程数
+    std::atomic<size_t> m_activeWorkers = {0};
+    // 已退出的线程id，指定到它们的任务改为不指定线程
+    std::unordered_set<int> m_retiredThreadIds;
 
     std::unordered_map<int, pid_t> m_threadIdMap; // 用户索引→系统线程id
 
@@ -140,20 +768,118 @@ private:
     std::vector<int> m_threadIds;
     // 需要额外创建的线程数
     size_t m_threadCount = 0;
-    // 活跃线程数
-    std::atomic<size_t> m_activeThreadCount = {0};
+    // 已提交且尚未执行完的任务数（排队中 + 正在执行）
+    // 提交时+1，执行完（或yield出去）才-1，因此任务在各队列之间移动、被窃取的过程中 stopping() 不会误判为空
+    std::atomic<size_t> m_pendingTaskCount = {0};
+    // setExternalInjection()
+    std::atomic<bool> m_injectExternal = {false};
+    // injectTarget() 的轮转位置
+    std::atomic<size_t> m_injectSeq = {0};
     // 空闲线程数
     std::atomic<size_t> m_idleThreadCount = {0};
+    // 阻塞等待中的线程数
+    std::atomic<size_t> m_parkedThreadCount = {0};
+    // 不是本调度器工作线程的 park() 等待的futex和等待者数，tickle() 唤醒时先把序号加1
+    std::atomic<uint32_t> m_strayParkSeq = {0};
+    std::atomic<size_t> m_strayParked = {0};
+
+    // 空闲策略，各字段见 IdlePolicy
+    std::atomic<uint32_t> m_idleSpinCount = {100};
+    std::atomic<uint32_t> m_idlePollCount = {1};
+    std::atomic<uint32_t> m_idleParkTimeout = {5000};
+
+    // 每个工作线程绑定的CPU集合（为空表示不绑定）和所在的NUMA节点，下标同 m_workers
+    std::vector<std::vector<int>> m_workerCpus;
+    std::vector<int> m_workerNodes;
+    // 是否有线程需要绑定
+    bool m_placed = false;
+    // 运行期间增加的线程是否按节点轮流分配
+    bool m_numaSpread = false;
+
+    // 自动伸缩
+    AutoScalePolicy m_autoScale;
+    std::mutex m_autoScaleMutex;
+    std::condition_variable m_autoScaleCv;
+    bool m_autoScaleStop = false;
+    std::shared_ptr<Thread> m_autoScaleThread;
+
+    // 长时间运行检测
+    WatchdogPolicy m_watchdog;
+    std::mutex m_watchdogMutex;
+    std::condition_variable m_watchdogCv;
+    bool m_watchdogStop = false;
+    std::shared_ptr<Thread> m_watchdogThread;
+    // 任务开始时是否记录开始时间
+    std::atomic<bool> m_watchdogOn = {false};
+
+    // 是否记录任务的排队/执行时间
+    std::atomic<bool> m_trackLatency = {false};
+
+    // 接纳控制中一个优先级的状态，各优先级分开缓存行：每次取出任务都要读，状态变化时才写
+    struct alignas(64) AdmissionLane {
+        // 排队时间开始不低于目标的时刻加上一个间隔（MonotonicNs），到这时仍不低于目标就进入过载；0表示低于目标
+        std::atomic<uint64_t> above_until_ns{0};
+        std::atomic<bool> overloaded{false};
+        // 过载期间下一次检查队列是否已经排空的时间
+        std::atomic<uint64_t> recheck_ns{0};
+        std::atomic<size_t> max_depth{0};
+        std::atomic<bool> shed{false};
+        std::atomic<uint64_t> rejected_overload{0};
+        std::atomic<uint64_t> rejected_queue_full{0};
+    };
+    AdmissionLane m_admission[PRIORITY_COUNT];
+    std::atomic<bool> m_admissionOn = {false};
+    std::atomic<uint64_t> m_admissionTargetNs = {0};
+    std::atomic<uint64_t> m_admissionIntervalNs = {0};
+    std::atomic<uint64_t> m_overloadEpisodes = {0};
+    // on_reject 回调，setAdmission() 时整体替换，调用时在锁外
+    std::mutex m_admissionMutex;
+    std::shared_ptr<const std::function<void(int, RejectReason)>> m_onReject;
+
+    // 每个工作线程的回调协程缓存上限
+    std::atomic<size_t> m_fiberCacheSize = {32};
+    // 回调协程新建/复用计数
+    std::atomic<uint64_t> m_fiberCreated = {0};
+    std::atomic<uint64_t> m_fiberReused = {0};
 
     // 主线程是否用作工作线程
     bool m_useCaller;
     // 如果是 -> 需要额外创建调度协程
-    std::shared_ptr<Fiber> m_schedulerFiber;
+    Fiber::ptr m_schedulerFiber;
     // 如果是 -> 记录主线程的线程id
     int m_rootThread = -1;
-    // 是否正在关闭
-    bool m_stopping = false;
+    // 是否已经 start()
+    bool m_started = false;
+    // 是否正在关闭：stop() 写入，各工作线程的空闲循环、taskDone() 不加锁读取
+    std::atomic<bool> m_stopping = {false};
+};
+
+// 在作用域内把当前协程换到 target 上执行，离开作用域时换回原来的调度器（不一定是原来的线程）：
+//   sylar::SchedulerSwitcher sw(&cpu_pool);
+//   result = heavy_compute(req);
+// 离开期间协程仍算作原调度器的待完成任务，原调度器的 stop() 会等它回来。
+// 切换不成立（见 Scheduler::switchTo）时什么也不做，代码留在原来的线程上执行
+class SchedulerSwitcher {
+public:
+    explicit SchedulerSwitcher(Scheduler* target, int thread = -1);
+    ~SchedulerSwitcher();
+    SchedulerSwitcher(const SchedulerSwitcher&) = delete;
+    SchedulerSwitcher& operator=(const SchedulerSwitcher&) = delete;
+
+    // 是否已经换到 target 上
+    bool switched() const {
+        return m_switched;
+    }
+
+private:
+    Scheduler* m_caller;
+    bool m_switched = false;
 };
+
+// 协作式让出点，见 Scheduler::MaybeYield
+inline void maybe_yield() {
+    Scheduler::MaybeYield();
+}
 }
 
 #endif
\ No newline at end of file
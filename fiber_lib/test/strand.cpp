@@ -0,0 +1,133 @@
+#include "strand.h"
+#include "cancel.h"
+#include "fiber_local.h"
+
+#include <cassert>
+
+namespace sylar {
+
+// 当前协程正在执行的任务所属的 Strand。任务可能挂起后在其他线程恢复，所以用协程局部存储而不是线程局部变量
+static FiberLocalKey s_current_strand;
+
+static const uintptr_t ACTIVE = 1;
+
+struct Strand::Node {
+    Node* next = nullptr;
+    Callback cb;
+    // 投递它的协程的取消上下文
+    std::shared_ptr<CancelContext> cancel;
+};
+
+Strand::Strand(Scheduler* scheduler, int priority, size_t batch)
+    :m_scheduler(scheduler)
+    ,m_priority(priority)
+    ,m_batch(batch ? batch: 1) {
+    assert(scheduler);
+}
+
+Strand::~Strand() {
+    // 排空任务持有引用，能析构时不会还有任务没执行
+    assert(m_head.load(std::memory_order_relaxed) == 0 && !m_local);
+}
+
+Strand* Strand::Current() {
+    return static_cast<Strand*>(s_current_strand.get());
+}
+
+void Strand::post(Callback cb) {
+    Node* node = new Node;
+    node->cb = std::move(cb);
+    node->cancel = CancelContext::GetCurrent();
+    uintptr_t old = m_head.load(std::memory_order_relaxed);
+    do {
+        node->next = (Node*)(old & ~ACTIVE);
+    } while(!m_head.compare_exchange_weak(old, (uintptr_t)node | ACTIVE,
+                                          std::memory_order_acq_rel, std::memory_order_relaxed));
+    if(!(old & ACTIVE)) {
+        scheduleDrain();
+    }
+}
+
+void Strand::dispatch(Callback cb) {
+    if(runningInThis()) {
+        cb();
+        return;
+    }
+    post(std::move(cb));
+}
+
+void Strand::scheduleDrain() {
+    ptr self(this);
+    Callback task([self]() {
+        self->drain();
+    });
+    // 排空任务执行的是各个投递方的任务，每个任务自己带着投递方的取消上下文，排空任务本身不继承
+    if(CancelContext::Current()) {
+        CancelScope none(nullptr);
+        m_scheduler->scheduleLock(std::move(task), -1, Fiber::STACK_DEFAULT, m_priority);
+    } else {
+        m_scheduler->scheduleLock(std::move(task), -1, Fiber::STACK_DEFAULT, m_priority);
+    }
+}
+
+void Strand::drain() {
+    void* saved = s_current_strand.set(this);
+    size_t n = 0;
+    for(;;) {
+        if(!m_local) {
+            // 取走整条链表，头指针留下 ACTIVE；反转后就是投递的顺序
+            Node* list = (Node*)(m_head.exchange(ACTIVE, std::memory_order_acquire) & ~ACTIVE);
+            if(!list) {
+                // 没有新任务：清掉 ACTIVE。失败说明刚有任务投递进来（它看到 ACTIVE，不会交给调度器），接着执行
+                uintptr_t expected = ACTIVE;
+                if(m_head.compare_exchange_strong(expected, 0, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                    break;
+                }
+                continue;
+            }
+            Node* fifo = nullptr;
+            while(list) {
+                Node* next = list->next;
+                list->next = fifo;
+                fifo = list;
+                list = next;
+            }
+            m_local = fifo;
+        }
+        if(n == m_batch) {
+            // 一批做完了还有任务：排到调度器队尾，ACTIVE 仍然置位，期间的 post 不会再交一个排空任务
+            s_current_strand.set(saved);
+            scheduleDrain();
+            return;
+        }
+        Node* node = m_local;
+        m_local = node->next;
+        if(node->cancel) {
+            CancelScope scope(std::move(node->cancel));
+            node->cb();
+        } else {
+            node->cb();
+        }
+        delete node;
+        ++n;
+        m_executed.fetch_add(1, std::memory_order_relaxed);
+    }
+    s_current_strand.set(saved);
+}
+
+StrandGroup::StrandGroup(Scheduler* scheduler, size_t count, int priority, size_t batch) {
+    m_strands.reserve(count ? count: 1);
+    for(size_t i = 0; i < (count ? count: 1); ++i) {
+        m_strands.emplace_back(new Strand(scheduler, priority, batch));
+    }
+}
+
+Strand* StrandGroup::get(uint64_t key) const {
+    // 先打散再取模：连续的id、std::hash 对整数的恒等映射都能均匀分开
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return m_strands[key % m_strands.size()].get();
+}
+
+}
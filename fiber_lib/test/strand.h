@@ -0,0 +1,120 @@
+#ifndef __SYLAR_STRAND_H__
+#define __SYLAR_STRAND_H__
+
+// Strand：串行执行器，把同一个对象（连接、会话、账户）上的回调排成一队，不用加锁
+//
+// 投递到同一个 Strand 的任务按投递顺序（FIFO）一个接一个执行，从不并发，但不固定在哪个线程：
+// 排空任务的协程作为普通回调任务交给调度器，由空闲的工作线程执行。不同的 Strand 之间完全并行。
+// 任务之间不需要互斥锁：一个任务写的状态，后面的任务一定看得到。
+// - Strand 本身是一个无锁的后进先出链表，链表头指针的最低位兼作"正在排空"的标记：
+//   post 是一次CAS；标记原来没有置位时由这次 post 把排空任务交给调度器。
+//   排空的一方一次取走整条链表、反转成先进先出后逐个执行，每批最多 batch 个，做完一批还有任务就重新排队，让其他任务也能执行
+// - 任务里可以挂起（hook 的读写、sleep 等）：挂起期间 Strand 一直被它占着，后面的任务等它执行完，顺序不变。
+//   所以不要在任务里等同一个 Strand 上的其他任务，会死锁
+// - 任务继承投递它的协程的取消上下文（见 cancel.h），与 scheduleLock 相同
+//
+//   sylar::Strand::ptr strand(new sylar::Strand(&iom));
+//   strand->post([=] { session->onMessage(msg); });    // 同一个 strand 上按顺序执行
+//
+//   sylar::StrandGroup group(&iom, 64);               // 按键散列到固定数量的 strand 上
+//   group.post(conn_id, [=] { ... });                  // 同一个 conn_id 的任务按顺序执行
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "callback.h"
+#include "ref_ptr.h"
+#include "scheduler.h"
+
+namespace sylar {
+
+class Strand: public RefCounted {
+public:
+    typedef RefPtr<Strand> ptr;
+
+    // priority 为排空任务在调度器中的优先级，batch 为排空任务每次最多执行的任务数
+    explicit Strand(Scheduler* scheduler, int priority = Scheduler::PRIORITY_NORMAL, size_t batch = 64);
+    ~Strand();
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    // 投递一个任务，排在之前投递的所有任务之后。可以在任何线程调用（包括调度器之外的线程）
+    void post(Callback cb);
+
+    // 当前正在执行本 Strand 的任务时直接执行（同步，不排队），否则同 post
+    void dispatch(Callback cb);
+
+    // 当前协程是否正在执行本 Strand 的任务
+    bool runningInThis() const {
+        return Current() == this;
+    }
+
+    Scheduler* getScheduler() const {
+        return m_scheduler;
+    }
+
+    // 已经执行完的任务数
+    uint64_t getExecuted() const {
+        return m_executed.load(std::memory_order_relaxed);
+    }
+
+    // 当前协程正在执行的任务所属的 Strand，没有时为空
+    static Strand* Current();
+
+private:
+    struct Node;
+
+    // 排空任务：在调度器的回调协程中执行
+    void drain();
+
+    // 把排空任务交给调度器
+    void scheduleDrain();
+
+private:
+    Scheduler* m_scheduler;
+    int m_priority;
+    size_t m_batch;
+    // 投递的任务（后进先出），最低位为 ACTIVE：已经有排空任务在调度器中或正在执行
+    std::atomic<uintptr_t> m_head{0};
+    // 已经取出、还没执行的任务（先进先出），只由当前的排空任务访问
+    Node* m_local = nullptr;
+    std::atomic<uint64_t> m_executed{0};
+};
+
+// 一组 Strand，按键散列：同一个键的任务总落在同一个 Strand 上按顺序执行，不同的键大多可以并行。
+// 键比 Strand 多得多时（例如按连接id），不需要为每个键创建 Strand
+class StrandGroup {
+public:
+    StrandGroup(Scheduler* scheduler, size_t count, int priority = Scheduler::PRIORITY_NORMAL, size_t batch = 64);
+
+    StrandGroup(const StrandGroup&) = delete;
+    StrandGroup& operator=(const StrandGroup&) = delete;
+
+    // 键对应的 Strand
+    Strand* get(uint64_t key) const;
+
+    template<class Key>
+    Strand* getByKey(const Key& key) const {
+        return get(std::hash<Key>()(key));
+    }
+
+    void post(uint64_t key, Callback cb) {
+        get(key)->post(std::move(cb));
+    }
+
+    size_t size() const {
+        return m_strands.size();
+    }
+
+private:
+    std::vector<Strand::ptr> m_strands;
+};
+
+}
+
+#endif
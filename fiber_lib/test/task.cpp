@@ -0,0 +1,76 @@
+#include "task.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <atomic>
+#include <new>
+#include <vector>
+
+namespace sylar {
+
+static const size_t FRAME_CLASS_COUNT = FramePool::MAX_CLASS_SIZE / FramePool::CLASS_GRANULARITY;
+
+static std::atomic<size_t> s_frame_capacity{256};
+
+// 线程级帧缓存，线程退出时释放缓存的帧
+struct FrameThreadCache {
+    std::vector<void*> free_list[FRAME_CLASS_COUNT];
+
+    ~FrameThreadCache() {
+        for(auto& list: free_list) {
+            for(void* p: list) {
+                ::operator delete(p);
+            }
+            list.clear();
+        }
+    }
+};
+
+static thread_local FrameThreadCache t_frames;
+
+// 0号等级对应 (0, 64]，依此类推；超过最大等级返回-1
+static int frame_class(size_t size) {
+    if(size == 0 || size > FramePool::MAX_CLASS_SIZE) {
+        return -1;
+    }
+    return (int)((size - 1) / FramePool::CLASS_GRANULARITY);
+}
+
+void* FramePool::Alloc(size_t size) {
+    int cls = frame_class(size);
+    if(cls < 0) {
+        return ::operator new(size);
+    }
+    std::vector<void*>& list = t_frames.free_list[cls];
+    if(!list.empty()) {
+        void* p = list.back();
+        list.pop_back();
+        return p;
+    }
+    // 按等级的上限分配，这样同一等级的帧可以互相复用
+    return ::operator new((cls + 1) * CLASS_GRANULARITY);
+}
+
+void FramePool::Free(void* p, size_t size) {
+    int cls = frame_class(size);
+    if(cls >= 0) {
+        std::vector<void*>& list = t_frames.free_list[cls];
+        if(list.size() < s_frame_capacity.load(std::memory_order_relaxed)) {
+            list.push_back(p);
+            return;
+        }
+    }
+    ::operator delete(p);
+}
+
+void FramePool::SetThreadCapacity(size_t n) {
+    s_frame_capacity = n;
+}
+
+size_t FramePool::GetThreadCapacity() {
+    return s_frame_capacity;
+}
+
+}
+
+#endif
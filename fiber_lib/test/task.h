@@ -0,0 +1,368 @@
+#ifndef __SYLAR_TASK_H__
+#define __SYLAR_TASK_H__
+
+// C++20 无栈协程 Task<T>，运行在现有的 Scheduler / IOManager 之上
+// 只在编译器支持协程（-std=c++20）时可用，C++17 下本头文件为空，不影响其余代码。
+//
+// 与 Fiber 相比，Task 没有独立的栈，协程帧只保存跨越 co_await 的局部变量（通常几百字节），
+// 帧内存来自线程级的帧池（FramePool），创建/销毁都不需要 malloc/free。
+// 适合调用层次浅、不需要在深层函数里阻塞的请求处理和扇出式RPC调用。
+//
+// 用法：
+//   Task<int> fetch(IOManager* iom, int fd) {
+//       co_await WaitEvent(iom, fd, IOManager::READ);
+//       ...
+//       co_return n;
+//   }
+//   Task<void> handler(IOManager* iom, int fd) {
+//       int n = co_await fetch(iom, fd);          // Task 等待 Task
+//       co_await SleepFor(iom, 10);               // 定时器
+//       co_await RunInFiber(iom, []{ ... });      // 在Fiber里执行可能阻塞的（hook过的）代码
+//   }
+//   schedule_task(iom, handler(iom, fd));         // 交给调度器执行，结束后自动释放
+//   int n = fetch(iom, fd).wait();                // 在Fiber中等待 Task，当前Fiber让出直到Task完成
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "ioscheduler.h"
+
+namespace sylar {
+
+// 协程帧池
+// 按64字节分级缓存已释放的帧，每个线程一份；协程可能在其他线程上结束，帧会留在结束它的线程的缓存里。
+// 超过最大等级或缓存已满时直接使用 ::operator new/delete。
+class FramePool {
+public:
+    static const size_t CLASS_GRANULARITY = 64;
+    static const size_t MAX_CLASS_SIZE = 2048;
+
+    static void* Alloc(size_t size);
+    static void Free(void* p, size_t size);
+
+    // 设置每个等级在单个线程中最多缓存多少个帧（默认256）
+    static void SetThreadCapacity(size_t n);
+    static size_t GetThreadCapacity();
+};
+
+template<class T>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+    // 等待本Task完成的协程，结束时对称转移（symmetric transfer）到它
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    // Task 是惰性的：创建后不执行，直到被 co_await / wait() / schedule_task()
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> c = h.promise().continuation;
+            return c ? c: std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        exception = std::current_exception();
+    }
+
+    static void* operator new(size_t size) {
+        return FramePool::Alloc(size);
+    }
+
+    static void operator delete(void* p, size_t size) {
+        FramePool::Free(p, size);
+    }
+};
+
+template<class T>
+struct TaskPromise: TaskPromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object() noexcept;
+
+    template<class U>
+    void return_value(U&& v) {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T result() {
+        if(exception) {
+            std::rethrow_exception(exception);
+        }
+        return std::move(*value);
+    }
+};
+
+template<>
+struct TaskPromise<void>: TaskPromiseBase {
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept {}
+
+    void result() {
+        if(exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+// 结束后自动销毁帧的协程，用于 schedule_task() 和 Task::wait()
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() noexcept {
+            return DetachedTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+
+        static void* operator new(size_t size) {
+            return FramePool::Alloc(size);
+        }
+
+        static void operator delete(void* p, size_t size) {
+            FramePool::Free(p, size);
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+}
+
+// 惰性启动、只能移动的协程任务
+template<class T = void>
+class Task {
+public:
+    typedef detail::TaskPromise<T> promise_type;
+
+    Task() noexcept {}
+
+    explicit Task(std::coroutine_handle<promise_type> h) noexcept: m_handle(h) {}
+
+    Task(Task&& other) noexcept: m_handle(std::exchange(other.m_handle, nullptr)) {}
+
+    Task& operator=(Task&& other) noexcept {
+        if(this != &other) {
+            if(m_handle) {
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        if(m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    bool done() const {
+        return !m_handle || m_handle.done();
+    }
+
+    struct Awaiter {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() noexcept {
+            return !handle || handle.done();
+        }
+
+        // 记下等待者，然后直接切换到本Task执行
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+
+        T await_resume() {
+            return handle.promise().result();
+        }
+    };
+
+    Awaiter operator co_await() & noexcept {
+        return Awaiter{m_handle};
+    }
+
+    Awaiter operator co_await() && noexcept {
+        return Awaiter{m_handle};
+    }
+
+    // 在Fiber中等待 Task 完成并取得结果
+    // 当前Fiber让出执行权，Task 在完成的那个线程上把Fiber重新放回调度器（共享栈协程放回绑定的线程）。
+    // 必须在调度器管理的Fiber中调用
+    T wait();
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+namespace detail {
+
+template<class T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+template<class T>
+DetachedTask WaitAndWake(Task<T>& task, Scheduler* sc, Fiber::ptr fiber) {
+    // 异常留给 wait() 在Fiber中重新抛出
+    try {
+        co_await task;
+    } catch(...) {
+    }
+    sc->scheduleLock(std::move(fiber));
+}
+
+inline DetachedTask RunDetached(Task<void> task) {
+    co_await task;
+}
+
+}
+
+template<class T>
+T Task<T>::wait() {
+    Scheduler* sc = Scheduler::GetThis();
+    assert(sc && m_handle);
+    Fiber* fiber = Fiber::Current();
+
+    // Task 可能就在这里同步执行完，此时Fiber已经被放回任务队列，yield之后会马上再被调度；
+    // 若在其他线程上完成，resume() 会等这里切换完成后才切入
+    detail::DetachedTask waiter = detail::WaitAndWake(*this, sc, Fiber::ptr(fiber));
+    waiter.handle.resume();
+    fiber->yield();
+    return m_handle.promise().result();
+}
+
+// 把 Task 交给调度器执行，Task 结束后自动释放
+// thread指定开始执行的线程，-1表示任意线程
+inline void schedule_task(Scheduler* sc, Task<void> task, int thread = -1) {
+    std::coroutine_handle<> h = detail::RunDetached(std::move(task)).handle;
+    sc->scheduleLock([h]() { h.resume(); }, thread);
+}
+
+// co_await ScheduleOn(sc)：把当前协程重新放入调度器的任务队列，之后在sc的某个线程（或指定线程）上继续执行
+struct ScheduleOn {
+    Scheduler* scheduler;
+    int thread = -1;
+
+    ScheduleOn(Scheduler* sc, int thr = -1): scheduler(sc), thread(thr) {}
+
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        scheduler->scheduleLock([h]() { h.resume(); }, thread);
+    }
+
+    void await_resume() noexcept {}
+};
+
+// co_await WaitEvent(iom, fd, IOManager::READ)：等待fd可读/可写
+// 返回0表示事件就绪（或被 cancelEvent 取消），-1表示注册事件失败（未挂起）
+struct WaitEvent {
+    IOManager* iom;
+    int fd;
+    IOManager::Event event;
+    int rt = 0;
+
+    WaitEvent(IOManager* m, int f, IOManager::Event e): iom(m), fd(f), event(e) {}
+
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        rt = iom->addEvent(fd, event, [h]() { h.resume(); });
+        return rt == 0;
+    }
+
+    int await_resume() noexcept {
+        return rt;
+    }
+};
+
+// co_await SleepFor(iom, ms)：ms毫秒之后继续执行
+// 到期的定时器回调由 IOManager::idle 放入任务队列，因此这里需要一个 IOManager
+struct SleepFor {
+    IOManager* iom;
+    uint64_t ms;
+
+    SleepFor(IOManager* m, uint64_t t): iom(m), ms(t) {}
+
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        iom->addTimer(ms, [h]() { h.resume(); });
+    }
+
+    void await_resume() noexcept {}
+};
+
+// co_await RunInFiber(sc, cb)：在调度器的一个Fiber里执行cb（可以调用hook过的阻塞函数、深层递归等），
+// cb返回后协程在同一个Fiber里继续执行
+struct RunInFiber {
+    Scheduler* scheduler;
+    Callback cb;
+
+    RunInFiber(Scheduler* sc, Callback f): scheduler(sc), cb(std::move(f)) {}
+
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        // 挂起期间awaiter一直存放在协程帧中，只捕获指针
+        scheduler->scheduleLock([this, h]() {
+            cb();
+            h.resume();
+        });
+    }
+
+    void await_resume() noexcept {}
+};
+
+}
+
+#endif
+
+#endif
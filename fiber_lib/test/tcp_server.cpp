@@ -0,0 +1,662 @@
+#include "tcp_server.h"
+#include "fd_manager.h"
+#include "fiber_sync.h"
+#include "hook.h"
+
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <string.h>
+
+namespace sylar {
+
+namespace detail {
+
+// 服务器和它的连接共享的状态：接入器排队的回调、连接、stop() 的定时器都持有它，
+// 服务器析构之后还在运行的连接协程不会访问到已经释放的内存
+struct TcpServerState {
+    IOManager* iom = nullptr;
+    TcpServer::Options options;
+    TcpServer::Handler handler;
+    TcpServer::MessageHandler message_handler;
+
+    std::atomic<bool> draining = {false};
+    std::atomic<uint64_t> next_id = {0};
+
+    std::atomic<uint64_t> accepted = {0};
+    std::atomic<uint64_t> rejected = {0};
+    std::atomic<uint64_t> shed = {0};
+    std::atomic<uint64_t> active = {0};
+    std::atomic<uint64_t> closed = {0};
+    std::atomic<uint64_t> read_timeouts = {0};
+    std::atomic<uint64_t> write_timeouts = {0};
+
+    // 还没关闭的连接。连接先从这里删除再关闭fd，持有锁时对其中的fd调用 shutdown 不会碰到被复用的fd号
+    std::mutex mutex;
+    std::unordered_map<uint64_t, TcpConnection*> conns;
+
+    // 每个连接加一，连接关闭时减一，stop() 等它归零
+    WaitGroup running;
+
+    // shutdown 所有连接（how 为 SHUT_RD 时只处理空闲的连接）
+    void shutdownConns(int how) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto& it: conns) {
+            TcpConnection* conn = it.second;
+            if(how != SHUT_RD || conn->m_idle.load(std::memory_order_acquire)) {
+                shutdown(conn->fd(), how);
+            }
+            if(how == SHUT_RDWR) {
+                conn->m_cancel->cancel();
+            }
+        }
+    }
+};
+
+}
+
+using detail::TcpServerState;
+
+// 协程恢复后可能换了线程，系统调用、读写 errno 放在单独的（不内联的）函数里
+
+__attribute__((noinline)) static void set_errno(int err) {
+    errno = err;
+}
+
+__attribute__((noinline)) static int get_errno() {
+    return errno;
+}
+
+// 调用一次，失败返回 -errno
+__attribute__((noinline)) static ssize_t recv_once(int fd, void* buf, size_t len) {
+    ssize_t n;
+    do {
+        n = recv_f(fd, buf, len, 0);
+    } while(n == -1 && errno == EINTR);
+    return n < 0 ? -errno: n;
+}
+
+__attribute__((noinline)) static ssize_t send_once(int fd, const void* buf, size_t len) {
+    ssize_t n;
+    do {
+        n = send_f(fd, buf, len, MSG_NOSIGNAL);
+    } while(n == -1 && errno == EINTR);
+    return n < 0 ? -errno: n;
+}
+
+// 同 hook 的 close：从 IOManager 注销（ENGINE_EPOLL_ET 下fd会一直注册着），删除fd上下文
+static void close_fd(IOManager* iom, int fd) {
+    iom->cancelAll(fd);
+    FdMgr::GetInstance()->del(fd);
+    close_f(fd);
+}
+
+TcpConnection::TcpConnection(const std::shared_ptr<TcpServerState>& state, int fd, uint64_t id)
+    :m_state(state)
+    ,m_fd(fd)
+    ,m_id(id)
+    ,m_readTimeout(state->options.read_timeout_ms)
+    ,m_writeTimeout(state->options.write_timeout_ms)
+    ,m_cancel(CancelContext::Create()) {
+    memset(&m_peer, 0, sizeof(m_peer));
+    m_peerLen = sizeof(m_peer);
+    if(getpeername(fd, (sockaddr*)&m_peer, &m_peerLen)) {
+        m_peerLen = 0;
+    }
+    // hook 的读写和下面的 read/write 都按 FdCtx 上的超时
+    FdCtx* ctx = FdMgr::GetInstance()->get(fd);
+    if(ctx) {
+        ctx->setTimeout(SO_RCVTIMEO, m_readTimeout);
+        ctx->setTimeout(SO_SNDTIMEO, m_writeTimeout);
+    }
+}
+
+TcpConnection::~TcpConnection() {
+    close();
+}
+
+std::string TcpConnection::peerString() const {
+    char ip[INET6_ADDRSTRLEN] = {0};
+    uint16_t port = 0;
+    if(m_peer.ss_family == AF_INET) {
+        const sockaddr_in* sin = (const sockaddr_in*)&m_peer;
+        inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+        port = ntohs(sin->sin_port);
+    } else if(m_peer.ss_family == AF_INET6) {
+        const sockaddr_in6* sin6 = (const sockaddr_in6*)&m_peer;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+        port = ntohs(sin6->sin6_port);
+        return "[" + std::string(ip) + "]:" + std::to_string(port);
+    } else {
+        return std::string();
+    }
+    return std::string(ip) + ":" + std::to_string(port);
+}
+
+int TcpConnection::waitReady(IOManager::Event event, uint64_t timeout_ms) {
+    int rt = m_state->iom->waitEvent(m_fd, event, timeout_ms);
+    if(rt == ETIMEDOUT) {
+        (event == IOManager::READ ? m_state->read_timeouts: m_state->write_timeouts).fetch_add(1, std::memory_order_relaxed);
+        return ETIMEDOUT;
+    }
+    return rt < 0 ? EINVAL: 0;
+}
+
+ssize_t TcpConnection::read(void* buf, size_t len) {
+    // 不依赖当前线程是否开启了 hook：用原始的 recv，EAGAIN 时自己等待
+    while(!isClosed()) {
+        ssize_t n = recv_once(m_fd, buf, len);
+        if(n >= 0) {
+            m_bytesRead += n;
+            return n;
+        }
+        if(n != -EAGAIN) {
+            set_errno(-n);
+            return -1;
+        }
+        int err = waitReady(IOManager::READ, m_readTimeout);
+        if(err) {
+            set_errno(err);
+            return -1;
+        }
+    }
+    set_errno(EBADF);
+    return -1;
+}
+
+ssize_t TcpConnection::readInto(ByteBuffer& buf, size_t max) {
+    while(!isClosed()) {
+        // 开启 hook 时 readv 自己挂起等待（按 FdCtx 的超时），否则返回 EAGAIN 由这里等待
+        ssize_t n = buf.readFrom(m_fd, max);
+        if(n >= 0) {
+            m_bytesRead += n;
+            return n;
+        }
+        int err = get_errno();
+        if(err == EINTR) {
+            continue;
+        }
+        if(err == ETIMEDOUT) {
+            m_state->read_timeouts.fetch_add(1, std::memory_order_relaxed);
+        }
+        if(err != EAGAIN) {
+            set_errno(err);
+            return -1;
+        }
+        err = waitReady(IOManager::READ, m_readTimeout);
+        if(err) {
+            set_errno(err);
+            return -1;
+        }
+    }
+    set_errno(EBADF);
+    return -1;
+}
+
+ssize_t TcpConnection::write(const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+    size_t left = len;
+    while(left) {
+        if(isClosed()) {
+            set_errno(EBADF);
+            return -1;
+        }
+        ssize_t n = send_once(m_fd, p, left);
+        if(n >= 0) {
+            p += n;
+            left -= n;
+            m_bytesWritten += n;
+            continue;
+        }
+        if(n != -EAGAIN) {
+            set_errno(-n);
+            return -1;
+        }
+        int err = waitReady(IOManager::WRITE, m_writeTimeout);
+        if(err) {
+            set_errno(err);
+            return -1;
+        }
+    }
+    return len;
+}
+
+ssize_t TcpConnection::write(ByteBuffer& buf) {
+    size_t total = 0;
+    while(!buf.empty()) {
+        if(isClosed()) {
+            set_errno(EBADF);
+            return -1;
+        }
+        // 对端关闭时 writev 会产生 SIGPIPE，TcpServer::start 已经忽略了它
+        ssize_t n = buf.writeTo(m_fd);
+        if(n >= 0) {
+            total += n;
+            m_bytesWritten += n;
+            continue;
+        }
+        int err = get_errno();
+        if(err == EINTR) {
+            continue;
+        }
+        if(err == ETIMEDOUT) {
+            m_state->write_timeouts.fetch_add(1, std::memory_order_relaxed);
+        }
+        if(err != EAGAIN) {
+            set_errno(err);
+            return -1;
+        }
+        err = waitReady(IOManager::WRITE, m_writeTimeout);
+        if(err) {
+            set_errno(err);
+            return -1;
+        }
+    }
+    return total;
+}
+
+ssize_t TcpConnection::send(const void* buf, size_t len) {
+    ByteBuffer data;
+    data.append(buf, len);
+    return send(std::move(data));
+}
+
+ssize_t TcpConnection::send(ByteBuffer&& buf) {
+    size_t len = buf.size();
+    const TcpServer::Options& opts = m_state->options;
+    std::unique_lock<std::mutex> lock(m_outMutex);
+    if(m_outError || isClosed()) {
+        int err = m_outError ? m_outError: EBADF;
+        lock.unlock();
+        set_errno(err);
+        return -1;
+    }
+    m_output.append(std::move(buf));
+    size_t pending = m_outPending.fetch_add(len, std::memory_order_relaxed) + len;
+    if(!m_flushing && len) {
+        // 排在当前线程上，当前协程让出之后才运行，这之前的 send 都会合并进同一批
+        m_flushing = true;
+        TcpConnection::ptr self = shared_from_this();
+        int thread = m_state->iom == Scheduler::GetThis() ? Thread::GetThreadId(): -1;
+        m_state->iom->scheduleLock([self]() {
+            self->flushLoop();
+        }, thread);
+    }
+    if(pending > opts.output_high_watermark) {
+        // 背压：等发送协程把队列降到低水位以下
+        while(m_outPending.load(std::memory_order_relaxed) > opts.output_low_watermark && !m_outError) {
+            m_outWaiters.wait(lock);
+            lock.lock();
+        }
+        if(m_outError) {
+            int err = m_outError;
+            lock.unlock();
+            set_errno(err);
+            return -1;
+        }
+    }
+    return len;
+}
+
+int TcpConnection::flush() {
+    std::unique_lock<std::mutex> lock(m_outMutex);
+    while(m_flushing && !m_outError) {
+        m_outWaiters.wait(lock);
+        lock.lock();
+    }
+    if(m_outError) {
+        int err = m_outError;
+        lock.unlock();
+        set_errno(err);
+        return -1;
+    }
+    return 0;
+}
+
+int TcpConnection::sendBatch(ByteBuffer& batch) {
+    TcpServer::CorkMode cork = m_state->options.cork;
+    while(!batch.empty()) {
+        if(isClosed()) {
+            return EBADF;
+        }
+        int flags = MSG_NOSIGNAL;
+        // 队列里除了这一批还有数据：告诉内核后面还有，先不要发出不满的报文段
+        if(cork == TcpServer::CORK_MSG_MORE && m_outPending.load(std::memory_order_relaxed) > batch.size()) {
+            flags |= MSG_MORE;
+        }
+        ssize_t n = batch.sendTo(m_fd, flags);
+        if(n >= 0) {
+            m_bytesWritten += n;
+            size_t pending = m_outPending.fetch_sub(n, std::memory_order_relaxed) - n;
+            if(pending <= m_state->options.output_low_watermark) {
+                std::deque<detail::SyncWaiter> waiters;
+                {
+                    std::lock_guard<std::mutex> lock(m_outMutex);
+                    m_outWaiters.popAll(waiters);
+                }
+                for(detail::SyncWaiter& w: waiters) {
+                    w.wake();
+                }
+            }
+            continue;
+        }
+        int err = get_errno();
+        if(err == EINTR) {
+            continue;
+        }
+        if(err == ETIMEDOUT) {
+            m_state->write_timeouts.fetch_add(1, std::memory_order_relaxed);
+        }
+        if(err != EAGAIN) {
+            return err;
+        }
+        err = waitReady(IOManager::WRITE, m_writeTimeout);
+        if(err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+void TcpConnection::flushLoop() {
+    bool tcp_cork = m_state->options.cork == TcpServer::CORK_TCP;
+    bool corked = false;
+    int err = 0;
+    std::deque<detail::SyncWaiter> waiters;
+    while(true) {
+        ByteBuffer batch;
+        {
+            std::lock_guard<std::mutex> lock(m_outMutex);
+            if(err) {
+                m_outError = err;
+                m_output.clear();
+                m_outPending.store(0, std::memory_order_relaxed);
+            }
+            if(m_output.empty()) {
+                m_flushing = false;
+                m_outWaiters.popAll(waiters);
+                break;
+            }
+            batch = std::move(m_output);
+        }
+        err = sendBatch(batch);
+        if(tcp_cork && !corked && !err && m_outPending.load(std::memory_order_relaxed)) {
+            // 发送期间又有了数据：之后的几批攒成整的报文段，队列清空时再把尾巴推出去
+            int one = 1;
+            corked = setsockopt_f(m_fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one)) == 0;
+        }
+    }
+    if(corked && !isClosed()) {
+        int zero = 0;
+        setsockopt_f(m_fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+    }
+    for(detail::SyncWaiter& w: waiters) {
+        w.wake();
+    }
+}
+
+void TcpConnection::setReadTimeout(uint64_t ms) {
+    m_readTimeout = ms;
+    FdCtx* ctx = FdMgr::GetInstance()->get(m_fd);
+    if(ctx && !isClosed()) {
+        ctx->setTimeout(SO_RCVTIMEO, ms);
+    }
+}
+
+void TcpConnection::setWriteTimeout(uint64_t ms) {
+    m_writeTimeout = ms;
+    FdCtx* ctx = FdMgr::GetInstance()->get(m_fd);
+    if(ctx && !isClosed()) {
+        ctx->setTimeout(SO_SNDTIMEO, ms);
+    }
+}
+
+bool TcpConnection::isDraining() const {
+    return m_state->draining.load(std::memory_order_relaxed);
+}
+
+void TcpConnection::shutdownWrite() {
+    if(!isClosed()) {
+        shutdown(m_fd, SHUT_WR);
+    }
+}
+
+void TcpConnection::close() {
+    if(m_closed.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->conns.erase(m_id);
+    }
+    close_fd(m_state->iom, m_fd);
+    m_cancel->cancel();
+    m_state->active.fetch_sub(1, std::memory_order_relaxed);
+    m_state->closed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TcpServer::RunConnection(const std::shared_ptr<TcpServerState>& state, const TcpConnection::ptr& conn) {
+    // 处理函数里直接调用的 read/write/sleep 也挂起协程而不是阻塞线程
+    set_hook_enable(true);
+    // 只包住处理部分：下面的 flush 在连接被强制关闭时也要能照常结束
+    {
+        CancelScope scope(conn->getCancelContext());
+        if(state->handler) {
+            state->handler(conn);
+        } else {
+            ByteBuffer& input = conn->input();
+            while(true) {
+                conn->setIdle(input.empty());
+                // stop() 可能在上面的标记之前检查过这个连接，这里再看一次
+                if(input.empty() && state->draining.load(std::memory_order_acquire)) {
+                    break;
+                }
+                ssize_t n = conn->readInto(input, state->options.read_size);
+                conn->setIdle(false);
+                if(n <= 0 || !state->message_handler(conn, input)) {
+                    break;
+                }
+            }
+        }
+    }
+    // 输出队列里的数据发完再关闭
+    conn->flush();
+    conn->close();
+    state->running.done();
+}
+
+void TcpServer::OnAccept(const std::shared_ptr<TcpServerState>& state, int fd) {
+    const TcpServer::Options& opts = state->options;
+    uint64_t active = state->active.fetch_add(1, std::memory_order_relaxed);
+    if(state->draining.load(std::memory_order_acquire) || (opts.max_connections && active >= opts.max_connections)) {
+        state->active.fetch_sub(1, std::memory_order_relaxed);
+        state->rejected.fetch_add(1, std::memory_order_relaxed);
+        close_fd(state->iom, fd);
+        return;
+    }
+    if(!state->iom->admit(opts.admission_priority)) {
+        // 调度器过载：立即拒绝，比接下来排队到超时好
+        state->active.fetch_sub(1, std::memory_order_relaxed);
+        state->shed.fetch_add(1, std::memory_order_relaxed);
+        if(opts.on_shed) {
+            opts.on_shed(fd);
+        }
+        close_fd(state->iom, fd);
+        return;
+    }
+    state->accepted.fetch_add(1, std::memory_order_relaxed);
+    if(opts.tcp_nodelay) {
+        int yes = 1;
+        setsockopt_f(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    state->running.add();
+    TcpConnection::ptr conn = std::make_shared<TcpConnection>(state, fd,
+                                                              state->next_id.fetch_add(1, std::memory_order_relaxed));
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->conns[conn->id()] = conn.get();
+    }
+    if(opts.stack_flags != Fiber::STACK_DEFAULT) {
+        // 换一个指定栈的协程，留在当前线程上（接入方式把连接分给了这个线程）
+        state->iom->scheduleLock([state, conn]() {
+            RunConnection(state, conn);
+        }, Thread::GetThreadId(), opts.stack_flags);
+        return;
+    }
+    RunConnection(state, conn);
+}
+
+TcpServer::TcpServer(IOManager* iom, const Options& options)
+    :m_iom(iom ? iom: IOManager::GetThis())
+    ,m_state(std::make_shared<TcpServerState>()) {
+    assert(m_iom);
+    m_state->iom = m_iom;
+    m_state->options = options;
+}
+
+TcpServer::TcpServer(IOManager* iom)
+    :TcpServer(iom, Options()) {
+}
+
+TcpServer::~TcpServer() {
+    stop();
+}
+
+void TcpServer::setHandler(Handler handler) {
+    m_state->handler = std::move(handler);
+    m_state->message_handler = nullptr;
+}
+
+void TcpServer::setMessageHandler(MessageHandler handler) {
+    m_state->message_handler = std::move(handler);
+    m_state->handler = nullptr;
+}
+
+const TcpServer::Options& TcpServer::getOptions() const {
+    return m_state->options;
+}
+
+bool TcpServer::addListener(const std::string& ip, uint16_t port) {
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    sockaddr_in* sin = (sockaddr_in*)&addr;
+    sockaddr_in6* sin6 = (sockaddr_in6*)&addr;
+    if(inet_pton(AF_INET, ip.c_str(), &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        return addListener((const sockaddr*)sin, sizeof(*sin));
+    }
+    if(inet_pton(AF_INET6, ip.c_str(), &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        return addListener((const sockaddr*)sin6, sizeof(*sin6));
+    }
+    set_errno(EINVAL);
+    return false;
+}
+
+bool TcpServer::addListener(const sockaddr* addr, socklen_t addrlen) {
+    if(!addr || addrlen > sizeof(sockaddr_storage)) {
+        set_errno(EINVAL);
+        return false;
+    }
+    Listener l;
+    memcpy(&l.addr, addr, addrlen);
+    l.addrlen = addrlen;
+    l.acceptor = -1;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_running && !listen(l)) {
+        return false;
+    }
+    m_listeners.push_back(l);
+    return true;
+}
+
+bool TcpServer::listen(Listener& l) {
+    std::shared_ptr<TcpServerState> state = m_state;
+    const Options& opts = state->options;
+    l.acceptor = m_iom->addAcceptor((const sockaddr*)&l.addr, l.addrlen, [state](int fd) {
+        OnAccept(state, fd);
+    }, opts.accept_mode, opts.accept_batch, opts.backlog);
+    return l.acceptor >= 0;
+}
+
+bool TcpServer::start() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_running) {
+        return true;
+    }
+    if(!m_state->handler && !m_state->message_handler) {
+        set_errno(EINVAL);
+        return false;
+    }
+    // 对端已经关闭时 writev/write 产生的 SIGPIPE 会杀死进程；TcpConnection 的 send 带 MSG_NOSIGNAL，
+    // 但 ByteBuffer 和处理函数里的 write/writev 没有办法带
+    signal(SIGPIPE, SIG_IGN);
+    m_state->draining.store(false, std::memory_order_release);
+    for(size_t i = 0; i < m_listeners.size(); ++i) {
+        if(!listen(m_listeners[i])) {
+            for(size_t j = 0; j < i; ++j) {
+                m_iom->delAcceptor(m_listeners[j].acceptor);
+                m_listeners[j].acceptor = -1;
+            }
+            return false;
+        }
+    }
+    m_running = true;
+    return true;
+}
+
+void TcpServer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(!m_running) {
+            return;
+        }
+        m_running = false;
+        for(Listener& l: m_listeners) {
+            m_iom->delAcceptor(l.acceptor);
+            l.acceptor = -1;
+        }
+    }
+    std::shared_ptr<TcpServerState> state = m_state;
+    state->draining.store(true, std::memory_order_release);
+    // 在等下一个请求的连接直接关闭读方向，连接协程读到0后结束
+    state->shutdownConns(SHUT_RD);
+
+    TimerHandle timer;
+    if(state->running.getCount() && state->options.drain_timeout_ms != ~0ull) {
+        timer = m_iom->addPooledTimer(state->options.drain_timeout_ms, [state]() {
+            state->shutdownConns(SHUT_RDWR);
+        });
+    }
+    state->running.wait();
+    if(timer) {
+        m_iom->cancelTimer(timer);
+    }
+}
+
+bool TcpServer::getListenAddress(size_t index, sockaddr_storage& addr, socklen_t& addrlen) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(index >= m_listeners.size() || m_listeners[index].acceptor < 0) {
+        return false;
+    }
+    return m_iom->getAcceptorAddress(m_listeners[index].acceptor, addr, addrlen);
+}
+
+TcpServer::Stats TcpServer::getStats() const {
+    Stats stats;
+    stats.accepted = m_state->accepted.load(std::memory_order_relaxed);
+    stats.rejected = m_state->rejected.load(std::memory_order_relaxed);
+    stats.shed = m_state->shed.load(std::memory_order_relaxed);
+    stats.active = m_state->active.load(std::memory_order_relaxed);
+    stats.closed = m_state->closed.load(std::memory_order_relaxed);
+    stats.read_timeouts = m_state->read_timeouts.load(std::memory_order_relaxed);
+    stats.write_timeouts = m_state->write_timeouts.load(std::memory_order_relaxed);
+    return stats;
+}
+
+}
@@ -0,0 +1,271 @@
+#ifndef __SYLAR_TCP_SERVER_H__
+#define __SYLAR_TCP_SERVER_H__
+
+// 基于 IOManager 接入器（addAcceptor）的 TCP 服务器
+//
+// 示例程序各自写一遍 accept 循环、fcntl(O_NONBLOCK)、按fd addEvent 的处理函数，接入策略分散在各处。TcpServer 把这些收在一起：
+// - 可以监听多个地址（addListener），每个地址是一个接入器；接入方式（AcceptMode）、每批 accept 的连接数按服务器设置
+// - 每个连接一个协程。连接处理函数（Handler）用阻塞的写法读写；或者只给消息回调（MessageHandler），
+//   由服务器把数据读进连接的 ByteBuffer 后调用它
+// - 读写超时设置在连接的 FdCtx 上（FdCtx::setTimeout），TcpConnection 的读写和 hook 的 read/write 都按它超时
+// - stop() 先停止监听，再等已有的连接结束：空闲的连接（消息回调模式下没有未处理的数据，或处理函数用 setIdle 标记）直接关闭，
+//   其余的最多等 drain_timeout_ms，到时还没结束的连接被 shutdown，阻塞在读写上的协程随即返回
+// - 连接计数：接受、拒绝（超过上限或正在停止）、过载丢弃（见 Options::admission_priority）、当前、关闭、读写超时
+//
+//   sylar::TcpServer server(&iom);
+//   server.setHandler([](const sylar::TcpConnection::ptr& conn) {
+//       char buf[4096];
+//       ssize_t n;
+//       while((n = conn->read(buf, sizeof(buf))) > 0) {
+//           conn->write(buf, n);
+//       }
+//   });
+//   server.addListener("0.0.0.0", 8080);
+//   server.start();
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "byte_buffer.h"
+#include "cancel.h"
+#include "fiber_sync.h"
+#include "ioscheduler.h"
+
+namespace sylar {
+
+namespace detail {
+struct TcpServerState;
+}
+
+// 服务器接受的一个连接。连接协程结束（处理函数返回）时被关闭，之后读写返回 EBADF
+//
+// 除了同步的 write，还有一个输出队列（send）：
+// - 同一段执行（协程让出之前）里的多次 send 只追加到队列，由排在当前线程上的一个发送协程合并成一次 writev 发出
+// - 可以在合并发送时带 MSG_MORE，或者在一轮发送期间打开 TCP_CORK（CorkMode）
+// - 队列中的数据超过高水位时 send 挂起调用者，直到发送到低水位以下，慢的对端不会让内存无限增长
+// send 和 write 不要混用，write 不经过队列，可能排到队列中的数据前面
+class TcpConnection : public std::enable_shared_from_this<TcpConnection> {
+public:
+    typedef std::shared_ptr<TcpConnection> ptr;
+
+    TcpConnection(const std::shared_ptr<detail::TcpServerState>& state, int fd, uint64_t id);
+    ~TcpConnection();
+    TcpConnection(const TcpConnection&) = delete;
+    TcpConnection& operator=(const TcpConnection&) = delete;
+
+    int fd() const { return m_fd; }
+    // 服务器内唯一的连接编号
+    uint64_t id() const { return m_id; }
+    const sockaddr* peer() const { return (const sockaddr*)&m_peer; }
+    socklen_t peerLen() const { return m_peerLen; }
+    // "ip:port" 形式的对端地址
+    std::string peerString() const;
+
+    // 读一次，没有数据时挂起协程，最多等读超时。返回值同 recv，超时返回-1并设置 errno 为 ETIMEDOUT
+    ssize_t read(void* buf, size_t len);
+    // 用 readv 读一次，最多 max 字节，追加到 buf 后面。返回值同 read
+    ssize_t readInto(ByteBuffer& buf, size_t max = 64 * 1024);
+
+    // 写出全部 len 字节，发送缓冲区满时挂起协程，每次等待最多等写超时。返回 len，出错返回-1
+    ssize_t write(const void* buf, size_t len);
+    ssize_t write(const std::string& s) { return write(s.data(), s.size()); }
+    // 用 writev 写出 buf 的全部数据（不拼成连续内存），写出的从 buf 中丢掉。返回写出的字节数，出错返回-1
+    ssize_t write(ByteBuffer& buf);
+
+    // 放进输出队列，在当前协程让出后和同一段执行里的其他 send 一起发出。返回 len；
+    // 队列超过高水位时挂起直到降到低水位以下；之前的发送出过错时返回-1，errno 为那次的错误
+    ssize_t send(const void* buf, size_t len);
+    ssize_t send(const std::string& s) { return send(s.data(), s.size()); }
+    // 数据移进队列，buf 被清空
+    ssize_t send(ByteBuffer&& buf);
+    // 等输出队列全部发出，成功返回0，出错返回-1。连接协程结束时会先调用它再关闭连接
+    int flush();
+    // 输出队列中还没发出的字节数
+    size_t getPendingOutput() const { return m_outPending.load(std::memory_order_relaxed); }
+
+    // 消息回调模式下服务器读进来的数据，回调从前面 consume 已经处理的部分
+    ByteBuffer& input() { return m_input; }
+
+    void setReadTimeout(uint64_t ms);
+    void setWriteTimeout(uint64_t ms);
+    uint64_t getReadTimeout() const { return m_readTimeout; }
+    uint64_t getWriteTimeout() const { return m_writeTimeout; }
+
+    // 服务器正在停止：长连接处理完当前请求后应当结束
+    bool isDraining() const;
+    // 标记连接是否在等下一个请求（没有读了一半的请求）：服务器停止时空闲的连接直接关闭读方向，
+    // 阻塞在读上的协程读到0后结束。标记为空闲之后应当再检查一次 isDraining()
+    void setIdle(bool idle) { m_idle.store(idle, std::memory_order_release); }
+
+    // 连接的取消上下文：处理函数（和消息回调）在它之下运行，其中提交的回调任务也继承它。
+    // 连接关闭、或者 stop() 等到超时强制关闭连接时取消，请求派生出来的协程随之结束挂起的等待
+    const CancelContext::ptr& getCancelContext() const { return m_cancel; }
+
+    // 关闭写方向（发送 FIN），仍可以读
+    void shutdownWrite();
+    // 提前关闭连接；连接协程结束时也会调用
+    void close();
+    bool isClosed() const { return m_closed.load(std::memory_order_acquire); }
+
+    uint64_t getBytesRead() const { return m_bytesRead; }
+    uint64_t getBytesWritten() const { return m_bytesWritten; }
+
+private:
+    friend class TcpServer;
+    friend struct detail::TcpServerState;
+
+    // 发送协程：把输出队列中的数据分批发出，直到队列为空
+    void flushLoop();
+    // 发出 batch 的全部数据，返回0或错误码
+    int sendBatch(ByteBuffer& batch);
+
+    // 等 fd 上的 event 就绪，返回0或错误码（超时为 ETIMEDOUT）
+    int waitReady(IOManager::Event event, uint64_t timeout_ms);
+
+private:
+    std::shared_ptr<detail::TcpServerState> m_state;
+    int m_fd;
+    uint64_t m_id;
+    sockaddr_storage m_peer;
+    socklen_t m_peerLen = 0;
+    uint64_t m_readTimeout;
+    uint64_t m_writeTimeout;
+    std::atomic<bool> m_closed = {false};
+    CancelContext::ptr m_cancel;
+    // 正在等待下一个请求，stop() 时可以直接关闭
+    std::atomic<bool> m_idle = {false};
+    ByteBuffer m_input;
+    uint64_t m_bytesRead = 0;
+    uint64_t m_bytesWritten = 0;
+
+    // 输出队列，由 m_outMutex 保护
+    std::mutex m_outMutex;
+    ByteBuffer m_output;
+    // 队列中加上正在发送的字节数
+    std::atomic<size_t> m_outPending = {0};
+    // 发送协程已经安排或正在运行
+    bool m_flushing = false;
+    // 发送出错时的错误码，之后 send 都失败
+    int m_outError = 0;
+    // 等待队列降到低水位（或清空）的协程
+    detail::SyncWaitQueue m_outWaiters;
+};
+
+class TcpServer {
+public:
+    enum CorkMode {
+        CORK_NONE = 0,
+        // 发送协程发出一批时，如果队列里已经又有数据，带 MSG_MORE
+        CORK_MSG_MORE,
+        // 发送协程运行期间打开 TCP_CORK，队列清空时关闭（把不满一个报文段的尾巴发出去）。每轮多两次 setsockopt
+        CORK_TCP
+    };
+
+    // 连接处理函数，在连接自己的协程中执行，返回后连接被关闭
+    typedef std::function<void(const TcpConnection::ptr&)> Handler;
+    // 消息回调：每读到一次数据调用一次，input 中是还没处理的全部数据，处理完的部分由回调 consume。
+    // 返回false关闭连接；对端关闭、出错或读超时时也关闭
+    typedef std::function<bool(const TcpConnection::ptr&, ByteBuffer& input)> MessageHandler;
+
+    struct Options {
+        // 新连接分给工作线程的方式，见 IOManager::AcceptMode
+        IOManager::AcceptMode accept_mode = IOManager::ACCEPT_SHARED;
+        // 每次监听socket就绪最多 accept 的连接数
+        size_t accept_batch = 16;
+        int backlog = 1024;
+        // 读写超时，~0ull 表示不超时
+        uint64_t read_timeout_ms = ~0ull;
+        uint64_t write_timeout_ms = ~0ull;
+        // 同时存在的连接数上限，超过时新连接直接关闭；0 不限制
+        size_t max_connections = 0;
+        bool tcp_nodelay = true;
+        // stop() 等待已有连接结束的最长时间
+        uint64_t drain_timeout_ms = 5000;
+        // 连接协程使用的栈（Fiber::StackFlag）。不是默认值时连接在接受它的线程上换一个这种栈的协程运行
+        int stack_flags = Fiber::STACK_DEFAULT;
+        // 消息回调模式下每次最多读的字节数
+        size_t read_size = 64 * 1024;
+        // 输出队列的高低水位：超过高水位时 send 挂起，发送到低水位以下时恢复
+        size_t output_high_watermark = 1024 * 1024;
+        size_t output_low_watermark = 256 * 1024;
+        // 合并发送时的攒包方式
+        CorkMode cork = CORK_NONE;
+        // 新连接按哪个优先级经过 IOManager 的接纳控制（Scheduler::setAdmission），不接纳时立即关闭（计入 shed）
+        int admission_priority = Scheduler::PRIORITY_NORMAL;
+        // 因过载被拒绝的连接在关闭前交给它，例如写一个表示繁忙的响应；在接受连接的协程中调用，不应阻塞
+        std::function<void(int fd)> on_shed;
+    };
+
+    struct Stats {
+        uint64_t accepted = 0;
+        uint64_t rejected = 0;
+        // 调度器过载（接纳控制）而关闭的新连接，不计入 rejected
+        uint64_t shed = 0;
+        uint64_t active = 0;
+        uint64_t closed = 0;
+        uint64_t read_timeouts = 0;
+        uint64_t write_timeouts = 0;
+    };
+
+    // iom 为空时使用当前线程的 IOManager
+    TcpServer(IOManager* iom, const Options& options);
+    explicit TcpServer(IOManager* iom = nullptr);
+    // 调用 stop()
+    ~TcpServer();
+    TcpServer(const TcpServer&) = delete;
+    TcpServer& operator=(const TcpServer&) = delete;
+
+    // 两种处理方式二选一，start() 之前设置
+    void setHandler(Handler handler);
+    void setMessageHandler(MessageHandler handler);
+
+    // 增加一个监听地址，start() 之前或运行中都可以调用（运行中立即开始监听）。失败返回false
+    bool addListener(const sockaddr* addr, socklen_t addrlen);
+    // ip 为数字地址（IPv4 或 IPv6），port 为0时由内核分配
+    bool addListener(const std::string& ip, uint16_t port);
+
+    // 开始监听所有地址；任何一个失败时已经开始的也停止，返回false
+    bool start();
+    // 停止监听并等待已有连接结束（见文件开头）。在协程中调用时挂起协程，否则阻塞线程；不能在连接协程中调用
+    void stop();
+    bool isRunning() const { return m_running; }
+
+    // 第index个监听地址实际绑定的地址（端口为0时是内核分配的端口），未在监听时返回false
+    bool getListenAddress(size_t index, sockaddr_storage& addr, socklen_t& addrlen);
+
+    Stats getStats() const;
+    const Options& getOptions() const;
+
+private:
+    struct Listener {
+        sockaddr_storage addr;
+        socklen_t addrlen;
+        int acceptor;
+    };
+
+    // 为 l 注册接入器，失败返回false
+    bool listen(Listener& l);
+
+    // 接入器的回调，在接受连接的线程上的协程中执行
+    static void OnAccept(const std::shared_ptr<detail::TcpServerState>& state, int fd);
+    // 连接协程：运行处理函数（或消息循环），结束时关闭连接
+    static void RunConnection(const std::shared_ptr<detail::TcpServerState>& state, const TcpConnection::ptr& conn);
+
+private:
+    IOManager* m_iom;
+    std::shared_ptr<detail::TcpServerState> m_state;
+    // 保护 m_listeners 和 m_running
+    std::mutex m_mutex;
+    std::vector<Listener> m_listeners;
+    bool m_running = false;
+};
+
+}
+
+#endif
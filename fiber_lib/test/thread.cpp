@@ -1,7 +1,8 @@
 #include "thread.h"
+#include "log.h"
 
+#include <sched.h>
 #include <sys/syscall.h>
-#include <iostream>
 #include <unistd.h>
 
 namespace sylar {
@@ -37,6 +38,21 @@ void Thread::SetName(const std::string& name) {
     t_thread_name = name;
 }
 
+static void fill_cpu_set(const std::vector<int>& cpus, cpu_set_t& set) {
+    CPU_ZERO(&set);
+    for(int c: cpus) {
+        if(c >= 0 && c < CPU_SETSIZE) {
+            CPU_SET(c, &set);
+        }
+    }
+}
+
+int Thread::SetAffinity(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    fill_cpu_set(cpus, set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
 // pthread_create：这是一个 POSIX 线程（pthreads）库的函数，用于创建新的线程。
 // &m_thread：这是一个 pthread_t 类型的指针，表示新创建的线程 ID。
 // nullptr：是线程的属性，通常设置为 nullptr 使用默认线程属性。
@@ -46,7 +62,29 @@ Thread::Thread(std::function<void()> cb, const std::string& name) :
     m_cb(cb), m_name(name) {
         int rt = pthread_create(&m_thread, nullptr, &Thread::run, this);
         if(rt) {
-            std::cerr << "pthread_create thread fail, rt=" << rt << " name=" << name;
+            SYLAR_LOG_ERROR() << "pthread_create thread fail, rt=" << rt << " name=" << name;
+            throw std::logic_error("pthread_create error");
+        }
+        // 等待线程函数完成初始化
+        m_semaphore.wait();
+    }
+
+Thread::Thread(std::function<void()> cb, const std::string& name, const std::vector<int>& cpus) :
+    m_cb(cb), m_name(name), m_cpus(cpus) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(!m_cpus.empty()) {
+            cpu_set_t set;
+            fill_cpu_set(m_cpus, set);
+            int rt = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+            if(rt) {
+                SYLAR_LOG_WARN() << "pthread_attr_setaffinity_np fail, rt=" << rt << " name=" << name;
+            }
+        }
+        int rt = pthread_create(&m_thread, &attr, &Thread::run, this);
+        pthread_attr_destroy(&attr);
+        if(rt) {
+            SYLAR_LOG_ERROR() << "pthread_create thread fail, rt=" << rt << " name=" << name;
             throw std::logic_error("pthread_create error");
         }
         // 等待线程函数完成初始化
@@ -75,7 +113,7 @@ void Thread::join() {
         // pthread_join 返回值 rt 为 0 表示操作成功，其他非零值表示失败。
         int rt = pthread_join(m_thread, nullptr);
         if(rt) {
-            std::cerr << "pthread_join failed, rt = " << rt << ", name = " << m_name << std::endl;
+            SYLAR_LOG_ERROR() << "pthread_join failed, rt = " << rt << ", name = " << m_name;
             throw std::logic_error("pthread_join error");
         }
         // m_thread = 0 将线程 ID 重置为 0，表示当前线程已经结束，线程资源已经回收。
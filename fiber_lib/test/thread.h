@@ -4,9 +4,22 @@
 #include <mutex>
 #include <condition_variable>
 #include <functional>
+#include <sched.h>
 #include <string>
+#include <vector>
 
 namespace sylar {
+// 自旋等待时降低功耗，也让出流水线给同核的另一个超线程
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    sched_yield();
+#endif
+}
+
 // 用于线程方法间的同步
 class Semaphore {
 private:
@@ -57,6 +70,10 @@ public:
 class Thread {
 public:
     Thread(std::function<void()> cb, const std::string& name);
+
+    // 创建绑定到指定CPU集合上的线程，亲和性在线程开始运行前通过线程属性设置，
+    // 线程从第一条指令起就在这些CPU上执行，首次访问的内存（栈、线程缓存）也就分配在本地节点上。cpus为空时不绑定
+    Thread(std::function<void()> cb, const std::string& name, const std::vector<int>& cpus);
     
     ~Thread();
 
@@ -70,6 +87,11 @@ public:
         return m_name;
     }
 
+    // 线程绑定的CPU集合，为空表示未绑定
+    const std::vector<int>& getCpus() const {
+        return m_cpus;
+    }
+
     // 阻塞当前线程，直到与之相关联的线程执行完毕。通常在这个函数内部会调用 pthread_join() 来等待线程结束。
     void join();
 
@@ -86,6 +108,9 @@ public:
     // 设置当前线程的名字
     static void SetName(const std::string& name);
 
+    // 把当前线程绑定到指定的CPU集合上，成功返回0，失败返回错误码
+    static int SetAffinity(const std::vector<int>& cpus);
+
 private:
     // 线程函数
     static void* run(void* arg);
@@ -96,6 +121,7 @@ private:
     // 线程需要运行的函数
     std::function<void()> m_cb;
     std::string m_name;
+    std::vector<int> m_cpus;
 
     Semaphore m_semaphore;
 };
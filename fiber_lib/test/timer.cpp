@@ -1,4 +1,6 @@
 #include "timer.h"
+#include "probe.h"
+#include "trace.h"
 
 namespace sylar {
 
@@ -9,21 +11,21 @@ bool Timer::cancel() {
     // std::shared_mutex 支持两种锁模式：
     // 共享模式（读锁）：允许多个线程同时读（用shared_lock）。
     // 独占模式（写锁）：仅允许一个线程写，禁止其他线程读写（用unique_lock）
-    std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+    // 只锁定时器所在的分片，其他分片上的添加、到期检查不受影响
+    std::unique_lock<std::shared_mutex> write_lock(m_manager->mutexOf(*this));
 
-    if(m_cb == nullptr) {
-        // 若为 nullptr，表示已经被取消过了。
+    if(!hasCallback()) {
+        // 回调为空，表示已经被取消过了。
         return false;
     } else {
-        m_cb = nullptr;
+        clearCallback();
     }
 
     // 从管理器的定时器集合中移除
     // 首先调用 shared_from_this()，获得一个指向当前 Timer 对象的共享指针（shared_ptr<Timer>）。    
     // 然后调用 find()，在定时器集合 (set) 中寻找当前 Timer 对象 
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it != m_manager->m_timers.end()) {
-        m_manager->m_timers.erase(it);
+    if(m_manager->unlinkTimer(shared_from_this())) {
+        m_manager->updateCount(*this);
     }
     return true;
 }
@@ -32,27 +34,24 @@ bool Timer::cancel() {
 // 将当前定时器的下一次执行时间重置为当前时间+初始间隔。
 // 典型场景：用于定时任务需要重新计时（比如心跳检测）
 bool Timer::refresh() {
-    // 获取独占写锁，保护定时器管理器的集合（m_manager->m_timers）不被其他线程读写干扰。
-    std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+    // 获取独占写锁，保护定时器所在分片的集合不被其他线程读写干扰。
+    std::unique_lock<std::shared_mutex> write_lock(m_manager->mutexOf(*this));
 
     // 检查定时器是否有效（是否已被取消）
-    if(!m_cb) {
+    if(!hasCallback()) {
         // 若未找到，说明定时器已经不在集合中了（可能已执行完毕或已被取消），返回false。
         return false;
     }
 
-    // 查找自身在集合中的位置
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    // 先从集合中删除自身，便于后续重新插入到正确位置。
+    std::shared_ptr<Timer> self = shared_from_this();
+    if(!m_manager->unlinkTimer(self)) {
         return false;
     }
-
-    // 先从集合中删除自身，便于后续重新插入到正确位置。
-    m_manager->m_timers.erase(it);
     // 从当前时间点重新计时，下一次超时时间重设为当前时间加上间隔。
-    m_next = std::chrono::system_clock::now() + std::chrono::milliseconds(m_ms);
-    // 集合（std::set）是有序的，插入后自动按下次执行时间排序。
-    m_manager->m_timers.insert(shared_from_this());
+    m_next = std::chrono::steady_clock::now() + std::chrono::microseconds(m_us);
+    // 重新放入：集合按下次执行时间排序，时间轮按新的到期刻度选槽
+    m_manager->linkTimer(self);
     return true;
 }
 
@@ -62,30 +61,28 @@ bool Timer::refresh() {
 // 支持从当前时间开始计时或从原有的起始时间点开始计时。
 bool Timer::reset(uint64_t ms, bool from_now) {
     // 检查是否要重置
-    // 如果新传入的定时周期（ms）与现有周期（m_ms）完全相同，并且不需要从当前时间重新开始计时（即from_now为false）
-    if(ms == m_ms && !from_now) {
+    // 如果新传入的定时周期（ms）与现有周期（m_us）完全相同，并且不需要从当前时间重新开始计时（即from_now为false）
+    if(ms * 1000 == m_us && !from_now) {
         // 代表不需要重置
         return true;
     }
 
     //如果不满足上面的条件需要重置，删除当前的定时器然后重新计算超时时间并重新插入定时器
     {
-        std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+        std::unique_lock<std::shared_mutex> write_lock(m_manager->mutexOf(*this));
 
         // 检查当前定时器的回调函数m_cb是否为空：
         // 若为空，说明该定时器已失效或被取消，此时无法重置，返回false。
-        if(!m_cb) {
+        if(!hasCallback()) {
             return false;
         }
 
         // 否则就是定时器已经初始化了
         // 在集合中找到并删除自身（准备重新插入）
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if(it == m_manager->m_timers.end()) {
+        // 分片的计数不变：马上会重新插入，期间 hasTimer() 不应看到空
+        if(!m_manager->unlinkTimer(shared_from_this())) {
             return false;
         }
-
-        m_manager->m_timers.erase(it);
     }
 
     // reinsert
@@ -96,148 +93,779 @@ bool Timer::reset(uint64_t ms, bool from_now) {
     // 假设原计划12:00执行，间隔10分钟：
     // from_now==true，假设现在是11:55，则改为12:05执行。
     // from_now==false，则仍为12:00执行（可能提前或延迟，取决于新的ms）
-    auto start = from_now ? std::chrono::system_clock::now(): m_next - std::chrono::milliseconds(m_ms);
-    m_ms = ms;
-    m_next = start + std::chrono::milliseconds(m_ms);
+    auto start = from_now ? std::chrono::steady_clock::now(): m_next - std::chrono::microseconds(m_us);
+    m_us = ms * 1000;
+    m_next = start + std::chrono::microseconds(m_us);
 
     // insert with lock
     // 调用管理器提供的addTimer()方法重新插入当前定时器：
     // 该方法内部同样会加锁以确保安全性。
     // 插入后，定时器集合自动重新排序，以正确反映新的执行顺序
     // 锁在删除完定时器后就立刻释放，减少锁持有时间，避免插入操作期间过长持锁，提升并发性能。
-    // 再次插入时，由addTimer函数内部再单独加锁保护（粒度更细，性能更优）。
+    // 再次插入时，由addTimer函数内部再单独加锁保护（粒度更细，性能更优）。仍然放回原来的分片
     m_manager->addTimer(shared_from_this());
     return true;
 }
 
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager):
-    m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager) {
+Timer::Timer(uint64_t us, Callback cb, bool recurring, TimerManager* manager, int priority, uint64_t slack_us):
+    m_recurring(recurring), m_us(us), m_slackUs(slack_us), m_priority(priority), m_manager(manager) {
+        if(m_recurring) {
+            m_recurringCb = std::make_shared<Callback>(std::move(cb));
+        } else {
+            m_cb = std::move(cb);
+        }
         // 记录当前时间
-        auto now = std::chrono::system_clock::now();
+        auto now = std::chrono::steady_clock::now();
         // 下一次超时时间
-        m_next = now + std::chrono::milliseconds(m_ms);
+        m_next = now + std::chrono::microseconds(m_us);
     }
 
 bool Timer::Comparator::operator()(const std::shared_ptr<Timer>& lhs, const std::shared_ptr<Timer>& rhs) const {
     assert(lhs != nullptr && rhs != nullptr);
-    return lhs->m_next < rhs->m_next;
+    // 到期时间相同的定时器按地址区分：否则 set 会把它们当成同一个，插入时丢掉后来的，查找时取下别的定时器
+    auto l = lhs->latest();
+    auto r = rhs->latest();
+    if(l != r) {
+        return l < r;
+    }
+    return lhs.get() < rhs.get();
+}
+
+// TIMER_WHEEL 的毫秒刻度：到期时刻向上取整，当前时刻向下取整，保证不会早于 m_next 触发
+static uint64_t ToMs(const std::chrono::steady_clock::time_point& t) {
+    return std::chrono::ceil<std::chrono::milliseconds>(t.time_since_epoch()).count();
 }
 
-TimerManager::TimerManager() {
-    //初始化当前系统事件，为后续检查系统时间错误时进行校对。
-    m_previousTime = std::chrono::system_clock::now();
+static uint64_t NowMs(const std::chrono::steady_clock::time_point& t) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+// [lo, hi] 中末尾0最多的刻度：保留两者相同的高位，最高的不同位取1、以下清零。
+// 允许的范围越宽，选中的刻度越“整”，相近的定时器越容易落在同一个槽里一起到期
+static uint64_t AlignMs(uint64_t lo, uint64_t hi) {
+    if(lo >= hi) {
+        return lo;
+    }
+    int bit = 63 - __builtin_clzll(lo ^ hi);
+    return hi & ~((1ull << bit) - 1);
+}
+
+// 分层时间轮：第0层 256 个槽，每槽一毫秒；第1~4层各 64 个槽，每个槽覆盖下一层一整圈。
+// 定时器按离当前刻度的距离放进能容纳它的最低一层；当前刻度走到某层的边界时，把该层对应的槽取出重新放置（下放），
+// 最终落到第0层，刻度走到它的槽时到期。每个槽是 WheelHook（Timer 或池化节点）的侵入式双向链表，插入、取消都是 O(1)；
+// 位图记录非空的槽，用来跳过空槽和估算最近的到期时间。调用方持有所在分片的锁
+struct TimerManager::Wheel {
+    static constexpr int ROOT_BITS = 8;
+    static constexpr int LEVEL_BITS = 6;
+    static constexpr int LEVELS = 5;
+    static constexpr int ROOT_SIZE = 1 << ROOT_BITS;
+    static constexpr int LEVEL_SIZE = 1 << LEVEL_BITS;
+    static constexpr int SLOTS = ROOT_SIZE + (LEVELS - 1) * LEVEL_SIZE;
+    // 最高层一圈的长度（约 49 天），更远的定时器先放在最高层，下放时再按真实到期时间放置
+    static constexpr uint64_t SPAN = 1ull << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS);
+
+    WheelHook* heads[SLOTS] = {};
+    uint64_t bits[SLOTS / 64] = {};
+
+    // 下一个要处理的刻度，之前的刻度都已经处理过
+    uint64_t current = 0;
+    size_t count = 0;
+
+    // 最近一次 getNextTimer 估算的最早到期刻度（读锁下写入），新插入的更早时需要唤醒
+    std::atomic<uint64_t> hint{~0ull};
+
+    static int shiftOf(int level) {
+        return level ? ROOT_BITS + (level - 1) * LEVEL_BITS: 0;
+    }
+
+    static int baseOf(int level) {
+        return level ? ROOT_SIZE + (level - 1) * LEVEL_SIZE: 0;
+    }
+
+    static int sizeOf(int level) {
+        return level ? LEVEL_SIZE: ROOT_SIZE;
+    }
+
+    // 本层从 from 开始（循环）第一个非空槽的距离，没有返回-1。每层占整数个64位字
+    int firstSet(int level, int from) const {
+        int base = baseOf(level);
+        int size = sizeOf(level);
+        for(int d = 0; d < size;) {
+            int i = (from + d) & (size - 1);
+            int room = std::min(64 - (i & 63), size - i);
+            uint64_t word = bits[(base + i) >> 6] >> (i & 63);
+            if(room < 64) {
+                word &= (1ull << room) - 1;
+            }
+            if(word) {
+                return d + __builtin_ctzll(word);
+            }
+            d += room;
+        }
+        return -1;
+    }
+
+    void link(WheelHook* timer) {
+        uint64_t expire = std::max(timer->m_expireMs, current);
+        uint64_t delta = expire - current;
+        if(delta >= SPAN) {
+            expire = current + SPAN - 1;
+            delta = SPAN - 1;
+        }
+        int level = 0;
+        while(level < LEVELS - 1 && delta >= (1ull << shiftOf(level + 1))) {
+            ++level;
+        }
+        int slot = baseOf(level) + ((expire >> shiftOf(level)) & (sizeOf(level) - 1));
+        timer->m_wheelSlot = slot;
+        timer->m_wheelPrev = nullptr;
+        timer->m_wheelNext = heads[slot];
+        if(heads[slot]) {
+            heads[slot]->m_wheelPrev = timer;
+        }
+        heads[slot] = timer;
+        bits[slot >> 6] |= 1ull << (slot & 63);
+    }
+
+    void unlink(WheelHook* timer) {
+        int slot = timer->m_wheelSlot;
+        if(timer->m_wheelPrev) {
+            timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+        } else {
+            heads[slot] = timer->m_wheelNext;
+        }
+        if(timer->m_wheelNext) {
+            timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+        }
+        if(!heads[slot]) {
+            bits[slot >> 6] &= ~(1ull << (slot & 63));
+        }
+        timer->m_wheelSlot = -1;
+        timer->m_wheelPrev = timer->m_wheelNext = nullptr;
+    }
+
+    // 把槽整个取下，返回链表头
+    WheelHook* take(int slot) {
+        WheelHook* head = heads[slot];
+        heads[slot] = nullptr;
+        bits[slot >> 6] &= ~(1ull << (slot & 63));
+        return head;
+    }
+
+    // 槽里的定时器全部移出轮子交给 expired
+    void expire(int slot, std::vector<WheelHook*>& expired) {
+        for(WheelHook* t = take(slot); t;) {
+            WheelHook* next = t->m_wheelNext;
+            t->m_wheelSlot = -1;
+            t->m_wheelPrev = t->m_wheelNext = nullptr;
+            expired.push_back(t);
+            --count;
+            t = next;
+        }
+    }
+
+    // 刻度走到 level 层的边界：把对应的槽按真实到期时间重新放置
+    void cascade(int level) {
+        int slot = baseOf(level) + ((current >> shiftOf(level)) & (LEVEL_SIZE - 1));
+        for(WheelHook* t = take(slot); t;) {
+            WheelHook* next = t->m_wheelNext;
+            link(t);
+            t = next;
+        }
+    }
+
+    // 处理到 now 为止的所有刻度
+    void advance(uint64_t now, std::vector<WheelHook*>& expired) {
+        while(current <= now) {
+            if(!count) {
+                current = now + 1;
+                break;
+            }
+            int idx = current & (ROOT_SIZE - 1);
+            if(!idx) {
+                // 从高层往低层下放：高层下放的定时器可能落到低层正要下放的槽里
+                int level = 1;
+                while(level < LEVELS - 1 && !(current & ((1ull << shiftOf(level + 1)) - 1))) {
+                    ++level;
+                }
+                for(; level >= 1; --level) {
+                    cascade(level);
+                }
+            }
+            // 本圈剩下的毫秒槽都是空的：直接跳到下一个边界（或 now 之后）
+            int d = firstSet(0, idx);
+            if(d < 0 || d >= ROOT_SIZE - idx) {
+                current = std::min((current | (ROOT_SIZE - 1)) + 1, now + 1);
+                continue;
+            }
+            // 中间的空槽不用逐个走；下一个非空槽还没到时只走到 now 之后，之后插入的定时器仍按自己的刻度放置
+            if(current + d > now) {
+                current = now + 1;
+                break;
+            }
+            current += d;
+            expire(current & (ROOT_SIZE - 1), expired);
+            ++current;
+        }
+    }
+
+    // 全部取下（析构时）
+    void expireAll(std::vector<WheelHook*>& expired) {
+        for(int slot = 0; slot < SLOTS; ++slot) {
+            expire(slot, expired);
+        }
+    }
+
+    // 最早可能到期的刻度：第0层是准确的，高层取下放的时刻（下限）
+    uint64_t earliest() const {
+        if(!count) {
+            return ~0ull;
+        }
+        uint64_t best = ~0ull;
+        int d = firstSet(0, current & (ROOT_SIZE - 1));
+        if(d >= 0) {
+            best = current + d;
+        }
+        for(int level = 1; level < LEVELS; ++level) {
+            int shift = shiftOf(level);
+            // current 正好在本层的边界上时，它对应的槽还没有下放（要等处理 current 这一刻度时），从它开始找
+            uint64_t from = current >> shift;
+            if(current & ((1ull << shift) - 1)) {
+                ++from;
+            }
+            d = firstSet(level, from & (LEVEL_SIZE - 1));
+            if(d >= 0) {
+                best = std::min(best, (from + d) << shift);
+            }
+        }
+        return best;
+    }
+};
+
+// 当前线程缓存的时间，0 表示还没有更新过
+static thread_local std::chrono::steady_clock::time_point t_cachedNow;
+
+std::chrono::steady_clock::time_point TimerManager::CachedNow() {
+    if(t_cachedNow.time_since_epoch().count() == 0) {
+        return std::chrono::steady_clock::now();
+    }
+    return t_cachedNow;
+}
+
+std::chrono::steady_clock::time_point TimerManager::UpdateCachedNow() {
+    t_cachedNow = std::chrono::steady_clock::now();
+    return t_cachedNow;
+}
+
+// 池化定时器的节点：一次性定时器需要的全部状态，挂在分片的时间轮上。
+// 节点按块分配且从不释放，过期的句柄仍可以安全地读取 gen 并发现代数不符
+struct TimerNode: WheelHook {
+    TimerNode() {
+        m_pooled = true;
+    }
+
+    Callback cb;
+    // 到期时间点，用于统计延迟
+    std::chrono::steady_clock::time_point next;
+    int priority = -1;
+    // 每次回到池中加一，句柄据此判断节点是否还是自己那一次
+    std::atomic<uint32_t> gen{0};
+    // 空闲链表
+    TimerNode* nextFree = nullptr;
+};
+
+// 节点池：每个线程缓存一批空闲节点，取、还都不加锁；缓存满了或线程退出时还给全局链表
+static constexpr size_t NODE_CHUNK = 64;
+static constexpr size_t NODE_CACHE_MAX = 4 * NODE_CHUNK;
+
+struct NodePool {
+    std::mutex mutex;
+    TimerNode* free = nullptr;
+};
+
+// 线程退出时还会用到，不析构
+static NodePool& GlobalNodePool() {
+    static NodePool* s_pool = new NodePool();
+    return *s_pool;
+}
+
+struct NodeCache {
+    TimerNode* head = nullptr;
+    size_t size = 0;
+
+    // 取出 n 个节点串成的链，返回链尾
+    TimerNode* detach(size_t n, TimerNode*& first) {
+        first = head;
+        TimerNode* last = head;
+        for(size_t i = 1; i < n; ++i) {
+            last = last->nextFree;
+        }
+        head = last->nextFree;
+        last->nextFree = nullptr;
+        size -= n;
+        return last;
+    }
+
+    ~NodeCache() {
+        if(!head) {
+            return;
+        }
+        TimerNode* first = nullptr;
+        TimerNode* last = detach(size, first);
+        NodePool& pool = GlobalNodePool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        last->nextFree = pool.free;
+        pool.free = first;
+    }
+};
+
+static thread_local NodeCache t_nodeCache;
+
+static TimerNode* AcquireNode() {
+    NodeCache& cache = t_nodeCache;
+    if(!cache.head) {
+        // 先从全局链表取一批，没有再分配新的一块
+        NodePool& pool = GlobalNodePool();
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            while(pool.free && cache.size < NODE_CHUNK) {
+                TimerNode* node = pool.free;
+                pool.free = node->nextFree;
+                node->nextFree = cache.head;
+                cache.head = node;
+                ++cache.size;
+            }
+        }
+        if(!cache.head) {
+            TimerNode* chunk = new TimerNode[NODE_CHUNK];
+            for(size_t i = 0; i < NODE_CHUNK; ++i) {
+                chunk[i].nextFree = cache.head;
+                cache.head = &chunk[i];
+            }
+            cache.size = NODE_CHUNK;
+        }
+    }
+    TimerNode* node = cache.head;
+    cache.head = node->nextFree;
+    node->nextFree = nullptr;
+    --cache.size;
+    return node;
+}
+
+// 在节点所在分片的写锁下调用：代数加一之后旧句柄全部失效
+static void ReleaseNode(TimerNode* node) {
+    node->cb = nullptr;
+    node->gen.fetch_add(1, std::memory_order_relaxed);
+    NodeCache& cache = t_nodeCache;
+    node->nextFree = cache.head;
+    cache.head = node;
+    if(++cache.size > NODE_CACHE_MAX) {
+        // 一直在别的线程取、在这里还的节点会越积越多，多出的一半还给全局
+        TimerNode* first = nullptr;
+        TimerNode* last = cache.detach(NODE_CACHE_MAX / 2, first);
+        NodePool& pool = GlobalNodePool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        last->nextFree = pool.free;
+        pool.free = first;
+    }
+}
+
+// 一个分片：自己的读写锁、存储和统计。对齐到缓存行，相邻分片的锁和计数不会互相干扰
+struct alignas(64) TimerManager::Shard {
+    // 用于多线程下安全地访问定时器堆的读写锁。
+    std::shared_mutex mutex;
+
+    // 时间堆
+    // 基于红黑树的有序集合，定时任务按最近执行的顺序存储。
+    // 存储所有的 Timer 对象，并使用 Timer::Comparator 进行排序，确保最早超时的 Timer 在最前面。
+    std::set<std::shared_ptr<Timer>, Timer::Comparator> timers;
+
+    // TIMER_WHEEL 时存放 Timer；池化定时器的节点不论 Backend 都放在这里
+    std::unique_ptr<Wheel> wheel;
+
+    // 在下次getNextTime()执行前 onTimerInsertedAtFront()是否已经被触发了 -> 在此过程中 onTimerInsertedAtFront()只执行一次
+    // 标记在下次getNextTimer()执行前，onTimerInsertedAtFront()是否被触发过，以减少频繁通知。
+    // getNextTimer() 只持有读锁，因此是原子变量
+    std::atomic<bool> tickled{false};
+
+    // 存储中的定时器数，在写锁下更新，hasTimer() 不加锁读取
+    std::atomic<size_t> count{0};
+
+    // 统计，在写锁下更新
+    Counter addedLocal;
+    Counter addedRemote;
+    Counter fired;
+    Histogram lag;
+
+    size_t stored() const {
+        return timers.size() + wheel->count;
+    }
+
+    // 挂到时间轮上（m_expireMs 已经算好），返回是否早于上次估算的最近到期时间
+    bool link(WheelHook* hook) {
+        // 轮子空着时当前刻度可能已经落后很久，直接对齐到现在
+        if(!wheel->count) {
+            wheel->current = NowMs(std::chrono::steady_clock::now());
+        }
+        wheel->link(hook);
+        ++wheel->count;
+        if(hook->m_expireMs < wheel->hint.load(std::memory_order_relaxed)) {
+            wheel->hint.store(hook->m_expireMs, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void unlink(WheelHook* hook) {
+        wheel->unlink(hook);
+        --wheel->count;
+    }
+
+    // 取出到期的定时器：Timer 放进 expired，池化的节点放进 nodes
+    void popExpired(std::chrono::steady_clock::time_point now, std::vector<std::shared_ptr<Timer>>& expired,
+                    std::vector<TimerNode*>& nodes) {
+        if(wheel->count) {
+            std::vector<WheelHook*> hooks;
+            wheel->advance(NowMs(now), hooks);
+            for(WheelHook* hook: hooks) {
+                if(hook->m_pooled) {
+                    nodes.push_back(static_cast<TimerNode*>(hook));
+                } else {
+                    expired.push_back(std::move(static_cast<Timer*>(hook)->m_wheelSelf));
+                }
+            }
+        }
+        // 超时 -> 清理超时timer。集合按最晚触发时间排序：从头取出所有已经到期（m_next 已过）的，
+        // 下一个还没到期就停下。排在它后面、已经到期但允许延后的定时器留到下一次，仍不会晚于它们的最晚触发时间
+        while(!timers.empty() && (*timers.begin())->m_next <= now) {
+            expired.push_back(*timers.begin());
+            timers.erase(timers.begin());
+        }
+    }
+};
+
+TimerManager::TimerManager(Backend backend, size_t shards): m_backend(backend), m_shardCount(std::max<size_t>(shards, 1)) {
+    m_shards.reset(new Shard[m_shardCount]);
+    for(size_t i = 0; i < m_shardCount; ++i) {
+        m_shards[i].wheel.reset(new Wheel());
+        m_shards[i].wheel->current = NowMs(std::chrono::steady_clock::now());
+    }
 }
 
 TimerManager::~TimerManager() {
+    // 轮上的定时器各自持有自己，断开后随最后一个外部引用释放；池化的节点（连同没执行的回调）还回池中
+    for(size_t i = 0; i < m_shardCount; ++i) {
+        std::vector<WheelHook*> all;
+        m_shards[i].wheel->expireAll(all);
+        for(WheelHook* hook: all) {
+            if(hook->m_pooled) {
+                ReleaseNode(static_cast<TimerNode*>(hook));
+            } else {
+                static_cast<Timer*>(hook)->m_wheelSelf.reset();
+            }
+        }
+    }
+}
+
+std::shared_mutex& TimerManager::mutexOf(const Timer& timer) {
+    return m_shards[timer.m_shard].mutex;
+}
+
+bool TimerManager::linkTimer(const std::shared_ptr<Timer>& timer) {
+    Shard& shard = m_shards[timer->m_shard];
+    if(m_backend != TIMER_WHEEL) {
+        // 先插入再取 begin()：写在同一个表达式里时两边的求值顺序不确定，可能拿插入前的 begin() 比较
+        auto it = shard.timers.insert(timer).first;
+        return it == shard.timers.begin();
+    }
+    timer->m_expireMs = AlignMs(ToMs(timer->m_next), NowMs(timer->latest()));
+    timer->m_wheelSelf = timer;
+    return shard.link(timer.get());
+}
+
+bool TimerManager::unlinkTimer(const std::shared_ptr<Timer>& timer) {
+    Shard& shard = m_shards[timer->m_shard];
+    if(m_backend != TIMER_WHEEL) {
+        auto it = shard.timers.find(timer);
+        if(it == shard.timers.end()) {
+            return false;
+        }
+        shard.timers.erase(it);
+        return true;
+    }
+    if(timer->m_wheelSlot < 0) {
+        return false;
+    }
+    shard.unlink(timer.get());
+    timer->m_wheelSelf.reset();
+    return true;
+}
+
+void TimerManager::updateCount(const Timer& timer) {
+    Shard& shard = m_shards[timer.m_shard];
+    shard.count.store(shard.stored(), std::memory_order_release);
+}
+
+bool TimerManager::isTimerTickled(size_t shard) const {
+    return m_shards[shard % m_shardCount].tickled.load(std::memory_order_seq_cst);
+}
+
+bool TimerManager::hasTimer() const {
+    for(size_t i = 0; i < m_shardCount; ++i) {
+        if(m_shards[i].count.load(std::memory_order_acquire) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+TimerManager::ShardStats TimerManager::getShardStats(size_t shard) const {
+    ShardStats stats;
+    if(shard < m_shardCount) {
+        const Shard& s = m_shards[shard];
+        stats.pending = s.count.load(std::memory_order_relaxed);
+        stats.added_local = s.addedLocal.get();
+        stats.added_remote = s.addedRemote.get();
+        stats.fired = s.fired.get();
+    }
+    return stats;
+}
+
+uint64_t TimerManager::getTimersFired() const {
+    uint64_t n = 0;
+    for(size_t i = 0; i < m_shardCount; ++i) {
+        n += m_shards[i].fired.get();
+    }
+    return n;
+}
+
+HistogramSnapshot TimerManager::getTimerLag() const {
+    HistogramSnapshot snap = m_shards[0].lag.snapshot();
+    for(size_t i = 1; i < m_shardCount; ++i) {
+        snap.merge(m_shards[i].lag.snapshot());
+    }
+    return snap;
 }
 
 // 创建一个新的定时器（Timer）。
 // 并将其添加到TimerManager内部维护的定时器集合中
-std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
-    std::shared_ptr<Timer> timer(new Timer(ms, cb, recurring, this));
+std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, Callback cb, bool recurring, int priority, uint64_t slack_ms) {
+    return addTimerUs(ms * 1000, std::move(cb), recurring, priority, slack_ms * 1000);
+}
+
+std::shared_ptr<Timer> TimerManager::addTimerUs(uint64_t us, Callback cb, bool recurring, int priority,
+                                                uint64_t slack_us) {
+    std::shared_ptr<Timer> timer(new Timer(us, std::move(cb), recurring, this, priority, slack_us));
+    bool remote = false;
+    timer->m_shard = pickShard(remote);
     // 将创建好的定时器插入到管理器的集合中进行管理。
-    addTimer(timer);
+    insertTimer(timer, true, remote);
     return timer;
 }
 
-// 如果条件存在 -> 执行cb()
-// 在执行定时任务的回调函数 (cb) 之前，首先判断一个关联的条件对象 (weak_cond) 是否依然存在（还未被销毁）。
-// 只有当条件对象存在时，才执行回调函数。
-static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
-    //确保当前条件的的对象仍然存在
-    // std::weak_ptr不能直接访问对象，必须调用lock()方法将其转化为shared_ptr：
-    // 若对象还存在，lock()返回有效的shared_ptr，对象的引用计数+1，确保后续访问安全。
-    // 若对象已不存在（已经销毁），则lock()返回空指针。
-    std::shared_ptr<void> tmp = weak_cond.lock();
-    if(tmp) {
-        cb();
+size_t TimerManager::pickShard(bool& remote) {
+    // 多个分片时放进当前线程自己的分片；其他线程添加的轮流放，由各分片的所属线程到期派发
+    remote = false;
+    if(m_shardCount == 1) {
+        return 0;
     }
+    int local = localTimerShard();
+    remote = local < 0;
+    return remote ? m_nextShard.fetch_add(1, std::memory_order_relaxed) % m_shardCount: (size_t)local % m_shardCount;
 }
 
-// 防止回调函数访问已销毁的对象，避免内存错误和程序崩溃。
-// 使用weak_ptr不增加引用计数，仅用于安全检测对象存在性，而不会延迟对象的销毁。
-std::shared_ptr<Timer> TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring) {
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+TimerHandle TimerManager::addPooledTimer(uint64_t ms, Callback cb, int priority, uint64_t slack_ms) {
+    bool remote = false;
+    size_t index = pickShard(remote);
+    Shard& shard = m_shards[index];
+
+    TimerNode* node = AcquireNode();
+    node->cb = std::move(cb);
+    node->priority = priority;
+    node->next = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    node->m_expireMs = AlignMs(ToMs(node->next), NowMs(node->next + std::chrono::milliseconds(slack_ms)));
+
+    TimerHandle handle;
+    handle.m_node = node;
+    handle.m_gen = node->gen.load(std::memory_order_relaxed);
+    handle.m_shard = index;
+
+    // 与 insertTimer 相同：插到最前面且还没通知过时唤醒
+    bool at_front = false;
+    {
+        std::unique_lock<std::shared_mutex> write_lock(shard.mutex);
+        (remote ? shard.addedRemote: shard.addedLocal).add();
+        bool earliest = shard.link(node);
+        shard.count.store(shard.stored(), std::memory_order_release);
+        at_front = earliest && !shard.tickled.exchange(true, std::memory_order_seq_cst);
+    }
+    if(at_front) {
+        onTimerInsertedAtFront(index);
+    }
+    return handle;
+}
+
+bool TimerManager::cancelTimer(const TimerHandle& handle) {
+    if(!handle.m_node) {
+        return false;
+    }
+    TimerNode* node = handle.m_node;
+    Shard& shard = m_shards[handle.m_shard];
+    // 回调在锁外析构，它捕获的对象析构时可能再来操作定时器
+    Callback cb;
+    {
+        std::unique_lock<std::shared_mutex> write_lock(shard.mutex);
+        // 代数不符：已经触发或取消过，节点可能已经被别的定时器复用
+        if(node->gen.load(std::memory_order_relaxed) != handle.m_gen || node->m_wheelSlot < 0) {
+            return false;
+        }
+        shard.unlink(node);
+        shard.count.store(shard.stored(), std::memory_order_release);
+        cb = std::move(node->cb);
+        ReleaseNode(node);
+    }
+    return true;
 }
 
 // 检测定时器集合中最近（最早）的一个定时器距离当前时间还有多久会触发。
 // 返回距离下一次超时触发的时间（毫秒）。
-uint64_t TimerManager::getNextTimer() {
-    // 使用共享锁（读锁）保护对m_timers集合的安全访问：
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
+uint64_t TimerManager::getNextTimer(int shard) {
+    uint64_t us = getNextTimerUs(shard);
+    return us == ~0ull ? ~0ull: (us + 999) / 1000;
+}
+
+uint64_t TimerManager::getNextTimerUs(int shard) {
+    if(shard >= 0) {
+        return nextTimerUs(m_shards[shard % m_shardCount]);
+    }
+    uint64_t next = ~0ull;
+    for(size_t i = 0; i < m_shardCount; ++i) {
+        next = std::min(next, nextTimerUs(m_shards[i]));
+    }
+    return next;
+}
+
+uint64_t TimerManager::nextTimerUs(Shard& shard) {
+    // 使用共享锁（读锁）保护对分片中集合的安全访问：
+    std::shared_lock<std::shared_mutex> read_lock(shard.mutex);
 
-    // reset m_tickled
+    // reset tickled
     // 表示本次执行过getNextTimer()后，可以再次允许下一次插入定时器时重新设置该标志并进行唤醒通知。
     // 这样保证了每次调用getNextTimer()后，后续新插入最早定时器时可再次进行通知，避免通知遗漏。
     // 调用getNextTimer()意味着，事件循环（或线程）准备处理下一批定时器了。
     // 这次调用会计算距离下一个定时器触发的时间是多少
-    // 重新设置m_tickled = false表示：
+    // 重新设置tickled = false表示：
     // 允许再次进行下一次的唤醒通知
-    m_tickled = false;
+    shard.tickled.store(false, std::memory_order_relaxed);
 
-    if(m_timers.empty()) {
-        // 表示当前没有任何定时任务。
-        // 返回最大值
-        // 返回特殊值~0ull（即无符号64位整数最大值，0xffffffffffffffff），表示没有定时器等待触发，事件循环或线程可无限等待其他事件。
-        return ~0ull;
+    // 获取当前绝对系统时间点(now)。
+    auto now = std::chrono::steady_clock::now();
+
+    // 时间轮（TIMER_WHEEL 的 Timer 和池化定时器）上最近的到期刻度
+    uint64_t next = ~0ull;
+    uint64_t earliest = shard.wheel->earliest();
+    shard.wheel->hint.store(earliest, std::memory_order_relaxed);
+    if(earliest != ~0ull) {
+        uint64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+        next = earliest * 1000 > now_us ? earliest * 1000 - now_us: 0;
     }
 
-    // 获取当前绝对系统时间点(now)。
-    auto now = std::chrono::system_clock::now();
+    if(shard.timers.empty()) {
+        // 表示集合中没有定时任务。
+        // 都没有时返回特殊值~0ull（即无符号64位整数最大值，0xffffffffffffffff），表示没有定时器等待触发，事件循环或线程可无限等待其他事件。
+        return next;
+    }
 
     // 获取最小时间堆中的第一个超时定时器判断超时
     // 获取定时器集合中第一个定时器的下一次触发时间点(time)
-    auto time = (*m_timers.begin())->m_next;
+    // 最早的最晚触发时间：在它之前醒来的话，这个定时器可能已经到期，但没有必须触发的
+    auto time = (*shard.timers.begin())->latest();
 
     // 判断当前时间是否已经超过了下一个定时器的超时时间
     if(now >= time) {
         // 已经有timer超时
         return 0;
     } else {
-        //计算从当前时间到下一个定时器超时时间的时间差，结果是一个 std::chrono::milliseconds 对象。
+        //计算从当前时间到下一个定时器超时时间的时间差，结果是一个 std::chrono::microseconds 对象。
         // auto diff = time - now;  // diff类型为duration，但单位可能不明确
-        // 为了明确将差值表示为具体单位（如毫秒），必须使用duration_cast
-        // std::chrono::duration_cast<目标单位>(原始duration)
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(time - now);
+        // 为了明确将差值表示为具体单位（如微秒），必须使用 duration_cast / ceil
+        // 向上取整：按它等待不会在到期之前醒来、再空转一轮
+        auto duration = std::chrono::ceil<std::chrono::microseconds>(time - now);
 
-        //将时间差转换为毫秒，并返回这个值。
+        //将时间差转换为微秒，并返回这个值。
         // count()方法用于获取duration对象中的时间间隔具体数值（整数或浮点数）。
-        return static_cast<uint64_t>(duration.count());
+        return std::min(next, static_cast<uint64_t>(duration.count()));
     }
 }
 
 // 将所有已到期（超时）的定时器任务的回调函数提取出来，加入到cbs列表中等待执行。
-void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs) {
-    auto now = std::chrono::system_clock::now();
-
-    // 加写锁保护定时器集合m_timers，因为接下来要修改它（删除、重新插入）
-    std::unique_lock<std::shared_mutex> write_lock(m_mutex);
+void TimerManager::listExpiredCb(std::vector<Callback>& cbs, std::vector<int>* priorities, int shard) {
+    auto now = CachedNow();
+    if(shard >= 0) {
+        listExpired(m_shards[shard % m_shardCount], now, cbs, priorities);
+        return;
+    }
+    for(size_t i = 0; i < m_shardCount; ++i) {
+        listExpired(m_shards[i], now, cbs, priorities);
+    }
+}
 
-    // 检测系统时钟是否回退
-    bool rollover = detectClockRollover();
+void TimerManager::listExpired(Shard& shard, std::chrono::steady_clock::time_point now, std::vector<Callback>& cbs,
+                               std::vector<int>* priorities) {
+    // 没有定时器的分片不加锁
+    if(shard.count.load(std::memory_order_acquire) == 0) {
+        return;
+    }
 
-    // 回退 -> 清理所有timer || 超时 -> 清理超时timer
-    // 主体循环：清理超时定时器
-    while(!m_timers.empty() && rollover || !m_timers.empty() && (*m_timers.begin())->m_next <= now) {
-        std::shared_ptr<Timer> temp = *m_timers.begin();
-        m_timers.erase(m_timers.begin());
+    // 加写锁保护分片的定时器集合，因为接下来要修改它（删除、重新插入）
+    std::unique_lock<std::shared_mutex> write_lock(shard.mutex);
+
+    // 超时 -> 清理超时timer。单调时钟不会回退，不再需要检测系统时间回退后全部触发
+    std::vector<std::shared_ptr<Timer>> expired;
+    std::vector<TimerNode*> nodes;
+    shard.popExpired(now, expired, nodes);
+
+    // 池化定时器：回调移交出去，节点还回池中
+    for(TimerNode* node: nodes) {
+        shard.fired.add();
+        uint64_t lag = node->next < now
+            ? std::chrono::duration_cast<std::chrono::microseconds>(now - node->next).count(): 0;
+        shard.lag.record(lag);
+        SYLAR_TRACE(TRACE_TIMER_FIRE, 0, lag);
+        SYLAR_PROBE1(timer_fire, lag);
+        if(priorities) {
+            priorities->push_back(node->priority);
+        }
+        cbs.push_back(std::move(node->cb));
+        ReleaseNode(node);
+    }
 
-        cbs.push_back(temp->m_cb);
+    // 主体循环：派发超时定时器
+    for(std::shared_ptr<Timer>& temp: expired) {
+        shard.fired.add();
+        // 按毫秒取整判断到期，不会出现负值；保险起见仍然截到0
+        uint64_t lag = temp->m_next < now
+            ? std::chrono::duration_cast<std::chrono::microseconds>(now - temp->m_next).count(): 0;
+        shard.lag.record(lag);
+        SYLAR_TRACE(TRACE_TIMER_FIRE, 0, lag);
+        SYLAR_PROBE1(timer_fire, lag);
+        if(priorities) {
+            priorities->push_back(temp->m_priority);
+        }
 
         if(temp->m_recurring) {
+            // 派发一个引用共享回调的任务
+            std::shared_ptr<Callback> cb = temp->m_recurringCb;
+            cbs.push_back([cb]() { (*cb)(); });
             // 重新加入时间堆
-            temp->m_next = now + std::chrono::milliseconds(temp->m_ms);
-            m_timers.insert(temp);
+            temp->m_next = now + std::chrono::microseconds(temp->m_us);
+            linkTimer(temp);
         } else {
-            // 清理cb
-            temp->m_cb = nullptr;
+            // 回调直接移交出去，同时清理了cb
+            cbs.push_back(std::move(temp->m_cb));
         }
     }
-}
-
-bool TimerManager::hasTimer() {
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-    return !m_timers.empty();
+    shard.count.store(shard.stored(), std::memory_order_release);
 }
 
 // lock + tickle()
@@ -245,11 +873,19 @@ bool TimerManager::hasTimer() {
 // 插入后自动根据定时器的下一次执行时间排序。
 // 如果新插入的定时器位于最前面（即下一个即将触发的定时器），则需要进行通知（唤醒）操作。
 void TimerManager::addTimer(std::shared_ptr<Timer> timer) {
+    insertTimer(std::move(timer), false, false);
+}
+
+void TimerManager::insertTimer(std::shared_ptr<Timer> timer, bool fresh, bool remote) {
+    Shard& shard = m_shards[timer->m_shard];
     // 标识插入的是最早超时的定时器
     bool at_front = false;
     {
-        // 使用独占锁保护对定时器集合（m_timers）的操作，确保线程安全性。
-        std::unique_lock<std::shared_mutex> write_lock(m_mutex);
+        // 使用独占锁保护对分片中定时器集合的操作，确保线程安全性。
+        std::unique_lock<std::shared_mutex> write_lock(shard.mutex);
+        if(fresh) {
+            (remote ? shard.addedRemote: shard.addedLocal).add();
+        }
 
         // 将定时器插入集合，并记录是否位于最前面
         // 调用std::set容器的insert方法，向容器中插入timer。
@@ -258,18 +894,16 @@ void TimerManager::addTimer(std::shared_ptr<Timer> timer) {
         // std::pair<iterator, bool> insert(const value_type& value);
         // first: 指向被插入元素的迭代器
         // second: bool类型，插入是否成功，true表示成功，false表示集合中已存在该元素
-        //将定时器插入到 m_timers 集合中。由于 m_timers 是一个 std::set，插入时会自动按定时器的超时时间排序。
-        auto it = m_timers.insert(timer).first;
+        //将定时器插入到分片的集合中。由于集合是一个 std::set，插入时会自动按定时器的超时时间排序。
+        bool earliest = linkTimer(timer);
+        shard.count.store(shard.stored(), std::memory_order_release);
 
         // 如果插入位置位于集合开头，说明该定时器是下一个将触发的最早定时器。
-        // 并且此时还未通知过（m_tickled == false），那么需通知相关线程唤醒检查。
-        at_front = (it == m_timers.begin()) && !m_tickled;
-
+        // 并且此时还未通知过（tickled == false），那么需通知相关线程唤醒检查。
         // only tickle once till one thread wakes up and runs getNextTime()
         // //标识有一个新的最早定时器被插入了，防止重复唤醒。
-        if(at_front) {
-            m_tickled = true;
-        }
+        // 与 isTimerTickled 配对：等待方先标记自己在等待再检查它，插入方先置位再看是否需要唤醒，两边至少一边能看到
+        at_front = earliest && !shard.tickled.exchange(true, std::memory_order_seq_cst);
     }
 
     // 如果通知函数(onTimerInsertedAtFront)的执行较慢或有额外逻辑，放在锁内会增加锁的持有时间，降低并发性能。
@@ -278,23 +912,7 @@ void TimerManager::addTimer(std::shared_ptr<Timer> timer) {
         // wake up 
         // 虚函数具体执行在ioscheduler
         // 通知或唤醒可能正在睡眠或等待的线程，以便及时处理新的最早定时器
-        onTimerInsertedAtFront();
-    }
-}
-
-// 检测系统时间是否出现了“回滚”（Clock Rollover）现象。
-bool TimerManager::detectClockRollover() {
-    // 初始化一个布尔变量 rollover，默认表示系统时间未回退。
-    bool rollover = false;
-    auto now = std::chrono::system_clock::now();
-
-    // 60 * 60 * 1000 毫秒 = 1小时。
-    // 当前系统时间比上一轮时间小了超过 1 小时
-    // 如果满足这个条件，就说明发生了系统时钟异常回退（rollover），设置 rollover = true。
-    if(now < (m_previousTime - std::chrono::milliseconds(60 * 60 * 1000))) {
-        rollover = true;
+        onTimerInsertedAtFront(timer->m_shard);
     }
-    m_previousTime = now;
-    return rollover;
 }
 }
\ No newline at end of file
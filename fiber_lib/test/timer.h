@@ -13,14 +13,47 @@
 #include <functional>
 // 互斥锁
 #include <mutex>
+#include <chrono>
+
+#include "callback.h"
+#include "metrics.h"
 
 namespace sylar {
 
 // 定时器管理类
 class TimerManager;
 
+// 时间轮（TIMER_WHEEL）的侵入式挂钩：Timer 和池化定时器的节点都通过它挂在时间轮的槽上，只由 TimerManager 使用
+struct WheelHook {
+    // 到期时刻（毫秒刻度），所在的槽（-1表示不在轮上）和槽内的双向链表
+    uint64_t m_expireMs = 0;
+    int m_wheelSlot = -1;
+    WheelHook* m_wheelPrev = nullptr;
+    WheelHook* m_wheelNext = nullptr;
+    // 是池化定时器的节点（TimerNode）还是 Timer
+    bool m_pooled = false;
+};
+
+// 池化定时器的节点，定义在 timer.cpp
+struct TimerNode;
+
+// 池化定时器（TimerManager::addPooledTimer）的句柄：节点指针加上它的代数，可以随意复制。
+// 定时器触发或取消后节点回到池中、代数加一，之后用旧句柄取消会返回false
+class TimerHandle {
+    friend class TimerManager;
+public:
+    explicit operator bool() const {
+        return m_node != nullptr;
+    }
+
+private:
+    TimerNode* m_node = nullptr;
+    uint32_t m_gen = 0;
+    uint32_t m_shard = 0;
+};
+
 // 继承的public是用来返回智能指针timer的this值
-class Timer: public std::enable_shared_from_this<Timer> {
+class Timer: public std::enable_shared_from_this<Timer>, private WheelHook {
     // 设置成友元访问timerManager类的函数和成员变量
     friend class TimerManager;
 public:
@@ -38,7 +71,22 @@ public:
     bool reset(uint64_t ms, bool from_now);
 
 private:
-    Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
+    Timer(uint64_t us, Callback cb, bool recurring, TimerManager* manager, int priority, uint64_t slack_us);
+
+    // 最晚的触发时间：m_next 加上允许的延后
+    std::chrono::steady_clock::time_point latest() const {
+        return m_next + std::chrono::microseconds(m_slackUs);
+    }
+
+    // 是否还持有回调（未被取消、未执行完）
+    bool hasCallback() const {
+        return m_cb || m_recurringCb;
+    }
+
+    void clearCallback() {
+        m_cb = nullptr;
+        m_recurringCb.reset();
+    }
 
 private:
     // 是否循环
@@ -46,22 +94,39 @@ private:
     bool m_recurring = false;
 
     // 超时时间
-    // 超时周期（毫秒），表示任务的延迟间隔。
-    uint64_t m_ms = 0;
+    // 超时周期（微秒），表示任务的延迟间隔。
+    uint64_t m_us = 0;
 
     // 绝对超时时间, 即该定时器下一次触发的时间点。
-    // 下一次任务的绝对执行时间点（精确到系统时钟）。
-    std::chrono::time_point<std::chrono::system_clock> m_next;
+    // 下一次任务的绝对执行时间点（单调时钟，不受系统时间调整影响）。
+    std::chrono::steady_clock::time_point m_next;
+
+    // 允许延后触发的时间（微秒）：定时器可以在 [m_next, m_next + m_slackUs] 内任意时刻触发，
+    // 管理器借此把相近的到期合并到同一次唤醒里
+    uint64_t m_slackUs = 0;
 
-    // 超时时触发的回调函数
-    std::function<void()> m_cb;
+    // 超时时触发的回调函数（一次性定时器，到期时直接移交给调度器）
+    Callback m_cb;
+
+    // 循环定时器的回调：每次到期都要执行一次而 Callback 不能拷贝，
+    // 因此放在共享对象里，已派发还未执行的任务各自持有一份引用
+    std::shared_ptr<Callback> m_recurringCb;
+
+    // 到期后回调派发时使用的优先级，由使用者（IOManager）解释，-1表示默认
+    int m_priority = -1;
 
     // 管理此timer的管理器
     TimerManager* m_manager = nullptr;
 
+    // 所在的分片（TimerManager 只有一个分片时为0），创建后不变
+    size_t m_shard = 0;
+
+    // TIMER_WHEEL：挂在轮上（WheelHook）时由 m_wheelSelf 持有自己，取下时释放
+    std::shared_ptr<Timer> m_wheelSelf;
+
 private:
-    // 实现最小堆的比较函数，⽤于⽐较两个Timer对象，⽐较的依据是绝对超时时间。
-    // 提供给 std::set 用于排序定时器，保证堆顶永远是最近执行的任务。
+    // 实现最小堆的比较函数，⽤于⽐较两个Timer对象，⽐较的依据是最晚的触发时间（latest()）。
+    // 提供给 std::set 用于排序定时器，保证堆顶永远是最先必须执行的任务。
 
     // 重载operator()的结构体或类，我们通常称之为函数对象（Functor）。
     // 这种类的对象能够像函数一样被调用。
@@ -73,61 +138,162 @@ private:
 class TimerManager {
     friend class Timer;
 public:
-    TimerManager();
+    // 定时器的存储方式，只能在构造时指定。
+    // TIMER_SET 为按到期时间排序的红黑树，插入、取消 O(log n)；
+    // TIMER_WHEEL 为毫秒精度的分层时间轮（256 个毫秒槽，之上 4 层各 64 槽，约 49 天，更远的先放在最高层），
+    // 插入、取消 O(1)，到期时按层级逐级下放。定时器很多（例如每个进行中的IO一个超时）时使用
+    enum Backend {
+        TIMER_SET = 0,
+        TIMER_WHEEL
+    };
+
+    // shards 为分片数：每个分片有自己的锁和存储，IOManager 按工作线程分片，
+    // 各线程在自己的分片上添加、到期检查，互不争用；1 即所有线程共用一份
+    explicit TimerManager(Backend backend = TIMER_SET, size_t shards = 1);
     virtual ~TimerManager();
 
     // 添加timer
     // ms定时器执行间隔时间
     // cb定时器回调函数
     // recurring是否循环定时器
-    std::shared_ptr<Timer> addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+    // priority到期回调的调度优先级（IOManager 中为 Scheduler::Priority），-1表示默认
+    // slack_ms允许延后触发的时间：到期后最多再等 slack_ms 毫秒，和附近到期的定时器一起触发，减少唤醒次数。
+    // TIMER_SET 在最早的“最晚触发时间”醒来，一并取出所有已经到期的；TIMER_WHEEL 在允许的范围内选最对齐的一毫秒槽
+    std::shared_ptr<Timer> addTimer(uint64_t ms, Callback cb, bool recurring = false, int priority = -1,
+                                    uint64_t slack_ms = 0);
+
+    // 同 addTimer，间隔以微秒为单位。TIMER_SET 按微秒精度到期（IOManager 用 epoll_pwait2 / io_uring 的纳秒超时等待），
+    // TIMER_WHEEL 的槽是一毫秒，到期时间向上取整到毫秒
+    std::shared_ptr<Timer> addTimerUs(uint64_t us, Callback cb, bool recurring = false, int priority = -1,
+                                      uint64_t slack_us = 0);
+
+    // 池化的一次性定时器：节点从线程本地的池里取，挂在分片的时间轮上（不论 Backend，毫秒精度，到期向上取整），
+    // 不创建 Timer、没有 shared_ptr；取消（cancelTimer）是 O(1) 的链表摘除，不分配内存。
+    // 适合大量创建、多数会被取消的超时。参数同 addTimer
+    TimerHandle addPooledTimer(uint64_t ms, Callback cb, int priority = -1, uint64_t slack_ms = 0);
+
+    // 取消池化定时器，已经触发、取消过（或句柄为空）时返回false。任何线程都可以调用
+    bool cancelTimer(const TimerHandle& handle);
 
     // 添加条件timer
     // 添加条件定时器，只有当weak_cond 所引用的资源还存活时，才会执行回调函数。
-    std::shared_ptr<Timer> addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false);
+    // 条件对象与回调一起捕获在同一个lambda中，典型的捕获大小放得进 Callback 的内联缓冲区
+    template<class F>
+    std::shared_ptr<Timer> addConditionTimer(uint64_t ms, F cb, std::weak_ptr<void> weak_cond, bool recurring = false,
+                                             int priority = -1, uint64_t slack_ms = 0) {
+        return addTimer(ms, [weak_cond, cb = std::move(cb)]() mutable {
+            // 若对象已不存在（已经销毁），则lock()返回空指针，不执行回调
+            std::shared_ptr<void> tmp = weak_cond.lock();
+            if(tmp) {
+                cb();
+            }
+        }, recurring, priority, slack_ms);
+    }
 
     // 拿到堆中最近的超时时间
-    // 获取最近一个定时任务距离当前时间的间隔（毫秒）。
-    uint64_t getNextTimer();
+    // 获取最近一个定时任务距离当前时间的间隔（毫秒，向上取整，按它等待不会提前醒来）。有 slack 的定时器按最晚触发时间计算
+    // shard 为-1时取所有分片中最早的
+    uint64_t getNextTimer(int shard = -1);
+
+    // 同 getNextTimer，单位为微秒（向上取整）。没有定时器返回 ~0ull
+    uint64_t getNextTimerUs(int shard = -1);
 
     // 取出所有超时定时器的回调函数
-    // 列出所有超时（已到期）任务的回调，供外部执行。
-    void listExpiredCb(std::vector<std::function<void()>>& cbs);
+    // 列出所有超时（已到期）任务的回调，供外部执行。以当前线程缓存的时间（CachedNow）判断是否到期，
+    // priorities不为空时同时按顺序回写每个回调的优先级。shard 为-1时检查所有分片
+    void listExpiredCb(std::vector<Callback>& cbs, std::vector<int>* priorities = nullptr, int shard = -1);
+
+    // 当前线程缓存的时间（steady_clock，即 CLOCK_MONOTONIC，与 MonotonicNs 相同）。
+    // IOManager 的工作线程每次从 epoll/io_uring 等待返回时更新一次，本轮派发的回调和协程读取它不需要再取时间；
+    // 任务运行得越久它越旧，需要精确时间的地方仍应取当前时间。从未更新过的线程读到的是当前时间
+    static std::chrono::steady_clock::time_point CachedNow();
+
+    // 取当前时间并更新当前线程的缓存
+    static std::chrono::steady_clock::time_point UpdateCachedNow();
 
     // 堆中是否有timer
-    // 检测是否还有未执行的定时任务。
-    bool hasTimer();
+    // 检测是否还有未执行的定时任务。不加锁，空闲循环每次都会调用
+    bool hasTimer() const;
+
+    size_t getTimerShards() const {
+        return m_shardCount;
+    }
+
+    // 一个分片的统计
+    struct ShardStats {
+        // 还在等待的定时器数
+        size_t pending = 0;
+        // 在分片所属线程上添加的 / 由其他线程添加的
+        uint64_t added_local = 0;
+        uint64_t added_remote = 0;
+        // 到期派发的回调数
+        uint64_t fired = 0;
+    };
+
+    ShardStats getShardStats(size_t shard) const;
+
+    // 到期派发的定时器回调数（循环定时器每次到期都计一次），所有分片之和
+    uint64_t getTimersFired() const;
+
+    // 定时器实际被取出时相对到期时间的延迟（微秒），合并所有分片
+    HistogramSnapshot getTimerLag() const;
 
 protected:
     // 当一个最早的timer加入到堆中 -> 调用该函数
-    // 每次有更早的定时任务插入到堆顶时触发。
-    virtual void onTimerInsertedAtFront() {};
+    // 每次有更早的定时任务插入到堆顶时触发。shard 为它所在的分片
+    virtual void onTimerInsertedAtFront(size_t /*shard*/) {}
+
+    // 当前线程自己的分片，不属于任何分片时返回-1（新定时器轮流放进各个分片）。只有一个分片时不调用
+    virtual int localTimerShard() const {
+        return -1;
+    }
+
+    // 分片在上次 getNextTimer 之后是否插入过新的最早定时器（已经或正在调用 onTimerInsertedAtFront）
+    bool isTimerTickled(size_t shard) const;
 
     // 添加timer
     // 添加定时任务
     void addTimer(std::shared_ptr<Timer> timer);
 
 private:
-    // 当系统时间改变时 -> 调用该函数
-    // 检测系统时钟是否发生了回退，若发生，则重新调整定时器集合。
-    bool detectClockRollover();
+    // TIMER_WHEEL 的实现
+    struct Wheel;
 
-private:
-    // 用于多线程下安全地访问定时器堆的读写锁。
-    std::shared_mutex m_mutex;
+    // 一个分片：锁、存储和统计
+    struct Shard;
+
+    // 定时器所在分片的读写锁
+    std::shared_mutex& mutexOf(const Timer& timer);
+
+    // 以下调用方持有定时器所在分片的写锁
+    // 把定时器放入分片的存储中，返回它是否成了最早的一个
+    bool linkTimer(const std::shared_ptr<Timer>& timer);
+
+    // 从存储中取下定时器，不在其中返回false
+    bool unlinkTimer(const std::shared_ptr<Timer>& timer);
+
+    // 按存储中的定时器数更新分片的计数（hasTimer 不加锁读取）
+    void updateCount(const Timer& timer);
 
-    // 时间堆
-    // 基于红黑树的有序集合，定时任务按最近执行的顺序存储。
-    // 存储所有的 Timer 对象，并使用 Timer::Comparator 进行排序，确保最早超时的 Timer 在最前面。
-    std::set<std::shared_ptr<Timer>, Timer::Comparator> m_timers;
+    // addTimer 的实现：fresh 为新建的定时器（计入分片的统计），remote 为其他线程添加的
+    void insertTimer(std::shared_ptr<Timer> timer, bool fresh, bool remote);
+
+    // 新定时器放进哪个分片，remote 回写是否由不属于任何分片的线程添加
+    size_t pickShard(bool& remote);
+
+    uint64_t nextTimerUs(Shard& shard);
+
+    void listExpired(Shard& shard, std::chrono::steady_clock::time_point now, std::vector<Callback>& cbs,
+                     std::vector<int>* priorities);
+
+private:
+    Backend m_backend;
 
-    // 在下次getNextTime()执行前 onTimerInsertedAtFront()是否已经被触发了 -> 在此过程中 onTimerInsertedAtFront()只执行一次
-    // 标记在下次getNextTimer()执行前，onTimerInsertedAtFront()是否被触发过，以减少频繁通知。
-    // 上次检查系统时间是否回退的绝对时间
-    bool m_tickled = false;
+    std::unique_ptr<Shard[]> m_shards;
+    size_t m_shardCount = 1;
 
-    // 上次检查系统时间是否回退的绝对时间
-    std::chrono::time_point<std::chrono::system_clock> m_previousTime;
+    // 不属于任何分片的线程添加定时器时轮流选择分片
+    std::atomic<size_t> m_nextShard{0};
 };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include "trace.h"
+#include "metrics.h"
+#include "thread.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace sylar {
+
+namespace detail {
+std::atomic<bool> g_trace_enabled{false};
+}
+
+namespace {
+
+struct TraceRecord {
+    uint64_t ts;
+    uint64_t id;
+    uint64_t arg;
+    uint32_t type;
+    uint32_t pad;
+};
+
+// 一个线程的环形缓冲区，只由所属线程写入。线程退出后保留，导出时仍然包含它的事件
+struct TraceRing {
+    TraceRecord* events;
+    uint64_t mask;
+    // 下一个写入位置（只增不减），写完一个事件后 release 发布
+    std::atomic<uint64_t> head{0};
+    // Clear() 时的 head，之前的事件不再导出
+    std::atomic<uint64_t> start{0};
+    pid_t tid;
+    std::string name;
+};
+
+struct TraceState {
+    std::mutex mutex;
+    std::vector<TraceRing*> rings;
+    std::atomic<size_t> capacity{64 * 1024};
+    // Start() 时的时间戳和单调时钟，用于把时间戳换算成微秒
+    uint64_t ts0 = 0;
+    uint64_t ns0 = 0;
+};
+
+TraceState& State() {
+    static TraceState* s = new TraceState;
+    return *s;
+}
+
+thread_local TraceRing* t_ring = nullptr;
+
+inline uint64_t now_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return MonotonicNs();
+#endif
+}
+
+TraceRing* create_ring() {
+    TraceState& st = State();
+    size_t cap = 1;
+    while(cap < st.capacity.load(std::memory_order_relaxed)) {
+        cap <<= 1;
+    }
+    TraceRing* ring = new TraceRing;
+    ring->events = new TraceRecord[cap];
+    ring->mask = cap - 1;
+    ring->tid = Thread::GetThreadId();
+    ring->name = Thread::GetName();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    st.rings.push_back(ring);
+    return ring;
+}
+
+// 一个线程的事件快照
+struct RingSnapshot {
+    pid_t tid;
+    std::string name;
+    std::vector<TraceRecord> events;
+};
+
+void snapshot(TraceRing* ring, RingSnapshot& out) {
+    out.tid = ring->tid;
+    out.name = ring->name;
+    uint64_t cap = ring->mask + 1;
+    uint64_t hi = ring->head.load(std::memory_order_acquire);
+    uint64_t lo = std::max(ring->start.load(std::memory_order_relaxed), hi > cap ? hi - cap: 0);
+    std::vector<TraceRecord> copy(hi - lo);
+    for(uint64_t i = lo; i < hi; ++i) {
+        memcpy(&copy[i - lo], &ring->events[i & ring->mask], sizeof(TraceRecord));
+    }
+    // 拷贝期间所属线程可能继续写：head 之后正在写的那一个也算，覆盖到的部分丢掉
+    uint64_t now = ring->head.load(std::memory_order_acquire);
+    uint64_t valid = now + 1 > cap ? now + 1 - cap: 0;
+    size_t skip = valid > lo ? std::min<uint64_t>(valid - lo, copy.size()): 0;
+    out.events.assign(copy.begin() + skip, copy.end());
+}
+
+const char* event_name(uint64_t event) {
+    switch(event) {
+        case 0x1: return "read";
+        case 0x4: return "write";
+        default: return "other";
+    }
+}
+
+}
+
+void Tracer::Start(size_t capacity) {
+    TraceState& st = State();
+    st.capacity.store(std::max<size_t>(capacity, 16), std::memory_order_relaxed);
+    Clear();
+    st.ts0 = now_ticks();
+    st.ns0 = MonotonicNs();
+    detail::g_trace_enabled.store(true, std::memory_order_release);
+}
+
+void Tracer::Stop() {
+    detail::g_trace_enabled.store(false, std::memory_order_release);
+}
+
+void Tracer::Clear() {
+    TraceState& st = State();
+    std::lock_guard<std::mutex> lock(st.mutex);
+    for(TraceRing* ring: st.rings) {
+        ring->start.store(ring->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+
+void Tracer::Record(TraceEventType type, uint64_t id, uint64_t arg) {
+    TraceRing* ring = t_ring;
+    if(!ring) {
+        ring = t_ring = create_ring();
+    }
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    TraceRecord& r = ring->events[h & ring->mask];
+    r.ts = now_ticks();
+    r.id = id;
+    r.arg = arg;
+    r.type = type;
+    ring->head.store(h + 1, std::memory_order_release);
+}
+
+std::string Tracer::ChromeTraceJson() {
+    TraceState& st = State();
+    std::vector<RingSnapshot> snaps;
+    {
+        std::lock_guard<std::mutex> lock(st.mutex);
+        snaps.resize(st.rings.size());
+        for(size_t i = 0; i < st.rings.size(); ++i) {
+            snapshot(st.rings[i], snaps[i]);
+        }
+    }
+    // 时间戳到微秒的换算比例
+    uint64_t ts1 = now_ticks();
+    uint64_t ns1 = MonotonicNs();
+    double us_per_tick = ts1 > st.ts0 ? (double)(ns1 - st.ns0) / (ts1 - st.ts0) / 1000.0: 0.001;
+
+    int pid = getpid();
+    std::ostringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(3);
+    ss << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    auto begin = [&](const char* ph, const std::string& name, const char* cat, pid_t tid, double ts) {
+        ss << (first ? "": ",\n") << "{\"ph\":\"" << ph << "\",\"name\":\"" << name << "\",\"cat\":\"" << cat
+           << "\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"ts\":" << ts;
+        first = false;
+    };
+    for(const RingSnapshot& s: snaps) {
+        begin("M", "thread_name", "__metadata", s.tid, 0);
+        ss << ",\"args\":{\"name\":\"" << (s.name.empty() ? "thread": s.name) << "\"}}";
+        for(const TraceRecord& r: s.events) {
+            double ts = (double)(int64_t)(r.ts - st.ts0) * us_per_tick;
+            switch(r.type) {
+                case TRACE_FIBER_CREATE:
+                    begin("i", "create", "fiber", s.tid, ts);
+                    ss << ",\"s\":\"t\",\"args\":{\"fiber\":" << r.id << ",\"stack_flags\":" << r.arg << "}}";
+                    break;
+                case TRACE_FIBER_RESUME:
+                    begin("B", "fiber " + std::to_string(r.id), "fiber", s.tid, ts);
+                    ss << ",\"args\":{\"fiber\":" << r.id << "}}";
+                    break;
+                case TRACE_FIBER_YIELD:
+                case TRACE_FIBER_TERM:
+                    begin("E", "fiber " + std::to_string(r.id), "fiber", s.tid, ts);
+                    ss << ",\"args\":{\"end\":\"" << (r.type == TRACE_FIBER_TERM ? "term": "yield") << "\"}}";
+                    break;
+                case TRACE_TASK_ENQUEUE:
+                case TRACE_TASK_DEQUEUE: {
+                    bool enq = r.type == TRACE_TASK_ENQUEUE;
+                    begin("i", enq ? "enqueue": "dequeue", "task", s.tid, ts);
+                    ss << ",\"s\":\"t\",\"args\":{\"fiber\":" << r.id << ",\"priority\":" << r.arg << "}}";
+                    // 协程任务从入队到出队连一条流箭头
+                    if(r.id) {
+                        begin(enq ? "s": "f", "queued", "task", s.tid, ts);
+                        ss << ",\"id\":" << r.id << (enq ? "": ",\"bp\":\"e\"") << "}";
+                    }
+                    break;
+                }
+                case TRACE_EVENT_ADD:
+                case TRACE_EVENT_TRIGGER:
+                    begin("i", r.type == TRACE_EVENT_ADD ? "addEvent": "triggerEvent", "io", s.tid, ts);
+                    ss << ",\"s\":\"t\",\"args\":{\"fd\":" << r.id << ",\"event\":\"" << event_name(r.arg) << "\"}}";
+                    break;
+                case TRACE_TIMER_FIRE:
+                    begin("i", "timer", "timer", s.tid, ts);
+                    ss << ",\"s\":\"t\",\"args\":{\"lag_us\":" << r.arg << "}}";
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    ss << "\n]}\n";
+    return ss.str();
+}
+
+bool Tracer::WriteChromeTrace(const std::string& path) {
+    std::ofstream out(path, std::ios::trunc);
+    if(!out) {
+        return false;
+    }
+    out << ChromeTraceJson();
+    return (bool)out;
+}
+
+}
@@ -0,0 +1,86 @@
+#ifndef __SYLAR_TRACE_H__
+#define __SYLAR_TRACE_H__
+
+// 协程生命周期追踪，导出为 Chrome trace JSON（chrome://tracing 或 ui.perfetto.dev 打开）
+//
+// 延迟抖动时要分清一个协程是在排队、在等 epoll、被晚到的定时器耽误了，还是正在运行。打开追踪后记录：
+// - 协程创建、resume、yield、结束：导出为每个线程上的执行区间，区间名为协程id
+// - 任务入队、出队：协程任务（不是回调）从入队到出队连一条流箭头，能看出在队列里等了多久、被哪个线程取走
+// - addEvent/waitEvent 注册、事件触发（就绪或取消），定时器到期（带相对到期时间的延迟）
+//
+// 每个线程第一次记录时分配一个环形缓冲区，只由该线程写入，不加锁；写满后覆盖最旧的事件（飞行记录器）。
+// 时间戳在 x86-64 上直接读 TSC，导出时按 Start() 以来的 TSC 和单调时钟换算成微秒。
+// 关闭时每个记录点只是一次对全局标志的读和一个预测为不跳转的分支；
+// 编译时定义 SYLAR_TRACE_DISABLED 则记录点完全不生成代码
+//
+//   sylar::Tracer::Start();
+//   ...
+//   sylar::Tracer::Stop();
+//   sylar::Tracer::WriteChromeTrace("trace.json");
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace sylar {
+
+enum TraceEventType {
+    // id 为协程id，arg 为 Fiber::StackFlag
+    TRACE_FIBER_CREATE = 0,
+    // 以下三个 id 为协程id
+    TRACE_FIBER_RESUME,
+    TRACE_FIBER_YIELD,
+    TRACE_FIBER_TERM,
+    // id 为协程id（回调任务为0），arg 为优先级
+    TRACE_TASK_ENQUEUE,
+    TRACE_TASK_DEQUEUE,
+    // id 为fd，arg 为 IOManager::Event
+    TRACE_EVENT_ADD,
+    TRACE_EVENT_TRIGGER,
+    // arg 为相对到期时间的延迟（微秒）
+    TRACE_TIMER_FIRE,
+    TRACE_EVENT_TYPE_COUNT
+};
+
+namespace detail {
+// 追踪是否打开，记录点只读它
+extern std::atomic<bool> g_trace_enabled;
+}
+
+class Tracer {
+public:
+    // 开始记录。capacity 为每个线程缓冲区的事件数（向上取整到2的幂，每个事件32字节），
+    // 只对之后第一次记录的线程生效，已经分配的缓冲区保持原来的大小
+    static void Start(size_t capacity = 64 * 1024);
+    // 停止记录，已记录的事件保留到 Clear() 或下一次 Start()
+    static void Stop();
+
+    static bool IsEnabled() {
+        return detail::g_trace_enabled.load(std::memory_order_relaxed);
+    }
+
+    // 丢弃已记录的事件
+    static void Clear();
+
+    // 记录中也可以调用：其他线程正在覆盖的事件被丢掉，不会读到写了一半的事件。失败返回false
+    static bool WriteChromeTrace(const std::string& path);
+    static std::string ChromeTraceJson();
+
+    // 记录一个事件，应当通过 SYLAR_TRACE 调用
+    static void Record(TraceEventType type, uint64_t id, uint64_t arg);
+};
+
+}
+
+#ifdef SYLAR_TRACE_DISABLED
+#define SYLAR_TRACE(type, id, arg) do {} while(0)
+#else
+#define SYLAR_TRACE(type, id, arg) \
+    do { \
+        if(__builtin_expect(::sylar::detail::g_trace_enabled.load(std::memory_order_relaxed), 0)) { \
+            ::sylar::Tracer::Record((type), (id), (arg)); \
+        } \
+    } while(0)
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+#include "uring.h"
+#include "log.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <algorithm>
+
+namespace sylar {
+
+static int uring_setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+Uring::Uring(unsigned entries, unsigned cq_factor) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // 完成队列留足空间：就绪事件和完成的IO可能一次来很多
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * cq_factor;
+    m_fd = uring_setup(entries, &p);
+    if(m_fd < 0) {
+        SYLAR_LOG_ERROR() << "Uring::io_uring_setup failed: " << strerror(errno);
+        return;
+    }
+
+    m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cqRing = m_sqRing;
+    } else if(m_sqRing != MAP_FAILED) {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    }
+    m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    if(m_sqRing != MAP_FAILED && m_cqRing != MAP_FAILED) {
+        m_sqes = (io_uring_sqe*)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    }
+    if(m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED) {
+        SYLAR_LOG_ERROR() << "Uring::mmap failed: " << strerror(errno);
+        // 析构时只释放映射成功的部分
+        if(m_sqRing == MAP_FAILED) {
+            m_sqRing = nullptr;
+        }
+        if(m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+        }
+        if(m_sqes == MAP_FAILED) {
+            m_sqes = nullptr;
+        }
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+
+    char* sq = (char*)m_sqRing;
+    m_sqHead = (unsigned*)(sq + p.sq_off.head);
+    m_sqTail = (unsigned*)(sq + p.sq_off.tail);
+    m_sqArray = (unsigned*)(sq + p.sq_off.array);
+    m_sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    m_sqEntries = p.sq_entries;
+    m_localTail = *m_sqTail;
+
+    char* cq = (char*)m_cqRing;
+    m_cqHead = (unsigned*)(cq + p.cq_off.head);
+    m_cqTail = (unsigned*)(cq + p.cq_off.tail);
+    m_cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+}
+
+Uring::~Uring() {
+    if(m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if(m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if(m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool Uring::Supported() {
+    static int s_supported = -1;
+    if(s_supported < 0) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = uring_setup(2, &p);
+        // 被 seccomp 或 kernel.io_uring_disabled 禁用时 setup 失败
+        s_supported = fd >= 0 && (p.features & IORING_FEAT_EXT_ARG) && (p.features & IORING_FEAT_NODROP);
+        if(fd >= 0) {
+            close(fd);
+        }
+    }
+    return s_supported;
+}
+
+io_uring_sqe* Uring::getSqe() {
+    while(m_localTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+        // 提交队列满：先把已有的交给内核。完成队列溢出时内核可能暂时拒绝（EBUSY），让出CPU等所属线程收割
+        if(flush() < 0 && errno == EBUSY) {
+            sched_yield();
+        }
+    }
+    unsigned idx = m_localTail & m_sqMask;
+    m_sqArray[idx] = idx;
+    ++m_localTail;
+    return &m_sqes[idx];
+}
+
+int Uring::flush() {
+    unsigned n = m_unsubmitted;
+    if(!n) {
+        return 0;
+    }
+    int rt = enter(n, 0, 0, nullptr, 0);
+    if(rt > 0) {
+        m_unsubmitted -= std::min<unsigned>(rt, n);
+    }
+    return rt;
+}
+
+int Uring::enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int Uring::wait(int64_t timeout_us, const sigset_t* mask) {
+    unsigned n = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        n = m_unsubmitted;
+        m_unsubmitted = 0;
+    }
+
+    unsigned ready = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE) - *m_cqHead;
+    int rt = 0;
+    if(timeout_us == 0 || ready) {
+        if(n) {
+            rt = enter(n, 0, 0, nullptr, 0);
+        }
+    } else {
+        __kernel_timespec ts;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        if(timeout_us > 0) {
+            ts.tv_sec = timeout_us / 1000000;
+            ts.tv_nsec = (timeout_us % 1000000) * 1000L;
+            arg.ts = (uint64_t)&ts;
+        }
+        if(mask) {
+            arg.sigmask = (uint64_t)mask;
+            arg.sigmask_sz = _NSIG / 8;
+        }
+        rt = enter(n, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    // 超时不算错误。已经提交了提交项时内核返回提交数，不会返回 EINTR；出错时提交项留到下一次
+    if(rt < 0 && errno != ETIME) {
+        int err = errno;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_unsubmitted += n;
+        errno = err;
+        return -1;
+    }
+    return __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE) - *m_cqHead;
+}
+
+}
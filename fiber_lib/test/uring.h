@@ -0,0 +1,104 @@
+#ifndef __SYLAR_URING_H__
+#define __SYLAR_URING_H__
+
+// io_uring 的最小封装
+//
+// 不依赖 liburing：直接用 io_uring_setup / io_uring_enter 系统调用建立队列，mmap 提交队列（SQ）和完成队列（CQ）。
+// 一个 Uring 属于一个工作线程：只有它等待、收割完成事件；其他线程可以往里放提交项（持有内部的锁），
+// 需要立即生效时顺便提交。所属线程自己放入的提交项留到下一次等待时和等待合并成一次 io_uring_enter
+
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <mutex>
+#include <string.h>
+
+namespace sylar {
+
+class Uring {
+public:
+    // entries 为提交队列长度，完成队列是它的 cq_factor 倍
+    explicit Uring(unsigned entries = 256, unsigned cq_factor = 16);
+    ~Uring();
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    bool valid() const {
+        return m_fd >= 0;
+    }
+
+    // 内核是否支持本封装需要的功能（带超时和信号掩码的等待 IORING_FEAT_EXT_ARG，完成事件不丢 IORING_FEAT_NODROP）
+    static bool Supported();
+
+    // 取n个清零的提交项交给 fill 填写，now 为true时立即提交，否则留给所属线程的下一次 wait()
+    template<class F>
+    void submit(unsigned n, F fill, bool now) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        io_uring_sqe* sqes[4];
+        for(unsigned i = 0; i < n; ++i) {
+            sqes[i] = getSqe();
+            memset(sqes[i], 0, sizeof(io_uring_sqe));
+        }
+        fill(sqes);
+        __atomic_store_n(m_sqTail, m_localTail, __ATOMIC_RELEASE);
+        m_unsubmitted += n;
+        if(now) {
+            flush();
+        }
+    }
+
+    // 由所属线程调用：提交积攒的提交项，并在没有完成事件时最多等待 timeout_us 微秒（0 不等待，负数一直等）。
+    // mask 不为空时等待期间使用该信号掩码（同 epoll_pwait）。返回可以收割的完成事件数，出错返回-1并设置errno
+    int wait(int64_t timeout_us, const sigset_t* mask);
+
+    // 由所属线程调用：对每个完成事件调用 f(const io_uring_cqe&)，返回处理的个数
+    template<class F>
+    size_t reap(F f) {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        size_t n = 0;
+        for(; head != tail; ++head, ++n) {
+            f(m_cqes[head & m_cqMask]);
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+private:
+    // 调用方持有 m_mutex；提交队列满时先提交已有的提交项
+    io_uring_sqe* getSqe();
+
+    // 调用方持有 m_mutex
+    int flush();
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz);
+
+private:
+    int m_fd = -1;
+    std::mutex m_mutex;
+
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    // 以下在 m_mutex 下访问
+    unsigned m_localTail = 0;
+    unsigned m_unsubmitted = 0;
+
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+};
+
+}
+
+#endif